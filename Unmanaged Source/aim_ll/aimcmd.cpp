@@ -104,6 +104,15 @@ ImScsiSyntaxHelp()
         "aim_ll --rescan\n"
         "        Rescans SCSI bus on installed adapter.\n"
         "\n"
+        "Benchmark syntax:\n"
+        "aim_ll --benchmark devicenumber [seconds]\n"
+        "        Measures random 4 KB read performance of an existing virtual disk at\n"
+        "        queue depths from 1 to 64, for 5 seconds at each depth unless\n"
+        "        specified. Compare results for the same image with different numbers\n"
+        "        of worker threads, set with WorkerThreads value under the driver\n"
+        "        Parameters registry key, to see how well requests are served in\n"
+        "        parallel.\n"
+        "\n"
         "Manage virtual disks:\n"
         "aim_ll -a -t type [-n] [-o opt1[,opt2 ...]] [-f|-F file] [-s size] [-b offset]\n"
         "       [-S sectorsize] [-u devicenumber] [-m mountpoint]\n"
@@ -308,6 +317,12 @@ ImScsiSyntaxHelp()
         "        Use it *only* with special purpose drivers that can meet all neeed\n"
         "        requirements!\n"
         "\n"
+        "        Without this flag, the driver keeps several requests outstanding\n"
+        "        against an image file, sent from its worker threads where file systems\n"
+        "        can handle them. Number of outstanding requests is set with the\n"
+        "        AsyncQueueDepth value under the driver Parameters registry key, 16 by\n"
+        "        default and 0 to wait for each request to complete.\n"
+        "\n"
         "buf     Buffered I/O. Valid for file-type virtual disks. With this flag set,\n"
         "        driver opens image file in buffered I/O mode. This is usually less\n"
         "        efficient, but it could be required to for example mount an image file\n"
@@ -1472,6 +1487,12 @@ LPWSTR MountPoint)
             IMSCSI_DEVICE_TYPE_FD ? ", Floppy" : ", HDD",
             config->Flags & IMSCSI_IMAGE_MODIFIED ? ", Modified" : "");
 
+        // Drivers that do not report this leave it zero
+        if (config->WorkerThreads > 1)
+        {
+            printf("Worker threads: %u\n", config->WorkerThreads);
+        }
+
         flushall();
 
         // Now enumerate disk volumes
@@ -1848,6 +1869,12 @@ wmain(int argc, LPWSTR argv[])
         return wmainSetup(argc - 1, argv + 1);
     }
 
+    if ((argc >= 2) &&
+        (_wcsicmp(argv[1], L"--benchmark") == 0))
+    {
+        return wmainBenchmark(argc - 1, argv + 1);
+    }
+
     enum
     {
         OP_MODE_NONE,
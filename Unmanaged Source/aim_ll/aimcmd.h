@@ -25,3 +25,10 @@ ImScsiCliAssertNotNull(LPVOID Ptr);
 
 int
 wmainSetup(int, wchar_t **argv);
+
+int
+wmainBenchmark(int argc, wchar_t **argv);
+
+// Prints command line syntax and exits.
+void __declspec(noreturn)
+ImScsiSyntaxHelp();
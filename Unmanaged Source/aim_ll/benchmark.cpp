@@ -0,0 +1,305 @@
+/// benchmark.cpp
+/// Random read benchmark for virtual disks, for command line use. Measures
+/// 4 KB random read IOPS at increasing queue depths, which shows how well
+/// the worker threads of a virtual disk serve requests in parallel.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winioctl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "..\aimapi\winstrct.hpp"
+
+#include "..\phdskmnt\inc\ntumapi.h"
+#include "..\phdskmnt\inc\common.h"
+#include "..\aimapi\aimapi.h"
+
+#include "aimcmd.h"
+
+#include <imdisk.h>
+
+/// Highest queue depth in sweep, limited by WaitForMultipleObjects
+#define BENCHMARK_MAX_QUEUE_DEPTH   MAXIMUM_WAIT_OBJECTS
+
+/// Size of each read, unless sector size is larger
+#define BENCHMARK_BLOCK_SIZE        4096
+
+#define BENCHMARK_DEFAULT_SECONDS   5
+
+static ULONGLONG
+NextRandom(ULONGLONG *State)
+{
+    // xorshift64
+    *State ^= *State << 13;
+    *State ^= *State >> 7;
+    *State ^= *State << 17;
+    return *State;
+}
+
+static BOOL
+StartRandomRead(HANDLE Disk, LPOVERLAPPED Overlapped, LPVOID Buffer,
+    DWORD BlockSize, ULONGLONG NumberOfBlocks, ULONGLONG *RandomState)
+{
+    ULARGE_INTEGER offset;
+    offset.QuadPart = (NextRandom(RandomState) % NumberOfBlocks) * BlockSize;
+
+    Overlapped->Offset = offset.LowPart;
+    Overlapped->OffsetHigh = offset.HighPart;
+
+    if (!ReadFile(Disk, Buffer, BlockSize, NULL, Overlapped) &&
+        (GetLastError() != ERROR_IO_PENDING))
+    {
+        PrintLastError(L"Read error:");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+int
+wmainBenchmark(int argc, wchar_t **argv)
+{
+    if ((argc < 2) || (argc > 3))
+    {
+        ImScsiSyntaxHelp();
+    }
+
+    DEVICE_NUMBER device_number;
+    LPWSTR endptr;
+    device_number.LongNumber = wcstoul(argv[1], &endptr, 16);
+    if (*endptr != 0)
+    {
+        ImScsiSyntaxHelp();
+    }
+
+    DWORD seconds = BENCHMARK_DEFAULT_SECONDS;
+    if (argc > 2)
+    {
+        seconds = wcstoul(argv[2], &endptr, 0);
+        if ((*endptr != 0) || (seconds == 0))
+        {
+            ImScsiSyntaxHelp();
+        }
+    }
+
+    BYTE port_number;
+    HANDLE adapter = ImScsiOpenScsiAdapter(&port_number);
+
+    if (adapter == INVALID_HANDLE_VALUE)
+    {
+        PrintLastError(L"Error opening Arsenal Image Mounter adapter:");
+        return -1;
+    }
+
+    WHeapMem<IMSCSI_DEVICE_CONFIGURATION> config(
+        UNICODE_STRING_MAX_BYTES,
+        HEAP_GENERATE_EXCEPTIONS | HEAP_ZERO_MEMORY);
+
+    config->DeviceNumber = device_number;
+
+    BOOL result = ImScsiQueryDevice(adapter, config, (DWORD)config.GetSize());
+
+    CloseHandle(adapter);
+
+    if (!result)
+    {
+        PrintLastError(L"Error querying device:");
+        return -1;
+    }
+
+    DWORD disk_number;
+    HANDLE disk = ImScsiOpenDiskByDeviceNumber(device_number, port_number,
+        &disk_number);
+
+    if (disk == INVALID_HANDLE_VALUE)
+    {
+        PrintLastError(L"Error opening disk:");
+        return -1;
+    }
+
+    CloseHandle(disk);
+
+    WMem<WCHAR> dev_path(ImDiskAllocPrintF(L"\\\\?\\PhysicalDrive%1!u!",
+        disk_number));
+
+    if (!dev_path)
+    {
+        fputs("Memory allocation error.\n", stderr);
+        return -1;
+    }
+
+    // Unbuffered, so that reads are not served by file system cache
+    disk = CreateFile(dev_path, GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL);
+
+    if (disk == INVALID_HANDLE_VALUE)
+    {
+        PrintLastError(L"Error opening disk:");
+        return -1;
+    }
+
+    DWORD block_size = BENCHMARK_BLOCK_SIZE;
+    if (config->BytesPerSector > block_size)
+    {
+        block_size = config->BytesPerSector;
+    }
+
+    ULONGLONG number_of_blocks = config->DiskSize.QuadPart / block_size;
+
+    if (number_of_blocks == 0)
+    {
+        fputs("Disk is too small.\n", stderr);
+        CloseHandle(disk);
+        return -1;
+    }
+
+    PUCHAR buffers = (PUCHAR)VirtualAlloc(NULL,
+        (SIZE_T)block_size * BENCHMARK_MAX_QUEUE_DEPTH,
+        MEM_COMMIT, PAGE_READWRITE);
+
+    OVERLAPPED overlapped[BENCHMARK_MAX_QUEUE_DEPTH] = { 0 };
+    HANDLE events[BENCHMARK_MAX_QUEUE_DEPTH] = { 0 };
+
+    result = buffers != NULL;
+
+    for (int i = 0; result && (i < BENCHMARK_MAX_QUEUE_DEPTH); i++)
+    {
+        events[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
+        overlapped[i].hEvent = events[i];
+        result = events[i] != NULL;
+    }
+
+    if (!result)
+    {
+        PrintLastError(L"Error allocating resources:");
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    ULONGLONG random_state = GetTickCount() | 1;
+
+    if (result)
+    {
+        printf("Random %u byte reads from PhysicalDrive%u, %u worker thread(s), "
+            "%u seconds for each queue depth.\n"
+            "\n"
+            "Queue depth          IOPS          MB/s   Latency (us)\n",
+            block_size, disk_number,
+            config->WorkerThreads != 0 ? config->WorkerThreads : 1,
+            seconds);
+    }
+
+    for (int depth = 1;
+        result && (depth <= BENCHMARK_MAX_QUEUE_DEPTH);
+        depth <<= 1)
+    {
+        BOOL active[BENCHMARK_MAX_QUEUE_DEPTH] = { 0 };
+        ULONGLONG completed = 0;
+        LARGE_INTEGER start;
+        LARGE_INTEGER now;
+
+        QueryPerformanceCounter(&start);
+        now = start;
+
+        for (int i = 0; result && (i < depth); i++)
+        {
+            result = active[i] = StartRandomRead(disk, &overlapped[i],
+                buffers + (SIZE_T)i * block_size, block_size,
+                number_of_blocks, &random_state);
+        }
+
+        LONGLONG end = start.QuadPart + frequency.QuadPart * seconds;
+
+        // Each completed read is replaced by a new one until time is up
+        while (result && (now.QuadPart < end))
+        {
+            DWORD wait_result = WaitForMultipleObjects(depth, events, FALSE,
+                INFINITE);
+
+            if (wait_result >= WAIT_OBJECT_0 + depth)
+            {
+                PrintLastError(L"Error waiting for reads:");
+                result = FALSE;
+                break;
+            }
+
+            int i = wait_result - WAIT_OBJECT_0;
+            DWORD bytes;
+
+            active[i] = FALSE;
+
+            if (!GetOverlappedResult(disk, &overlapped[i], &bytes, FALSE))
+            {
+                PrintLastError(L"Read error:");
+                result = FALSE;
+                break;
+            }
+
+            completed++;
+
+            QueryPerformanceCounter(&now);
+
+            if (now.QuadPart < end)
+            {
+                result = active[i] = StartRandomRead(disk, &overlapped[i],
+                    buffers + (SIZE_T)i * block_size, block_size,
+                    number_of_blocks, &random_state);
+            }
+        }
+
+        // Reads still in progress use buffers and events
+        for (int i = 0; i < depth; i++)
+        {
+            DWORD bytes;
+
+            if (active[i])
+            {
+                GetOverlappedResult(disk, &overlapped[i], &bytes, TRUE);
+            }
+        }
+
+        if (!result)
+        {
+            break;
+        }
+
+        double elapsed = (double)(now.QuadPart - start.QuadPart) /
+            frequency.QuadPart;
+
+        printf("%11i %13.0f %13.1f %14.1f\n",
+            depth,
+            completed / elapsed,
+            completed * block_size / elapsed / (1 << 20),
+            elapsed * depth * 1000000 / completed);
+    }
+
+    CloseHandle(disk);
+
+    for (int i = 0; i < BENCHMARK_MAX_QUEUE_DEPTH; i++)
+    {
+        if (events[i] != NULL)
+        {
+            CloseHandle(events[i]);
+        }
+    }
+
+    if (buffers != NULL)
+    {
+        VirtualFree(buffers, 0, MEM_RELEASE);
+    }
+
+    return result ? 0 : -1;
+}
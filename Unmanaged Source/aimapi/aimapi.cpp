@@ -1942,6 +1942,32 @@ ImScsiExtendDevice(HWND hWnd,
     return TRUE;
 }
 
+AIMAPI_API BOOL
+WINAPI
+ImScsiQueryDeviceStatistics(HANDLE Adapter,
+    DEVICE_NUMBER DeviceNumber,
+    PIMSCSI_DEVICE_STATISTICS Statistics)
+{
+    DWORD dw;
+
+    SRB_IMSCSI_QUERY_STATISTICS query_data = { 0 };
+
+    query_data.DeviceNumber = DeviceNumber;
+
+    if (!ImScsiDeviceIoControl(Adapter,
+        SMP_IMSCSI_QUERY_STATISTICS,
+        &query_data.SrbIoControl,
+        sizeof(query_data),
+        0, &dw))
+    {
+        return FALSE;
+    }
+
+    *Statistics = query_data.Statistics;
+
+    return TRUE;
+}
+
 AIMAPI_API BOOL
 WINAPI
 ImScsiSaveRegistrySettings(PIMSCSI_DEVICE_CONFIGURATION Config)
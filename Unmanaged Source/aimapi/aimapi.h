@@ -280,6 +280,24 @@ extern "C" {
         IN DEVICE_NUMBER DeviceNumber,
         IN CONST PLARGE_INTEGER ExtendSize);
 
+    /**
+    This function retrieves performance counters for an existing virtual disk
+    device, such as number of requests and number of bytes copied between
+    intermediate buffers.
+
+    Adapter         Open handle to SCSI adapter.
+
+    DeviceNumber    Number of the device to query.
+
+    Statistics      A pointer to an IMSCSI_DEVICE_STATISTICS structure that
+    receives the counters.
+    */
+    AIMAPI_API BOOL
+        WINAPI
+        ImScsiQueryDeviceStatistics(IN HANDLE Adapter,
+        IN DEVICE_NUMBER DeviceNumber,
+        OUT PIMSCSI_DEVICE_STATISTICS Statistics);
+
     /**
     Adds registry settings for creating a virtual disk at system startup (or
     when driver is loaded).
@@ -31,26 +31,158 @@
 // up complete blocks as new blocks are allocated by small
 // write requests.
 //
-#define DIFF_BLOCK_BITS                         16
+// Block size is chosen for each protected volume when its diff device
+// is created, from a "<device path>:DiffBlockBits" registry value
+// next to the diff device path value, or the default below. It is
+// saved as DiffBlockBits in diff device VBR and existing diff devices
+// keep their block size.
+//
+#define DIFF_BLOCK_BITS_DEFAULT                 16
+#define DIFF_BLOCK_BITS_MIN                     12
+#define DIFF_BLOCK_BITS_MAX                     21
+
+#define DIFF_BLOCK_BITS_VALUE_SUFFIX            L":DiffBlockBits"
 
 //
-// Macros for easier block/offset calculation
+// Macros for easier block/offset calculation, for device extension x
 //
-#define DIFF_BLOCK_SIZE                         (1ULL << DIFF_BLOCK_BITS)
-#define DIFF_BLOCK_OFFSET_MASK                  (DIFF_BLOCK_SIZE - 1)
-#define DIFF_BLOCK_BASE_MASK                    (~(DIFF_BLOCK_SIZE - 1))
-#define DIFF_GET_BLOCK_NUMBER(a)                ((a) >> DIFF_BLOCK_BITS)
-#define DIFF_GET_NUMBER_OF_BLOCKS(a)            (((a) + DIFF_BLOCK_OFFSET_MASK) >> DIFF_BLOCK_BITS)
-#define DIFF_GET_BLOCK_OFFSET(a)                ((ULONG)((a) & DIFF_BLOCK_OFFSET_MASK))
-#define DIFF_GET_BLOCK_BASE_FROM_ABS_OFFSET(a)  ((a) & DIFF_BLOCK_BASE_MASK)
+#define DIFF_BLOCK_BITS(x)                      ((x)->Statistics.DiffDeviceVbr.Fields.Head.DiffBlockBits)
+#define DIFF_BLOCK_SIZE(x)                      (1UL << DIFF_BLOCK_BITS(x))
+#define DIFF_BLOCK_OFFSET_MASK(x)               ((ULONGLONG)DIFF_BLOCK_SIZE(x) - 1)
+#define DIFF_BLOCK_BASE_MASK(x)                 (~DIFF_BLOCK_OFFSET_MASK(x))
+#define DIFF_GET_BLOCK_NUMBER(x, a)             ((a) >> DIFF_BLOCK_BITS(x))
+#define DIFF_GET_NUMBER_OF_BLOCKS(x, a)         (((a) + DIFF_BLOCK_OFFSET_MASK(x)) >> DIFF_BLOCK_BITS(x))
+#define DIFF_GET_BLOCK_OFFSET(x, a)             ((ULONG)((a) & DIFF_BLOCK_OFFSET_MASK(x)))
+#define DIFF_GET_BLOCK_BASE_FROM_ABS_OFFSET(x, a) ((a) & DIFF_BLOCK_BASE_MASK(x))
 
 #define DIFF_BLOCK_UNALLOCATED                  (0x00000000UL)
 
+//
+// Allocation table value for a block claimed by a write request that is
+// writing it to a newly allocated diff block. Entry is set to the new diff
+// block when write completes, or back to DIFF_BLOCK_UNALLOCATED if it
+// fails. Until then, block is read from original device and other writes
+// to it wait for worker thread.
+//
+#define DIFF_BLOCK_CLAIMED                      (-1L)
+
 #define SECTOR_BITS                             9
 #define SECTOR_SIZE                             (1L << SECTOR_BITS)
 
 #define IDLE_TRIM_BLOCKS_INTERVAL               32
 
+//
+// Allocation table has one LONG entry for each allocation block at
+// protected volume, with diff device block number where it is stored, or
+// DIFF_BLOCK_UNALLOCATED. Entries are kept in leaves of one allocation
+// block each, 16384 entries with default block size. Leaves are only
+// allocated when a block within them is first written, so that memory
+// and diff device space used for the table follow the amount of data
+// written rather than size of protected volume.
+//
+#define DIFF_TABLE_LEAF_BITS(x)                 (DIFF_BLOCK_BITS(x) - 2)
+#define DIFF_TABLE_ENTRIES_PER_LEAF(x)          (1UL << DIFF_TABLE_LEAF_BITS(x))
+#define DIFF_TABLE_GET_LEAF(x, b)               ((ULONG)((b) >> DIFF_TABLE_LEAF_BITS(x)))
+#define DIFF_TABLE_GET_LEAF_ENTRY(x, b)         ((ULONG)(b) & (DIFF_TABLE_ENTRIES_PER_LEAF(x) - 1))
+#define DIFF_TABLE_GET_NUMBER_OF_LEAVES(x, n)   ((ULONG)(((n) + DIFF_TABLE_ENTRIES_PER_LEAF(x) - 1) >> DIFF_TABLE_LEAF_BITS(x)))
+
+//
+// Sector bitmap for an allocation block. A set bit means that the sector
+// has not been written to diff device since the block was allocated, so
+// it is still read from original device. Blocks allocated by complete
+// block writes, or filled up with data from original device, have no
+// bits set. Bitmaps are kept in chunks of one allocation block each, and
+// chunks where no bits are set need not be allocated. Bitmaps are
+// DIFF_SECTOR_BITMAP_SIZE bytes for each allocation block, at least one
+// ULONGLONG also for block sizes with fewer than 64 sectors. With default
+// block size, that is 16 bytes for each of 4096 blocks in a chunk.
+//
+#define DIFF_SECTORS_PER_BLOCK(x)               (DIFF_BLOCK_SIZE(x) >> SECTOR_BITS)
+
+typedef struct _DIFF_SECTOR_BITMAP
+{
+    ULONGLONG Bits[ANYSIZE_ARRAY];
+
+} DIFF_SECTOR_BITMAP, *PDIFF_SECTOR_BITMAP;
+
+#define DIFF_SECTOR_BITMAP_SIZE(x)              ((ULONG)((DIFF_SECTORS_PER_BLOCK(x) + 63) / 64 * sizeof(ULONGLONG)))
+#define DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(x)  (DIFF_BLOCK_SIZE(x) / DIFF_SECTOR_BITMAP_SIZE(x))
+
+//
+// Allocation table leaves and sector bitmap chunks changed since they
+// were last saved are marked with one bit each in dirty bitmaps, so that
+// only those are written when diff device header is saved. Worker thread
+// saves them at DIFF_HEADER_SAVE_INTERVAL, in 100 ns units, which is a
+// checkpoint for allocation journal, so that cleanup only needs to write
+// what changed since. Changed pages at adjacent diff blocks are written
+// together, up to DIFF_HEADER_WRITE_SIZE bytes per request.
+//
+#define DIFF_DIRTY_BITMAP_WORDS(n)              (((n) + 31) / 32)
+#define DIFF_HEADER_SAVE_INTERVAL               (30ULL * 10000000ULL)
+#define DIFF_HEADER_WRITE_SIZE                  (1UL << 20)
+
+//
+// Allocation journal at diff device is DIFF_JOURNAL_SIZE bytes, rounded
+// up to whole allocation blocks. Changes to allocation table and sector
+// bitmaps are kept in memory as journal entries, up to
+// DIFF_JOURNAL_ENTRIES of them, and written as journal records together
+// when a flush request is processed. If more entries are added before
+// that, or journal is more than half full, header is saved instead.
+//
+#define DIFF_JOURNAL_SIZE                       (1UL << 20)
+#define DIFF_JOURNAL_ENTRIES                    4096UL
+#define DIFF_JOURNAL_RECORDS                    ((DIFF_JOURNAL_ENTRIES + AIMWRFLTR_JOURNAL_RECORD_ENTRIES - 1) / AIMWRFLTR_JOURNAL_RECORD_ENTRIES)
+
+//
+// Deferred write requests that do not overlap are processed together
+// by worker thread, up to this number of requests at a time.
+//
+#define DEFERRED_WRITE_BATCH_SIZE               8
+
+//
+// Maximum number of allocation blocks with writes to diff device in
+// flight at the same time, and how many of them can be new blocks that
+// need fill reads from original device. Each of the latter needs a
+// block sized buffer in worker thread, so their number also depends on
+// block size, but is always at least one.
+//
+#define DEFERRED_WRITE_BLOCKS_IN_FLIGHT         32UL
+#define DEFERRED_FILL_BYTES_IN_FLIGHT           (512UL << 10)
+#define DEFERRED_FILL_BLOCKS_IN_FLIGHT(x)       max(1UL, min(DEFERRED_WRITE_BLOCKS_IN_FLIGHT, \
+                                                    DEFERRED_FILL_BYTES_IN_FLIGHT >> DIFF_BLOCK_BITS(x)))
+
+//
+// Maximum number of lower level requests a read request is split into
+// when sent from dispatch routine. Reads from diff device and original
+// device that continue where previous one ended are merged into one
+// request, also across block boundaries. Read requests that need more
+// are processed by worker thread, with at most this number of lower
+// level requests in flight at a time.
+//
+#define READ_EXTENTS_IN_FLIGHT                  16UL
+
+//
+// Worker thread buffer for lower level trim requests. At least 64 KB, so
+// that small block sizes do not limit number of ranges in trim requests.
+//
+#define DEFERRED_BLOCK_BUFFER_SIZE(x)           max(DIFF_BLOCK_SIZE(x), 64UL << 10)
+
+//
+// Worker thread compacts diff device when no read or write requests have
+// been received for COMPACT_IDLE_INTERVAL, in 100 ns units. Each step
+// looks at up to COMPACT_SCAN_BLOCKS allocation table entries and moves
+// up to COMPACT_MOVES_PER_STEP diff blocks, so that worker thread soon
+// gets back to requests. Diff blocks that blocks were moved from are
+// reused once header has been saved, after at most
+// COMPACT_PENDING_BLOCKS moves. Blocks being moved wait up to
+// COMPACT_DRAIN_WAIT_MS for direct reads and writes already sent.
+//
+#define COMPACT_IDLE_INTERVAL                   (2ULL * 10000000ULL)
+#define COMPACT_SCAN_BLOCKS                     4096UL
+#define COMPACT_MOVES_PER_STEP                  16UL
+#define COMPACT_PENDING_BLOCKS                  1024UL
+#define COMPACT_DRAIN_WAIT_MS                   100UL
+
 #define ACCESS_FROM_CTL_CODE(ctrlCode)          ((UCHAR)((ctrlCode >> 14) & 0x03))
 
 #ifndef _countof
@@ -284,9 +416,155 @@ typedef struct _DEVICE_EXTENSION
     AIMWRFLTR_DEVICE_STATISTICS Statistics;
 
     //
-    // Pointer to diff block allocation table
+    // Allocation table leaves, see DIFF_TABLE_ENTRIES_PER_LEAF. NULL
+    // entries for leaves where no block has been written yet.
+    //
+    LONG volatile * volatile * AllocationTable;
+
+    //
+    // Diff device block where each allocation table leaf is saved, or
+    // DIFF_BLOCK_UNALLOCATED. This is the allocation table directory
+    // saved at OffsetToAllocationTable.
+    //
+    PLONG AllocationTableLeafBlocks;
+
+    //
+    // Number of allocation table leaves.
     //
-    LONG volatile * AllocationTable;
+    ULONG AllocationTableLeaves;
+
+    //
+    // Dirty bitmap with one bit for each allocation table leaf changed
+    // since it was last saved.
+    //
+    LONG volatile * AllocationTableDirty;
+
+    //
+    // Set when a diff device with a flat allocation table, from version
+    // 2.0 or earlier, is opened. Table is converted to leaves when loaded.
+    //
+    bool MigrateAllocationTable;
+
+    //
+    // Set when a DIFF_BLOCK_CLAIMED entry in allocation table is resolved.
+    // Worker thread waits for this when a block it needs is claimed.
+    //
+    KEVENT BlockClaimEvent;
+
+    //
+    // Sector bitmap chunks of one allocation block each, for
+    // DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK allocation blocks. NULL entries
+    // for chunks where all allocated blocks are complete at diff device.
+    //
+    PDIFF_SECTOR_BITMAP volatile * SectorBitmap;
+
+    //
+    // Diff device block where each sector bitmap chunk is saved, or
+    // DIFF_BLOCK_UNALLOCATED. This is the sector bitmap directory saved
+    // at OffsetToSectorBitmap.
+    //
+    PLONG SectorBitmapBlocks;
+
+    //
+    // Number of sector bitmap chunks.
+    //
+    ULONG SectorBitmapChunks;
+
+    //
+    // Dirty bitmap with one bit for each sector bitmap chunk changed
+    // since it was last saved.
+    //
+    LONG volatile * SectorBitmapDirty;
+
+    //
+    // Journal entries for changes to allocation table and sector bitmaps
+    // since journal records were last written. Entries are added after
+    // changes are made, so that a header save that discards entries
+    // waiting here includes their changes. Protected by JournalLock. NULL
+    // if journal is not loaded.
+    //
+    PAIMWRFLTR_JOURNAL_ENTRY JournalEntries;
+
+    ULONG JournalEntryCount;
+
+    //
+    // Set when entries did not fit in JournalEntries, or could not be
+    // written. Next flush request then saves header instead of writing
+    // journal records.
+    //
+    bool JournalOverflow;
+
+    KSPIN_LOCK JournalLock;
+
+    //
+    // Sequence number for next journal record. Only used by worker
+    // thread.
+    //
+    ULONGLONG JournalSequence;
+
+    //
+    // Worker thread buffers for entries being written and journal
+    // records built from them.
+    //
+    PAIMWRFLTR_JOURNAL_ENTRY JournalCommitEntries;
+
+    PAIMWRFLTR_JOURNAL_RECORD JournalRecords;
+
+    //
+    // Free diff blocks up to LastAllocatedBlock, with one bit set for each
+    // block that can be allocated again, such as blocks that compaction
+    // has moved data away from or that have been trimmed. Built when diff device is opened, from
+    // blocks not referenced by allocation table, directories or journal.
+    // Protected by FreeBlockLock. Number of set bits is FreeDiffBlocks in
+    // statistics, which allocations check without lock. Buffer is NULL if
+    // free block map could not be built.
+    //
+    RTL_BITMAP FreeBlockMap;
+
+    KSPIN_LOCK FreeBlockLock;
+
+    //
+    // Lowest block that can be free in FreeBlockMap, where searches for
+    // free blocks start.
+    //
+    ULONG FreeBlockHint;
+
+    //
+    // Diff blocks that data, allocation table leaves or sector bitmap
+    // chunks have been moved away from, or that trim requests have freed,
+    // but that allocation table and directories saved at diff device can
+    // still refer to. They are added
+    // to FreeBlockMap after header has been saved and diff device flushed.
+    // Only used by worker thread.
+    //
+    PLONG PendingFreeBlocks;
+
+    ULONG PendingFreeCount;
+
+    //
+    // Set while worker thread moves a block at diff device. Direct reads
+    // and writes are then sent to worker thread instead. DirectIoCount is
+    // number of direct reads and writes in flight, so that worker thread
+    // can wait for those that were sent before it set RelocationActive.
+    //
+    LONG volatile RelocationActive;
+
+    LONG volatile DirectIoCount;
+
+    //
+    // Blocks moved and fragments found so far in current compaction pass,
+    // and fragments found in previous pass. Compaction stops after a pass
+    // where nothing could be moved, or fragments and LastAllocatedBlock
+    // did not decrease, until CompactIdleWrites changes. Only used by
+    // worker thread.
+    //
+    LONGLONG CompactPassMoves;
+
+    LONGLONG CompactPassFragments;
+
+    LONG CompactPassLastAllocatedBlock;
+
+    LONGLONG CompactIdleWrites;
 
     //
     // FILE_OBJECT for diff device
@@ -356,6 +634,332 @@ typedef struct _DEVICE_EXTENSION
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
 
+//
+// Sector bitmap for an allocation block within its chunk.
+//
+FORCEINLINE
+PDIFF_SECTOR_BITMAP
+AIMWrFltrSectorBitmapInChunk(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PDIFF_SECTOR_BITMAP Chunk, IN LONGLONG Block)
+{
+    return (PDIFF_SECTOR_BITMAP)((PUCHAR)Chunk +
+        (Block % DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension)) *
+        DIFF_SECTOR_BITMAP_SIZE(DeviceExtension));
+}
+
+//
+// Returns sector bitmap for an allocation block, or NULL if all sectors
+// of the block are at diff device.
+//
+FORCEINLINE
+PDIFF_SECTOR_BITMAP
+AIMWrFltrGetSectorBitmap(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Block)
+{
+    if (DeviceExtension->SectorBitmap == NULL)
+    {
+        return NULL;
+    }
+
+    PDIFF_SECTOR_BITMAP chunk = DeviceExtension->SectorBitmap[
+        Block / DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension)];
+
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+
+    return AIMWrFltrSectorBitmapInChunk(DeviceExtension, chunk, Block);
+}
+
+//
+// Allocation table entry for an allocation block, or NULL if no block in
+// its leaf has been written yet.
+//
+FORCEINLINE
+LONG volatile *
+AIMWrFltrGetTableEntry(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Block)
+{
+    LONG volatile * leaf = DeviceExtension->AllocationTable[
+        DIFF_TABLE_GET_LEAF(DeviceExtension, Block)];
+
+    if (leaf == NULL)
+    {
+        return NULL;
+    }
+
+    return leaf + DIFF_TABLE_GET_LEAF_ENTRY(DeviceExtension, Block);
+}
+
+//
+// Allocation table entry value for an allocation block, including
+// DIFF_BLOCK_CLAIMED.
+//
+FORCEINLINE
+LONG
+AIMWrFltrReadTableEntry(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Block)
+{
+    LONG volatile * entry = AIMWrFltrGetTableEntry(DeviceExtension, Block);
+
+    if (entry == NULL)
+    {
+        return DIFF_BLOCK_UNALLOCATED;
+    }
+
+    return *entry;
+}
+
+//
+// Diff block for an allocation block, or DIFF_BLOCK_UNALLOCATED if block
+// is not yet at diff device. Blocks claimed by writes in progress are
+// still read from original device.
+//
+FORCEINLINE
+LONG
+AIMWrFltrGetDiffBlock(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Block)
+{
+    LONG block_address = AIMWrFltrReadTableEntry(DeviceExtension, Block);
+
+    if (block_address == DIFF_BLOCK_CLAIMED)
+    {
+        return DIFF_BLOCK_UNALLOCATED;
+    }
+
+    return block_address;
+}
+
+//
+// Marks a page, allocation table leaf or sector bitmap chunk, in a dirty
+// bitmap. Can be called at DISPATCH_LEVEL.
+//
+FORCEINLINE
+VOID
+AIMWrFltrMarkPageDirty(IN LONG volatile * DirtyBitmap, IN ULONG Page)
+{
+    LONG mask = 1L << (Page % 32);
+
+    // Pages written to are usually marked already, so avoid locked
+    // operation on shared bitmap word
+    if ((DirtyBitmap[Page / 32] & mask) == 0)
+    {
+        InterlockedOr(&DirtyBitmap[Page / 32], mask);
+    }
+}
+
+//
+// Takes Count consecutive free blocks from FreeBlockMap and returns first
+// of them, or DIFF_BLOCK_UNALLOCATED if there are none. Can be called at
+// DISPATCH_LEVEL.
+//
+extern "C"
+LONG
+AIMWrFltrAllocateFreeBlocks(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONG Count);
+
+//
+// Allocates Count consecutive blocks at diff device and returns first of
+// them. Free blocks below LastAllocatedBlock are used first. Safe to call
+// from any thread.
+//
+FORCEINLINE
+LONG
+AIMWrFltrAllocateDiffBlocks(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONG Count)
+{
+    if (DeviceExtension->Statistics.FreeDiffBlocks >= Count)
+    {
+        LONG block_address = AIMWrFltrAllocateFreeBlocks(DeviceExtension,
+            Count);
+
+        if (block_address != DIFF_BLOCK_UNALLOCATED)
+        {
+            return block_address;
+        }
+    }
+
+    return InterlockedExchangeAdd((LONG volatile *)&DeviceExtension->
+        Statistics.DiffDeviceVbr.Fields.Head.LastAllocatedBlock, Count) + 1;
+}
+
+//
+// Counts a direct read or write that uses allocation table entries and
+// sends lower level requests from dispatch routine. Returns false if
+// worker thread is moving a block at diff device, and request must be
+// sent to worker thread instead. Otherwise AIMWrFltrEndDirectIo is called
+// when all lower level requests have completed.
+//
+FORCEINLINE
+bool
+AIMWrFltrStartDirectIo(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    InterlockedIncrement(&DeviceExtension->DirectIoCount);
+
+    if (DeviceExtension->RelocationActive)
+    {
+        InterlockedDecrement(&DeviceExtension->DirectIoCount);
+
+        return false;
+    }
+
+    return true;
+}
+
+FORCEINLINE
+VOID
+AIMWrFltrEndDirectIo(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    InterlockedDecrement(&DeviceExtension->DirectIoCount);
+}
+
+//
+// Resolves claims for Blocks allocation blocks from FirstBlock, setting
+// them to consecutive diff blocks from BlockAddress, or back to
+// DIFF_BLOCK_UNALLOCATED. Can be called at DISPATCH_LEVEL.
+//
+FORCEINLINE
+VOID
+AIMWrFltrResolveBlockClaims(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG FirstBlock, IN ULONG Blocks, IN LONG BlockAddress)
+{
+    // Leaves of claimed blocks are always allocated
+    for (ULONG i = 0; i < Blocks; i++)
+    {
+        InterlockedExchange(
+            AIMWrFltrGetTableEntry(DeviceExtension, FirstBlock + i),
+            BlockAddress == DIFF_BLOCK_UNALLOCATED ?
+            DIFF_BLOCK_UNALLOCATED : BlockAddress + (LONG)i);
+    }
+
+    // Leaves are marked after entries are set, so that a save that
+    // clears marks first copies new entries
+    if (BlockAddress != DIFF_BLOCK_UNALLOCATED && Blocks > 0)
+    {
+        for (ULONG leaf = DIFF_TABLE_GET_LEAF(DeviceExtension, FirstBlock);
+            leaf <= DIFF_TABLE_GET_LEAF(DeviceExtension, FirstBlock + Blocks - 1);
+            leaf++)
+        {
+            AIMWrFltrMarkPageDirty(DeviceExtension->AllocationTableDirty, leaf);
+        }
+    }
+
+    KeSetEvent(&DeviceExtension->BlockClaimEvent, 0, FALSE);
+}
+
+//
+// Mask of bits in bitmap word Word for sectors FirstSector to LastSector.
+//
+FORCEINLINE
+ULONGLONG
+AIMWrFltrSectorBitmapMask(IN ULONG Word, IN ULONG FirstSector,
+    IN ULONG LastSector)
+{
+    ULONGLONG mask = ~0ULL;
+
+    if (Word == FirstSector / 64)
+    {
+        mask &= ~0ULL << (FirstSector % 64);
+    }
+
+    if (Word == LastSector / 64)
+    {
+        mask &= ~0ULL >> (63 - LastSector % 64);
+    }
+
+    return mask;
+}
+
+//
+// Checks whether any sector within Length bytes at Offset within an
+// allocation block is missing at diff device.
+//
+FORCEINLINE
+bool
+AIMWrFltrAnySectorMissing(IN PDIFF_SECTOR_BITMAP Bitmap,
+    IN ULONG Offset, IN ULONG Length)
+{
+    if (Bitmap == NULL)
+    {
+        return false;
+    }
+
+    ULONG first = Offset >> SECTOR_BITS;
+    ULONG last = (Offset + Length - 1) >> SECTOR_BITS;
+
+    for (ULONG word = first / 64; word <= last / 64; word++)
+    {
+        if (Bitmap->Bits[word] &
+            AIMWrFltrSectorBitmapMask(word, first, last))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//
+// Marks sectors within Length bytes at Offset within an allocation block
+// as missing at diff device or as present.
+//
+FORCEINLINE
+VOID
+AIMWrFltrSetSectorsMissing(IN PDIFF_SECTOR_BITMAP Bitmap,
+    IN ULONG Offset, IN ULONG Length, IN bool Missing)
+{
+    ULONG first = Offset >> SECTOR_BITS;
+    ULONG last = (Offset + Length - 1) >> SECTOR_BITS;
+
+    for (ULONG word = first / 64; word <= last / 64; word++)
+    {
+        ULONGLONG mask = AIMWrFltrSectorBitmapMask(word, first, last);
+
+        if (Missing)
+        {
+            Bitmap->Bits[word] |= mask;
+        }
+        else
+        {
+            Bitmap->Bits[word] &= ~mask;
+        }
+    }
+}
+
+//
+// Number of bytes from Offset within an allocation block, up to Length,
+// where sectors are all missing or all present at diff device. Missing
+// receives which of them.
+//
+FORCEINLINE
+ULONG
+AIMWrFltrSectorRunLength(IN PDIFF_SECTOR_BITMAP Bitmap,
+    IN ULONG Offset, IN ULONG Length, OUT bool *Missing)
+{
+    ULONG sector = Offset >> SECTOR_BITS;
+    ULONG end = Offset + Length;
+
+    *Missing = (Bitmap->Bits[sector / 64] & (1ULL << (sector % 64))) != 0;
+
+    ULONG run_end = (sector + 1) << SECTOR_BITS;
+
+    while (run_end < end)
+    {
+        sector = run_end >> SECTOR_BITS;
+
+        if (((Bitmap->Bits[sector / 64] & (1ULL << (sector % 64))) != 0) !=
+            *Missing)
+        {
+            break;
+        }
+
+        run_end += SECTOR_SIZE;
+    }
+
+    return min(run_end, end) - Offset;
+}
+
 //
 // Function to free a driver allocated IRP, including unlocking and
 // freeing all MDLs assigned to the IRP.
@@ -385,6 +989,22 @@ AIMWrFltrFreeIrpWithMdls(IN PIRP Irp)
     IoFreeIrp(Irp);
 }
 
+//
+// Allocation blocks claimed by a direct write, resolved when lower level
+// write to new diff blocks completes.
+//
+typedef struct _DIFF_BLOCK_CLAIM
+{
+    PDEVICE_EXTENSION DeviceExtension;
+
+    LONGLONG FirstBlock;
+
+    ULONG Blocks;
+
+    LONG BlockAddress;
+
+} DIFF_BLOCK_CLAIM, *PDIFF_BLOCK_CLAIM;
+
 typedef class SCATTERED_IRP
 {
     PIRP OriginalIrp;
@@ -403,6 +1023,8 @@ typedef class SCATTERED_IRP
 
     PUCHAR AllocatedBuffer;
 
+    LONG volatile * DirectIoCount;
+
     static IO_COMPLETION_ROUTINE IrpCompletionRoutine;
 
     SCATTERED_IRP()
@@ -411,6 +1033,11 @@ typedef class SCATTERED_IRP
 
     ~SCATTERED_IRP()
     {
+        if (DirectIoCount != NULL)
+        {
+            InterlockedDecrement(DirectIoCount);
+        }
+
         OriginalIrp->IoStatus.Status = LastFailedStatus;
 
         if (NT_SUCCESS(LastFailedStatus))
@@ -451,7 +1078,8 @@ public:
         PDEVICE_OBJECT OriginalDeviceObject,
         PIRP OriginalIrp,
         PIO_REMOVE_LOCK RemoveLock,
-        PUCHAR SystemBuffer = NULL)
+        PUCHAR SystemBuffer = NULL,
+        LONG volatile * DirectIoCount = NULL)
     {
         //
         // Acquire the remove lock so that device will not be removed while
@@ -482,6 +1110,7 @@ public:
         (*Object)->RemoveLock = RemoveLock;
         (*Object)->ScatterCount = 1;
         (*Object)->SystemBuffer = SystemBuffer;
+        (*Object)->DirectIoCount = DirectIoCount;
 
         IoMarkIrpPending(OriginalIrp);
 
@@ -494,7 +1123,8 @@ public:
         PFILE_OBJECT FileObject,
         ULONG OriginalIrpOffset,
         ULONG BytesThisIrp,
-        PLARGE_INTEGER LowerDeviceOffset);
+        PLARGE_INTEGER LowerDeviceOffset,
+        PDIFF_BLOCK_CLAIM Claim = NULL);
 
 } *PSCATTERED_IRP;
 
@@ -508,6 +1138,8 @@ typedef struct PARTIAL_IRP
 
     bool CopyBack;
 
+    DIFF_BLOCK_CLAIM Claim;
+
 } *PPARTIAL_IRP;
 
 //
@@ -585,6 +1217,10 @@ extern "C"
 
     IO_COMPLETION_ROUTINE AIMWrFltrSynchronousIrpCompletion;
 
+    IO_COMPLETION_ROUTINE AIMWrFltrDeferredWriteIrpCompletion;
+
+    IO_COMPLETION_ROUTINE AIMWrFltrDeferredReadIrpCompletion;
+
     DRIVER_UNLOAD AIMWrFltrUnload;
 
     KSTART_ROUTINE AIMWrFltrDeviceWorkerThread;
@@ -592,14 +1228,13 @@ extern "C"
     VOID
         AIMWrFltrDeferredRead(
             PDEVICE_EXTENSION DeviceExtension,
-            PIRP Irp,
-            PUCHAR BlockBuffer);
+            PIRP Irp);
 
     VOID
         AIMWrFltrDeferredWrite(
             PDEVICE_EXTENSION DeviceExtension,
             PIRP Irp,
-            PUCHAR BlockBuffer);
+            PUCHAR FillBuffers);
 
     VOID
         AIMWrFltrDeferredFlushBuffers(
@@ -655,9 +1290,132 @@ extern "C"
             OUT PKEY_VALUE_PARTIAL_INFORMATION DiffDevicePath,
             IN ULONG DiffDevicePathSize);
 
+    UCHAR
+        AIMWrFltrGetDiffBlockBits(IN PUNICODE_STRING MountDevName);
+
     NTSTATUS
         AIMWrFltrInitializeDiffDevice(IN PDEVICE_EXTENSION DeviceExtension);
 
+    //
+    // Saves allocation table leaves and sector bitmap chunks changed since
+    // last save, followed by VBR with a new journal checkpoint. Only called
+    // by worker thread, or when worker thread is not running.
+    //
+    NTSTATUS
+        AIMWrFltSaveDiffHeader(IN PDEVICE_EXTENSION DeviceExtension);
+
+    //
+    // Adds journal entries for Blocks allocation blocks from Block. Sets
+    // them to consecutive diff blocks from BlockAddress, unless that is
+    // zero, and marks FirstSector to FirstSector + Sectors - 1 as written
+    // in sector bitmap, unless Sectors is zero. Remaining sectors of new
+    // blocks with Sectors set are marked as missing. Called after the
+    // change is made in allocation table and sector bitmap. Can be called
+    // at DISPATCH_LEVEL.
+    //
+    VOID
+        AIMWrFltrJournalAppend(IN PDEVICE_EXTENSION DeviceExtension,
+            IN LONGLONG Block,
+            IN ULONG Blocks,
+            IN LONG BlockAddress,
+            IN ULONG FirstSector,
+            IN ULONG Sectors);
+
+    //
+    // Writes journal entries added since last time as journal records,
+    // after flushing data they refer to, or saves header if entries are
+    // missing or journal is full. Only called by worker thread.
+    //
+    NTSTATUS
+        AIMWrFltrCommitJournal(IN PDEVICE_EXTENSION DeviceExtension);
+
+    //
+    // Discards journal entries waiting to be written and returns sequence
+    // number for a checkpoint, when a header save is about to copy changes
+    // they refer to.
+    //
+    ULONGLONG
+        AIMWrFltrStartJournalCheckpoint(IN PDEVICE_EXTENSION DeviceExtension);
+
+    //
+    // Makes next flush request save header instead of writing journal
+    // records, when entries have been discarded without being saved.
+    //
+    VOID
+        AIMWrFltrSetJournalOverflow(IN PDEVICE_EXTENSION DeviceExtension);
+
+    //
+    // Allocates journal buffers. If journal was just reserved at diff
+    // device, it is cleared. Otherwise records from JournalCheckpoint on
+    // are replayed into allocation table and sector bitmaps, which must be
+    // loaded, and their number returned in ReplayedRecords.
+    //
+    NTSTATUS
+        AIMWrFltrLoadJournal(IN PDEVICE_EXTENSION DeviceExtension,
+            IN bool NewJournal,
+            OUT PULONG ReplayedRecords);
+
+    VOID
+        AIMWrFltrFreeJournal(IN PDEVICE_EXTENSION DeviceExtension);
+
+    //
+    // Returns sector bitmap for an allocation block, allocating bitmap
+    // chunk for it if needed. Only called by worker thread. Returns NULL
+    // if memory allocation fails.
+    //
+    PDIFF_SECTOR_BITMAP
+        AIMWrFltrAllocateSectorBitmap(IN PDEVICE_EXTENSION DeviceExtension,
+            IN LONGLONG Block);
+
+    //
+    // Returns allocation table entry for an allocation block, allocating
+    // table leaf for it if needed. Can be called at DISPATCH_LEVEL. Returns
+    // NULL if memory allocation fails.
+    //
+    LONG volatile *
+        AIMWrFltrAllocateTableEntry(IN PDEVICE_EXTENSION DeviceExtension,
+            IN LONGLONG Block);
+
+    //
+    // Builds FreeBlockMap from blocks up to LastAllocatedBlock that are
+    // not referenced by loaded allocation table, sector bitmap directory
+    // or regions in VBR. Called when diff device has been opened and
+    // journal replayed.
+    //
+    NTSTATUS
+        AIMWrFltrBuildFreeBlockMap(IN PDEVICE_EXTENSION DeviceExtension);
+
+    VOID
+        AIMWrFltrFreeFreeBlockMap(IN PDEVICE_EXTENSION DeviceExtension);
+
+    //
+    // Returns true if worker thread has compaction work to do when
+    // protected volume is idle.
+    //
+    bool
+        AIMWrFltrCompactionPending(IN PDEVICE_EXTENSION DeviceExtension);
+
+    //
+    // Runs one step of background compaction, moving a limited number of
+    // diff blocks. BlockBuffer holds at least one allocation block. Only
+    // called by worker thread.
+    //
+    VOID
+        AIMWrFltrCompactDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
+            IN PUCHAR BlockBuffer);
+
+    //
+    // Frees diff blocks of allocation blocks that trim ranges cover
+    // completely, so that those blocks are read from original device
+    // again and their diff blocks are reused once header has been saved.
+    // Ranges must be within protected volume. Only called by worker
+    // thread.
+    //
+    VOID
+        AIMWrFltrFreeTrimmedBlocks(IN PDEVICE_EXTENSION DeviceExtension,
+            IN PDEVICE_DATA_SET_RANGE Ranges,
+            IN ULONG NumberOfRanges);
+
     FORCEINLINE
         PDEVICE_OBJECT
         AIMWrFltrGetLowerDeviceObjectAndDereference(
@@ -0,0 +1,1036 @@
+#include "aimwrfltr.h"
+
+//
+// Free block map and background compaction of diff device.
+//
+// Compaction runs in worker thread when protected volume has been idle
+// for a while. It walks allocation table in protected volume block order
+// and moves a diff block to the free block after diff block of previous
+// allocation block, so that runs of blocks at protected volume become
+// runs at diff device as well, and moves blocks from the end of diff
+// device to free blocks further down, so that LastAllocatedBlock can be
+// lowered. Each move is added to allocation journal like any other
+// allocation table change. Blocks moved from are only allocated again
+// after header has been saved and flushed, so that allocation table at
+// diff device never refers to a block that has been reused. Diff blocks
+// of allocation blocks that trim requests cover completely are freed the
+// same way.
+//
+
+//
+// Marks Count blocks from FirstBlock as in use, for blocks within map.
+//
+static VOID
+AIMWrFltrMarkBlocksUsed(IN PRTL_BITMAP Map,
+    IN LONGLONG FirstBlock,
+    IN LONGLONG Count)
+{
+    LONGLONG end = min(FirstBlock + Count, (LONGLONG)Map->SizeOfBitMap);
+
+    FirstBlock = max(FirstBlock, 0);
+
+    if (end > FirstBlock)
+    {
+        RtlClearBits(Map, (ULONG)FirstBlock, (ULONG)(end - FirstBlock));
+    }
+}
+
+//
+// Marks diff blocks for a region in VBR, offset and size in 512 byte
+// units, as in use.
+//
+static VOID
+AIMWrFltrMarkRegionUsed(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PRTL_BITMAP Map,
+    IN LONGLONG Offset,
+    IN LONGLONG Size)
+{
+    if (Size <= 0)
+    {
+        return;
+    }
+
+    UCHAR shift = DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS;
+
+    LONGLONG first_block = Offset >> shift;
+    LONGLONG end_block = (Offset + Size + (1LL << shift) - 1) >> shift;
+
+    AIMWrFltrMarkBlocksUsed(Map, first_block, end_block - first_block);
+}
+
+//
+// Bits in a map buffer that covers blocks up to Block, rounded up to
+// whole ULONGs.
+//
+static ULONG
+AIMWrFltrFreeBlockMapBits(IN LONG Block)
+{
+    return ((ULONG)Block + 32) & ~31UL;
+}
+
+NTSTATUS
+AIMWrFltrBuildFreeBlockMap(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    AIMWrFltrFreeFreeBlockMap(DeviceExtension);
+
+    LONG last_allocated_block = DeviceExtension->Statistics.DiffDeviceVbr.
+        Fields.Head.LastAllocatedBlock;
+
+    ULONG bits = AIMWrFltrFreeBlockMapBits(last_allocated_block);
+
+    // Zero filled by operator new
+    PULONG buffer = new ULONG[bits / 32];
+    DeviceExtension->PendingFreeBlocks = new LONG[COMPACT_PENDING_BLOCKS];
+
+    if (buffer == NULL || DeviceExtension->PendingFreeBlocks == NULL)
+    {
+        delete[] buffer;
+
+        delete[] DeviceExtension->PendingFreeBlocks;
+        DeviceExtension->PendingFreeBlocks = NULL;
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RTL_BITMAP map;
+    RtlInitializeBitMap(&map, buffer, bits);
+
+    PAIMWRFLTR_VBR_HEAD_FIELDS head =
+        &DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head;
+
+    // VBR is in block zero even where OffsetToFirstAllocatedBlock is not
+    // set
+    LONG first_block = max((LONG)(head->OffsetToFirstAllocatedBlock >>
+        (DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS)), 1L);
+
+    if (last_allocated_block >= first_block)
+    {
+        RtlSetBits(&map, (ULONG)first_block,
+            (ULONG)(last_allocated_block - first_block + 1));
+    }
+
+    AIMWrFltrMarkRegionUsed(DeviceExtension, &map,
+        head->OffsetToPrivateData, head->SizeOfPrivateData);
+
+    AIMWrFltrMarkRegionUsed(DeviceExtension, &map,
+        head->OffsetToLogData, head->SizeOfLogData);
+
+    AIMWrFltrMarkRegionUsed(DeviceExtension, &map,
+        head->OffsetToAllocationTable, head->SizeOfAllocationTable);
+
+    AIMWrFltrMarkRegionUsed(DeviceExtension, &map,
+        head->OffsetToSectorBitmap, head->SizeOfSectorBitmap);
+
+    AIMWrFltrMarkRegionUsed(DeviceExtension, &map,
+        head->OffsetToJournal, head->SizeOfJournal);
+
+    for (ULONG i = 0; i < DeviceExtension->AllocationTableLeaves; i++)
+    {
+        AIMWrFltrMarkBlocksUsed(&map,
+            DeviceExtension->AllocationTableLeafBlocks[i], 1);
+
+        LONG volatile * leaf = DeviceExtension->AllocationTable[i];
+
+        if (leaf == NULL)
+        {
+            continue;
+        }
+
+        for (ULONG j = 0; j < DIFF_TABLE_ENTRIES_PER_LEAF(DeviceExtension); j++)
+        {
+            if (leaf[j] > 0)
+            {
+                AIMWrFltrMarkBlocksUsed(&map, leaf[j], 1);
+            }
+        }
+    }
+
+    for (ULONG i = 0; i < DeviceExtension->SectorBitmapChunks; i++)
+    {
+        AIMWrFltrMarkBlocksUsed(&map,
+            DeviceExtension->SectorBitmapBlocks[i], 1);
+    }
+
+    ULONG free_blocks = RtlNumberOfSetBits(&map);
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->FreeBlockLock, &irql);
+
+    DeviceExtension->FreeBlockMap = map;
+    DeviceExtension->FreeBlockHint = 0;
+    DeviceExtension->Statistics.FreeDiffBlocks = (LONG)free_blocks;
+
+    KeReleaseSpinLock(&DeviceExtension->FreeBlockLock, irql);
+
+    DeviceExtension->PendingFreeCount = 0;
+
+    if (free_blocks > 0)
+    {
+        DbgPrint("AIMWrFltrInitializeDiffDevice: %u free blocks below block %i for %p.\n",
+            free_blocks, last_allocated_block, DeviceExtension->DeviceObject);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+AIMWrFltrFreeFreeBlockMap(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->FreeBlockLock, &irql);
+
+    PULONG buffer = DeviceExtension->FreeBlockMap.Buffer;
+
+    RtlZeroMemory(&DeviceExtension->FreeBlockMap,
+        sizeof(DeviceExtension->FreeBlockMap));
+
+    DeviceExtension->Statistics.FreeDiffBlocks = 0;
+
+    KeReleaseSpinLock(&DeviceExtension->FreeBlockLock, irql);
+
+    delete[] buffer;
+
+    delete[] DeviceExtension->PendingFreeBlocks;
+    DeviceExtension->PendingFreeBlocks = NULL;
+    DeviceExtension->PendingFreeCount = 0;
+}
+
+LONG
+AIMWrFltrAllocateFreeBlocks(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONG Count)
+{
+    LONG block_address = DIFF_BLOCK_UNALLOCATED;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->FreeBlockLock, &irql);
+
+    if (DeviceExtension->FreeBlockMap.Buffer != NULL &&
+        DeviceExtension->Statistics.FreeDiffBlocks >= Count)
+    {
+        ULONG hint = DeviceExtension->FreeBlockHint <
+            DeviceExtension->FreeBlockMap.SizeOfBitMap ?
+            DeviceExtension->FreeBlockHint : 0;
+
+        ULONG index = RtlFindSetBitsAndClear(&DeviceExtension->FreeBlockMap,
+            (ULONG)Count, hint);
+
+        if (index != MAXULONG)
+        {
+            block_address = (LONG)index;
+
+            DeviceExtension->Statistics.FreeDiffBlocks -= Count;
+
+            // No free blocks are left below a run found at hint
+            if (index == hint)
+            {
+                DeviceExtension->FreeBlockHint = index + Count;
+            }
+        }
+    }
+
+    KeReleaseSpinLock(&DeviceExtension->FreeBlockLock, irql);
+
+    return block_address;
+}
+
+//
+// Takes a particular free block from FreeBlockMap. Returns false if it is
+// not free.
+//
+static bool
+AIMWrFltrTakeFreeBlock(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONG BlockAddress)
+{
+    bool taken = false;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->FreeBlockLock, &irql);
+
+    if (DeviceExtension->FreeBlockMap.Buffer != NULL &&
+        BlockAddress > 0 &&
+        (ULONG)BlockAddress < DeviceExtension->FreeBlockMap.SizeOfBitMap &&
+        RtlCheckBit(&DeviceExtension->FreeBlockMap, (ULONG)BlockAddress))
+    {
+        RtlClearBits(&DeviceExtension->FreeBlockMap, (ULONG)BlockAddress, 1);
+
+        --DeviceExtension->Statistics.FreeDiffBlocks;
+
+        taken = true;
+    }
+
+    KeReleaseSpinLock(&DeviceExtension->FreeBlockLock, irql);
+
+    return taken;
+}
+
+//
+// Replaces map buffer with one that covers blocks up to Block. Only called
+// by worker thread, which is the only one that sets bits in map.
+//
+static bool
+AIMWrFltrGrowFreeBlockMap(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONG Block)
+{
+    ULONG bits = max(AIMWrFltrFreeBlockMapBits(Block),
+        DeviceExtension->FreeBlockMap.SizeOfBitMap * 2);
+
+    // Zero filled by operator new
+    PULONG buffer = new ULONG[bits / 32];
+
+    if (buffer == NULL)
+    {
+        return false;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->FreeBlockLock, &irql);
+
+    PULONG old_buffer = DeviceExtension->FreeBlockMap.Buffer;
+
+    RtlCopyMemory(buffer, old_buffer,
+        DeviceExtension->FreeBlockMap.SizeOfBitMap / 8);
+
+    RtlInitializeBitMap(&DeviceExtension->FreeBlockMap, buffer, bits);
+
+    KeReleaseSpinLock(&DeviceExtension->FreeBlockLock, irql);
+
+    delete[] old_buffer;
+
+    return true;
+}
+
+//
+// Returns blocks to FreeBlockMap. Only called by worker thread. Blocks
+// are lost until diff device is opened again if map cannot grow to cover
+// them.
+//
+static VOID
+AIMWrFltrAddFreeBlocks(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PLONG Blocks,
+    IN ULONG Count)
+{
+    LONG highest_block = 0;
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        highest_block = max(highest_block, Blocks[i]);
+    }
+
+    if ((ULONG)highest_block >= DeviceExtension->FreeBlockMap.SizeOfBitMap &&
+        !AIMWrFltrGrowFreeBlockMap(DeviceExtension, highest_block))
+    {
+        DbgPrint("AIMWrFltrAddFreeBlocks: Cannot extend free block map for %p.\n",
+            DeviceExtension->DeviceObject);
+
+        return;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->FreeBlockLock, &irql);
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        if (Blocks[i] <= 0 ||
+            RtlCheckBit(&DeviceExtension->FreeBlockMap, (ULONG)Blocks[i]))
+        {
+            continue;
+        }
+
+        RtlSetBits(&DeviceExtension->FreeBlockMap, (ULONG)Blocks[i], 1);
+
+        ++DeviceExtension->Statistics.FreeDiffBlocks;
+
+        DeviceExtension->FreeBlockHint = min(DeviceExtension->FreeBlockHint,
+            (ULONG)Blocks[i]);
+    }
+
+    KeReleaseSpinLock(&DeviceExtension->FreeBlockLock, irql);
+}
+
+//
+// Lowers LastAllocatedBlock below free blocks at the end of diff device.
+// New blocks allocated at the end at the same time make this leave
+// LastAllocatedBlock as it is.
+//
+static VOID
+AIMWrFltrLowerLastAllocatedBlock(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    LONG volatile * last_allocated_block = (LONG volatile *)
+        &DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        LastAllocatedBlock;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->FreeBlockLock, &irql);
+
+    LONG old_last = *last_allocated_block;
+    LONG new_last = old_last;
+
+    while (new_last > 0 &&
+        (ULONG)new_last < DeviceExtension->FreeBlockMap.SizeOfBitMap &&
+        RtlCheckBit(&DeviceExtension->FreeBlockMap, (ULONG)new_last))
+    {
+        --new_last;
+    }
+
+    if (new_last != old_last &&
+        InterlockedCompareExchange(last_allocated_block, new_last,
+            old_last) == old_last)
+    {
+        RtlClearBits(&DeviceExtension->FreeBlockMap, (ULONG)new_last + 1,
+            (ULONG)(old_last - new_last));
+
+        DeviceExtension->Statistics.FreeDiffBlocks -= old_last - new_last;
+
+        DeviceExtension->Statistics.ReclaimedDiffBlocks += old_last - new_last;
+    }
+
+    KeReleaseSpinLock(&DeviceExtension->FreeBlockLock, irql);
+}
+
+//
+// Writes journal records for allocation table changes so far and flushes
+// diff device, as a flush request does. Bitmap chunks are saved before
+// allocation table leaves, so a change that moves or frees a diff block
+// must be found in journal before sector bitmap changes made after it can
+// be saved. Otherwise, a crash could leave a saved leaf that still refers
+// to the old diff block, with sectors never written there marked as
+// present.
+//
+static NTSTATUS
+AIMWrFltrFlushJournal(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    NTSTATUS status = AIMWrFltrCommitJournal(DeviceExtension);
+
+    if (NT_SUCCESS(status))
+    {
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_FLUSH_BUFFERS);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("AIMWrFltrFlushJournal: Error saving journal for %p: 0x%X\n",
+            DeviceExtension->DeviceObject, status);
+    }
+
+    return status;
+}
+
+//
+// Saves header and flushes diff device, after which nothing saved there
+// refers to blocks in PendingFreeBlocks, and makes those blocks free. If
+// that fails, they are kept until next time.
+//
+static VOID
+AIMWrFltrReleasePendingFreeBlocks(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension->PendingFreeCount == 0)
+    {
+        return;
+    }
+
+    NTSTATUS status = AIMWrFltSaveDiffHeader(DeviceExtension);
+
+    if (NT_SUCCESS(status))
+    {
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_FLUSH_BUFFERS);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("AIMWrFltrReleasePendingFreeBlocks: Error saving header for %p: 0x%X\n",
+            DeviceExtension->DeviceObject, status);
+
+        // Tried again when compaction starts over after new writes
+        DeviceExtension->CompactIdleWrites =
+            DeviceExtension->Statistics.WriteRequests;
+
+        return;
+    }
+
+    AIMWrFltrAddFreeBlocks(DeviceExtension,
+        DeviceExtension->PendingFreeBlocks,
+        DeviceExtension->PendingFreeCount);
+
+    DeviceExtension->PendingFreeCount = 0;
+
+    AIMWrFltrLowerLastAllocatedBlock(DeviceExtension);
+}
+
+//
+// Highest diff block that would be in use if all blocks in use were at
+// the start of diff device. Blocks above this are moved further down.
+//
+static LONG
+AIMWrFltrCompactEnd(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    return DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        LastAllocatedBlock - DeviceExtension->Statistics.FreeDiffBlocks -
+        (LONG)DeviceExtension->PendingFreeCount;
+}
+
+//
+// Chooses a free diff block to move data at BlockAddress to. Block after
+// diff block of previous allocation block is used if it is free, and
+// lowest free block if BlockAddress is in the part of diff device that
+// compaction empties. Returns DIFF_BLOCK_UNALLOCATED if data stays where
+// it is.
+//
+static LONG
+AIMWrFltrChooseCompactTarget(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONG PreviousBlockAddress,
+    IN LONG BlockAddress)
+{
+    LONG compact_end = AIMWrFltrCompactEnd(DeviceExtension);
+
+    if (PreviousBlockAddress != DIFF_BLOCK_UNALLOCATED &&
+        PreviousBlockAddress + 1 != BlockAddress &&
+        PreviousBlockAddress + 1 <= compact_end &&
+        AIMWrFltrTakeFreeBlock(DeviceExtension, PreviousBlockAddress + 1))
+    {
+        return PreviousBlockAddress + 1;
+    }
+
+    if (BlockAddress <= compact_end)
+    {
+        return DIFF_BLOCK_UNALLOCATED;
+    }
+
+    LONG target = AIMWrFltrAllocateFreeBlocks(DeviceExtension, 1);
+
+    if (target != DIFF_BLOCK_UNALLOCATED && target > BlockAddress)
+    {
+        AIMWrFltrAddFreeBlocks(DeviceExtension, &target, 1);
+
+        return DIFF_BLOCK_UNALLOCATED;
+    }
+
+    return target;
+}
+
+//
+// Sends new direct reads and writes to worker thread, which is running
+// this, and waits for those already sent, so that allocation table
+// entries can be changed under them. Returns STATUS_DEVICE_BUSY if they
+// do not finish within COMPACT_DRAIN_WAIT_MS.
+//
+static NTSTATUS
+AIMWrFltrStartRelocation(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    InterlockedExchange(&DeviceExtension->RelocationActive, 1);
+
+    for (ULONG waited = 0; DeviceExtension->DirectIoCount != 0; waited++)
+    {
+        if (waited >= COMPACT_DRAIN_WAIT_MS)
+        {
+            InterlockedExchange(&DeviceExtension->RelocationActive, 0);
+
+            return STATUS_DEVICE_BUSY;
+        }
+
+        LARGE_INTEGER interval;
+        interval.QuadPart = -10000;    // 1 ms
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+AIMWrFltrEndRelocation(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    InterlockedExchange(&DeviceExtension->RelocationActive, 0);
+}
+
+//
+// Copies data for an allocation block from diff block From to diff block
+// To and updates allocation table entry.
+//
+static NTSTATUS
+AIMWrFltrRelocateBlock(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Block,
+    IN LONG From,
+    IN LONG To,
+    IN PUCHAR BlockBuffer)
+{
+    NTSTATUS status = AIMWrFltrStartRelocation(DeviceExtension);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    // Direct writes waited for can have changed entry
+    if (AIMWrFltrReadTableEntry(DeviceExtension, Block) != From)
+    {
+        status = STATUS_RETRY;
+    }
+
+    ULONG length = DIFF_BLOCK_SIZE(DeviceExtension);
+    IO_STATUS_BLOCK io_status;
+
+    if (NT_SUCCESS(status))
+    {
+        LARGE_INTEGER offset;
+        offset.QuadPart = (LONGLONG)From << DIFF_BLOCK_BITS(DeviceExtension);
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_READ,
+            BlockBuffer,
+            length,
+            &offset,
+            &io_status);
+
+        if (NT_SUCCESS(status) && io_status.Information != length)
+        {
+            status = STATUS_IO_DEVICE_ERROR;
+        }
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        LARGE_INTEGER offset;
+        offset.QuadPart = (LONGLONG)To << DIFF_BLOCK_BITS(DeviceExtension);
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_WRITE,
+            BlockBuffer,
+            length,
+            &offset,
+            &io_status);
+
+        if (NT_SUCCESS(status) && io_status.Information != length)
+        {
+            status = STATUS_IO_DEVICE_ERROR;
+        }
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        InterlockedExchange(AIMWrFltrGetTableEntry(DeviceExtension, Block), To);
+
+        AIMWrFltrMarkPageDirty(DeviceExtension->AllocationTableDirty,
+            DIFF_TABLE_GET_LEAF(DeviceExtension, Block));
+
+        // Sector bitmap is left as it is
+        AIMWrFltrJournalAppend(DeviceExtension, Block, 1, To, 0, 0);
+
+        ++DeviceExtension->Statistics.CompactedBlocks;
+        DeviceExtension->Statistics.CompactedBytes += length;
+    }
+
+    AIMWrFltrEndRelocation(DeviceExtension);
+
+    return status;
+}
+
+//
+// Moves allocation table leaves or sector bitmap chunks saved in the part
+// of diff device that compaction empties. Page is given a new block the
+// next time header is saved, and diff block it was saved in becomes
+// pending free. Only pages loaded in memory are moved, since those are
+// the ones that header saves write. One page is moved each time, since
+// blocks for several new pages are allocated together and would rarely
+// find a free run that size.
+//
+static VOID
+AIMWrFltrRelocatePages(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PLONG PageBlocks,
+    IN ULONG NumberOfPages,
+    IN PVOID volatile * Pages,
+    IN LONG volatile * DirtyBitmap)
+{
+    LONG compact_end = AIMWrFltrCompactEnd(DeviceExtension);
+
+    for (ULONG i = 0; i < NumberOfPages; i++)
+    {
+        if (PageBlocks[i] <= compact_end || Pages[i] == NULL)
+        {
+            continue;
+        }
+
+        DeviceExtension->PendingFreeBlocks[
+            DeviceExtension->PendingFreeCount++] = PageBlocks[i];
+
+        PageBlocks[i] = DIFF_BLOCK_UNALLOCATED;
+
+        AIMWrFltrMarkPageDirty(DirtyBitmap, i);
+
+        ++DeviceExtension->Statistics.CompactedBlocks;
+        DeviceExtension->Statistics.CompactedBytes +=
+            DIFF_BLOCK_SIZE(DeviceExtension);
+
+        return;
+    }
+}
+
+bool
+AIMWrFltrCompactionPending(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (!DeviceExtension->Statistics.Initialized ||
+        DeviceExtension->AllocationTable == NULL ||
+        DeviceExtension->FreeBlockMap.Buffer == NULL)
+    {
+        return false;
+    }
+
+    if (DeviceExtension->CompactIdleWrites ==
+        DeviceExtension->Statistics.WriteRequests)
+    {
+        return false;
+    }
+
+    return DeviceExtension->Statistics.FreeDiffBlocks > 0 ||
+        DeviceExtension->PendingFreeCount > 0;
+}
+
+VOID
+AIMWrFltrCompactDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PUCHAR BlockBuffer)
+{
+    // Compaction that stopped starts over when something has been written
+    DeviceExtension->CompactIdleWrites = -1;
+
+    LONGLONG number_of_blocks = DIFF_GET_NUMBER_OF_BLOCKS(DeviceExtension,
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.Size.QuadPart);
+
+    LONGLONG block = DeviceExtension->Statistics.NextCompactBlock;
+
+    if (block == 0)
+    {
+        DeviceExtension->CompactPassMoves = 0;
+        DeviceExtension->CompactPassFragments = 0;
+        DeviceExtension->CompactPassLastAllocatedBlock = DeviceExtension->
+            Statistics.DiffDeviceVbr.Fields.Head.LastAllocatedBlock;
+    }
+
+    LONG previous_block_address = block > 0 ?
+        AIMWrFltrGetDiffBlock(DeviceExtension, block - 1) :
+        DIFF_BLOCK_UNALLOCATED;
+
+    ULONG scanned = 0;
+    ULONG moves = 0;
+
+    while (block < number_of_blocks &&
+        scanned < COMPACT_SCAN_BLOCKS &&
+        moves < COMPACT_MOVES_PER_STEP &&
+        DeviceExtension->PendingFreeCount < COMPACT_PENDING_BLOCKS)
+    {
+        ++scanned;
+
+        // Leaves where nothing has been written are skipped at once
+        if (AIMWrFltrGetTableEntry(DeviceExtension, block) == NULL)
+        {
+            block = ((LONGLONG)DIFF_TABLE_GET_LEAF(DeviceExtension, block) + 1)
+                << DIFF_TABLE_LEAF_BITS(DeviceExtension);
+
+            previous_block_address = DIFF_BLOCK_UNALLOCATED;
+
+            continue;
+        }
+
+        LONG block_address = AIMWrFltrGetDiffBlock(DeviceExtension, block);
+
+        if (block_address == DIFF_BLOCK_UNALLOCATED)
+        {
+            ++block;
+
+            previous_block_address = DIFF_BLOCK_UNALLOCATED;
+
+            continue;
+        }
+
+        LONG target = AIMWrFltrChooseCompactTarget(DeviceExtension,
+            previous_block_address, block_address);
+
+        if (target != DIFF_BLOCK_UNALLOCATED)
+        {
+            NTSTATUS status = AIMWrFltrRelocateBlock(DeviceExtension, block,
+                block_address, target, BlockBuffer);
+
+            if (!NT_SUCCESS(status))
+            {
+                AIMWrFltrAddFreeBlocks(DeviceExtension, &target, 1);
+
+                // Busy volume, or entry changed by a write. Block is
+                // looked at again next step.
+                if (status == STATUS_DEVICE_BUSY || status == STATUS_RETRY)
+                {
+                    break;
+                }
+
+                DbgPrint("AIMWrFltrCompactDiffDevice: Error moving block for %p: 0x%X\n",
+                    DeviceExtension->DeviceObject, status);
+            }
+            else
+            {
+                DeviceExtension->PendingFreeBlocks[
+                    DeviceExtension->PendingFreeCount++] = block_address;
+
+                block_address = target;
+
+                ++moves;
+            }
+        }
+
+        if (previous_block_address == DIFF_BLOCK_UNALLOCATED ||
+            block_address != previous_block_address + 1)
+        {
+            ++DeviceExtension->CompactPassFragments;
+        }
+
+        previous_block_address = block_address;
+
+        ++block;
+    }
+
+    DeviceExtension->Statistics.NextCompactBlock = block;
+    DeviceExtension->CompactPassMoves += moves;
+
+    // Writes to blocks moved can follow before header is saved
+    if (moves > 0)
+    {
+        AIMWrFltrFlushJournal(DeviceExtension);
+    }
+
+    if (block < number_of_blocks)
+    {
+        if (DeviceExtension->PendingFreeCount >= COMPACT_PENDING_BLOCKS)
+        {
+            AIMWrFltrReleasePendingFreeBlocks(DeviceExtension);
+        }
+
+        return;
+    }
+
+    // End of pass. Leaves and chunks left at the end of diff device are
+    // moved when header is saved to release blocks moved from.
+    if (DeviceExtension->PendingFreeCount + 2 <= COMPACT_PENDING_BLOCKS &&
+        DeviceExtension->Statistics.FreeDiffBlocks > 0)
+    {
+        ULONG pending = DeviceExtension->PendingFreeCount;
+
+        AIMWrFltrRelocatePages(DeviceExtension,
+            DeviceExtension->AllocationTableLeafBlocks,
+            DeviceExtension->AllocationTableLeaves,
+            (PVOID volatile *)DeviceExtension->AllocationTable,
+            DeviceExtension->AllocationTableDirty);
+
+        AIMWrFltrRelocatePages(DeviceExtension,
+            DeviceExtension->SectorBitmapBlocks,
+            DeviceExtension->SectorBitmapChunks,
+            (PVOID volatile *)DeviceExtension->SectorBitmap,
+            DeviceExtension->SectorBitmapDirty);
+
+        DeviceExtension->CompactPassMoves +=
+            DeviceExtension->PendingFreeCount - pending;
+    }
+
+    AIMWrFltrReleasePendingFreeBlocks(DeviceExtension);
+
+    bool progress = DeviceExtension->CompactPassMoves > 0 &&
+        (DeviceExtension->Statistics.CompactionPasses == 0 ||
+            DeviceExtension->CompactPassFragments <
+            DeviceExtension->Statistics.DiffFragments ||
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            LastAllocatedBlock <
+            DeviceExtension->CompactPassLastAllocatedBlock);
+
+    ++DeviceExtension->Statistics.CompactionPasses;
+    DeviceExtension->Statistics.DiffFragments =
+        DeviceExtension->CompactPassFragments;
+    DeviceExtension->Statistics.NextCompactBlock = 0;
+
+    // Nothing more to do until something is written
+    if (!progress)
+    {
+        DeviceExtension->CompactIdleWrites =
+            DeviceExtension->Statistics.WriteRequests;
+
+        KdPrint(("AIMWrFltrCompactDiffDevice: Compaction done for %p, %I64i fragments.\n",
+            DeviceExtension->DeviceObject,
+            DeviceExtension->Statistics.DiffFragments));
+    }
+}
+
+//
+// Clears sector bitmaps of unallocated blocks within trim ranges, so that
+// blocks freed there can be allocated again without a new bitmap.
+//
+static VOID
+AIMWrFltrClearTrimmedSectorBitmaps(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PDEVICE_DATA_SET_RANGE Ranges,
+    IN ULONG NumberOfRanges)
+{
+    for (ULONG i = 0; i < NumberOfRanges; i++)
+    {
+        LONGLONG block = DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+            Ranges[i].StartingOffset + DIFF_BLOCK_SIZE(DeviceExtension) - 1);
+
+        LONGLONG end_block = DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+            Ranges[i].StartingOffset + (LONGLONG)Ranges[i].LengthInBytes);
+
+        while (block < end_block)
+        {
+            LONG volatile * entry =
+                AIMWrFltrGetTableEntry(DeviceExtension, block);
+
+            // Nothing has been freed in leaves that are not loaded
+            if (entry == NULL)
+            {
+                block = ((LONGLONG)DIFF_TABLE_GET_LEAF(DeviceExtension, block) + 1)
+                    << DIFF_TABLE_LEAF_BITS(DeviceExtension);
+
+                continue;
+            }
+
+            if (*entry != DIFF_BLOCK_UNALLOCATED)
+            {
+                ++block;
+
+                continue;
+            }
+
+            PDIFF_SECTOR_BITMAP bitmap =
+                AIMWrFltrGetSectorBitmap(DeviceExtension, block);
+
+            if (AIMWrFltrAnySectorMissing(bitmap, 0,
+                DIFF_BLOCK_SIZE(DeviceExtension)))
+            {
+                RtlZeroMemory(bitmap, DIFF_SECTOR_BITMAP_SIZE(DeviceExtension));
+
+                AIMWrFltrMarkPageDirty(DeviceExtension->SectorBitmapDirty,
+                    (ULONG)(block /
+                        DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension)));
+            }
+
+            ++block;
+        }
+    }
+}
+
+VOID
+AIMWrFltrFreeTrimmedBlocks(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PDEVICE_DATA_SET_RANGE Ranges,
+    IN ULONG NumberOfRanges)
+{
+    if (DeviceExtension->FreeBlockMap.Buffer == NULL)
+    {
+        return;
+    }
+
+    // Blocks stay allocated if direct reads and writes do not finish.
+    // Their data at diff device has been trimmed either way.
+    NTSTATUS status = AIMWrFltrStartRelocation(DeviceExtension);
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("AIMWrFltrFreeTrimmedBlocks: Volume busy, trimmed blocks not freed for %p.\n",
+            DeviceExtension->DeviceObject));
+
+        return;
+    }
+
+    LONGLONG freed = 0;
+    bool sectors_missing = false;
+
+    for (ULONG i = 0; i < NumberOfRanges && NT_SUCCESS(status); i++)
+    {
+        // Allocation blocks completely within range
+        LONGLONG block = DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+            Ranges[i].StartingOffset + DIFF_BLOCK_SIZE(DeviceExtension) - 1);
+
+        LONGLONG end_block = DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+            Ranges[i].StartingOffset + (LONGLONG)Ranges[i].LengthInBytes);
+
+        while (block < end_block)
+        {
+            LONG volatile * entry =
+                AIMWrFltrGetTableEntry(DeviceExtension, block);
+
+            if (entry == NULL)
+            {
+                block = ((LONGLONG)DIFF_TABLE_GET_LEAF(DeviceExtension, block) + 1)
+                    << DIFF_TABLE_LEAF_BITS(DeviceExtension);
+
+                continue;
+            }
+
+            LONG block_address = *entry;
+
+            if (block_address == DIFF_BLOCK_UNALLOCATED ||
+                block_address == DIFF_BLOCK_CLAIMED)
+            {
+                ++block;
+
+                continue;
+            }
+
+            if (DeviceExtension->PendingFreeCount >= COMPACT_PENDING_BLOCKS)
+            {
+                AIMWrFltrReleasePendingFreeBlocks(DeviceExtension);
+
+                // Rest of trimmed blocks stay allocated
+                if (DeviceExtension->PendingFreeCount > 0)
+                {
+                    status = STATUS_DEVICE_BUSY;
+
+                    break;
+                }
+            }
+
+            InterlockedExchange(entry, DIFF_BLOCK_UNALLOCATED);
+
+            AIMWrFltrMarkPageDirty(DeviceExtension->AllocationTableDirty,
+                DIFF_TABLE_GET_LEAF(DeviceExtension, block));
+
+            if (AIMWrFltrAnySectorMissing(
+                AIMWrFltrGetSectorBitmap(DeviceExtension, block), 0,
+                DIFF_BLOCK_SIZE(DeviceExtension)))
+            {
+                sectors_missing = true;
+            }
+
+            AIMWrFltrJournalAppend(DeviceExtension, block, 1,
+                AIMWRFLTR_JOURNAL_FREE_BLOCK, 0, 0);
+
+            DeviceExtension->PendingFreeBlocks[
+                DeviceExtension->PendingFreeCount++] = block_address;
+
+            ++freed;
+            ++block;
+        }
+    }
+
+    AIMWrFltrEndRelocation(DeviceExtension);
+
+    if (freed > 0)
+    {
+        DeviceExtension->Statistics.TrimFreedBlocks += freed;
+
+        // Pending blocks are released by compaction when volume is idle
+        DeviceExtension->CompactIdleWrites = -1;
+    }
+
+    if (!sectors_missing)
+    {
+        return;
+    }
+
+    // Blocks allocated again are not always given a new sector bitmap, so
+    // bitmaps of freed blocks are cleared, once journal records that free
+    // them are at diff device
+    AIMWrFltrFlushJournal(DeviceExtension);
+
+    AIMWrFltrClearTrimmedSectorBitmaps(DeviceExtension, Ranges,
+        NumberOfRanges);
+}
@@ -48,7 +48,11 @@ typedef LONG NTSTATUS, *PNTSTATUS;
 // that the filter driver is currently using for a filtered device.
 //
 // Size of output buffer for this request need to be at least
-// sizeof(AIMWRFLTR_DEVICE_STATISTICS).
+// AIMWRFLTR_DEVICE_STATISTICS_MIN_SIZE, the size of the structure before
+// fields from CompactedBlocks on were added. Fields that fit in output
+// buffer are returned, up to sizeof(AIMWRFLTR_DEVICE_STATISTICS), and
+// number of bytes returned tells which of them are valid. Version field
+// holds structure size of driver.
 //
 
 #define IOCTL_AIMWRFLTR_GET_DEVICE_DATA         CTL_CODE(0x8844UL, 0xD01UL, METHOD_BUFFERED, 0)
@@ -169,9 +173,17 @@ typedef struct _AIMWRFLTR_VBR_HEAD_FIELDS
     LARGE_INTEGER Size;
 
     //
-    // Number of allocation blocks reserved at the beginning of
-    // diff device for future use for saving allocation table
-    // between reboots.
+    // Number of allocation blocks reserved for allocation table
+    // directory at OffsetToAllocationTable. From version 3.0, this has
+    // one LONG for each leaf of allocation table entries for protected
+    // volume, with diff device block number where leaf is saved, or zero
+    // if no block within leaf has been written. Each leaf fills one
+    // allocation block, with one LONG diff block number for each
+    // allocation block at protected volume. Earlier versions saved a flat
+    // table with one entry for each allocation block here, at
+    // OffsetToAllocationTable counted in bytes rather than 512 byte
+    // units. Those are converted to leaves when opened by a version 3.0
+    // or later driver.
     //
     LONG AllocationTableBlocks;
 
@@ -181,10 +193,48 @@ typedef struct _AIMWRFLTR_VBR_HEAD_FIELDS
     LONG LastAllocatedBlock;
 
     //
-    // Number of bits in block size calculations.
+    // Number of bits in block size calculations, 12 (4 KB) to 21 (2 MB).
+    // Set when diff device is created. Zero in diff devices created by
+    // drivers that always used 64 KB blocks.
     //
     UCHAR DiffBlockBits;
 
+    //
+    // Sector bitmap directory, added in version 2.0. One LONG for each
+    // chunk of allocation blocks at protected volume, with diff device
+    // block number where sector bitmaps for that chunk are saved, or zero
+    // if all allocated blocks in chunk are complete at diff device. Each
+    // chunk fills one allocation block. Sector bitmaps have one bit for
+    // each 512 byte sector, rounded up to a multiple of 8 bytes for each
+    // allocation block, so that with 64 KB blocks they are 16 bytes for
+    // each of 4096 blocks in a chunk. Bits are set for sectors not
+    // written to diff device and read from original device instead.
+    // Version 1.0 diff devices only have complete allocation blocks and
+    // get an empty directory when opened by a version 2.0 driver.
+    //
+    LONGLONG OffsetToSectorBitmap;
+    LONGLONG SizeOfSectorBitmap;
+
+    //
+    // Allocation journal, added in version 4.0. Circular area of
+    // AIMWRFLTR_JOURNAL_RECORD sectors with allocation table and sector
+    // bitmap changes made since allocation table and sector bitmaps were
+    // last saved. Record with sequence number n is at sector n modulo
+    // number of sectors in journal. Records are written when flush
+    // requests are processed, after data they refer to has been flushed
+    // at diff device. Version 3.0 diff devices get an empty journal when
+    // opened by a version 4.0 driver.
+    //
+    LONGLONG OffsetToJournal;
+    LONGLONG SizeOfJournal;
+
+    //
+    // Sequence number of first journal record with changes that are not
+    // in allocation table and sector bitmaps saved at diff device.
+    // Records from this one on are replayed when diff device is opened.
+    //
+    ULONGLONG JournalCheckpoint;
+
 } AIMWRFLTR_VBR_HEAD_FIELDS, *PAIMWRFLTR_VBR_HEAD_FIELDS;
 
 //
@@ -231,6 +281,62 @@ typedef union _AIMWRFLTR_VBR
 
 } AIMWRFLTR_VBR, *PAIMWRFLTR_VBR;
 
+//
+// Allocation journal entry. Sets allocation table entry for Block to
+// BlockAddress, unless that is zero. If Sectors is not zero, sectors
+// FirstSector to FirstSector + Sectors - 1 within the block are marked
+// as written to diff device in sector bitmap. For a new block, where
+// BlockAddress is also set, all other sectors of the block are marked as
+// missing. BlockAddress AIMWRFLTR_JOURNAL_FREE_BLOCK, with Sectors zero,
+// sets allocation table entry back to unallocated, for a block that has
+// been trimmed completely. Those entries were added in version 4.1, and
+// version 4.0 drivers do not open diff devices with such entries in
+// journal.
+//
+
+typedef struct _AIMWRFLTR_JOURNAL_ENTRY
+{
+    LONGLONG Block;
+
+    LONG BlockAddress;
+
+    USHORT FirstSector;
+
+    USHORT Sectors;
+
+} AIMWRFLTR_JOURNAL_ENTRY, *PAIMWRFLTR_JOURNAL_ENTRY;
+
+#define AIMWRFLTR_JOURNAL_FREE_BLOCK            (-1L)
+
+#define AIMWRFLTR_JOURNAL_RECORD_MAGIC          0x4C4E524AUL
+#define AIMWRFLTR_JOURNAL_RECORD_ENTRIES        30
+
+//
+// Allocation journal record, one 512 byte sector at diff device. Magic is
+// AIMWRFLTR_JOURNAL_RECORD_MAGIC and Checksum is 32 bit FNV-1a of all 512
+// bytes with Checksum field set to zero. Records are only valid with
+// Sequence matching their position in journal, so that records left from
+// an earlier round through journal are not replayed.
+//
+
+typedef struct _AIMWRFLTR_JOURNAL_RECORD
+{
+    ULONG Magic;
+
+    ULONG Checksum;
+
+    ULONGLONG Sequence;
+
+    ULONG Count;
+
+    ULONG Reserved;
+
+    AIMWRFLTR_JOURNAL_ENTRY Entries[AIMWRFLTR_JOURNAL_RECORD_ENTRIES];
+
+    UCHAR NotUsed[8];
+
+} AIMWRFLTR_JOURNAL_RECORD, *PAIMWRFLTR_JOURNAL_RECORD;
+
 //
 // Device statistics
 //
@@ -436,8 +542,94 @@ typedef struct _AIMWRFLTR_DEVICE_STATISTICS
     //
     AIMWRFLTR_VBR DiffDeviceVbr;
 
+    //
+    // Number of allocation blocks at diff device that background
+    // compaction has moved to make blocks next to each other at
+    // protected volume contiguous at diff device, or to free blocks at
+    // the end of diff device. Includes allocation table leaves and sector
+    // bitmap chunks moved.
+    //
+    LONGLONG CompactedBlocks;
+
+    //
+    // Total number of bytes copied by background compaction.
+    //
+    LONGLONG CompactedBytes;
+
+    //
+    // Number of complete compaction passes over allocation table.
+    //
+    LONGLONG CompactionPasses;
+
+    //
+    // Allocation block at protected volume where current compaction pass
+    // continues. Compared to number of allocation blocks in Size, this
+    // shows progress of the pass.
+    //
+    LONGLONG NextCompactBlock;
+
+    //
+    // Number of runs of allocation blocks that are contiguous both at
+    // protected volume and at diff device, counted by last complete
+    // compaction pass. Equal to number of allocated blocks when nothing
+    // is contiguous, lower after compaction.
+    //
+    LONGLONG DiffFragments;
+
+    //
+    // Number of blocks that LastAllocatedBlock has been lowered by, when
+    // compaction left free blocks at the end of diff device.
+    //
+    LONGLONG ReclaimedDiffBlocks;
+
+    //
+    // Number of free blocks below LastAllocatedBlock that are allocated
+    // again before new blocks are added at the end of diff device.
+    //
+    LONG FreeDiffBlocks;
+
+    //
+    // Number of allocation blocks that trim requests have covered
+    // completely, so that their diff blocks have been freed and the blocks
+    // are read from original device again.
+    //
+    LONGLONG TrimFreedBlocks;
+
+    //
+    // Number of deferred write waves that sent fill reads to original
+    // device. Fill reads of all new blocks in a wave run in parallel.
+    //
+    LONGLONG FillReadWaves;
+
+    //
+    // Total time, in 100 ns units, that worker threads have waited for
+    // fill reads of waves in FillReadWaves to complete. Divided by
+    // FillReadWaves, this gives average fill read latency seen by
+    // deferred writes.
+    //
+    LONGLONG FillReadWaitTime;
+
+    //
+    // Number of new allocation blocks where sector aligned writes only
+    // wrote sectors supplied, and marked the rest as missing in sector
+    // bitmap, instead of filling up block with reads from original device.
+    //
+    LONGLONG PartialNewBlocks;
+
+    //
+    // Total number of bytes in PartialNewBlocks left missing at diff
+    // device. These bytes would have been read by fill reads before.
+    //
+    LONGLONG FillReadBytesAvoided;
+
 } AIMWRFLTR_DEVICE_STATISTICS, *PAIMWRFLTR_DEVICE_STATISTICS;
 
+//
+// Smallest output buffer accepted by IOCTL_AIMWRFLTR_GET_DEVICE_DATA
+//
+#define AIMWRFLTR_DEVICE_STATISTICS_MIN_SIZE \
+    FIELD_OFFSET(AIMWRFLTR_DEVICE_STATISTICS, CompactedBlocks)
+
 //
 // Value of AllocationTableBlocks converted to bytes instead
 // of number of allocation blocks.
@@ -21,8 +21,11 @@ AIMWrFltrDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     {
     case IOCTL_AIMWRFLTR_GET_DEVICE_DATA:
     {
-        if (io_stack->Parameters.DeviceIoControl.OutputBufferLength <
-            sizeof(AIMWRFLTR_DEVICE_STATISTICS))
+        ULONG length = io_stack->Parameters.DeviceIoControl.OutputBufferLength;
+
+        // Callers built before fields were appended to the structure pass
+        // smaller buffers. Return as many fields as fit.
+        if (length < AIMWRFLTR_DEVICE_STATISTICS_MIN_SIZE)
         {
             status = STATUS_BUFFER_TOO_SMALL;
 
@@ -31,14 +34,19 @@ AIMWrFltrDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
             return status;
         }
 
+        if (length > sizeof(AIMWRFLTR_DEVICE_STATISTICS))
+        {
+            length = sizeof(AIMWRFLTR_DEVICE_STATISTICS);
+        }
+
         RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer,
             &device_extension->Statistics,
-            sizeof(AIMWRFLTR_DEVICE_STATISTICS));
+            length);
 
         status = STATUS_SUCCESS;
 
         Irp->IoStatus.Status = status;
-        Irp->IoStatus.Information = sizeof(AIMWRFLTR_DEVICE_STATISTICS);
+        Irp->IoStatus.Information = length;
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
         return status;
     }
@@ -521,36 +529,36 @@ AIMWrFltrDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
                 if (range[i].LengthInBytes == 0)
                     continue;
 
-                LONG first = (LONG)
-                    DIFF_GET_BLOCK_NUMBER(range[i].StartingOffset);
-                LONG last = (LONG)
-                    DIFF_GET_BLOCK_NUMBER(range[i].StartingOffset +
+                LONGLONG first = (LONGLONG)
+                    DIFF_GET_BLOCK_NUMBER(device_extension, range[i].StartingOffset);
+                LONGLONG last = (LONGLONG)
+                    DIFF_GET_BLOCK_NUMBER(device_extension, range[i].StartingOffset +
                         range[i].LengthInBytes - 1);
 
                 ULONGLONG length_done = 0;
 
                 for (
-                    LONG b = first;
+                    LONGLONG b = first;
                     (!allocated) && (b <= last);
                     b++)
                 {
                     LONGLONG abs_offset_this_iter =
                         range[i].StartingOffset + length_done;
                     ULONG page_offset_this_iter =
-                        DIFF_GET_BLOCK_OFFSET(abs_offset_this_iter);
+                        DIFF_GET_BLOCK_OFFSET(device_extension, abs_offset_this_iter);
                     ULONGLONG bytes_this_iter =
                         range[i].LengthInBytes - length_done;
 
                     if ((page_offset_this_iter + bytes_this_iter) >
-                        DIFF_BLOCK_SIZE)
+                        DIFF_BLOCK_SIZE(device_extension))
                     {
-                        bytes_this_iter = DIFF_BLOCK_SIZE -
+                        bytes_this_iter = DIFF_BLOCK_SIZE(device_extension) -
                             page_offset_this_iter;
                     }
 
                     length_done += bytes_this_iter;
 
-                    if (device_extension->AllocationTable[b] !=
+                    if (AIMWrFltrGetDiffBlock(device_extension, b) !=
                         DIFF_BLOCK_UNALLOCATED)
                     {
                         allocated = true;
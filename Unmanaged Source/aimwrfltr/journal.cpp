@@ -0,0 +1,533 @@
+#include "aimwrfltr.h"
+
+C_ASSERT(sizeof(AIMWRFLTR_JOURNAL_RECORD) == SECTOR_SIZE);
+
+//
+// 32 bit FNV-1a of a journal record with Checksum field set to zero.
+//
+static ULONG
+AIMWrFltrJournalChecksum(IN PAIMWRFLTR_JOURNAL_RECORD Record)
+{
+    ULONG saved_checksum = Record->Checksum;
+    Record->Checksum = 0;
+
+    ULONG hash = 2166136261UL;
+    PUCHAR bytes = (PUCHAR)Record;
+
+    for (ULONG i = 0; i < sizeof(*Record); i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619UL;
+    }
+
+    Record->Checksum = saved_checksum;
+
+    return hash;
+}
+
+VOID
+AIMWrFltrJournalAppend(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Block,
+    IN ULONG Blocks,
+    IN LONG BlockAddress,
+    IN ULONG FirstSector,
+    IN ULONG Sectors)
+{
+    if (DeviceExtension->JournalEntries == NULL)
+    {
+        return;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->JournalLock, &irql);
+
+    if (DeviceExtension->JournalOverflow ||
+        DeviceExtension->JournalEntryCount + Blocks > DIFF_JOURNAL_ENTRIES)
+    {
+        // Changes are still in allocation table and sector bitmaps, and
+        // next flush saves those instead
+        DeviceExtension->JournalOverflow = true;
+    }
+    else
+    {
+        for (ULONG i = 0; i < Blocks; i++)
+        {
+            PAIMWRFLTR_JOURNAL_ENTRY entry = &DeviceExtension->JournalEntries[
+                DeviceExtension->JournalEntryCount++];
+
+            entry->Block = Block + i;
+            entry->BlockAddress = BlockAddress == DIFF_BLOCK_UNALLOCATED ||
+                BlockAddress == AIMWRFLTR_JOURNAL_FREE_BLOCK ?
+                BlockAddress : BlockAddress + (LONG)i;
+            entry->FirstSector = (USHORT)FirstSector;
+            entry->Sectors = (USHORT)Sectors;
+        }
+    }
+
+    KeReleaseSpinLock(&DeviceExtension->JournalLock, irql);
+}
+
+ULONGLONG
+AIMWrFltrStartJournalCheckpoint(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension->JournalEntries == NULL)
+    {
+        return DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            JournalCheckpoint;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->JournalLock, &irql);
+
+    DeviceExtension->JournalEntryCount = 0;
+    DeviceExtension->JournalOverflow = false;
+
+    KeReleaseSpinLock(&DeviceExtension->JournalLock, irql);
+
+    return DeviceExtension->JournalSequence;
+}
+
+VOID
+AIMWrFltrSetJournalOverflow(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension->JournalEntries == NULL)
+    {
+        return;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->JournalLock, &irql);
+
+    DeviceExtension->JournalOverflow = true;
+
+    KeReleaseSpinLock(&DeviceExtension->JournalLock, irql);
+}
+
+NTSTATUS
+AIMWrFltrCommitJournal(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    LARGE_INTEGER offset;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    if (DeviceExtension->JournalEntries == NULL)
+    {
+        return AIMWrFltSaveDiffHeader(DeviceExtension);
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&DeviceExtension->JournalLock, &irql);
+
+    bool overflow = DeviceExtension->JournalOverflow;
+    ULONG count = 0;
+
+    if (!overflow)
+    {
+        count = DeviceExtension->JournalEntryCount;
+
+        RtlCopyMemory(DeviceExtension->JournalCommitEntries,
+            DeviceExtension->JournalEntries,
+            count * sizeof(AIMWRFLTR_JOURNAL_ENTRY));
+
+        DeviceExtension->JournalEntryCount = 0;
+    }
+
+    KeReleaseSpinLock(&DeviceExtension->JournalLock, irql);
+
+    if (overflow)
+    {
+        return AIMWrFltSaveDiffHeader(DeviceExtension);
+    }
+
+    if (count == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    ULONG journal_sectors = (ULONG)DeviceExtension->Statistics.DiffDeviceVbr.
+        Fields.Head.SizeOfJournal;
+
+    ULONG records = (count + AIMWRFLTR_JOURNAL_RECORD_ENTRIES - 1) /
+        AIMWRFLTR_JOURNAL_RECORD_ENTRIES;
+
+    // Records from checkpoint on must not be overwritten. Entries taken
+    // above are for changes already in allocation table and sector
+    // bitmaps, so they are included when header is saved instead.
+    if (DeviceExtension->JournalSequence + records -
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        JournalCheckpoint > journal_sectors)
+    {
+        return AIMWrFltSaveDiffHeader(DeviceExtension);
+    }
+
+    // Entries are only added after data writes they refer to have
+    // completed, so this makes that data durable before records are
+    // written
+    status = AIMWrFltrSynchronousReadWrite(
+        DeviceExtension->DiffDeviceObject,
+        DeviceExtension->DiffFileObject,
+        IRP_MJ_FLUSH_BUFFERS);
+
+    if (!NT_SUCCESS(status))
+    {
+        AIMWrFltrSetJournalOverflow(DeviceExtension);
+
+        return status;
+    }
+
+    for (ULONG i = 0; i < records; i++)
+    {
+        PAIMWRFLTR_JOURNAL_RECORD record = &DeviceExtension->JournalRecords[i];
+
+        RtlZeroMemory(record, sizeof(*record));
+
+        record->Magic = AIMWRFLTR_JOURNAL_RECORD_MAGIC;
+        record->Sequence = DeviceExtension->JournalSequence + i;
+        record->Count = min(count - i * AIMWRFLTR_JOURNAL_RECORD_ENTRIES,
+            (ULONG)AIMWRFLTR_JOURNAL_RECORD_ENTRIES);
+
+        RtlCopyMemory(record->Entries, DeviceExtension->JournalCommitEntries +
+            i * AIMWRFLTR_JOURNAL_RECORD_ENTRIES,
+            record->Count * sizeof(AIMWRFLTR_JOURNAL_ENTRY));
+
+        record->Checksum = AIMWrFltrJournalChecksum(record);
+    }
+
+    // Records wrap around to start of journal, so write in up to two
+    // parts
+    for (ULONG done = 0; done < records; )
+    {
+        ULONG position = (ULONG)((DeviceExtension->JournalSequence + done) %
+            journal_sectors);
+
+        ULONG length = min(records - done, journal_sectors - position) <<
+            SECTOR_BITS;
+
+        offset.QuadPart = (DeviceExtension->Statistics.DiffDeviceVbr.Fields.
+            Head.OffsetToJournal + position) << SECTOR_BITS;
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_WRITE,
+            DeviceExtension->JournalRecords + done,
+            length,
+            &offset,
+            &io_status);
+
+        if (!NT_SUCCESS(status) || io_status.Information != length)
+        {
+            DbgPrint("AIMWrFiltr: Error writing allocation journal: %#x\n", status);
+
+            return AIMWrFltSaveDiffHeader(DeviceExtension);
+        }
+
+        done += length >> SECTOR_BITS;
+    }
+
+    DeviceExtension->JournalSequence += records;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Applies one journal entry to allocation table and sector bitmaps and
+// marks changed leaves and chunks to be saved.
+//
+static NTSTATUS
+AIMWrFltrReplayJournalEntry(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PAIMWRFLTR_JOURNAL_ENTRY Entry,
+    IN ULONGLONG NumberOfBlocks)
+{
+    if (Entry->Block < 0 || (ULONGLONG)Entry->Block >= NumberOfBlocks ||
+        (Entry->BlockAddress < 0 &&
+            Entry->BlockAddress != AIMWRFLTR_JOURNAL_FREE_BLOCK) ||
+        (ULONG)Entry->FirstSector + Entry->Sectors >
+        DIFF_SECTORS_PER_BLOCK(DeviceExtension))
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    // Sector bitmap of a freed block is cleared here and not only with
+    // those of other unallocated blocks after replay, since later entries
+    // can allocate the block again without setting its bitmap
+    if (Entry->BlockAddress == AIMWRFLTR_JOURNAL_FREE_BLOCK)
+    {
+        LONG volatile * table_entry =
+            AIMWrFltrGetTableEntry(DeviceExtension, Entry->Block);
+
+        if (table_entry != NULL)
+        {
+            *table_entry = DIFF_BLOCK_UNALLOCATED;
+
+            AIMWrFltrMarkPageDirty(DeviceExtension->AllocationTableDirty,
+                DIFF_TABLE_GET_LEAF(DeviceExtension, Entry->Block));
+        }
+
+        PDIFF_SECTOR_BITMAP bitmap =
+            AIMWrFltrGetSectorBitmap(DeviceExtension, Entry->Block);
+
+        if (AIMWrFltrAnySectorMissing(bitmap, 0,
+            DIFF_BLOCK_SIZE(DeviceExtension)))
+        {
+            RtlZeroMemory(bitmap, DIFF_SECTOR_BITMAP_SIZE(DeviceExtension));
+
+            AIMWrFltrMarkPageDirty(DeviceExtension->SectorBitmapDirty,
+                (ULONG)(Entry->Block /
+                    DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension)));
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    if (Entry->Sectors != 0)
+    {
+        PDIFF_SECTOR_BITMAP bitmap =
+            AIMWrFltrAllocateSectorBitmap(DeviceExtension, Entry->Block);
+
+        if (bitmap == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (Entry->BlockAddress != DIFF_BLOCK_UNALLOCATED)
+        {
+            AIMWrFltrSetSectorsMissing(bitmap, 0,
+                DIFF_BLOCK_SIZE(DeviceExtension), true);
+        }
+
+        AIMWrFltrSetSectorsMissing(bitmap,
+            (ULONG)Entry->FirstSector << SECTOR_BITS,
+            (ULONG)Entry->Sectors << SECTOR_BITS, false);
+
+        AIMWrFltrMarkPageDirty(DeviceExtension->SectorBitmapDirty,
+            (ULONG)(Entry->Block /
+                DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension)));
+    }
+
+    if (Entry->BlockAddress != DIFF_BLOCK_UNALLOCATED)
+    {
+        LONG volatile * table_entry =
+            AIMWrFltrAllocateTableEntry(DeviceExtension, Entry->Block);
+
+        if (table_entry == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        *table_entry = Entry->BlockAddress;
+
+        AIMWrFltrMarkPageDirty(DeviceExtension->AllocationTableDirty,
+            DIFF_TABLE_GET_LEAF(DeviceExtension, Entry->Block));
+
+        if (Entry->BlockAddress > DeviceExtension->Statistics.DiffDeviceVbr.
+            Fields.Head.LastAllocatedBlock)
+        {
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                LastAllocatedBlock = Entry->BlockAddress;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Clears sector bitmaps of unallocated blocks. Bitmap chunks are saved
+// before allocation table leaves, so after a crash, chunks can have
+// bitmaps for new blocks that leaves saved do not have. Those blocks are
+// unallocated, and when allocated again, they must not have sectors
+// marked as missing from before. Saved leaves can also have blocks freed
+// by trim requests, where chunks saved earlier still have their bitmaps.
+// Journal entries for new blocks written completely do not set bitmaps,
+// so this is done both before and after replay.
+//
+static VOID
+AIMWrFltrClearUnallocatedSectorBitmaps(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONGLONG NumberOfBlocks)
+{
+    ULONG blocks_per_chunk =
+        DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension);
+
+    for (ULONG i = 0; i < DeviceExtension->SectorBitmapChunks; i++)
+    {
+        PDIFF_SECTOR_BITMAP chunk = DeviceExtension->SectorBitmap[i];
+
+        if (chunk == NULL)
+        {
+            continue;
+        }
+
+        for (ULONGLONG block = (ULONGLONG)i * blocks_per_chunk;
+            block < min((ULONGLONG)(i + 1) * blocks_per_chunk, NumberOfBlocks);
+            block++)
+        {
+            if (AIMWrFltrReadTableEntry(DeviceExtension, block) !=
+                DIFF_BLOCK_UNALLOCATED)
+            {
+                continue;
+            }
+
+            PDIFF_SECTOR_BITMAP bitmap =
+                AIMWrFltrSectorBitmapInChunk(DeviceExtension, chunk, block);
+
+            if (AIMWrFltrAnySectorMissing(bitmap, 0,
+                DIFF_BLOCK_SIZE(DeviceExtension)))
+            {
+                RtlZeroMemory(bitmap, DIFF_SECTOR_BITMAP_SIZE(DeviceExtension));
+
+                AIMWrFltrMarkPageDirty(DeviceExtension->SectorBitmapDirty, i);
+            }
+        }
+    }
+}
+
+VOID
+AIMWrFltrFreeJournal(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    delete[] DeviceExtension->JournalEntries;
+    DeviceExtension->JournalEntries = NULL;
+
+    delete[] DeviceExtension->JournalCommitEntries;
+    DeviceExtension->JournalCommitEntries = NULL;
+
+    delete[] DeviceExtension->JournalRecords;
+    DeviceExtension->JournalRecords = NULL;
+
+    DeviceExtension->JournalEntryCount = 0;
+    DeviceExtension->JournalOverflow = false;
+}
+
+NTSTATUS
+AIMWrFltrLoadJournal(IN PDEVICE_EXTENSION DeviceExtension,
+    IN bool NewJournal,
+    OUT PULONG ReplayedRecords)
+{
+    LARGE_INTEGER offset;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    *ReplayedRecords = 0;
+
+    ULONG journal_sectors = (ULONG)DeviceExtension->Statistics.DiffDeviceVbr.
+        Fields.Head.SizeOfJournal;
+
+    ULONG journal_size = journal_sectors << SECTOR_BITS;
+
+    // Zero filled by operator new
+    PAIMWRFLTR_JOURNAL_RECORD journal =
+        new AIMWRFLTR_JOURNAL_RECORD[journal_sectors];
+
+    DeviceExtension->JournalEntries =
+        new AIMWRFLTR_JOURNAL_ENTRY[DIFF_JOURNAL_ENTRIES];
+    DeviceExtension->JournalCommitEntries =
+        new AIMWRFLTR_JOURNAL_ENTRY[DIFF_JOURNAL_ENTRIES];
+    DeviceExtension->JournalRecords =
+        new AIMWRFLTR_JOURNAL_RECORD[DIFF_JOURNAL_RECORDS];
+
+    if (journal == NULL ||
+        DeviceExtension->JournalEntries == NULL ||
+        DeviceExtension->JournalCommitEntries == NULL ||
+        DeviceExtension->JournalRecords == NULL)
+    {
+        delete[] journal;
+
+        AIMWrFltrFreeJournal(DeviceExtension);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    offset.QuadPart = DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        OffsetToJournal << SECTOR_BITS;
+
+    // Reserved blocks can hold anything, including journal records from
+    // an earlier diff device at same location
+    status = AIMWrFltrSynchronousReadWrite(
+        DeviceExtension->DiffDeviceObject,
+        DeviceExtension->DiffFileObject,
+        NewJournal ? IRP_MJ_WRITE : IRP_MJ_READ,
+        journal,
+        journal_size,
+        &offset,
+        &io_status);
+
+    if (!NT_SUCCESS(status) || io_status.Information != journal_size)
+    {
+        DbgPrint("AIMWrFltrInitializeDiffDevice: Error %s allocation journal for %p: 0x%X\n",
+            NewJournal ? "writing" : "reading",
+            DeviceExtension->DeviceObject, status);
+
+        delete[] journal;
+
+        AIMWrFltrFreeJournal(DeviceExtension);
+
+        return NT_SUCCESS(status) ? STATUS_FILE_CORRUPT_ERROR : status;
+    }
+
+    ULONGLONG number_of_blocks = DIFF_GET_NUMBER_OF_BLOCKS(DeviceExtension,
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.Size.QuadPart);
+
+    ULONGLONG sequence = DeviceExtension->Statistics.DiffDeviceVbr.Fields.
+        Head.JournalCheckpoint;
+
+    status = STATUS_SUCCESS;
+
+    if (!NewJournal)
+    {
+        AIMWrFltrClearUnallocatedSectorBitmaps(DeviceExtension,
+            number_of_blocks);
+    }
+
+    // Replay stops at first record missing, which is where last write
+    // of records ended, or was torn by a crash
+    while (!NewJournal && *ReplayedRecords < journal_sectors)
+    {
+        PAIMWRFLTR_JOURNAL_RECORD record =
+            &journal[sequence % journal_sectors];
+
+        if (record->Magic != AIMWRFLTR_JOURNAL_RECORD_MAGIC ||
+            record->Sequence != sequence ||
+            record->Count > AIMWRFLTR_JOURNAL_RECORD_ENTRIES ||
+            record->Checksum != AIMWrFltrJournalChecksum(record))
+        {
+            break;
+        }
+
+        for (ULONG i = 0; i < record->Count && NT_SUCCESS(status); i++)
+        {
+            status = AIMWrFltrReplayJournalEntry(DeviceExtension,
+                &record->Entries[i], number_of_blocks);
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            DbgPrint("AIMWrFltrInitializeDiffDevice: Error replaying allocation journal for %p: 0x%X\n",
+                DeviceExtension->DeviceObject, status);
+
+            delete[] journal;
+
+            AIMWrFltrFreeJournal(DeviceExtension);
+
+            return status;
+        }
+
+        ++sequence;
+        ++*ReplayedRecords;
+    }
+
+    delete[] journal;
+
+    AIMWrFltrClearUnallocatedSectorBitmaps(DeviceExtension, number_of_blocks);
+
+    // Records after a missing one, and any left from earlier rounds
+    // through journal, have lower sequence numbers than new records
+    // written from one round further on
+    DeviceExtension->JournalSequence = NewJournal ? sequence :
+        sequence + journal_sectors;
+
+    if (*ReplayedRecords > 0)
+    {
+        DbgPrint("AIMWrFltrInitializeDiffDevice: Replayed %u allocation journal records for %p.\n",
+            *ReplayedRecords, DeviceExtension->DeviceObject);
+    }
+
+    return STATUS_SUCCESS;
+}
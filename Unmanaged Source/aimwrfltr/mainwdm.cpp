@@ -9,9 +9,39 @@ const UCHAR diff_file_magic[FIELD_SIZE(AIMWRFLTR_VBR_HEAD_FIELDS, Magic)] =
 
 const USHORT vbr_signature = 0xAA55;
 
-const ULONG major_version = 1UL;
+const ULONG major_version = 4UL;
 
-const ULONG minor_version = 0UL;
+//
+// Diff devices with this major version or earlier are upgraded to current
+// version when opened. Versions 1.0 and 2.0 have a flat allocation table,
+// which is converted to leaves. Version 1.0 also has no sector bitmaps, so
+// all of its allocated blocks are complete.
+//
+const ULONG migrate_major_version = 2UL;
+
+const ULONG sector_bitmap_major_version = 2UL;
+
+//
+// Diff devices from before this version have no allocation journal and
+// get an empty one when opened. Version 3.0 is otherwise opened as is.
+// Older drivers must not open a diff device with a journal, since they
+// would save allocation table without a journal checkpoint, and journal
+// records would later be replayed over newer changes.
+//
+const ULONG journal_major_version = 4UL;
+
+//
+// Version 4.1 adds journal entries that free trimmed blocks. Version 4.0
+// drivers refuse to open diff devices with such entries in journal, but
+// open them again once header has been saved.
+//
+const ULONG minor_version = 1UL;
+
+//
+// Block size of diff devices created before block size was saved in VBR.
+// Their DiffBlockBits field is zero.
+//
+const UCHAR legacy_diff_block_bits = 16;
 
 HANDLE AIMWrFltrParametersKey = NULL;
 PKEVENT AIMWrFltrDiffFullEvent = NULL;
@@ -28,6 +58,7 @@ bool AIMWrFltrLinksCreated = false;
 #pragma alloc_text (PAGE, AIMWrFltrCreate)
 #pragma alloc_text (PAGE, AIMWrFltrAddDevice)
 #pragma alloc_text (PAGE, AIMWrFltrGetDiffDevicePath)
+#pragma alloc_text (PAGE, AIMWrFltrGetDiffBlockBits)
 #pragma alloc_text (PAGE, AIMWrFltrPnp)
 #pragma alloc_text (PAGE, AIMWrFltrStartDevice)
 #pragma alloc_text (PAGE, AIMWrFltrRemoveDevice)
@@ -249,136 +280,1122 @@ AIMWrFltrSyncFilterWithTarget(IN PDEVICE_OBJECT FilterDevice,
     FilterDevice->Characteristics |= prop_flags;
 }
 
-NTSTATUS
-AIMWrFltSaveDiffHeader(IN PDEVICE_EXTENSION DeviceExtension)
+PDIFF_SECTOR_BITMAP
+AIMWrFltrAllocateSectorBitmap(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Block)
 {
-    LARGE_INTEGER offset;
-    IO_STATUS_BLOCK io_status;
+    if (DeviceExtension->SectorBitmap == NULL)
+    {
+        return NULL;
+    }
 
-    offset.QuadPart = 0;
+    ULONG chunk_index = (ULONG)Block /
+        DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension);
 
-    NTSTATUS status = AIMWrFltrSynchronousReadWrite(
-        DeviceExtension->DiffDeviceObject,
-        DeviceExtension->DiffFileObject,
-        IRP_MJ_WRITE,
-        DeviceExtension->Statistics.DiffDeviceVbr.Raw.Bytes,
-        sizeof(DeviceExtension->Statistics.DiffDeviceVbr),
-        &offset,
-        &io_status);
+    PDIFF_SECTOR_BITMAP chunk = DeviceExtension->SectorBitmap[chunk_index];
 
-    if (!NT_SUCCESS(status) || io_status.Information !=
-        sizeof(DeviceExtension->Statistics.DiffDeviceVbr))
+    if (chunk == NULL)
     {
-        DbgPrint("AIMWrFiltr: Error writing diff file header: %#x\n", status);
-        return status;
+        // Zero filled by operator new
+        chunk = (PDIFF_SECTOR_BITMAP)
+            new UCHAR[DIFF_BLOCK_SIZE(DeviceExtension)];
+
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+
+        InterlockedExchangePointer(
+            (PVOID volatile *)&DeviceExtension->SectorBitmap[chunk_index],
+            chunk);
     }
 
-    offset.QuadPart =
-        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.OffsetToAllocationTable;
+    return AIMWrFltrSectorBitmapInChunk(DeviceExtension, chunk, Block);
+}
 
-    ULONG alloc_table_size = (ULONG)DeviceExtension->Statistics.
-        DiffDeviceVbr.Fields.Head.AllocationTableBlocks << DIFF_BLOCK_BITS;
+//
+// Copies of pages, allocation table leaves or sector bitmap chunks, that
+// were marked in a dirty bitmap, in page order.
+//
+typedef struct _DIFF_PAGE_SNAPSHOT
+{
+    ULONG Count;
 
-    status = AIMWrFltrSynchronousReadWrite(
-        DeviceExtension->DiffDeviceObject,
-        DeviceExtension->DiffFileObject,
-        IRP_MJ_WRITE,
-        (PVOID)DeviceExtension->AllocationTable,
-        alloc_table_size,
-        &offset,
-        &io_status);
+    PULONG Pages;
 
-    if (io_status.Information != alloc_table_size || !NT_SUCCESS(status))
+    PUCHAR Data;
+
+} DIFF_PAGE_SNAPSHOT, *PDIFF_PAGE_SNAPSHOT;
+
+static bool
+AIMWrFltrAnyPageDirty(IN LONG volatile * DirtyBitmap,
+    IN ULONG NumberOfPages)
+{
+    if (DirtyBitmap == NULL)
     {
-        DbgPrint("AIMWrFiltr: Error writing diff allocation table: %#x\n", status);
-        return status;
+        return false;
+    }
+
+    for (ULONG i = 0; i < DIFF_DIRTY_BITMAP_WORDS(NumberOfPages); i++)
+    {
+        if (DirtyBitmap[i] != 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static VOID
+AIMWrFltrFreePageSnapshot(IN PDIFF_PAGE_SNAPSHOT Snapshot)
+{
+    delete[] Snapshot->Pages;
+    delete[] Snapshot->Data;
+
+    RtlZeroMemory(Snapshot, sizeof(*Snapshot));
+}
+
+//
+// Marks pages in a snapshot in dirty bitmap again, when they could not be
+// saved.
+//
+static VOID
+AIMWrFltrMarkSnapshotDirty(IN LONG volatile * DirtyBitmap,
+    IN PDIFF_PAGE_SNAPSHOT Snapshot)
+{
+    for (ULONG i = 0; i < Snapshot->Count; i++)
+    {
+        AIMWrFltrMarkPageDirty(DirtyBitmap, Snapshot->Pages[i]);
+    }
+}
+
+//
+// Copies pages marked in dirty bitmap and clears their marks. Pages that
+// change while this runs are marked again and saved next time.
+//
+static NTSTATUS
+AIMWrFltrSnapshotDirtyPages(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PVOID volatile * Pages,
+    IN ULONG NumberOfPages,
+    IN LONG volatile * DirtyBitmap,
+    OUT PDIFF_PAGE_SNAPSHOT Snapshot)
+{
+    RtlZeroMemory(Snapshot, sizeof(*Snapshot));
+
+    if (Pages == NULL || DirtyBitmap == NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    ULONG words = DIFF_DIRTY_BITMAP_WORDS(NumberOfPages);
+    ULONG count = 0;
+
+    for (ULONG i = 0; i < words; i++)
+    {
+        for (LONG marks = DirtyBitmap[i]; marks != 0; marks &= marks - 1)
+        {
+            ++count;
+        }
+    }
+
+    if (count == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    Snapshot->Pages = new ULONG[count];
+    Snapshot->Data =
+        new UCHAR[(SIZE_T)count << DIFF_BLOCK_BITS(DeviceExtension)];
+
+    if (Snapshot->Pages == NULL || Snapshot->Data == NULL)
+    {
+        AIMWrFltrFreePageSnapshot(Snapshot);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG i = 0; i < words; i++)
+    {
+        if (DirtyBitmap[i] == 0)
+        {
+            continue;
+        }
+
+        LONG marks = InterlockedExchange(&DirtyBitmap[i], 0);
+
+        for (; marks != 0; marks &= marks - 1)
+        {
+            // Marked after pages were counted, leave for next save
+            if (Snapshot->Count == count)
+            {
+                InterlockedOr(&DirtyBitmap[i], marks);
+                break;
+            }
+
+            ULONG bit;
+            BitScanForward(&bit, (ULONG)marks);
+
+            ULONG page = i * 32 + bit;
+
+            RtlCopyMemory(Snapshot->Data +
+                ((SIZE_T)Snapshot->Count << DIFF_BLOCK_BITS(DeviceExtension)),
+                Pages[page],
+                DIFF_BLOCK_SIZE(DeviceExtension));
+
+            Snapshot->Pages[Snapshot->Count++] = page;
+        }
     }
 
     return STATUS_SUCCESS;
 }
 
-VOID
-AIMWrFltrCleanupDevice(IN PDEVICE_EXTENSION DeviceExtension)
+//
+// Writes pages in a snapshot to their diff device blocks. Blocks for new
+// pages are allocated together, so that they can be written in the same
+// request as adjacent ones, and directory sectors with their entries are
+// written after them, once they have been flushed to diff device. Until
+// then, new blocks can hold anything, such as data from blocks that were
+// allocated but never saved in allocation table before a crash.
+// Directory is at DirectoryOffset, in sectors. Called before VBR is
+// saved, since this can change LastAllocatedBlock.
+//
+static NTSTATUS
+AIMWrFltrWritePageSnapshot(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PLONG PageBlocks,
+    IN LONGLONG DirectoryOffset,
+    IN PDIFF_PAGE_SNAPSHOT Snapshot)
 {
-    PAGED_CODE();
+    LARGE_INTEGER offset;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status = STATUS_SUCCESS;
 
-    if (DeviceExtension->WorkerThread != NULL)
+    ULONG new_pages = 0;
+    ULONG first_new_page = MAXULONG;
+    ULONG last_new_page = 0;
+
+    for (ULONG i = 0; i < Snapshot->Count; i++)
     {
-        DeviceExtension->ShutdownThread = true;
-        KeSetEvent(&DeviceExtension->ListEvent, 0, FALSE);
-        ZwWaitForSingleObject(DeviceExtension->WorkerThread, FALSE, NULL);
-        ZwClose(DeviceExtension->WorkerThread);
-        DeviceExtension->WorkerThread = NULL;
+        if (PageBlocks[Snapshot->Pages[i]] == DIFF_BLOCK_UNALLOCATED)
+        {
+            ++new_pages;
+        }
     }
 
-    if (DeviceExtension->AllocationTable != NULL &&
-        DeviceExtension->Statistics.Initialized)
+    LONG first_new_block = DIFF_BLOCK_UNALLOCATED;
+
+    if (new_pages > 0)
     {
-        AIMWrFltSaveDiffHeader(DeviceExtension);
+        first_new_block = AIMWrFltrAllocateDiffBlocks(DeviceExtension,
+            (LONG)new_pages);
 
-        delete[] DeviceExtension->AllocationTable;
-        DeviceExtension->AllocationTable = NULL;
+        LONG block_address = first_new_block;
+
+        for (ULONG i = 0; i < Snapshot->Count; i++)
+        {
+            ULONG page = Snapshot->Pages[i];
+
+            if (PageBlocks[page] == DIFF_BLOCK_UNALLOCATED)
+            {
+                PageBlocks[page] = block_address++;
+                first_new_page = min(first_new_page, page);
+                last_new_page = max(last_new_page, page);
+            }
+        }
     }
 
-    if (DeviceExtension->DiffFileObject != NULL)
+    ULONG max_run = max(1UL,
+        DIFF_HEADER_WRITE_SIZE >> DIFF_BLOCK_BITS(DeviceExtension));
+
+    for (ULONG i = 0; i < Snapshot->Count; )
     {
-        ObDereferenceObject(DeviceExtension->DiffFileObject);
-        DeviceExtension->DiffDeviceObject = NULL;
-        DeviceExtension->DiffFileObject = NULL;
+        LONG block_address = PageBlocks[Snapshot->Pages[i]];
+        ULONG run = 1;
+
+        while (i + run < Snapshot->Count && run < max_run &&
+            PageBlocks[Snapshot->Pages[i + run]] == block_address + (LONG)run)
+        {
+            ++run;
+        }
+
+        ULONG length = run << DIFF_BLOCK_BITS(DeviceExtension);
+
+        offset.QuadPart = (LONGLONG)block_address <<
+            DIFF_BLOCK_BITS(DeviceExtension);
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_WRITE,
+            Snapshot->Data + ((SIZE_T)i << DIFF_BLOCK_BITS(DeviceExtension)),
+            length,
+            &offset,
+            &io_status);
+
+        if (NT_SUCCESS(status) && io_status.Information != length)
+        {
+            status = STATUS_IO_DEVICE_ERROR;
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            break;
+        }
+
+        i += run;
     }
 
-    if (DeviceExtension->DiffDeviceHandle != NULL)
+    if (NT_SUCCESS(status) && new_pages > 0)
     {
-        IO_STATUS_BLOCK io_status;
-        ZwFlushBuffersFile(DeviceExtension->DiffDeviceHandle, &io_status);
-        ZwClose(DeviceExtension->DiffDeviceHandle);
-        DeviceExtension->DiffDeviceHandle = NULL;
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_FLUSH_BUFFERS);
+    }
+
+    if (NT_SUCCESS(status) && new_pages > 0)
+    {
+        ULONG first_byte = (first_new_page * sizeof(LONG)) &
+            ~(SECTOR_SIZE - 1);
+        ULONG end_byte = ((last_new_page + 1) * sizeof(LONG) +
+            SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+
+        offset.QuadPart = (DirectoryOffset << SECTOR_BITS) + first_byte;
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_WRITE,
+            (PUCHAR)PageBlocks + first_byte,
+            end_byte - first_byte,
+            &offset,
+            &io_status);
+
+        if (NT_SUCCESS(status) &&
+            io_status.Information != end_byte - first_byte)
+        {
+            status = STATUS_IO_DEVICE_ERROR;
+        }
+    }
+
+    // New pages get new blocks next time, since directory entries for
+    // these might not have been saved
+    if (!NT_SUCCESS(status) && new_pages > 0)
+    {
+        for (ULONG i = 0; i < Snapshot->Count; i++)
+        {
+            ULONG page = Snapshot->Pages[i];
+
+            if (PageBlocks[page] >= first_new_block &&
+                PageBlocks[page] < first_new_block + (LONG)new_pages)
+            {
+                PageBlocks[page] = DIFF_BLOCK_UNALLOCATED;
+            }
+        }
+    }
+
+    return status;
+}
+
+VOID
+AIMWrFltrFreeSectorBitmap(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension->SectorBitmap != NULL)
+    {
+        for (ULONG i = 0; i < DeviceExtension->SectorBitmapChunks; i++)
+        {
+            delete[] (PUCHAR)DeviceExtension->SectorBitmap[i];
+        }
+
+        delete[] DeviceExtension->SectorBitmap;
+        DeviceExtension->SectorBitmap = NULL;
     }
+
+    delete[] DeviceExtension->SectorBitmapBlocks;
+    DeviceExtension->SectorBitmapBlocks = NULL;
+
+    delete[] (PLONG)DeviceExtension->SectorBitmapDirty;
+    DeviceExtension->SectorBitmapDirty = NULL;
+
+    DeviceExtension->SectorBitmapChunks = 0;
 }
 
+//
+// Creates sector bitmap directory and chunks in memory. Directory is
+// read from diff device followed by chunks it references, unless it was
+// just reserved at diff device, in which case an empty directory is
+// written there.
+//
 NTSTATUS
-AIMWrFltrGetDiffDevicePath(IN PUNICODE_STRING MountDevName,
-    OUT PKEY_VALUE_PARTIAL_INFORMATION DiffDevicePath,
-    IN ULONG DiffDevicePathSize)
+AIMWrFltrLoadSectorBitmap(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONGLONG NumberOfBlocks,
+    IN bool NewDirectory)
 {
-    PAGED_CODE();
+    LARGE_INTEGER offset;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
 
-    KdPrint(("AIMWrFltrGetDiffDevicePath: Device assigned link '%wZ'\n",
-        MountDevName));
+    ULONG chunks = (ULONG)((NumberOfBlocks +
+        DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension) - 1) /
+        DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension));
+
+    ULONG directory_size = (ULONG)DeviceExtension->Statistics.DiffDeviceVbr.
+        Fields.Head.SizeOfSectorBitmap << SECTOR_BITS;
+
+    if (directory_size < chunks * sizeof(LONG))
+    {
+        DbgPrint("AIMWrFltrInitializeDiffDevice: Sector bitmap directory too small for %p.\n",
+            DeviceExtension->DeviceObject);
+
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    // Zero filled by operator new
+    DeviceExtension->SectorBitmapBlocks = new LONG[directory_size / sizeof(LONG)];
+    DeviceExtension->SectorBitmap = new PDIFF_SECTOR_BITMAP[chunks];
+    DeviceExtension->SectorBitmapDirty =
+        new LONG[DIFF_DIRTY_BITMAP_WORDS(chunks)];
+
+    if (DeviceExtension->SectorBitmapBlocks == NULL ||
+        DeviceExtension->SectorBitmap == NULL ||
+        DeviceExtension->SectorBitmapDirty == NULL)
+    {
+        AIMWrFltrFreeSectorBitmap(DeviceExtension);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    DeviceExtension->SectorBitmapChunks = chunks;
+
+    offset.QuadPart = DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        OffsetToSectorBitmap << SECTOR_BITS;
+
+    status = AIMWrFltrSynchronousReadWrite(
+        DeviceExtension->DiffDeviceObject,
+        DeviceExtension->DiffFileObject,
+        NewDirectory ? IRP_MJ_WRITE : IRP_MJ_READ,
+        DeviceExtension->SectorBitmapBlocks,
+        directory_size,
+        &offset,
+        &io_status);
+
+    if (!NT_SUCCESS(status) || io_status.Information != directory_size)
+    {
+        DbgPrint("AIMWrFltrInitializeDiffDevice: Error %s sector bitmap directory for %p: 0x%X\n",
+            NewDirectory ? "writing" : "reading",
+            DeviceExtension->DeviceObject, status);
+
+        AIMWrFltrFreeSectorBitmap(DeviceExtension);
+
+        return NT_SUCCESS(status) ? STATUS_FILE_CORRUPT_ERROR : status;
+    }
+
+    for (ULONG i = 0; i < chunks; i++)
+    {
+        if (DeviceExtension->SectorBitmapBlocks[i] == DIFF_BLOCK_UNALLOCATED)
+        {
+            continue;
+        }
+
+        DeviceExtension->SectorBitmap[i] = (PDIFF_SECTOR_BITMAP)
+            new UCHAR[DIFF_BLOCK_SIZE(DeviceExtension)];
+
+        if (DeviceExtension->SectorBitmap[i] == NULL)
+        {
+            AIMWrFltrFreeSectorBitmap(DeviceExtension);
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        offset.QuadPart = (LONGLONG)DeviceExtension->SectorBitmapBlocks[i] <<
+            DIFF_BLOCK_BITS(DeviceExtension);
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_READ,
+            DeviceExtension->SectorBitmap[i],
+            DIFF_BLOCK_SIZE(DeviceExtension),
+            &offset,
+            &io_status);
+
+        if (!NT_SUCCESS(status) ||
+            io_status.Information != DIFF_BLOCK_SIZE(DeviceExtension))
+        {
+            DbgPrint("AIMWrFltrInitializeDiffDevice: Error reading sector bitmap for %p: 0x%X\n",
+                DeviceExtension->DeviceObject, status);
+
+            AIMWrFltrFreeSectorBitmap(DeviceExtension);
+
+            return NT_SUCCESS(status) ? STATUS_FILE_CORRUPT_ERROR : status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+LONG volatile *
+AIMWrFltrAllocateTableEntry(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Block)
+{
+    ULONG leaf_index = DIFF_TABLE_GET_LEAF(DeviceExtension, Block);
+
+    LONG volatile * leaf = DeviceExtension->AllocationTable[leaf_index];
+
+    if (leaf == NULL)
+    {
+        // Zero filled by operator new
+        leaf = new LONG[DIFF_TABLE_ENTRIES_PER_LEAF(DeviceExtension)];
+
+        if (leaf == NULL)
+        {
+            return NULL;
+        }
+
+        // Direct writes and worker thread can allocate same leaf at the
+        // same time. Only one of them is kept.
+        LONG volatile * existing_leaf = (LONG volatile *)
+            InterlockedCompareExchangePointer(
+                (PVOID volatile *)&DeviceExtension->AllocationTable[leaf_index],
+                (PVOID)leaf, NULL);
+
+        if (existing_leaf != NULL)
+        {
+            delete[] (PLONG)leaf;
+            leaf = existing_leaf;
+        }
+    }
+
+    return leaf + DIFF_TABLE_GET_LEAF_ENTRY(DeviceExtension, Block);
+}
+
+//
+// Writes allocation table leaves marked as changed, allocating diff device
+// blocks for new ones, followed by directory entries for those. Used where
+// no data writes can be in progress. AIMWrFltSaveDiffHeader saves leaves
+// together with sector bitmap chunks and data they refer to.
+//
+NTSTATUS
+AIMWrFltrSaveAllocationTable(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    DIFF_PAGE_SNAPSHOT table;
+
+    NTSTATUS status = AIMWrFltrSnapshotDirtyPages(DeviceExtension,
+        (PVOID volatile *)DeviceExtension->AllocationTable,
+        DeviceExtension->AllocationTableLeaves,
+        DeviceExtension->AllocationTableDirty,
+        &table);
+
+    if (NT_SUCCESS(status))
+    {
+        status = AIMWrFltrWritePageSnapshot(DeviceExtension,
+            DeviceExtension->AllocationTableLeafBlocks,
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            OffsetToAllocationTable,
+            &table);
+
+        if (!NT_SUCCESS(status))
+        {
+            AIMWrFltrMarkSnapshotDirty(DeviceExtension->AllocationTableDirty,
+                &table);
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("AIMWrFiltr: Error writing diff allocation table: %#x\n", status);
+    }
+
+    AIMWrFltrFreePageSnapshot(&table);
+
+    return status;
+}
+
+VOID
+AIMWrFltrFreeAllocationTable(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension->AllocationTable != NULL)
+    {
+        for (ULONG i = 0; i < DeviceExtension->AllocationTableLeaves; i++)
+        {
+            delete[] (PLONG)DeviceExtension->AllocationTable[i];
+        }
+
+        delete[] DeviceExtension->AllocationTable;
+        DeviceExtension->AllocationTable = NULL;
+    }
+
+    delete[] DeviceExtension->AllocationTableLeafBlocks;
+    DeviceExtension->AllocationTableLeafBlocks = NULL;
+
+    delete[] (PLONG)DeviceExtension->AllocationTableDirty;
+    DeviceExtension->AllocationTableDirty = NULL;
+
+    DeviceExtension->AllocationTableLeaves = 0;
+}
+
+//
+// Reads a flat allocation table, as saved by version 2.0 and earlier, one
+// leaf at a time. Only leaves with any allocated block are kept, and
+// marked as changed.
+// FlatTableOffset is in bytes, as these versions used
+// OffsetToAllocationTable.
+//
+NTSTATUS
+AIMWrFltrConvertFlatAllocationTable(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG FlatTableOffset)
+{
+    LARGE_INTEGER offset;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    PLONG leaf = NULL;
+
+    for (ULONG i = 0; i < DeviceExtension->AllocationTableLeaves; i++)
+    {
+        if (leaf == NULL)
+        {
+            leaf = new LONG[DIFF_TABLE_ENTRIES_PER_LEAF(DeviceExtension)];
+
+            if (leaf == NULL)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+        }
+
+        offset.QuadPart = FlatTableOffset +
+            ((LONGLONG)i << DIFF_BLOCK_BITS(DeviceExtension));
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_READ,
+            leaf,
+            DIFF_BLOCK_SIZE(DeviceExtension),
+            &offset,
+            &io_status);
+
+        if (!NT_SUCCESS(status) && status != STATUS_END_OF_FILE)
+        {
+            delete[] leaf;
+
+            return status;
+        }
+
+        if (io_status.Information != DIFF_BLOCK_SIZE(DeviceExtension))
+        {
+            RtlZeroMemory((PUCHAR)leaf + io_status.Information,
+                DIFF_BLOCK_SIZE(DeviceExtension) - io_status.Information);
+        }
+
+        if (RtlCompareMemoryUlong(leaf, DIFF_BLOCK_SIZE(DeviceExtension),
+            DIFF_BLOCK_UNALLOCATED) != DIFF_BLOCK_SIZE(DeviceExtension))
+        {
+            DeviceExtension->AllocationTable[i] = leaf;
+            AIMWrFltrMarkPageDirty(DeviceExtension->AllocationTableDirty, i);
+            leaf = NULL;
+        }
+    }
+
+    delete[] leaf;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Creates allocation table directory and leaves in memory. Directory is
+// read from diff device followed by leaves it references. If it was just
+// reserved at diff device, an empty directory is written there instead,
+// and leaves are converted from a flat table at FlatTableOffset, if not
+// zero, and saved.
+//
+NTSTATUS
+AIMWrFltrLoadAllocationTable(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONGLONG NumberOfBlocks,
+    IN bool NewDirectory,
+    IN LONGLONG FlatTableOffset)
+{
+    LARGE_INTEGER offset;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    ULONG leaves = DIFF_TABLE_GET_NUMBER_OF_LEAVES(DeviceExtension,
+        NumberOfBlocks);
+
+    ULONG directory_size = (ULONG)DeviceExtension->Statistics.DiffDeviceVbr.
+        Fields.Head.SizeOfAllocationTable << SECTOR_BITS;
+
+    if (directory_size < leaves * sizeof(LONG))
+    {
+        DbgPrint("AIMWrFltrInitializeDiffDevice: Allocation table directory too small for %p.\n",
+            DeviceExtension->DeviceObject);
+
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    // Zero filled by operator new
+    DeviceExtension->AllocationTableLeafBlocks =
+        new LONG[directory_size / sizeof(LONG)];
+    DeviceExtension->AllocationTable = new LONG volatile *[leaves];
+    DeviceExtension->AllocationTableDirty =
+        new LONG[DIFF_DIRTY_BITMAP_WORDS(leaves)];
+
+    if (DeviceExtension->AllocationTableLeafBlocks == NULL ||
+        DeviceExtension->AllocationTable == NULL ||
+        DeviceExtension->AllocationTableDirty == NULL)
+    {
+        AIMWrFltrFreeAllocationTable(DeviceExtension);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    DeviceExtension->AllocationTableLeaves = leaves;
+
+    offset.QuadPart = DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        OffsetToAllocationTable << SECTOR_BITS;
+
+    status = AIMWrFltrSynchronousReadWrite(
+        DeviceExtension->DiffDeviceObject,
+        DeviceExtension->DiffFileObject,
+        NewDirectory ? IRP_MJ_WRITE : IRP_MJ_READ,
+        DeviceExtension->AllocationTableLeafBlocks,
+        directory_size,
+        &offset,
+        &io_status);
+
+    if (!NT_SUCCESS(status) || io_status.Information != directory_size)
+    {
+        DbgPrint("AIMWrFltrInitializeDiffDevice: Error %s allocation table directory for %p: 0x%X\n",
+            NewDirectory ? "writing" : "reading",
+            DeviceExtension->DeviceObject, status);
+
+        AIMWrFltrFreeAllocationTable(DeviceExtension);
+
+        return NT_SUCCESS(status) ? STATUS_FILE_CORRUPT_ERROR : status;
+    }
+
+    if (NewDirectory && FlatTableOffset != 0)
+    {
+        status = AIMWrFltrConvertFlatAllocationTable(DeviceExtension,
+            FlatTableOffset);
+
+        if (NT_SUCCESS(status))
+        {
+            status = AIMWrFltrSaveAllocationTable(DeviceExtension);
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            DbgPrint("AIMWrFltrInitializeDiffDevice: Error converting allocation table for %p: 0x%X\n",
+                DeviceExtension->DeviceObject, status);
+
+            AIMWrFltrFreeAllocationTable(DeviceExtension);
+
+            return status;
+        }
+    }
+
+    for (ULONG i = 0; i < leaves; i++)
+    {
+        if (DeviceExtension->AllocationTable[i] == NULL)
+        {
+            if (DeviceExtension->AllocationTableLeafBlocks[i] ==
+                DIFF_BLOCK_UNALLOCATED)
+            {
+                continue;
+            }
+
+            DeviceExtension->AllocationTable[i] =
+                new LONG[DIFF_TABLE_ENTRIES_PER_LEAF(DeviceExtension)];
+
+            if (DeviceExtension->AllocationTable[i] == NULL)
+            {
+                AIMWrFltrFreeAllocationTable(DeviceExtension);
+
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            offset.QuadPart =
+                (LONGLONG)DeviceExtension->AllocationTableLeafBlocks[i] <<
+                DIFF_BLOCK_BITS(DeviceExtension);
+
+            status = AIMWrFltrSynchronousReadWrite(
+                DeviceExtension->DiffDeviceObject,
+                DeviceExtension->DiffFileObject,
+                IRP_MJ_READ,
+                (PVOID)DeviceExtension->AllocationTable[i],
+                DIFF_BLOCK_SIZE(DeviceExtension),
+                &offset,
+                &io_status);
+
+            if (!NT_SUCCESS(status) ||
+                io_status.Information != DIFF_BLOCK_SIZE(DeviceExtension))
+            {
+                DbgPrint("AIMWrFltrInitializeDiffDevice: Error reading allocation table for %p: 0x%X\n",
+                    DeviceExtension->DeviceObject, status);
+
+                AIMWrFltrFreeAllocationTable(DeviceExtension);
+
+                return NT_SUCCESS(status) ? STATUS_FILE_CORRUPT_ERROR : status;
+            }
+        }
+
+        // Table could have been saved while writes to new blocks were in
+        // progress. Those blocks were never completely written.
+        for (ULONG j = 0; j < DIFF_TABLE_ENTRIES_PER_LEAF(DeviceExtension); j++)
+        {
+            if (DeviceExtension->AllocationTable[i][j] == DIFF_BLOCK_CLAIMED)
+            {
+                DeviceExtension->AllocationTable[i][j] = DIFF_BLOCK_UNALLOCATED;
+            }
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Raises LastAllocatedBlock to cover all blocks referenced by loaded
+// allocation table and directories. Leaves, sector bitmap chunks and
+// directories are saved before VBR, so after a crash they can refer to
+// blocks allocated after LastAllocatedBlock in VBR.
+//
+VOID
+AIMWrFltrRecoverLastAllocatedBlock(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    LONG last_allocated_block = DeviceExtension->Statistics.DiffDeviceVbr.
+        Fields.Head.LastAllocatedBlock;
+
+    for (ULONG i = 0; i < DeviceExtension->AllocationTableLeaves; i++)
+    {
+        last_allocated_block = max(last_allocated_block,
+            DeviceExtension->AllocationTableLeafBlocks[i]);
+
+        if (DeviceExtension->AllocationTable[i] == NULL)
+        {
+            continue;
+        }
+
+        for (ULONG j = 0; j < DIFF_TABLE_ENTRIES_PER_LEAF(DeviceExtension); j++)
+        {
+            last_allocated_block = max(last_allocated_block,
+                DeviceExtension->AllocationTable[i][j]);
+        }
+    }
+
+    for (ULONG i = 0; i < DeviceExtension->SectorBitmapChunks; i++)
+    {
+        last_allocated_block = max(last_allocated_block,
+            DeviceExtension->SectorBitmapBlocks[i]);
+    }
+
+    if (last_allocated_block != DeviceExtension->Statistics.DiffDeviceVbr.
+        Fields.Head.LastAllocatedBlock)
+    {
+        DbgPrint("AIMWrFltrInitializeDiffDevice: Blocks up to %i in use for %p, VBR had %i.\n",
+            last_allocated_block, DeviceExtension->DeviceObject,
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            LastAllocatedBlock);
+
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            LastAllocatedBlock = last_allocated_block;
+    }
+}
+
+//
+// Leaves are copied before sector bitmap chunks, since bitmaps of new
+// blocks are updated before claims for them are resolved. Diff device is
+// flushed after copies are made, so that data they refer to is written
+// before them, and again after bitmap chunks are written, so that those
+// are written before leaves. Journal entries added before copies are made
+// are for changes included in them, so VBR is saved with a checkpoint
+// after those. Diff device is flushed again before that, since journal
+// records before the new checkpoint are no longer replayed once VBR is
+// written.
+//
+NTSTATUS
+AIMWrFltSaveDiffHeader(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    LARGE_INTEGER offset;
+    IO_STATUS_BLOCK io_status;
+    DIFF_PAGE_SNAPSHOT table;
+    DIFF_PAGE_SNAPSHOT bitmap = { 0 };
+
+    ULONGLONG checkpoint = AIMWrFltrStartJournalCheckpoint(DeviceExtension);
+
+    NTSTATUS status = AIMWrFltrSnapshotDirtyPages(DeviceExtension,
+        (PVOID volatile *)DeviceExtension->AllocationTable,
+        DeviceExtension->AllocationTableLeaves,
+        DeviceExtension->AllocationTableDirty,
+        &table);
+
+    if (NT_SUCCESS(status))
+    {
+        status = AIMWrFltrSnapshotDirtyPages(DeviceExtension,
+            (PVOID volatile *)DeviceExtension->SectorBitmap,
+            DeviceExtension->SectorBitmapChunks,
+            DeviceExtension->SectorBitmapDirty,
+            &bitmap);
+    }
+
+    if (NT_SUCCESS(status) && (table.Count > 0 || bitmap.Count > 0))
+    {
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_FLUSH_BUFFERS);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = AIMWrFltrWritePageSnapshot(DeviceExtension,
+            DeviceExtension->SectorBitmapBlocks,
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            OffsetToSectorBitmap,
+            &bitmap);
+    }
+
+    // Leaves must not reach diff device before bitmap chunks for blocks
+    // in them
+    if (NT_SUCCESS(status) && table.Count > 0 && bitmap.Count > 0)
+    {
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_FLUSH_BUFFERS);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = AIMWrFltrWritePageSnapshot(DeviceExtension,
+            DeviceExtension->AllocationTableLeafBlocks,
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            OffsetToAllocationTable,
+            &table);
+    }
+
+    if (NT_SUCCESS(status) && DeviceExtension->JournalEntries != NULL &&
+        (table.Count > 0 || bitmap.Count > 0))
+    {
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_FLUSH_BUFFERS);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("AIMWrFiltr: Error writing diff allocation table: %#x\n", status);
+
+        AIMWrFltrMarkSnapshotDirty(DeviceExtension->AllocationTableDirty,
+            &table);
+        AIMWrFltrMarkSnapshotDirty(DeviceExtension->SectorBitmapDirty,
+            &bitmap);
+    }
+
+    AIMWrFltrFreePageSnapshot(&table);
+    AIMWrFltrFreePageSnapshot(&bitmap);
+
+    if (!NT_SUCCESS(status))
+    {
+        AIMWrFltrSetJournalOverflow(DeviceExtension);
+
+        return status;
+    }
+
+    ULONGLONG previous_checkpoint = DeviceExtension->Statistics.
+        DiffDeviceVbr.Fields.Head.JournalCheckpoint;
+
+    DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.JournalCheckpoint =
+        checkpoint;
+
+    offset.QuadPart = 0;
+
+    status = AIMWrFltrSynchronousReadWrite(
+        DeviceExtension->DiffDeviceObject,
+        DeviceExtension->DiffFileObject,
+        IRP_MJ_WRITE,
+        DeviceExtension->Statistics.DiffDeviceVbr.Raw.Bytes,
+        sizeof(DeviceExtension->Statistics.DiffDeviceVbr),
+        &offset,
+        &io_status);
+
+    if (!NT_SUCCESS(status) || io_status.Information !=
+        sizeof(DeviceExtension->Statistics.DiffDeviceVbr))
+    {
+        DbgPrint("AIMWrFiltr: Error writing diff file header: %#x\n", status);
+
+        // Journal records from previous checkpoint are still replayed
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            JournalCheckpoint = previous_checkpoint;
+
+        AIMWrFltrSetJournalOverflow(DeviceExtension);
+
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+AIMWrFltrCleanupDevice(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    PAGED_CODE();
+
+    if (DeviceExtension->WorkerThread != NULL)
+    {
+        DeviceExtension->ShutdownThread = true;
+        KeSetEvent(&DeviceExtension->ListEvent, 0, FALSE);
+        ZwWaitForSingleObject(DeviceExtension->WorkerThread, FALSE, NULL);
+        ZwClose(DeviceExtension->WorkerThread);
+        DeviceExtension->WorkerThread = NULL;
+    }
+
+    if (DeviceExtension->AllocationTable != NULL &&
+        DeviceExtension->Statistics.Initialized)
+    {
+        AIMWrFltSaveDiffHeader(DeviceExtension);
+    }
+
+    AIMWrFltrFreeJournal(DeviceExtension);
+
+    AIMWrFltrFreeFreeBlockMap(DeviceExtension);
+
+    AIMWrFltrFreeAllocationTable(DeviceExtension);
+
+    AIMWrFltrFreeSectorBitmap(DeviceExtension);
+
+    if (DeviceExtension->DiffFileObject != NULL)
+    {
+        ObDereferenceObject(DeviceExtension->DiffFileObject);
+        DeviceExtension->DiffDeviceObject = NULL;
+        DeviceExtension->DiffFileObject = NULL;
+    }
+
+    if (DeviceExtension->DiffDeviceHandle != NULL)
+    {
+        IO_STATUS_BLOCK io_status;
+        ZwFlushBuffersFile(DeviceExtension->DiffDeviceHandle, &io_status);
+        ZwClose(DeviceExtension->DiffDeviceHandle);
+        DeviceExtension->DiffDeviceHandle = NULL;
+    }
+}
+
+NTSTATUS
+AIMWrFltrGetDiffDevicePath(IN PUNICODE_STRING MountDevName,
+    OUT PKEY_VALUE_PARTIAL_INFORMATION DiffDevicePath,
+    IN ULONG DiffDevicePathSize)
+{
+    PAGED_CODE();
+
+    KdPrint(("AIMWrFltrGetDiffDevicePath: Device assigned link '%wZ'\n",
+        MountDevName));
+
+    ULONG length;
+    NTSTATUS status = ZwQueryValueKey(AIMWrFltrParametersKey, MountDevName,
+        KeyValuePartialInformation, DiffDevicePath, DiffDevicePathSize, &length);
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("AIMWrFltrGetDiffDevicePath: Cannot query registry settings for device '%wZ' status 0x%X.\n",
+            MountDevName, status));
+
+        return status;
+    }
+
+    status = ZwDeleteValueKey(AIMWrFltrParametersKey, MountDevName);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(
+            "AIMWrFltrGetDiffDevicePath: Warning: Failed removing registry value for device '%wZ': 0x%#X\n",
+            MountDevName, status);
+    }
+
+    if (DiffDevicePath->DataLength < 4)
+    {
+        DbgPrint("AIMWrFltrGetDiffDevicePath: Empty diff device for volume '%wZ'.\n",
+            MountDevName);
+
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    KdPrint(("AIMWrFltrGetDiffDevicePath: Setting diff device for volume '%wZ' to '%ws'.\n",
+        MountDevName, (PCWSTR)DiffDevicePath->Data));
+
+    return STATUS_SUCCESS;
+}
+
+UCHAR
+AIMWrFltrGetDiffBlockBits(IN PUNICODE_STRING MountDevName)
+{
+    PAGED_CODE();
+
+    UNICODE_STRING suffix;
+    RtlInitUnicodeString(&suffix, DIFF_BLOCK_BITS_VALUE_SUFFIX);
+
+    WPagedPoolMem<WCHAR> value_name_buffer(MountDevName->Length +
+        suffix.Length);
+
+    if (!value_name_buffer)
+    {
+        return DIFF_BLOCK_BITS_DEFAULT;
+    }
+
+    UNICODE_STRING value_name;
+    value_name.Buffer = value_name_buffer;
+    value_name.Length = 0;
+    value_name.MaximumLength = (USHORT)value_name_buffer.GetSize();
+
+    RtlAppendUnicodeStringToString(&value_name, MountDevName);
+    RtlAppendUnicodeStringToString(&value_name, &suffix);
+
+    WPagedPoolMem<KEY_VALUE_PARTIAL_INFORMATION> value(
+        FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + sizeof(ULONG));
+
+    if (!value)
+    {
+        return DIFF_BLOCK_BITS_DEFAULT;
+    }
 
     ULONG length;
-    NTSTATUS status = ZwQueryValueKey(AIMWrFltrParametersKey, MountDevName,
-        KeyValuePartialInformation, DiffDevicePath, DiffDevicePathSize, &length);
+    NTSTATUS status = ZwQueryValueKey(AIMWrFltrParametersKey, &value_name,
+        KeyValuePartialInformation, value, (ULONG)value.GetSize(), &length);
 
     if (!NT_SUCCESS(status))
     {
-        KdPrint(("AIMWrFltrGetDiffDevicePath: Cannot query registry settings for device '%wZ' status 0x%X.\n",
-            MountDevName, status));
+        KdPrint(("AIMWrFltrGetDiffBlockBits: No block size set for device '%wZ', using default.\n",
+            MountDevName));
 
-        return status;
+        return DIFF_BLOCK_BITS_DEFAULT;
     }
 
-    status = ZwDeleteValueKey(AIMWrFltrParametersKey, MountDevName);
+    status = ZwDeleteValueKey(AIMWrFltrParametersKey, &value_name);
 
     if (!NT_SUCCESS(status))
     {
         DbgPrint(
-            "AIMWrFltrGetDiffDevicePath: Warning: Failed removing registry value for device '%wZ': 0x%#X\n",
-            MountDevName, status);
+            "AIMWrFltrGetDiffBlockBits: Warning: Failed removing registry value '%wZ': 0x%#X\n",
+            &value_name, status);
     }
 
-    if (DiffDevicePath->DataLength < 4)
+    ULONG block_bits = *(PULONG)value->Data;
+
+    if (value->Type != REG_DWORD ||
+        value->DataLength != sizeof(ULONG) ||
+        block_bits < DIFF_BLOCK_BITS_MIN ||
+        block_bits > DIFF_BLOCK_BITS_MAX)
     {
-        DbgPrint("AIMWrFltrGetDiffDevicePath: Empty diff device for volume '%wZ'.\n",
+        DbgPrint("AIMWrFltrGetDiffBlockBits: Invalid block size setting for device '%wZ', using default.\n",
             MountDevName);
 
-        return STATUS_DEVICE_CONFIGURATION_ERROR;
+        return DIFF_BLOCK_BITS_DEFAULT;
     }
 
-    KdPrint(("AIMWrFltrGetDiffDevicePath: Setting diff device for volume '%wZ' to '%ws'.\n",
-        MountDevName, (PCWSTR)DiffDevicePath->Data));
+    KdPrint(("AIMWrFltrGetDiffBlockBits: Block size for new diff device for '%wZ' is %u bytes.\n",
+        MountDevName, 1UL << block_bits));
 
-    return STATUS_SUCCESS;
+    return (UCHAR)block_bits;
 }
 
 NTSTATUS
@@ -525,7 +1542,7 @@ AIMWrFltrOpenDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
             NULL);
 
         LARGE_INTEGER allocation_size;
-        allocation_size.QuadPart = DIFF_BLOCK_SIZE;
+        allocation_size.QuadPart = DIFF_BLOCK_SIZE(DeviceExtension);
 
         IO_STATUS_BLOCK io_status;
 
@@ -598,6 +1615,9 @@ AIMWrFltrOpenDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
     // Read diff volume VBR
     if (*(PULONGLONG)DeviceExtension->Statistics.DiffDeviceVbr.Raw.Bytes == 0)
     {
+        // Block size requested for a new diff device
+        UCHAR diff_block_bits = DIFF_BLOCK_BITS(DeviceExtension);
+
         LARGE_INTEGER lower_offset = { 0 };
 
         IO_STATUS_BLOCK io_status;
@@ -633,7 +1653,8 @@ AIMWrFltrOpenDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
                 io_status.Information);
         }
 
-        // If this is the wrong file type = VBR magic mismatch
+        // If this is the wrong file type = VBR magic mismatch, or an
+        // unsupported block size
         if (RtlCompareMemoryUlong(
             DeviceExtension->Statistics.DiffDeviceVbr.Raw.Bytes,
             sizeof(DeviceExtension->Statistics.DiffDeviceVbr), 0) !=
@@ -642,7 +1663,10 @@ AIMWrFltrOpenDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
                 VbrSignature != vbr_signature) ||
                 !RtlEqualMemory(diff_file_magic,
                     DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.Magic,
-                    sizeof(diff_file_magic))))
+                    sizeof(diff_file_magic)) ||
+                (DIFF_BLOCK_BITS(DeviceExtension) != 0 &&
+                    (DIFF_BLOCK_BITS(DeviceExtension) < DIFF_BLOCK_BITS_MIN ||
+                        DIFF_BLOCK_BITS(DeviceExtension) > DIFF_BLOCK_BITS_MAX))))
         {
             DbgPrint("AIMWrFltrInitializeDiffDevice: Diff device VBR for %p is invalid.\n",
                 DeviceExtension->DeviceObject);
@@ -651,6 +1675,8 @@ AIMWrFltrOpenDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
 
             DeviceExtension->Statistics.LastErrorCode = STATUS_WRONG_VOLUME;
 
+            DIFF_BLOCK_BITS(DeviceExtension) = diff_block_bits;
+
             if (DeviceExtension->DiffDeviceHandle != NULL)
             {
                 ZwClose(DeviceExtension->DiffDeviceHandle);
@@ -665,6 +1691,53 @@ AIMWrFltrOpenDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
         }
         
         if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            MajorVersion != 0 &&
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            MajorVersion < journal_major_version)
+        {
+            // Allocation table directory is reserved and flat table
+            // converted in AIMWrFltrInitializeDiffDeviceUnsafe for
+            // versions 1.0 and 2.0. So is sector bitmap directory when
+            // SizeOfSectorBitmap is zero, as it is in version 1.0, and
+            // allocation journal for all of them.
+            DbgPrint("AIMWrFltrInitializeDiffDevice: Upgrading diff device from version %i:%i to %i:%i.\n",
+                DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                MajorVersion,
+                DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                MinorVersion,
+                major_version,
+                minor_version);
+
+            if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                MajorVersion < sector_bitmap_major_version)
+            {
+                DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                    OffsetToSectorBitmap = 0;
+
+                DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                    SizeOfSectorBitmap = 0;
+            }
+
+            if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                MajorVersion <= migrate_major_version)
+            {
+                DeviceExtension->MigrateAllocationTable = true;
+            }
+
+            // Reserved in AIMWrFltrInitializeDiffDeviceUnsafe
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                OffsetToJournal = 0;
+
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                SizeOfJournal = 0;
+
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                JournalCheckpoint = 0;
+
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                MinorVersion = minor_version;
+        }
+        else if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
             MajorVersion != major_version)
         {
             DbgPrint("AIMWrFltrInitializeDiffDevice: Overwriting incompatible version. Found in VBR %i:%i, expected %i:%i.\n",
@@ -690,6 +1763,20 @@ AIMWrFltrOpenDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
                 minor_version);
         }
 
+        // Existing diff devices keep the block size they were created with
+        if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            MajorVersion == 0)
+        {
+            DIFF_BLOCK_BITS(DeviceExtension) = diff_block_bits;
+        }
+        else if (DIFF_BLOCK_BITS(DeviceExtension) == 0)
+        {
+            DIFF_BLOCK_BITS(DeviceExtension) = legacy_diff_block_bits;
+        }
+
+        DbgPrint("AIMWrFltrInitializeDiffDevice: Diff device block size for %p is %u bytes.\n",
+            DeviceExtension->DeviceObject, DIFF_BLOCK_SIZE(DeviceExtension));
+
         RtlCopyMemory(DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
             Magic, diff_file_magic, sizeof(diff_file_magic));
 
@@ -700,10 +1787,10 @@ AIMWrFltrOpenDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
             major_version;
 
         if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-            OffsetToAllocationTable == 0)
+            MinorVersion < minor_version)
         {
             DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-                OffsetToAllocationTable = DIFF_BLOCK_SIZE;
+                MinorVersion = minor_version;
         }
     }
 
@@ -754,155 +1841,294 @@ AIMWrFltrInitializeDiffDeviceUnsafe(IN PDEVICE_EXTENSION DeviceExtension)
 
     KdBreakPoint();
 
-    ULONGLONG number_of_blocks = DIFF_GET_NUMBER_OF_BLOCKS(
+    ULONGLONG number_of_blocks = DIFF_GET_NUMBER_OF_BLOCKS(DeviceExtension,
         DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.Size.
         QuadPart);
 
-    DeviceExtension->Statistics.DiffDeviceVbr.Fields.
-        Head.AllocationTableBlocks = (LONG)
-        DIFF_GET_NUMBER_OF_BLOCKS(sizeof(LONG) * number_of_blocks) + 1;
+    if ((number_of_blocks >> DIFF_TABLE_LEAF_BITS(DeviceExtension)) >= MAXLONG)
+    {
+        DbgPrint("AIMWrFltr: FATAL: Filtered volume is %I64u bytes which is too large.\n",
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.Size.QuadPart);
 
-    DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-        SizeOfAllocationTable = (LONGLONG)DeviceExtension->Statistics.
-        DiffDeviceVbr.Fields.Head.AllocationTableBlocks <<
-        (DIFF_BLOCK_BITS - SECTOR_BITS);
+        KdBreakPoint();
 
-    LONGLONG free_offset = DIFF_BLOCK_SIZE;
+        status = STATUS_NOT_SUPPORTED;
 
-    if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-        OffsetToLogData > free_offset)
-    {
-        free_offset = DeviceExtension->Statistics.DiffDeviceVbr.Fields.
-            Head.OffsetToLogData + DeviceExtension->Statistics.
-            DiffDeviceVbr.Fields.Head.SizeOfLogData;
+        DeviceExtension->Statistics.LastErrorCode = status;
+
+        return status;
     }
 
+    ULONG leaves = DIFF_TABLE_GET_NUMBER_OF_LEAVES(DeviceExtension,
+        number_of_blocks);
+
     if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-        OffsetToPrivateData > free_offset)
+        LastAllocatedBlock == 0)
     {
-        free_offset = DeviceExtension->Statistics.DiffDeviceVbr.Fields.
-            Head.OffsetToPrivateData + DeviceExtension->Statistics.
-            DiffDeviceVbr.Fields.Head.SizeOfPrivateData;
-    }
+        LONGLONG free_offset = DIFF_BLOCK_SIZE(DeviceExtension) >> SECTOR_BITS;
+
+        if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            OffsetToLogData > free_offset)
+        {
+            free_offset = DeviceExtension->Statistics.DiffDeviceVbr.Fields.
+                Head.OffsetToLogData + DeviceExtension->Statistics.
+                DiffDeviceVbr.Fields.Head.SizeOfLogData;
+        }
 
-    free_offset <<= SECTOR_BITS;
+        if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            OffsetToPrivateData > free_offset)
+        {
+            free_offset = DeviceExtension->Statistics.DiffDeviceVbr.Fields.
+                Head.OffsetToPrivateData + DeviceExtension->Statistics.
+                DiffDeviceVbr.Fields.Head.SizeOfPrivateData;
+        }
 
-    free_offset = (free_offset + DIFF_BLOCK_OFFSET_MASK) &
-        DIFF_BLOCK_BASE_MASK;
+        free_offset <<= SECTOR_BITS;
 
-    free_offset >>= SECTOR_BITS;
+        free_offset = (free_offset + DIFF_BLOCK_OFFSET_MASK(DeviceExtension)) &
+            DIFF_BLOCK_BASE_MASK(DeviceExtension);
 
-    DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-        OffsetToAllocationTable = free_offset;
+        free_offset >>= SECTOR_BITS;
 
-    DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-        OffsetToFirstAllocatedBlock = DeviceExtension->Statistics.
-        DiffDeviceVbr.Fields.Head.OffsetToAllocationTable +
         DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-        SizeOfAllocationTable;
+            OffsetToFirstAllocatedBlock = free_offset;
 
-    if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-        LastAllocatedBlock == 0)
-    {
         DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
             LastAllocatedBlock = (LONG)
             (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
                 OffsetToFirstAllocatedBlock >>
-                (DIFF_BLOCK_BITS - SECTOR_BITS));
+                (DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS));
     }
 
-    LARGE_INTEGER lower_offset = { 0 };
+    LONG last_allocated_block = DeviceExtension->Statistics.DiffDeviceVbr.
+        Fields.Head.LastAllocatedBlock;
 
-    IO_STATUS_BLOCK io_status;
+    // Reserve blocks for allocation table directory after those already
+    // in use, for new diff devices as well as for upgraded ones. Flat
+    // allocation table of an upgraded diff device stays where it is until
+    // it has been converted and VBR refers to the new directory.
+    bool new_allocation_table_directory = false;
+    LONG table_directory_blocks = 0;
+    LONGLONG flat_table_offset = 0;
+    LONG flat_table_blocks = 0;
 
-    status = AIMWrFltrSynchronousReadWrite(
-        DeviceExtension->DiffDeviceObject,
-        DeviceExtension->DiffFileObject,
-        IRP_MJ_WRITE,
-        DeviceExtension->Statistics.DiffDeviceVbr.Raw.Bytes,
-        sizeof(DeviceExtension->Statistics.DiffDeviceVbr),
-        &lower_offset,
-        &io_status);
+    if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        SizeOfAllocationTable == 0 ||
+        DeviceExtension->MigrateAllocationTable)
+    {
+        if (DeviceExtension->MigrateAllocationTable)
+        {
+            flat_table_offset = DeviceExtension->Statistics.
+                DiffDeviceVbr.Fields.Head.OffsetToAllocationTable;
 
-    if (!NT_SUCCESS(status) ||
-        io_status.Information !=
-        sizeof(DeviceExtension->Statistics.DiffDeviceVbr))
+            flat_table_blocks = DeviceExtension->Statistics.
+                DiffDeviceVbr.Fields.Head.AllocationTableBlocks;
+        }
+
+        table_directory_blocks = (LONG)
+            DIFF_GET_NUMBER_OF_BLOCKS(DeviceExtension, sizeof(LONG) * leaves);
+
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            AllocationTableBlocks = table_directory_blocks;
+
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            OffsetToAllocationTable = (LONGLONG)(DeviceExtension->Statistics.
+                DiffDeviceVbr.Fields.Head.LastAllocatedBlock + 1) <<
+            (DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS);
+
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            SizeOfAllocationTable = (LONGLONG)table_directory_blocks <<
+            (DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS);
+
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            LastAllocatedBlock += table_directory_blocks;
+
+        new_allocation_table_directory = true;
+    }
+
+    // Reserve blocks for sector bitmap directory the same way. Empty
+    // directories are written before VBR refers to them.
+    bool new_sector_bitmap_directory = false;
+    LONG directory_blocks = 0;
+
+    if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        SizeOfSectorBitmap == 0)
     {
-        DbgPrint("AIMWrFltrInitializeDiffDevice: Error writing diff device for %p: 0x%X\n",
-            DeviceExtension->DeviceObject, status);
+        ULONGLONG chunks = (number_of_blocks +
+            DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension) - 1) /
+            DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(DeviceExtension);
+
+        directory_blocks = (LONG)
+            DIFF_GET_NUMBER_OF_BLOCKS(DeviceExtension, sizeof(LONG) * chunks);
+
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            OffsetToSectorBitmap = (LONGLONG)(DeviceExtension->Statistics.
+                DiffDeviceVbr.Fields.Head.LastAllocatedBlock + 1) <<
+            (DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS);
+
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            SizeOfSectorBitmap = (LONGLONG)directory_blocks <<
+            (DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS);
+
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            LastAllocatedBlock += directory_blocks;
+
+        new_sector_bitmap_directory = true;
     }
 
-    // Create allocation table
-    if (DeviceExtension->AllocationTable == NULL)
+    status = STATUS_SUCCESS;
+
+    if (DeviceExtension->SectorBitmap == NULL)
+    {
+        status = AIMWrFltrLoadSectorBitmap(DeviceExtension, number_of_blocks,
+            new_sector_bitmap_directory);
+    }
+
+    // Converted leaves of a flat allocation table are saved here, also
+    // before VBR refers to them
+    if (NT_SUCCESS(status) && DeviceExtension->AllocationTable == NULL)
+    {
+        status = AIMWrFltrLoadAllocationTable(DeviceExtension,
+            number_of_blocks, new_allocation_table_directory,
+            flat_table_offset);
+    }
+
+    // Journal records from last checkpoint are replayed into loaded
+    // allocation table and sector bitmaps. Journal is reserved after
+    // blocks in use, also those saved after VBR was last written.
+    bool new_journal = false;
+    ULONG replayed_records = 0;
+
+    if (NT_SUCCESS(status) && DeviceExtension->JournalEntries == NULL)
     {
-        LONG alloc_table_blocks = (LONG)
-            DIFF_GET_NUMBER_OF_BLOCKS(sizeof(LONG) * number_of_blocks) + 1;
+        AIMWrFltrRecoverLastAllocatedBlock(DeviceExtension);
 
-        if ((number_of_blocks + alloc_table_blocks) >= MAXLONG)
+        if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            SizeOfJournal == 0)
         {
-            DbgPrint("AIMWrFltr: FATAL: Filtered volume is %I64u bytes which is too large. Max = %I64u.\n",
-                DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.Size.QuadPart,
-                ((LONGLONG)MAXLONG - 1) << DIFF_BLOCK_BITS);
+            LONG journal_blocks = (LONG)
+                DIFF_GET_NUMBER_OF_BLOCKS(DeviceExtension, DIFF_JOURNAL_SIZE);
 
-            KdBreakPoint();
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                OffsetToJournal = (LONGLONG)(DeviceExtension->Statistics.
+                    DiffDeviceVbr.Fields.Head.LastAllocatedBlock + 1) <<
+                (DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS);
 
-            status = STATUS_NOT_SUPPORTED;
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                SizeOfJournal = (LONGLONG)journal_blocks <<
+                (DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS);
 
-            DeviceExtension->Statistics.LastErrorCode = status;
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                JournalCheckpoint = 0;
 
-            return status;
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                LastAllocatedBlock += journal_blocks;
+
+            new_journal = true;
         }
 
-        DeviceExtension->AllocationTable = new LONG[
-            (size_t)alloc_table_blocks << DIFF_BLOCK_BITS];
+        status = AIMWrFltrLoadJournal(DeviceExtension, new_journal,
+            &replayed_records);
+    }
 
-        if (DeviceExtension->AllocationTable == NULL)
-        {
-            DbgPrint(
-                "AIMWrFltrInitializeDiffDevice: Memory allocation error.\n");
+    if (!NT_SUCCESS(status))
+    {
+        // VBR at diff device still refers to previous directories, so
+        // blocks reserved or allocated here are not in use
+        AIMWrFltrFreeAllocationTable(DeviceExtension);
 
-            KdBreakPoint();
+        AIMWrFltrFreeSectorBitmap(DeviceExtension);
 
-            status = STATUS_INSUFFICIENT_RESOURCES;
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            LastAllocatedBlock = last_allocated_block;
 
-            DeviceExtension->Statistics.LastErrorCode = status;
+        if (new_sector_bitmap_directory)
+        {
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                OffsetToSectorBitmap = 0;
 
-            return status;
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                SizeOfSectorBitmap = 0;
         }
 
-        lower_offset.QuadPart =
+        if (new_allocation_table_directory)
+        {
             DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-            OffsetToAllocationTable;
+                OffsetToAllocationTable = flat_table_offset;
 
-        status = AIMWrFltrSynchronousReadWrite(
-            DeviceExtension->DiffDeviceObject,
-            DeviceExtension->DiffFileObject,
-            IRP_MJ_READ,
-            (PVOID)DeviceExtension->AllocationTable,
-            (ULONG)alloc_table_blocks << DIFF_BLOCK_BITS,
-            &lower_offset,
-            &io_status);
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                AllocationTableBlocks = flat_table_blocks;
 
-        if (!NT_SUCCESS(status) && status != STATUS_END_OF_FILE)
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                SizeOfAllocationTable = (LONGLONG)flat_table_blocks <<
+                (DIFF_BLOCK_BITS(DeviceExtension) - SECTOR_BITS);
+        }
+
+        if (new_journal)
         {
-            DbgPrint(
-                "AIMWrFltrInitializeDiffDevice: Error reading diff device for %p: 0x%X\n",
-                DeviceExtension->DeviceObject, status);
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                OffsetToJournal = 0;
 
-            KdBreakPoint();
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+                SizeOfJournal = 0;
+        }
 
-            DeviceExtension->Statistics.LastErrorCode = status;
+        KdBreakPoint();
 
-            return status;
-        }
+        DeviceExtension->Statistics.LastErrorCode = status;
 
-        if (io_status.Information !=
-            ((ULONG_PTR)alloc_table_blocks << DIFF_BLOCK_BITS))
+        return status;
+    }
+
+    DeviceExtension->MigrateAllocationTable = false;
+
+    // Replayed changes are saved with a checkpoint after the records
+    // replayed. Otherwise checkpoint is only moved past any records left
+    // in journal.
+    if (replayed_records > 0)
+    {
+        AIMWrFltSaveDiffHeader(DeviceExtension);
+    }
+    else
+    {
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            JournalCheckpoint = DeviceExtension->JournalSequence;
+    }
+
+    LARGE_INTEGER lower_offset = { 0 };
+
+    IO_STATUS_BLOCK io_status;
+
+    status = AIMWrFltrSynchronousReadWrite(
+        DeviceExtension->DiffDeviceObject,
+        DeviceExtension->DiffFileObject,
+        IRP_MJ_WRITE,
+        DeviceExtension->Statistics.DiffDeviceVbr.Raw.Bytes,
+        sizeof(DeviceExtension->Statistics.DiffDeviceVbr),
+        &lower_offset,
+        &io_status);
+
+    if (!NT_SUCCESS(status) ||
+        io_status.Information !=
+        sizeof(DeviceExtension->Statistics.DiffDeviceVbr))
+    {
+        DbgPrint("AIMWrFltrInitializeDiffDevice: Error writing diff device for %p: 0x%X\n",
+            DeviceExtension->DeviceObject, status);
+
+        // Journal checkpoint at diff device was not moved, so new records
+        // cannot be written until header has been saved
+        AIMWrFltrSetJournalOverflow(DeviceExtension);
+    }
+    else
+    {
+        // Without it, new blocks are only allocated at the end of diff
+        // device and compaction does not run
+        status = AIMWrFltrBuildFreeBlockMap(DeviceExtension);
+
+        if (!NT_SUCCESS(status))
         {
-            RtlZeroMemory((PUCHAR)DeviceExtension->AllocationTable +
-                io_status.Information,
-                ((ULONG_PTR)alloc_table_blocks << DIFF_BLOCK_BITS) -
-                io_status.Information);
+            DbgPrint("AIMWrFltrInitializeDiffDevice: Cannot build free block map for %p: 0x%X\n",
+                DeviceExtension->DeviceObject, status);
         }
     }
 
@@ -1067,6 +2293,8 @@ AIMWrFltrAddDevice(IN PDRIVER_OBJECT DriverObject,
 
     *(PWCHAR)&diff_device_reg_value->Data[diff_device_reg_value->DataLength - sizeof(WCHAR)] = 0;
 
+    UCHAR diff_block_bits = AIMWrFltrGetDiffBlockBits(&obj_name_info->Name);
+
     UNICODE_STRING diff_device_path;
     RtlInitUnicodeString(&diff_device_path, (PCWSTR)diff_device_reg_value->Data);
 
@@ -1107,7 +2335,9 @@ AIMWrFltrAddDevice(IN PDRIVER_OBJECT DriverObject,
 
     device_extension->Statistics.Version = sizeof(AIMWRFLTR_DEVICE_STATISTICS);
 
-    device_extension->Statistics.DiffDeviceVbr.Fields.Head.DiffBlockBits = DIFF_BLOCK_BITS;
+    // Replaced by block size saved in VBR if diff device already exists
+    device_extension->Statistics.DiffDeviceVbr.Fields.Head.DiffBlockBits =
+        diff_block_bits;
 
     //
     // Initialize the remove lock
@@ -1123,6 +2353,16 @@ AIMWrFltrAddDevice(IN PDRIVER_OBJECT DriverObject,
     KeInitializeEvent(&device_extension->ListEvent, SynchronizationEvent,
         FALSE);
 
+    KeInitializeEvent(&device_extension->BlockClaimEvent, NotificationEvent,
+        FALSE);
+
+    KeInitializeSpinLock(&device_extension->JournalLock);
+
+    KeInitializeSpinLock(&device_extension->FreeBlockLock);
+
+    // Compaction pass runs when diff device is opened, before any writes
+    device_extension->CompactIdleWrites = -1;
+
     KeInitializeEvent(&device_extension->InitializationEvent,
         SynchronizationEvent, TRUE);
     KeInitializeGuardedMutex(&device_extension->InitializationMutex);
@@ -1850,6 +3090,53 @@ VOID.
 }
 
 
+//
+// Saves diff device header from worker thread when allocation table leaves
+// or sector bitmap chunks have changed and DIFF_HEADER_SAVE_INTERVAL has
+// passed since last time, or when more than half of allocation journal is
+// in use since last checkpoint.
+//
+static VOID
+AIMWrFltrPeriodicSaveDiffHeader(IN PDEVICE_EXTENSION DeviceExtension,
+    IN OUT PULONGLONG LastSaveTime)
+{
+    if (!DeviceExtension->Statistics.Initialized ||
+        DeviceExtension->AllocationTable == NULL)
+    {
+        return;
+    }
+
+    ULONGLONG now = KeQueryInterruptTime();
+
+    if (DeviceExtension->JournalEntries != NULL &&
+        DeviceExtension->JournalSequence - DeviceExtension->Statistics.
+        DiffDeviceVbr.Fields.Head.JournalCheckpoint >
+        (ULONGLONG)DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        SizeOfJournal / 2)
+    {
+        *LastSaveTime = now;
+
+        AIMWrFltSaveDiffHeader(DeviceExtension);
+
+        return;
+    }
+
+    if (now - *LastSaveTime < DIFF_HEADER_SAVE_INTERVAL)
+    {
+        return;
+    }
+
+    *LastSaveTime = now;
+
+    if (AIMWrFltrAnyPageDirty(DeviceExtension->AllocationTableDirty,
+        DeviceExtension->AllocationTableLeaves) ||
+        AIMWrFltrAnyPageDirty(DeviceExtension->SectorBitmapDirty,
+            DeviceExtension->SectorBitmapChunks))
+    {
+        AIMWrFltSaveDiffHeader(DeviceExtension);
+    }
+}
+
 void
 AIMWrFltrDeviceWorkerThread(PVOID Context)
 {
@@ -1858,7 +3145,8 @@ AIMWrFltrDeviceWorkerThread(PVOID Context)
     KdPrint(("AIMWrFltr: Worker thread started for device %p\n",
         device_extension->DeviceObject));
 
-    PUCHAR block_buffer = new UCHAR[DIFF_BLOCK_SIZE];
+    PUCHAR block_buffer =
+        new UCHAR[DEFERRED_BLOCK_BUFFER_SIZE(device_extension)];
 
     if (block_buffer == NULL)
     {
@@ -1866,6 +3154,26 @@ AIMWrFltrDeviceWorkerThread(PVOID Context)
         return;
     }
 
+    // Buffers for new blocks filled up with data from original device
+    // while deferred writes are in flight
+    PUCHAR fill_buffers =
+        new UCHAR[DIFF_BLOCK_SIZE(device_extension) *
+        DEFERRED_FILL_BLOCKS_IN_FLIGHT(device_extension)];
+
+    if (fill_buffers == NULL)
+    {
+        delete[] block_buffer;
+        PsTerminateSystemThread(STATUS_INSUFFICIENT_RESOURCES);
+        return;
+    }
+
+    ULONGLONG last_header_save = KeQueryInterruptTime();
+
+    // Read and write requests received, and when that number last changed,
+    // so that compaction only runs while protected volume is idle
+    LONGLONG last_requests = -1;
+    ULONGLONG last_request_time = last_header_save;
+
     for (;;)
     {
         PLIST_ENTRY request = ExInterlockedRemoveHeadList(
@@ -1901,10 +3209,38 @@ AIMWrFltrDeviceWorkerThread(PVOID Context)
             }
         }
 
+        AIMWrFltrPeriodicSaveDiffHeader(device_extension, &last_header_save);
+
         if (request == NULL)
         {
+            LONGLONG requests = device_extension->Statistics.ReadRequests +
+                device_extension->Statistics.WriteRequests;
+
+            ULONGLONG now = KeQueryInterruptTime();
+
+            if (requests != last_requests)
+            {
+                last_requests = requests;
+                last_request_time = now;
+            }
+
+            bool compaction_pending =
+                AIMWrFltrCompactionPending(device_extension);
+
+            if (compaction_pending &&
+                now - last_request_time >= COMPACT_IDLE_INTERVAL)
+            {
+                AIMWrFltrCompactDiffDevice(device_extension, block_buffer);
+
+                continue;
+            }
+
+            LARGE_INTEGER timeout;
+            timeout.QuadPart = -(LONGLONG)(compaction_pending ?
+                COMPACT_IDLE_INTERVAL : DIFF_HEADER_SAVE_INTERVAL);
+
             KeWaitForSingleObject(&device_extension->ListEvent, Executive,
-                KernelMode, FALSE, NULL);
+                KernelMode, FALSE, &timeout);
 
             continue;
         }
@@ -1918,11 +3254,11 @@ AIMWrFltrDeviceWorkerThread(PVOID Context)
         switch (io_stack->MajorFunction)
         {
         case IRP_MJ_READ:
-            AIMWrFltrDeferredRead(device_extension, irp, block_buffer);
+            AIMWrFltrDeferredRead(device_extension, irp);
             break;
 
         case IRP_MJ_WRITE:
-            AIMWrFltrDeferredWrite(device_extension, irp, block_buffer);
+            AIMWrFltrDeferredWrite(device_extension, irp, fill_buffers);
             break;
 
         case IRP_MJ_FLUSH_BUFFERS:
@@ -1959,6 +3295,7 @@ AIMWrFltrDeviceWorkerThread(PVOID Context)
     KdPrint(("AIMWrFltr: Terminating worker thread for device %p\n",
         device_extension->DeviceObject));
 
+    delete[] fill_buffers;
     delete[] block_buffer;
 
     PsTerminateSystemThread(STATUS_SUCCESS);
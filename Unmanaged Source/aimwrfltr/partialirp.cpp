@@ -6,7 +6,8 @@ PIRP SCATTERED_IRP::BuildIrp(
     PFILE_OBJECT FileObject,
     ULONG OriginalIrpOffset,
     ULONG BytesThisIrp,
-    PLARGE_INTEGER LowerDeviceOffset)
+    PLARGE_INTEGER LowerDeviceOffset,
+    PDIFF_BLOCK_CLAIM Claim)
 {
     if (DeviceObject == NULL)
     {
@@ -144,6 +145,11 @@ PIRP SCATTERED_IRP::BuildIrp(
     partial->OriginalIrpOffset = OriginalIrpOffset;
     partial->BytesThisIrp = BytesThisIrp;
 
+    if (Claim != NULL)
+    {
+        partial->Claim = *Claim;
+    }
+
     lower_irp->Tail.Overlay.Thread = OriginalIrp->Tail.Overlay.Thread;
 
     if (MajorFunction == IRP_MJ_WRITE)
@@ -199,6 +205,18 @@ PVOID Context
         }
 
         InterlockedExchangeAddPtr(&scatter->BytesCompleted, Irp->IoStatus.Information);
+
+        // New diff blocks now hold valid data
+        if (partial->Claim.Blocks > 0)
+        {
+            AIMWrFltrResolveBlockClaims(partial->Claim.DeviceExtension,
+                partial->Claim.FirstBlock, partial->Claim.Blocks,
+                partial->Claim.BlockAddress);
+
+            AIMWrFltrJournalAppend(partial->Claim.DeviceExtension,
+                partial->Claim.FirstBlock, partial->Claim.Blocks,
+                partial->Claim.BlockAddress, 0, 0);
+        }
     }
     else
     {
@@ -208,6 +226,15 @@ PVOID Context
         //KdBreakPoint();
 
         InterlockedExchange(&scatter->LastFailedStatus, Irp->IoStatus.Status);
+
+        // Give up claimed blocks. Diff blocks allocated for them are
+        // left unused.
+        if (partial->Claim.Blocks > 0)
+        {
+            AIMWrFltrResolveBlockClaims(partial->Claim.DeviceExtension,
+                partial->Claim.FirstBlock, partial->Claim.Blocks,
+                DIFF_BLOCK_UNALLOCATED);
+        }
     }
 
     delete partial;
@@ -1,5 +1,120 @@
 #include "aimwrfltr.h"
 
+//
+// Part of a read request stored contiguously at one lower level device,
+// original device or diff device.
+//
+typedef struct _DIFF_READ_EXTENT
+{
+    PDEVICE_OBJECT DeviceObject;
+
+    PFILE_OBJECT FileObject;
+
+    LARGE_INTEGER LowerOffset;
+
+    ULONG Length;
+
+} DIFF_READ_EXTENT, *PDIFF_READ_EXTENT;
+
+//
+// Finds where Length bytes at Offset at protected volume are stored, as
+// far as they are contiguous at one lower level device. Unallocated
+// blocks, and sectors still missing at diff device in allocated blocks,
+// are at the same offset at original device, so runs of them are merged
+// also across allocated blocks. Sectors present at diff device are
+// merged as long as next block is the next diff block.
+//
+static VOID
+AIMWrFltrGetReadExtent(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Offset, IN ULONG Length, OUT PDIFF_READ_EXTENT Extent)
+{
+    Extent->DeviceObject = NULL;
+    Extent->FileObject = NULL;
+    Extent->LowerOffset.QuadPart = 0;
+    Extent->Length = 0;
+
+    while (Extent->Length < Length)
+    {
+        LONGLONG abs_offset = Offset + Extent->Length;
+        LONGLONG block = (LONGLONG)
+            DIFF_GET_BLOCK_NUMBER(DeviceExtension, abs_offset);
+        ULONG block_offset = DIFF_GET_BLOCK_OFFSET(DeviceExtension, abs_offset);
+        ULONG bytes = min(Length - Extent->Length,
+            (ULONG)DIFF_BLOCK_SIZE(DeviceExtension) - block_offset);
+        LONG block_address = AIMWrFltrGetDiffBlock(DeviceExtension, block);
+        bool missing = true;
+
+        if (block_address != DIFF_BLOCK_UNALLOCATED)
+        {
+            PDIFF_SECTOR_BITMAP bitmap =
+                AIMWrFltrGetSectorBitmap(DeviceExtension, block);
+
+            if (AIMWrFltrAnySectorMissing(bitmap, block_offset, bytes))
+            {
+                bytes = AIMWrFltrSectorRunLength(bitmap, block_offset, bytes,
+                    &missing);
+            }
+            else
+            {
+                missing = false;
+            }
+        }
+
+        PDEVICE_OBJECT device;
+        PFILE_OBJECT file;
+        LONGLONG lower_offset;
+
+        if (missing)
+        {
+            device = DeviceExtension->TargetDeviceObject;
+            file = NULL;
+            lower_offset = abs_offset;
+        }
+        else
+        {
+            device = DeviceExtension->DiffDeviceObject;
+            file = DeviceExtension->DiffFileObject;
+            lower_offset =
+                ((LONGLONG)block_address << DIFF_BLOCK_BITS(DeviceExtension)) +
+                block_offset;
+        }
+
+        if (Extent->Length == 0)
+        {
+            Extent->DeviceObject = device;
+            Extent->FileObject = file;
+            Extent->LowerOffset.QuadPart = lower_offset;
+        }
+        else if ((device != Extent->DeviceObject) ||
+            (lower_offset != Extent->LowerOffset.QuadPart + Extent->Length))
+        {
+            break;
+        }
+
+        Extent->Length += bytes;
+    }
+}
+
+//
+// Adds an extent to read statistics.
+//
+static VOID
+AIMWrFltrCountReadExtent(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PDIFF_READ_EXTENT Extent)
+{
+    if (Extent->DeviceObject == DeviceExtension->TargetDeviceObject)
+    {
+        InterlockedExchangeAdd64(
+            &DeviceExtension->Statistics.ReadBytesFromOriginal,
+            Extent->Length);
+    }
+    else
+    {
+        InterlockedExchangeAdd64(&DeviceExtension->Statistics.ReadBytesFromDiff,
+            Extent->Length);
+    }
+}
+
 NTSTATUS
 AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 {
@@ -60,28 +175,36 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
         return STATUS_END_OF_MEDIA;
     }
 
-    bool any_block_modified = false;
-    LONG first = (LONG)
-        DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Read.ByteOffset.QuadPart);
-    LONG last = (LONG)
-        DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Read.ByteOffset.QuadPart +
-            io_stack->Parameters.Read.Length - 1);
+    // Direct reads wait while worker thread moves a block at diff device
+    bool direct_io = AIMWrFltrStartDirectIo(device_extension);
+
+    // Count lower level requests needed, up to one more than can be sent
+    // from here
+    ULONG extents = 0;
+    DIFF_READ_EXTENT extent = { 0 };
 
     if ((device_extension->AllocationTable != NULL) &&
         (device_extension->DiffDeviceObject != NULL))
     {
-        for (LONG i = first; i <= last; i++)
+        for (ULONG length_done = 0;
+            (length_done < io_stack->Parameters.Read.Length) &&
+            (extents <= READ_EXTENTS_IN_FLIGHT);
+            length_done += extent.Length)
         {
-            if (device_extension->AllocationTable[i] !=
-                DIFF_BLOCK_UNALLOCATED)
-            {
-                any_block_modified = true;
-                break;
-            }
+            AIMWrFltrGetReadExtent(device_extension,
+                io_stack->Parameters.Read.ByteOffset.QuadPart + length_done,
+                io_stack->Parameters.Read.Length - length_done,
+                &extent);
+
+            ++extents;
         }
     }
 
-    if (!any_block_modified)
+    // Nothing to read from diff device? Includes modified blocks where
+    // sectors in this range are still missing at diff device.
+    if ((extents == 0) ||
+        ((extents == 1) &&
+            (extent.DeviceObject == device_extension->TargetDeviceObject)))
     {
         InterlockedIncrement64(
             &device_extension->Statistics.ReadRequestsReroutedToOriginal);
@@ -90,14 +213,26 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
             &device_extension->Statistics.ReadBytesReroutedToOriginal,
             io_stack->Parameters.Read.Length);
 
+        if (direct_io)
+        {
+            AIMWrFltrEndDirectIo(device_extension);
+        }
+
         IoSkipCurrentIrpStackLocation(Irp);
         return IoCallDriver(device_extension->TargetDeviceObject, Irp);
     }
 
-    bool use_deferred_read = false;
+    // Too fragmented to send all lower level requests at once? Then
+    // worker thread sends them a limited number at a time.
+    bool use_deferred_read = !direct_io || extents > READ_EXTENTS_IN_FLIGHT;
 
     if (use_deferred_read)
     {
+        if (direct_io)
+        {
+            AIMWrFltrEndDirectIo(device_extension);
+        }
+
         //
         // Acquire the remove lock so that device will not be removed while
         // processing this irp.
@@ -138,10 +273,13 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
         &device_extension->RemoveLock,
         (DeviceObject->Flags & DO_BUFFERED_IO) ?
         (PUCHAR)Irp->AssociatedIrp.SystemBuffer :
-        NULL);
+        NULL,
+        &device_extension->DirectIoCount);
 
     if (!NT_SUCCESS(status))
     {
+        AIMWrFltrEndDirectIo(device_extension);
+
         Irp->IoStatus.Status = status;
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
 
@@ -150,108 +288,53 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
         return status;
     }
 
+    // Table may have changed since extents were counted, so this is the
+    // actual split
     ULONG length_done = 0;
     ULONG splits = 0;
 
-    for (
-        LONG i = first;
-        (i <= last) && (length_done < io_stack->Parameters.Read.Length);
-        i++)
+    while (length_done < io_stack->Parameters.Read.Length)
     {
-        LONGLONG abs_offset_this_iter =
-            io_stack->Parameters.Read.ByteOffset.QuadPart + length_done;
-        ULONG page_offset_this_iter =
-            DIFF_GET_BLOCK_OFFSET(abs_offset_this_iter);
-        ULONG bytes_this_iter =
-            io_stack->Parameters.Read.Length - length_done;
-        LARGE_INTEGER lower_offset = { 0 };
-        PDEVICE_OBJECT lower_device = NULL;
-        PFILE_OBJECT lower_file = NULL;
-
-        if (device_extension->AllocationTable[i] == DIFF_BLOCK_UNALLOCATED)
-        {
-            ULONG block_size = DIFF_BLOCK_SIZE;
+        AIMWrFltrGetReadExtent(device_extension,
+            io_stack->Parameters.Read.ByteOffset.QuadPart + length_done,
+            io_stack->Parameters.Read.Length - length_done,
+            &extent);
 
-            // Contigous? Then merge with next iteration
-            while ((page_offset_this_iter + bytes_this_iter) > block_size)
-            {
-                if (device_extension->AllocationTable[i + 1] ==
-                    DIFF_BLOCK_UNALLOCATED)
-                {
-                    block_size += DIFF_BLOCK_SIZE;
-                    ++i;
-                }
-                else
-                {
-                    bytes_this_iter = block_size - page_offset_this_iter;
-                    ++splits;
-                }
-            }
+        AIMWrFltrCountReadExtent(device_extension, &extent);
 
-            InterlockedExchangeAdd64(
-                &device_extension->Statistics.ReadBytesFromOriginal,
-                bytes_this_iter);
-
-            lower_device = device_extension->TargetDeviceObject;
-            lower_offset.QuadPart = abs_offset_this_iter;
-        }
-        else
-        {
-            ULONG block_size = DIFF_BLOCK_SIZE;
-            LONG block_base = device_extension->AllocationTable[i];
-
-            // Contigous? Then merge with next iteration
-            while ((page_offset_this_iter + bytes_this_iter) > block_size)
-            {
-                if (device_extension->AllocationTable[i + 1] ==
-                    device_extension->AllocationTable[i] + 1)
-                {
-                    block_size += DIFF_BLOCK_SIZE;
-                    ++i;
-                }
-                else
-                {
-                    bytes_this_iter = block_size - page_offset_this_iter;
-                }
-            }
-
-            InterlockedExchangeAdd64(&device_extension->Statistics.ReadBytesFromDiff,
-                bytes_this_iter);
-
-            lower_device = device_extension->DiffDeviceObject;
-            lower_file = device_extension->DiffFileObject;
-
-            lower_offset.QuadPart =
-                ((LONGLONG)block_base << DIFF_BLOCK_BITS) +
-                page_offset_this_iter;
-        }
-
-        __analysis_assume(lower_device != NULL);
+        __analysis_assume(extent.DeviceObject != NULL);
 
         PIRP lower_irp = scatter->BuildIrp(
             IRP_MJ_READ,
-            lower_device,
-            lower_file,
+            extent.DeviceObject,
+            extent.FileObject,
             length_done,
-            bytes_this_iter,
-            &lower_offset);
+            extent.Length,
+            &extent.LowerOffset);
 
         if (lower_irp == NULL)
         {
             break;
         }
 
-        ASSERT(IoGetNextIrpStackLocation(lower_irp)->FileObject == lower_file);
+        ASSERT(IoGetNextIrpStackLocation(lower_irp)->FileObject ==
+            extent.FileObject);
 
-        ASSERT((lower_device == device_extension->TargetDeviceObject &&
-            lower_file == NULL) ||
-            (lower_file == device_extension->DiffFileObject &&
-                lower_device == device_extension->DiffDeviceObject &&
-                lower_device == IoGetRelatedDeviceObject(lower_file)));
+        ASSERT((extent.DeviceObject == device_extension->TargetDeviceObject &&
+            extent.FileObject == NULL) ||
+            (extent.FileObject == device_extension->DiffFileObject &&
+                extent.DeviceObject == device_extension->DiffDeviceObject &&
+                extent.DeviceObject ==
+                IoGetRelatedDeviceObject(extent.FileObject)));
 
-        IoCallDriver(lower_device, lower_irp);
+        IoCallDriver(extent.DeviceObject, lower_irp);
+
+        if (length_done > 0)
+        {
+            ++splits;
+        }
 
-        length_done += bytes_this_iter;
+        length_done += extent.Length;
     }
 
     if (splits > 0)
@@ -265,15 +348,49 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
     return STATUS_PENDING;
 }				// end AIMWrFltrReadWrite()
 
+//
+// Lower level read requests in flight for a deferred read. Outstanding
+// is biased by one while requests are being sent, so that event is not
+// set until all of them are sent and completed.
+//
+typedef struct _DEFERRED_READ_WAVE
+{
+    PIRP Irps[READ_EXTENTS_IN_FLIGHT];
+
+    ULONG Lengths[READ_EXTENTS_IN_FLIGHT];
+
+    ULONG IrpCount;
+
+    volatile LONG Outstanding;
+
+    KEVENT Event;
+
+} DEFERRED_READ_WAVE, *PDEFERRED_READ_WAVE;
+
+NTSTATUS
+AIMWrFltrDeferredReadIrpCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_opt_(_Inexpressible_("varies")) PVOID Context)
+{
+    PDEFERRED_READ_WAVE wave = (PDEFERRED_READ_WAVE)Context;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Irp);
+
+    if (InterlockedDecrement(&wave->Outstanding) == 0)
+    {
+        KeSetEvent(&wave->Event, IO_NO_INCREMENT, FALSE);
+    }
+
+    // Irp is freed by AIMWrFltrDeferredRead
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
 VOID
 AIMWrFltrDeferredRead(
     PDEVICE_EXTENSION DeviceExtension,
-    PIRP Irp,
-    PUCHAR BlockBuffer)
+    PIRP Irp)
 {
-    KEVENT event;
-    KeInitializeEvent(&event, SynchronizationEvent, FALSE);
-
     PUCHAR buffer = NULL;
     if (DeviceExtension->DeviceObject->Flags & DO_BUFFERED_IO)
     {
@@ -293,139 +410,110 @@ AIMWrFltrDeferredRead(
 
     PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
 
-    LONG first = (LONG)
-        DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Read.ByteOffset.QuadPart);
-    LONG last = (LONG)
-        DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Read.ByteOffset.QuadPart +
-            io_stack->Parameters.Read.Length - 1);
-
-    LONG splits = last - first;
-    if (splits > 0)
-    {
-        InterlockedExchangeAdd64(&DeviceExtension->Statistics.SplitReads, splits);
-    }
+    DEFERRED_READ_WAVE wave;
+    wave.Outstanding = 1;
+    KeInitializeEvent(&wave.Event, NotificationEvent, FALSE);
 
-    IO_STATUS_BLOCK io_status;
     ULONG length_done = 0;
+    ULONG splits = 0;
 
-    for (
-        LONG i = first;
-        (i <= last) && (length_done < io_stack->Parameters.Read.Length);
-        i++)
+    // Send up to READ_EXTENTS_IN_FLIGHT lower level requests directly to
+    // caller's buffer, then wait for them before sending more
+    while ((length_done < io_stack->Parameters.Read.Length) &&
+        NT_SUCCESS(Irp->IoStatus.Status))
     {
-        LONGLONG abs_offset_this_iter =
-            io_stack->Parameters.Read.ByteOffset.QuadPart +
-            length_done;
-        ULONG page_offset_this_iter =
-            DIFF_GET_BLOCK_OFFSET(abs_offset_this_iter);
-        ULONG bytes_this_iter = io_stack->Parameters.Read.Length -
-            length_done;
-
-        if ((page_offset_this_iter + bytes_this_iter) > DIFF_BLOCK_SIZE)
-        {
-            bytes_this_iter = DIFF_BLOCK_SIZE - page_offset_this_iter;
-        }
+        wave.IrpCount = 0;
 
-        NTSTATUS status;
-        LONG block_address = DeviceExtension->AllocationTable[i];
-        if (block_address == DIFF_BLOCK_UNALLOCATED)
+        while ((wave.IrpCount < READ_EXTENTS_IN_FLIGHT) &&
+            (length_done < io_stack->Parameters.Read.Length))
         {
-            LARGE_INTEGER offset;
-            offset.QuadPart =
-                DIFF_GET_BLOCK_BASE_FROM_ABS_OFFSET(abs_offset_this_iter) +
-                page_offset_this_iter;
+            DIFF_READ_EXTENT extent;
+
+            AIMWrFltrGetReadExtent(DeviceExtension,
+                io_stack->Parameters.Read.ByteOffset.QuadPart + length_done,
+                io_stack->Parameters.Read.Length - length_done,
+                &extent);
 
-            PIRP target_irp = IoBuildSynchronousFsdRequest(
+            PIRP lower_irp = IoBuildAsynchronousFsdRequest(
                 IRP_MJ_READ,
-                DeviceExtension->TargetDeviceObject,
-                BlockBuffer + page_offset_this_iter,
-                bytes_this_iter,
-                &offset,
-                &event,
-                &io_status);
-
-            if (target_irp == NULL)
+                extent.DeviceObject,
+                buffer + length_done,
+                extent.Length,
+                &extent.LowerOffset,
+                NULL);
+
+            if (lower_irp == NULL)
             {
                 KdBreakPoint();
 
                 Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-                return;
+                break;
             }
 
-            KeClearEvent(&event);
+            AIMWrFltrCountReadExtent(DeviceExtension, &extent);
 
-            status = IoCallDriver(
-                DeviceExtension->TargetDeviceObject,
-                target_irp);
-
-            if (status == STATUS_PENDING)
-            {
-                KeWaitForSingleObject(&event, Executive, KernelMode,
-                    FALSE, NULL);
-            }
+            IoGetNextIrpStackLocation(lower_irp)->FileObject =
+                extent.FileObject;
 
-            if (NT_SUCCESS(status) &&
-                io_status.Information != bytes_this_iter)
-            {
-                KdPrint(("AIMWrFltrDeferredRead: Read request 0x%X bytes, done 0x%IX.\n",
-                    bytes_this_iter, io_status.Information));
+            IoSetCompletionRoutine(lower_irp,
+                AIMWrFltrDeferredReadIrpCompletion,
+                &wave, TRUE, TRUE, TRUE);
 
-                KdBreakPoint();
-            }
+            wave.Irps[wave.IrpCount] = lower_irp;
+            wave.Lengths[wave.IrpCount] = extent.Length;
+            wave.IrpCount++;
 
-            if (!NT_SUCCESS(status))
-            {
-                KdPrint(("AIMWrFltrDeferredRead: Read from target device failed: 0x%X\n",
-                    status));
+            InterlockedIncrement(&wave.Outstanding);
 
-                KdBreakPoint();
+            IoCallDriver(extent.DeviceObject, lower_irp);
 
-                Irp->IoStatus.Status = io_status.Status;
-                return;
+            if (length_done > 0)
+            {
+                ++splits;
             }
+
+            length_done += extent.Length;
         }
-        else
+
+        if (InterlockedDecrement(&wave.Outstanding) != 0)
         {
-            LARGE_INTEGER lower_offset = { 0 };
+            KeWaitForSingleObject(&wave.Event, Executive, KernelMode, FALSE,
+                NULL);
+        }
 
-            lower_offset.QuadPart = ((LONGLONG)block_address <<
-                DIFF_BLOCK_BITS) + page_offset_this_iter;
+        wave.Outstanding = 1;
+        KeClearEvent(&wave.Event);
 
-            status = AIMWrFltrSynchronousReadWrite(
-                DeviceExtension->DiffDeviceObject,
-                DeviceExtension->DiffFileObject,
-                IRP_MJ_READ,
-                BlockBuffer + page_offset_this_iter,
-                bytes_this_iter,
-                &lower_offset,
-                &io_status);
-
-#pragma warning(suppress: 6102)
-            if (NT_SUCCESS(status) &&
-                io_status.Information != bytes_this_iter)
+        for (ULONG i = 0; i < wave.IrpCount; i++)
+        {
+            PIRP lower_irp = wave.Irps[i];
+
+            if (NT_SUCCESS(lower_irp->IoStatus.Status) &&
+                lower_irp->IoStatus.Information != wave.Lengths[i])
             {
                 KdPrint(("AIMWrFltrDeferredRead: Read request 0x%X bytes, done 0x%IX.\n",
-                    bytes_this_iter, io_status.Information));
+                    wave.Lengths[i], lower_irp->IoStatus.Information));
 
                 KdBreakPoint();
             }
 
-            if (!NT_SUCCESS(status))
+            if (!NT_SUCCESS(lower_irp->IoStatus.Status))
             {
-                KdPrint(("AIMWrFltrDeferredRead: Read from diff device failed: 0x%X\n",
-                    status));
+                KdPrint(("AIMWrFltrDeferredRead: Lower level read failed: 0x%X\n",
+                    lower_irp->IoStatus.Status));
 
                 KdBreakPoint();
 
-                Irp->IoStatus.Status = status;
-                return;
+                Irp->IoStatus.Status = lower_irp->IoStatus.Status;
             }
-        }
 
-        RtlCopyMemory(buffer + length_done,
-            BlockBuffer + page_offset_this_iter, bytes_this_iter);
+            AIMWrFltrFreeIrpWithMdls(lower_irp);
+        }
+    }
 
-        length_done += bytes_this_iter;
+    if (splits > 0)
+    {
+        InterlockedExchangeAdd64(&DeviceExtension->Statistics.SplitReads, splits);
     }
 
     if (NT_SUCCESS(Irp->IoStatus.Status))
@@ -433,5 +521,3 @@ AIMWrFltrDeferredRead(
         Irp->IoStatus.Information = io_stack->Parameters.Read.Length;
     }
 }
-
-
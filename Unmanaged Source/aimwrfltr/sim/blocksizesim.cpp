@@ -0,0 +1,510 @@
+/// blocksizesim.cpp
+/// aimwrfltr-blocksizesim command line application. Replays a write trace
+/// against the write filter allocation rules for each diff block size from
+/// 4 KB to 2 MB and reports diff device space used compared to data
+/// written, allocation table and sector bitmap sizes, and fill read bytes,
+/// so that a block size can be chosen for a workload when a volume is
+/// protected (DiffBlockBits in aimwrfltr.h).
+///
+/// Blocks are allocated as by AIMWrFltrWrite and AIMWrFltrDeferredWrite.
+/// Fill reads are what a new block not completely covered by a write
+/// costs without a sector bitmap, as with version 1.0 diff devices or
+/// when a bitmap chunk cannot be allocated. With sector bitmaps, such
+/// blocks instead keep sectors missing at diff device until written, and
+/// reads of them are split between diff device and original device.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/// Same values as in aimwrfltr.h
+constexpr unsigned DIFF_BLOCK_BITS_MIN = 12;
+constexpr unsigned DIFF_BLOCK_BITS_MAX = 21;
+constexpr unsigned DIFF_BLOCK_BITS_DEFAULT = 16;
+constexpr unsigned SECTOR_BITS = 9;
+constexpr uint32_t SECTOR_SIZE = 1u << SECTOR_BITS;
+
+struct SimOptions
+{
+    uint64_t volume_size = 1ull << 30;
+    unsigned min_bits = DIFF_BLOCK_BITS_MIN;
+    unsigned max_bits = DIFF_BLOCK_BITS_MAX;
+};
+
+struct TraceEntry
+{
+    uint64_t offset = 0;
+    uint32_t length = 0;
+};
+
+/// Bit per sector of protected volume, for bytes written by trace
+class SectorSet
+{
+public:
+
+    explicit SectorSet(uint64_t sectors)
+        : bits((size_t)((sectors + 63) / 64), 0)
+    {
+    }
+
+    /// Sets sectors and returns number of them that were not set before
+    uint64_t set(uint64_t first, uint64_t count)
+    {
+        uint64_t added = 0;
+
+        for (uint64_t sector = first; sector < first + count; sector++)
+        {
+            uint64_t mask = 1ull << (sector % 64);
+            uint64_t &word = bits[(size_t)(sector / 64)];
+
+            if ((word & mask) == 0)
+            {
+                word |= mask;
+                added++;
+            }
+        }
+
+        return added;
+    }
+
+private:
+
+    std::vector<uint64_t> bits;
+};
+
+struct SimResult
+{
+    uint64_t data_blocks = 0;
+    uint64_t table_bytes = 0;
+    uint64_t table_pool_bytes = 0;
+    uint64_t directory_bytes = 0;
+    uint64_t bitmap_chunks = 0;
+    uint64_t fill_bytes = 0;
+    uint64_t partial_blocks = 0;
+};
+
+/// Allocation table and sector bitmaps of one protected volume for one
+/// block size
+class SimVolume
+{
+public:
+
+    SimVolume(const SimOptions &options, unsigned block_bits)
+        : block_bits(block_bits),
+        block_size(1u << block_bits),
+        sectors_per_block(block_size >> SECTOR_BITS),
+        bitmap_words((sectors_per_block + 63) / 64),
+        blocks((options.volume_size + block_size - 1) >> block_bits),
+        allocated((size_t)blocks, false)
+    {
+        // DIFF_SECTOR_BITMAP_SIZE and DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK
+        blocks_per_chunk = block_size / (bitmap_words * 8);
+    }
+
+    void write(const TraceEntry &entry, SimResult &result)
+    {
+        uint64_t end = entry.offset + entry.length;
+
+        for (uint64_t block = entry.offset >> block_bits;
+            block <= (end - 1) >> block_bits;
+            block++)
+        {
+            uint64_t block_base = block << block_bits;
+            uint32_t first = (uint32_t)(std::max(entry.offset, block_base) -
+                block_base);
+            uint32_t last = (uint32_t)(std::min(end, block_base + block_size) -
+                block_base);
+
+            if (!allocated[(size_t)block])
+            {
+                allocated[(size_t)block] = true;
+                result.data_blocks++;
+
+                // DIFF_TABLE_GET_LEAF
+                leaves.insert(block >> (block_bits - 2));
+
+                if (last - first == block_size)
+                {
+                    continue;
+                }
+
+                result.fill_bytes += block_size - (last - first);
+
+                // Partial new block gets a sector bitmap with all sectors
+                // missing except those written
+                std::vector<uint64_t> &bitmap = bitmaps[block];
+                bitmap.assign(bitmap_words, 0);
+                set_missing(bitmap, 0, block_size, true);
+
+                chunks.insert(block / blocks_per_chunk);
+            }
+
+            auto bitmap = bitmaps.find(block);
+
+            if (bitmap != bitmaps.end())
+            {
+                set_missing(bitmap->second, first, last, false);
+            }
+        }
+    }
+
+    void finish(SimResult &result)
+    {
+        // Same calculations as AIMWrFltrInitializeDiffDeviceUnsafe. Table
+        // is its directory and leaves with any allocated block, and in
+        // memory also one leaf pointer for each leaf.
+        uint64_t leaf_count = (blocks + (block_size >> 2) - 1) >> (block_bits - 2);
+        uint64_t table_blocks = (leaf_count * 4 + block_size - 1) >> block_bits;
+        uint64_t chunk_count = (blocks + blocks_per_chunk - 1) / blocks_per_chunk;
+        uint64_t directory_blocks = (chunk_count * 4 + block_size - 1) >> block_bits;
+
+        result.table_bytes = (table_blocks + leaves.size()) << block_bits;
+        result.table_pool_bytes = result.table_bytes + leaf_count * sizeof(void *);
+        result.directory_bytes = directory_blocks << block_bits;
+        result.bitmap_chunks = chunks.size();
+
+        for (auto &bitmap : bitmaps)
+        {
+            for (uint64_t word : bitmap.second)
+            {
+                if (word != 0)
+                {
+                    result.partial_blocks++;
+                    break;
+                }
+            }
+        }
+    }
+
+    const unsigned block_bits;
+    const uint32_t block_size;
+
+private:
+
+    /// AIMWrFltrSetSectorsMissing for bytes first to last within block
+    void set_missing(std::vector<uint64_t> &bitmap, uint32_t first,
+        uint32_t last, bool missing)
+    {
+        for (uint32_t sector = first >> SECTOR_BITS;
+            sector < (last + SECTOR_SIZE - 1) >> SECTOR_BITS;
+            sector++)
+        {
+            uint64_t mask = 1ull << (sector % 64);
+
+            if (missing)
+            {
+                bitmap[sector / 64] |= mask;
+            }
+            else
+            {
+                bitmap[sector / 64] &= ~mask;
+            }
+        }
+    }
+
+    const uint32_t sectors_per_block;
+    const uint32_t bitmap_words;
+    const uint64_t blocks;
+    uint32_t blocks_per_chunk;
+    std::vector<bool> allocated;
+    std::unordered_map<uint64_t, std::vector<uint64_t>> bitmaps;
+    std::unordered_set<uint64_t> chunks;
+    std::unordered_set<uint64_t> leaves;
+};
+
+static bool read_trace(const char *path, const SimOptions &options,
+    std::vector<TraceEntry> &trace)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+    if (file == nullptr)
+    {
+        perror(path);
+        return false;
+    }
+
+    char line[256];
+    unsigned line_number = 0;
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof line, file) != nullptr)
+    {
+        line_number++;
+
+        char op = 0;
+        long long offset = 0;
+        long length = 0;
+
+        if (sscanf(line, " %c", &op) != 1 || op == '#' || op == 'F' ||
+            op == 'f')
+        {
+            continue;
+        }
+
+        if ((op == 'W' || op == 'w') &&
+            sscanf(line, " %*c %lli %li", &offset, &length) == 2 &&
+            offset >= 0 && length > 0 && (offset % SECTOR_SIZE) == 0 &&
+            (length % SECTOR_SIZE) == 0 &&
+            (uint64_t)(offset + length) <= options.volume_size)
+        {
+            TraceEntry entry;
+            entry.offset = (uint64_t)offset;
+            entry.length = (uint32_t)length;
+            trace.push_back(entry);
+        }
+        else
+        {
+            fprintf(stderr, "%s(%u): Invalid request: %s", path, line_number, line);
+            ok = false;
+        }
+    }
+
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+
+    return ok;
+}
+
+/// Random writes of power of two sizes from min_length to max_length,
+/// aligned to their size or 4 KB, whichever is smaller, within the first
+/// region bytes of volume.
+static void generate_trace(unsigned count, unsigned seed,
+    uint32_t min_length, uint32_t max_length, uint64_t region,
+    std::vector<TraceEntry> &trace)
+{
+    std::mt19937_64 random(seed);
+    unsigned size_classes = 1;
+
+    while ((min_length << (size_classes - 1)) < max_length)
+    {
+        size_classes++;
+    }
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        TraceEntry entry;
+
+        entry.length = min_length << (random() % size_classes);
+
+        uint64_t alignment = std::min<uint64_t>(entry.length, 4096);
+        uint64_t positions = (region - entry.length) / alignment + 1;
+
+        entry.offset = (random() % positions) * alignment;
+
+        trace.push_back(entry);
+    }
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "aimwrfltr-blocksizesim [options] [tracefile]\n"
+        "\n"
+        "Replays write trace against write filter block allocation for each\n"
+        "diff block size from 4 KB to 2 MB. Trace lines are\n"
+        "\"W offset length [time]\" or \"F [time]\", as for aimwrfltr-fillsim,\n"
+        "with offset and length in bytes. Time and flushes are ignored. Use -\n"
+        "for stdin. Without trace file, a random trace is generated.\n"
+        "\n"
+        "Prints for each block size number of allocated blocks, data MB at\n"
+        "diff device, KB for allocation table, sector bitmap directory and\n"
+        "chunks, space amplification as diff device size divided by bytes\n"
+        "written by trace, fill read MB without sector bitmaps, blocks still\n"
+        "with sectors missing with sector bitmaps, and KB of non-paged pool\n"
+        "for allocation table.\n"
+        "\n"
+        "-v, --volume-size bytes   Size of protected volume, default 1 GB.\n"
+        "-b, --min-bits bits       Smallest block size to simulate, default 12.\n"
+        "-B, --max-bits bits       Largest block size to simulate, default 21.\n"
+        "-g, --generate count      Requests in random trace, default 100000.\n"
+        "-l, --min-length bytes    Smallest write in random trace, default 4096.\n"
+        "-L, --max-length bytes    Largest write in random trace, default same\n"
+        "                          as -l. Writes use random power of two sizes\n"
+        "                          between them.\n"
+        "-r, --region bytes        Random trace writes within first bytes of\n"
+        "                          volume, default whole volume.\n"
+        "-s, --seed value          Seed for random trace, default 1.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "volume-size", required_argument, nullptr, 'v' },
+        { "min-bits", required_argument, nullptr, 'b' },
+        { "max-bits", required_argument, nullptr, 'B' },
+        { "generate", required_argument, nullptr, 'g' },
+        { "min-length", required_argument, nullptr, 'l' },
+        { "max-length", required_argument, nullptr, 'L' },
+        { "region", required_argument, nullptr, 'r' },
+        { "seed", required_argument, nullptr, 's' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    SimOptions options;
+    unsigned generate = 100000;
+    uint32_t min_length = 4096;
+    uint32_t max_length = 0;
+    uint64_t region = 0;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "v:b:B:g:l:L:r:s:h",
+        long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            options.volume_size = strtoull(optarg, nullptr, 0) &
+                ~(uint64_t)(SECTOR_SIZE - 1);
+            break;
+
+        case 'b':
+            options.min_bits = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'B':
+            options.max_bits = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'g':
+            generate = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'l':
+            min_length = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'L':
+            max_length = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'r':
+            region = strtoull(optarg, nullptr, 0);
+            break;
+
+        case 's':
+            seed = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (max_length == 0)
+    {
+        max_length = min_length;
+    }
+
+    if (region == 0 || region > options.volume_size)
+    {
+        region = options.volume_size;
+    }
+
+    if (optind + 1 < argc || options.volume_size < (1ull << 20) ||
+        options.min_bits < DIFF_BLOCK_BITS_MIN ||
+        options.max_bits > DIFF_BLOCK_BITS_MAX ||
+        options.min_bits > options.max_bits ||
+        min_length < SECTOR_SIZE || (min_length % SECTOR_SIZE) != 0 ||
+        max_length < min_length || max_length > region)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<TraceEntry> trace;
+
+    if (optind < argc)
+    {
+        if (!read_trace(argv[optind], options, trace))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        generate_trace(generate, seed, min_length, max_length, region, trace);
+    }
+
+    SectorSet written(options.volume_size >> SECTOR_BITS);
+    uint64_t request_bytes = 0;
+    uint64_t written_bytes = 0;
+
+    for (const TraceEntry &entry : trace)
+    {
+        request_bytes += entry.length;
+        written_bytes += written.set(entry.offset >> SECTOR_BITS,
+            entry.length >> SECTOR_BITS) << SECTOR_BITS;
+    }
+
+    printf("%llu requests, %.1f MB written to %.1f MB of volume\n",
+        (unsigned long long)trace.size(),
+        (double)request_bytes / (1 << 20),
+        (double)written_bytes / (1 << 20));
+
+    printf("%-8s %10s %10s %10s %10s %10s %8s %10s %10s %10s\n",
+        "block", "blocks", "data MB", "table KB", "dir KB", "bitmap KB",
+        "space", "fill MB", "partial", "pool KB");
+
+    for (unsigned bits = options.min_bits; bits <= options.max_bits; bits++)
+    {
+        SimVolume volume(options, bits);
+        SimResult result;
+
+        for (const TraceEntry &entry : trace)
+        {
+            volume.write(entry, result);
+        }
+
+        volume.finish(result);
+
+        uint64_t data_bytes = result.data_blocks << bits;
+        uint64_t bitmap_bytes = result.bitmap_chunks << bits;
+
+        // VBR block, allocation table, directory, data and bitmap chunks
+        uint64_t diff_bytes = (1ull << bits) + result.table_bytes +
+            result.directory_bytes + data_bytes + bitmap_bytes;
+
+        char name[16];
+        snprintf(name, sizeof name, "%uK%s", (1u << bits) >> 10,
+            bits == DIFF_BLOCK_BITS_DEFAULT ? "*" : "");
+
+        printf("%-8s %10llu %10.1f %10.1f %10.1f %10.1f %8.2f %10.1f %10llu %10.1f\n",
+            name,
+            (unsigned long long)result.data_blocks,
+            (double)data_bytes / (1 << 20),
+            (double)result.table_bytes / (1 << 10),
+            (double)result.directory_bytes / (1 << 10),
+            (double)bitmap_bytes / (1 << 10),
+            written_bytes > 0 ? (double)diff_bytes / (double)written_bytes : 0,
+            (double)result.fill_bytes / (1 << 20),
+            (unsigned long long)result.partial_blocks,
+            (double)result.table_pool_bytes / (1 << 10));
+    }
+
+    return 0;
+}
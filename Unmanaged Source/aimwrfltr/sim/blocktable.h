@@ -0,0 +1,217 @@
+/// blocktable.h
+/// User mode model of the write filter allocation table and the protocol
+/// for claiming new blocks, so that direct writes and the worker thread can
+/// allocate diff blocks at the same time (aimwrfltr.h and write.cpp). Each
+/// member function corresponds to a driver function of similar name. Used
+/// by aimwrfltr-claimstress to test the protocol with many threads on Linux.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _AIMWRFLTR_SIM_BLOCKTABLE_H_
+#define _AIMWRFLTR_SIM_BLOCKTABLE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace aimwrfltr
+{
+
+/// Same values as in aimwrfltr.h
+constexpr int32_t DIFF_BLOCK_UNALLOCATED = 0;
+constexpr int32_t DIFF_BLOCK_CLAIMED = -1;
+
+/// Counterpart of a notification KEVENT
+class NotificationEvent
+{
+public:
+
+    void set()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        signaled = true;
+        condition.notify_all();
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        signaled = false;
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return signaled; });
+    }
+
+private:
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool signaled = false;
+};
+
+/// Allocation table with LastAllocatedBlock and BlockClaimEvent from
+/// DEVICE_EXTENSION. With naive set, claims and allocations are plain
+/// reads followed by writes, as when only the worker thread allocated
+/// blocks, so that the stress test can show what happens without atomic
+/// operations. Threads yield between read and write, as if preempted, so
+/// that races show up in short test runs.
+class BlockTable
+{
+public:
+
+    BlockTable(int32_t blocks, bool naive = false)
+        : entries(new std::atomic<int32_t>[blocks]), naive(naive)
+    {
+        for (int32_t i = 0; i < blocks; i++)
+        {
+            entries[i] = DIFF_BLOCK_UNALLOCATED;
+        }
+    }
+
+    BlockTable(const BlockTable &) = delete;
+    BlockTable &operator=(const BlockTable &) = delete;
+
+    /// Raw table entry, including DIFF_BLOCK_CLAIMED
+    int32_t entry(int32_t block) const
+    {
+        return entries[block].load();
+    }
+
+    int32_t last_allocated() const
+    {
+        return last_allocated_block.load();
+    }
+
+    /// AIMWrFltrGetDiffBlock. Claimed blocks read as unallocated.
+    int32_t get_diff_block(int32_t block) const
+    {
+        int32_t block_address = entries[block].load();
+
+        return block_address == DIFF_BLOCK_CLAIMED ?
+            DIFF_BLOCK_UNALLOCATED : block_address;
+    }
+
+    /// AIMWrFltrAllocateDiffBlocks. Returns first of count consecutive
+    /// diff blocks.
+    int32_t allocate_diff_blocks(int32_t count)
+    {
+        if (naive)
+        {
+            int32_t first = last_allocated_block.load() + 1;
+            std::this_thread::yield();
+            last_allocated_block.store(first + count - 1);
+            return first;
+        }
+
+        return last_allocated_block.fetch_add(count) + 1;
+    }
+
+    /// AIMWrFltrResolveBlockClaims. Sets claimed blocks to consecutive
+    /// diff blocks from block_address, or back to unallocated.
+    void resolve_claims(int32_t first_block, uint32_t blocks,
+        int32_t block_address)
+    {
+        for (uint32_t i = 0; i < blocks; i++)
+        {
+            entries[first_block + i].store(
+                block_address == DIFF_BLOCK_UNALLOCATED ?
+                DIFF_BLOCK_UNALLOCATED : block_address + (int32_t)i);
+        }
+
+        claim_event.set();
+    }
+
+    /// AIMWrFltrReleaseClaimedBlocks. Blocks claimed by caller within
+    /// first_block to last_block back to unallocated.
+    void release_claimed(int32_t first_block, int32_t last_block)
+    {
+        for (int32_t i = first_block; i <= last_block; i++)
+        {
+            if (entries[i].load() == DIFF_BLOCK_CLAIMED)
+            {
+                resolve_claims(i, 1, DIFF_BLOCK_UNALLOCATED);
+            }
+        }
+    }
+
+    /// AIMWrFltrClaimNewBlock. Claims a block for a direct write that was
+    /// unallocated when request was checked. Returns false if another
+    /// request has claimed or allocated it since then.
+    bool claim_new_block(int32_t block)
+    {
+        return claim(block) == DIFF_BLOCK_UNALLOCATED;
+    }
+
+    /// AIMWrFltrClaimDeferredBlock. Waits while block is claimed by a
+    /// direct write. Claims unallocated block and returns
+    /// DIFF_BLOCK_UNALLOCATED, otherwise returns its diff block. waits is
+    /// incremented each time caller had to wait.
+    int32_t claim_deferred_block(int32_t block, uint64_t &waits)
+    {
+        for (;;)
+        {
+            claim_event.clear();
+
+            int32_t block_address = claim(block);
+
+            if (block_address != DIFF_BLOCK_CLAIMED)
+            {
+                return block_address;
+            }
+
+            ++waits;
+
+            claim_event.wait();
+        }
+    }
+
+private:
+
+    /// InterlockedCompareExchange from unallocated to claimed. Returns
+    /// previous value.
+    int32_t claim(int32_t block)
+    {
+        if (naive)
+        {
+            int32_t block_address = entries[block].load();
+
+            if (block_address == DIFF_BLOCK_UNALLOCATED)
+            {
+                std::this_thread::yield();
+                entries[block].store(DIFF_BLOCK_CLAIMED);
+            }
+
+            return block_address;
+        }
+
+        int32_t block_address = DIFF_BLOCK_UNALLOCATED;
+
+        entries[block].compare_exchange_strong(block_address,
+            DIFF_BLOCK_CLAIMED);
+
+        return block_address;
+    }
+
+    std::unique_ptr<std::atomic<int32_t>[]> entries;
+    std::atomic<int32_t> last_allocated_block{ 0 };
+    NotificationEvent claim_event;
+    bool naive;
+};
+
+}
+
+#endif // _AIMWRFLTR_SIM_BLOCKTABLE_H_
@@ -0,0 +1,961 @@
+/// claimstress.cpp
+/// aimwrfltr-claimstress command line application. Stress test for the
+/// protocol that lets direct writes claim and allocate new blocks while
+/// the worker thread does the same (blocktable.h). Writer threads send
+/// random writes through a model of the direct write path in AIMWrFltrWrite
+/// and hand requests over to one worker thread where the driver would.
+/// Reader threads check that no block is visible before its diff block
+/// holds data, while writes are in progress.
+///
+/// The worker thread allocates about half of new blocks for partial writes
+/// without filling them up, and marks sectors not written as missing in a
+/// sector bitmap, as the driver does for sector aligned writes. Missing
+/// sectors read as original data. Direct writes must never write sectors
+/// still marked missing, since those would then never be read.
+///
+/// Each writer has a range of blocks of its own, with contents verified
+/// exactly at end, and all writers also write to a shared range, where
+/// each sector must hold original data or data from some write to it.
+/// Writes to shared range go to a few blocks around a position that moves
+/// forward through the range, so that writers often race to claim the
+/// same new blocks.
+/// Diff block accounting is verified at end: no claims left, no diff
+/// block used for two blocks, and all allocated diff blocks either in
+/// table or left unused by failed writes.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "blocktable.h"
+
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <random>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using namespace aimwrfltr;
+
+using stress_clock = std::chrono::steady_clock;
+
+/// Sectors in an allocation block in this model. Fewer than in driver,
+/// so that partial writes often cover complete blocks.
+constexpr uint32_t SECTORS_PER_BLOCK = 8;
+
+/// Diff device sector contents before first write
+constexpr uint64_t SECTOR_UNWRITTEN = 0;
+
+/// Owner of a diff block not yet written
+constexpr int32_t NO_OWNER = -1;
+
+struct StressOptions
+{
+    int32_t blocks = 4096;
+    unsigned writers = 4;
+    unsigned readers = 2;
+    uint64_t writes = 100000;
+    uint32_t max_blocks = 4;
+    unsigned partial_percent = 20;
+    int32_t hot_blocks = 1024;
+    unsigned hot_percent = 20;
+    unsigned fail_ppm = 1000;
+    unsigned latency_us = 0;
+    bool naive = false;
+    uint32_t seed = 1;
+};
+
+struct WriteRequest
+{
+    int32_t first_block = 0;
+    uint32_t first_sector = 0;
+    uint32_t sectors = 0;
+    std::vector<uint64_t> data;
+    std::promise<bool> done;
+};
+
+struct DiffSlot
+{
+    std::atomic<int32_t> owner{ NO_OWNER };
+    std::atomic<uint64_t> sectors[SECTORS_PER_BLOCK];
+
+    DiffSlot()
+    {
+        for (std::atomic<uint64_t> &sector : sectors)
+        {
+            sector = SECTOR_UNWRITTEN;
+        }
+    }
+};
+
+static uint64_t original_sector(int32_t block, uint32_t sector)
+{
+    return (1ull << 63) | ((uint64_t)block << 8) | sector;
+}
+
+/// Sector bitmap bits for sectors from first_sector within a block
+static uint32_t sector_mask(uint32_t first_sector, uint32_t sectors)
+{
+    return ((1u << sectors) - 1) << first_sector;
+}
+
+class ClaimStress
+{
+public:
+
+    explicit ClaimStress(const StressOptions &options)
+        : options(options),
+        table(options.blocks, options.naive),
+        capacity(options.blocks * 2 + (int32_t)options.max_blocks + 16),
+        diff(new DiffSlot[capacity + 1]),
+        missing(new std::atomic<uint32_t>[options.blocks]),
+        failure_budget(options.blocks)
+    {
+        for (int32_t i = 0; i < options.blocks; i++)
+        {
+            missing[i] = 0;
+        }
+    }
+
+    int run();
+
+private:
+
+    void error(const char *format, ...)
+        __attribute__((format(printf, 2, 3)))
+    {
+        if (errors.fetch_add(1) < 20)
+        {
+            va_list args;
+            va_start(args, format);
+            vfprintf(stderr, format, args);
+            va_end(args);
+        }
+    }
+
+    bool inject_failure(std::mt19937_64 &random, uint32_t blocks)
+    {
+        return (options.fail_ppm > 0) &&
+            (random() % 1000000 < options.fail_ppm) &&
+            (failure_budget.fetch_sub(blocks) >= (int64_t)blocks);
+    }
+
+    bool lower_write(std::mt19937_64 &random, int32_t address, int32_t block,
+        uint32_t first_sector, uint32_t sectors, const uint64_t *data);
+
+    bool direct_write(std::mt19937_64 &random, WriteRequest &request,
+        bool &success);
+
+    bool deferred_write(std::mt19937_64 &random, WriteRequest &request);
+
+    void writer(unsigned index);
+    void worker();
+    void reader(unsigned index);
+    void verify();
+
+    const StressOptions &options;
+    BlockTable table;
+    int32_t capacity;
+    std::unique_ptr<DiffSlot[]> diff;
+    std::unique_ptr<std::atomic<uint32_t>[]> missing;
+    std::atomic<int64_t> failure_budget;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_event;
+    std::deque<WriteRequest *> queue;
+    bool shutdown = false;
+    std::atomic<bool> writers_done{ false };
+    std::atomic<uint64_t> shared_position{ 0 };
+
+    int32_t private_blocks = 0;
+    std::vector<std::vector<uint64_t>> expected;
+    std::vector<std::vector<uint64_t>> shared_writes;
+
+    std::atomic<uint64_t> errors{ 0 };
+    std::atomic<uint64_t> direct_writes{ 0 };
+    std::atomic<uint64_t> direct_new_blocks{ 0 };
+    std::atomic<uint64_t> deferred_writes{ 0 };
+    std::atomic<uint64_t> claim_conflicts{ 0 };
+    std::atomic<uint64_t> partial_new_blocks{ 0 };
+    std::atomic<uint64_t> failed_writes{ 0 };
+    std::atomic<uint64_t> unused_blocks{ 0 };
+    std::atomic<uint64_t> reads_checked{ 0 };
+    uint64_t worker_waits = 0;
+};
+
+/// Lower level write of sectors from first_sector in block to diff blocks
+/// from address. Diff blocks must not already hold any other block.
+bool ClaimStress::lower_write(std::mt19937_64 &random, int32_t address,
+    int32_t block, uint32_t first_sector, uint32_t sectors,
+    const uint64_t *data)
+{
+    uint32_t blocks = (first_sector + sectors + SECTORS_PER_BLOCK - 1) /
+        SECTORS_PER_BLOCK;
+
+    if (address <= 0 || address + (int32_t)blocks - 1 > capacity)
+    {
+        error("Diff block %i outside diff device\n", address);
+        return false;
+    }
+
+    if (inject_failure(random, blocks))
+    {
+        ++failed_writes;
+        return false;
+    }
+
+    for (uint32_t i = 0; i < sectors; i++)
+    {
+        uint32_t sector = first_sector + i;
+        int32_t this_block = block + (int32_t)(sector / SECTORS_PER_BLOCK);
+        DiffSlot &slot = diff[address + sector / SECTORS_PER_BLOCK];
+        int32_t owner = NO_OWNER;
+
+        if (!slot.owner.compare_exchange_strong(owner, this_block) &&
+            owner != this_block)
+        {
+            error("Diff block %i used for blocks %i and %i\n",
+                address + (int32_t)(sector / SECTORS_PER_BLOCK), owner,
+                this_block);
+        }
+
+        slot.sectors[sector % SECTORS_PER_BLOCK] = data[i];
+    }
+
+    if (options.latency_us > 0)
+    {
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(options.latency_us));
+    }
+
+    return true;
+}
+
+/// AIMWrFltrWrite. Returns false if request needs to be handed over to
+/// worker thread, otherwise sends it and sets success.
+bool ClaimStress::direct_write(std::mt19937_64 &random,
+    WriteRequest &request, bool &success)
+{
+    uint32_t end_sector = request.first_sector + request.sectors;
+    int32_t first = request.first_block;
+    int32_t last = first + (int32_t)((end_sector - 1) / SECTORS_PER_BLOCK);
+    bool any_block_unmodified = false;
+    int32_t new_blocks = 0;
+    int32_t last_claimed = -1;
+
+    for (int32_t i = first; i <= last && !any_block_unmodified; i++)
+    {
+        int32_t block_address = table.entry(i);
+        uint32_t block_first = i > first ? 0 : request.first_sector;
+        uint32_t block_end = i < last ? SECTORS_PER_BLOCK :
+            (end_sector - 1) % SECTORS_PER_BLOCK + 1;
+
+        if (block_address == DIFF_BLOCK_UNALLOCATED)
+        {
+            if (block_first > 0 || block_end < SECTORS_PER_BLOCK)
+            {
+                any_block_unmodified = true;
+                continue;
+            }
+
+            // As if preempted after block was checked, so that worker
+            // thread or other writers often get to claim it first
+            std::this_thread::yield();
+
+            if (table.claim_new_block(i))
+            {
+                ++new_blocks;
+                last_claimed = i;
+            }
+            else
+            {
+                ++claim_conflicts;
+                any_block_unmodified = true;
+            }
+        }
+        else if (block_address == DIFF_BLOCK_CLAIMED ||
+            (missing[i] & sector_mask(block_first, block_end - block_first)))
+        {
+            any_block_unmodified = true;
+        }
+    }
+
+    if (any_block_unmodified)
+    {
+        if (new_blocks > 0)
+        {
+            table.release_claimed(first, last_claimed);
+        }
+
+        return false;
+    }
+
+    ++direct_writes;
+    direct_new_blocks += (uint64_t)new_blocks;
+
+    int32_t next_new_block = 0;
+
+    if (new_blocks > 0)
+    {
+        next_new_block = table.allocate_diff_blocks(new_blocks);
+    }
+
+    uint32_t sectors_done = 0;
+    success = true;
+
+    for (int32_t i = first; i <= last && sectors_done < request.sectors; i++)
+    {
+        uint32_t sector_in_block =
+            (request.first_sector + sectors_done) % SECTORS_PER_BLOCK;
+        uint32_t sectors_this_iter = request.sectors - sectors_done;
+        uint32_t block_sectors = SECTORS_PER_BLOCK;
+        int32_t run_first = i;
+        int32_t block_base = table.entry(i);
+        uint32_t claimed_blocks = 0;
+
+        if (block_base == DIFF_BLOCK_CLAIMED)
+        {
+            block_base = next_new_block++;
+            claimed_blocks = 1;
+        }
+
+        int32_t run_address = block_base;
+
+        while (sector_in_block + sectors_this_iter > block_sectors)
+        {
+            int32_t next_block_address = table.entry(i + 1);
+
+            if (claimed_blocks > 0 ?
+                next_block_address == DIFF_BLOCK_CLAIMED :
+                next_block_address == table.entry(i) + 1)
+            {
+                if (claimed_blocks > 0)
+                {
+                    ++next_new_block;
+                    ++claimed_blocks;
+                }
+
+                block_sectors += SECTORS_PER_BLOCK;
+                ++i;
+            }
+            else
+            {
+                sectors_this_iter = block_sectors - sector_in_block;
+            }
+        }
+
+        bool written = lower_write(random, run_address, run_first,
+            sector_in_block, sectors_this_iter,
+            request.data.data() + sectors_done);
+
+        for (uint32_t sector = sector_in_block;
+            written && claimed_blocks == 0 &&
+            sector < sector_in_block + sectors_this_iter; sector++)
+        {
+            int32_t this_block = run_first + (int32_t)(sector / SECTORS_PER_BLOCK);
+
+            if (missing[this_block] & (1u << (sector % SECTORS_PER_BLOCK)))
+            {
+                error("Block %i sector %u written directly while missing\n",
+                    this_block, sector % SECTORS_PER_BLOCK);
+            }
+        }
+
+        if (claimed_blocks > 0)
+        {
+            table.resolve_claims(run_first, claimed_blocks,
+                written ? run_address : DIFF_BLOCK_UNALLOCATED);
+
+            if (!written)
+            {
+                unused_blocks += claimed_blocks;
+            }
+        }
+
+        if (!written)
+        {
+            success = false;
+        }
+
+        sectors_done += sectors_this_iter;
+    }
+
+    return true;
+}
+
+/// AIMWrFltrDeferredWrite, one block at a time
+bool ClaimStress::deferred_write(std::mt19937_64 &random,
+    WriteRequest &request)
+{
+    uint32_t sectors_done = 0;
+    bool success = true;
+
+    for (int32_t i = request.first_block; sectors_done < request.sectors; i++)
+    {
+        uint32_t sector_in_block =
+            (request.first_sector + sectors_done) % SECTORS_PER_BLOCK;
+        uint32_t sectors_this_iter = std::min(request.sectors - sectors_done,
+            SECTORS_PER_BLOCK - sector_in_block);
+        const uint64_t *data = request.data.data() + sectors_done;
+
+        int32_t block_address = table.claim_deferred_block(i, worker_waits);
+
+        uint32_t mask = sector_mask(sector_in_block, sectors_this_iter);
+
+        if (block_address == DIFF_BLOCK_UNALLOCATED &&
+            sectors_this_iter < SECTORS_PER_BLOCK && random() % 2 == 0)
+        {
+            block_address = table.allocate_diff_blocks(1);
+
+            bool written = lower_write(random, block_address, i,
+                sector_in_block, sectors_this_iter, data);
+
+            if (written)
+            {
+                ++partial_new_blocks;
+                missing[i] = sector_mask(0, SECTORS_PER_BLOCK) & ~mask;
+            }
+            else
+            {
+                ++unused_blocks;
+                success = false;
+            }
+
+            table.resolve_claims(i, 1,
+                written ? block_address : DIFF_BLOCK_UNALLOCATED);
+        }
+        else if (block_address == DIFF_BLOCK_UNALLOCATED)
+        {
+            uint64_t fill[SECTORS_PER_BLOCK];
+
+            for (uint32_t sector = 0; sector < SECTORS_PER_BLOCK; sector++)
+            {
+                fill[sector] = original_sector(i, sector);
+            }
+
+            std::copy(data, data + sectors_this_iter, fill + sector_in_block);
+
+            block_address = table.allocate_diff_blocks(1);
+
+            bool written = lower_write(random, block_address, i, 0,
+                SECTORS_PER_BLOCK, fill);
+
+            table.resolve_claims(i, 1,
+                written ? block_address : DIFF_BLOCK_UNALLOCATED);
+
+            if (!written)
+            {
+                ++unused_blocks;
+                success = false;
+            }
+        }
+        else if (lower_write(random, block_address, i, sector_in_block,
+            sectors_this_iter, data))
+        {
+            missing[i] &= ~mask;
+        }
+        else
+        {
+            success = false;
+        }
+
+        sectors_done += sectors_this_iter;
+    }
+
+    return success;
+}
+
+void ClaimStress::worker()
+{
+    std::mt19937_64 random(options.seed * 1000 + 999);
+
+    for (;;)
+    {
+        WriteRequest *request;
+
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+
+            queue_event.wait(lock, [this] { return shutdown || !queue.empty(); });
+
+            if (queue.empty())
+            {
+                return;
+            }
+
+            request = queue.front();
+            queue.pop_front();
+        }
+
+        request->done.set_value(deferred_write(random, *request));
+    }
+}
+
+void ClaimStress::writer(unsigned index)
+{
+    std::mt19937_64 random(options.seed * 1000 + index);
+    int32_t private_first = options.hot_blocks + (int32_t)index * private_blocks;
+    std::vector<uint64_t> &image = expected[index];
+    std::vector<uint64_t> &shared = shared_writes[index];
+
+    for (uint64_t n = 0; n < options.writes; n++)
+    {
+        bool hot = private_blocks == 0 ||
+            (options.hot_blocks > 0 && random() % 100 < options.hot_percent);
+        int32_t region_first = hot ? 0 : private_first;
+        int32_t region_blocks = hot ? options.hot_blocks : private_blocks;
+
+        int32_t blocks = std::min<int32_t>(region_blocks,
+            1 + (int32_t)(random() % options.max_blocks));
+
+        WriteRequest request;
+
+        if (hot)
+        {
+            int32_t positions = region_blocks - blocks + 1;
+            uint64_t position = shared_position++ / options.writers;
+
+            request.first_block = region_first +
+                (int32_t)((position + random() % options.max_blocks) %
+                    (uint64_t)positions);
+        }
+        else
+        {
+            request.first_block = region_first +
+                (int32_t)(random() % (uint64_t)(region_blocks - blocks + 1));
+        }
+
+        uint32_t region_sectors = (uint32_t)blocks * SECTORS_PER_BLOCK;
+
+        if (random() % 100 < options.partial_percent)
+        {
+            request.first_sector = (uint32_t)(random() % region_sectors);
+            request.sectors = 1 + (uint32_t)(random() %
+                (region_sectors - request.first_sector));
+        }
+        else
+        {
+            request.sectors = region_sectors;
+        }
+
+        request.first_block += (int32_t)(request.first_sector / SECTORS_PER_BLOCK);
+        request.first_sector %= SECTORS_PER_BLOCK;
+
+        uint64_t tag = ((uint64_t)(index + 1) << 40) | (n + 1);
+
+        request.data.assign(request.sectors, tag);
+
+        // Failed requests are sent again until they succeed, so that
+        // final contents are known
+        for (;;)
+        {
+            bool success;
+
+            if (!direct_write(random, request, success))
+            {
+                ++deferred_writes;
+
+                request.done = std::promise<bool>();
+                std::future<bool> done = request.done.get_future();
+
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    queue.push_back(&request);
+                }
+
+                queue_event.notify_one();
+
+                success = done.get();
+            }
+
+            if (success)
+            {
+                break;
+            }
+        }
+
+        for (uint32_t i = 0; i < request.sectors; i++)
+        {
+            uint64_t sector = (uint64_t)request.first_block * SECTORS_PER_BLOCK +
+                request.first_sector + i;
+
+            if (hot)
+            {
+                shared.push_back(tag | (sector << 50));
+            }
+            else
+            {
+                image[sector - (uint64_t)private_first * SECTORS_PER_BLOCK] = tag;
+            }
+        }
+    }
+}
+
+/// Checks that blocks are only visible when their diff blocks hold data
+void ClaimStress::reader(unsigned index)
+{
+    std::mt19937_64 random(options.seed * 1000 + 500 + index);
+
+    while (!writers_done)
+    {
+        int32_t block = (int32_t)(random() % (uint64_t)options.blocks);
+        int32_t block_address = table.get_diff_block(block);
+
+        if (block_address == DIFF_BLOCK_UNALLOCATED)
+        {
+            continue;
+        }
+
+        ++reads_checked;
+
+        if (block_address < 0 || block_address > table.last_allocated() ||
+            block_address > capacity)
+        {
+            error("Block %i at diff block %i, last allocated %i\n",
+                block, block_address, table.last_allocated());
+
+            continue;
+        }
+
+        DiffSlot &slot = diff[block_address];
+
+        if (slot.owner != block)
+        {
+            error("Block %i at diff block %i that holds block %i\n",
+                block, block_address, slot.owner.load());
+        }
+
+        uint32_t missing_sectors = missing[block];
+
+        for (uint32_t sector = 0; sector < SECTORS_PER_BLOCK; sector++)
+        {
+            if ((missing_sectors & (1u << sector)) == 0 &&
+                slot.sectors[sector] == SECTOR_UNWRITTEN)
+            {
+                error("Block %i visible at diff block %i before sector %u written\n",
+                    block, block_address, sector);
+
+                break;
+            }
+        }
+    }
+}
+
+void ClaimStress::verify()
+{
+    std::vector<int32_t> used_by(capacity + 1, NO_OWNER);
+    uint64_t allocated = 0;
+
+    for (int32_t block = 0; block < options.blocks; block++)
+    {
+        int32_t block_address = table.entry(block);
+
+        if (block_address == DIFF_BLOCK_CLAIMED)
+        {
+            error("Block %i still claimed\n", block);
+            continue;
+        }
+
+        if (block_address == DIFF_BLOCK_UNALLOCATED)
+        {
+            continue;
+        }
+
+        ++allocated;
+
+        if (block_address > table.last_allocated() || block_address > capacity)
+        {
+            error("Block %i at diff block %i, last allocated %i\n",
+                block, block_address, table.last_allocated());
+
+            continue;
+        }
+
+        if (used_by[block_address] != NO_OWNER)
+        {
+            error("Diff block %i used for blocks %i and %i\n",
+                block_address, used_by[block_address], block);
+        }
+
+        used_by[block_address] = block;
+    }
+
+    if (allocated + unused_blocks != (uint64_t)table.last_allocated())
+    {
+        error("%llu blocks in table and %llu unused, but %i allocated\n",
+            (unsigned long long)allocated, (unsigned long long)unused_blocks.load(),
+            table.last_allocated());
+    }
+
+    std::unordered_set<uint64_t> shared;
+
+    for (const std::vector<uint64_t> &writes : shared_writes)
+    {
+        shared.insert(writes.begin(), writes.end());
+    }
+
+    for (int32_t block = 0; block < options.blocks; block++)
+    {
+        int32_t block_address = table.get_diff_block(block);
+
+        for (uint32_t sector = 0; sector < SECTORS_PER_BLOCK; sector++)
+        {
+            uint64_t data = block_address == DIFF_BLOCK_UNALLOCATED ||
+                block_address > capacity ||
+                (missing[block] & (1u << sector)) ?
+                original_sector(block, sector) :
+                diff[block_address].sectors[sector].load();
+
+            uint64_t abs_sector = (uint64_t)block * SECTORS_PER_BLOCK + sector;
+
+            if (block < options.hot_blocks)
+            {
+                if (data != original_sector(block, sector) &&
+                    shared.find(data | (abs_sector << 50)) == shared.end())
+                {
+                    error("Block %i sector %u holds 0x%llX, never written there\n",
+                        block, sector, (unsigned long long)data);
+                }
+
+                continue;
+            }
+
+            unsigned owner = (unsigned)((block - options.hot_blocks) / private_blocks);
+            uint64_t expected_data = owner < options.writers ?
+                expected[owner][abs_sector -
+                (uint64_t)(options.hot_blocks + (int32_t)owner * private_blocks) *
+                SECTORS_PER_BLOCK] :
+                original_sector(block, sector);
+
+            if (data != expected_data)
+            {
+                error("Block %i sector %u holds 0x%llX, expected 0x%llX\n",
+                    block, sector, (unsigned long long)data,
+                    (unsigned long long)expected_data);
+            }
+        }
+    }
+}
+
+int ClaimStress::run()
+{
+    private_blocks = (options.blocks - options.hot_blocks) / (int32_t)options.writers;
+
+    expected.resize(options.writers);
+    shared_writes.resize(options.writers);
+
+    for (unsigned i = 0; i < options.writers; i++)
+    {
+        int32_t private_first = options.hot_blocks + (int32_t)i * private_blocks;
+
+        expected[i].resize((size_t)private_blocks * SECTORS_PER_BLOCK);
+
+        for (size_t sector = 0; sector < expected[i].size(); sector++)
+        {
+            expected[i][sector] = original_sector(
+                private_first + (int32_t)(sector / SECTORS_PER_BLOCK),
+                (uint32_t)(sector % SECTORS_PER_BLOCK));
+        }
+    }
+
+    auto start_time = stress_clock::now();
+
+    std::thread worker_thread([this] { worker(); });
+    std::vector<std::thread> readers;
+    std::vector<std::thread> writers;
+
+    for (unsigned i = 0; i < options.readers; i++)
+    {
+        readers.emplace_back([this, i] { reader(i); });
+    }
+
+    for (unsigned i = 0; i < options.writers; i++)
+    {
+        writers.emplace_back([this, i] { writer(i); });
+    }
+
+    for (std::thread &thread : writers)
+    {
+        thread.join();
+    }
+
+    writers_done = true;
+
+    for (std::thread &thread : readers)
+    {
+        thread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        shutdown = true;
+    }
+
+    queue_event.notify_one();
+    worker_thread.join();
+
+    double elapsed = std::chrono::duration<double>(
+        stress_clock::now() - start_time).count();
+
+    verify();
+
+    printf("Elapsed time:          %10.3f s\n", elapsed);
+    printf("Writes:                %10llu\n",
+        (unsigned long long)(options.writes * options.writers));
+    printf("Direct writes:         %10llu\n", (unsigned long long)direct_writes.load());
+    printf("New blocks direct:     %10llu\n", (unsigned long long)direct_new_blocks.load());
+    printf("Deferred writes:       %10llu\n", (unsigned long long)deferred_writes.load());
+    printf("Claim conflicts:       %10llu\n", (unsigned long long)claim_conflicts.load());
+    printf("Partial new blocks:    %10llu\n", (unsigned long long)partial_new_blocks.load());
+    printf("Worker claim waits:    %10llu\n", (unsigned long long)worker_waits);
+    printf("Failed lower writes:   %10llu\n", (unsigned long long)failed_writes.load());
+    printf("Unused diff blocks:    %10llu\n", (unsigned long long)unused_blocks.load());
+    printf("Allocated diff blocks: %10i\n", table.last_allocated());
+    printf("Reads checked:         %10llu\n", (unsigned long long)reads_checked.load());
+    printf("Errors:                %10llu\n", (unsigned long long)errors.load());
+
+    return errors > 0 ? 1 : 0;
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "aimwrfltr-claimstress [options]\n"
+        "\n"
+        "Runs writer threads that claim and allocate new blocks directly,\n"
+        "one worker thread for requests handed over to it, and reader threads\n"
+        "that check blocks while they are written. Verifies allocation table\n"
+        "and contents at end. Exit code is 1 if any errors were found.\n"
+        "\n"
+        "-b, --blocks count        Allocation blocks in volume, default 4096.\n"
+        "-t, --writers count       Writer threads, default 4.\n"
+        "-r, --readers count       Reader threads, default 2.\n"
+        "-n, --writes count        Writes for each writer thread, default\n"
+        "                          100000.\n"
+        "-m, --max-blocks count    Largest write in blocks, default 4.\n"
+        "-p, --partial percent     Writes not aligned to blocks, default 20.\n"
+        "-s, --shared count        Blocks that all writers write to, default\n"
+        "                          1024.\n"
+        "-h, --shared-percent pct  Writes to shared blocks, default 20.\n"
+        "-f, --fail-ppm count      Lower level writes that fail, per million,\n"
+        "                          default 1000.\n"
+        "-l, --latency us          Time for each lower level write, default 0.\n"
+        "-u, --naive               Claim and allocate with plain reads and\n"
+        "                          writes instead of atomic operations, as\n"
+        "                          when only worker thread allocated blocks.\n"
+        "-S, --seed number         Random seed, default 1.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "blocks", required_argument, nullptr, 'b' },
+        { "writers", required_argument, nullptr, 't' },
+        { "readers", required_argument, nullptr, 'r' },
+        { "writes", required_argument, nullptr, 'n' },
+        { "max-blocks", required_argument, nullptr, 'm' },
+        { "partial", required_argument, nullptr, 'p' },
+        { "shared", required_argument, nullptr, 's' },
+        { "shared-percent", required_argument, nullptr, 'h' },
+        { "fail-ppm", required_argument, nullptr, 'f' },
+        { "latency", required_argument, nullptr, 'l' },
+        { "naive", no_argument, nullptr, 'u' },
+        { "seed", required_argument, nullptr, 'S' },
+        { "help", no_argument, nullptr, '?' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    StressOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:t:r:n:m:p:s:h:f:l:uS:",
+        long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            options.blocks = (int32_t)strtol(optarg, nullptr, 0);
+            break;
+
+        case 't':
+            options.writers = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'r':
+            options.readers = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'n':
+            options.writes = strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'm':
+            options.max_blocks = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'p':
+            options.partial_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 's':
+            options.hot_blocks = (int32_t)strtol(optarg, nullptr, 0);
+            break;
+
+        case 'h':
+            options.hot_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'f':
+            options.fail_ppm = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'l':
+            options.latency_us = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'u':
+            options.naive = true;
+            break;
+
+        case 'S':
+            options.seed = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind < argc || options.writers == 0 || options.max_blocks == 0 ||
+        options.hot_blocks < 0 || options.blocks <= options.hot_blocks ||
+        options.fail_ppm >= 1000000 ||
+        (options.blocks - options.hot_blocks) / (int32_t)options.writers <
+        (int32_t)options.max_blocks ||
+        (options.hot_blocks > 0 && options.hot_blocks < (int32_t)options.max_blocks))
+    {
+        usage();
+        return 1;
+    }
+
+    ClaimStress stress(options);
+
+    return stress.run();
+}
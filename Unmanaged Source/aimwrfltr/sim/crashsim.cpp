@@ -0,0 +1,1614 @@
+/// crashsim.cpp
+/// aimwrfltr-crashsim command line application. Crash injection test for
+/// the allocation journal. Runs random writes and flushes through a model
+/// of the driver's deferred write, journal commit and checkpoint paths
+/// (write.cpp, journal.cpp and AIMWrFltSaveDiffHeader), against a diff
+/// device stored in a file. Writes go to a volatile write cache in front
+/// of the file, as with a disk write cache, and are only certain to reach
+/// the file when the diff device is flushed.
+///
+/// At a random point, the model crashes: each write still in cache is
+/// lost, written, or torn with only some of its sectors written. Diff
+/// device is then opened again the way AIMWrFltrInitializeDiffDevice does
+/// it, which can also crash, and every sector of protected volume is
+/// checked. Each sector must hold data from the last write acknowledged
+/// by a flush, or from a later write, and no allocation table entry or
+/// sector bitmap may lead to diff device data that was not written for
+/// that sector. Writes then continue on the recovered diff device, so
+/// that journal records left from before a crash are also tested.
+///
+/// Blocks that no table entry, directory or region refers to when diff
+/// device is opened, such as blocks written before a crash but never
+/// journaled, are allocated again the way AIMWrFltrBuildFreeBlockMap and
+/// AIMWrFltrAllocateDiffBlocks do it. With --compact, some requests are
+/// idle compaction steps from compact.cpp instead, which move diff blocks
+/// and only reuse blocks moved from after header is saved and flushed.
+/// With --trim, some requests are trims, where blocks covered completely
+/// are freed the way AIMWrFltrFreeTrimmedBlocks does it, and their
+/// sectors may then read original data. Blocks are then also checked for
+/// being referenced twice, or both referenced and free.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "journal.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <memory>
+#include <random>
+
+using namespace aimwrfltr;
+
+/// Diff device sector written for a sector at protected volume
+constexpr uint64_t DATA_SECTOR_MAGIC = 0x41544144544C4657;
+
+/// Generation of data from original volume
+constexpr uint64_t ORIGINAL_DATA = 0;
+
+/// Compaction step sizes, smaller than in the driver so that passes span
+/// several steps and blocks moved from are released in the middle of them
+constexpr uint32_t COMPACT_SCAN_BLOCKS = 64;
+constexpr uint32_t COMPACT_MOVES_PER_STEP = 4;
+constexpr uint32_t COMPACT_PENDING_BLOCKS = 16;
+
+struct CrashOptions
+{
+    uint32_t block_bits = 12;
+    uint32_t volume_blocks = 1024;
+    uint32_t journal_sectors = 64;
+    uint32_t journal_entries = 256;
+    unsigned iterations = 200;
+    unsigned crashes = 5;
+    unsigned max_requests = 400;
+    unsigned flush_percent = 10;
+    unsigned checkpoint_interval = 100;
+    unsigned compact_percent = 0;
+    unsigned trim_percent = 0;
+    const char *path = nullptr;
+    bool unordered = false;
+    uint32_t seed = 1;
+};
+
+struct DataSector
+{
+    uint64_t magic;
+    int64_t volume_sector;
+    uint64_t generation;
+};
+
+/// Thrown by CachedFile when crash point is reached
+struct Crash
+{
+};
+
+/// File stand-in for diff device with a volatile write cache
+class CachedFile
+{
+public:
+
+    explicit CachedFile(int fd)
+        : fd(fd)
+    {
+    }
+
+    void truncate()
+    {
+        pending.clear();
+
+        if (ftruncate(fd, 0) != 0)
+        {
+            perror("ftruncate");
+            exit(1);
+        }
+    }
+
+    /// Crash when this many more writes and flushes have been issued
+    void arm(uint64_t operations)
+    {
+        armed = true;
+        operations_left = operations;
+    }
+
+    void disarm()
+    {
+        armed = false;
+    }
+
+    bool read(uint64_t offset, void *buffer, size_t length) const
+    {
+        memset(buffer, 0, length);
+
+        if (pread(fd, buffer, length, (off_t)offset) < 0)
+        {
+            return false;
+        }
+
+        for (const PendingWrite &write : pending)
+        {
+            uint64_t begin = std::max(offset, write.offset);
+            uint64_t end = std::min(offset + length,
+                write.offset + write.data.size());
+
+            if (begin < end)
+            {
+                memcpy((uint8_t *)buffer + (begin - offset),
+                    &write.data[begin - write.offset], end - begin);
+            }
+        }
+
+        return true;
+    }
+
+    void write(uint64_t offset, const void *buffer, size_t length)
+    {
+        step();
+
+        pending.push_back({ offset, std::vector<uint8_t>(
+            (const uint8_t *)buffer, (const uint8_t *)buffer + length) });
+    }
+
+    void flush()
+    {
+        step();
+
+        for (const PendingWrite &write : pending)
+        {
+            store(write.offset, write.data.data(), write.data.size());
+        }
+
+        pending.clear();
+    }
+
+    /// Writes in cache are lost, written or torn, in any order
+    void crash(std::mt19937 &random)
+    {
+        std::shuffle(pending.begin(), pending.end(), random);
+
+        for (const PendingWrite &write : pending)
+        {
+            switch (random() % 3)
+            {
+            case 0:
+                ++lost_writes;
+                break;
+
+            case 1:
+                store(write.offset, write.data.data(), write.data.size());
+                break;
+
+            default:
+                ++torn_writes;
+
+                for (size_t i = 0; i < write.data.size(); i += SECTOR_SIZE)
+                {
+                    if (random() % 2 == 0)
+                    {
+                        store(write.offset + i, &write.data[i], SECTOR_SIZE);
+                    }
+                }
+            }
+        }
+
+        pending.clear();
+        armed = false;
+    }
+
+    uint64_t lost_writes = 0;
+    uint64_t torn_writes = 0;
+
+private:
+
+    struct PendingWrite
+    {
+        uint64_t offset;
+        std::vector<uint8_t> data;
+    };
+
+    void step()
+    {
+        if (armed && operations_left-- == 0)
+        {
+            throw Crash();
+        }
+    }
+
+    void store(uint64_t offset, const void *buffer, size_t length)
+    {
+        if (pwrite(fd, buffer, length, (off_t)offset) != (ssize_t)length)
+        {
+            perror("pwrite");
+            exit(1);
+        }
+    }
+
+    int fd;
+    std::vector<PendingWrite> pending;
+    bool armed = false;
+    uint64_t operations_left = 0;
+};
+
+/// Driver state for one diff device, with allocation table and sector
+/// bitmaps in image and journal fields from DEVICE_EXTENSION
+class SimFilter
+{
+public:
+
+    SimFilter(CachedFile &device, const CrashOptions &options)
+        : device(device), options(options)
+    {
+    }
+
+    /// Lays out a new diff device the way AIMWrFltrInitializeDiffDevice
+    /// reserves directories and journal after VBR, with empty directories
+    /// and journal written before VBR refers to them
+    void create()
+    {
+        VbrHead &head = image.vbr.head;
+
+        memset(&image.vbr, 0, sizeof(image.vbr));
+        memcpy(head.magic, DIFF_FILE_MAGIC, sizeof(head.magic));
+        head.major_version = JOURNAL_MAJOR_VERSION;
+        head.size = (int64_t)options.volume_blocks << options.block_bits;
+        head.diff_block_bits = (uint8_t)options.block_bits;
+        image.vbr.signature = VBR_SIGNATURE;
+
+        image.reset();
+
+        reserve(head.offset_to_allocation_table,
+            head.size_of_allocation_table,
+            image.leaves() * sizeof(int32_t));
+
+        head.allocation_table_blocks = (int32_t)(head.size_of_allocation_table >>
+            (image.block_bits() - SECTOR_BITS));
+
+        reserve(head.offset_to_sector_bitmap, head.size_of_sector_bitmap,
+            image.chunks() * sizeof(int32_t));
+
+        reserve(head.offset_to_journal, head.size_of_journal,
+            (uint64_t)options.journal_sectors << SECTOR_BITS);
+
+        device.write(0, &image.vbr, sizeof(image.vbr));
+        device.flush();
+    }
+
+    /// AIMWrFltrInitializeDiffDevice for a version 4.0 diff device
+    bool mount(std::string &error, uint32_t &replayed)
+    {
+        ReadFunction read = [this](uint64_t offset, void *buffer, size_t length)
+        {
+            return device.read(offset, buffer, length);
+        };
+
+        std::vector<JournalRecord> journal;
+
+        if (!image.load(read, error) ||
+            !image.read_journal(read, journal, error))
+        {
+            return false;
+        }
+
+        image.recover_last_allocated_block();
+
+        entries.clear();
+        overflow = false;
+
+        if (!image.replay_journal(journal, sequence, replayed, error))
+        {
+            return false;
+        }
+
+        if (replayed > 0)
+        {
+            save_header();
+        }
+        else
+        {
+            image.vbr.head.journal_checkpoint = sequence;
+        }
+
+        device.write(0, &image.vbr, sizeof(image.vbr));
+
+        build_free_map();
+
+        return true;
+    }
+
+    /// Deferred write of sectors with data for generation, one block at a
+    /// time as in AIMWrFltrRunDeferredWriteWave, without fill reads
+    void write(int64_t first_sector, uint32_t sectors, uint64_t generation)
+    {
+        uint32_t sectors_per_block = image.sectors_per_block();
+
+        while (sectors > 0)
+        {
+            int64_t block = first_sector / sectors_per_block;
+            uint32_t first = (uint32_t)(first_sector % sectors_per_block);
+            uint32_t count = std::min(sectors, sectors_per_block - first);
+
+            int32_t block_address = image.table[block];
+            bool new_block = block_address == DIFF_BLOCK_UNALLOCATED;
+            bool partial_new_block = new_block && count < sectors_per_block;
+
+            if (new_block)
+            {
+                block_address = allocate(1);
+            }
+
+            std::vector<uint8_t> data((size_t)count << SECTOR_BITS);
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                DataSector sector = { DATA_SECTOR_MAGIC, first_sector + i,
+                    generation };
+
+                memcpy(&data[(size_t)i << SECTOR_BITS], &sector, sizeof(sector));
+            }
+
+            device.write(((uint64_t)block_address << image.block_bits()) +
+                ((uint64_t)first << SECTOR_BITS), data.data(),
+                (size_t)count << SECTOR_BITS);
+
+            // Write has completed, so allocation table and sector bitmap
+            // are updated and journaled
+            bool sectors_written = new_block ||
+                image.any_sector_missing(block, first, count);
+
+            if (partial_new_block)
+            {
+                image.set_sectors_missing(block, 0, sectors_per_block, true);
+            }
+
+            if (partial_new_block || (!new_block && sectors_written))
+            {
+                image.set_sectors_missing(block, first, count, false);
+            }
+
+            if (new_block)
+            {
+                image.set_table_entry(block, block_address);
+            }
+
+            if (sectors_written)
+            {
+                bool bitmap = partial_new_block || !new_block;
+
+                append({ block,
+                    new_block ? block_address : DIFF_BLOCK_UNALLOCATED,
+                    (uint16_t)(bitmap ? first : 0),
+                    (uint16_t)(bitmap ? count : 0) });
+            }
+
+            first_sector += count;
+            sectors -= count;
+        }
+    }
+
+    /// AIMWrFltrFreeTrimmedBlocks for one trim range. Lower level trim is
+    /// not modeled, so diff blocks keep their data until allocated again.
+    void trim(int64_t first_sector, uint32_t sectors)
+    {
+        uint32_t sectors_per_block = image.sectors_per_block();
+        int64_t first_block = (first_sector + sectors_per_block - 1) /
+            sectors_per_block;
+        int64_t end_block = (first_sector + sectors) / sectors_per_block;
+        bool sectors_missing = false;
+
+        for (int64_t block = first_block; block < end_block; block++)
+        {
+            int32_t block_address = image.table[block];
+
+            if (block_address == DIFF_BLOCK_UNALLOCATED)
+            {
+                continue;
+            }
+
+            if (pending.size() >= COMPACT_PENDING_BLOCKS)
+            {
+                release_pending();
+            }
+
+            image.set_table_entry(block, DIFF_BLOCK_UNALLOCATED);
+
+            sectors_missing = sectors_missing ||
+                image.any_sector_missing(block, 0, sectors_per_block);
+
+            append({ block, JOURNAL_FREE_BLOCK, 0, 0 });
+
+            pending.push_back(block_address);
+            ++trimmed_blocks;
+        }
+
+        if (!sectors_missing)
+        {
+            return;
+        }
+
+        // Journal records that free blocks reach diff device before
+        // bitmaps cleared here can be saved
+        flush();
+
+        for (int64_t block = first_block; block < end_block; block++)
+        {
+            if (image.table[block] == DIFF_BLOCK_UNALLOCATED &&
+                image.any_sector_missing(block, 0, sectors_per_block))
+            {
+                image.set_sectors_missing(block, 0, sectors_per_block, false);
+            }
+        }
+    }
+
+    /// AIMWrFltrDeferredFlushBuffers, followed by forwarded flush
+    void flush()
+    {
+        commit_journal();
+
+        device.flush();
+    }
+
+    /// AIMWrFltrPeriodicSaveDiffHeader, with a request count for time
+    void periodic(bool interval_passed)
+    {
+        if (sequence - image.vbr.head.journal_checkpoint >
+            (uint64_t)image.vbr.head.size_of_journal / 2)
+        {
+            save_header();
+        }
+        else if (interval_passed &&
+            (std::count(image.dirty_leaves.begin(), image.dirty_leaves.end(), true) > 0 ||
+                std::count(image.dirty_chunks.begin(), image.dirty_chunks.end(), true) > 0))
+        {
+            save_header();
+        }
+    }
+
+    /// Generation of data read from protected volume sector, or
+    /// ORIGINAL_DATA. Returns false if diff device data for another
+    /// sector, or no data at all, is found.
+    bool read(int64_t volume_sector, uint64_t &generation) const
+    {
+        int64_t block = volume_sector / image.sectors_per_block();
+        uint32_t sector = (uint32_t)(volume_sector % image.sectors_per_block());
+        int32_t block_address = image.table[block];
+
+        generation = ORIGINAL_DATA;
+
+        if (block_address == DIFF_BLOCK_UNALLOCATED ||
+            image.sector_missing(block, sector))
+        {
+            return true;
+        }
+
+        DataSector data;
+
+        if (!device.read(((uint64_t)block_address << image.block_bits()) +
+            ((uint64_t)sector << SECTOR_BITS), &data, sizeof(data)) ||
+            data.magic != DATA_SECTOR_MAGIC ||
+            data.volume_sector != volume_sector)
+        {
+            return false;
+        }
+
+        generation = data.generation;
+
+        return true;
+    }
+
+    /// One step of AIMWrFltrCompactDiffDevice. Every page is loaded in
+    /// this model, and compaction does not stop after passes that made no
+    /// progress.
+    void compact()
+    {
+        int64_t block = next_compact_block;
+        int32_t previous = block > 0 ? image.table[block - 1] :
+            DIFF_BLOCK_UNALLOCATED;
+        uint32_t scanned = 0;
+        uint32_t moves = 0;
+
+        while ((uint64_t)block < image.number_of_blocks &&
+            scanned < COMPACT_SCAN_BLOCKS &&
+            moves < COMPACT_MOVES_PER_STEP &&
+            pending.size() < COMPACT_PENDING_BLOCKS)
+        {
+            ++scanned;
+
+            // Leaves never written to are not loaded in the driver
+            uint32_t leaf = (uint32_t)(block / image.entries_per_leaf());
+
+            if (image.leaf_blocks[leaf] == DIFF_BLOCK_UNALLOCATED &&
+                !image.dirty_leaves[leaf])
+            {
+                previous = DIFF_BLOCK_UNALLOCATED;
+                block = (int64_t)(leaf + 1) * image.entries_per_leaf();
+                continue;
+            }
+
+            int32_t block_address = image.table[block];
+
+            if (block_address == DIFF_BLOCK_UNALLOCATED)
+            {
+                previous = DIFF_BLOCK_UNALLOCATED;
+                ++block;
+                continue;
+            }
+
+            int32_t target = compact_target(previous, block_address);
+
+            if (target != DIFF_BLOCK_UNALLOCATED)
+            {
+                relocate(block, block_address, target);
+
+                pending.push_back(block_address);
+                block_address = target;
+                ++moves;
+            }
+
+            previous = block_address;
+            ++block;
+        }
+
+        next_compact_block = block;
+
+        if (moves > 0)
+        {
+            flush();
+        }
+
+        if ((uint64_t)block < image.number_of_blocks)
+        {
+            if (pending.size() >= COMPACT_PENDING_BLOCKS)
+            {
+                release_pending();
+            }
+
+            return;
+        }
+
+        if (free_count > 0)
+        {
+            relocate_page(image.leaf_blocks, image.dirty_leaves);
+            relocate_page(image.chunk_blocks, image.dirty_chunks);
+        }
+
+        release_pending();
+
+        next_compact_block = 0;
+        ++compaction_passes;
+    }
+
+    /// Checks that no diff block is referenced twice by table, directories
+    /// and regions in VBR, and that no referenced or pending free block is
+    /// free or above last allocated block
+    bool check_blocks(std::string &error) const
+    {
+        const VbrHead &head = image.vbr.head;
+        std::vector<char> used((size_t)head.last_allocated_block + 1, false);
+
+        auto use = [&](int64_t block_address, const char *what) -> bool
+        {
+            if (block_address <= 0)
+            {
+                return true;
+            }
+
+            if (block_address > head.last_allocated_block)
+            {
+                error = std::string(what) + " at block " +
+                    std::to_string(block_address) +
+                    " above last allocated block";
+                return false;
+            }
+
+            if (used[(size_t)block_address] || is_free((int32_t)block_address))
+            {
+                error = std::string(what) + " at block " +
+                    std::to_string(block_address) +
+                    (used[(size_t)block_address] ? " is used twice" :
+                        " is free");
+                return false;
+            }
+
+            used[(size_t)block_address] = true;
+            return true;
+        };
+
+        auto use_region = [&](int64_t offset, int64_t size, const char *what)
+        {
+            uint32_t shift = image.block_bits() - SECTOR_BITS;
+
+            for (int64_t b = offset >> shift; b < (offset + size) >> shift; b++)
+            {
+                if (!use(b, what))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        };
+
+        if (!use_region(head.offset_to_allocation_table,
+            head.size_of_allocation_table, "Allocation table directory") ||
+            !use_region(head.offset_to_sector_bitmap, head.size_of_sector_bitmap,
+                "Sector bitmap directory") ||
+            !use_region(head.offset_to_journal, head.size_of_journal, "Journal"))
+        {
+            return false;
+        }
+
+        for (int32_t block_address : image.leaf_blocks)
+        {
+            if (!use(block_address, "Allocation table leaf"))
+            {
+                return false;
+            }
+        }
+
+        for (int32_t block_address : image.chunk_blocks)
+        {
+            if (!use(block_address, "Sector bitmap chunk"))
+            {
+                return false;
+            }
+        }
+
+        for (int32_t block_address : image.table)
+        {
+            if (!use(block_address, "Data"))
+            {
+                return false;
+            }
+        }
+
+        for (int32_t block_address : pending)
+        {
+            if (!use(block_address, "Pending free block"))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    DiffImage image;
+    uint64_t commits = 0;
+    uint64_t checkpoints = 0;
+    uint64_t compacted_blocks = 0;
+    uint64_t compaction_passes = 0;
+    uint64_t reclaimed_blocks = 0;
+    uint64_t reused_blocks = 0;
+    uint64_t trimmed_blocks = 0;
+
+private:
+
+    /// AIMWrFltrBuildFreeBlockMap, after VBR has been written when diff
+    /// device is opened
+    void build_free_map()
+    {
+        free_map.assign((size_t)image.vbr.head.last_allocated_block + 1, false);
+        pending.clear();
+
+        std::vector<char> used(free_map.size(), false);
+        const VbrHead &head = image.vbr.head;
+        uint32_t shift = image.block_bits() - SECTOR_BITS;
+
+        auto use = [&](int64_t block_address)
+        {
+            if (block_address > 0 && (size_t)block_address < used.size())
+            {
+                used[(size_t)block_address] = true;
+            }
+        };
+
+        auto use_region = [&](int64_t offset, int64_t size)
+        {
+            for (int64_t b = offset >> shift; b < (offset + size) >> shift; b++)
+            {
+                use(b);
+            }
+        };
+
+        use_region(head.offset_to_allocation_table, head.size_of_allocation_table);
+        use_region(head.offset_to_sector_bitmap, head.size_of_sector_bitmap);
+        use_region(head.offset_to_journal, head.size_of_journal);
+
+        for (int32_t block_address : image.leaf_blocks)
+        {
+            use(block_address);
+        }
+
+        for (int32_t block_address : image.chunk_blocks)
+        {
+            use(block_address);
+        }
+
+        for (int32_t block_address : image.table)
+        {
+            use(block_address);
+        }
+
+        free_count = 0;
+
+        for (size_t i = 1; i < used.size(); i++)
+        {
+            free_map[i] = !used[i];
+            free_count += free_map[i];
+        }
+    }
+
+    bool is_free(int32_t block_address) const
+    {
+        return block_address > 0 && (size_t)block_address < free_map.size() &&
+            free_map[(size_t)block_address];
+    }
+
+    void take_free(int32_t block_address)
+    {
+        free_map[(size_t)block_address] = false;
+        --free_count;
+        ++reused_blocks;
+    }
+
+    /// AIMWrFltrAllocateDiffBlocks, lowest free run first
+    int32_t allocate(uint32_t count)
+    {
+        if (free_count >= count)
+        {
+            uint32_t run = 0;
+
+            for (size_t i = 1; i < free_map.size(); i++)
+            {
+                run = free_map[i] ? run + 1 : 0;
+
+                if (run == count)
+                {
+                    int32_t first = (int32_t)(i - count + 1);
+
+                    for (uint32_t j = 0; j < count; j++)
+                    {
+                        take_free(first + (int32_t)j);
+                    }
+
+                    return first;
+                }
+            }
+        }
+
+        int32_t first = image.vbr.head.last_allocated_block + 1;
+        image.vbr.head.last_allocated_block += (int32_t)count;
+
+        return first;
+    }
+
+    /// AIMWrFltrCompactEnd
+    int32_t compact_end() const
+    {
+        return image.vbr.head.last_allocated_block - (int32_t)free_count -
+            (int32_t)pending.size();
+    }
+
+    /// AIMWrFltrChooseCompactTarget
+    int32_t compact_target(int32_t previous, int32_t block_address)
+    {
+        int32_t end = compact_end();
+
+        if (previous != DIFF_BLOCK_UNALLOCATED &&
+            previous + 1 != block_address &&
+            previous + 1 <= end &&
+            is_free(previous + 1))
+        {
+            take_free(previous + 1);
+            return previous + 1;
+        }
+
+        if (block_address <= end || free_count == 0)
+        {
+            return DIFF_BLOCK_UNALLOCATED;
+        }
+
+        for (size_t i = 1; i < free_map.size() && (int32_t)i < block_address; i++)
+        {
+            if (free_map[i])
+            {
+                take_free((int32_t)i);
+                return (int32_t)i;
+            }
+        }
+
+        return DIFF_BLOCK_UNALLOCATED;
+    }
+
+    /// AIMWrFltrRelocateBlock
+    void relocate(int64_t block, int32_t from, int32_t to)
+    {
+        std::vector<uint8_t> data(image.block_size());
+
+        device.read((uint64_t)from << image.block_bits(), data.data(),
+            data.size());
+
+        device.write((uint64_t)to << image.block_bits(), data.data(),
+            data.size());
+
+        image.set_table_entry(block, to);
+
+        append({ block, to, 0, 0 });
+
+        ++compacted_blocks;
+    }
+
+    /// AIMWrFltrRelocatePages, one page in the part compaction empties
+    void relocate_page(std::vector<int32_t> &page_blocks,
+        std::vector<char> &dirty_pages)
+    {
+        int32_t end = compact_end();
+
+        for (size_t i = 0; i < page_blocks.size(); i++)
+        {
+            if (page_blocks[i] > end)
+            {
+                pending.push_back(page_blocks[i]);
+                page_blocks[i] = DIFF_BLOCK_UNALLOCATED;
+                dirty_pages[i] = true;
+                ++compacted_blocks;
+                return;
+            }
+        }
+    }
+
+    /// AIMWrFltrReleasePendingFreeBlocks and
+    /// AIMWrFltrLowerLastAllocatedBlock
+    void release_pending()
+    {
+        if (pending.empty())
+        {
+            return;
+        }
+
+        save_header();
+        device.flush();
+
+        for (int32_t block_address : pending)
+        {
+            if ((size_t)block_address >= free_map.size())
+            {
+                free_map.resize((size_t)block_address + 1, false);
+            }
+
+            free_map[(size_t)block_address] = true;
+            ++free_count;
+        }
+
+        pending.clear();
+
+        int32_t &last = image.vbr.head.last_allocated_block;
+
+        while (is_free(last))
+        {
+            free_map[(size_t)last] = false;
+            --free_count;
+            --last;
+            ++reclaimed_blocks;
+        }
+    }
+
+    /// Reserves blocks after last allocated block and writes zeros there
+    void reserve(int64_t &offset, int64_t &size, uint64_t bytes)
+    {
+        uint32_t blocks = (uint32_t)((bytes + image.block_size() - 1) >>
+            image.block_bits());
+
+        offset = (int64_t)(image.vbr.head.last_allocated_block + 1) <<
+            (image.block_bits() - SECTOR_BITS);
+        size = (int64_t)blocks << (image.block_bits() - SECTOR_BITS);
+
+        image.vbr.head.last_allocated_block += blocks;
+
+        std::vector<uint8_t> zeros((size_t)blocks << image.block_bits());
+
+        device.write((uint64_t)offset << SECTOR_BITS, zeros.data(),
+            zeros.size());
+    }
+
+    /// AIMWrFltrJournalAppend
+    void append(const JournalEntry &entry)
+    {
+        if (overflow || entries.size() >= options.journal_entries)
+        {
+            overflow = true;
+        }
+        else
+        {
+            entries.push_back(entry);
+        }
+    }
+
+    /// AIMWrFltrCommitJournal
+    void commit_journal()
+    {
+        if (overflow)
+        {
+            save_header();
+            return;
+        }
+
+        if (entries.empty())
+        {
+            return;
+        }
+
+        std::vector<JournalRecord> records =
+            build_journal_records(entries, sequence);
+
+        entries.clear();
+
+        uint64_t journal_sectors = (uint64_t)image.vbr.head.size_of_journal;
+
+        if (sequence + records.size() - image.vbr.head.journal_checkpoint >
+            journal_sectors)
+        {
+            save_header();
+            return;
+        }
+
+        device.flush();
+
+        for (size_t done = 0; done < records.size(); )
+        {
+            uint64_t position = (sequence + done) % journal_sectors;
+            size_t count = (size_t)std::min<uint64_t>(records.size() - done,
+                journal_sectors - position);
+
+            device.write(((uint64_t)image.vbr.head.offset_to_journal +
+                position) << SECTOR_BITS, &records[done],
+                count * sizeof(JournalRecord));
+
+            done += count;
+        }
+
+        sequence += records.size();
+        ++commits;
+    }
+
+    /// AIMWrFltSaveDiffHeader
+    void save_header()
+    {
+        uint64_t checkpoint = sequence;
+
+        entries.clear();
+        overflow = false;
+
+        std::vector<uint32_t> leaves;
+        std::vector<uint32_t> chunks;
+
+        for (uint32_t i = 0; i < image.leaves(); i++)
+        {
+            if (image.dirty_leaves[i])
+            {
+                leaves.push_back(i);
+                image.dirty_leaves[i] = false;
+            }
+        }
+
+        for (uint32_t i = 0; i < image.chunks(); i++)
+        {
+            if (image.dirty_chunks[i])
+            {
+                chunks.push_back(i);
+                image.dirty_chunks[i] = false;
+            }
+        }
+
+        if (!leaves.empty() || !chunks.empty())
+        {
+            device.flush();
+
+            uint32_t chunk_size = image.blocks_per_chunk() * image.bitmap_words();
+
+            write_pages(image.chunk_blocks, image.vbr.head.offset_to_sector_bitmap,
+                chunks, [&](uint32_t chunk)
+                {
+                    return (const void *)&image.bitmaps[(size_t)chunk * chunk_size];
+                });
+
+            if (!options.unordered && !leaves.empty() && !chunks.empty())
+            {
+                device.flush();
+            }
+
+            write_pages(image.leaf_blocks,
+                image.vbr.head.offset_to_allocation_table, leaves,
+                [&](uint32_t leaf)
+                {
+                    return (const void *)&image.table[
+                        (size_t)leaf * image.entries_per_leaf()];
+                });
+
+            if (!options.unordered)
+            {
+                device.flush();
+            }
+        }
+
+        image.vbr.head.journal_checkpoint = checkpoint;
+
+        device.write(0, &image.vbr, sizeof(image.vbr));
+
+        ++checkpoints;
+    }
+
+    /// AIMWrFltrWritePageSnapshot. Pages are written from current table
+    /// and bitmaps, which is the same as a snapshot in this single
+    /// threaded model.
+    void write_pages(std::vector<int32_t> &page_blocks, int64_t directory_offset,
+        const std::vector<uint32_t> &pages,
+        const std::function<const void *(uint32_t)> &page_data)
+    {
+        uint32_t first_new_page = UINT32_MAX;
+        uint32_t last_new_page = 0;
+
+        uint32_t new_pages = (uint32_t)std::count_if(pages.begin(), pages.end(),
+            [&](uint32_t page)
+            {
+                return page_blocks[page] == DIFF_BLOCK_UNALLOCATED;
+            });
+
+        // New pages get consecutive blocks allocated together
+        int32_t next_new_block = new_pages > 0 ? allocate(new_pages) : 0;
+
+        for (uint32_t page : pages)
+        {
+            if (page_blocks[page] == DIFF_BLOCK_UNALLOCATED)
+            {
+                page_blocks[page] = next_new_block++;
+                first_new_page = std::min(first_new_page, page);
+                last_new_page = std::max(last_new_page, page);
+            }
+
+            device.write((uint64_t)page_blocks[page] << image.block_bits(),
+                page_data(page), image.block_size());
+        }
+
+        if (first_new_page == UINT32_MAX)
+        {
+            return;
+        }
+
+        if (!options.unordered)
+        {
+            device.flush();
+        }
+
+        uint32_t first_byte = (uint32_t)(first_new_page * sizeof(int32_t)) &
+            ~(SECTOR_SIZE - 1);
+        uint32_t end_byte = (uint32_t)((last_new_page + 1) * sizeof(int32_t) +
+            SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+
+        // Directory vector is only as large as needed for entries, while
+        // directory at diff device fills whole sectors
+        std::vector<uint8_t> directory(end_byte - first_byte);
+
+        memcpy(directory.data(), (const uint8_t *)page_blocks.data() + first_byte,
+            std::min<size_t>(directory.size(),
+                page_blocks.size() * sizeof(int32_t) - first_byte));
+
+        device.write(((uint64_t)directory_offset << SECTOR_BITS) + first_byte,
+            directory.data(), directory.size());
+    }
+
+    CachedFile &device;
+    const CrashOptions &options;
+    std::vector<JournalEntry> entries;
+    bool overflow = false;
+    uint64_t sequence = 0;
+    std::vector<char> free_map;
+    uint32_t free_count = 0;
+    std::vector<int32_t> pending;
+    int64_t next_compact_block = 0;
+};
+
+class CrashSim
+{
+public:
+
+    CrashSim(CachedFile &device, const CrashOptions &options)
+        : device(device), options(options), random(options.seed)
+    {
+    }
+
+    int run();
+
+private:
+
+    void error(const char *format, ...)
+        __attribute__((format(printf, 2, 3)))
+    {
+        if (errors++ < 20)
+        {
+            va_list args;
+            va_start(args, format);
+            vfprintf(stderr, format, args);
+            va_end(args);
+        }
+    }
+
+    bool run_requests(SimFilter &filter);
+    bool recover(std::unique_ptr<SimFilter> &filter);
+    void verify(const SimFilter &filter);
+
+    CachedFile &device;
+    const CrashOptions &options;
+    std::mt19937 random;
+
+    /// For each protected volume sector, generations written to it in
+    /// increasing order, latest one acknowledged by a flush, and latest
+    /// one written
+    std::vector<std::vector<uint64_t>> history;
+    std::vector<uint64_t> acknowledged;
+    std::vector<uint64_t> latest;
+    uint64_t generation = ORIGINAL_DATA;
+
+    uint64_t writes = 0;
+    uint64_t flushes = 0;
+    uint64_t crashes = 0;
+    uint64_t mount_crashes = 0;
+    uint64_t replayed_records = 0;
+    uint64_t commits = 0;
+    uint64_t checkpoints = 0;
+    uint64_t compaction_steps = 0;
+    uint64_t compacted_blocks = 0;
+    uint64_t compaction_passes = 0;
+    uint64_t reclaimed_blocks = 0;
+    uint64_t reused_blocks = 0;
+    uint64_t trims = 0;
+    uint64_t trimmed_blocks = 0;
+    uint64_t unacknowledged_kept = 0;
+    uint64_t errors = 0;
+};
+
+/// Random writes and flushes until crash point, or until max_requests
+/// have completed, in which case crash happens after the last one
+bool CrashSim::run_requests(SimFilter &filter)
+{
+    uint64_t volume_sectors = (uint64_t)options.volume_blocks <<
+        (options.block_bits - SECTOR_BITS);
+    uint32_t max_sectors = 2U << (options.block_bits - SECTOR_BITS);
+
+    device.arm(random() % (options.max_requests * 4));
+
+    try
+    {
+        for (unsigned i = 1; i <= options.max_requests; i++)
+        {
+            unsigned request = random() % 100;
+
+            if (request < options.flush_percent)
+            {
+                filter.flush();
+
+                acknowledged = latest;
+                ++flushes;
+            }
+            else if (request < options.flush_percent + options.compact_percent)
+            {
+                filter.compact();
+                ++compaction_steps;
+
+                std::string message;
+
+                if (!filter.check_blocks(message))
+                {
+                    error("After compaction step: %s.\n", message.c_str());
+                }
+            }
+            else if (request < options.flush_percent +
+                options.compact_percent + options.trim_percent)
+            {
+                uint32_t sectors = 1 + random() % (2 * max_sectors);
+                int64_t first_sector = (int64_t)(random() %
+                    (volume_sectors - sectors + 1));
+                uint32_t sectors_per_block =
+                    1U << (options.block_bits - SECTOR_BITS);
+
+                // Sectors of blocks covered completely can read original
+                // data or any data written earlier, since header can be
+                // saved with blocks freed before trim is flushed
+                for (int64_t s = (first_sector + sectors_per_block - 1) /
+                    sectors_per_block * sectors_per_block;
+                    s + sectors_per_block <= first_sector + sectors;
+                    s += sectors_per_block)
+                {
+                    std::fill(latest.begin() + s,
+                        latest.begin() + s + sectors_per_block, ORIGINAL_DATA);
+                    std::fill(acknowledged.begin() + s,
+                        acknowledged.begin() + s + sectors_per_block,
+                        ORIGINAL_DATA);
+                }
+
+                filter.trim(first_sector, sectors);
+                ++trims;
+            }
+            else
+            {
+                uint32_t sectors = 1 + random() % max_sectors;
+                int64_t first_sector = (int64_t)(random() %
+                    (volume_sectors - sectors + 1));
+
+                ++generation;
+
+                for (uint32_t s = 0; s < sectors; s++)
+                {
+                    history[first_sector + s].push_back(generation);
+                    latest[first_sector + s] = generation;
+                }
+
+                filter.write(first_sector, sectors, generation);
+                ++writes;
+            }
+
+            filter.periodic(i % options.checkpoint_interval == 0);
+        }
+    }
+    catch (const Crash &)
+    {
+    }
+
+    commits += filter.commits;
+    checkpoints += filter.checkpoints;
+    compacted_blocks += filter.compacted_blocks;
+    compaction_passes += filter.compaction_passes;
+    reclaimed_blocks += filter.reclaimed_blocks;
+    reused_blocks += filter.reused_blocks;
+    trimmed_blocks += filter.trimmed_blocks;
+
+    device.crash(random);
+    ++crashes;
+
+    return true;
+}
+
+/// Opens diff device after a crash, crashing again at times while doing
+/// that
+bool CrashSim::recover(std::unique_ptr<SimFilter> &filter)
+{
+    for (;;)
+    {
+        filter.reset(new SimFilter(device, options));
+
+        std::string message;
+        uint32_t replayed = 0;
+
+        if (random() % 4 == 0)
+        {
+            device.arm(random() % 8);
+        }
+
+        try
+        {
+            if (!filter->mount(message, replayed))
+            {
+                error("Error opening diff device: %s\n", message.c_str());
+                return false;
+            }
+
+            device.disarm();
+
+            replayed_records += replayed;
+
+            return true;
+        }
+        catch (const Crash &)
+        {
+            device.crash(random);
+            ++mount_crashes;
+        }
+    }
+}
+
+void CrashSim::verify(const SimFilter &filter)
+{
+    std::string message;
+
+    if (!filter.check_blocks(message))
+    {
+        error("After opening diff device: %s.\n", message.c_str());
+    }
+
+    for (size_t sector = 0; sector < history.size(); sector++)
+    {
+        uint64_t found;
+
+        if (!filter.read((int64_t)sector, found))
+        {
+            error("Sector %zu: Allocation table leads to data never written for it.\n",
+                sector);
+            continue;
+        }
+
+        if (found != ORIGINAL_DATA &&
+            !std::binary_search(history[sector].begin(),
+                history[sector].end(), found))
+        {
+            error("Sector %zu: Generation %llu was never written to it.\n",
+                sector, (unsigned long long)found);
+            continue;
+        }
+
+        if (found < acknowledged[sector])
+        {
+            error("Sector %zu: Found generation %llu, write of generation %llu was acknowledged by flush.\n",
+                sector, (unsigned long long)found,
+                (unsigned long long)acknowledged[sector]);
+        }
+        else if (found > acknowledged[sector])
+        {
+            ++unacknowledged_kept;
+        }
+
+        // What was recovered is what later writes replace
+        acknowledged[sector] = found;
+        latest[sector] = found;
+    }
+}
+
+int CrashSim::run()
+{
+    uint64_t volume_sectors = (uint64_t)options.volume_blocks <<
+        (options.block_bits - SECTOR_BITS);
+
+    for (unsigned iteration = 0; iteration < options.iterations; iteration++)
+    {
+        history.assign(volume_sectors, std::vector<uint64_t>());
+        acknowledged.assign(volume_sectors, ORIGINAL_DATA);
+        latest.assign(volume_sectors, ORIGINAL_DATA);
+
+        device.truncate();
+
+        std::unique_ptr<SimFilter> filter(new SimFilter(device, options));
+
+        filter->create();
+
+        std::string message;
+        uint32_t replayed;
+
+        if (!filter->mount(message, replayed))
+        {
+            error("Error opening new diff device: %s\n", message.c_str());
+            break;
+        }
+
+        for (unsigned crash = 0; crash < options.crashes; crash++)
+        {
+            run_requests(*filter);
+
+            // Diff device kept in output file is left as last crash left
+            // it, with journal records to replay
+            if (options.path != nullptr &&
+                iteration + 1 == options.iterations &&
+                crash + 1 == options.crashes)
+            {
+                break;
+            }
+
+            if (!recover(filter))
+            {
+                break;
+            }
+
+            verify(*filter);
+        }
+
+        if (errors > 0)
+        {
+            fprintf(stderr, "Errors in iteration %u.\n", iteration);
+            break;
+        }
+    }
+
+    printf("Writes:                %10llu\n", (unsigned long long)writes);
+    printf("Flushes:               %10llu\n", (unsigned long long)flushes);
+    printf("Journal commits:       %10llu\n", (unsigned long long)commits);
+    printf("Checkpoints:           %10llu\n", (unsigned long long)checkpoints);
+    printf("Crashes:               %10llu\n", (unsigned long long)crashes);
+    printf("Crashes while opening: %10llu\n", (unsigned long long)mount_crashes);
+    printf("Lost cached writes:    %10llu\n", (unsigned long long)device.lost_writes);
+    printf("Torn cached writes:    %10llu\n", (unsigned long long)device.torn_writes);
+    printf("Records replayed:      %10llu\n", (unsigned long long)replayed_records);
+    printf("Free blocks reused:    %10llu\n", (unsigned long long)reused_blocks);
+    printf("Compaction steps:      %10llu\n", (unsigned long long)compaction_steps);
+    printf("Compaction passes:     %10llu\n", (unsigned long long)compaction_passes);
+    printf("Blocks compacted:      %10llu\n", (unsigned long long)compacted_blocks);
+    printf("Blocks reclaimed:      %10llu\n", (unsigned long long)reclaimed_blocks);
+    printf("Trims:                 %10llu\n", (unsigned long long)trims);
+    printf("Blocks trimmed:        %10llu\n", (unsigned long long)trimmed_blocks);
+    printf("Unflushed sectors kept:%10llu\n", (unsigned long long)unacknowledged_kept);
+    printf("Errors:                %10llu\n", (unsigned long long)errors);
+
+    return errors > 0 ? 1 : 0;
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "aimwrfltr-crashsim [options]\n"
+        "\n"
+        "Runs random writes and flushes through a model of the write filter\n"
+        "diff device with allocation journal, against a file with a volatile\n"
+        "write cache in front of it. Crashes at random points, drops or tears\n"
+        "writes not yet flushed, opens diff device again and checks that all\n"
+        "writes acknowledged by a flush are found and that no sector reads\n"
+        "diff device data not written for it. Exit code is 1 if any errors\n"
+        "were found.\n"
+        "\n"
+        "-b, --block-bits bits       Diff block size bits, 12 to 21, default 12.\n"
+        "-v, --volume-blocks count   Blocks at protected volume, default 1024.\n"
+        "-j, --journal-sectors count Journal records, default 64, rounded up\n"
+        "                            to whole blocks.\n"
+        "-e, --journal-entries count Entries between flushes before header is\n"
+        "                            saved instead, default 256.\n"
+        "-i, --iterations count      New diff devices tested, default 200.\n"
+        "-c, --crashes count         Crashes for each diff device, default 5.\n"
+        "-n, --requests count        Requests before each crash, at most,\n"
+        "                            default 400.\n"
+        "-f, --flush-percent percent Requests that are flushes, default 10.\n"
+        "-p, --checkpoint count      Requests between periodic checkpoints,\n"
+        "                            default 100.\n"
+        "-m, --compact percent       Requests that are idle compaction steps,\n"
+        "                            default 0.\n"
+        "-t, --trim percent          Requests that are trims, default 0.\n"
+        "-o, --output path           Keep diff device in this file, as left\n"
+        "                            by last crash, for aimwrfltr-journalreplay.\n"
+        "                            Default is a temporary file.\n"
+        "-u, --unordered             Leave out flushes that order directory\n"
+        "                            and VBR writes after table writes, which\n"
+        "                            is expected to fail.\n"
+        "-s, --seed value            Random seed, default 1.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "block-bits", required_argument, nullptr, 'b' },
+        { "volume-blocks", required_argument, nullptr, 'v' },
+        { "journal-sectors", required_argument, nullptr, 'j' },
+        { "journal-entries", required_argument, nullptr, 'e' },
+        { "iterations", required_argument, nullptr, 'i' },
+        { "crashes", required_argument, nullptr, 'c' },
+        { "requests", required_argument, nullptr, 'n' },
+        { "flush-percent", required_argument, nullptr, 'f' },
+        { "checkpoint", required_argument, nullptr, 'p' },
+        { "compact", required_argument, nullptr, 'm' },
+        { "trim", required_argument, nullptr, 't' },
+        { "output", required_argument, nullptr, 'o' },
+        { "unordered", no_argument, nullptr, 'u' },
+        { "seed", required_argument, nullptr, 's' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    CrashOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:v:j:e:i:c:n:f:p:m:t:o:us:h",
+        long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            options.block_bits = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'v':
+            options.volume_blocks = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'j':
+            options.journal_sectors = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'e':
+            options.journal_entries = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'i':
+            options.iterations = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'c':
+            options.crashes = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'n':
+            options.max_requests = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'f':
+            options.flush_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'p':
+            options.checkpoint_interval = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'm':
+            options.compact_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 't':
+            options.trim_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'o':
+            options.path = optarg;
+            break;
+
+        case 'u':
+            options.unordered = true;
+            break;
+
+        case 's':
+            options.seed = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind < argc || options.block_bits < 12 || options.block_bits > 21 ||
+        options.volume_blocks == 0 || options.journal_sectors < 2 ||
+        options.max_requests == 0 || options.checkpoint_interval == 0 ||
+        options.flush_percent + options.compact_percent +
+        options.trim_percent > 100)
+    {
+        usage();
+        return 1;
+    }
+
+    int fd;
+
+    if (options.path != nullptr)
+    {
+        fd = open(options.path, O_RDWR | O_CREAT, 0644);
+    }
+    else
+    {
+        char path[] = "/tmp/aimwrfltr-crashsim-XXXXXX";
+        fd = mkstemp(path);
+
+        if (fd != -1)
+        {
+            unlink(path);
+        }
+    }
+
+    if (fd == -1)
+    {
+        perror(options.path != nullptr ? options.path : "mkstemp");
+        return 1;
+    }
+
+    CachedFile device(fd);
+    CrashSim sim(device, options);
+
+    int result = sim.run();
+
+    close(fd);
+
+    return result;
+}
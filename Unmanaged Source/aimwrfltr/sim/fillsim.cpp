@@ -0,0 +1,991 @@
+/// fillsim.cpp
+/// aimwrfltr-fillsim command line application. Replays a write trace
+/// through a model of the write filter deferred write path and reports
+/// fill read and request latency, for the old path with one synchronous
+/// I/O at a time and for batched deferred writes with fill reads and diff
+/// writes in flight together (AIMWrFltrDeferredWrite in write.cpp).
+///
+/// Devices are simulated with a fixed latency per request, a transfer rate
+/// and a number of requests each device can serve at the same time. Time
+/// is simulated, so results are deterministic for a trace. Each sector
+/// carries a tag for the write that last stored it, and the resulting
+/// diff device contents are verified against the trace applied in order.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Same values as in aimwrfltr.h
+constexpr unsigned DIFF_BLOCK_BITS = 16;
+constexpr uint32_t DIFF_BLOCK_SIZE = 1u << DIFF_BLOCK_BITS;
+constexpr unsigned SECTOR_BITS = 9;
+constexpr uint32_t SECTOR_SIZE = 1u << SECTOR_BITS;
+constexpr uint32_t SECTORS_PER_BLOCK = DIFF_BLOCK_SIZE / SECTOR_SIZE;
+constexpr int32_t DIFF_BLOCK_UNALLOCATED = 0;
+
+struct SimOptions
+{
+    uint64_t volume_size = 1ull << 30;
+    double read_latency = 100;
+    double write_latency = 100;
+    double mb_per_second = 500;
+    unsigned device_queue_depth = 32;
+    unsigned batch_size = 8;
+    unsigned blocks_in_flight = 32;
+    unsigned fill_blocks_in_flight = 8;
+    bool serial = true;
+    bool batched = true;
+};
+
+struct TraceEntry
+{
+    bool flush = false;
+    uint64_t offset = 0;
+    uint32_t length = 0;
+    double arrival = 0;
+};
+
+/// Device with a number of channels that each serve one request at a time
+class SimDevice
+{
+public:
+
+    SimDevice(const SimOptions &options, double latency)
+        : channels(options.device_queue_depth, 0.0), latency(latency),
+        us_per_byte(1.0 / options.mb_per_second)
+    {
+    }
+
+    /// Returns completion time for a request sent at time now
+    double submit(double now, uint32_t length)
+    {
+        auto channel = std::min_element(channels.begin(), channels.end());
+        double start = std::max(now, *channel);
+        *channel = start + latency + length * us_per_byte;
+        return *channel;
+    }
+
+private:
+
+    std::vector<double> channels;
+    double latency;
+    double us_per_byte;
+};
+
+/// Sorted samples with percentile lookup
+class Samples
+{
+public:
+
+    void add(double value)
+    {
+        values.push_back(value);
+    }
+
+    size_t count() const
+    {
+        return values.size();
+    }
+
+    void sort()
+    {
+        std::sort(values.begin(), values.end());
+    }
+
+    double mean() const
+    {
+        double sum = 0;
+
+        for (double value : values)
+        {
+            sum += value;
+        }
+
+        return values.empty() ? 0 : sum / (double)values.size();
+    }
+
+    double percentile(double p) const
+    {
+        if (values.empty())
+        {
+            return 0;
+        }
+
+        size_t index = (size_t)(p * (double)(values.size() - 1) + 0.5);
+
+        return values[index];
+    }
+
+private:
+
+    std::vector<double> values;
+};
+
+/// One allocation block of a deferred write, as DEFERRED_WRITE_BLOCK
+struct SimBlock
+{
+    size_t request;
+    int64_t block_number;
+    int32_t block_address;
+    uint32_t block_offset;
+    uint32_t length;
+    bool needs_fill;
+};
+
+/// Original device, diff device and allocation table of one protected
+/// volume. Sector tags are negative for original contents and request
+/// number plus one for written data.
+class SimVolume
+{
+public:
+
+    SimVolume(const SimOptions &options)
+        : original(options, options.read_latency),
+        diff(options, options.write_latency),
+        allocation_table((size_t)(options.volume_size >> DIFF_BLOCK_BITS),
+            DIFF_BLOCK_UNALLOCATED)
+    {
+    }
+
+    static int64_t original_tag(int64_t sector)
+    {
+        return -(sector + 1);
+    }
+
+    bool all_blocks_allocated(const TraceEntry &entry) const
+    {
+        for (int64_t block = (int64_t)(entry.offset >> DIFF_BLOCK_BITS);
+            block <= (int64_t)((entry.offset + entry.length - 1) >> DIFF_BLOCK_BITS);
+            block++)
+        {
+            if (allocation_table[(size_t)block] == DIFF_BLOCK_UNALLOCATED)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// Write to blocks already allocated, as AIMWrFltrWrite does without
+    /// worker thread
+    void direct_write(const TraceEntry &entry, size_t request)
+    {
+        for (uint64_t sector = entry.offset >> SECTOR_BITS;
+            sector < (entry.offset + entry.length) >> SECTOR_BITS;
+            sector++)
+        {
+            int32_t address = allocation_table[(size_t)(sector / SECTORS_PER_BLOCK)];
+
+            diff_blocks[address][sector % SECTORS_PER_BLOCK] = (int64_t)request + 1;
+        }
+    }
+
+    /// Stores data for a block in diff device, with fill from original
+    /// device where needed
+    void store_block(const SimBlock &block)
+    {
+        std::vector<int64_t> &sectors = diff_blocks[block.block_address];
+
+        if (sectors.empty())
+        {
+            sectors.resize(SECTORS_PER_BLOCK);
+        }
+
+        int64_t first_sector = block.block_number * SECTORS_PER_BLOCK;
+
+        for (uint32_t i = 0; i < SECTORS_PER_BLOCK; i++)
+        {
+            uint32_t offset = i << SECTOR_BITS;
+
+            if (offset >= block.block_offset &&
+                offset < block.block_offset + block.length)
+            {
+                sectors[i] = (int64_t)block.request + 1;
+            }
+            else if (block.needs_fill)
+            {
+                sectors[i] = original_tag(first_sector + i);
+            }
+        }
+    }
+
+    SimDevice original;
+    SimDevice diff;
+    std::vector<int32_t> allocation_table;
+    int32_t last_allocated_block = 0;
+    std::unordered_map<int32_t, std::vector<int64_t>> diff_blocks;
+};
+
+struct SimResult
+{
+    Samples fill_latency;
+    Samples request_latency;
+    uint64_t direct_requests = 0;
+    uint64_t deferred_requests = 0;
+    uint64_t fill_reads = 0;
+    uint64_t fill_read_bytes = 0;
+    uint64_t written_bytes = 0;
+    double elapsed = 0;
+    bool verified = false;
+};
+
+/// Replays trace through worker thread model. Arriving requests that only
+/// touch allocated blocks are written directly. Others are queued for
+/// worker thread, which processes them one block and one I/O at a time
+/// when batched is false, or as AIMWrFltrDeferredWrite does otherwise.
+class SimWorker
+{
+public:
+
+    SimWorker(const SimOptions &options, const std::vector<TraceEntry> &trace,
+        bool batched)
+        : options(options), trace(trace), volume(options), batched(batched),
+        queued_blocks(volume.allocation_table.size()),
+        held_blocks(volume.allocation_table.size())
+    {
+    }
+
+    SimResult run()
+    {
+        double now = 0;
+
+        while (next_arrival < trace.size() || !queue.empty() || !held.empty())
+        {
+            if (queue.empty() && held.empty() &&
+                trace[next_arrival].arrival > now)
+            {
+                now = trace[next_arrival].arrival;
+            }
+
+            receive(now);
+
+            if (queue.empty())
+            {
+                continue;
+            }
+
+            std::vector<size_t> batch = collect();
+
+            if (trace[batch[0]].flush)
+            {
+                now = volume.diff.submit(now, 0);
+            }
+            else
+            {
+                now = batched ? write_batched(batch, now) : write_serial(batch[0], now);
+            }
+
+            for (size_t request : batch)
+            {
+                result.request_latency.add(now - trace[request].arrival);
+            }
+        }
+
+        result.elapsed = now;
+        result.verified = verify();
+        result.fill_latency.sort();
+        result.request_latency.sort();
+
+        return result;
+    }
+
+private:
+
+    /// Requests that have arrived up to time now. A write that would go
+    /// directly to diff device, but overlaps an earlier write that is not
+    /// yet done, is held until that one is done, as file systems do not
+    /// send overlapping writes at the same time. Later writes that overlap
+    /// a held one are held behind it.
+    void receive(double now)
+    {
+        std::vector<size_t> candidates;
+
+        candidates.swap(held);
+
+        for (size_t request : candidates)
+        {
+            count_blocks(trace[request], held_blocks, -1);
+        }
+
+        while (next_arrival < trace.size() && trace[next_arrival].arrival <= now)
+        {
+            const TraceEntry &entry = trace[next_arrival];
+
+            if (!entry.flush)
+            {
+                result.written_bytes += entry.length;
+            }
+
+            candidates.push_back(next_arrival++);
+        }
+
+        for (size_t request : candidates)
+        {
+            const TraceEntry &entry = trace[request];
+
+            if (entry.flush)
+            {
+                queue.push_back(request);
+                continue;
+            }
+
+            bool direct = volume.all_blocks_allocated(entry);
+
+            if (any_block_counted(entry, held_blocks) ||
+                (direct && any_block_counted(entry, queued_blocks)))
+            {
+                held.push_back(request);
+                count_blocks(entry, held_blocks, 1);
+            }
+            else if (direct)
+            {
+                result.direct_requests++;
+                volume.direct_write(entry, request);
+                result.request_latency.add(
+                    volume.diff.submit(std::max(now, entry.arrival), entry.length) -
+                    entry.arrival);
+            }
+            else
+            {
+                result.deferred_requests++;
+                queue.push_back(request);
+                count_blocks(entry, queued_blocks, 1);
+            }
+        }
+    }
+
+    /// Number of queued or held write requests for each block
+    void count_blocks(const TraceEntry &entry, std::vector<uint32_t> &counts,
+        int delta) const
+    {
+        if (entry.flush)
+        {
+            return;
+        }
+
+        for (int64_t block = first_block(entry); block <= last_block(entry); block++)
+        {
+            counts[(size_t)block] += delta;
+        }
+    }
+
+    bool any_block_counted(const TraceEntry &entry,
+        const std::vector<uint32_t> &counts) const
+    {
+        for (int64_t block = first_block(entry); block <= last_block(entry); block++)
+        {
+            if (counts[(size_t)block] > 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// As AIMWrFltrCollectDeferredWrites
+    std::vector<size_t> collect()
+    {
+        std::vector<size_t> batch;
+
+        batch.push_back(queue.front());
+        queue.pop_front();
+        count_blocks(trace[batch.back()], queued_blocks, -1);
+
+        if (!batched || trace[batch[0]].flush)
+        {
+            return batch;
+        }
+
+        while (batch.size() < options.batch_size && !queue.empty())
+        {
+            const TraceEntry &entry = trace[queue.front()];
+
+            if (entry.flush)
+            {
+                break;
+            }
+
+            bool overlaps = false;
+
+            for (size_t request : batch)
+            {
+                if (first_block(entry) <= last_block(trace[request]) &&
+                    last_block(entry) >= first_block(trace[request]))
+                {
+                    overlaps = true;
+                    break;
+                }
+            }
+
+            if (overlaps)
+            {
+                break;
+            }
+
+            batch.push_back(queue.front());
+            queue.pop_front();
+            count_blocks(entry, queued_blocks, -1);
+        }
+
+        return batch;
+    }
+
+    static int64_t first_block(const TraceEntry &entry)
+    {
+        return (int64_t)(entry.offset >> DIFF_BLOCK_BITS);
+    }
+
+    static int64_t last_block(const TraceEntry &entry)
+    {
+        return (int64_t)((entry.offset + entry.length - 1) >> DIFF_BLOCK_BITS);
+    }
+
+    /// Splits request in allocation blocks and allocates new blocks
+    void split(size_t request, std::vector<SimBlock> &blocks)
+    {
+        const TraceEntry &entry = trace[request];
+        uint32_t length_done = 0;
+
+        for (int64_t i = first_block(entry); i <= last_block(entry); i++)
+        {
+            uint64_t abs_offset = entry.offset + length_done;
+            uint32_t block_offset = (uint32_t)(abs_offset & (DIFF_BLOCK_SIZE - 1));
+            uint32_t bytes = std::min(entry.length - length_done,
+                DIFF_BLOCK_SIZE - block_offset);
+
+            int32_t block_address = volume.allocation_table[(size_t)i];
+            bool needs_fill = block_address == DIFF_BLOCK_UNALLOCATED &&
+                bytes < DIFF_BLOCK_SIZE;
+
+            if (block_address == DIFF_BLOCK_UNALLOCATED)
+            {
+                block_address = ++volume.last_allocated_block;
+            }
+
+            blocks.push_back({ request, i, block_address, block_offset, bytes,
+                needs_fill });
+
+            length_done += bytes;
+        }
+    }
+
+    double write_serial(size_t request, double now)
+    {
+        std::vector<SimBlock> blocks;
+
+        split(request, blocks);
+
+        for (const SimBlock &block : blocks)
+        {
+            uint32_t length = block.length;
+
+            if (block.needs_fill)
+            {
+                if (block.block_offset > 0)
+                {
+                    now = fill_read(now, block.block_offset);
+                }
+
+                if (block.block_offset + block.length < DIFF_BLOCK_SIZE)
+                {
+                    now = fill_read(now,
+                        DIFF_BLOCK_SIZE - block.block_offset - block.length);
+                }
+
+                length = DIFF_BLOCK_SIZE;
+            }
+
+            now = volume.diff.submit(now, length);
+
+            volume.store_block(block);
+            volume.allocation_table[(size_t)block.block_number] = block.block_address;
+        }
+
+        return now;
+    }
+
+    double write_batched(const std::vector<size_t> &batch, double now)
+    {
+        std::vector<SimBlock> blocks;
+
+        for (size_t request : batch)
+        {
+            split(request, blocks);
+        }
+
+        std::vector<SimBlock> wave;
+        unsigned fill_count = 0;
+
+        for (const SimBlock &block : blocks)
+        {
+            if (wave.size() >= options.blocks_in_flight ||
+                (block.needs_fill && fill_count >= options.fill_blocks_in_flight))
+            {
+                now = run_wave(wave, now);
+                fill_count = 0;
+            }
+
+            wave.push_back(block);
+
+            if (block.needs_fill)
+            {
+                fill_count++;
+            }
+        }
+
+        return run_wave(wave, now);
+    }
+
+    /// As AIMWrFltrRunDeferredWriteWave
+    double run_wave(std::vector<SimBlock> &wave, double now)
+    {
+        double fills_done = now;
+
+        for (const SimBlock &block : wave)
+        {
+            if (!block.needs_fill)
+            {
+                continue;
+            }
+
+            if (block.block_offset > 0)
+            {
+                fills_done = std::max(fills_done, fill_read(now, block.block_offset));
+            }
+
+            if (block.block_offset + block.length < DIFF_BLOCK_SIZE)
+            {
+                fills_done = std::max(fills_done, fill_read(now,
+                    DIFF_BLOCK_SIZE - block.block_offset - block.length));
+            }
+        }
+
+        double writes_done = fills_done;
+
+        for (const SimBlock &block : wave)
+        {
+            writes_done = std::max(writes_done, volume.diff.submit(fills_done,
+                block.needs_fill ? DIFF_BLOCK_SIZE : block.length));
+        }
+
+        for (const SimBlock &block : wave)
+        {
+            volume.store_block(block);
+            volume.allocation_table[(size_t)block.block_number] = block.block_address;
+        }
+
+        wave.clear();
+
+        return writes_done;
+    }
+
+    double fill_read(double now, uint32_t length)
+    {
+        double done = volume.original.submit(now, length);
+
+        result.fill_reads++;
+        result.fill_read_bytes += length;
+        result.fill_latency.add(done - now);
+
+        return done;
+    }
+
+    /// Compares each allocated block with trace applied in order, and
+    /// checks that no written sector is left in an unallocated block
+    bool verify() const
+    {
+        std::unordered_map<uint64_t, int64_t> expected;
+
+        for (size_t request = 0; request < trace.size(); request++)
+        {
+            const TraceEntry &entry = trace[request];
+
+            if (entry.flush)
+            {
+                continue;
+            }
+
+            for (uint64_t sector = entry.offset >> SECTOR_BITS;
+                sector < (entry.offset + entry.length) >> SECTOR_BITS;
+                sector++)
+            {
+                expected[sector] = (int64_t)request + 1;
+            }
+        }
+
+        for (const auto &item : expected)
+        {
+            if (volume.allocation_table[(size_t)(item.first / SECTORS_PER_BLOCK)] ==
+                DIFF_BLOCK_UNALLOCATED)
+            {
+                fprintf(stderr, "Sector %llu written but block not allocated\n",
+                    (unsigned long long)item.first);
+
+                return false;
+            }
+        }
+
+        for (size_t block = 0; block < volume.allocation_table.size(); block++)
+        {
+            int32_t address = volume.allocation_table[block];
+
+            if (address == DIFF_BLOCK_UNALLOCATED)
+            {
+                continue;
+            }
+
+            const std::vector<int64_t> &sectors = volume.diff_blocks.at(address);
+
+            for (uint32_t i = 0; i < SECTORS_PER_BLOCK; i++)
+            {
+                uint64_t sector = block * SECTORS_PER_BLOCK + i;
+                auto item = expected.find(sector);
+                int64_t tag = item != expected.end() ? item->second :
+                    SimVolume::original_tag((int64_t)sector);
+
+                if (sectors[i] != tag)
+                {
+                    fprintf(stderr, "Sector %llu has data from %lld, expected %lld\n",
+                        (unsigned long long)sector, (long long)sectors[i],
+                        (long long)tag);
+
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    const SimOptions &options;
+    const std::vector<TraceEntry> &trace;
+    SimVolume volume;
+    bool batched;
+    size_t next_arrival = 0;
+    std::deque<size_t> queue;
+    std::vector<size_t> held;
+    std::vector<uint32_t> queued_blocks;
+    std::vector<uint32_t> held_blocks;
+    SimResult result;
+};
+
+/// Reads a trace with one request on each line: "W offset length [time]",
+/// or "F [time]" for flush. Offset and length are in bytes and must be
+/// sector aligned, time is arrival in microseconds. Without time, request
+/// arrives together with previous one, so that a trace without times is
+/// all queued at start. Empty lines and lines starting with #
+/// are ignored.
+static bool read_trace(const char *path, const SimOptions &options,
+    std::vector<TraceEntry> &trace)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+    if (file == nullptr)
+    {
+        perror(path);
+        return false;
+    }
+
+    char line[256];
+    unsigned line_number = 0;
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof line, file) != nullptr)
+    {
+        line_number++;
+
+        char op = 0;
+        long long offset = 0;
+        long length = 0;
+        double arrival = trace.empty() ? 0 : trace.back().arrival;
+        TraceEntry entry;
+
+        if (sscanf(line, " %c", &op) != 1 || op == '#')
+        {
+            continue;
+        }
+
+        if (op == 'F' || op == 'f')
+        {
+            sscanf(line, " %*c %lf", &arrival);
+            entry.flush = true;
+        }
+        else if ((op == 'W' || op == 'w') &&
+            sscanf(line, " %*c %lli %li %lf", &offset, &length, &arrival) >= 2 &&
+            offset >= 0 && length > 0 && (offset % SECTOR_SIZE) == 0 &&
+            (length % SECTOR_SIZE) == 0 &&
+            (uint64_t)(offset + length) <= options.volume_size)
+        {
+            entry.offset = (uint64_t)offset;
+            entry.length = (uint32_t)length;
+        }
+        else
+        {
+            fprintf(stderr, "%s(%u): Invalid request: %s", path, line_number, line);
+            ok = false;
+            break;
+        }
+
+        entry.arrival = arrival;
+
+        if (!trace.empty() && entry.arrival < trace.back().arrival)
+        {
+            fprintf(stderr, "%s(%u): Requests must be in order of arrival\n",
+                path, line_number);
+            ok = false;
+            break;
+        }
+
+        trace.push_back(entry);
+    }
+
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+
+    return ok;
+}
+
+/// Random writes of 4 KB to 128 KB at 4 KB aligned offsets, arriving
+/// interval microseconds apart, with a flush every flush_interval
+/// requests.
+static void generate_trace(const SimOptions &options, unsigned count,
+    unsigned seed, double interval, unsigned flush_interval,
+    std::vector<TraceEntry> &trace)
+{
+    std::mt19937_64 random(seed);
+    uint64_t pages = options.volume_size >> 12;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        TraceEntry entry;
+
+        entry.arrival = i * interval;
+
+        if (flush_interval > 0 && (i % flush_interval) == flush_interval - 1)
+        {
+            entry.flush = true;
+        }
+        else
+        {
+            entry.length = 4096u << (random() % 6);
+            entry.offset = (random() % (pages - (entry.length >> 12) + 1)) << 12;
+        }
+
+        trace.push_back(entry);
+    }
+}
+
+static void print_result(const char *name, const SimResult &result)
+{
+    printf("%-8s %9llu %9llu %9llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.2f %9.1f %s\n",
+        name,
+        (unsigned long long)result.direct_requests,
+        (unsigned long long)result.deferred_requests,
+        (unsigned long long)result.fill_reads,
+        result.fill_latency.mean(),
+        result.fill_latency.percentile(0.5),
+        result.fill_latency.percentile(0.99),
+        result.request_latency.mean(),
+        result.request_latency.percentile(0.99),
+        result.elapsed / 1e3,
+        result.elapsed > 0 ? (double)result.written_bytes / result.elapsed : 0,
+        result.verified ? "ok" : "FAILED");
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "aimwrfltr-fillsim [options] [tracefile]\n"
+        "\n"
+        "Replays write trace through a model of write filter deferred write\n"
+        "path, with one synchronous I/O at a time (serial) and with batched\n"
+        "requests and fill reads and diff writes in flight together (batched).\n"
+        "Trace lines are \"W offset length [time]\" or \"F [time]\", with\n"
+        "offset and length in bytes and arrival time in microseconds. Use -\n"
+        "for stdin. Without trace file, a random trace is generated.\n"
+        "\n"
+        "Prints number of direct and deferred write requests, fill reads, fill\n"
+        "read latency mean, median and 99th percentile in microseconds, request\n"
+        "latency mean and 99th percentile, elapsed milliseconds, MB/s and\n"
+        "result of verifying diff device contents against trace.\n"
+        "\n"
+        "-v, --volume-size bytes   Size of protected volume, default 1 GB.\n"
+        "-r, --read-latency us     Original device latency, default 100.\n"
+        "-w, --write-latency us    Diff device latency, default 100.\n"
+        "-t, --transfer-rate MB/s  Transfer rate of both devices, default 500.\n"
+        "-q, --queue-depth count   Requests each device serves at the same\n"
+        "                          time, default 32.\n"
+        "-b, --batch-size count    Requests in a batch, default 8.\n"
+        "-k, --blocks count        Blocks in flight, default 32.\n"
+        "-f, --fill-blocks count   Blocks with fill reads in flight, default 8.\n"
+        "-m, --mode mode           serial, batched or both (default).\n"
+        "-g, --generate count      Requests in random trace, default 10000.\n"
+        "-s, --seed value          Seed for random trace, default 1.\n"
+        "-i, --interval us         Time between requests in random trace,\n"
+        "                          default 0, all queued at start.\n"
+        "-F, --flush-every count   Flush every count requests in random trace,\n"
+        "                          default 0, never.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "volume-size", required_argument, nullptr, 'v' },
+        { "read-latency", required_argument, nullptr, 'r' },
+        { "write-latency", required_argument, nullptr, 'w' },
+        { "transfer-rate", required_argument, nullptr, 't' },
+        { "queue-depth", required_argument, nullptr, 'q' },
+        { "batch-size", required_argument, nullptr, 'b' },
+        { "blocks", required_argument, nullptr, 'k' },
+        { "fill-blocks", required_argument, nullptr, 'f' },
+        { "mode", required_argument, nullptr, 'm' },
+        { "generate", required_argument, nullptr, 'g' },
+        { "seed", required_argument, nullptr, 's' },
+        { "interval", required_argument, nullptr, 'i' },
+        { "flush-every", required_argument, nullptr, 'F' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    SimOptions options;
+    unsigned generate = 10000;
+    unsigned seed = 1;
+    double interval = 0;
+    unsigned flush_interval = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "v:r:w:t:q:b:k:f:m:g:s:i:F:h",
+        long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            options.volume_size = strtoull(optarg, nullptr, 0) &
+                ~(uint64_t)(DIFF_BLOCK_SIZE - 1);
+            break;
+
+        case 'r':
+            options.read_latency = strtod(optarg, nullptr);
+            break;
+
+        case 'w':
+            options.write_latency = strtod(optarg, nullptr);
+            break;
+
+        case 't':
+            options.mb_per_second = strtod(optarg, nullptr);
+            break;
+
+        case 'q':
+            options.device_queue_depth = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'b':
+            options.batch_size = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'k':
+            options.blocks_in_flight = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'f':
+            options.fill_blocks_in_flight = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'm':
+            options.serial = strcmp(optarg, "batched") != 0;
+            options.batched = strcmp(optarg, "serial") != 0;
+            break;
+
+        case 'g':
+            generate = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 's':
+            seed = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'i':
+            interval = strtod(optarg, nullptr);
+            break;
+
+        case 'F':
+            flush_interval = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind + 1 < argc || options.volume_size < (1ull << 20) ||
+        options.device_queue_depth == 0 || options.batch_size == 0 ||
+        options.blocks_in_flight == 0 || options.fill_blocks_in_flight == 0 ||
+        options.mb_per_second <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<TraceEntry> trace;
+
+    if (optind < argc)
+    {
+        if (!read_trace(argv[optind], options, trace))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        generate_trace(options, generate, seed, interval, flush_interval, trace);
+    }
+
+    printf("%-8s %9s %9s %9s %9s %9s %9s %9s %9s %9s %9s %s\n",
+        "mode", "direct", "deferred", "fills", "fill avg", "fill p50",
+        "fill p99", "req avg", "req p99", "ms", "MB/s", "verify");
+
+    bool verified = true;
+
+    if (options.serial)
+    {
+        SimResult result = SimWorker(options, trace, false).run();
+        print_result("serial", result);
+        verified &= result.verified;
+    }
+
+    if (options.batched)
+    {
+        SimResult result = SimWorker(options, trace, true).run();
+        print_result("batched", result);
+        verified &= result.verified;
+    }
+
+    return verified ? 0 : 2;
+}
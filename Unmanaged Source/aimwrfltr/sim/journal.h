@@ -0,0 +1,526 @@
+/// journal.h
+/// User mode model of the write filter diff device format from version
+/// 4.0 (fltstats.h): VBR, allocation table and sector bitmap directories
+/// with their leaves and chunks, and the allocation journal. Loading and
+/// journal replay follow AIMWrFltrInitializeDiffDevice and
+/// AIMWrFltrLoadJournal. Used by aimwrfltr-journalreplay to inspect diff
+/// device images and by aimwrfltr-crashsim to recover them after simulated
+/// crashes.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _AIMWRFLTR_SIM_JOURNAL_H_
+#define _AIMWRFLTR_SIM_JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace aimwrfltr
+{
+
+/// Same values as in aimwrfltr.h, fltstats.h and mainwdm.cpp
+constexpr uint32_t SECTOR_BITS = 9;
+constexpr uint32_t SECTOR_SIZE = 1U << SECTOR_BITS;
+constexpr int32_t DIFF_BLOCK_UNALLOCATED = 0;
+constexpr int32_t JOURNAL_FREE_BLOCK = -1;
+constexpr uint8_t LEGACY_DIFF_BLOCK_BITS = 16;
+constexpr uint32_t JOURNAL_MAJOR_VERSION = 4;
+constexpr uint16_t VBR_SIGNATURE = 0xAA55;
+constexpr uint32_t JOURNAL_RECORD_MAGIC = 0x4C4E524A;
+constexpr uint32_t JOURNAL_RECORD_ENTRIES = 30;
+
+constexpr uint8_t DIFF_FILE_MAGIC[16] =
+{ 0xF4, 0xEB, 0xFD, 0x00, 0x00, 0x00, 0x00, 'A', 'I', 'M', 'W', 'r', 'F', 'l', 't', 'r' };
+
+/// AIMWRFLTR_VBR_HEAD_FIELDS. Offsets and sizes in 512 byte units.
+struct VbrHead
+{
+    uint8_t magic[16];
+    uint32_t major_version;
+    uint32_t minor_version;
+    int64_t offset_to_private_data;
+    int64_t size_of_private_data;
+    int64_t offset_to_log_data;
+    int64_t size_of_log_data;
+    int64_t offset_to_allocation_table;
+    int64_t size_of_allocation_table;
+    int64_t offset_to_first_allocated_block;
+    int64_t size;
+    int32_t allocation_table_blocks;
+    int32_t last_allocated_block;
+    uint8_t diff_block_bits;
+    int64_t offset_to_sector_bitmap;
+    int64_t size_of_sector_bitmap;
+    int64_t offset_to_journal;
+    int64_t size_of_journal;
+    uint64_t journal_checkpoint;
+};
+
+/// AIMWRFLTR_VBR
+struct Vbr
+{
+    VbrHead head;
+    uint8_t not_used[SECTOR_SIZE - sizeof(VbrHead) - sizeof(uint16_t)];
+    uint16_t signature;
+};
+
+static_assert(sizeof(VbrHead) == 144, "VBR head layout differs from driver");
+static_assert(sizeof(Vbr) == SECTOR_SIZE, "VBR must fill one sector");
+
+/// AIMWRFLTR_JOURNAL_ENTRY
+struct JournalEntry
+{
+    int64_t block;
+    int32_t block_address;
+    uint16_t first_sector;
+    uint16_t sectors;
+};
+
+/// AIMWRFLTR_JOURNAL_RECORD
+struct JournalRecord
+{
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t sequence;
+    uint32_t count;
+    uint32_t reserved;
+    JournalEntry entries[JOURNAL_RECORD_ENTRIES];
+    uint8_t not_used[8];
+};
+
+static_assert(sizeof(JournalEntry) == 16, "Journal entry layout differs from driver");
+static_assert(sizeof(JournalRecord) == SECTOR_SIZE, "Journal record must fill one sector");
+
+/// AIMWrFltrJournalChecksum. 32 bit FNV-1a with checksum field as zero.
+inline uint32_t journal_checksum(const JournalRecord &record)
+{
+    JournalRecord copy = record;
+    copy.checksum = 0;
+
+    uint32_t hash = 2166136261U;
+    const uint8_t *bytes = (const uint8_t *)&copy;
+
+    for (size_t i = 0; i < sizeof(copy); i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+/// Records for entries from sequence on, as AIMWrFltrCommitJournal
+/// builds them
+inline std::vector<JournalRecord> build_journal_records(
+    const std::vector<JournalEntry> &entries, uint64_t sequence)
+{
+    std::vector<JournalRecord> records((entries.size() +
+        JOURNAL_RECORD_ENTRIES - 1) / JOURNAL_RECORD_ENTRIES);
+
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        JournalRecord &record = records[i];
+
+        memset(&record, 0, sizeof(record));
+
+        record.magic = JOURNAL_RECORD_MAGIC;
+        record.sequence = sequence + i;
+        record.count = (uint32_t)std::min(entries.size() -
+            i * JOURNAL_RECORD_ENTRIES, (size_t)JOURNAL_RECORD_ENTRIES);
+
+        memcpy(record.entries, &entries[i * JOURNAL_RECORD_ENTRIES],
+            record.count * sizeof(JournalEntry));
+
+        record.checksum = journal_checksum(record);
+    }
+
+    return records;
+}
+
+/// Reads length bytes at byte offset from a diff device
+using ReadFunction = std::function<bool(uint64_t offset, void *buffer,
+    size_t length)>;
+
+/// Allocation table and sector bitmaps of a diff device, as the driver
+/// keeps them in DEVICE_EXTENSION. Table and bitmaps are flat here, with
+/// directories and dirty flags for each leaf and chunk as saved.
+class DiffImage
+{
+public:
+
+    Vbr vbr;
+    uint64_t number_of_blocks = 0;
+
+    std::vector<int32_t> table;
+    std::vector<int32_t> leaf_blocks;
+    std::vector<char> dirty_leaves;
+
+    std::vector<uint64_t> bitmaps;
+    std::vector<int32_t> chunk_blocks;
+    std::vector<char> dirty_chunks;
+
+    uint32_t block_bits() const
+    {
+        return vbr.head.diff_block_bits;
+    }
+
+    uint32_t block_size() const
+    {
+        return 1U << block_bits();
+    }
+
+    uint32_t sectors_per_block() const
+    {
+        return block_size() >> SECTOR_BITS;
+    }
+
+    /// DIFF_TABLE_ENTRIES_PER_LEAF
+    uint32_t entries_per_leaf() const
+    {
+        return block_size() / sizeof(int32_t);
+    }
+
+    /// DIFF_SECTOR_BITMAP_SIZE in 64 bit words
+    uint32_t bitmap_words() const
+    {
+        return (sectors_per_block() + 63) / 64;
+    }
+
+    /// DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK
+    uint32_t blocks_per_chunk() const
+    {
+        return block_size() / (bitmap_words() * sizeof(uint64_t));
+    }
+
+    uint32_t leaves() const
+    {
+        return (uint32_t)((number_of_blocks + entries_per_leaf() - 1) /
+            entries_per_leaf());
+    }
+
+    uint32_t chunks() const
+    {
+        return (uint32_t)((number_of_blocks + blocks_per_chunk() - 1) /
+            blocks_per_chunk());
+    }
+
+    bool sector_missing(int64_t block, uint32_t sector) const
+    {
+        return (bitmaps[block * bitmap_words() + sector / 64] >>
+            (sector % 64)) & 1;
+    }
+
+    /// AIMWrFltrSetSectorsMissing, in sectors rather than bytes
+    void set_sectors_missing(int64_t block, uint32_t first, uint32_t count,
+        bool missing)
+    {
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            uint64_t &word = bitmaps[block * bitmap_words() + i / 64];
+            uint64_t mask = 1ULL << (i % 64);
+
+            word = missing ? (word | mask) : (word & ~mask);
+        }
+
+        dirty_chunks[block / blocks_per_chunk()] = true;
+    }
+
+    bool any_sector_missing(int64_t block, uint32_t first,
+        uint32_t count) const
+    {
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            if (sector_missing(block, i))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void set_table_entry(int64_t block, int32_t block_address)
+    {
+        table[block] = block_address;
+        dirty_leaves[block / entries_per_leaf()] = true;
+    }
+
+    /// Creates empty table and bitmaps for vbr, as for new directories
+    void reset()
+    {
+        if (vbr.head.diff_block_bits == 0)
+        {
+            vbr.head.diff_block_bits = LEGACY_DIFF_BLOCK_BITS;
+        }
+
+        number_of_blocks = ((uint64_t)vbr.head.size + block_size() - 1) >>
+            block_bits();
+
+        table.assign((size_t)leaves() * entries_per_leaf(),
+            DIFF_BLOCK_UNALLOCATED);
+        leaf_blocks.assign(leaves(), DIFF_BLOCK_UNALLOCATED);
+        dirty_leaves.assign(leaves(), false);
+
+        bitmaps.assign((size_t)chunks() * blocks_per_chunk() *
+            bitmap_words(), 0);
+        chunk_blocks.assign(chunks(), DIFF_BLOCK_UNALLOCATED);
+        dirty_chunks.assign(chunks(), false);
+    }
+
+    /// Reads VBR, directories, leaves and chunks. Journal is not replayed.
+    bool load(const ReadFunction &read, std::string &error)
+    {
+        if (!read(0, &vbr, sizeof(vbr)))
+        {
+            error = "Error reading VBR";
+            return false;
+        }
+
+        if (memcmp(vbr.head.magic, DIFF_FILE_MAGIC, sizeof(DIFF_FILE_MAGIC)) != 0 ||
+            vbr.signature != VBR_SIGNATURE)
+        {
+            error = "Not a write filter diff device";
+            return false;
+        }
+
+        if (vbr.head.major_version < JOURNAL_MAJOR_VERSION)
+        {
+            error = "Diff device version " +
+                std::to_string(vbr.head.major_version) +
+                ".x has no allocation journal";
+            return false;
+        }
+
+        if (vbr.head.diff_block_bits != 0 &&
+            (vbr.head.diff_block_bits < 12 || vbr.head.diff_block_bits > 21))
+        {
+            error = "Invalid block size";
+            return false;
+        }
+
+        reset();
+
+        if ((uint64_t)vbr.head.size_of_allocation_table << SECTOR_BITS <
+            leaves() * sizeof(int32_t) ||
+            (uint64_t)vbr.head.size_of_sector_bitmap << SECTOR_BITS <
+            chunks() * sizeof(int32_t))
+        {
+            error = "Directory too small for volume size";
+            return false;
+        }
+
+        if (!read((uint64_t)vbr.head.offset_to_allocation_table << SECTOR_BITS,
+            leaf_blocks.data(), leaf_blocks.size() * sizeof(int32_t)) ||
+            !read((uint64_t)vbr.head.offset_to_sector_bitmap << SECTOR_BITS,
+                chunk_blocks.data(), chunk_blocks.size() * sizeof(int32_t)))
+        {
+            error = "Error reading directories";
+            return false;
+        }
+
+        for (uint32_t i = 0; i < leaves(); i++)
+        {
+            if (leaf_blocks[i] != DIFF_BLOCK_UNALLOCATED &&
+                !read((uint64_t)leaf_blocks[i] << block_bits(),
+                    &table[(size_t)i * entries_per_leaf()], block_size()))
+            {
+                error = "Error reading allocation table leaf " +
+                    std::to_string(i);
+                return false;
+            }
+        }
+
+        for (uint32_t i = 0; i < chunks(); i++)
+        {
+            if (chunk_blocks[i] != DIFF_BLOCK_UNALLOCATED &&
+                !read((uint64_t)chunk_blocks[i] << block_bits(),
+                    &bitmaps[(size_t)i * blocks_per_chunk() * bitmap_words()],
+                    block_size()))
+            {
+                error = "Error reading sector bitmap chunk " +
+                    std::to_string(i);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// AIMWrFltrRecoverLastAllocatedBlock
+    void recover_last_allocated_block()
+    {
+        int32_t &last = vbr.head.last_allocated_block;
+
+        for (uint32_t i = 0; i < leaves(); i++)
+        {
+            last = std::max(last, leaf_blocks[i]);
+
+            if (leaf_blocks[i] == DIFF_BLOCK_UNALLOCATED)
+            {
+                continue;
+            }
+
+            for (uint32_t j = 0; j < entries_per_leaf(); j++)
+            {
+                last = std::max(last, table[(size_t)i * entries_per_leaf() + j]);
+            }
+        }
+
+        for (uint32_t i = 0; i < chunks(); i++)
+        {
+            last = std::max(last, chunk_blocks[i]);
+        }
+    }
+
+    /// AIMWrFltrClearUnallocatedSectorBitmaps
+    void clear_unallocated_bitmaps()
+    {
+        for (uint64_t block = 0; block < number_of_blocks; block++)
+        {
+            if (table[block] == DIFF_BLOCK_UNALLOCATED &&
+                any_sector_missing((int64_t)block, 0, sectors_per_block()))
+            {
+                set_sectors_missing((int64_t)block, 0, sectors_per_block(),
+                    false);
+            }
+        }
+    }
+
+    /// AIMWrFltrReplayJournalEntry
+    bool apply_entry(const JournalEntry &entry)
+    {
+        if (entry.block < 0 || (uint64_t)entry.block >= number_of_blocks ||
+            (entry.block_address < 0 &&
+                entry.block_address != JOURNAL_FREE_BLOCK) ||
+            (uint32_t)entry.first_sector + entry.sectors > sectors_per_block())
+        {
+            return false;
+        }
+
+        // Sector bitmap is cleared here, since later entries can allocate
+        // the block again without setting it
+        if (entry.block_address == JOURNAL_FREE_BLOCK)
+        {
+            set_table_entry(entry.block, DIFF_BLOCK_UNALLOCATED);
+
+            if (any_sector_missing(entry.block, 0, sectors_per_block()))
+            {
+                set_sectors_missing(entry.block, 0, sectors_per_block(), false);
+            }
+
+            return true;
+        }
+
+        if (entry.sectors != 0)
+        {
+            if (entry.block_address != DIFF_BLOCK_UNALLOCATED)
+            {
+                set_sectors_missing(entry.block, 0, sectors_per_block(), true);
+            }
+
+            set_sectors_missing(entry.block, entry.first_sector, entry.sectors,
+                false);
+        }
+
+        if (entry.block_address != DIFF_BLOCK_UNALLOCATED)
+        {
+            set_table_entry(entry.block, entry.block_address);
+
+            vbr.head.last_allocated_block = std::max(
+                vbr.head.last_allocated_block, entry.block_address);
+        }
+
+        return true;
+    }
+
+    /// AIMWrFltrLoadJournal for an existing journal. Replays records from
+    /// checkpoint in VBR, clears bitmaps of unallocated blocks and returns
+    /// sequence number for next record written. Each record replayed is
+    /// passed to callback, if set.
+    bool replay_journal(const std::vector<JournalRecord> &journal,
+        uint64_t &next_sequence, uint32_t &replayed, std::string &error,
+        const std::function<void(const JournalRecord &)> &callback = nullptr)
+    {
+        uint64_t journal_sectors = journal.size();
+        uint64_t sequence = vbr.head.journal_checkpoint;
+
+        replayed = 0;
+
+        clear_unallocated_bitmaps();
+
+        while (replayed < journal_sectors)
+        {
+            const JournalRecord &record = journal[sequence % journal_sectors];
+
+            if (record.magic != JOURNAL_RECORD_MAGIC ||
+                record.sequence != sequence ||
+                record.count > JOURNAL_RECORD_ENTRIES ||
+                record.checksum != journal_checksum(record))
+            {
+                break;
+            }
+
+            if (callback)
+            {
+                callback(record);
+            }
+
+            for (uint32_t i = 0; i < record.count; i++)
+            {
+                if (!apply_entry(record.entries[i]))
+                {
+                    error = "Invalid entry " + std::to_string(i) +
+                        " in journal record " + std::to_string(sequence);
+                    return false;
+                }
+            }
+
+            ++sequence;
+            ++replayed;
+        }
+
+        clear_unallocated_bitmaps();
+
+        next_sequence = sequence + journal_sectors;
+
+        return true;
+    }
+
+    /// Reads journal area of diff device
+    bool read_journal(const ReadFunction &read,
+        std::vector<JournalRecord> &journal, std::string &error) const
+    {
+        if (vbr.head.size_of_journal <= 0)
+        {
+            error = "Diff device has no journal";
+            return false;
+        }
+
+        journal.resize((size_t)vbr.head.size_of_journal);
+
+        if (!read((uint64_t)vbr.head.offset_to_journal << SECTOR_BITS,
+            journal.data(), journal.size() * sizeof(JournalRecord)))
+        {
+            error = "Error reading journal";
+            return false;
+        }
+
+        return true;
+    }
+};
+
+}
+
+#endif // _AIMWRFLTR_SIM_JOURNAL_H_
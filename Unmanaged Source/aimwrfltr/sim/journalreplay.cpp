@@ -0,0 +1,208 @@
+/// journalreplay.cpp
+/// aimwrfltr-journalreplay command line application. Reads a diff device
+/// image, such as a copy of a diff file or a raw image of a diff
+/// partition, and replays its allocation journal into allocation table and
+/// sector bitmaps loaded in memory, as the driver does when it opens the
+/// diff device (journal.h). Reports journal records and changes they make,
+/// without modifying the image.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "journal.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace aimwrfltr;
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "aimwrfltr-journalreplay [-v] image\n"
+        "\n"
+        "Loads allocation table and sector bitmaps from a write filter diff\n"
+        "device image and replays allocation journal records from last\n"
+        "checkpoint, as the driver does when diff device is opened. Prints\n"
+        "number of records and entries replayed and allocation table leaves\n"
+        "and sector bitmap chunks they change. Image is not modified.\n"
+        "\n"
+        "-v, --verbose     List each record and entry replayed.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "verbose", no_argument, nullptr, 'v' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "vh", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            verbose = true;
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind + 1 != argc)
+    {
+        usage();
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+
+    if (fd == -1)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    ReadFunction read_image = [fd](uint64_t offset, void *buffer, size_t length)
+    {
+        return pread(fd, buffer, length, (off_t)offset) == (ssize_t)length;
+    };
+
+    DiffImage image;
+    std::vector<JournalRecord> journal;
+    std::string error;
+
+    if (!image.load(read_image, error) ||
+        !image.read_journal(read_image, journal, error))
+    {
+        fprintf(stderr, "%s: %s\n", argv[optind], error.c_str());
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+
+    const VbrHead &head = image.vbr.head;
+
+    printf("Version:               %u.%u\n", head.major_version,
+        head.minor_version);
+    printf("Volume size:           %lld bytes\n", (long long)head.size);
+    printf("Block size:            %u bytes\n", image.block_size());
+    printf("Last allocated block:  %d\n", head.last_allocated_block);
+    printf("Journal:               %lld records at sector %lld\n",
+        (long long)head.size_of_journal, (long long)head.offset_to_journal);
+    printf("Journal checkpoint:    %llu\n",
+        (unsigned long long)head.journal_checkpoint);
+
+    // Valid records anywhere in journal, including those already in
+    // saved allocation table and those left from earlier rounds
+    uint64_t valid_records = 0;
+    uint64_t highest_sequence = 0;
+
+    for (size_t i = 0; i < journal.size(); i++)
+    {
+        if (journal[i].magic == JOURNAL_RECORD_MAGIC &&
+            journal[i].sequence % journal.size() == i &&
+            journal[i].checksum == journal_checksum(journal[i]))
+        {
+            ++valid_records;
+            highest_sequence = std::max(highest_sequence, journal[i].sequence);
+        }
+    }
+
+    printf("Valid records:         %llu, highest sequence %llu\n",
+        (unsigned long long)valid_records,
+        (unsigned long long)highest_sequence);
+
+    int32_t last_allocated_block = head.last_allocated_block;
+
+    image.recover_last_allocated_block();
+
+    if (head.last_allocated_block != last_allocated_block)
+    {
+        printf("Blocks in use:         up to %d, saved after VBR\n",
+            head.last_allocated_block);
+    }
+
+    uint64_t next_sequence = 0;
+    uint32_t replayed = 0;
+    uint64_t entries = 0;
+
+    bool replay_ok = image.replay_journal(journal, next_sequence, replayed,
+        error, [&](const JournalRecord &record)
+        {
+            entries += record.count;
+
+            if (!verbose)
+            {
+                return;
+            }
+
+            printf("Record %llu, %u entries\n",
+                (unsigned long long)record.sequence, record.count);
+
+            for (uint32_t i = 0; i < record.count; i++)
+            {
+                const JournalEntry &entry = record.entries[i];
+
+                printf("  block %lld", (long long)entry.block);
+
+                if (entry.block_address == JOURNAL_FREE_BLOCK)
+                {
+                    printf(" freed");
+                }
+                else if (entry.block_address != DIFF_BLOCK_UNALLOCATED)
+                {
+                    printf(" -> diff block %d", entry.block_address);
+                }
+
+                if (entry.sectors != 0)
+                {
+                    printf(", sectors %u-%u written", entry.first_sector,
+                        entry.first_sector + entry.sectors - 1);
+                }
+
+                printf("\n");
+            }
+        });
+
+    if (!replay_ok)
+    {
+        fprintf(stderr, "%s: %s\n", argv[optind], error.c_str());
+        return 1;
+    }
+
+    // Nothing is marked dirty by loading, only by entries replayed
+    uint32_t changed_leaves = (uint32_t)std::count(image.dirty_leaves.begin(),
+        image.dirty_leaves.end(), true);
+    uint32_t changed_chunks = (uint32_t)std::count(image.dirty_chunks.begin(),
+        image.dirty_chunks.end(), true);
+
+    printf("Records replayed:      %u, %llu entries\n", replayed,
+        (unsigned long long)entries);
+    printf("Leaves changed:        %u of %u\n", changed_leaves, image.leaves());
+    printf("Bitmap chunks changed: %u of %u\n", changed_chunks, image.chunks());
+    printf("Last allocated block:  %d after replay\n",
+        head.last_allocated_block);
+    printf("Next record sequence:  %llu\n", (unsigned long long)next_sequence);
+
+    return 0;
+}
@@ -0,0 +1,830 @@
+/// readsplitsim.cpp
+/// aimwrfltr-readsplitsim command line application. Replays a trace of
+/// writes and reads against a model of the write filter allocation table
+/// and sector bitmaps, and splits each read into lower level requests,
+/// both as AIMWrFltrRead did before and with read extents that merge
+/// contiguous runs across block boundaries (AIMWrFltrGetReadExtent in
+/// read.cpp). Reports number of lower level requests and bytes per
+/// request for each, and how many reads need more than
+/// READ_EXTENTS_IN_FLIGHT requests and are sent by worker thread.
+///
+/// Each split is checked sector by sector against where allocation table
+/// and sector bitmaps say the data is stored.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+/// Same values as in aimwrfltr.h
+constexpr unsigned DIFF_BLOCK_BITS_MIN = 12;
+constexpr unsigned DIFF_BLOCK_BITS_MAX = 21;
+constexpr unsigned DIFF_BLOCK_BITS_DEFAULT = 16;
+constexpr int32_t DIFF_BLOCK_UNALLOCATED = 0;
+constexpr unsigned SECTOR_BITS = 9;
+constexpr uint32_t SECTOR_SIZE = 1u << SECTOR_BITS;
+constexpr uint32_t READ_EXTENTS_IN_FLIGHT = 16;
+
+struct TraceEntry
+{
+    bool write = false;
+    uint64_t offset = 0;
+    uint32_t length = 0;
+};
+
+enum class Device
+{
+    Original,
+    Diff
+};
+
+/// Counterpart of DIFF_READ_EXTENT, and of one lower level request built
+/// by AIMWrFltrRead before
+struct Extent
+{
+    Device device = Device::Original;
+    uint64_t offset = 0;
+    uint32_t length = 0;
+};
+
+/// Allocation table and sector bitmaps of protected volume
+class SimVolume
+{
+public:
+
+    SimVolume(uint64_t volume_size, unsigned block_bits)
+        : block_bits(block_bits),
+        block_size(1u << block_bits),
+        bitmap_words(((block_size >> SECTOR_BITS) + 63) / 64),
+        table((size_t)((volume_size + block_size - 1) >> block_bits),
+            DIFF_BLOCK_UNALLOCATED)
+    {
+    }
+
+    /// New blocks of a write are claimed and allocated together at
+    /// consecutive diff blocks, as by AIMWrFltrClaimNewBlocks. Sector
+    /// aligned writes leave sectors not written missing in a sector
+    /// bitmap instead of filling them.
+    void write(const TraceEntry &entry)
+    {
+        uint64_t end = entry.offset + entry.length;
+        uint64_t first = entry.offset >> block_bits;
+        uint64_t last = (end - 1) >> block_bits;
+        int32_t new_blocks = 0;
+
+        for (uint64_t block = first; block <= last; block++)
+        {
+            if (table[(size_t)block] == DIFF_BLOCK_UNALLOCATED)
+            {
+                new_blocks++;
+            }
+        }
+
+        int32_t block_address = last_allocated_block + 1;
+        last_allocated_block += new_blocks;
+
+        for (uint64_t block = first; block <= last; block++)
+        {
+            uint64_t block_base = block << block_bits;
+            uint32_t first_byte = (uint32_t)(std::max(entry.offset, block_base) -
+                block_base);
+            uint32_t last_byte = (uint32_t)(std::min(end, block_base + block_size) -
+                block_base);
+
+            if (table[(size_t)block] == DIFF_BLOCK_UNALLOCATED)
+            {
+                table[(size_t)block] = block_address++;
+
+                if (last_byte - first_byte == block_size)
+                {
+                    continue;
+                }
+
+                std::vector<uint64_t> &bitmap = bitmaps[block];
+                bitmap.assign(bitmap_words, 0);
+                set_missing(bitmap, 0, block_size, true);
+            }
+
+            auto bitmap = bitmaps.find(block);
+
+            if (bitmap != bitmaps.end())
+            {
+                set_missing(bitmap->second, first_byte, last_byte, false);
+            }
+        }
+    }
+
+    /// AIMWrFltrGetDiffBlock
+    int32_t get_diff_block(uint64_t block) const
+    {
+        return table[(size_t)block];
+    }
+
+    /// AIMWrFltrGetSectorBitmap
+    const std::vector<uint64_t> *get_sector_bitmap(uint64_t block) const
+    {
+        auto bitmap = bitmaps.find(block);
+
+        if (bitmap == bitmaps.end())
+        {
+            return nullptr;
+        }
+
+        return &bitmap->second;
+    }
+
+    /// AIMWrFltrAnySectorMissing
+    static bool any_sector_missing(const std::vector<uint64_t> *bitmap,
+        uint32_t offset, uint32_t length)
+    {
+        if (bitmap == nullptr)
+        {
+            return false;
+        }
+
+        for (uint32_t sector = offset >> SECTOR_BITS;
+            sector <= (offset + length - 1) >> SECTOR_BITS;
+            sector++)
+        {
+            if (sector_missing(*bitmap, sector))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// AIMWrFltrSectorRunLength
+    static uint32_t sector_run_length(const std::vector<uint64_t> &bitmap,
+        uint32_t offset, uint32_t length, bool &missing)
+    {
+        uint32_t sector = offset >> SECTOR_BITS;
+        uint32_t end = offset + length;
+
+        missing = sector_missing(bitmap, sector);
+
+        uint32_t run_end = (sector + 1) << SECTOR_BITS;
+
+        while (run_end < end &&
+            sector_missing(bitmap, run_end >> SECTOR_BITS) == missing)
+        {
+            run_end += SECTOR_SIZE;
+        }
+
+        return std::min(run_end, end) - offset;
+    }
+
+    /// Where a sector of protected volume is read from
+    Extent locate(uint64_t offset) const
+    {
+        Extent extent;
+        uint64_t block = offset >> block_bits;
+        uint32_t block_offset = (uint32_t)(offset & (block_size - 1));
+        int32_t block_address = get_diff_block(block);
+        const std::vector<uint64_t> *bitmap = get_sector_bitmap(block);
+
+        extent.length = SECTOR_SIZE;
+
+        if (block_address == DIFF_BLOCK_UNALLOCATED ||
+            (bitmap != nullptr &&
+                sector_missing(*bitmap, block_offset >> SECTOR_BITS)))
+        {
+            extent.device = Device::Original;
+            extent.offset = offset;
+        }
+        else
+        {
+            extent.device = Device::Diff;
+            extent.offset = ((uint64_t)block_address << block_bits) +
+                block_offset;
+        }
+
+        return extent;
+    }
+
+    const unsigned block_bits;
+    const uint32_t block_size;
+
+private:
+
+    static bool sector_missing(const std::vector<uint64_t> &bitmap,
+        uint32_t sector)
+    {
+        return (bitmap[sector / 64] & (1ull << (sector % 64))) != 0;
+    }
+
+    /// AIMWrFltrSetSectorsMissing for bytes first to last within block
+    static void set_missing(std::vector<uint64_t> &bitmap, uint32_t first,
+        uint32_t last, bool missing)
+    {
+        for (uint32_t sector = first >> SECTOR_BITS;
+            sector < (last + SECTOR_SIZE - 1) >> SECTOR_BITS;
+            sector++)
+        {
+            uint64_t mask = 1ull << (sector % 64);
+
+            if (missing)
+            {
+                bitmap[sector / 64] |= mask;
+            }
+            else
+            {
+                bitmap[sector / 64] &= ~mask;
+            }
+        }
+    }
+
+    const uint32_t bitmap_words;
+    std::vector<int32_t> table;
+    std::unordered_map<uint64_t, std::vector<uint64_t>> bitmaps;
+    int32_t last_allocated_block = 0;
+};
+
+/// Lower level requests built by AIMWrFltrRead before read extents.
+/// Runs of unallocated blocks were merged, and blocks with all sectors
+/// at consecutive diff blocks, but a block with sectors missing was read
+/// one run at a time within that block.
+static void split_by_blocks(const SimVolume &volume, const TraceEntry &entry,
+    std::vector<Extent> &extents)
+{
+    const uint32_t block_size = volume.block_size;
+    uint64_t first = entry.offset >> volume.block_bits;
+    uint64_t last = (entry.offset + entry.length - 1) >> volume.block_bits;
+
+    bool any_block_modified = false;
+
+    for (uint64_t i = first; i <= last; i++)
+    {
+        if (volume.get_diff_block(i) != DIFF_BLOCK_UNALLOCATED)
+        {
+            any_block_modified = true;
+            break;
+        }
+    }
+
+    if (!any_block_modified)
+    {
+        Extent extent;
+        extent.device = Device::Original;
+        extent.offset = entry.offset;
+        extent.length = entry.length;
+        extents.push_back(extent);
+        return;
+    }
+
+    uint32_t length_done = 0;
+
+    for (uint64_t i = first; i <= last && length_done < entry.length; i++)
+    {
+        uint64_t abs_offset = entry.offset + length_done;
+        uint32_t page_offset = (uint32_t)(abs_offset & (block_size - 1));
+        uint32_t bytes = entry.length - length_done;
+        Extent extent;
+
+        if (volume.get_diff_block(i) == DIFF_BLOCK_UNALLOCATED)
+        {
+            uint32_t merged_size = block_size;
+
+            while (page_offset + bytes > merged_size)
+            {
+                if (volume.get_diff_block(i + 1) == DIFF_BLOCK_UNALLOCATED)
+                {
+                    merged_size += block_size;
+                    ++i;
+                }
+                else
+                {
+                    bytes = merged_size - page_offset;
+                }
+            }
+
+            extent.device = Device::Original;
+            extent.offset = abs_offset;
+        }
+        else if (SimVolume::any_sector_missing(volume.get_sector_bitmap(i),
+            page_offset, std::min(bytes, block_size - page_offset)))
+        {
+            int32_t block_base = volume.get_diff_block(i);
+            bool missing;
+
+            bytes = SimVolume::sector_run_length(*volume.get_sector_bitmap(i),
+                page_offset, std::min(bytes, block_size - page_offset),
+                missing);
+
+            if (page_offset + bytes < block_size)
+            {
+                --i;
+            }
+
+            if (missing)
+            {
+                extent.device = Device::Original;
+                extent.offset = abs_offset;
+            }
+            else
+            {
+                extent.device = Device::Diff;
+                extent.offset = ((uint64_t)block_base << volume.block_bits) +
+                    page_offset;
+            }
+        }
+        else
+        {
+            uint32_t merged_size = block_size;
+            int32_t block_base = volume.get_diff_block(i);
+
+            while (page_offset + bytes > merged_size)
+            {
+                if (volume.get_diff_block(i + 1) ==
+                    volume.get_diff_block(i) + 1 &&
+                    !SimVolume::any_sector_missing(
+                        volume.get_sector_bitmap(i + 1), 0,
+                        std::min(page_offset + bytes - merged_size,
+                            block_size)))
+                {
+                    merged_size += block_size;
+                    ++i;
+                }
+                else
+                {
+                    bytes = merged_size - page_offset;
+                }
+            }
+
+            extent.device = Device::Diff;
+            extent.offset = ((uint64_t)block_base << volume.block_bits) +
+                page_offset;
+        }
+
+        extent.length = bytes;
+        extents.push_back(extent);
+        length_done += bytes;
+    }
+}
+
+/// AIMWrFltrGetReadExtent
+static Extent get_read_extent(const SimVolume &volume, uint64_t offset,
+    uint32_t length)
+{
+    Extent extent;
+
+    while (extent.length < length)
+    {
+        uint64_t abs_offset = offset + extent.length;
+        uint64_t block = abs_offset >> volume.block_bits;
+        uint32_t block_offset = (uint32_t)(abs_offset & (volume.block_size - 1));
+        uint32_t bytes = std::min(length - extent.length,
+            volume.block_size - block_offset);
+        int32_t block_address = volume.get_diff_block(block);
+        bool missing = true;
+
+        if (block_address != DIFF_BLOCK_UNALLOCATED)
+        {
+            const std::vector<uint64_t> *bitmap =
+                volume.get_sector_bitmap(block);
+
+            if (SimVolume::any_sector_missing(bitmap, block_offset, bytes))
+            {
+                bytes = SimVolume::sector_run_length(*bitmap, block_offset,
+                    bytes, missing);
+            }
+            else
+            {
+                missing = false;
+            }
+        }
+
+        Device device = missing ? Device::Original : Device::Diff;
+        uint64_t lower_offset = missing ? abs_offset :
+            ((uint64_t)block_address << volume.block_bits) + block_offset;
+
+        if (extent.length == 0)
+        {
+            extent.device = device;
+            extent.offset = lower_offset;
+        }
+        else if (device != extent.device ||
+            lower_offset != extent.offset + extent.length)
+        {
+            break;
+        }
+
+        extent.length += bytes;
+    }
+
+    return extent;
+}
+
+static void split_by_extents(const SimVolume &volume, const TraceEntry &entry,
+    std::vector<Extent> &extents)
+{
+    for (uint32_t length_done = 0; length_done < entry.length;)
+    {
+        Extent extent = get_read_extent(volume, entry.offset + length_done,
+            entry.length - length_done);
+
+        extents.push_back(extent);
+        length_done += extent.length;
+    }
+}
+
+/// Checks that extents cover read and that each sector is read from where
+/// it is stored. Returns number of sectors read from wrong place.
+static uint64_t verify_split(const SimVolume &volume, const TraceEntry &entry,
+    const std::vector<Extent> &extents)
+{
+    uint64_t errors = 0;
+    uint64_t offset = entry.offset;
+
+    for (const Extent &extent : extents)
+    {
+        for (uint32_t done = 0; done < extent.length; done += SECTOR_SIZE)
+        {
+            Extent expected = volume.locate(offset + done);
+
+            if (expected.device != extent.device ||
+                expected.offset != extent.offset + done)
+            {
+                if (errors++ < 10)
+                {
+                    fprintf(stderr,
+                        "Read at %llu: Sector %llu read from %s offset %llu, stored at %s offset %llu.\n",
+                        (unsigned long long)entry.offset,
+                        (unsigned long long)((offset + done) >> SECTOR_BITS),
+                        extent.device == Device::Diff ? "diff" : "original",
+                        (unsigned long long)(extent.offset + done),
+                        expected.device == Device::Diff ? "diff" : "original",
+                        (unsigned long long)expected.offset);
+                }
+            }
+        }
+
+        offset += extent.length;
+    }
+
+    if (offset != entry.offset + entry.length)
+    {
+        fprintf(stderr, "Read at %llu: Split covers %llu of %u bytes.\n",
+            (unsigned long long)entry.offset,
+            (unsigned long long)(offset - entry.offset), entry.length);
+
+        errors++;
+    }
+
+    return errors;
+}
+
+struct SplitResult
+{
+    uint64_t requests = 0;
+    uint64_t max_requests = 0;
+    uint64_t split_reads = 0;
+    uint64_t over_limit = 0;
+    uint64_t diff_requests = 0;
+    uint64_t errors = 0;
+
+    void add(const std::vector<Extent> &extents)
+    {
+        requests += extents.size();
+        max_requests = std::max<uint64_t>(max_requests, extents.size());
+
+        if (extents.size() > 1)
+        {
+            split_reads++;
+        }
+
+        if (extents.size() > READ_EXTENTS_IN_FLIGHT)
+        {
+            over_limit++;
+        }
+
+        for (const Extent &extent : extents)
+        {
+            if (extent.device == Device::Diff)
+            {
+                diff_requests++;
+            }
+        }
+    }
+};
+
+static bool read_trace(const char *path, uint64_t volume_size,
+    std::vector<TraceEntry> &trace)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+    if (file == nullptr)
+    {
+        perror(path);
+        return false;
+    }
+
+    char line[256];
+    unsigned line_number = 0;
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof line, file) != nullptr)
+    {
+        line_number++;
+
+        char op = 0;
+        long long offset = 0;
+        long length = 0;
+
+        if (sscanf(line, " %c", &op) != 1 || op == '#' || op == 'F' ||
+            op == 'f')
+        {
+            continue;
+        }
+
+        if ((op == 'W' || op == 'w' || op == 'R' || op == 'r') &&
+            sscanf(line, " %*c %lli %li", &offset, &length) == 2 &&
+            offset >= 0 && length > 0 && (offset % SECTOR_SIZE) == 0 &&
+            (length % SECTOR_SIZE) == 0 &&
+            (uint64_t)(offset + length) <= volume_size)
+        {
+            TraceEntry entry;
+            entry.write = op == 'W' || op == 'w';
+            entry.offset = (uint64_t)offset;
+            entry.length = (uint32_t)length;
+            trace.push_back(entry);
+        }
+        else
+        {
+            fprintf(stderr, "%s(%u): Invalid request: %s", path, line_number, line);
+            ok = false;
+        }
+    }
+
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+
+    return ok;
+}
+
+/// Random writes of power of two sizes from min_length to max_length,
+/// aligned to their size or 4 KB, whichever is smaller, within the first
+/// region bytes of volume, followed by sequential reads of read_length
+/// through the region.
+static void generate_trace(unsigned count, unsigned seed,
+    uint32_t min_length, uint32_t max_length, uint64_t region,
+    uint32_t read_length, std::vector<TraceEntry> &trace)
+{
+    std::mt19937_64 random(seed);
+    unsigned size_classes = 1;
+
+    while ((min_length << (size_classes - 1)) < max_length)
+    {
+        size_classes++;
+    }
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        TraceEntry entry;
+
+        entry.write = true;
+        entry.length = min_length << (random() % size_classes);
+
+        uint64_t alignment = std::min<uint64_t>(entry.length, 4096);
+        uint64_t positions = (region - entry.length) / alignment + 1;
+
+        entry.offset = (random() % positions) * alignment;
+
+        trace.push_back(entry);
+    }
+
+    for (uint64_t offset = 0; offset < region; offset += read_length)
+    {
+        TraceEntry entry;
+
+        entry.offset = offset;
+        entry.length = (uint32_t)std::min<uint64_t>(read_length,
+            region - offset);
+
+        trace.push_back(entry);
+    }
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "aimwrfltr-readsplitsim [options] [tracefile]\n"
+        "\n"
+        "Replays trace of writes and reads against write filter allocation\n"
+        "table and sector bitmaps, and splits each read into lower level\n"
+        "requests by blocks, as before, and by read extents. Trace lines are\n"
+        "\"W offset length [time]\", \"R offset length [time]\" or\n"
+        "\"F [time]\", with offset and length in bytes. Time and flushes are\n"
+        "ignored. Use - for stdin. Without trace file, a random trace of\n"
+        "writes is generated, followed by sequential reads through the same\n"
+        "region.\n"
+        "\n"
+        "Prints for each split method number of lower level requests, average\n"
+        "KB per request, largest number of requests for one read, reads split\n"
+        "and reads that need more than 16 lower level requests and are sent by\n"
+        "worker thread. Exits with code 1 if any read would get data from the\n"
+        "wrong place.\n"
+        "\n"
+        "-v, --volume-size bytes   Size of protected volume, default 1 GB.\n"
+        "-b, --block-bits bits     Diff block size, default 16 for 64 KB.\n"
+        "-g, --generate count      Writes in random trace, default 2000.\n"
+        "-l, --min-length bytes    Smallest write in random trace, default 4096.\n"
+        "-L, --max-length bytes    Largest write in random trace, default same\n"
+        "                          as -l. Writes use random power of two sizes\n"
+        "                          between them.\n"
+        "-r, --region bytes        Random trace writes and reads within first\n"
+        "                          bytes of volume, default whole volume.\n"
+        "-R, --read-length bytes   Size of reads in random trace, default 1 MB.\n"
+        "-s, --seed value          Seed for random trace, default 1.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "volume-size", required_argument, nullptr, 'v' },
+        { "block-bits", required_argument, nullptr, 'b' },
+        { "generate", required_argument, nullptr, 'g' },
+        { "min-length", required_argument, nullptr, 'l' },
+        { "max-length", required_argument, nullptr, 'L' },
+        { "region", required_argument, nullptr, 'r' },
+        { "read-length", required_argument, nullptr, 'R' },
+        { "seed", required_argument, nullptr, 's' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    uint64_t volume_size = 1ull << 30;
+    unsigned block_bits = DIFF_BLOCK_BITS_DEFAULT;
+    unsigned generate = 2000;
+    uint32_t min_length = 4096;
+    uint32_t max_length = 0;
+    uint64_t region = 0;
+    uint32_t read_length = 1u << 20;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "v:b:g:l:L:r:R:s:h",
+        long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            volume_size = strtoull(optarg, nullptr, 0) &
+                ~(uint64_t)(SECTOR_SIZE - 1);
+            break;
+
+        case 'b':
+            block_bits = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'g':
+            generate = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'l':
+            min_length = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'L':
+            max_length = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'r':
+            region = strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'R':
+            read_length = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 's':
+            seed = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (max_length == 0)
+    {
+        max_length = min_length;
+    }
+
+    if (region == 0 || region > volume_size)
+    {
+        region = volume_size;
+    }
+
+    if (optind + 1 < argc || volume_size < (1ull << 20) ||
+        block_bits < DIFF_BLOCK_BITS_MIN || block_bits > DIFF_BLOCK_BITS_MAX ||
+        min_length < SECTOR_SIZE || (min_length % SECTOR_SIZE) != 0 ||
+        max_length < min_length || max_length > region ||
+        read_length < SECTOR_SIZE || (read_length % SECTOR_SIZE) != 0)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<TraceEntry> trace;
+
+    if (optind < argc)
+    {
+        if (!read_trace(argv[optind], volume_size, trace))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        generate_trace(generate, seed, min_length, max_length, region,
+            read_length, trace);
+    }
+
+    SimVolume volume(volume_size, block_bits);
+    SplitResult by_blocks;
+    SplitResult by_extents;
+    uint64_t reads = 0;
+    uint64_t read_bytes = 0;
+    uint64_t writes = 0;
+    std::vector<Extent> extents;
+
+    for (const TraceEntry &entry : trace)
+    {
+        if (entry.write)
+        {
+            volume.write(entry);
+            writes++;
+            continue;
+        }
+
+        reads++;
+        read_bytes += entry.length;
+
+        extents.clear();
+        split_by_blocks(volume, entry, extents);
+        by_blocks.errors += verify_split(volume, entry, extents);
+        by_blocks.add(extents);
+
+        extents.clear();
+        split_by_extents(volume, entry, extents);
+        by_extents.errors += verify_split(volume, entry, extents);
+        by_extents.add(extents);
+    }
+
+    printf("%llu writes, %llu reads of %.1f MB, %u KB blocks\n",
+        (unsigned long long)writes, (unsigned long long)reads,
+        (double)read_bytes / (1 << 20), (1u << block_bits) >> 10);
+
+    printf("%-8s %10s %10s %10s %10s %10s %10s %8s\n",
+        "split", "requests", "diff", "KB/req", "max/read", "split",
+        "deferred", "errors");
+
+    const struct
+    {
+        const char *name;
+        const SplitResult &result;
+    } rows[] =
+    {
+        { "blocks", by_blocks },
+        { "extents", by_extents }
+    };
+
+    for (const auto &row : rows)
+    {
+        printf("%-8s %10llu %10llu %10.1f %10llu %10llu %10llu %8llu\n",
+            row.name,
+            (unsigned long long)row.result.requests,
+            (unsigned long long)row.result.diff_requests,
+            row.result.requests > 0 ?
+            (double)read_bytes / (double)row.result.requests / 1024 : 0,
+            (unsigned long long)row.result.max_requests,
+            (unsigned long long)row.result.split_reads,
+            (unsigned long long)row.result.over_limit,
+            (unsigned long long)row.result.errors);
+    }
+
+    return by_blocks.errors + by_extents.errors > 0 ? 1 : 0;
+}
@@ -1,5 +1,46 @@
 #include "aimwrfltr.h"
 
+//
+// Sets blocks claimed by caller within FirstBlock to LastBlock back to
+// unallocated.
+//
+static VOID
+AIMWrFltrReleaseClaimedBlocks(
+    PDEVICE_EXTENSION DeviceExtension,
+    LONGLONG FirstBlock,
+    LONGLONG LastBlock)
+{
+    for (LONGLONG i = FirstBlock; i <= LastBlock; i++)
+    {
+        if (AIMWrFltrReadTableEntry(DeviceExtension, i) == DIFF_BLOCK_CLAIMED)
+        {
+            AIMWrFltrResolveBlockClaims(DeviceExtension, i, 1,
+                DIFF_BLOCK_UNALLOCATED);
+        }
+    }
+}
+
+//
+// Claims a block for a direct write that was unallocated when request was
+// checked. Returns false if there is no memory for allocation table leaf,
+// or if another request has claimed or allocated the block since then.
+// Worker thread can allocate it for a partial write in between, leaving
+// sectors missing in its sector bitmap that a direct write would not mark
+// as written, so request is then handed over to worker thread instead.
+//
+static bool
+AIMWrFltrClaimNewBlock(
+    PDEVICE_EXTENSION DeviceExtension,
+    LONGLONG Block)
+{
+    LONG volatile * entry =
+        AIMWrFltrAllocateTableEntry(DeviceExtension, Block);
+
+    return entry != NULL &&
+        InterlockedCompareExchange(entry, DIFF_BLOCK_CLAIMED,
+            DIFF_BLOCK_UNALLOCATED) == DIFF_BLOCK_UNALLOCATED;
+}
+
 NTSTATUS
 AIMWrFltrWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 {
@@ -71,23 +112,88 @@ AIMWrFltrWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
             device_extension->Statistics.LargestWriteSize >> 10));
     }
     
-    bool any_block_unmodified = false;
-    LONG first = (LONG)
-        DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Write.ByteOffset.QuadPart);
-    LONG last = (LONG)
-        DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Write.ByteOffset.QuadPart +
+    // Direct writes wait while worker thread moves a block at diff device
+    bool direct_io = AIMWrFltrStartDirectIo(device_extension);
+
+    bool any_block_unmodified = !direct_io;
+    LONG new_blocks = 0;
+    LONGLONG last_claimed = -1;
+    LONGLONG first = (LONGLONG)
+        DIFF_GET_BLOCK_NUMBER(device_extension,
+            io_stack->Parameters.Write.ByteOffset.QuadPart);
+    LONGLONG last = (LONGLONG)
+        DIFF_GET_BLOCK_NUMBER(device_extension,
+            io_stack->Parameters.Write.ByteOffset.QuadPart +
         io_stack->Parameters.Write.Length - 1);
 
-    for (LONG i = first; i <= last && !any_block_unmodified; i++)
+    for (LONGLONG i = first; i <= last && !any_block_unmodified; i++)
     {
-        if (device_extension->AllocationTable[i] == DIFF_BLOCK_UNALLOCATED)
+        LONG block_address = AIMWrFltrReadTableEntry(device_extension, i);
+        LONGLONG block_base = (LONGLONG)i << DIFF_BLOCK_BITS(device_extension);
+
+        // New blocks completely covered by this request are claimed and
+        // written directly. Others need to be filled up or need a sector
+        // bitmap, so they are left to worker thread. So are blocks claimed
+        // by other requests still in progress, and blocks that another
+        // request claims or allocates before they are claimed here.
+        if (block_address == DIFF_BLOCK_UNALLOCATED)
+        {
+            if ((block_base >= io_stack->Parameters.Write.ByteOffset.QuadPart) &&
+                ((block_base + (LONGLONG)DIFF_BLOCK_SIZE(device_extension)) <=
+                    highest_byte) &&
+                AIMWrFltrClaimNewBlock(device_extension, i))
+            {
+                ++new_blocks;
+                last_claimed = i;
+            }
+            else
+            {
+                any_block_unmodified = true;
+            }
+
+            continue;
+        }
+
+        if (block_address == DIFF_BLOCK_CLAIMED)
         {
             any_block_unmodified = true;
+            break;
+        }
+
+        // Writes to sectors not yet at diff device need sector bitmap
+        // updated by worker thread
+        PDIFF_SECTOR_BITMAP bitmap =
+            AIMWrFltrGetSectorBitmap(device_extension, i);
+
+        if (bitmap != NULL)
+        {
+            LONGLONG start = max(block_base,
+                io_stack->Parameters.Write.ByteOffset.QuadPart);
+            LONGLONG end = min(block_base + (LONGLONG)DIFF_BLOCK_SIZE(device_extension),
+                highest_byte);
+
+            if (AIMWrFltrAnySectorMissing(bitmap, (ULONG)(start - block_base),
+                (ULONG)(end - start)))
+            {
+                any_block_unmodified = true;
+            }
         }
     }
 
     if (any_block_unmodified)
     {
+        // Worker thread claims these again
+        if (new_blocks > 0)
+        {
+            AIMWrFltrReleaseClaimedBlocks(device_extension, first,
+                last_claimed);
+        }
+
+        if (direct_io)
+        {
+            AIMWrFltrEndDirectIo(device_extension);
+        }
+
         InterlockedIncrement64(
             &device_extension->Statistics.DeferredWriteRequests);
 
@@ -139,10 +245,18 @@ AIMWrFltrWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
         &device_extension->RemoveLock,
         (DeviceObject->Flags & DO_BUFFERED_IO) ?
         (PUCHAR)Irp->AssociatedIrp.SystemBuffer :
-        NULL);
+        NULL,
+        &device_extension->DirectIoCount);
 
     if (!NT_SUCCESS(status))
     {
+        if (new_blocks > 0)
+        {
+            AIMWrFltrReleaseClaimedBlocks(device_extension, first, last);
+        }
+
+        AIMWrFltrEndDirectIo(device_extension);
+
         Irp->IoStatus.Status = status;
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
 
@@ -151,30 +265,65 @@ AIMWrFltrWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
         return status;
     }
 
+    // Diff blocks for claimed blocks, allocated in order so that claimed
+    // blocks next to each other are written with one request
+    LONG next_new_block = 0;
+
+    if (new_blocks > 0)
+    {
+        next_new_block = AIMWrFltrAllocateDiffBlocks(device_extension,
+            new_blocks);
+    }
+
     ULONG length_done = 0;
     ULONG splits = 0;
 
     for (
-        LONG i = first;
+        LONGLONG i = first;
         (i <= last) && (length_done < io_stack->Parameters.Write.Length);
         i++)
     {
         LONGLONG abs_offset_this_iter =
             io_stack->Parameters.Write.ByteOffset.QuadPart + length_done;
         ULONG page_offset_this_iter =
-            DIFF_GET_BLOCK_OFFSET(abs_offset_this_iter);
+            DIFF_GET_BLOCK_OFFSET(device_extension, abs_offset_this_iter);
         ULONG bytes_this_iter =
             io_stack->Parameters.Write.Length - length_done;
-        ULONG block_size = DIFF_BLOCK_SIZE;
-        LONG block_base = device_extension->AllocationTable[i];
+        ULONG block_size = DIFF_BLOCK_SIZE(device_extension);
+        LONGLONG run_first = i;
+        LONG block_base = AIMWrFltrReadTableEntry(device_extension, i);
+        DIFF_BLOCK_CLAIM claim = { 0 };
+
+        // Claimed blocks are only merged with each other, so that they are
+        // all resolved when this lower level request completes
+        if (block_base == DIFF_BLOCK_CLAIMED)
+        {
+            block_base = next_new_block++;
+
+            claim.DeviceExtension = device_extension;
+            claim.FirstBlock = i;
+            claim.Blocks = 1;
+            claim.BlockAddress = block_base;
+        }
 
         while ((page_offset_this_iter + bytes_this_iter) > block_size)
         {
+            LONG next_block_address =
+                AIMWrFltrReadTableEntry(device_extension, i + 1);
+
             // Contigous? Then merge with next iteration
-            if (device_extension->AllocationTable[i + 1] ==
-                device_extension->AllocationTable[i] + 1)
+            if ((claim.Blocks > 0) ?
+                (next_block_address == DIFF_BLOCK_CLAIMED) :
+                (next_block_address ==
+                    AIMWrFltrReadTableEntry(device_extension, i) + 1))
             {
-                block_size += DIFF_BLOCK_SIZE;
+                if (claim.Blocks > 0)
+                {
+                    ++next_new_block;
+                    ++claim.Blocks;
+                }
+
+                block_size += DIFF_BLOCK_SIZE(device_extension);
                 ++i;
             }
             else
@@ -186,7 +335,8 @@ AIMWrFltrWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 
         LARGE_INTEGER lower_offset = { 0 };
 
-        lower_offset.QuadPart = ((LONGLONG)block_base << DIFF_BLOCK_BITS) +
+        lower_offset.QuadPart = ((LONGLONG)block_base <<
+            DIFF_BLOCK_BITS(device_extension)) +
             page_offset_this_iter;
 
         PIRP lower_irp = scatter->BuildIrp(
@@ -195,10 +345,18 @@ AIMWrFltrWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
             device_extension->DiffFileObject,
             length_done,
             bytes_this_iter,
-            &lower_offset);
+            &lower_offset,
+            claim.Blocks > 0 ? &claim : NULL);
 
         if (lower_irp == NULL)
         {
+            // Claimed blocks not yet sent to diff device
+            if (new_blocks > 0)
+            {
+                AIMWrFltrReleaseClaimedBlocks(device_extension, run_first,
+                    last);
+            }
+
             break;
         }
 
@@ -224,243 +382,767 @@ AIMWrFltrWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
     return STATUS_PENDING;
 }				// end AIMWrFltrReadWrite()
 
-VOID
-AIMWrFltrDeferredWrite(
-PDEVICE_EXTENSION DeviceExtension,
-PIRP Irp,
-PUCHAR BlockBuffer)
+//
+// One allocation block of a deferred write request and lower level
+// requests for it.
+//
+typedef struct _DEFERRED_WRITE_BLOCK
 {
-    KEVENT event;
-    KeInitializeEvent(&event, SynchronizationEvent, FALSE);
+    //
+    // Index of request in batch that this block belongs to.
+    //
+    ULONG IrpIndex;
+
+    LONGLONG BlockNumber;
+
+    LONG BlockAddress;
+
+    //
+    // Data to write to diff device at BlockOffset within block. For new
+    // blocks that need fill reads, this is a fill buffer and BlockOffset
+    // and Length are changed to a complete block when fill reads are
+    // done. Otherwise it points into buffer of original request.
+    //
+    PUCHAR Buffer;
+
+    ULONG BlockOffset;
+
+    ULONG Length;
 
-    PUCHAR buffer = NULL;
-    if (DeviceExtension->DeviceObject->Flags & DO_BUFFERED_IO)
+    bool NeedsFill;
+
+    //
+    // Block claimed by worker thread, to be resolved to BlockAddress when
+    // written.
+    //
+    bool NewBlock;
+
+    //
+    // New block where only sectors written are stored at diff device and
+    // remaining ones are marked as missing in sector bitmap.
+    //
+    bool PartialNewBlock;
+
+    //
+    // Sector bitmap for block, if any, to update when data is written.
+    //
+    PDIFF_SECTOR_BITMAP SectorBitmap;
+
+    NTSTATUS Status;
+
+    PIRP HeadFillIrp;
+
+    PIRP TailFillIrp;
+
+    PIRP WriteIrp;
+
+} DEFERRED_WRITE_BLOCK, *PDEFERRED_WRITE_BLOCK;
+
+//
+// Lower level requests in flight for a number of deferred write blocks.
+// Outstanding is biased by one while requests are being sent, so that
+// event is not set until all of them are sent and completed.
+//
+typedef struct _DEFERRED_WRITE_WAVE
+{
+    PDEVICE_EXTENSION DeviceExtension;
+
+    PIRP *Irps;
+
+    DEFERRED_WRITE_BLOCK Blocks[DEFERRED_WRITE_BLOCKS_IN_FLIGHT];
+
+    ULONG BlockCount;
+
+    ULONG FillCount;
+
+    volatile LONG Outstanding;
+
+    KEVENT Event;
+
+} DEFERRED_WRITE_WAVE, *PDEFERRED_WRITE_WAVE;
+
+NTSTATUS
+AIMWrFltrDeferredWriteIrpCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_opt_(_Inexpressible_("varies")) PVOID Context)
+{
+    PDEFERRED_WRITE_WAVE wave = (PDEFERRED_WRITE_WAVE)Context;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Irp);
+
+    if (InterlockedDecrement(&wave->Outstanding) == 0)
     {
-        buffer = (PUCHAR)Irp->AssociatedIrp.SystemBuffer;
+        KeSetEvent(&wave->Event, IO_NO_INCREMENT, FALSE);
     }
-    else
+
+    // Irp is freed by AIMWrFltrRunDeferredWriteWave
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static PIRP
+AIMWrFltrStartDeferredWriteIrp(
+    PDEFERRED_WRITE_WAVE Wave,
+    UCHAR MajorFunction,
+    PDEVICE_OBJECT DeviceObject,
+    PFILE_OBJECT FileObject,
+    PVOID Buffer,
+    ULONG Length,
+    LONGLONG Offset)
+{
+    LARGE_INTEGER offset;
+    offset.QuadPart = Offset;
+
+    PIRP irp = IoBuildAsynchronousFsdRequest(
+        MajorFunction,
+        DeviceObject,
+        Buffer,
+        Length,
+        &offset,
+        NULL);
+
+    if (irp == NULL)
+    {
+        KdBreakPoint();
+
+        return NULL;
+    }
+
+    IoGetNextIrpStackLocation(irp)->FileObject = FileObject;
+
+    IoSetCompletionRoutine(irp, AIMWrFltrDeferredWriteIrpCompletion,
+        Wave, TRUE, TRUE, TRUE);
+
+    InterlockedIncrement(&Wave->Outstanding);
+
+    IoCallDriver(DeviceObject, irp);
+
+    return irp;
+}
+
+static VOID
+AIMWrFltrWaitDeferredWriteWave(PDEFERRED_WRITE_WAVE Wave)
+{
+    if (InterlockedDecrement(&Wave->Outstanding) != 0)
+    {
+        KeWaitForSingleObject(&Wave->Event, Executive, KernelMode, FALSE,
+            NULL);
+    }
+
+    Wave->Outstanding = 1;
+    KeClearEvent(&Wave->Event);
+}
+
+//
+// Completes fill read and returns its final status.
+//
+static NTSTATUS
+AIMWrFltrFinishFillRead(PIRP FillIrp, ULONG Length)
+{
+    NTSTATUS status = FillIrp->IoStatus.Status;
+
+    if (NT_SUCCESS(status) &&
+        FillIrp->IoStatus.Information != Length)
+    {
+        KdPrint(("AIMWrFltrDeferredWrite: Fill read request 0x%X bytes, got 0x%IX.\n",
+            Length, FillIrp->IoStatus.Information));
+
+        KdBreakPoint();
+    }
+
+    AIMWrFltrFreeIrpWithMdls(FillIrp);
+
+    return status;
+}
+
+//
+// Sends fill reads for all new blocks in wave at once, head and tail of
+// each block in parallel, waits for them, then sends writes to diff
+// device for all blocks at once. Allocation table is only updated for
+// blocks that have been completely written to diff device, so that no
+// reads or writes use a block before it holds valid data.
+//
+static VOID
+AIMWrFltrRunDeferredWriteWave(PDEFERRED_WRITE_WAVE Wave)
+{
+    PDEVICE_EXTENSION device_extension = Wave->DeviceExtension;
+
+    if (Wave->BlockCount == 0)
     {
-        buffer = (PUCHAR)MmGetSystemAddressForMdlSafe(
-            Irp->MdlAddress, NormalPagePriority);
+        return;
+    }
+
+    ULONGLONG fill_start = KeQueryInterruptTime();
+    BOOLEAN fill_sent = FALSE;
 
-        if (buffer == NULL)
+    for (ULONG i = 0; i < Wave->BlockCount; i++)
+    {
+        PDEFERRED_WRITE_BLOCK block = &Wave->Blocks[i];
+
+        if (!block->NeedsFill)
         {
-            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-            return;
+            continue;
+        }
+
+        LONGLONG block_base = (LONGLONG)block->BlockNumber <<
+            DIFF_BLOCK_BITS(device_extension);
+        ULONG data_end = block->BlockOffset + block->Length;
+
+        // Need to fill up beginning of block?
+        if (block->BlockOffset > 0)
+        {
+            block->HeadFillIrp = AIMWrFltrStartDeferredWriteIrp(
+                Wave,
+                IRP_MJ_READ,
+                device_extension->TargetDeviceObject,
+                NULL,
+                block->Buffer,
+                block->BlockOffset,
+                block_base);
+
+            if (block->HeadFillIrp == NULL)
+            {
+                block->Status = STATUS_INSUFFICIENT_RESOURCES;
+                continue;
+            }
+
+            InterlockedIncrement64(&device_extension->Statistics.FillReads);
+            InterlockedExchangeAdd64(&device_extension->Statistics.FillReadBytes,
+                block->BlockOffset);
+
+            fill_sent = TRUE;
+        }
+
+        // Need to fill up end of block?
+        if (data_end < DIFF_BLOCK_SIZE(device_extension))
+        {
+            block->TailFillIrp = AIMWrFltrStartDeferredWriteIrp(
+                Wave,
+                IRP_MJ_READ,
+                device_extension->TargetDeviceObject,
+                NULL,
+                block->Buffer + data_end,
+                (ULONG)(DIFF_BLOCK_SIZE(device_extension) - data_end),
+                block_base + data_end);
+
+            if (block->TailFillIrp == NULL)
+            {
+                block->Status = STATUS_INSUFFICIENT_RESOURCES;
+                continue;
+            }
+
+            InterlockedIncrement64(&device_extension->Statistics.FillReads);
+            InterlockedExchangeAdd64(&device_extension->Statistics.FillReadBytes,
+                DIFF_BLOCK_SIZE(device_extension) - data_end);
+
+            fill_sent = TRUE;
         }
     }
 
-    PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
+    AIMWrFltrWaitDeferredWriteWave(Wave);
 
-    LONG first = (LONG)
-        DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Write.ByteOffset.QuadPart);
-    LONG last = (LONG)
-        DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Write.ByteOffset.QuadPart +
-        io_stack->Parameters.Write.Length - 1);
+    if (fill_sent)
+    {
+        InterlockedIncrement64(&device_extension->Statistics.FillReadWaves);
+        InterlockedExchangeAdd64(&device_extension->Statistics.FillReadWaitTime,
+            (LONGLONG)(KeQueryInterruptTime() - fill_start));
+    }
 
-    LONG splits = last - first;
-    if (splits > 0)
+    for (ULONG i = 0; i < Wave->BlockCount; i++)
     {
-        InterlockedExchangeAdd64(&DeviceExtension->Statistics.SplitWrites, splits);
+        PDEFERRED_WRITE_BLOCK block = &Wave->Blocks[i];
+        ULONG data_end = block->BlockOffset + block->Length;
+
+        if (block->HeadFillIrp != NULL)
+        {
+            NTSTATUS status = AIMWrFltrFinishFillRead(block->HeadFillIrp,
+                block->BlockOffset);
+
+            block->HeadFillIrp = NULL;
+
+            if (!NT_SUCCESS(status) && NT_SUCCESS(block->Status))
+            {
+                block->Status = status;
+            }
+        }
+
+        if (block->TailFillIrp != NULL)
+        {
+            NTSTATUS status = AIMWrFltrFinishFillRead(block->TailFillIrp,
+                (ULONG)(DIFF_BLOCK_SIZE(device_extension) - data_end));
+
+            block->TailFillIrp = NULL;
+
+            if (!NT_SUCCESS(status) && NT_SUCCESS(block->Status))
+            {
+                block->Status = status;
+            }
+        }
+
+        if (!NT_SUCCESS(block->Status))
+        {
+            KdPrint(("AIMWrFltrDeferredWrite: Fill read from original device failed: 0x%X\n",
+                block->Status));
+
+            KdBreakPoint();
+
+            continue;
+        }
+
+        if (block->NeedsFill)
+        {
+            block->BlockOffset = 0;
+            block->Length = DIFF_BLOCK_SIZE(device_extension);
+        }
+
+        block->WriteIrp = AIMWrFltrStartDeferredWriteIrp(
+            Wave,
+            IRP_MJ_WRITE,
+            device_extension->DiffDeviceObject,
+            device_extension->DiffFileObject,
+            block->Buffer,
+            block->Length,
+            ((LONGLONG)block->BlockAddress << DIFF_BLOCK_BITS(device_extension)) +
+            block->BlockOffset);
+
+        if (block->WriteIrp == NULL)
+        {
+            block->Status = STATUS_INSUFFICIENT_RESOURCES;
+        }
     }
 
-    IO_STATUS_BLOCK io_status;
-    ULONG length_done = 0;
+    AIMWrFltrWaitDeferredWriteWave(Wave);
 
-    for (
-        LONG i = first;
-        (i <= last) && (length_done < io_stack->Parameters.Write.Length);
-        i++)
+    for (ULONG i = 0; i < Wave->BlockCount; i++)
     {
-        LONGLONG abs_offset_this_iter =
-            io_stack->Parameters.Write.ByteOffset.QuadPart +
-            length_done;
-        ULONG page_offset_this_iter =
-            DIFF_GET_BLOCK_OFFSET(abs_offset_this_iter);
-        ULONG bytes_this_iter = io_stack->Parameters.Write.Length -
-            length_done;
+        PDEFERRED_WRITE_BLOCK block = &Wave->Blocks[i];
 
-        if ((page_offset_this_iter + bytes_this_iter) > DIFF_BLOCK_SIZE)
+        if (block->WriteIrp != NULL)
         {
-            bytes_this_iter = DIFF_BLOCK_SIZE - page_offset_this_iter;
-        }
+            block->Status = block->WriteIrp->IoStatus.Status;
 
-        RtlCopyMemory(BlockBuffer + page_offset_this_iter,
-            buffer + length_done, bytes_this_iter);
+            if (NT_SUCCESS(block->Status) &&
+                block->WriteIrp->IoStatus.Information != block->Length)
+            {
+                KdPrint(("AIMWrFltrDeferredWrite: Write request 0x%X bytes, done 0x%IX.\n",
+                    block->Length, block->WriteIrp->IoStatus.Information));
 
-        length_done += bytes_this_iter;
+                KdBreakPoint();
+            }
 
-        NTSTATUS status;
-        LONG block_address = DeviceExtension->AllocationTable[i];
-        if (block_address == DIFF_BLOCK_UNALLOCATED)
+            AIMWrFltrFreeIrpWithMdls(block->WriteIrp);
+
+            block->WriteIrp = NULL;
+
+            if (!NT_SUCCESS(block->Status))
+            {
+                KdPrint(("AIMWrFltrDeferredWrite: Write to diff device failed: 0x%X\n",
+                    block->Status));
+
+                KdBreakPoint();
+            }
+        }
+
+        if (!NT_SUCCESS(block->Status))
         {
-            block_address = ++DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.LastAllocatedBlock;
+            Wave->Irps[block->IrpIndex]->IoStatus.Status = block->Status;
 
-            // If not writing a complete block, we need to fill up by reading
-            // some data from target volume
-            if (bytes_this_iter < DIFF_BLOCK_SIZE)
+            if (block->NewBlock)
             {
-                // Need to fill up beginning of block?
-                if (page_offset_this_iter > 0)
-                {
-                    LARGE_INTEGER offset;
-                    offset.QuadPart =
-                        DIFF_GET_BLOCK_BASE_FROM_ABS_OFFSET(abs_offset_this_iter);
-
-                    PIRP target_irp = IoBuildSynchronousFsdRequest(
-                        IRP_MJ_READ,
-                        DeviceExtension->TargetDeviceObject,
-                        BlockBuffer,
-                        page_offset_this_iter,
-                        &offset,
-                        &event,
-                        &io_status);
-
-                    if (target_irp == NULL)
-                    {
-                        KdBreakPoint();
+                AIMWrFltrResolveBlockClaims(device_extension,
+                    block->BlockNumber, 1, DIFF_BLOCK_UNALLOCATED);
+            }
 
-                        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-                        return;
-                    }
+            continue;
+        }
 
-                    KeClearEvent(&event);
+        ULONG first_sector = block->BlockOffset >> SECTOR_BITS;
+        ULONG sectors = ((block->BlockOffset + block->Length - 1) >>
+            SECTOR_BITS) - first_sector + 1;
 
-                    status = IoCallDriver(
-                        DeviceExtension->TargetDeviceObject,
-                        target_irp);
+        // Existing blocks only need a journal entry when sectors that
+        // were missing at diff device have now been written
+        bool sectors_written = block->NewBlock ||
+            AIMWrFltrAnySectorMissing(block->SectorBitmap,
+                block->BlockOffset, block->Length);
 
-                    ++DeviceExtension->Statistics.FillReads;
-                    DeviceExtension->Statistics.FillReadBytes +=
-                        page_offset_this_iter;
+        if (block->SectorBitmap != NULL)
+        {
+            if (block->PartialNewBlock)
+            {
+                AIMWrFltrSetSectorsMissing(block->SectorBitmap, 0,
+                    DIFF_BLOCK_SIZE(device_extension), true);
+            }
 
-                    if (status == STATUS_PENDING)
-                    {
-                        KeWaitForSingleObject(&event, Executive, KernelMode,
-                            FALSE, NULL);
-                    }
+            AIMWrFltrSetSectorsMissing(block->SectorBitmap, block->BlockOffset,
+                block->Length, false);
 
-                    if (!NT_SUCCESS(io_status.Status))
-                    {
-                        KdBreakPoint();
+            AIMWrFltrMarkPageDirty(device_extension->SectorBitmapDirty,
+                (ULONG)(block->BlockNumber /
+                    DIFF_SECTOR_BITMAP_BLOCKS_PER_CHUNK(device_extension)));
+        }
 
-                        Irp->IoStatus.Status = io_status.Status;
-                        return;
-                    }
+        if (block->NewBlock)
+        {
+            AIMWrFltrResolveBlockClaims(device_extension, block->BlockNumber,
+                1, block->BlockAddress);
+        }
 
-                    bytes_this_iter += page_offset_this_iter;
-                    page_offset_this_iter = 0;
-                }
+        // Blocks without sector bitmap have no sectors missing, so only
+        // table entry needs to be journaled for them
+        if (sectors_written)
+        {
+            AIMWrFltrJournalAppend(device_extension, block->BlockNumber, 1,
+                block->NewBlock ? block->BlockAddress : DIFF_BLOCK_UNALLOCATED,
+                block->SectorBitmap != NULL ? first_sector : 0,
+                block->SectorBitmap != NULL ? sectors : 0);
+        }
+    }
 
-                // Need to fill up end of block?
-                if (bytes_this_iter < DIFF_BLOCK_SIZE)
-                {
-                    LARGE_INTEGER offset;
-                    offset.QuadPart =
-                        DIFF_GET_BLOCK_BASE_FROM_ABS_OFFSET(abs_offset_this_iter) +
-                        bytes_this_iter;
-
-                    PIRP target_irp = IoBuildSynchronousFsdRequest(
-                        IRP_MJ_READ,
-                        DeviceExtension->TargetDeviceObject,
-                        BlockBuffer + bytes_this_iter,
-                        DIFF_BLOCK_SIZE - bytes_this_iter,
-                        &offset,
-                        &event,
-                        &io_status);
-
-                    if (target_irp == NULL)
-                    {
-                        KdBreakPoint();
+    Wave->BlockCount = 0;
+    Wave->FillCount = 0;
+}
 
-                        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-                        return;
-                    }
+//
+// Returns diff block for an allocation block that worker thread is about
+// to write. If block is claimed by a direct write in progress, waits for
+// that to complete first. If block is unallocated, claims it and returns
+// DIFF_BLOCK_UNALLOCATED. Returns DIFF_BLOCK_CLAIMED if there is no
+// memory for allocation table leaf.
+//
+static LONG
+AIMWrFltrClaimDeferredBlock(
+    PDEVICE_EXTENSION DeviceExtension,
+    LONGLONG Block)
+{
+    LONG volatile * entry = AIMWrFltrAllocateTableEntry(DeviceExtension, Block);
+
+    if (entry == NULL)
+    {
+        return DIFF_BLOCK_CLAIMED;
+    }
 
-                    KeClearEvent(&event);
+    for (;;)
+    {
+        KeClearEvent(&DeviceExtension->BlockClaimEvent);
 
-                    status = IoCallDriver(
-                        DeviceExtension->TargetDeviceObject,
-                        target_irp);
+        LONG block_address = InterlockedCompareExchange(entry,
+            DIFF_BLOCK_CLAIMED, DIFF_BLOCK_UNALLOCATED);
 
-                    if (status == STATUS_PENDING)
-                    {
-                        KeWaitForSingleObject(&event, Executive, KernelMode,
-                            FALSE, NULL);
-                    }
+        if (block_address != DIFF_BLOCK_CLAIMED)
+        {
+            return block_address;
+        }
 
-                    if (io_status.Information != DIFF_BLOCK_SIZE - bytes_this_iter)
-                    {
-                        KdPrint(("AIMWrFltrDeferredWrite: Fill read request 0x%IX bytes, got 0x%IX.\n",
-                            DIFF_BLOCK_SIZE - bytes_this_iter, io_status.Information));
+        KeWaitForSingleObject(&DeviceExtension->BlockClaimEvent, Executive,
+            KernelMode, FALSE, NULL);
+    }
+}
 
-                        KdBreakPoint();
-                    }
+//
+// Takes following write requests from worker queue that can be processed
+// together with Irps[0]. Stops at first request that is not a write or
+// that overlaps an allocation block of a request already taken, and puts
+// that back first in queue. Requests are then still processed in order
+// they were queued wherever order matters.
+//
+static ULONG
+AIMWrFltrCollectDeferredWrites(
+    PDEVICE_EXTENSION DeviceExtension,
+    PIRP *Irps)
+{
+    LONGLONG first[DEFERRED_WRITE_BATCH_SIZE];
+    LONGLONG last[DEFERRED_WRITE_BATCH_SIZE];
+    ULONG count = 0;
 
-                    if (!NT_SUCCESS(io_status.Status))
-                    {
-                        KdPrint(("AIMWrFltrDeferredWrite: Fill read from original device failed: 0x%X\n",
-                            io_status.Status));
+    for (;;)
+    {
+        PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irps[count]);
 
-                        KdBreakPoint();
+        first[count] = (LONGLONG)
+            DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+                io_stack->Parameters.Write.ByteOffset.QuadPart);
+        last[count] = (LONGLONG)
+            DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+                io_stack->Parameters.Write.ByteOffset.QuadPart +
+                io_stack->Parameters.Write.Length - 1);
 
-                        Irp->IoStatus.Status = io_status.Status;
-                        return;
-                    }
+        ++count;
+
+        if (count >= DEFERRED_WRITE_BATCH_SIZE)
+        {
+            break;
+        }
+
+        PLIST_ENTRY request = ExInterlockedRemoveHeadList(
+            &DeviceExtension->ListHead, &DeviceExtension->ListLock);
+
+        if (request == NULL)
+        {
+            break;
+        }
+
+        PIRP irp = CONTAINING_RECORD(request, IRP, Tail.Overlay.ListEntry);
+        io_stack = IoGetCurrentIrpStackLocation(irp);
 
-                    ++DeviceExtension->Statistics.FillReads;
-                    DeviceExtension->Statistics.FillReadBytes +=
-                        DIFF_BLOCK_SIZE - bytes_this_iter;
+        bool can_batch = io_stack->MajorFunction == IRP_MJ_WRITE;
 
-                    bytes_this_iter = DIFF_BLOCK_SIZE;
+        if (can_batch)
+        {
+            LONGLONG irp_first = (LONGLONG)
+                DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+                    io_stack->Parameters.Write.ByteOffset.QuadPart);
+            LONGLONG irp_last = (LONGLONG)
+                DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+                    io_stack->Parameters.Write.ByteOffset.QuadPart +
+                    io_stack->Parameters.Write.Length - 1);
+
+            for (ULONG i = 0; i < count; i++)
+            {
+                if (irp_first <= last[i] && irp_last >= first[i])
+                {
+                    can_batch = false;
+                    break;
                 }
             }
         }
 
-        LARGE_INTEGER lower_offset = { 0 };
+        if (!can_batch)
+        {
+            ExInterlockedInsertHeadList(&DeviceExtension->ListHead,
+                request, &DeviceExtension->ListLock);
 
-        lower_offset.QuadPart = ((LONGLONG)block_address <<
-            DIFF_BLOCK_BITS) + page_offset_this_iter;
+            break;
+        }
 
-        status = AIMWrFltrSynchronousReadWrite(
-            DeviceExtension->DiffDeviceObject,
-            DeviceExtension->DiffFileObject,
-            IRP_MJ_WRITE,
-            BlockBuffer + page_offset_this_iter,
-            bytes_this_iter,
-            &lower_offset,
-            &io_status);
+        irp->IoStatus.Information = 0;
+        irp->IoStatus.Status = STATUS_SUCCESS;
 
-#pragma warning(suppress: 6102)
-        if (NT_SUCCESS(status) &&
-            io_status.Information != bytes_this_iter)
-        {
-            KdPrint(("AIMWrFltrDeferredWrite: Write request 0x%X bytes, done 0x%IX.\n",
-                bytes_this_iter, io_status.Information));
+        Irps[count] = irp;
+    }
 
-            KdBreakPoint();
+    return count;
+}
+
+VOID
+AIMWrFltrDeferredWrite(
+PDEVICE_EXTENSION DeviceExtension,
+PIRP Irp,
+PUCHAR FillBuffers)
+{
+    PIRP irps[DEFERRED_WRITE_BATCH_SIZE];
+    irps[0] = Irp;
+
+    ULONG irp_count = AIMWrFltrCollectDeferredWrites(DeviceExtension, irps);
+
+    PDEFERRED_WRITE_WAVE wave = (PDEFERRED_WRITE_WAVE)
+        ExAllocatePoolWithTag(NonPagedPool, sizeof(DEFERRED_WRITE_WAVE),
+            POOL_TAG);
+
+    if (wave == NULL)
+    {
+        KdBreakPoint();
+
+        for (ULONG i = 0; i < irp_count; i++)
+        {
+            irps[i]->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
         }
+    }
+    else
+    {
+        wave->DeviceExtension = DeviceExtension;
+        wave->Irps = irps;
+        wave->BlockCount = 0;
+        wave->FillCount = 0;
+        wave->Outstanding = 1;
+        KeInitializeEvent(&wave->Event, NotificationEvent, FALSE);
+    }
 
-        if (!NT_SUCCESS(status))
+    for (ULONG irp_index = 0; (wave != NULL) && (irp_index < irp_count); irp_index++)
+    {
+        PIRP irp = irps[irp_index];
+        PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(irp);
+
+        PUCHAR buffer = NULL;
+        if (DeviceExtension->DeviceObject->Flags & DO_BUFFERED_IO)
         {
-            KdPrint(("AIMWrFltrDeferredWrite: Write to diff device failed: 0x%X\n",
-                status));
+            buffer = (PUCHAR)irp->AssociatedIrp.SystemBuffer;
+        }
+        else
+        {
+            buffer = (PUCHAR)MmGetSystemAddressForMdlSafe(
+                irp->MdlAddress, NormalPagePriority);
 
-            KdBreakPoint();
+            if (buffer == NULL)
+            {
+                irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+                continue;
+            }
+        }
 
-            Irp->IoStatus.Status = status;
-            return;
+        LONGLONG first = (LONGLONG)
+            DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+                io_stack->Parameters.Write.ByteOffset.QuadPart);
+        LONGLONG last = (LONGLONG)
+            DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+                io_stack->Parameters.Write.ByteOffset.QuadPart +
+            io_stack->Parameters.Write.Length - 1);
+
+        LONGLONG splits = last - first;
+        if (splits > 0)
+        {
+            InterlockedExchangeAdd64(&DeviceExtension->Statistics.SplitWrites, splits);
         }
 
-        if (DeviceExtension->AllocationTable[i] != block_address)
+        ULONG length_done = 0;
+
+        for (
+            LONGLONG i = first;
+            (i <= last) && (length_done < io_stack->Parameters.Write.Length) &&
+            NT_SUCCESS(irp->IoStatus.Status);
+            i++)
         {
-            DeviceExtension->AllocationTable[i] = block_address;
+            LONGLONG abs_offset_this_iter =
+                io_stack->Parameters.Write.ByteOffset.QuadPart +
+                length_done;
+            ULONG page_offset_this_iter =
+                DIFF_GET_BLOCK_OFFSET(DeviceExtension, abs_offset_this_iter);
+            ULONG bytes_this_iter = io_stack->Parameters.Write.Length -
+                length_done;
+
+            if ((page_offset_this_iter + bytes_this_iter) >
+                DIFF_BLOCK_SIZE(DeviceExtension))
+            {
+                bytes_this_iter =
+                    DIFF_BLOCK_SIZE(DeviceExtension) - page_offset_this_iter;
+            }
+
+            LONG block_address =
+                AIMWrFltrClaimDeferredBlock(DeviceExtension, i);
+
+            if (block_address == DIFF_BLOCK_CLAIMED)
+            {
+                irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+
+            bool new_block = block_address == DIFF_BLOCK_UNALLOCATED;
+            PDIFF_SECTOR_BITMAP bitmap =
+                AIMWrFltrGetSectorBitmap(DeviceExtension, i);
+            bool partial_new_block = false;
+            bool needs_fill = false;
+
+            // If not writing a complete block to a new block, only write
+            // sectors supplied and mark the others as missing at diff
+            // device. If request is not sector aligned, or there is no
+            // memory for sector bitmap, we need to fill up by reading
+            // some data from target volume.
+            if (new_block && (bytes_this_iter < DIFF_BLOCK_SIZE(DeviceExtension)))
+            {
+                if (((page_offset_this_iter | bytes_this_iter) &
+                    (SECTOR_SIZE - 1)) == 0)
+                {
+                    PDIFF_SECTOR_BITMAP new_bitmap =
+                        AIMWrFltrAllocateSectorBitmap(DeviceExtension, i);
+
+                    if (new_bitmap != NULL)
+                    {
+                        bitmap = new_bitmap;
+                        partial_new_block = true;
+                    }
+                }
+
+                needs_fill = !partial_new_block;
+            }
+
+            if ((wave->BlockCount >= DEFERRED_WRITE_BLOCKS_IN_FLIGHT) ||
+                (needs_fill && (wave->FillCount >=
+                    DEFERRED_FILL_BLOCKS_IN_FLIGHT(DeviceExtension))))
+            {
+                AIMWrFltrRunDeferredWriteWave(wave);
+
+                if (!NT_SUCCESS(irp->IoStatus.Status))
+                {
+                    if (new_block)
+                    {
+                        AIMWrFltrResolveBlockClaims(DeviceExtension, i, 1,
+                            DIFF_BLOCK_UNALLOCATED);
+                    }
+
+                    break;
+                }
+            }
+
+            if (new_block)
+            {
+                block_address = AIMWrFltrAllocateDiffBlocks(DeviceExtension, 1);
+            }
+
+            PDEFERRED_WRITE_BLOCK block = &wave->Blocks[wave->BlockCount++];
+
+            RtlZeroMemory(block, sizeof(*block));
+
+            block->IrpIndex = irp_index;
+            block->BlockNumber = i;
+            block->BlockAddress = block_address;
+            block->BlockOffset = page_offset_this_iter;
+            block->Length = bytes_this_iter;
+            block->NeedsFill = needs_fill;
+            block->NewBlock = new_block;
+            block->PartialNewBlock = partial_new_block;
+            block->SectorBitmap = bitmap;
+            block->Status = STATUS_SUCCESS;
+
+            if (partial_new_block)
+            {
+                InterlockedIncrement64(
+                    &DeviceExtension->Statistics.PartialNewBlocks);
+                InterlockedExchangeAdd64(
+                    &DeviceExtension->Statistics.FillReadBytesAvoided,
+                    DIFF_BLOCK_SIZE(DeviceExtension) - bytes_this_iter);
+            }
+
+            if (needs_fill)
+            {
+                block->Buffer = FillBuffers +
+                    ((SIZE_T)wave->FillCount++ << DIFF_BLOCK_BITS(DeviceExtension));
+
+                RtlCopyMemory(block->Buffer + page_offset_this_iter,
+                    buffer + length_done, bytes_this_iter);
+            }
+            else
+            {
+                block->Buffer = buffer + length_done;
+            }
+
+            length_done += bytes_this_iter;
         }
     }
 
-    if (NT_SUCCESS(Irp->IoStatus.Status))
+    if (wave != NULL)
+    {
+        AIMWrFltrRunDeferredWriteWave(wave);
+
+        ExFreePoolWithTag(wave, POOL_TAG);
+    }
+
+    for (ULONG irp_index = 0; irp_index < irp_count; irp_index++)
     {
-        Irp->IoStatus.Information = io_stack->Parameters.Write.Length;
+        PIRP irp = irps[irp_index];
+
+        if (NT_SUCCESS(irp->IoStatus.Status))
+        {
+            irp->IoStatus.Information =
+                IoGetCurrentIrpStackLocation(irp)->Parameters.Write.Length;
+        }
+
+        // First request is completed by worker thread
+        if (irp_index > 0)
+        {
+            IoCompleteRequest(irp, IO_DISK_INCREMENT);
+
+            IoReleaseRemoveLock(&DeviceExtension->RemoveLock, irp);
+        }
     }
 }
 
@@ -471,14 +1153,26 @@ AIMWrFltrDeferredFlushBuffers(
 {
     PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
 
-    NTSTATUS status = AIMWrFltrSynchronousReadWrite(
-        DeviceExtension->DiffDeviceObject,
-        DeviceExtension->DiffFileObject,
-        io_stack->MajorFunction,
-        NULL,
-        0,
-        NULL,
-        &Irp->IoStatus);
+    // Write journal records for blocks written before this request, so
+    // that they are found after a restart, then flush them to diff
+    // device. At shutdown, save allocation table leaves and sector bitmap
+    // chunks instead, so that no journal records need to be replayed next
+    // time.
+    NTSTATUS status = io_stack->MajorFunction == IRP_MJ_SHUTDOWN ?
+        AIMWrFltSaveDiffHeader(DeviceExtension) :
+        AIMWrFltrCommitJournal(DeviceExtension);
+
+    if (NT_SUCCESS(status))
+    {
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            io_stack->MajorFunction,
+            NULL,
+            0,
+            NULL,
+            &Irp->IoStatus);
+    }
 
     Irp->IoStatus.Status = status;
 }
@@ -549,26 +1243,28 @@ PUCHAR BlockBuffer)
             return;
         }
 
-        LONG first = (LONG)DIFF_GET_BLOCK_NUMBER(range[i].StartingOffset);
-        LONG last = (LONG)DIFF_GET_BLOCK_NUMBER(range[i].StartingOffset +
+        LONGLONG first = (LONGLONG)DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+            range[i].StartingOffset);
+        LONGLONG last = (LONGLONG)DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+            range[i].StartingOffset +
             range[i].LengthInBytes - 1);
 
         ULONGLONG length_done = 0;
 
         for (
-            LONG b = first;
+            LONGLONG b = first;
             (b <= last) && (length_done < range[i].LengthInBytes);
             b++)
         {
             LONGLONG abs_offset_this_iter =
                 range[i].StartingOffset + length_done;
             ULONG page_offset_this_iter =
-                DIFF_GET_BLOCK_OFFSET(abs_offset_this_iter);
+                DIFF_GET_BLOCK_OFFSET(DeviceExtension, abs_offset_this_iter);
             ULONGLONG bytes_this_iter =
                 range[i].LengthInBytes - length_done;
-            ULONGLONG block_size = DIFF_BLOCK_SIZE;
+            ULONGLONG block_size = DIFF_BLOCK_SIZE(DeviceExtension);
 
-            if (DeviceExtension->AllocationTable[b] == DIFF_BLOCK_UNALLOCATED)
+            if (AIMWrFltrGetDiffBlock(DeviceExtension, b) == DIFF_BLOCK_UNALLOCATED)
             {
                 if ((page_offset_this_iter + bytes_this_iter) > block_size)
                 {
@@ -586,10 +1282,10 @@ PUCHAR BlockBuffer)
             while ((page_offset_this_iter + bytes_this_iter) > block_size)
             {
                 // Contigous? Then merge with next iteration
-                if (DeviceExtension->AllocationTable[b + 1] ==
-                    (DeviceExtension->AllocationTable[b] + 1))
+                if (AIMWrFltrGetDiffBlock(DeviceExtension, b + 1) ==
+                    (AIMWrFltrGetDiffBlock(DeviceExtension, b) + 1))
                 {
-                    block_size += DIFF_BLOCK_SIZE;
+                    block_size += DIFF_BLOCK_SIZE(DeviceExtension);
                     ++b;
                 }
                 else
@@ -624,7 +1320,7 @@ PUCHAR BlockBuffer)
     SIZE_T lower_mdsa_size = FIELD_OFFSET(FILE_LEVEL_TRIM, Ranges) + (allocated *
         sizeof(FILE_LEVEL_TRIM_RANGE));
 
-    if (lower_mdsa_size > DIFF_BLOCK_SIZE)
+    if (lower_mdsa_size > DEFERRED_BLOCK_BUFFER_SIZE(DeviceExtension))
     {
         Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
         return;
@@ -643,25 +1339,27 @@ PUCHAR BlockBuffer)
         if (range[i].LengthInBytes == 0)
             continue;
 
-        LONG first = (LONG)DIFF_GET_BLOCK_NUMBER(range[i].StartingOffset);
-        LONG last = (LONG)DIFF_GET_BLOCK_NUMBER(range[i].StartingOffset +
+        LONGLONG first = (LONGLONG)DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+            range[i].StartingOffset);
+        LONGLONG last = (LONGLONG)DIFF_GET_BLOCK_NUMBER(DeviceExtension,
+            range[i].StartingOffset +
             range[i].LengthInBytes - 1);
 
         ULONGLONG length_done = 0;
 
         for (
-            LONG b = first;
+            LONGLONG b = first;
             (b <= last) && (length_done < range[i].LengthInBytes);
             b++)
         {
             LONGLONG abs_offset_this_iter =
                 range[i].StartingOffset + length_done;
             ULONG page_offset_this_iter =
-                DIFF_GET_BLOCK_OFFSET(abs_offset_this_iter);
+                DIFF_GET_BLOCK_OFFSET(DeviceExtension, abs_offset_this_iter);
             ULONGLONG bytes_this_iter =
                 range[i].LengthInBytes - length_done;
-            ULONGLONG block_size = DIFF_BLOCK_SIZE;
-            LONG block_base = DeviceExtension->AllocationTable[b];
+            ULONGLONG block_size = DIFF_BLOCK_SIZE(DeviceExtension);
+            LONG block_base = AIMWrFltrGetDiffBlock(DeviceExtension, b);
 
             if (block_base == DIFF_BLOCK_UNALLOCATED)
             {
@@ -678,10 +1376,10 @@ PUCHAR BlockBuffer)
             while ((page_offset_this_iter + bytes_this_iter) > block_size)
             {
                 // Contigous? Then merge with next iteration
-                if (DeviceExtension->AllocationTable[b + 1] ==
-                    (DeviceExtension->AllocationTable[b] + 1))
+                if (AIMWrFltrGetDiffBlock(DeviceExtension, b + 1) ==
+                    (AIMWrFltrGetDiffBlock(DeviceExtension, b) + 1))
                 {
-                    block_size += DIFF_BLOCK_SIZE;
+                    block_size += DIFF_BLOCK_SIZE(DeviceExtension);
                     ++b;
                 }
                 else
@@ -691,7 +1389,7 @@ PUCHAR BlockBuffer)
             }
 
             lower_range->Offset =
-                ((LONGLONG)block_base << DIFF_BLOCK_BITS) +
+                ((LONGLONG)block_base << DIFF_BLOCK_BITS(DeviceExtension)) +
                 page_offset_this_iter;
 
             lower_range->Length = bytes_this_iter;
@@ -734,6 +1432,8 @@ PUCHAR BlockBuffer)
     if (status == STATUS_PENDING)
         KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
 
+    AIMWrFltrFreeTrimmedBlocks(DeviceExtension, range, (ULONG)items);
+
     Irp->IoStatus.Status = io_status.Status;
 }
 
@@ -0,0 +1,515 @@
+/// bench.cpp
+/// devio-bench command line application. Measures throughput of a devio
+/// TCP/IP server by sending read or write requests the same way as the
+/// Arsenal Image Mounter driver does, using tagged requests to keep a
+/// number of requests in flight where server supports it.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "devioproto.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+struct BenchOptions
+{
+    std::string host = "127.0.0.1";
+    std::string port = "9000";
+    size_t block_size = 64 << 10;
+    unsigned queue_depth = 32;
+    unsigned connections = 1;
+    unsigned seconds = 10;
+    bool write = false;
+    bool random = false;
+
+    /// Run once for each power of two queue depth up to queue_depth
+    bool sweep = false;
+};
+
+struct BenchResult
+{
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    double total_latency = 0;
+    std::string error;
+};
+
+static void send_all(int fd, const void *buffer, size_t length)
+{
+    const char *ptr = (const char *)buffer;
+
+    while (length > 0)
+    {
+        ssize_t count = send(fd, ptr, length, MSG_NOSIGNAL);
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::system_error(errno, std::generic_category(), "send");
+        }
+
+        ptr += count;
+        length -= (size_t)count;
+    }
+}
+
+static void recv_all(int fd, void *buffer, size_t length)
+{
+    char *ptr = (char *)buffer;
+
+    while (length > 0)
+    {
+        ssize_t count = recv(fd, ptr, length, MSG_WAITALL);
+
+        if (count == 0)
+        {
+            throw std::system_error(ECONNRESET, std::generic_category(),
+                "Server closed connection");
+        }
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::system_error(errno, std::generic_category(), "recv");
+        }
+
+        ptr += count;
+        length -= (size_t)count;
+    }
+}
+
+static int connect_server(const BenchOptions &options)
+{
+    struct addrinfo hints = { };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addresses = nullptr;
+    int result = getaddrinfo(options.host.c_str(), options.port.c_str(),
+        &hints, &addresses);
+
+    if (result != 0)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            std::string("Cannot resolve server address: ") + gai_strerror(result));
+    }
+
+    int last_error = ECONNREFUSED;
+    int fd = -1;
+
+    for (struct addrinfo *address = addresses;
+        address != nullptr;
+        address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+            address->ai_protocol);
+
+        if (fd < 0)
+        {
+            last_error = errno;
+            continue;
+        }
+
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+        {
+            break;
+        }
+
+        last_error = errno;
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addresses);
+
+    if (fd < 0)
+    {
+        throw std::system_error(last_error, std::generic_category(),
+            "Cannot connect to " + options.host + " port " + options.port);
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    return fd;
+}
+
+static void run_connection(const BenchOptions &options, unsigned index,
+    BenchResult &result)
+{
+    int fd = -1;
+
+    try
+    {
+        fd = connect_server(options);
+
+        ULONGLONG request_code = IMDPROXY_REQ_INFO;
+        send_all(fd, &request_code, sizeof(request_code));
+
+        IMDPROXY_INFO_RESP info;
+        recv_all(fd, &info, sizeof(info));
+
+        if (options.write && (info.flags & IMDPROXY_FLAG_RO))
+        {
+            throw std::runtime_error("Server image is read-only");
+        }
+
+        bool tagged = (info.flags & IMDPROXY_FLAG_SUPPORTS_TAGGED) != 0;
+        unsigned queue_depth = tagged ? options.queue_depth : 1;
+
+        uint64_t block_count = info.file_size / options.block_size;
+        if (block_count == 0)
+        {
+            throw std::runtime_error("Image smaller than block size");
+        }
+
+        // Each connection starts sequential runs at a different place
+        uint64_t next_block = block_count * index / options.connections;
+        std::mt19937_64 random_blocks(index + 1);
+
+        std::vector<uint8_t> buffer(options.block_size, 0x5A);
+        std::vector<bench_clock::time_point> started(queue_depth);
+        unsigned in_flight = 0;
+
+        auto end_time = bench_clock::now() + std::chrono::seconds(options.seconds);
+        bool sending = true;
+
+        while (sending || in_flight > 0)
+        {
+            // Fill the pipeline. Tags are slot numbers, used to find start
+            // time of request when response arrives.
+            while (sending && in_flight < queue_depth)
+            {
+                if (bench_clock::now() >= end_time)
+                {
+                    sending = false;
+                    break;
+                }
+
+                uint64_t block = options.random ?
+                    random_blocks() % block_count :
+                    next_block++ % block_count;
+
+                unsigned slot = 0;
+                while (started[slot] != bench_clock::time_point())
+                {
+                    slot++;
+                }
+
+                IMDPROXY_TAGGED_READ_REQ request;
+                request.offset = block * options.block_size;
+                request.length = options.block_size;
+                request.tag = slot;
+
+                if (tagged)
+                {
+                    request.request_code = options.write ?
+                        IMDPROXY_REQ_WRITE_TAGGED : IMDPROXY_REQ_READ_TAGGED;
+                    send_all(fd, &request, sizeof(IMDPROXY_TAGGED_READ_REQ));
+                }
+                else
+                {
+                    request.request_code = options.write ?
+                        IMDPROXY_REQ_WRITE : IMDPROXY_REQ_READ;
+                    send_all(fd, &request, sizeof(IMDPROXY_READ_REQ));
+                }
+
+                if (options.write)
+                {
+                    send_all(fd, buffer.data(), buffer.size());
+                }
+
+                started[slot] = bench_clock::now();
+                in_flight++;
+            }
+
+            if (in_flight == 0)
+            {
+                break;
+            }
+
+            ULONGLONG tag = 0;
+            ULONGLONG errorno;
+            ULONGLONG length;
+
+            if (tagged)
+            {
+                IMDPROXY_TAGGED_RESP response;
+                recv_all(fd, &response, sizeof(response));
+                tag = response.tag;
+                errorno = response.errorno;
+                length = response.length;
+            }
+            else
+            {
+                IMDPROXY_READ_RESP response;
+                recv_all(fd, &response, sizeof(response));
+                errorno = response.errorno;
+                length = response.length;
+            }
+
+            if (errorno != 0)
+            {
+                throw std::system_error((int)errorno, std::generic_category(),
+                    "Server returned error");
+            }
+
+            if (tag >= queue_depth ||
+                started[tag] == bench_clock::time_point() ||
+                length > options.block_size)
+            {
+                throw std::runtime_error("Invalid response from server");
+            }
+
+            if (!options.write)
+            {
+                recv_all(fd, buffer.data(), (size_t)length);
+            }
+
+            result.total_latency += std::chrono::duration<double>(
+                bench_clock::now() - started[tag]).count();
+            started[tag] = bench_clock::time_point();
+            in_flight--;
+
+            result.requests++;
+            result.bytes += length;
+        }
+
+        request_code = IMDPROXY_REQ_CLOSE;
+        send_all(fd, &request_code, sizeof(request_code));
+    }
+    catch (const std::exception &ex)
+    {
+        result.error = ex.what();
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/// Runs one test with all connections. Returns false if any of them
+/// failed.
+static bool run_test(const BenchOptions &options, BenchResult &total,
+    double &elapsed)
+{
+    std::vector<BenchResult> results(options.connections);
+    std::vector<std::thread> threads;
+
+    auto start_time = bench_clock::now();
+
+    for (unsigned i = 0; i < options.connections; i++)
+    {
+        threads.emplace_back(run_connection, std::cref(options), i,
+            std::ref(results[i]));
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    elapsed = std::chrono::duration<double>(
+        bench_clock::now() - start_time).count();
+
+    total = BenchResult();
+
+    for (const BenchResult &result : results)
+    {
+        if (!result.error.empty())
+        {
+            fprintf(stderr, "%s\n", result.error.c_str());
+            return false;
+        }
+
+        total.requests += result.requests;
+        total.bytes += result.bytes;
+        total.total_latency += result.total_latency;
+    }
+
+    return true;
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "devio-bench [options] [server [port]]\n"
+        "\n"
+        "Measures throughput of a devio TCP/IP server, default 127.0.0.1\n"
+        "port 9000.\n"
+        "\n"
+        "-b, --block-size bytes   Request size, default 65536.\n"
+        "-q, --queue-depth count  Requests in flight per connection, default\n"
+        "                         32. Only used if server supports tagged\n"
+        "                         requests.\n"
+        "-c, --connections count  Number of parallel connections, default 1.\n"
+        "-t, --time seconds       Duration of test, default 10.\n"
+        "-w, --write              Write test. Overwrites image contents!\n"
+        "-R, --random             Random offsets instead of sequential.\n"
+        "-s, --sweep              Run test at queue depths 1, 2, 4 and so on up\n"
+        "                         to value of -q, and print one line for each.\n"
+        "                         Useful for comparing server I/O engines,\n"
+        "                         for example with -q 128.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "block-size", required_argument, nullptr, 'b' },
+        { "queue-depth", required_argument, nullptr, 'q' },
+        { "connections", required_argument, nullptr, 'c' },
+        { "time", required_argument, nullptr, 't' },
+        { "write", no_argument, nullptr, 'w' },
+        { "random", no_argument, nullptr, 'R' },
+        { "sweep", no_argument, nullptr, 's' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    BenchOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:q:c:t:wRsh", long_options,
+        nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            options.block_size = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'q':
+            options.queue_depth = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'c':
+            options.connections = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 't':
+            options.seconds = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'w':
+            options.write = true;
+            break;
+
+        case 'R':
+            options.random = true;
+            break;
+
+        case 's':
+            options.sweep = true;
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind < argc)
+    {
+        options.host = argv[optind++];
+    }
+
+    if (optind < argc)
+    {
+        options.port = argv[optind++];
+    }
+
+    if (options.block_size == 0 || options.queue_depth == 0 ||
+        options.connections == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    BenchResult total;
+    double elapsed;
+
+    if (!options.sweep)
+    {
+        if (!run_test(options, total, elapsed))
+        {
+            return 1;
+        }
+
+        printf("%s %s, %zu byte blocks, queue depth %u, %u connection(s):\n"
+            "%.1f MB/s, %.0f requests/s, average latency %.3f ms\n",
+            options.random ? "Random" : "Sequential",
+            options.write ? "write" : "read",
+            options.block_size, options.queue_depth, options.connections,
+            total.bytes / elapsed / 1e6,
+            total.requests / elapsed,
+            total.requests > 0 ? total.total_latency / total.requests * 1e3 : 0.0);
+
+        return 0;
+    }
+
+    printf("%s %s, %zu byte blocks, %u connection(s)\n"
+        "%11s %12s %12s %12s\n",
+        options.random ? "Random" : "Sequential",
+        options.write ? "write" : "read",
+        options.block_size, options.connections,
+        "Queue depth", "MB/s", "Requests/s", "Latency ms");
+
+    BenchOptions step = options;
+
+    for (step.queue_depth = 1;
+        step.queue_depth <= options.queue_depth;
+        step.queue_depth <<= 1)
+    {
+        if (!run_test(step, total, elapsed))
+        {
+            return 1;
+        }
+
+        printf("%11u %12.1f %12.0f %12.3f\n",
+            step.queue_depth,
+            total.bytes / elapsed / 1e6,
+            total.requests / elapsed,
+            total.requests > 0 ? total.total_latency / total.requests * 1e3 : 0.0);
+
+        fflush(stdout);
+    }
+
+    return 0;
+}
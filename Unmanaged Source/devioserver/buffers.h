@@ -0,0 +1,277 @@
+/// buffers.h
+/// Page aligned I/O buffers and a pool that keeps released buffers for
+/// reuse, so that large requests do not cause a new allocation and page
+/// faults for each request.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_BUFFERS_H_
+#define _DEVIOSERVER_BUFFERS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace devio
+{
+
+/// Alignment of all I/O buffers. Enough for O_DIRECT on all common devices.
+constexpr size_t IO_BUFFER_ALIGNMENT = 4096;
+
+/// Smallest buffer size handed out by BufferPool
+constexpr size_t IO_BUFFER_MIN_SIZE = 64 << 10;
+
+class BufferPool;
+
+/// Owner of an aligned buffer. Returns buffer to its pool when destroyed.
+class IoBuffer
+{
+public:
+
+    IoBuffer() = default;
+
+    IoBuffer(IoBuffer &&other) noexcept
+        : pool(other.pool), ptr(other.ptr), buffer_capacity(other.buffer_capacity),
+        arena_index(other.arena_index)
+    {
+        other.ptr = nullptr;
+        other.buffer_capacity = 0;
+        other.arena_index = -1;
+    }
+
+    IoBuffer &operator=(IoBuffer &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            pool = other.pool;
+            ptr = other.ptr;
+            buffer_capacity = other.buffer_capacity;
+            arena_index = other.arena_index;
+            other.ptr = nullptr;
+            other.buffer_capacity = 0;
+            other.arena_index = -1;
+        }
+
+        return *this;
+    }
+
+    IoBuffer(const IoBuffer &) = delete;
+    IoBuffer &operator=(const IoBuffer &) = delete;
+
+    ~IoBuffer()
+    {
+        release();
+    }
+
+    uint8_t *data() const
+    {
+        return ptr;
+    }
+
+    size_t capacity() const
+    {
+        return buffer_capacity;
+    }
+
+    /// Index of buffer within pool arena, as registered with io_uring, or
+    /// -1 for buffers outside of arena
+    int index() const
+    {
+        return arena_index;
+    }
+
+    inline void release();
+
+private:
+
+    friend class BufferPool;
+
+    IoBuffer(BufferPool *owner, uint8_t *buffer, size_t size, int index = -1)
+        : pool(owner), ptr(buffer), buffer_capacity(size), arena_index(index)
+    {
+    }
+
+    BufferPool *pool = nullptr;
+    uint8_t *ptr = nullptr;
+    size_t buffer_capacity = 0;
+    int arena_index = -1;
+};
+
+/// Thread safe pool of aligned buffers in power of two size classes.
+/// Optionally also holds an arena of equally sized buffers in one
+/// allocation, which are handed out first for requests that fit. The arena
+/// is meant to be registered once with the kernel, for example as fixed
+/// buffers for io_uring.
+class BufferPool
+{
+public:
+
+    /// max_cached is number of free buffers kept for each size class
+    explicit BufferPool(size_t max_cached = 64)
+        : max_cached_per_class(max_cached)
+    {
+    }
+
+    ~BufferPool()
+    {
+        for (std::vector<uint8_t *> &list : free_lists)
+        {
+            for (uint8_t *buffer : list)
+            {
+                free(buffer);
+            }
+        }
+
+        free(arena);
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    /// Allocates an arena of count buffers of size bytes each. Can only be
+    /// called once, before any buffers are handed out. Throws
+    /// std::bad_alloc.
+    void create_arena(size_t count, size_t size)
+    {
+        size = (size + IO_BUFFER_ALIGNMENT - 1) & ~(IO_BUFFER_ALIGNMENT - 1);
+
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, IO_BUFFER_ALIGNMENT, count * size) != 0)
+        {
+            throw std::bad_alloc();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        arena = (uint8_t *)buffer;
+        arena_buffer_size = size;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            arena_iovecs.push_back(iovec{ arena + i * size, size });
+            free_arena.push_back((int)(count - 1 - i));
+        }
+    }
+
+    /// Arena buffers, in index order
+    const std::vector<struct iovec> &arena_buffers() const
+    {
+        return arena_iovecs;
+    }
+
+    /// Returns a buffer of at least size bytes. Throws std::bad_alloc.
+    IoBuffer get(size_t size)
+    {
+        size_t size_class = 0;
+        size_t class_size = IO_BUFFER_MIN_SIZE;
+
+        while (class_size < size)
+        {
+            class_size <<= 1;
+            size_class++;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (size <= arena_buffer_size && !free_arena.empty())
+            {
+                int index = free_arena.back();
+                free_arena.pop_back();
+                return IoBuffer(this, arena + (size_t)index * arena_buffer_size,
+                    arena_buffer_size, index);
+            }
+
+            if (size_class < free_lists.size() &&
+                !free_lists[size_class].empty())
+            {
+                uint8_t *buffer = free_lists[size_class].back();
+                free_lists[size_class].pop_back();
+                return IoBuffer(this, buffer, class_size);
+            }
+        }
+
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, IO_BUFFER_ALIGNMENT, class_size) != 0)
+        {
+            throw std::bad_alloc();
+        }
+
+        return IoBuffer(this, (uint8_t *)buffer, class_size);
+    }
+
+private:
+
+    friend class IoBuffer;
+
+    void put(uint8_t *buffer, size_t size, int index)
+    {
+        if (index >= 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_arena.push_back(index);
+            return;
+        }
+
+        size_t size_class = 0;
+
+        for (size_t class_size = IO_BUFFER_MIN_SIZE; class_size < size;
+            class_size <<= 1)
+        {
+            size_class++;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (free_lists.size() <= size_class)
+            {
+                free_lists.resize(size_class + 1);
+            }
+
+            if (free_lists[size_class].size() < max_cached_per_class)
+            {
+                free_lists[size_class].push_back(buffer);
+                return;
+            }
+        }
+
+        free(buffer);
+    }
+
+    std::mutex mutex;
+    std::vector<std::vector<uint8_t *>> free_lists;
+    size_t max_cached_per_class;
+
+    uint8_t *arena = nullptr;
+    size_t arena_buffer_size = 0;
+    std::vector<struct iovec> arena_iovecs;
+    std::vector<int> free_arena;
+};
+
+inline void IoBuffer::release()
+{
+    if (ptr != nullptr)
+    {
+        pool->put(ptr, buffer_capacity, arena_index);
+        ptr = nullptr;
+        buffer_capacity = 0;
+        arena_index = -1;
+    }
+}
+
+}
+
+#endif // _DEVIOSERVER_BUFFERS_H_
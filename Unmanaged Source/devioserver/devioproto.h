@@ -0,0 +1,129 @@
+/// devioproto.h
+/// Definitions of the ImDisk/devio proxy protocol for portable devio server
+/// and client implementations. Same wire format as imdproxy.h, with Arsenal
+/// Image Mounter extensions included from aimproxy.h.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOPROTO_H_
+#define _DEVIOPROTO_H_
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <imdproxy.h>
+
+#else
+
+#include <stdint.h>
+#include <stddef.h>
+
+///
+/// Basic Windows types used by imdproxy.h and aimproxy.h
+///
+
+typedef uint64_t ULONGLONG;
+typedef int64_t LONGLONG;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef size_t SIZE_T;
+
+///
+/// Request codes, flags and structures from imdproxy.h
+///
+
+#define IMDPROXY_HEADER_SIZE                4096
+
+#define IMDPROXY_REQ_NULL                   0x0000ULL
+#define IMDPROXY_REQ_INFO                   0x0001ULL
+#define IMDPROXY_REQ_READ                   0x0002ULL
+#define IMDPROXY_REQ_WRITE                  0x0003ULL
+#define IMDPROXY_REQ_CONNECT                0x0004ULL
+#define IMDPROXY_REQ_CLOSE                  0x0005ULL
+#define IMDPROXY_REQ_UNMAP                  0x0006ULL
+#define IMDPROXY_REQ_ZERO                   0x0007ULL
+#define IMDPROXY_REQ_SCSI                   0x0008ULL
+#define IMDPROXY_REQ_SHARED                 0x0009ULL
+
+#define IMDPROXY_FLAG_RO                    0x0001ULL
+#define IMDPROXY_FLAG_SUPPORTS_UNMAP        0x0002ULL
+#define IMDPROXY_FLAG_SUPPORTS_ZERO         0x0004ULL
+#define IMDPROXY_FLAG_SUPPORTS_SCSI         0x0008ULL
+#define IMDPROXY_FLAG_SUPPORTS_SHARED       0x0010ULL
+
+typedef struct _IMDPROXY_INFO_RESP
+{
+    ULONGLONG file_size;
+    ULONGLONG req_alignment;
+    ULONGLONG flags;
+} IMDPROXY_INFO_RESP, *PIMDPROXY_INFO_RESP;
+
+typedef struct _IMDPROXY_READ_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG offset;
+    ULONGLONG length;
+} IMDPROXY_READ_REQ, *PIMDPROXY_READ_REQ;
+
+typedef struct _IMDPROXY_READ_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG length;
+} IMDPROXY_READ_RESP, *PIMDPROXY_READ_RESP;
+
+typedef struct _IMDPROXY_WRITE_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG offset;
+    ULONGLONG length;
+} IMDPROXY_WRITE_REQ, *PIMDPROXY_WRITE_REQ;
+
+typedef struct _IMDPROXY_WRITE_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG length;
+} IMDPROXY_WRITE_RESP, *PIMDPROXY_WRITE_RESP;
+
+typedef struct _IMDPROXY_UNMAP_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG length;           // Size of DEVICE_DATA_SET_RANGE array
+} IMDPROXY_UNMAP_REQ, *PIMDPROXY_UNMAP_REQ;
+
+typedef struct _IMDPROXY_UNMAP_RESP
+{
+    ULONGLONG errorno;
+} IMDPROXY_UNMAP_RESP, *PIMDPROXY_UNMAP_RESP;
+
+typedef struct _IMDPROXY_ZERO_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG length;           // Size of DEVICE_DATA_SET_RANGE array
+} IMDPROXY_ZERO_REQ, *PIMDPROXY_ZERO_REQ;
+
+typedef struct _IMDPROXY_ZERO_RESP
+{
+    ULONGLONG errorno;
+} IMDPROXY_ZERO_RESP, *PIMDPROXY_ZERO_RESP;
+
+/// Range structure that follows unmap and zero requests, same layout as in
+/// ntddstor.h
+typedef struct _DEVICE_DATA_SET_RANGE
+{
+    LONGLONG StartingOffset;
+    ULONGLONG LengthInBytes;
+} DEVICE_DATA_SET_RANGE, *PDEVICE_DATA_SET_RANGE;
+
+#endif
+
+#include "../phdskmnt/inc/aimproxy.h"
+
+#endif // _DEVIOPROTO_H_
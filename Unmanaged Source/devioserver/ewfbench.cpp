@@ -0,0 +1,651 @@
+/// ewfbench.cpp
+/// devio-ewfbench command line application. Writes a synthetic EnCase (E01)
+/// image set with a mix of zero, compressible and incompressible chunks and
+/// measures throughput of the native E01 backend of devio server, for
+/// sequential hashing of the whole image and for random 4 KB reads, with
+/// and without worker pool inflation, read-ahead and chunk cache.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "ewfimage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+struct BenchOptions
+{
+    std::string directory = "/tmp";
+    uint64_t image_size = 1ULL << 30;
+    uint32_t sectors_per_chunk = 64;
+    uint64_t segment_size = 256ULL << 20;
+    int compression_level = 1;
+    size_t cache_size = 256 << 20;
+    unsigned inflate_threads = 0;
+    unsigned readahead_chunks = 64;
+    unsigned reader_threads = 8;
+    unsigned seconds = 5;
+    bool keep = false;
+};
+
+static const uint32_t bytes_per_sector = 512;
+
+// Largest number of chunks in one table section, as written by EnCase
+static const uint32_t max_table_entries = 16375;
+
+static inline void put_le32(uint8_t *ptr, uint32_t value)
+{
+    ptr[0] = (uint8_t)value;
+    ptr[1] = (uint8_t)(value >> 8);
+    ptr[2] = (uint8_t)(value >> 16);
+    ptr[3] = (uint8_t)(value >> 24);
+}
+
+static inline void put_le64(uint8_t *ptr, uint64_t value)
+{
+    put_le32(ptr, (uint32_t)value);
+    put_le32(ptr + 4, (uint32_t)(value >> 32));
+}
+
+static inline uint64_t mix64(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+/// Fills a chunk with synthetic media data. One in four chunks is zeros,
+/// one in four is random and the rest is text-like data that compresses
+/// to about a third, roughly like a used file system.
+static void fill_chunk(uint64_t index, uint8_t *buffer, size_t length)
+{
+    static const char *const words[] =
+    {
+        "the ", "image ", "mounter ", "sector ", "evidence ", "file ",
+        "system ", "registry ", "volume ", "of ", "and ", "data ", "\r\n",
+        "<html>", "0x7fff ", "NTFS ", "MFT ", "record ", "user ", "a "
+    };
+
+    uint64_t state = mix64(index + 1);
+
+    switch (state & 3)
+    {
+    case 0:
+        memset(buffer, 0, length);
+        return;
+
+    case 1:
+        for (size_t i = 0; i < length; i += 8)
+        {
+            uint64_t value = mix64(state + i);
+            memcpy(buffer + i, &value, std::min<size_t>(8, length - i));
+        }
+        return;
+
+    default:
+        for (size_t i = 0; i < length;)
+        {
+            state = mix64(state);
+            const char *word = words[state % (sizeof(words) / sizeof(*words))];
+            size_t count = std::min(strlen(word), length - i);
+
+            memcpy(buffer + i, word, count);
+            i += count;
+        }
+        return;
+    }
+}
+
+/// Hash of media data, computed over 64 bit words in order so that it does
+/// not depend on how data is split into reads
+class MediaHash
+{
+public:
+
+    void update(const uint8_t *data, size_t length)
+    {
+        for (size_t i = 0; i + 8 <= length; i += 8)
+        {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            hash = (hash ^ word) * 0x100000001b3ULL;
+            hash ^= hash >> 29;
+        }
+    }
+
+    uint64_t value() const
+    {
+        return hash;
+    }
+
+private:
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+};
+
+static void write_fully(int fd, const void *buffer, size_t length,
+    uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t result = pwrite(fd, buffer, length, (off_t)offset);
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::system_error(errno, std::generic_category(), "pwrite");
+        }
+
+        buffer = (const uint8_t *)buffer + result;
+        length -= (size_t)result;
+        offset += (uint64_t)result;
+    }
+}
+
+/// Writes a section descriptor and returns offset of next section
+static uint64_t write_section(int fd, const char *type, uint64_t offset,
+    uint64_t size, bool last)
+{
+    uint8_t descriptor[76] = { };
+
+    strncpy((char *)descriptor, type, 16);
+    put_le64(descriptor + 16, last ? offset : offset + size);
+    put_le64(descriptor + 24, size);
+    put_le32(descriptor + 72, (uint32_t)adler32(1, descriptor, 72));
+
+    write_fully(fd, descriptor, sizeof(descriptor), offset);
+
+    return offset + size;
+}
+
+static uint64_t write_section_data(int fd, const char *type, uint64_t offset,
+    const std::vector<uint8_t> &data)
+{
+    write_fully(fd, data.data(), data.size(), offset + 76);
+
+    return write_section(fd, type, offset, 76 + data.size(), false);
+}
+
+/// Writes image as E01 segment files named base.E01, base.E02 and so on.
+/// Returns paths of segment files and hash of media data.
+static std::vector<std::string> write_image(const BenchOptions &options,
+    const std::string &base, uint64_t &hash_value, uint64_t &stored_bytes)
+{
+    uint32_t chunk_size = options.sectors_per_chunk * bytes_per_sector;
+    uint64_t sector_count = options.image_size / bytes_per_sector;
+    uint64_t media_size = sector_count * bytes_per_sector;
+    uint64_t chunk_count = (media_size + chunk_size - 1) / chunk_size;
+
+    std::vector<uint8_t> volume(1052);
+    volume[0] = 1;
+    put_le32(volume.data() + 4, (uint32_t)chunk_count);
+    put_le32(volume.data() + 8, options.sectors_per_chunk);
+    put_le32(volume.data() + 12, bytes_per_sector);
+    put_le64(volume.data() + 16, sector_count);
+    put_le32(volume.data() + 1048, (uint32_t)adler32(1, volume.data(), 1048));
+
+    static const char header_text[] =
+        "1\r\nmain\r\nc\tn\ta\te\tt\tav\tov\tm\tu\tp\r\n"
+        "1\tdevio-ewfbench\tSynthetic image\tdevio\t\tbench\tLinux\t\t\t0\r\n"
+        "\r\n";
+
+    std::vector<uint8_t> header(compressBound(sizeof(header_text)));
+    uLongf header_length = (uLongf)header.size();
+    compress2(header.data(), &header_length, (const Bytef *)header_text,
+        sizeof(header_text) - 1, Z_BEST_COMPRESSION);
+    header.resize(header_length);
+
+    // Uncompressed chunks are stored with an Adler-32 checksum after data
+    std::vector<uint8_t> chunk(chunk_size + 4);
+    std::vector<uint8_t> compressed(compressBound(chunk_size));
+    std::vector<std::string> paths;
+    MediaHash hash;
+    uint64_t index = 0;
+
+    stored_bytes = 0;
+
+    while (index < chunk_count)
+    {
+        char extension[8];
+        snprintf(extension, sizeof(extension), ".E%02zu", paths.size() + 1);
+
+        if (paths.size() >= 99)
+        {
+            throw std::runtime_error("Too many segment files, use larger "
+                "segment size");
+        }
+
+        std::string path = base + extension;
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot create " + path);
+        }
+
+        paths.push_back(path);
+
+        uint8_t file_header[13] = { 'E', 'V', 'F', 0x09, 0x0d, 0x0a, 0xff, 0x00,
+            0x01 };
+        put_le32(file_header + 9, (uint32_t)paths.size());
+        write_fully(fd, file_header, sizeof(file_header), 0);
+
+        uint64_t offset = sizeof(file_header);
+
+        if (paths.size() == 1)
+        {
+            offset = write_section_data(fd, "header", offset, header);
+            offset = write_section_data(fd, "volume", offset, volume);
+        }
+        else
+        {
+            offset = write_section_data(fd, "data", offset, volume);
+        }
+
+        uint64_t sectors_offset = offset;
+        uint64_t base_offset = sectors_offset;
+        offset += 76;
+
+        std::vector<uint8_t> table(24);
+
+        while (index < chunk_count &&
+            table.size() - 24 < max_table_entries * 4 &&
+            offset < options.segment_size)
+        {
+            size_t length = (size_t)std::min<uint64_t>(chunk_size,
+                media_size - index * chunk_size);
+
+            fill_chunk(index, chunk.data(), length);
+            hash.update(chunk.data(), length);
+
+            uLongf compressed_length = (uLongf)compressed.size();
+            uint32_t entry = (uint32_t)(offset - base_offset);
+
+            if (compress2(compressed.data(), &compressed_length, chunk.data(),
+                (uLong)length, options.compression_level) == Z_OK &&
+                compressed_length < length)
+            {
+                write_fully(fd, compressed.data(), compressed_length, offset);
+                offset += compressed_length;
+                entry |= 0x80000000;
+            }
+            else
+            {
+                put_le32(chunk.data() + length,
+                    (uint32_t)adler32(1, chunk.data(), (uInt)length));
+                write_fully(fd, chunk.data(), length + 4, offset);
+                offset += length + 4;
+            }
+
+            table.resize(table.size() + 4);
+            put_le32(table.data() + table.size() - 4, entry);
+
+            index++;
+        }
+
+        stored_bytes += offset - sectors_offset - 76;
+
+        write_section(fd, "sectors", sectors_offset, offset - sectors_offset,
+            false);
+
+        uint32_t entry_count = (uint32_t)((table.size() - 24) / 4);
+        put_le32(table.data(), entry_count);
+        put_le64(table.data() + 8, base_offset);
+        put_le32(table.data() + 20, (uint32_t)adler32(1, table.data(), 20));
+
+        table.resize(table.size() + 4);
+        put_le32(table.data() + table.size() - 4,
+            (uint32_t)adler32(1, table.data() + 24, entry_count * 4));
+
+        offset = write_section_data(fd, "table", offset, table);
+        offset = write_section_data(fd, "table2", offset, table);
+
+        write_section(fd, index < chunk_count ? "next" : "done", offset, 76,
+            true);
+
+        close(fd);
+    }
+
+    hash_value = hash.value();
+
+    return paths;
+}
+
+/// Reads whole image in 1 MB requests from one thread and hashes it, like
+/// an imaging or verification tool does. Returns MB/s.
+static double run_hash_test(const devio::EwfImage &image, uint64_t &hash_value)
+{
+    std::vector<uint8_t> buffer(1 << 20);
+    MediaHash hash;
+
+    auto start = bench_clock::now();
+
+    for (uint64_t offset = 0; offset < image.size(); offset += buffer.size())
+    {
+        ssize_t result = image.read(buffer.data(), buffer.size(), offset);
+
+        if (result <= 0)
+        {
+            throw std::system_error(result < 0 ? (int)-result : EIO,
+                std::generic_category(), "Read failed");
+        }
+
+        hash.update(buffer.data(), (size_t)result);
+    }
+
+    double elapsed = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+
+    hash_value = hash.value();
+
+    return image.size() / elapsed / 1e6;
+}
+
+/// Random 4 KB reads from several threads, like worker threads of server
+/// serving random requests from clients. Returns MB/s.
+static double run_random_test(const devio::EwfImage &image,
+    const BenchOptions &options, double &iops)
+{
+    std::atomic<uint64_t> total_reads{ 0 };
+    std::atomic<bool> failed{ false };
+    std::vector<std::thread> threads;
+
+    auto start = bench_clock::now();
+    auto end = start + std::chrono::seconds(options.seconds);
+
+    for (unsigned t = 0; t < options.reader_threads; t++)
+    {
+        threads.emplace_back([&, t]
+        {
+            std::mt19937_64 random(t + 1);
+            std::uniform_int_distribution<uint64_t> block(0,
+                image.size() / 4096 - 1);
+            uint8_t buffer[4096];
+            uint64_t reads = 0;
+
+            while ((reads & 63) != 0 || bench_clock::now() < end)
+            {
+                if (image.read(buffer, sizeof(buffer),
+                    block(random) * 4096) != sizeof(buffer))
+                {
+                    failed = true;
+                    break;
+                }
+
+                reads++;
+            }
+
+            total_reads += reads;
+        });
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    if (failed)
+    {
+        throw std::runtime_error("Random read failed");
+    }
+
+    double elapsed = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+
+    iops = total_reads / elapsed;
+
+    return total_reads * 4096.0 / elapsed / 1e6;
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "devio-ewfbench [options]\n"
+        "\n"
+        "Writes a synthetic E01 image set and measures sequential hashing and\n"
+        "random 4 KB read throughput of the native E01 backend, first with\n"
+        "one inflate thread and no cache like a per-request decoder, then\n"
+        "with worker pool, read-ahead and chunk cache.\n"
+        "\n"
+        "-d, --directory path     Where to write image, default /tmp.\n"
+        "-s, --size MB            Media size, default 1024.\n"
+        "-b, --chunk-sectors n    Sectors per chunk, default 64.\n"
+        "-S, --segment-size MB    Segment file size, default 256.\n"
+        "-z, --level n            zlib compression level, default 1.\n"
+        "-c, --cache-size MB      Chunk cache size, default 256.\n"
+        "-i, --inflate-threads n  Inflate threads, default one per CPU.\n"
+        "-a, --readahead chunks   Read-ahead window, default 64.\n"
+        "-r, --readers n          Threads doing random reads, default 8.\n"
+        "-t, --time seconds       Duration of random read tests, default 5.\n"
+        "-k, --keep               Keep image files.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "directory", required_argument, nullptr, 'd' },
+        { "size", required_argument, nullptr, 's' },
+        { "chunk-sectors", required_argument, nullptr, 'b' },
+        { "segment-size", required_argument, nullptr, 'S' },
+        { "level", required_argument, nullptr, 'z' },
+        { "cache-size", required_argument, nullptr, 'c' },
+        { "inflate-threads", required_argument, nullptr, 'i' },
+        { "readahead", required_argument, nullptr, 'a' },
+        { "readers", required_argument, nullptr, 'r' },
+        { "time", required_argument, nullptr, 't' },
+        { "keep", no_argument, nullptr, 'k' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    BenchOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:s:b:S:z:c:i:a:r:t:kh",
+        long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            options.directory = optarg;
+            break;
+
+        case 's':
+            options.image_size = strtoull(optarg, nullptr, 0) << 20;
+            break;
+
+        case 'b':
+            options.sectors_per_chunk = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'S':
+            options.segment_size = strtoull(optarg, nullptr, 0) << 20;
+            break;
+
+        case 'z':
+            options.compression_level = (int)strtol(optarg, nullptr, 0);
+            break;
+
+        case 'c':
+            options.cache_size = (size_t)strtoull(optarg, nullptr, 0) << 20;
+            break;
+
+        case 'i':
+            options.inflate_threads = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'a':
+            options.readahead_chunks = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'r':
+            options.reader_threads = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 't':
+            options.seconds = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'k':
+            options.keep = true;
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (options.image_size < (1 << 20) || options.sectors_per_chunk == 0 ||
+        options.sectors_per_chunk * bytes_per_sector > (1 << 20) ||
+        options.segment_size < (1 << 20) ||
+        options.segment_size > (1ULL << 31) ||
+        options.reader_threads == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<std::string> paths;
+
+    try
+    {
+        std::string base = options.directory + "/devio-ewfbench-" +
+            std::to_string(getpid());
+        uint64_t expected_hash;
+        uint64_t stored_bytes;
+
+        paths = write_image(options, base, expected_hash, stored_bytes);
+
+        printf("Synthetic E01 image, %llu MB media in %zu segment(s), "
+            "%u byte chunks, %.1f MB stored\n",
+            (unsigned long long)(options.image_size >> 20), paths.size(),
+            options.sectors_per_chunk * bytes_per_sector, stored_bytes / 1e6);
+
+        // Before: one inflate thread, no cache and no read-ahead, close to
+        // how a per-request decoder behaves. After: default backend.
+        devio::EwfOptions serial;
+        serial.cache_size = 0;
+        serial.inflate_threads = 1;
+        serial.readahead_chunks = 0;
+
+        devio::EwfOptions pooled;
+        pooled.cache_size = options.cache_size;
+        pooled.inflate_threads = options.inflate_threads;
+        pooled.readahead_chunks = options.readahead_chunks;
+
+        struct
+        {
+            const char *name;
+            devio::EwfOptions ewf_options;
+        } const configs[] =
+        {
+            { "No cache", serial },
+            { "Pool and cache", pooled }
+        };
+
+        printf("%-18s %14s %14s %14s %10s\n", "Backend", "Hash MB/s",
+            "Random MB/s", "Random IOPS", "Hit rate");
+
+        bool mismatch = false;
+
+        for (const auto &config : configs)
+        {
+            uint64_t hash_value;
+            double hash_rate;
+            double random_rate;
+            double iops;
+            devio::EwfImage::Statistics stats;
+
+            {
+                devio::EwfImage image(paths, config.ewf_options);
+                hash_rate = run_hash_test(image, hash_value);
+            }
+
+            {
+                // Fresh image, so that random reads start with empty cache
+                devio::EwfImage image(paths, config.ewf_options);
+                random_rate = run_random_test(image, options, iops);
+                stats = image.statistics();
+            }
+
+            uint64_t lookups = stats.cache_hits + stats.cache_misses;
+
+            printf("%-18s %14.1f %14.1f %14.0f %9.1f%%%s\n", config.name,
+                hash_rate, random_rate, iops,
+                lookups > 0 ? 100.0 * stats.cache_hits / lookups : 0.0,
+                hash_value == expected_hash ? "" : "  HASH MISMATCH");
+
+            fflush(stdout);
+
+            if (hash_value != expected_hash)
+            {
+                mismatch = true;
+            }
+        }
+
+        if (!options.keep)
+        {
+            for (const std::string &path : paths)
+            {
+                unlink(path.c_str());
+            }
+        }
+        else
+        {
+            printf("Image kept as %s\n", paths[0].c_str());
+        }
+
+        return mismatch ? 1 : 0;
+    }
+    catch (const std::exception &ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+
+        if (!options.keep)
+        {
+            for (const std::string &path : paths)
+            {
+                unlink(path.c_str());
+            }
+        }
+
+        return 1;
+    }
+}
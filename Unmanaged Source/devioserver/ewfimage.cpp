@@ -0,0 +1,856 @@
+/// ewfimage.cpp
+/// Storage backend for devio server that serves EnCase (E01) images.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "ewfimage.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <system_error>
+#include <thread>
+
+namespace devio
+{
+
+// Segment file layout, all values little endian. A 13 byte file header is
+// followed by a chain of sections, each starting with a 76 byte section
+// descriptor that holds section type, absolute offset of next section,
+// size of section including descriptor and an Adler-32 checksum of the
+// first 72 bytes of descriptor.
+
+static const uint8_t ewf_signature[8] =
+{
+    'E', 'V', 'F', 0x09, 0x0d, 0x0a, 0xff, 0x00
+};
+
+static const uint8_t ewf2_signature[8] =
+{
+    'E', 'V', 'F', '2', 0x0d, 0x0a, 0x81, 0x00
+};
+
+static const size_t ewf_file_header_size = 13;
+static const size_t ewf_section_size = 76;
+
+// Table section data starts with entry count, base offset and a checksum
+// of these, followed by one 32 bit entry per chunk. Bit 31 of an entry is
+// set for compressed chunks, other bits are offset from base offset.
+static const size_t ewf_table_header_size = 24;
+static const uint32_t ewf_chunk_compressed = 0x80000000;
+
+// Volume sections written by EnCase are 1052 bytes, those written by
+// SMART are 94 bytes and have a 32 bit sector count.
+static const size_t ewf_volume_size = 1052;
+static const size_t ewf_volume_smart_size = 94;
+
+static inline uint32_t get_le32(const uint8_t *ptr)
+{
+    return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) |
+        ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static inline uint64_t get_le64(const uint8_t *ptr)
+{
+    return (uint64_t)get_le32(ptr) | ((uint64_t)get_le32(ptr + 4) << 32);
+}
+
+static int read_fully(int fd, void *buffer, size_t length, uint64_t offset)
+{
+    size_t done = 0;
+
+    while (done < length)
+    {
+        ssize_t result = pread(fd, (char *)buffer + done, length - done,
+            (off_t)(offset + done));
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -errno;
+        }
+
+        if (result == 0)
+        {
+            return -EIO;
+        }
+
+        done += (size_t)result;
+    }
+
+    return 0;
+}
+
+/// Inflate stream kept by each thread, so that zlib state is allocated once
+/// per thread instead of once per chunk
+class ThreadInflater
+{
+public:
+
+    ThreadInflater()
+    {
+        if (inflateInit(&stream) == Z_OK)
+        {
+            initialized = true;
+        }
+    }
+
+    ~ThreadInflater()
+    {
+        if (initialized)
+        {
+            inflateEnd(&stream);
+        }
+    }
+
+    /// Decompresses a complete zlib stream that is expected to expand to
+    /// exactly output_length bytes. Returns zero or -errno.
+    int inflate_exact(const uint8_t *input, size_t input_length,
+        uint8_t *output, size_t output_length)
+    {
+        if (!initialized || inflateReset(&stream) != Z_OK)
+        {
+            return -ENOMEM;
+        }
+
+        stream.next_in = (Bytef *)input;
+        stream.avail_in = (uInt)input_length;
+        stream.next_out = output;
+        stream.avail_out = (uInt)output_length;
+
+        int result = inflate(&stream, Z_FINISH);
+
+        if (result != Z_STREAM_END || stream.avail_out != 0)
+        {
+            return -EIO;
+        }
+
+        return 0;
+    }
+
+    std::vector<uint8_t> stored;
+
+private:
+
+    z_stream stream = { };
+    bool initialized = false;
+};
+
+EwfImage::EwfImage(const std::vector<std::string> &paths,
+    const EwfOptions &options)
+    : options(options)
+{
+    try
+    {
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            int fd = open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+
+            if (fd < 0)
+            {
+                throw std::system_error(errno, std::generic_category(),
+                    "Cannot open " + paths[i]);
+            }
+
+            segments.push_back(fd);
+
+            parse_segment(i, paths[i]);
+        }
+    }
+    catch (...)
+    {
+        for (int fd : segments)
+        {
+            close(fd);
+        }
+
+        throw;
+    }
+
+    try
+    {
+        if (segments.empty())
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                "No image files");
+        }
+
+        if (bytes_per_chunk == 0)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                "No volume section in " + paths[0]);
+        }
+
+        if (chunks.size() < volume_chunk_count ||
+            (uint64_t)chunks.size() * bytes_per_chunk < media_size)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                "Image is incomplete, " + std::to_string(chunks.size()) +
+                " of " + std::to_string(volume_chunk_count) +
+                " chunks found in " + std::to_string(segments.size()) +
+                " segment file(s)");
+        }
+
+        // Some writers add table entries beyond end of media
+        chunks.resize((size_t)((media_size + bytes_per_chunk - 1) /
+            bytes_per_chunk));
+    }
+    catch (...)
+    {
+        for (int fd : segments)
+        {
+            close(fd);
+        }
+
+        throw;
+    }
+
+    size_t cache_chunks = this->options.cache_size / bytes_per_chunk;
+
+    if (this->options.readahead_chunks > cache_chunks / 2)
+    {
+        this->options.readahead_chunks = (unsigned)(cache_chunks / 2);
+    }
+
+    unsigned thread_count = this->options.inflate_threads;
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    inflate_pool.reset(new WorkerPool(thread_count));
+}
+
+EwfImage::~EwfImage()
+{
+    // Queued read-ahead refers to segments and cache
+    inflate_pool.reset();
+
+    for (int fd : segments)
+    {
+        close(fd);
+    }
+}
+
+void EwfImage::parse_segment(size_t segment, const std::string &path)
+{
+    int fd = segments[segment];
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot query size of " + path);
+    }
+
+    uint64_t file_size = (uint64_t)st.st_size;
+
+    uint8_t file_header[ewf_file_header_size];
+
+    if (read_fully(fd, file_header, sizeof(file_header), 0) < 0 ||
+        memcmp(file_header, ewf2_signature, sizeof(ewf2_signature)) == 0 ||
+        memcmp(file_header, ewf_signature, sizeof(ewf_signature)) != 0)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            path + " is not an EWF (E01) segment file");
+    }
+
+    uint16_t segment_number = (uint16_t)(file_header[9] |
+        (file_header[10] << 8));
+
+    if (segment_number != segment + 1)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            path + " is segment " + std::to_string(segment_number) +
+            ", expected segment " + std::to_string(segment + 1));
+    }
+
+    std::vector<uint8_t> data;
+    uint64_t offset = ewf_file_header_size;
+
+    for (;;)
+    {
+        uint8_t descriptor[ewf_section_size];
+
+        if (offset + ewf_section_size > file_size ||
+            read_fully(fd, descriptor, sizeof(descriptor), offset) < 0)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                path + " is truncated");
+        }
+
+        if (adler32(1, descriptor, 72) != get_le32(descriptor + 72))
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                "Bad section descriptor checksum in " + path);
+        }
+
+        char type[17] = { };
+        memcpy(type, descriptor, 16);
+        uint64_t next = get_le64(descriptor + 16);
+        uint64_t section_size = get_le64(descriptor + 24);
+
+        uint64_t data_size = section_size > ewf_section_size &&
+            offset + section_size <= file_size ?
+            section_size - ewf_section_size : 0;
+
+        if (strcmp(type, "done") == 0 || strcmp(type, "next") == 0)
+        {
+            return;
+        }
+        else if (strcmp(type, "volume") == 0 || strcmp(type, "disk") == 0)
+        {
+            if (data_size < ewf_volume_smart_size)
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    "Bad volume section in " + path);
+            }
+
+            data.resize((size_t)data_size);
+
+            if (read_fully(fd, data.data(), data.size(),
+                offset + ewf_section_size) < 0)
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    path + " is truncated");
+            }
+
+            volume_chunk_count = get_le32(data.data() + 4);
+            uint32_t sectors_per_chunk = get_le32(data.data() + 8);
+            uint32_t bytes_per_sector = get_le32(data.data() + 12);
+            uint64_t sector_count = data_size >= ewf_volume_size ?
+                get_le64(data.data() + 16) : get_le32(data.data() + 16);
+
+            if (sectors_per_chunk == 0 || bytes_per_sector == 0 ||
+                (uint64_t)sectors_per_chunk * bytes_per_sector > (64 << 20))
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    "Unsupported chunk size in " + path);
+            }
+
+            bytes_per_chunk = sectors_per_chunk * bytes_per_sector;
+            media_size = sector_count * bytes_per_sector;
+        }
+        else if (strcmp(type, "sectors") == 0)
+        {
+            sectors_end = offset + section_size;
+        }
+        else if (strcmp(type, "table") == 0)
+        {
+            uint8_t *header;
+
+            if (data_size < ewf_table_header_size)
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    "Bad table section in " + path);
+            }
+
+            data.resize((size_t)data_size);
+
+            if (read_fully(fd, data.data(), data.size(),
+                offset + ewf_section_size) < 0)
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    path + " is truncated");
+            }
+
+            header = data.data();
+
+            if (adler32(1, header, 20) != get_le32(header + 20))
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    "Bad table checksum in " + path);
+            }
+
+            uint32_t entry_count = get_le32(header);
+            uint64_t base_offset = get_le64(header + 8);
+
+            if (entry_count > (data_size - ewf_table_header_size) / 4)
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    "Bad table section in " + path);
+            }
+
+            // Last chunk in table ends where sectors section ends. Old
+            // EnCase versions store chunks in table section itself, after
+            // entries.
+            const uint8_t *entries = header + ewf_table_header_size;
+            size_t first = chunks.size();
+
+            for (uint32_t i = 0; i < entry_count; i++)
+            {
+                uint32_t entry = get_le32(entries + i * 4);
+
+                chunks.push_back(ChunkLocation{
+                    base_offset + (entry & ~ewf_chunk_compressed), 0,
+                    (uint16_t)segment,
+                    (entry & ewf_chunk_compressed) != 0 });
+            }
+
+            for (size_t i = first; i < chunks.size(); i++)
+            {
+                uint64_t end;
+
+                if (i + 1 < chunks.size())
+                {
+                    end = chunks[i + 1].offset;
+                }
+                else if (sectors_end > chunks[i].offset)
+                {
+                    end = sectors_end;
+                }
+                else
+                {
+                    end = offset + section_size;
+                }
+
+                if (end <= chunks[i].offset || end > file_size ||
+                    end - chunks[i].offset > 2ULL * bytes_per_chunk + 4)
+                {
+                    throw std::system_error(EINVAL, std::generic_category(),
+                        "Bad table entry for chunk " + std::to_string(i) +
+                        " in " + path);
+                }
+
+                chunks[i].stored_size = (uint32_t)(end - chunks[i].offset);
+            }
+        }
+
+        // Other sections, such as header, table2, data, hash and digest,
+        // are not needed to serve media data
+        if (next <= offset)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                "Bad section chain in " + path);
+        }
+
+        offset = next;
+    }
+}
+
+bool EwfImage::is_ewf_file(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    uint8_t signature[sizeof(ewf_signature)];
+
+    bool result = read_fully(fd, signature, sizeof(signature), 0) == 0 &&
+        (memcmp(signature, ewf_signature, sizeof(signature)) == 0 ||
+        memcmp(signature, ewf2_signature, sizeof(signature)) == 0);
+
+    close(fd);
+
+    return result;
+}
+
+std::vector<std::string> EwfImage::find_segments(const std::string &path)
+{
+    std::vector<std::string> paths{ path };
+
+    size_t length = path.size();
+
+    if (length < 4 || path[length - 4] != '.' || !isalpha(path[length - 3]))
+    {
+        return paths;
+    }
+
+    char extension[3] = { path[length - 3], path[length - 2], path[length - 1] };
+    char alpha = islower(extension[0]) ? 'a' : 'A';
+
+    for (;;)
+    {
+        // E01 to E99, then EAA to EZZ, FAA to FZZ and so on
+        if (isdigit(extension[1]) && isdigit(extension[2]))
+        {
+            if (extension[1] == '9' && extension[2] == '9')
+            {
+                extension[1] = alpha;
+                extension[2] = alpha;
+            }
+            else if (extension[2] == '9')
+            {
+                extension[1]++;
+                extension[2] = '0';
+            }
+            else
+            {
+                extension[2]++;
+            }
+        }
+        else if (isalpha(extension[1]) && isalpha(extension[2]))
+        {
+            if (extension[2] != alpha + 25)
+            {
+                extension[2]++;
+            }
+            else if (extension[1] != alpha + 25)
+            {
+                extension[1]++;
+                extension[2] = alpha;
+            }
+            else if (extension[0] != alpha + 25)
+            {
+                extension[0]++;
+                extension[1] = alpha;
+                extension[2] = alpha;
+            }
+            else
+            {
+                return paths;
+            }
+        }
+        else
+        {
+            return paths;
+        }
+
+        std::string next = path.substr(0, length - 3) +
+            std::string(extension, 3);
+
+        struct stat st;
+        if (stat(next.c_str(), &st) < 0)
+        {
+            return paths;
+        }
+
+        paths.push_back(next);
+    }
+}
+
+ssize_t EwfImage::read(void *buffer, size_t length, uint64_t offset) const
+{
+    if (offset >= media_size || length == 0)
+    {
+        return 0;
+    }
+
+    length = (size_t)std::min<uint64_t>(length, media_size - offset);
+
+    uint64_t first = offset / bytes_per_chunk;
+    uint64_t last = (offset + length - 1) / bytes_per_chunk;
+
+    // Chunks after the first one are inflated in parallel on the pool while
+    // this thread inflates the first one. Entries are held here, so that
+    // they are not lost if they are evicted before they are copied.
+    std::vector<std::shared_ptr<CacheEntry>> entries;
+    entries.reserve((size_t)(last - first + 1));
+
+    prefetch(first, last + 1, first + 1, &entries);
+
+    read_ahead(first, last);
+
+    size_t done = 0;
+
+    for (uint64_t index = first; index <= last; index++)
+    {
+        const std::shared_ptr<CacheEntry> &entry = entries[index - first];
+
+        wait_chunk(index, entry);
+
+        if (entry->error != 0)
+        {
+            return entry->error;
+        }
+
+        size_t chunk_offset = (size_t)((offset + done) % bytes_per_chunk);
+        size_t count = std::min(length - done,
+            entry->data.size() - chunk_offset);
+
+        memcpy((uint8_t *)buffer + done, entry->data.data() + chunk_offset,
+            count);
+
+        done += count;
+    }
+
+    return (ssize_t)done;
+}
+
+void EwfImage::read_ahead(uint64_t first, uint64_t last) const
+{
+    uint64_t window = options.readahead_chunks;
+
+    if (window == 0)
+    {
+        return;
+    }
+
+    uint64_t queue_first;
+    uint64_t queue_last;
+
+    {
+        std::lock_guard<std::mutex> lock(readahead_mutex);
+
+        // Requests from a sequential reader with several requests in flight
+        // arrive slightly out of order, so anything that starts within
+        // the read-ahead window behind end of last read counts as
+        // sequential. Anything else starts a new sequential run.
+        if (first > sequential_end ||
+            first + window < sequential_end)
+        {
+            sequential_end = last + 1;
+            readahead_end = last + 1;
+            return;
+        }
+
+        sequential_end = std::max(sequential_end, last + 1);
+
+        queue_first = std::max(readahead_end, sequential_end);
+        queue_last = std::min<uint64_t>(sequential_end + window, chunks.size());
+
+        if (queue_first >= queue_last)
+        {
+            return;
+        }
+
+        readahead_end = queue_last;
+    }
+
+    readahead_count += prefetch(queue_first, queue_last, queue_first,
+        nullptr);
+}
+
+uint64_t EwfImage::prefetch(uint64_t first, uint64_t last, uint64_t queue_first,
+    std::vector<std::shared_ptr<CacheEntry>> *entries) const
+{
+    std::vector<std::pair<uint64_t, std::shared_ptr<CacheEntry>>> queued;
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+
+        for (uint64_t index = first; index < last; index++)
+        {
+            std::shared_ptr<CacheEntry> &entry = cache[index];
+
+            if (!entry)
+            {
+                entry = std::make_shared<CacheEntry>();
+
+                if (index >= queue_first)
+                {
+                    queued.emplace_back(index, entry);
+                }
+
+                if (entries != nullptr)
+                {
+                    cache_misses++;
+                }
+            }
+            else if (entries != nullptr)
+            {
+                cache_hits++;
+
+                if (entry->in_lru)
+                {
+                    lru.splice(lru.begin(), lru, entry->lru);
+                }
+            }
+
+            if (entries != nullptr)
+            {
+                entries->push_back(entry);
+            }
+        }
+    }
+
+    for (auto &item : queued)
+    {
+        uint64_t index = item.first;
+        std::shared_ptr<CacheEntry> entry = std::move(item.second);
+
+        inflate_pool->submit([this, index, entry]
+        {
+            {
+                // A reader may have taken chunk over while it was queued
+                std::lock_guard<std::mutex> lock(cache_mutex);
+
+                if (entry->started)
+                {
+                    return;
+                }
+
+                entry->started = true;
+            }
+
+            fill(index, entry);
+        });
+    }
+
+    return queued.size();
+}
+
+void EwfImage::wait_chunk(uint64_t index,
+    const std::shared_ptr<CacheEntry> &entry) const
+{
+    {
+        std::unique_lock<std::mutex> lock(cache_mutex);
+
+        if (entry->started)
+        {
+            chunk_ready.wait(lock, [&entry] { return entry->done; });
+
+            return;
+        }
+
+        // Not yet started, or queued behind other chunks. Inflate it here
+        // rather than wait.
+        entry->started = true;
+    }
+
+    fill(index, entry);
+}
+
+void EwfImage::fill(uint64_t index, const std::shared_ptr<CacheEntry> &entry) const
+{
+    int error = inflate_chunk(index, entry->data);
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+
+        entry->error = error;
+        entry->done = true;
+
+        auto it = cache.find(index);
+
+        if (it != cache.end() && it->second == entry)
+        {
+            if (error != 0 || entry->data.size() > options.cache_size)
+            {
+                // Failed chunks are retried by next request. Without cache,
+                // chunk is dropped as soon as those waiting for it have it.
+                cache.erase(it);
+            }
+            else
+            {
+                lru.push_front(index);
+                entry->lru = lru.begin();
+                entry->in_lru = true;
+                cached_bytes += entry->data.size();
+
+                while (cached_bytes > options.cache_size)
+                {
+                    auto victim = cache.find(lru.back());
+
+                    cached_bytes -= victim->second->data.size();
+                    victim->second->in_lru = false;
+                    cache.erase(victim);
+                    lru.pop_back();
+
+                    evicted_count++;
+                }
+            }
+        }
+    }
+
+    chunk_ready.notify_all();
+}
+
+int EwfImage::inflate_chunk(uint64_t index, std::vector<uint8_t> &data) const
+{
+    static thread_local ThreadInflater inflater;
+
+    const ChunkLocation &chunk = chunks[(size_t)index];
+    uint64_t start = index * bytes_per_chunk;
+    size_t length = (size_t)std::min<uint64_t>(bytes_per_chunk,
+        media_size - start);
+
+    if (chunk.compressed)
+    {
+        data.resize(length);
+
+        std::vector<uint8_t> &stored = inflater.stored;
+        stored.resize(chunk.stored_size);
+
+        int result = read_fully(segments[chunk.segment], stored.data(),
+            stored.size(), chunk.offset);
+
+        if (result < 0)
+        {
+            return result;
+        }
+
+        return inflater.inflate_exact(stored.data(), stored.size(),
+            data.data(), data.size());
+    }
+
+    // Uncompressed chunks are followed by an Adler-32 checksum, except in
+    // images written by some old tools
+    if (chunk.stored_size < length)
+    {
+        return -EIO;
+    }
+
+    bool has_checksum = chunk.stored_size >= length + 4;
+
+    data.resize(has_checksum ? length + 4 : length);
+
+    int result = read_fully(segments[chunk.segment], data.data(),
+        data.size(), chunk.offset);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    if (has_checksum)
+    {
+        if (adler32(1, data.data(), (uInt)length) != get_le32(data.data() + length))
+        {
+            return -EIO;
+        }
+
+        data.resize(length);
+    }
+
+    return 0;
+}
+
+ssize_t EwfImage::write(const struct iovec *, int, uint64_t) const
+{
+    return -EROFS;
+}
+
+int EwfImage::punch_hole(uint64_t, uint64_t) const
+{
+    return -EOPNOTSUPP;
+}
+
+int EwfImage::flush() const
+{
+    return 0;
+}
+
+EwfImage::Statistics EwfImage::statistics() const
+{
+    Statistics stats;
+
+    stats.cache_hits = cache_hits;
+    stats.cache_misses = cache_misses;
+    stats.readahead_chunks = readahead_count;
+    stats.evicted_chunks = evicted_count;
+
+    return stats;
+}
+
+}
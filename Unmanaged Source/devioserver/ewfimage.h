@@ -0,0 +1,219 @@
+/// ewfimage.h
+/// Storage backend for devio server that serves EnCase (E01) images
+/// natively. Section tables of all segment files are parsed into an
+/// in-memory chunk index when image is opened. Chunks are inflated on a
+/// worker pool, ahead of sequential readers, and kept in a cache of
+/// decompressed chunks limited to a number of bytes.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_EWFIMAGE_H_
+#define _DEVIOSERVER_EWFIMAGE_H_
+
+#include "imagebackend.h"
+#include "workerpool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace devio
+{
+
+struct EwfOptions
+{
+    /// Largest number of bytes of decompressed chunks kept in memory. Zero
+    /// disables cache and read-ahead, each chunk is then inflated once for
+    /// every request that reads from it.
+    size_t cache_size = 256 << 20;
+
+    /// Number of threads that inflate chunks ahead of readers and for
+    /// requests that span several chunks, zero for one per CPU
+    unsigned inflate_threads = 0;
+
+    /// Number of chunks inflated ahead of sequential readers, zero to
+    /// disable. Limited to half of what fits in cache.
+    unsigned readahead_chunks = 64;
+};
+
+class EwfImage : public ImageBackend
+{
+public:
+
+    /// Opens all segment files, in segment number order, and builds chunk
+    /// index. Throws std::system_error if any of them cannot be opened or
+    /// is not a valid EWF segment file.
+    EwfImage(const std::vector<std::string> &paths, const EwfOptions &options);
+    ~EwfImage();
+
+    EwfImage(const EwfImage &) = delete;
+    EwfImage &operator=(const EwfImage &) = delete;
+
+    /// True if file at path starts with an EWF segment file signature
+    static bool is_ewf_file(const std::string &path);
+
+    /// Returns path and paths of all following segment files that exist,
+    /// named with extensions .E01 to .E99, then .EAA to .EZZ, .FAA and so
+    /// on, in the same case as extension of path.
+    static std::vector<std::string> find_segments(const std::string &path);
+
+    uint64_t size() const override
+    {
+        return media_size;
+    }
+
+    bool read_only() const override
+    {
+        return true;
+    }
+
+    bool supports_punch_hole() const override
+    {
+        return false;
+    }
+
+    ssize_t read(void *buffer, size_t length, uint64_t offset) const override;
+
+    ssize_t write(const struct iovec *iov, int iovcnt,
+        uint64_t offset) const override;
+
+    using ImageBackend::write;
+
+    int punch_hole(uint64_t offset, uint64_t length) const override;
+
+    int flush() const override;
+
+    uint32_t chunk_size() const
+    {
+        return bytes_per_chunk;
+    }
+
+    uint64_t chunk_count() const
+    {
+        return chunks.size();
+    }
+
+    size_t segment_count() const
+    {
+        return segments.size();
+    }
+
+    struct Statistics
+    {
+        /// Chunks read by requests that were found in cache, including
+        /// those still being inflated by read-ahead
+        uint64_t cache_hits;
+
+        /// Chunks read by requests that were not in cache
+        uint64_t cache_misses;
+
+        /// Chunks inflated ahead of readers
+        uint64_t readahead_chunks;
+
+        /// Chunks dropped from cache to stay within cache size
+        uint64_t evicted_chunks;
+    };
+
+    Statistics statistics() const;
+
+private:
+
+    /// Where a chunk is stored in segment files
+    struct ChunkLocation
+    {
+        uint64_t offset;
+        uint32_t stored_size;
+        uint16_t segment;
+        bool compressed;
+    };
+
+    /// Decompressed chunk in cache, or placeholder for a chunk that is
+    /// queued or being inflated. Whoever sets started inflates it, others
+    /// sleep on chunk_ready until done is set.
+    struct CacheEntry
+    {
+        std::vector<uint8_t> data;
+        bool started = false;
+        bool done = false;
+        int error = 0;
+        bool in_lru = false;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    void parse_segment(size_t segment, const std::string &path);
+
+    /// Looks up chunks in [first, last) and adds placeholders for those not
+    /// in cache. New placeholders from queue_first on are queued for
+    /// inflation on the pool. If entries is not null, entries of all
+    /// chunks are returned there and counted as cache hits or misses.
+    /// Returns number of chunks queued.
+    uint64_t prefetch(uint64_t first, uint64_t last, uint64_t queue_first,
+        std::vector<std::shared_ptr<CacheEntry>> *entries) const;
+
+    /// Waits for a chunk that is being inflated, or inflates it in calling
+    /// thread if nobody has started it. Check error member afterwards.
+    void wait_chunk(uint64_t index,
+        const std::shared_ptr<CacheEntry> &entry) const;
+
+    /// Inflates chunk into placeholder entry, publishes it in cache and
+    /// wakes waiters
+    void fill(uint64_t index, const std::shared_ptr<CacheEntry> &entry) const;
+
+    /// Reads and decompresses a chunk. Returns zero or -errno.
+    int inflate_chunk(uint64_t index, std::vector<uint8_t> &data) const;
+
+    /// Detects sequential readers and queues read-ahead for them
+    void read_ahead(uint64_t first, uint64_t last) const;
+
+    std::vector<int> segments;
+    std::vector<ChunkLocation> chunks;
+    uint64_t media_size = 0;
+    uint32_t bytes_per_chunk = 0;
+    uint64_t volume_chunk_count = 0;
+
+    /// End of last sectors section, which is end of last chunk in next
+    /// table section
+    uint64_t sectors_end = 0;
+
+    EwfOptions options;
+
+    mutable std::mutex cache_mutex;
+    mutable std::condition_variable chunk_ready;
+    mutable std::unordered_map<uint64_t, std::shared_ptr<CacheEntry>> cache;
+
+    /// Cached chunk numbers, most recently used first. Placeholders are
+    /// not in this list and do not count in cached_bytes.
+    mutable std::list<uint64_t> lru;
+    mutable size_t cached_bytes = 0;
+
+    /// Chunk after last chunk read by current sequential reader, and
+    /// chunk after last one queued for read-ahead
+    mutable std::mutex readahead_mutex;
+    mutable uint64_t sequential_end = 0;
+    mutable uint64_t readahead_end = 0;
+
+    mutable std::atomic<uint64_t> cache_hits{ 0 };
+    mutable std::atomic<uint64_t> cache_misses{ 0 };
+    mutable std::atomic<uint64_t> readahead_count{ 0 };
+    mutable std::atomic<uint64_t> evicted_count{ 0 };
+
+    /// Created last and stopped first, queued work refers to everything
+    /// above
+    std::unique_ptr<WorkerPool> inflate_pool;
+};
+
+}
+
+#endif // _DEVIOSERVER_EWFIMAGE_H_
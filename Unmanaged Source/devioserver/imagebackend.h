@@ -0,0 +1,69 @@
+/// imagebackend.h
+/// Interface of storage backends served by devio server. ImageFile serves
+/// raw images and block devices, EwfImage serves EnCase E01 images,
+/// VhdImage serves VHDX images and dynamic and differencing VHD images and
+/// QcowImage serves QCOW2 images.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_IMAGEBACKEND_H_
+#define _DEVIOSERVER_IMAGEBACKEND_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace devio
+{
+
+/// All methods may be called concurrently from any number of worker
+/// threads.
+class ImageBackend
+{
+public:
+
+    virtual ~ImageBackend() = default;
+
+    virtual uint64_t size() const = 0;
+
+    virtual bool read_only() const = 0;
+
+    /// True if unmap and zero requests can be served by deallocating
+    /// ranges
+    virtual bool supports_punch_hole() const = 0;
+
+    /// Reads up to length bytes. Returns number of bytes read, which is
+    /// less than length only at end of image, or -errno on failure.
+    virtual ssize_t read(void *buffer, size_t length, uint64_t offset) const = 0;
+
+    /// Writes length bytes from a scatter list of buffers. Writes that
+    /// extend beyond end of image are truncated. Returns number of bytes
+    /// written or -errno on failure.
+    virtual ssize_t write(const struct iovec *iov, int iovcnt,
+        uint64_t offset) const = 0;
+
+    ssize_t write(const void *buffer, size_t length, uint64_t offset) const
+    {
+        struct iovec iov = { (void *)buffer, length };
+
+        return write(&iov, 1, offset);
+    }
+
+    /// Deallocates a range so that it reads back as zeros. Returns zero or
+    /// -errno on failure.
+    virtual int punch_hole(uint64_t offset, uint64_t length) const = 0;
+
+    /// Flushes image to stable storage
+    virtual int flush() const = 0;
+};
+
+}
+
+#endif // _DEVIOSERVER_IMAGEBACKEND_H_
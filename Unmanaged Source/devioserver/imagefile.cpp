@@ -0,0 +1,350 @@
+/// imagefile.cpp
+/// Storage backend for devio server.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "imagefile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <system_error>
+
+namespace devio
+{
+
+ImageFile::ImageFile(const std::vector<std::string> &paths, bool read_only)
+    : is_read_only(read_only)
+{
+    try
+    {
+        for (const std::string &path : paths)
+        {
+            int fd = open(path.c_str(),
+                (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+
+            if (fd < 0)
+            {
+                throw std::system_error(errno, std::generic_category(),
+                    "Cannot open " + path);
+            }
+
+            image_parts.push_back(Part{ fd, total_size, 0 });
+
+            struct stat st;
+            if (fstat(fd, &st) < 0)
+            {
+                throw std::system_error(errno, std::generic_category(),
+                    "Cannot query size of " + path);
+            }
+
+            uint64_t part_size;
+
+            if (S_ISBLK(st.st_mode))
+            {
+                if (ioctl(fd, BLKGETSIZE64, &part_size) < 0)
+                {
+                    throw std::system_error(errno, std::generic_category(),
+                        "Cannot query size of " + path);
+                }
+
+                // Block devices can discard ranges but cannot punch holes
+                // through fallocate() on all kernels, so do not advertise
+                // unmap support for them.
+                can_punch_hole = false;
+            }
+            else if (S_ISREG(st.st_mode))
+            {
+                part_size = (uint64_t)st.st_size;
+            }
+            else
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    path + " is neither a file nor a block device");
+            }
+
+            image_parts.back().size = part_size;
+            total_size += part_size;
+        }
+    }
+    catch (...)
+    {
+        for (const Part &part : image_parts)
+        {
+            close(part.fd);
+        }
+
+        throw;
+    }
+
+    if (image_parts.empty())
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "No image files");
+    }
+
+    if (read_only)
+    {
+        can_punch_hole = false;
+    }
+}
+
+ImageFile::~ImageFile()
+{
+    for (const Part &part : image_parts)
+    {
+        close(part.fd);
+    }
+}
+
+size_t ImageFile::find_part(uint64_t offset) const
+{
+    // Parts are sorted by start offset, find last one starting at or
+    // before offset.
+    auto it = std::upper_bound(image_parts.begin(), image_parts.end(), offset,
+        [](uint64_t value, const Part &part)
+        {
+            return value < part.start;
+        });
+
+    if (it == image_parts.begin() || offset >= total_size)
+    {
+        return image_parts.size();
+    }
+
+    size_t index = (size_t)(it - image_parts.begin()) - 1;
+
+    // Skip empty parts
+    while (index < image_parts.size() &&
+        offset - image_parts[index].start >= image_parts[index].size)
+    {
+        index++;
+    }
+
+    return index;
+}
+
+ssize_t ImageFile::read(void *buffer, size_t length, uint64_t offset) const
+{
+    size_t done = 0;
+
+    for (size_t index = find_part(offset);
+        done < length && index < image_parts.size();
+        index++)
+    {
+        const Part &part = image_parts[index];
+        uint64_t part_offset = offset + done - part.start;
+
+        if (part_offset >= part.size)
+        {
+            continue;
+        }
+
+        size_t chunk = (size_t)std::min<uint64_t>(length - done,
+            part.size - part_offset);
+
+        while (chunk > 0)
+        {
+            ssize_t result = pread(part.fd, (char *)buffer + done, chunk,
+                (off_t)part_offset);
+
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return -errno;
+            }
+
+            if (result == 0)
+            {
+                // File was truncated after open, treat as end of image
+                return (ssize_t)done;
+            }
+
+            done += (size_t)result;
+            part_offset += (uint64_t)result;
+            chunk -= (size_t)result;
+        }
+    }
+
+    return (ssize_t)done;
+}
+
+ssize_t ImageFile::write(const struct iovec *iov, int iovcnt,
+    uint64_t offset) const
+{
+    if (is_read_only)
+    {
+        return -EROFS;
+    }
+
+    // Local copy of scatter list so that it can be advanced on partial
+    // writes and split at part boundaries.
+    std::vector<struct iovec> vec(iov, iov + iovcnt);
+    size_t first = 0;
+    size_t done = 0;
+
+    for (size_t index = find_part(offset);
+        first < vec.size() && index < image_parts.size();
+        index++)
+    {
+        const Part &part = image_parts[index];
+        uint64_t part_offset = offset + done - part.start;
+
+        if (part_offset >= part.size)
+        {
+            continue;
+        }
+
+        uint64_t part_remaining = part.size - part_offset;
+
+        while (part_remaining > 0 && first < vec.size())
+        {
+            // Limit scatter list to what fits in this part
+            size_t last = first;
+            uint64_t chunk = 0;
+            size_t saved_len = 0;
+
+            while (last < vec.size() && chunk < part_remaining)
+            {
+                chunk += vec[last].iov_len;
+                last++;
+            }
+
+            if (chunk > part_remaining)
+            {
+                saved_len = vec[last - 1].iov_len;
+                vec[last - 1].iov_len -= (size_t)(chunk - part_remaining);
+            }
+
+            ssize_t result = pwritev(part.fd, &vec[first],
+                (int)std::min<size_t>(last - first, IOV_MAX),
+                (off_t)part_offset);
+
+            if (saved_len != 0)
+            {
+                vec[last - 1].iov_len = saved_len;
+            }
+
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return -errno;
+            }
+
+            if (result == 0)
+            {
+                return -EIO;
+            }
+
+            done += (size_t)result;
+            part_offset += (uint64_t)result;
+            part_remaining -= (uint64_t)result;
+
+            // Advance scatter list past written bytes
+            size_t advance = (size_t)result;
+            while (advance > 0 && first < vec.size())
+            {
+                if (advance >= vec[first].iov_len)
+                {
+                    advance -= vec[first].iov_len;
+                    first++;
+                }
+                else
+                {
+                    vec[first].iov_base = (char *)vec[first].iov_base + advance;
+                    vec[first].iov_len -= advance;
+                    advance = 0;
+                }
+            }
+
+            while (first < vec.size() && vec[first].iov_len == 0)
+            {
+                first++;
+            }
+        }
+    }
+
+    return (ssize_t)done;
+}
+
+int ImageFile::punch_hole(uint64_t offset, uint64_t length) const
+{
+    if (!can_punch_hole)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    if (offset >= total_size)
+    {
+        return 0;
+    }
+
+    length = std::min(length, total_size - offset);
+
+    for (size_t index = find_part(offset);
+        length > 0 && index < image_parts.size();
+        index++)
+    {
+        const Part &part = image_parts[index];
+        uint64_t part_offset = offset - part.start;
+
+        if (part_offset >= part.size)
+        {
+            continue;
+        }
+
+        uint64_t chunk = std::min(length, part.size - part_offset);
+
+        if (fallocate(part.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            (off_t)part_offset, (off_t)chunk) < 0)
+        {
+            return -errno;
+        }
+
+        offset += chunk;
+        length -= chunk;
+    }
+
+    return 0;
+}
+
+int ImageFile::flush() const
+{
+    for (const Part &part : image_parts)
+    {
+        if (fdatasync(part.fd) < 0)
+        {
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+}
@@ -0,0 +1,93 @@
+/// imagefile.h
+/// Storage backend for devio server. Serves a raw image file, a block
+/// device or a set of image part files that are concatenated in the order
+/// they are given.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_IMAGEFILE_H_
+#define _DEVIOSERVER_IMAGEFILE_H_
+
+#include "imagebackend.h"
+
+#include <string>
+#include <vector>
+
+namespace devio
+{
+
+class ImageFile : public ImageBackend
+{
+public:
+
+    /// Opens all parts. Throws std::system_error if any of them cannot be
+    /// opened or its size cannot be determined.
+    ImageFile(const std::vector<std::string> &paths, bool read_only);
+    ~ImageFile();
+
+    ImageFile(const ImageFile &) = delete;
+    ImageFile &operator=(const ImageFile &) = delete;
+
+    uint64_t size() const override
+    {
+        return total_size;
+    }
+
+    bool read_only() const override
+    {
+        return is_read_only;
+    }
+
+    /// True if unmap and zero requests can be served by deallocating
+    /// ranges in all parts
+    bool supports_punch_hole() const override
+    {
+        return can_punch_hole;
+    }
+
+    ssize_t read(void *buffer, size_t length, uint64_t offset) const override;
+
+    ssize_t write(const struct iovec *iov, int iovcnt,
+        uint64_t offset) const override;
+
+    using ImageBackend::write;
+
+    int punch_hole(uint64_t offset, uint64_t length) const override;
+
+    /// Flushes all parts to stable storage
+    int flush() const override;
+
+    struct Part
+    {
+        int fd;
+        uint64_t start;
+        uint64_t size;
+    };
+
+    const std::vector<Part> &parts() const
+    {
+        return image_parts;
+    }
+
+    /// Finds part containing offset, or parts().size() if offset is at or
+    /// beyond end of image.
+    size_t find_part(uint64_t offset) const;
+
+private:
+
+    std::vector<Part> image_parts;
+    uint64_t total_size = 0;
+    bool is_read_only;
+    bool can_punch_hole = true;
+};
+
+}
+
+#endif // _DEVIOSERVER_IMAGEFILE_H_
@@ -0,0 +1,358 @@
+/// main.cpp
+/// devio-server command line application. Serves a raw image file, block
+/// device, multi-part image, EnCase (E01) image, VHDX/VHD image or QCOW2
+/// image over TCP/IP, or through shared memory to a local client, to Arsenal
+/// Image Mounter proxy clients.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "ewfimage.h"
+#include "qcowimage.h"
+#include "server.h"
+#include "shmserver.h"
+#include "vhdimage.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <exception>
+#include <memory>
+
+static devio::DevioServer *running_server;
+static devio::ShmServer *running_shm_server;
+
+static void stop_server(int)
+{
+    if (running_server != nullptr)
+    {
+        running_server->stop();
+    }
+
+    if (running_shm_server != nullptr)
+    {
+        running_shm_server->stop();
+    }
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "devio-server [options] imagefile [imagefile ...]\n"
+        "\n"
+        "Serves an image over TCP/IP, or through shared memory to a local\n"
+        "client, to Arsenal Image Mounter proxy clients.\n"
+        "Several image files are served as one image, concatenated in the\n"
+        "order they are given, for example split raw images. EnCase (E01)\n"
+        "images are detected automatically and served read-only, given as\n"
+        "first segment file or as all segment files in order. VHDX images,\n"
+        "and dynamic and differencing VHD images, are also detected and\n"
+        "served read-only, with parent images found through parent locators,\n"
+        "and so are QCOW2 images, with their backing files.\n"
+        "\n"
+        "-l, --listen address     Listen on this address only.\n"
+        "-p, --port port          TCP port to listen on, default 9000.\n"
+        "-r, --readonly           Do not allow clients to modify image.\n"
+        "-t, --threads count      Number of backend I/O threads, default one\n"
+        "                         per CPU.\n"
+        "-q, --queue-depth count  Max tagged requests in progress per\n"
+        "                         connection, default 64.\n"
+        "-m, --max-request bytes  Largest request size accepted, default\n"
+        "                         64 MB.\n"
+        "-d, --delay microseconds Delay each response, to simulate network\n"
+        "                         latency.\n"
+        "-e, --engine name        Backend I/O engine: uring, threads or auto.\n"
+        "                         Default auto, which uses io_uring where\n"
+        "                         available.\n"
+        "-u, --uring-entries n    io_uring queue size, which is also max\n"
+        "                         backend requests in flight, default 256.\n"
+        "-c, --cache-size MB      Decompressed E01 chunks kept in memory,\n"
+        "                         default 256 MB.\n"
+        "-a, --readahead chunks   E01 chunks inflated ahead of sequential\n"
+        "                         readers, default 64.\n"
+        "-i, --inflate-threads n  Threads that inflate E01 chunks and QCOW2\n"
+        "                         compressed clusters, default one per CPU.\n"
+        "-b, --block-threads n    Threads that read VHDX/VHD blocks of\n"
+        "                         requests in parallel, default one per CPU.\n"
+        "-k, --lookup-cache n     VHDX/VHD blocks for which location in a\n"
+        "                         differencing chain is cached, default\n"
+        "                         65536.\n"
+        "-L, --l2-cache MB        QCOW2 L2 tables kept in memory, default\n"
+        "                         32 MB.\n"
+        "-s, --shm name           Serve through shared memory section with\n"
+        "                         this name instead of TCP/IP, to one local\n"
+        "                         client at a time.\n"
+        "-S, --shm-size bytes     Size of shared memory section, default\n"
+        "                         32 slots of 1 MB plus headers.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "listen", required_argument, nullptr, 'l' },
+        { "port", required_argument, nullptr, 'p' },
+        { "readonly", no_argument, nullptr, 'r' },
+        { "threads", required_argument, nullptr, 't' },
+        { "queue-depth", required_argument, nullptr, 'q' },
+        { "max-request", required_argument, nullptr, 'm' },
+        { "delay", required_argument, nullptr, 'd' },
+        { "engine", required_argument, nullptr, 'e' },
+        { "uring-entries", required_argument, nullptr, 'u' },
+        { "cache-size", required_argument, nullptr, 'c' },
+        { "readahead", required_argument, nullptr, 'a' },
+        { "inflate-threads", required_argument, nullptr, 'i' },
+        { "block-threads", required_argument, nullptr, 'b' },
+        { "lookup-cache", required_argument, nullptr, 'k' },
+        { "l2-cache", required_argument, nullptr, 'L' },
+        { "shm", required_argument, nullptr, 's' },
+        { "shm-size", required_argument, nullptr, 'S' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    devio::ServerOptions options;
+    devio::EwfOptions ewf_options;
+    devio::VhdOptions vhd_options;
+    devio::QcowOptions qcow_options;
+    devio::ShmServerOptions shm_options;
+    bool read_only = false;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "l:p:rt:q:m:d:e:u:c:a:i:b:k:L:s:S:h",
+        long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            options.listen_address = optarg;
+            break;
+
+        case 'p':
+            options.port = (uint16_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'r':
+            read_only = true;
+            break;
+
+        case 't':
+            options.worker_threads = (unsigned)strtoul(optarg, nullptr, 0);
+            shm_options.worker_threads = options.worker_threads;
+            break;
+
+        case 'q':
+            options.max_outstanding = (unsigned)strtoul(optarg, nullptr, 0);
+            if (options.max_outstanding == 0)
+            {
+                options.max_outstanding = 1;
+            }
+            break;
+
+        case 'm':
+            options.max_request_size = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'd':
+            options.response_delay =
+                std::chrono::microseconds(strtoull(optarg, nullptr, 0));
+            break;
+
+        case 'e':
+            if (strcmp(optarg, "uring") == 0)
+            {
+                options.engine = devio::IoEngineType::Uring;
+            }
+            else if (strcmp(optarg, "threads") == 0)
+            {
+                options.engine = devio::IoEngineType::ThreadPool;
+            }
+            else if (strcmp(optarg, "auto") == 0)
+            {
+                options.engine = devio::IoEngineType::Auto;
+            }
+            else
+            {
+                usage();
+                return 1;
+            }
+            break;
+
+        case 'u':
+            options.uring_entries = (unsigned)strtoul(optarg, nullptr, 0);
+            if (options.uring_entries == 0)
+            {
+                options.uring_entries = 1;
+            }
+            break;
+
+        case 'c':
+            ewf_options.cache_size =
+                (size_t)strtoull(optarg, nullptr, 0) << 20;
+            break;
+
+        case 'a':
+            ewf_options.readahead_chunks =
+                (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'i':
+            ewf_options.inflate_threads =
+                (unsigned)strtoul(optarg, nullptr, 0);
+            qcow_options.decompress_threads = ewf_options.inflate_threads;
+            break;
+
+        case 'b':
+            vhd_options.read_threads =
+                (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'k':
+            vhd_options.lookup_cache_blocks =
+                (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'L':
+            qcow_options.l2_cache_size =
+                (size_t)strtoull(optarg, nullptr, 0) << 20;
+            break;
+
+        case 's':
+            shm_options.name = optarg;
+            break;
+
+        case 'S':
+            shm_options.buffer_size = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<std::string> paths(argv + optind, argv + argc);
+
+    try
+    {
+        std::unique_ptr<devio::ImageBackend> backend;
+
+        if (devio::EwfImage::is_ewf_file(paths[0]))
+        {
+            if (paths.size() == 1)
+            {
+                paths = devio::EwfImage::find_segments(paths[0]);
+            }
+
+            devio::EwfImage *ewf = new devio::EwfImage(paths, ewf_options);
+            backend.reset(ewf);
+
+            fprintf(stderr, "E01 image size %llu bytes in %zu segment(s), "
+                "%u byte chunks, read-only.\n",
+                (unsigned long long)ewf->size(), ewf->segment_count(),
+                ewf->chunk_size());
+        }
+        else if (devio::VhdImage::is_vhd_file(paths[0]))
+        {
+            if (paths.size() != 1)
+            {
+                fprintf(stderr, "VHDX and VHD images are served one at a "
+                    "time, parents are found automatically.\n");
+                return 1;
+            }
+
+            devio::VhdImage *vhd = new devio::VhdImage(paths[0], vhd_options);
+            backend.reset(vhd);
+
+            fprintf(stderr, "%s image size %llu bytes, %u byte blocks, %zu "
+                "file(s) in chain, read-only.\n", vhd->format_name(),
+                (unsigned long long)vhd->size(), vhd->block_size(),
+                vhd->chain_length());
+        }
+        else if (devio::QcowImage::is_qcow_file(paths[0]))
+        {
+            if (paths.size() != 1)
+            {
+                fprintf(stderr, "QCOW2 images are served one at a time, "
+                    "backing files are found automatically.\n");
+                return 1;
+            }
+
+            devio::QcowImage *qcow = new devio::QcowImage(paths[0],
+                qcow_options);
+            backend.reset(qcow);
+
+            fprintf(stderr, "QCOW2 image size %llu bytes, %u byte clusters, "
+                "%zu file(s) in chain, read-only.\n",
+                (unsigned long long)qcow->size(), qcow->cluster_size(),
+                qcow->chain_length());
+        }
+        else
+        {
+            devio::ImageFile *file = new devio::ImageFile(paths, read_only);
+            backend.reset(file);
+
+            fprintf(stderr, "Image size %llu bytes in %zu part(s)%s.\n",
+                (unsigned long long)file->size(), file->parts().size(),
+                file->read_only() ? ", read-only" : "");
+        }
+
+        devio::ImageBackend &image = *backend;
+
+        struct sigaction action = { };
+        action.sa_handler = stop_server;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+
+        if (!shm_options.name.empty())
+        {
+            devio::ShmServer server(image, shm_options);
+
+            running_shm_server = &server;
+
+            server.run();
+
+            running_shm_server = nullptr;
+        }
+        else
+        {
+            devio::DevioServer server(image, options);
+
+            running_server = &server;
+
+            server.run();
+
+            running_server = nullptr;
+        }
+
+        if (!image.read_only())
+        {
+            image.flush();
+        }
+    }
+    catch (const std::exception &ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,342 @@
+/// poolbench.cpp
+/// devio-poolbench command line application. Measures allocation cost per
+/// request of the driver's SRB path allocators, using the user mode port
+/// in srbpool.h, compared to allocating each work item and intermediate
+/// buffer directly from the system allocator as the driver used to do.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "srbpool.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <functional>
+#include <random>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+/// Roughly sizeof(MP_WorkRtnParms) in an x64 driver build
+constexpr size_t WORK_ITEM_SIZE = 160;
+
+struct PoolBenchOptions
+{
+    size_t min_size = 4096;
+    size_t max_size = 4096;
+    unsigned threads = 1;
+    unsigned queue_depth = 32;
+    uint64_t requests = 1000000;
+    size_t pool_size = 4 << 20;
+    bool copy = false;
+};
+
+struct Request
+{
+    void *work_item = nullptr;
+    void *buffer = nullptr;
+    size_t size = 0;
+};
+
+/// Allocation functions for one mode, so that both modes run the same loop
+struct Allocators
+{
+    std::function<void *()> allocate_work_item;
+    std::function<void(void *)> free_work_item;
+    std::function<void *(size_t)> allocate_buffer;
+    std::function<void(void *, size_t)> free_buffer;
+};
+
+/// Each thread keeps queue_depth requests outstanding and replaces the
+/// oldest one for each new request, so that buffers are released in a
+/// different order than they were allocated, as when requests complete
+/// out of order.
+static bool run_thread(const PoolBenchOptions &options, const Allocators &allocators,
+    unsigned index)
+{
+    std::vector<Request> ring(options.queue_depth);
+    std::mt19937 random_sizes(index + 1);
+    unsigned min_shift = 0;
+    unsigned size_classes = 1;
+
+    while (((size_t)1 << min_shift) < options.min_size)
+    {
+        min_shift++;
+    }
+
+    while (((size_t)1 << (min_shift + size_classes - 1)) < options.max_size)
+    {
+        size_classes++;
+    }
+
+    for (uint64_t i = 0; i < options.requests; i++)
+    {
+        Request &request = ring[i % options.queue_depth];
+
+        if (request.work_item != nullptr)
+        {
+            allocators.free_buffer(request.buffer, request.size);
+            allocators.free_work_item(request.work_item);
+        }
+
+        request.size = options.min_size == options.max_size ? options.min_size :
+            (size_t)1 << (min_shift + random_sizes() % size_classes);
+
+        request.work_item = allocators.allocate_work_item();
+        request.buffer = allocators.allocate_buffer(request.size);
+
+        if (request.work_item == nullptr || request.buffer == nullptr)
+        {
+            return false;
+        }
+
+        memset(request.work_item, 0, WORK_ITEM_SIZE);
+
+        if (options.copy)
+        {
+            memset(request.buffer, (int)i, request.size);
+        }
+        else
+        {
+            ((volatile uint8_t *)request.buffer)[0] = (uint8_t)i;
+            ((volatile uint8_t *)request.buffer)[request.size - 1] = (uint8_t)i;
+        }
+    }
+
+    for (Request &request : ring)
+    {
+        if (request.work_item != nullptr)
+        {
+            allocators.free_buffer(request.buffer, request.size);
+            allocators.free_work_item(request.work_item);
+        }
+    }
+
+    return true;
+}
+
+static bool run_mode(const char *name, const PoolBenchOptions &options,
+    const Allocators &allocators, uint64_t hits, uint64_t fallbacks,
+    const std::function<void(uint64_t &, uint64_t &)> &counters)
+{
+    std::vector<std::thread> threads;
+    std::vector<char> results(options.threads);
+
+    auto start_time = bench_clock::now();
+
+    for (unsigned i = 0; i < options.threads; i++)
+    {
+        threads.emplace_back([&, i]
+        {
+            results[i] = run_thread(options, allocators, i);
+        });
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    double elapsed = std::chrono::duration<double>(
+        bench_clock::now() - start_time).count();
+
+    for (char result : results)
+    {
+        if (!result)
+        {
+            fprintf(stderr, "%s: Memory allocation failed\n", name);
+            return false;
+        }
+    }
+
+    counters(hits, fallbacks);
+
+    uint64_t total = options.requests * options.threads;
+
+    printf("%-8s %10.1f %10.3f %14llu %14llu\n",
+        name,
+        elapsed * 1e9 * options.threads / (double)total,
+        (double)total / elapsed / 1e6,
+        (unsigned long long)hits,
+        (unsigned long long)fallbacks);
+
+    return true;
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "devio-poolbench [options]\n"
+        "\n"
+        "Measures cost of allocating and freeing one work item and one\n"
+        "intermediate buffer for each request, first directly from system\n"
+        "allocator and then with the driver's lookaside list and buffer pool.\n"
+        "Prints time per request for each thread, requests per second for\n"
+        "all threads together, and buffer pool hits and fallbacks.\n"
+        "\n"
+        "-b, --block-size bytes    Buffer size, default 4096.\n"
+        "-m, --max-size bytes      Largest buffer size. Requests use random\n"
+        "                          power of two sizes from -b up to this size.\n"
+        "-t, --threads count       Number of threads, default 1.\n"
+        "-q, --queue-depth count   Requests outstanding per thread, default 32.\n"
+        "-n, --requests count      Requests per thread, default 1000000.\n"
+        "-p, --pool-size bytes     Buffer pool size for each size class, as\n"
+        "                          BufferPoolSize registry value. Default\n"
+        "                          4194304.\n"
+        "-c, --copy                Fill each buffer, as a bounce copy would.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "block-size", required_argument, nullptr, 'b' },
+        { "max-size", required_argument, nullptr, 'm' },
+        { "threads", required_argument, nullptr, 't' },
+        { "queue-depth", required_argument, nullptr, 'q' },
+        { "requests", required_argument, nullptr, 'n' },
+        { "pool-size", required_argument, nullptr, 'p' },
+        { "copy", no_argument, nullptr, 'c' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    PoolBenchOptions options;
+    bool max_size_set = false;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:m:t:q:n:p:ch", long_options,
+        nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            options.min_size = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'm':
+            options.max_size = (size_t)strtoull(optarg, nullptr, 0);
+            max_size_set = true;
+            break;
+
+        case 't':
+            options.threads = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'q':
+            options.queue_depth = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'n':
+            options.requests = strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'p':
+            options.pool_size = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'c':
+            options.copy = true;
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!max_size_set)
+    {
+        options.max_size = options.min_size;
+    }
+
+    if (optind < argc || options.min_size == 0 ||
+        options.max_size < options.min_size || options.threads == 0 ||
+        options.queue_depth == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    printf("%-8s %10s %10s %14s %14s\n",
+        "mode", "ns/req", "Mreq/s", "pool hits", "fallbacks");
+
+    Allocators system_allocators;
+
+    system_allocators.allocate_work_item = []
+    {
+        return malloc(WORK_ITEM_SIZE);
+    };
+
+    system_allocators.free_work_item = [](void *block)
+    {
+        free(block);
+    };
+
+    system_allocators.allocate_buffer = [](size_t size) -> void *
+    {
+        void *buffer = nullptr;
+        return posix_memalign(&buffer, 4096, size) == 0 ? buffer : nullptr;
+    };
+
+    system_allocators.free_buffer = [](void *buffer, size_t)
+    {
+        free(buffer);
+    };
+
+    if (!run_mode("system", options, system_allocators, 0,
+        options.requests * options.threads,
+        [](uint64_t &, uint64_t &) { }))
+    {
+        return 1;
+    }
+
+    devio::LookasideList work_items(WORK_ITEM_SIZE);
+    devio::SrbBufferPool buffers(options.pool_size);
+    Allocators pool_allocators;
+
+    pool_allocators.allocate_work_item = [&]
+    {
+        return work_items.allocate();
+    };
+
+    pool_allocators.free_work_item = [&](void *block)
+    {
+        work_items.release(block);
+    };
+
+    pool_allocators.allocate_buffer = [&](size_t size)
+    {
+        return buffers.allocate(size);
+    };
+
+    pool_allocators.free_buffer = [&](void *buffer, size_t size)
+    {
+        buffers.release(buffer, size);
+    };
+
+    if (!run_mode("pool", options, pool_allocators, 0, 0,
+        [&](uint64_t &hits, uint64_t &fallbacks)
+        {
+            hits = buffers.hits.load();
+            fallbacks = buffers.fallbacks.load();
+        }))
+    {
+        return 1;
+    }
+
+    return 0;
+}
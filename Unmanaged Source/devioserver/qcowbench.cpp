@@ -0,0 +1,1127 @@
+/// qcowbench.cpp
+/// devio-qcowbench command line application. Writes a synthetic QCOW2
+/// backing chain, a sparse raw base image under a QCOW2 image with plain,
+/// compressed and zero clusters, under a QCOW2 image with extended L2
+/// entries, and measures random 4 KB read latency of the native QCOW2
+/// backend of devio server for a range of L2 cache sizes. All data read is
+/// verified against a model of which file each sector comes from.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "qcowimage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef DEVIO_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+struct BenchOptions
+{
+    std::string directory = "/tmp";
+    uint64_t image_size = 4ULL << 30;
+    uint32_t cluster_size = 64 << 10;
+    unsigned raw_percent = 5;
+    unsigned allocated_percent = 8;
+    unsigned compressed_percent = 50;
+    unsigned written_percent = 2;
+    bool zstd = false;
+    std::vector<size_t> cache_sizes;
+    unsigned decompress_threads = 0;
+    unsigned reader_threads = 1;
+    unsigned seconds = 2;
+    bool keep = false;
+};
+
+// Model and synthetic data are in units of 512 bytes
+static const uint32_t model_unit = 512;
+
+// Files of chain, also values in model plus one
+static const unsigned raw_layer = 0;
+static const unsigned compressed_layer = 1;
+static const unsigned top_layer = 2;
+
+// Writes to top image, and raw base image extents
+static const uint32_t top_write_size = 16 << 10;
+static const uint32_t raw_extent_size = 1 << 20;
+
+static inline void put_be32(uint8_t *ptr, uint32_t value)
+{
+    ptr[0] = (uint8_t)(value >> 24);
+    ptr[1] = (uint8_t)(value >> 16);
+    ptr[2] = (uint8_t)(value >> 8);
+    ptr[3] = (uint8_t)value;
+}
+
+static inline void put_be64(uint8_t *ptr, uint64_t value)
+{
+    put_be32(ptr, (uint32_t)(value >> 32));
+    put_be32(ptr + 4, (uint32_t)value);
+}
+
+static inline uint64_t mix64(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+/// Synthetic data written by one file of chain to one 512 byte unit.
+/// Compressed image gets text that compresses, the others random data.
+static void fill_unit(unsigned layer, uint64_t unit, uint8_t *buffer)
+{
+    static const char *const words[] =
+    {
+        "the ", "image ", "mounter ", "sector ", "evidence ", "file ",
+        "system ", "registry ", "volume ", "of ", "and ", "data ", "\r\n",
+        "<html>", "0x7fff ", "NTFS ", "MFT ", "record ", "user ", "a "
+    };
+
+    uint64_t seed = ((uint64_t)(layer + 1) << 48) ^ (unit << 6);
+
+    if (layer != compressed_layer)
+    {
+        for (uint32_t i = 0; i < model_unit; i += 8)
+        {
+            uint64_t value = mix64(seed + i / 8);
+            memcpy(buffer + i, &value, 8);
+        }
+
+        return;
+    }
+
+    uint64_t state = mix64(seed);
+
+    for (uint32_t i = 0; i < model_unit;)
+    {
+        state = mix64(state);
+        const char *word = words[state % (sizeof(words) / sizeof(*words))];
+        uint32_t count = std::min((uint32_t)strlen(word), model_unit - i);
+
+        memcpy(buffer + i, word, count);
+        i += count;
+    }
+}
+
+static void fill_range(unsigned layer, uint64_t offset, uint8_t *buffer,
+    size_t length)
+{
+    for (size_t done = 0; done < length; done += model_unit)
+    {
+        fill_unit(layer, (offset + done) / model_unit, buffer + done);
+    }
+}
+
+static void write_fully(int fd, const void *buffer, size_t length,
+    uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t result = pwrite(fd, buffer, length, (off_t)offset);
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::system_error(errno, std::generic_category(), "pwrite");
+        }
+
+        buffer = (const uint8_t *)buffer + result;
+        length -= (size_t)result;
+        offset += (uint64_t)result;
+    }
+}
+
+/// Which file of chain each 512 byte unit comes from, plus one, or zero
+/// for units that read as zeros
+typedef std::vector<uint8_t> Model;
+
+static void set_model(Model &model, uint64_t offset, uint64_t length,
+    uint8_t value)
+{
+    std::fill(model.begin() + offset / model_unit,
+        model.begin() + (offset + length) / model_unit, value);
+}
+
+/// Writes a sparse raw base image with random 1 MB extents of data
+static void write_raw(const std::string &path, uint64_t size,
+    unsigned percent, Model &model, std::mt19937_64 &random)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot create " + path);
+    }
+
+    try
+    {
+        if (ftruncate(fd, (off_t)size) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "ftruncate");
+        }
+
+        std::vector<uint8_t> buffer(raw_extent_size);
+        uint64_t extents = size * percent / 100 / raw_extent_size;
+
+        for (uint64_t i = 0; i < extents; i++)
+        {
+            uint64_t offset = random() % (size / raw_extent_size) *
+                raw_extent_size;
+
+            fill_range(raw_layer, offset, buffer.data(), buffer.size());
+            write_fully(fd, buffer.data(), buffer.size(), offset);
+            set_model(model, offset, buffer.size(), raw_layer + 1);
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+enum class ClusterPlan : uint8_t
+{
+    Unallocated,
+    Zero,
+    Data,
+    Compressed,
+    Subclusters
+};
+
+/// What one QCOW2 file of chain contains. Clusters with extended L2
+/// entries have allocated and zero subcluster masks.
+struct QcowPlan
+{
+    uint64_t size;
+    unsigned cluster_bits;
+    bool extended_l2;
+    std::vector<ClusterPlan> clusters;
+    std::map<uint64_t, std::pair<uint32_t, uint32_t>> subclusters;
+};
+
+/// Compressed image: allocated_percent of clusters with data, part of them
+/// compressed, and one in 100 clusters explicitly zeroed, or one in 4 of
+/// those that hide data of raw base image
+static QcowPlan plan_compressed(const BenchOptions &options,
+    unsigned cluster_bits, const Model &model, std::mt19937_64 &random)
+{
+    QcowPlan plan{ options.image_size, cluster_bits, false, {}, {} };
+
+    plan.clusters.resize((size_t)(options.image_size >> cluster_bits));
+
+    for (uint64_t cluster = 0; cluster < plan.clusters.size(); cluster++)
+    {
+        ClusterPlan &state = plan.clusters[(size_t)cluster];
+        bool over_data = model[(size_t)((cluster << cluster_bits) /
+            model_unit)] != 0;
+
+        if (random() % 100 < options.allocated_percent)
+        {
+            state = random() % 100 < options.compressed_percent ?
+                ClusterPlan::Compressed : ClusterPlan::Data;
+        }
+        else if (random() % (over_data ? 4 : 100) == 0)
+        {
+            state = ClusterPlan::Zero;
+        }
+    }
+
+    return plan;
+}
+
+/// Top image: random 16 KB writes over written_percent of disk, one in 8
+/// of them zero writes. With extended L2 entries these allocate or zero
+/// subclusters, otherwise whole clusters.
+static QcowPlan plan_top(const BenchOptions &options, unsigned cluster_bits,
+    std::mt19937_64 &random)
+{
+    uint64_t cluster_size = 1ULL << cluster_bits;
+    QcowPlan plan{ options.image_size, cluster_bits, cluster_bits >= 14, {}, {} };
+
+    plan.clusters.resize((size_t)(options.image_size >> cluster_bits));
+
+    uint64_t writes = options.image_size * options.written_percent / 100 /
+        top_write_size;
+
+    for (uint64_t i = 0; i < writes; i++)
+    {
+        uint64_t offset = random() % (options.image_size / top_write_size) *
+            top_write_size;
+        bool zero = random() % 8 == 0;
+
+        for (uint64_t position = offset; position < offset + top_write_size;)
+        {
+            uint64_t cluster = position / cluster_size;
+            uint64_t cluster_end = std::min(offset + top_write_size,
+                (cluster + 1) * cluster_size);
+            ClusterPlan &state = plan.clusters[(size_t)cluster];
+
+            if (!plan.extended_l2)
+            {
+                state = zero ? ClusterPlan::Zero : ClusterPlan::Data;
+            }
+            else
+            {
+                uint64_t subcluster_size = cluster_size / 32;
+                std::pair<uint32_t, uint32_t> &masks =
+                    plan.subclusters[cluster];
+
+                state = ClusterPlan::Subclusters;
+
+                for (uint64_t sc = (position % cluster_size) / subcluster_size;
+                    sc < (cluster_end - cluster * cluster_size +
+                    subcluster_size - 1) / subcluster_size; sc++)
+                {
+                    if (zero)
+                    {
+                        masks.first &= ~(1U << sc);
+                        masks.second |= 1U << sc;
+                    }
+                    else
+                    {
+                        masks.first |= 1U << sc;
+                        masks.second &= ~(1U << sc);
+                    }
+                }
+            }
+
+            position = cluster_end;
+        }
+    }
+
+    return plan;
+}
+
+static void apply_plan(Model &model, const QcowPlan &plan, unsigned layer)
+{
+    uint64_t cluster_size = 1ULL << plan.cluster_bits;
+    uint64_t subcluster_size = cluster_size / 32;
+
+    for (uint64_t cluster = 0; cluster < plan.clusters.size(); cluster++)
+    {
+        uint64_t start = cluster * cluster_size;
+
+        switch (plan.clusters[(size_t)cluster])
+        {
+        case ClusterPlan::Unallocated:
+            break;
+
+        case ClusterPlan::Zero:
+            set_model(model, start, cluster_size, 0);
+            break;
+
+        case ClusterPlan::Data:
+        case ClusterPlan::Compressed:
+            set_model(model, start, cluster_size, (uint8_t)(layer + 1));
+            break;
+
+        case ClusterPlan::Subclusters:
+        {
+            const std::pair<uint32_t, uint32_t> &masks =
+                plan.subclusters.at(cluster);
+
+            for (unsigned sc = 0; sc < 32; sc++)
+            {
+                if ((masks.first >> sc) & 1)
+                {
+                    set_model(model, start + sc * subcluster_size,
+                        subcluster_size, (uint8_t)(layer + 1));
+                }
+                else if ((masks.second >> sc) & 1)
+                {
+                    set_model(model, start + sc * subcluster_size,
+                        subcluster_size, 0);
+                }
+            }
+            break;
+        }
+        }
+    }
+}
+
+/// Compresses a cluster as QEMU does, raw deflate with 4 KB window, or
+/// one zstd frame. Returns false if it does not get smaller.
+static bool compress_cluster(bool zstd, const std::vector<uint8_t> &input,
+    std::vector<uint8_t> &output)
+{
+    output.resize(input.size());
+
+#ifdef DEVIO_WITH_ZSTD
+    if (zstd)
+    {
+        size_t result = ZSTD_compress(output.data(), output.size(),
+            input.data(), input.size(), 1);
+
+        if (ZSTD_isError(result))
+        {
+            return false;
+        }
+
+        output.resize(result);
+        return true;
+    }
+#else
+    (void)zstd;
+#endif
+
+    z_stream stream = { };
+
+    if (deflateInit2(&stream, 1, Z_DEFLATED, -12, 9,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+
+    stream.next_in = (Bytef *)input.data();
+    stream.avail_in = (uInt)input.size();
+    stream.next_out = output.data();
+    stream.avail_out = (uInt)output.size();
+
+    int result = deflate(&stream, Z_FINISH);
+
+    output.resize(output.size() - stream.avail_out);
+
+    deflateEnd(&stream);
+
+    return result == Z_STREAM_END;
+}
+
+/// Writes a version 3 QCOW2 file: header, extensions and backing file name
+/// in first cluster, refcount table in second, L1 table after it, then L2
+/// tables, data clusters and compressed clusters in order of first use.
+/// Refcounts are left empty, the backend never reads them.
+static void write_qcow2(const std::string &path, const QcowPlan &plan,
+    unsigned layer, const std::string &backing, const char *backing_format,
+    bool zstd)
+{
+    uint64_t cluster_size = 1ULL << plan.cluster_bits;
+    uint64_t subcluster_size = cluster_size / 32;
+    unsigned entry_bytes = plan.extended_l2 ? 16 : 8;
+    uint64_t l2_entries = cluster_size / entry_bytes;
+    uint64_t l1_size = (plan.clusters.size() + l2_entries - 1) / l2_entries;
+    uint64_t l1_clusters = (l1_size * 8 + cluster_size - 1) / cluster_size;
+    uint64_t next_offset = (2 + l1_clusters) * cluster_size;
+    bool compressed = false;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot create " + path);
+    }
+
+    try
+    {
+        std::vector<uint64_t> l1((size_t)l1_size);
+        std::map<uint64_t, std::vector<uint8_t>> l2_tables;
+        std::vector<uint8_t> data((size_t)cluster_size);
+        std::vector<uint8_t> packed;
+
+        auto allocate_cluster = [&]()
+        {
+            next_offset = (next_offset + cluster_size - 1) & ~(cluster_size - 1);
+            uint64_t offset = next_offset;
+            next_offset += cluster_size;
+            return offset;
+        };
+
+        for (uint64_t cluster = 0; cluster < plan.clusters.size(); cluster++)
+        {
+            ClusterPlan state = plan.clusters[(size_t)cluster];
+
+            if (state == ClusterPlan::Unallocated)
+            {
+                continue;
+            }
+
+            uint64_t l1_index = cluster / l2_entries;
+
+            if (l1[(size_t)l1_index] == 0)
+            {
+                l1[(size_t)l1_index] = allocate_cluster();
+                l2_tables[l1_index].resize((size_t)cluster_size);
+            }
+
+            uint8_t *entry = l2_tables[l1_index].data() +
+                cluster % l2_entries * entry_bytes;
+            uint64_t start = cluster * cluster_size;
+            uint64_t host = 0;
+
+            switch (state)
+            {
+            case ClusterPlan::Unallocated:
+                break;
+
+            case ClusterPlan::Zero:
+                put_be64(entry, 1);
+                break;
+
+            case ClusterPlan::Compressed:
+                fill_range(layer, start, data.data(), data.size());
+
+                if (compress_cluster(zstd, data, packed))
+                {
+                    // Packed at byte offsets, descriptor has offset and
+                    // number of additional 512 byte sectors used
+                    unsigned shift = 62 - (plan.cluster_bits - 8);
+                    uint64_t sectors = ((next_offset + packed.size() - 1) >> 9) -
+                        (next_offset >> 9);
+
+                    put_be64(entry, (1ULL << 62) | (sectors << shift) |
+                        next_offset);
+                    write_fully(fd, packed.data(), packed.size(), next_offset);
+                    next_offset += packed.size();
+                    compressed = true;
+                    break;
+                }
+
+                // Stored as it is, like QEMU does
+                host = allocate_cluster();
+                put_be64(entry, (1ULL << 63) | host);
+                write_fully(fd, data.data(), data.size(), host);
+                break;
+
+            case ClusterPlan::Data:
+                fill_range(layer, start, data.data(), data.size());
+                host = allocate_cluster();
+                put_be64(entry, (1ULL << 63) | host);
+                write_fully(fd, data.data(), data.size(), host);
+                break;
+
+            case ClusterPlan::Subclusters:
+            {
+                const std::pair<uint32_t, uint32_t> &masks =
+                    plan.subclusters.at(cluster);
+
+                if (masks.first != 0)
+                {
+                    host = allocate_cluster();
+
+                    for (unsigned sc = 0; sc < 32; sc++)
+                    {
+                        if ((masks.first >> sc) & 1)
+                        {
+                            fill_range(layer, start + sc * subcluster_size,
+                                data.data(), (size_t)subcluster_size);
+                            write_fully(fd, data.data(),
+                                (size_t)subcluster_size,
+                                host + sc * subcluster_size);
+                        }
+                    }
+                }
+
+                put_be64(entry, host != 0 ? (1ULL << 63) | host : 0);
+                put_be64(entry + 8, masks.first |
+                    ((uint64_t)masks.second << 32));
+                break;
+            }
+            }
+        }
+
+        for (const auto &table : l2_tables)
+        {
+            write_fully(fd, table.second.data(), table.second.size(),
+                l1[(size_t)table.first]);
+        }
+
+        std::vector<uint8_t> l1_table((size_t)(l1_clusters * cluster_size));
+
+        for (size_t i = 0; i < l1.size(); i++)
+        {
+            put_be64(l1_table.data() + i * 8,
+                l1[i] != 0 ? (1ULL << 63) | l1[i] : 0);
+        }
+
+        write_fully(fd, l1_table.data(), l1_table.size(), 2 * cluster_size);
+
+        // Header with compression type, padded to 112 bytes, extensions
+        // and backing file name
+        std::vector<uint8_t> header((size_t)cluster_size);
+        uint64_t incompatible = (plan.extended_l2 ? 1 << 4 : 0) |
+            (zstd && compressed ? 1 << 3 : 0);
+        size_t position = 112;
+
+        memcpy(header.data(), "QFI\xfb", 4);
+        put_be32(header.data() + 4, 3);
+        put_be32(header.data() + 20, plan.cluster_bits);
+        put_be64(header.data() + 24, plan.size);
+        put_be32(header.data() + 36, (uint32_t)l1_size);
+        put_be64(header.data() + 40, 2 * cluster_size);
+        put_be64(header.data() + 48, cluster_size);
+        put_be32(header.data() + 56, 1);
+        put_be64(header.data() + 72, incompatible);
+        put_be32(header.data() + 96, 4);
+        put_be32(header.data() + 100, 112);
+        header[104] = zstd && compressed ? 1 : 0;
+
+        if (!backing.empty())
+        {
+            size_t format_length = strlen(backing_format);
+
+            put_be32(header.data() + position, 0xe2792aca);
+            put_be32(header.data() + position + 4, (uint32_t)format_length);
+            memcpy(header.data() + position + 8, backing_format,
+                format_length);
+            position += 8 + ((format_length + 7) & ~(size_t)7);
+        }
+
+        // End of extensions
+        position += 8;
+
+        if (!backing.empty())
+        {
+            put_be64(header.data() + 8, position);
+            put_be32(header.data() + 16, (uint32_t)backing.size());
+            memcpy(header.data() + position, backing.data(), backing.size());
+        }
+
+        write_fully(fd, header.data(), header.size(), 0);
+
+        if (ftruncate(fd, (off_t)next_offset) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "ftruncate");
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+/// Fills buffer with expected contents of [offset, offset + length)
+static void expected_data(const Model &model, uint8_t *buffer, size_t length,
+    uint64_t offset)
+{
+    for (size_t done = 0; done < length;)
+    {
+        uint64_t unit = (offset + done) / model_unit;
+        size_t unit_offset = (size_t)((offset + done) % model_unit);
+        size_t count = std::min(length - done, model_unit - unit_offset);
+        uint8_t data[model_unit];
+
+        if (model[(size_t)unit] == 0)
+        {
+            memset(data, 0, sizeof(data));
+        }
+        else
+        {
+            fill_unit(model[(size_t)unit] - 1u, unit, data);
+        }
+
+        memcpy(buffer + done, data + unit_offset, count);
+        done += count;
+    }
+}
+
+/// Reads random ranges of random length at 512 byte aligned offsets and
+/// compares them with model. Returns number of mismatches.
+static unsigned verify_random(const devio::QcowImage &image,
+    const Model &model, unsigned count, uint64_t max_length)
+{
+    std::mt19937_64 random(7);
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> expected;
+    unsigned errors = 0;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        uint64_t offset = random() % (image.size() / 512) * 512;
+        size_t length = (size_t)std::min<uint64_t>(
+            (1 + random() % (max_length / 512)) * 512, image.size() - offset);
+
+        buffer.resize(length);
+        expected.resize(length);
+
+        expected_data(model, expected.data(), length, offset);
+
+        if (image.read(buffer.data(), length, offset) != (ssize_t)length ||
+            memcmp(buffer.data(), expected.data(), length) != 0)
+        {
+            if (errors++ < 5)
+            {
+                fprintf(stderr, "Mismatch reading %zu bytes at %llu\n",
+                    length, (unsigned long long)offset);
+            }
+        }
+    }
+
+    return errors;
+}
+
+/// Reads whole image in 1 MB requests from one thread and compares it with
+/// model. Only time spent in reads counts. Returns MB/s.
+static double run_sequential_test(const devio::QcowImage &image,
+    const Model &model, bool &mismatch)
+{
+    std::vector<uint8_t> buffer(1 << 20);
+    std::vector<uint8_t> expected(buffer.size());
+    bench_clock::duration elapsed{ 0 };
+
+    mismatch = false;
+
+    for (uint64_t offset = 0; offset < image.size(); offset += buffer.size())
+    {
+        auto start = bench_clock::now();
+
+        ssize_t result = image.read(buffer.data(), buffer.size(), offset);
+
+        elapsed += bench_clock::now() - start;
+
+        if (result <= 0)
+        {
+            throw std::system_error(result < 0 ? (int)-result : EIO,
+                std::generic_category(), "Read failed");
+        }
+
+        expected_data(model, expected.data(), (size_t)result, offset);
+
+        if (memcmp(buffer.data(), expected.data(), (size_t)result) != 0)
+        {
+            mismatch = true;
+        }
+    }
+
+    return image.size() / std::chrono::duration<double>(elapsed).count() / 1e6;
+}
+
+struct LatencyResult
+{
+    double iops;
+    double average_us;
+    double median_us;
+    double p99_us;
+};
+
+/// Random 4 KB reads from several threads, like worker threads of server
+/// serving random requests from clients, with latency of each read
+static LatencyResult run_latency_test(const devio::QcowImage &image,
+    const BenchOptions &options)
+{
+    std::vector<std::vector<uint32_t>> latencies(options.reader_threads);
+    std::atomic<bool> failed{ false };
+    std::vector<std::thread> threads;
+
+    auto start = bench_clock::now();
+    auto end = start + std::chrono::seconds(options.seconds);
+
+    for (unsigned t = 0; t < options.reader_threads; t++)
+    {
+        threads.emplace_back([&, t]
+        {
+            std::mt19937_64 random(t + 1);
+            std::uniform_int_distribution<uint64_t> block(0,
+                image.size() / 4096 - 1);
+            uint8_t buffer[4096];
+            std::vector<uint32_t> &samples = latencies[t];
+
+            for (;;)
+            {
+                auto read_start = bench_clock::now();
+
+                if (read_start >= end)
+                {
+                    break;
+                }
+
+                if (image.read(buffer, sizeof(buffer),
+                    block(random) * 4096) != sizeof(buffer))
+                {
+                    failed = true;
+                    break;
+                }
+
+                samples.push_back((uint32_t)std::min<int64_t>(UINT32_MAX,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        bench_clock::now() - read_start).count()));
+            }
+        });
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    if (failed)
+    {
+        throw std::runtime_error("Random read failed");
+    }
+
+    double elapsed = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+
+    std::vector<uint32_t> all;
+
+    for (const std::vector<uint32_t> &samples : latencies)
+    {
+        all.insert(all.end(), samples.begin(), samples.end());
+    }
+
+    if (all.empty())
+    {
+        throw std::runtime_error("No reads done");
+    }
+
+    std::sort(all.begin(), all.end());
+
+    double total = 0;
+
+    for (uint32_t latency : all)
+    {
+        total += latency;
+    }
+
+    LatencyResult result;
+
+    result.iops = all.size() / elapsed;
+    result.average_us = total / all.size() / 1e3;
+    result.median_us = all[all.size() / 2] / 1e3;
+    result.p99_us = all[all.size() * 99 / 100] / 1e3;
+
+    return result;
+}
+
+static std::string format_size(size_t bytes)
+{
+    if (bytes >= (1 << 20) && bytes % (1 << 20) == 0)
+    {
+        return std::to_string(bytes >> 20) + " MB";
+    }
+
+    return std::to_string(bytes >> 10) + " KB";
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "devio-qcowbench [options]\n"
+        "\n"
+        "Writes a synthetic QCOW2 backing chain, a raw base image under a\n"
+        "QCOW2 image with compressed clusters under a QCOW2 image with\n"
+        "extended L2 entries, and measures random 4 KB read latency of the\n"
+        "native QCOW2 backend for a range of L2 cache sizes.\n"
+        "\n"
+        "-d, --directory path     Where to write images, default /tmp.\n"
+        "-s, --size MB            Virtual disk size, default 4096.\n"
+        "-c, --cluster KB         Cluster size, default 64.\n"
+        "-b, --raw n              Percent of raw base image written, default\n"
+        "                         5.\n"
+        "-p, --allocated n        Percent of clusters allocated in middle\n"
+        "                         image, default 8.\n"
+        "-x, --compressed n       Percent of those compressed, default 50.\n"
+        "-w, --written n          Percent of disk written in top image,\n"
+        "                         default 2.\n"
+        "-z, --zstd               Compress with zstd instead of zlib, needs\n"
+        "                         DEVIO_WITH_ZSTD.\n"
+        "-l, --l2-cache KB,...    L2 cache sizes to measure, default 0 and\n"
+        "                         64 KB and up in steps of 4 until all L2\n"
+        "                         tables fit.\n"
+        "-j, --threads n          Decompression threads, default one per\n"
+        "                         CPU.\n"
+        "-r, --readers n          Threads doing random reads, default 1.\n"
+        "-t, --time seconds       Duration of each latency test, default 2.\n"
+        "-k, --keep               Keep image files.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "directory", required_argument, nullptr, 'd' },
+        { "size", required_argument, nullptr, 's' },
+        { "cluster", required_argument, nullptr, 'c' },
+        { "raw", required_argument, nullptr, 'b' },
+        { "allocated", required_argument, nullptr, 'p' },
+        { "compressed", required_argument, nullptr, 'x' },
+        { "written", required_argument, nullptr, 'w' },
+        { "zstd", no_argument, nullptr, 'z' },
+        { "l2-cache", required_argument, nullptr, 'l' },
+        { "threads", required_argument, nullptr, 'j' },
+        { "readers", required_argument, nullptr, 'r' },
+        { "time", required_argument, nullptr, 't' },
+        { "keep", no_argument, nullptr, 'k' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    BenchOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:s:c:b:p:x:w:zl:j:r:t:kh",
+        long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            options.directory = optarg;
+            break;
+
+        case 's':
+            options.image_size = strtoull(optarg, nullptr, 0) << 20;
+            break;
+
+        case 'c':
+            options.cluster_size = (uint32_t)strtoul(optarg, nullptr, 0) << 10;
+            break;
+
+        case 'b':
+            options.raw_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'p':
+            options.allocated_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'x':
+            options.compressed_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'w':
+            options.written_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'z':
+#ifdef DEVIO_WITH_ZSTD
+            options.zstd = true;
+            break;
+#else
+            fputs("Built without DEVIO_WITH_ZSTD.\n", stderr);
+            return 1;
+#endif
+
+        case 'l':
+            for (char *item = strtok(optarg, ","); item != nullptr;
+                item = strtok(nullptr, ","))
+            {
+                options.cache_sizes.push_back(
+                    (size_t)strtoull(item, nullptr, 0) << 10);
+            }
+            break;
+
+        case 'j':
+            options.decompress_threads = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'r':
+            options.reader_threads = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 't':
+            options.seconds = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'k':
+            options.keep = true;
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // 1 KB to 2 MB clusters, and whole clusters of disk
+    if (options.cluster_size < (1 << 10) || options.cluster_size > (2 << 20) ||
+        (options.cluster_size & (options.cluster_size - 1)) != 0 ||
+        options.image_size < (64 << 20) ||
+        options.image_size % std::max<uint32_t>(options.cluster_size,
+            raw_extent_size) != 0 ||
+        options.raw_percent > 100 || options.allocated_percent > 100 ||
+        options.compressed_percent > 100 || options.written_percent > 100 ||
+        options.reader_threads == 0 || options.seconds == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    unsigned cluster_bits = 0;
+
+    while ((1U << cluster_bits) < options.cluster_size)
+    {
+        cluster_bits++;
+    }
+
+    std::vector<std::string> paths;
+
+    auto remove_files = [&]
+    {
+        if (!options.keep)
+        {
+            for (const std::string &path : paths)
+            {
+                unlink(path.c_str());
+            }
+        }
+    };
+
+    try
+    {
+        std::string name = "devio-qcowbench-" + std::to_string(getpid());
+        std::string base = options.directory + "/" + name;
+        std::mt19937_64 random(1);
+        Model model((size_t)(options.image_size / model_unit));
+
+        // Raw base image is smaller than disk, rest reads as zeros
+        uint64_t raw_size = options.image_size / 4 * 3 / raw_extent_size *
+            raw_extent_size;
+
+        paths.push_back(base + "-base.raw");
+        write_raw(paths.back(), raw_size, options.raw_percent, model, random);
+
+        QcowPlan middle = plan_compressed(options, cluster_bits, model,
+            random);
+
+        paths.push_back(base + "-middle.qcow2");
+        write_qcow2(paths.back(), middle, compressed_layer, name + "-base.raw",
+            "raw", options.zstd);
+        apply_plan(model, middle, compressed_layer);
+
+        QcowPlan top = plan_top(options, cluster_bits, random);
+
+        paths.push_back(base + "-top.qcow2");
+        write_qcow2(paths.back(), top, top_layer, name + "-middle.qcow2",
+            "qcow2", options.zstd);
+        apply_plan(model, top, top_layer);
+
+        std::string top_path = paths.back();
+
+        uint64_t present_units = model.size() -
+            std::count(model.begin(), model.end(), 0);
+
+        devio::QcowOptions qcow_options;
+        qcow_options.decompress_threads = options.decompress_threads;
+
+        uint64_t l2_bytes;
+        double sequential_rate;
+        bool sequential_mismatch;
+
+        {
+            devio::QcowImage image(top_path, qcow_options);
+
+            l2_bytes = image.l2_table_bytes();
+            sequential_rate = run_sequential_test(image, model,
+                sequential_mismatch);
+        }
+
+        printf("Synthetic QCOW2 chain, %llu MB virtual disk, %u KB clusters, "
+            "%s compression%s, %.1f%% of disk allocated, %s of L2 tables\n",
+            (unsigned long long)(options.image_size >> 20),
+            options.cluster_size >> 10, options.zstd ? "zstd" : "zlib",
+            top.extended_l2 ? ", extended L2 entries in top image" : "",
+            100.0 * present_units / model.size(),
+            format_size((size_t)l2_bytes).c_str());
+
+        printf("Sequential 1 MB reads: %.1f MB/s%s\n", sequential_rate,
+            sequential_mismatch ? "  DATA MISMATCH" : "");
+
+        if (options.cache_sizes.empty())
+        {
+            options.cache_sizes.push_back(0);
+
+            for (size_t size = 64 << 10;; size *= 4)
+            {
+                options.cache_sizes.push_back(size);
+
+                if (size >= l2_bytes)
+                {
+                    break;
+                }
+            }
+        }
+
+        printf("%-10s %10s %12s %10s %10s %10s\n", "L2 cache", "Hit rate",
+            "Random IOPS", "Avg us", "p50 us", "p99 us");
+
+        bool mismatch = sequential_mismatch;
+
+        for (size_t cache_size : options.cache_sizes)
+        {
+            qcow_options.l2_cache_size = cache_size;
+
+            devio::QcowImage image(top_path, qcow_options);
+
+            LatencyResult result = run_latency_test(image, options);
+            devio::QcowImage::Statistics stats = image.statistics();
+            uint64_t lookups = stats.l2_hits + stats.l2_misses;
+
+            unsigned errors = verify_random(image, model, 300,
+                4ULL * options.cluster_size);
+
+            printf("%-10s %9.1f%% %12.0f %10.1f %10.1f %10.1f%s\n",
+                format_size(cache_size).c_str(),
+                lookups > 0 ? 100.0 * stats.l2_hits / lookups : 0.0,
+                result.iops, result.average_us, result.median_us,
+                result.p99_us, errors != 0 ? "  DATA MISMATCH" : "");
+
+            fflush(stdout);
+
+            if (errors != 0)
+            {
+                mismatch = true;
+            }
+        }
+
+        remove_files();
+
+        if (options.keep)
+        {
+            printf("Images kept as %s\n", top_path.c_str());
+        }
+
+        return mismatch ? 1 : 0;
+    }
+    catch (const std::exception &ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+
+        remove_files();
+
+        return 1;
+    }
+}
@@ -0,0 +1,1240 @@
+/// qcowimage.cpp
+/// Storage backend for devio server that serves QCOW2 images.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "qcowimage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef DEVIO_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <condition_variable>
+#include <system_error>
+#include <thread>
+
+namespace devio
+{
+
+// QCOW2 layout, all values big endian. Header in first cluster, followed
+// by header extensions. L1 table entries point to L2 tables, L2 table
+// entries point to data clusters, or describe compressed clusters.
+
+static const size_t qcow_header_v2_size = 72;
+static const size_t qcow_header_v3_min_size = 104;
+static const unsigned qcow_min_cluster_bits = 9;
+static const unsigned qcow_max_cluster_bits = 21;
+static const uint32_t qcow_max_backing_name = 1023;
+
+// Incompatible feature bits of version 3 headers. Dirty and corrupt images
+// are served anyway, refcounts are not used by a read-only reader.
+static const uint64_t qcow_incompat_dirty = 1 << 0;
+static const uint64_t qcow_incompat_corrupt = 1 << 1;
+static const uint64_t qcow_incompat_data_file = 1 << 2;
+static const uint64_t qcow_incompat_compression = 1 << 3;
+static const uint64_t qcow_incompat_extended_l2 = 1 << 4;
+
+static const uint32_t qcow_ext_end = 0;
+static const uint32_t qcow_ext_backing_format = 0xe2792aca;
+
+static const unsigned qcow_compression_zlib = 0;
+static const unsigned qcow_compression_zstd = 1;
+
+// L1 and standard L2 entries have host offset in bits 9 to 55. Standard L2
+// entries have compressed flag in bit 62 and, in version 3, all zeros flag
+// in bit 0. Extended L2 entries are followed by a bitmap with allocation
+// of 32 subclusters in low half and all zeros flags in high half.
+static const uint64_t qcow_offset_mask = 0x00fffffffffffe00ULL;
+static const uint64_t qcow_compressed = 1ULL << 62;
+static const uint64_t qcow_zero = 1;
+static const unsigned qcow_subclusters = 32;
+
+// Largest L1 table accepted, 32 M entries, which covers 256 TB with 64 KB
+// clusters
+static const uint32_t qcow_max_l1_size = 32 << 20;
+
+// L2 tables are cached in slices of this many bytes, or whole tables for
+// smaller clusters, so that a cache miss does not read a whole table
+static const uint32_t l2_slice_bytes = 4096;
+
+// Longest backing chain followed, guards against loops
+static const size_t max_chain_length = 256;
+
+static inline uint32_t get_be32(const uint8_t *ptr)
+{
+    return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) |
+        ((uint32_t)ptr[2] << 8) | (uint32_t)ptr[3];
+}
+
+static inline uint64_t get_be64(const uint8_t *ptr)
+{
+    return ((uint64_t)get_be32(ptr) << 32) | (uint64_t)get_be32(ptr + 4);
+}
+
+static std::string directory_of(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+
+    if (slash == std::string::npos)
+    {
+        return ".";
+    }
+
+    return path.substr(0, slash == 0 ? 1 : slash);
+}
+
+static int read_fully(int fd, void *buffer, size_t length, uint64_t offset)
+{
+    size_t done = 0;
+
+    while (done < length)
+    {
+        ssize_t result = pread(fd, (char *)buffer + done, length - done,
+            (off_t)(offset + done));
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -errno;
+        }
+
+        if (result == 0)
+        {
+            return -EIO;
+        }
+
+        done += (size_t)result;
+    }
+
+    return 0;
+}
+
+/// Like read_fully, but end of file is not an error. Compressed cluster
+/// sizes are rounded up to sectors and last one can end before that.
+/// Returns bytes read or -errno.
+static ssize_t read_available(int fd, void *buffer, size_t length,
+    uint64_t offset)
+{
+    size_t done = 0;
+
+    while (done < length)
+    {
+        ssize_t result = pread(fd, (char *)buffer + done, length - done,
+            (off_t)(offset + done));
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -errno;
+        }
+
+        if (result == 0)
+        {
+            break;
+        }
+
+        done += (size_t)result;
+    }
+
+    return (ssize_t)done;
+}
+
+/// Decompression state kept by each thread, so that zlib and zstd contexts
+/// are allocated once per thread instead of once per cluster
+class ThreadDecompressor
+{
+public:
+
+    ThreadDecompressor()
+    {
+        // Raw deflate without zlib header, 4 KB window, like QEMU writes
+        if (inflateInit2(&stream, -12) == Z_OK)
+        {
+            initialized = true;
+        }
+    }
+
+    ~ThreadDecompressor()
+    {
+        if (initialized)
+        {
+            inflateEnd(&stream);
+        }
+
+#ifdef DEVIO_WITH_ZSTD
+        ZSTD_freeDCtx(zstd);
+#endif
+    }
+
+    /// Decompresses a cluster. Input is rounded up to whole sectors and
+    /// may have garbage after compressed data. Returns zero or -errno.
+    int decompress(unsigned compression_type, const uint8_t *input,
+        size_t input_length, uint8_t *output, size_t output_length)
+    {
+        if (compression_type == qcow_compression_zlib)
+        {
+            if (!initialized || inflateReset(&stream) != Z_OK)
+            {
+                return -ENOMEM;
+            }
+
+            stream.next_in = (Bytef *)input;
+            stream.avail_in = (uInt)input_length;
+            stream.next_out = output;
+            stream.avail_out = (uInt)output_length;
+
+            int result = inflate(&stream, Z_FINISH);
+
+            // Output full before end of stream is seen is fine, end of
+            // stream can be in bytes not read
+            if ((result != Z_STREAM_END && result != Z_BUF_ERROR &&
+                result != Z_OK) || stream.avail_out != 0)
+            {
+                return -EIO;
+            }
+
+            return 0;
+        }
+
+#ifdef DEVIO_WITH_ZSTD
+        if (compression_type == qcow_compression_zstd)
+        {
+            if (zstd == nullptr && (zstd = ZSTD_createDCtx()) == nullptr)
+            {
+                return -ENOMEM;
+            }
+
+            // One frame, followed by padding
+            size_t frame_length = ZSTD_findFrameCompressedSize(input,
+                input_length);
+
+            if (ZSTD_isError(frame_length))
+            {
+                return -EIO;
+            }
+
+            size_t result = ZSTD_decompressDCtx(zstd, output, output_length,
+                input, frame_length);
+
+            if (ZSTD_isError(result) || result != output_length)
+            {
+                return -EIO;
+            }
+
+            return 0;
+        }
+#endif
+
+        return -EOPNOTSUPP;
+    }
+
+    std::vector<uint8_t> stored;
+    std::vector<uint8_t> cluster;
+
+private:
+
+    z_stream stream = { };
+    bool initialized = false;
+
+#ifdef DEVIO_WITH_ZSTD
+    ZSTD_DCtx *zstd = nullptr;
+#endif
+};
+
+QcowImage::QcowImage(const std::string &path, const QcowOptions &options)
+    : options(options)
+{
+    try
+    {
+        layers.emplace_back();
+        layers.back().path = path;
+
+        open_layer(layers.back());
+
+        if (layers.back().raw)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                path + " is not a QCOW2 image");
+        }
+
+        while (open_backing())
+        {
+            if (layers.size() > max_chain_length)
+            {
+                throw std::system_error(ELOOP, std::generic_category(),
+                    "Backing chain of " + path + " is too long");
+            }
+        }
+    }
+    catch (...)
+    {
+        for (const Layer &layer : layers)
+        {
+            if (layer.fd >= 0)
+            {
+                close(layer.fd);
+            }
+        }
+
+        throw;
+    }
+
+    unsigned thread_count = this->options.decompress_threads;
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    decompress_pool.reset(new WorkerPool(thread_count));
+}
+
+QcowImage::~QcowImage()
+{
+    // Queued reads refer to layers
+    decompress_pool.reset();
+
+    for (const Layer &layer : layers)
+    {
+        close(layer.fd);
+    }
+}
+
+bool QcowImage::is_qcow_file(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    uint8_t header[8];
+
+    bool result = read_fully(fd, header, sizeof(header), 0) == 0 &&
+        memcmp(header, "QFI\xfb", 4) == 0 &&
+        (get_be32(header + 4) == 2 || get_be32(header + 4) == 3);
+
+    close(fd);
+
+    return result;
+}
+
+void QcowImage::open_layer(Layer &layer)
+{
+    layer.fd = open(layer.path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (layer.fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot open " + layer.path);
+    }
+
+    auto invalid = [&layer](const char *reason)
+    {
+        return std::system_error(EINVAL, std::generic_category(),
+            layer.path + ": " + reason);
+    };
+
+    // Size of raw backing files, including block devices
+    off_t file_size = lseek(layer.fd, 0, SEEK_END);
+
+    if (file_size < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot query size of " + layer.path);
+    }
+
+    uint8_t header[qcow_header_v3_min_size + 8] = { };
+
+    ssize_t header_read = read_available(layer.fd, header, sizeof(header), 0);
+
+    if (header_read < 0)
+    {
+        throw std::system_error((int)-header_read, std::generic_category(),
+            "Cannot read " + layer.path);
+    }
+
+    bool has_signature = header_read >= 8 && memcmp(header, "QFI\xfb", 4) == 0;
+
+    if (layer.backing_format == "raw" ||
+        (layer.backing_format.empty() && !has_signature))
+    {
+        layer.raw = true;
+        layer.size = (uint64_t)file_size;
+        return;
+    }
+
+    if (!layer.backing_format.empty() && layer.backing_format != "qcow2")
+    {
+        throw std::system_error(ENOTSUP, std::generic_category(),
+            layer.path + ": Backing format " + layer.backing_format +
+            " is not supported");
+    }
+
+    uint32_t version = get_be32(header + 4);
+
+    if (!has_signature || (size_t)header_read < qcow_header_v2_size)
+    {
+        throw invalid("Not a QCOW2 image");
+    }
+
+    if (version != 2 && version != 3)
+    {
+        throw std::system_error(ENOTSUP, std::generic_category(),
+            layer.path + ": QCOW version " + std::to_string(version) +
+            " is not supported");
+    }
+
+    uint64_t backing_offset = get_be64(header + 8);
+    uint32_t backing_length = get_be32(header + 16);
+    layer.cluster_bits = get_be32(header + 20);
+    layer.size = get_be64(header + 24);
+    uint32_t crypt_method = get_be32(header + 32);
+    uint32_t l1_size = get_be32(header + 36);
+    uint64_t l1_offset = get_be64(header + 40);
+    uint64_t incompatible = 0;
+    uint32_t header_length = (uint32_t)qcow_header_v2_size;
+
+    if (layer.cluster_bits < qcow_min_cluster_bits ||
+        layer.cluster_bits > qcow_max_cluster_bits)
+    {
+        throw invalid("Invalid cluster size");
+    }
+
+    if (crypt_method != 0)
+    {
+        throw std::system_error(ENOTSUP, std::generic_category(),
+            layer.path + ": Encrypted images are not supported");
+    }
+
+    uint32_t cluster_size = 1U << layer.cluster_bits;
+
+    if (version == 3)
+    {
+        if ((size_t)header_read < qcow_header_v3_min_size)
+        {
+            throw invalid("Truncated header");
+        }
+
+        incompatible = get_be64(header + 72);
+        header_length = get_be32(header + 100);
+
+        if (header_length < qcow_header_v3_min_size ||
+            header_length > cluster_size)
+        {
+            throw invalid("Invalid header length");
+        }
+
+        if ((incompatible & qcow_incompat_data_file) != 0)
+        {
+            throw std::system_error(ENOTSUP, std::generic_category(),
+                layer.path + ": External data files are not supported");
+        }
+
+        if ((incompatible & ~(qcow_incompat_dirty | qcow_incompat_corrupt |
+            qcow_incompat_compression | qcow_incompat_extended_l2)) != 0)
+        {
+            throw std::system_error(ENOTSUP, std::generic_category(),
+                layer.path + ": Image uses unknown incompatible features");
+        }
+
+        if ((incompatible & qcow_incompat_compression) != 0)
+        {
+            if (header_length <= qcow_header_v3_min_size)
+            {
+                throw invalid("Invalid header length");
+            }
+
+            layer.compression_type = header[104];
+
+            if (layer.compression_type != qcow_compression_zlib &&
+                layer.compression_type != qcow_compression_zstd)
+            {
+                throw std::system_error(ENOTSUP, std::generic_category(),
+                    layer.path + ": Compression type " +
+                    std::to_string(layer.compression_type) +
+                    " is not supported");
+            }
+
+#ifndef DEVIO_WITH_ZSTD
+            if (layer.compression_type == qcow_compression_zstd)
+            {
+                throw std::system_error(ENOTSUP, std::generic_category(),
+                    layer.path + ": zstd compressed images need a server "
+                    "built with DEVIO_WITH_ZSTD");
+            }
+#endif
+        }
+
+        // Extended L2 entries need at least 16 KB clusters, so that
+        // subclusters are at least 512 bytes
+        if ((incompatible & qcow_incompat_extended_l2) != 0)
+        {
+            if (layer.cluster_bits < 14)
+            {
+                throw invalid("Extended L2 entries with too small clusters");
+            }
+
+            layer.extended_l2 = true;
+        }
+    }
+
+    layer.l2_bits = layer.cluster_bits - (layer.extended_l2 ? 4 : 3);
+
+    // Header extensions, within first cluster
+    std::vector<uint8_t> first_cluster(cluster_size);
+
+    ssize_t cluster_read = read_available(layer.fd, first_cluster.data(),
+        first_cluster.size(), 0);
+
+    if (cluster_read < 0)
+    {
+        throw std::system_error((int)-cluster_read, std::generic_category(),
+            "Cannot read " + layer.path);
+    }
+
+    first_cluster.resize((size_t)cluster_read);
+
+    std::string backing_format;
+
+    for (size_t position = header_length;
+        position + 8 <= first_cluster.size();)
+    {
+        uint32_t type = get_be32(first_cluster.data() + position);
+        uint32_t length = get_be32(first_cluster.data() + position + 4);
+
+        if (type == qcow_ext_end)
+        {
+            break;
+        }
+
+        if (length > first_cluster.size() - position - 8)
+        {
+            throw invalid("Invalid header extension");
+        }
+
+        if (type == qcow_ext_backing_format)
+        {
+            backing_format.assign(
+                (const char *)first_cluster.data() + position + 8, length);
+        }
+
+        position += 8 + (((size_t)length + 7) & ~(size_t)7);
+    }
+
+    if (backing_offset != 0)
+    {
+        if (backing_length == 0 || backing_length > qcow_max_backing_name)
+        {
+            throw invalid("Invalid backing file name");
+        }
+
+        std::string name(backing_length, '\0');
+
+        int result = read_fully(layer.fd, &name[0], name.size(),
+            backing_offset);
+
+        if (result < 0)
+        {
+            throw std::system_error(-result, std::generic_category(),
+                "Cannot read backing file name of " + layer.path);
+        }
+
+        // Absolute names are also looked for by file name in directory of
+        // image, where images copied from another system are usually kept
+        // together
+        if (name[0] == '/')
+        {
+            layer.backing_paths.push_back(name);
+            layer.backing_paths.push_back(directory_of(layer.path) + "/" +
+                name.substr(name.rfind('/') + 1));
+        }
+        else
+        {
+            layer.backing_paths.push_back(directory_of(layer.path) + "/" +
+                name);
+        }
+
+        layer.backing_format = backing_format;
+    }
+
+    // Every cluster of virtual disk needs an L1 entry
+    uint64_t bytes_per_l1_entry = 1ULL << (layer.cluster_bits + layer.l2_bits);
+    uint64_t l1_needed = (layer.size + bytes_per_l1_entry - 1) /
+        bytes_per_l1_entry;
+
+    if (l1_size > qcow_max_l1_size || l1_size < l1_needed ||
+        (l1_size > 0 && (l1_offset & (cluster_size - 1)) != 0))
+    {
+        throw invalid("Invalid L1 table");
+    }
+
+    std::vector<uint8_t> table((size_t)l1_needed * 8);
+
+    int result = read_fully(layer.fd, table.data(), table.size(), l1_offset);
+
+    if (result < 0)
+    {
+        throw std::system_error(-result, std::generic_category(),
+            "Cannot read L1 table of " + layer.path);
+    }
+
+    layer.l1.resize((size_t)l1_needed);
+
+    for (size_t i = 0; i < layer.l1.size(); i++)
+    {
+        uint64_t l2_offset = get_be64(table.data() + i * 8) & qcow_offset_mask;
+
+        if ((l2_offset & (cluster_size - 1)) != 0)
+        {
+            throw invalid("Unaligned L2 table");
+        }
+
+        layer.l1[i] = l2_offset;
+    }
+}
+
+bool QcowImage::open_backing()
+{
+    if (layers.back().backing_paths.empty())
+    {
+        return false;
+    }
+
+    // Copied, layers may be reallocated below
+    std::string child = layers.back().path;
+    std::vector<std::string> candidates = layers.back().backing_paths;
+    std::string format = layers.back().backing_format;
+
+    for (const std::string &candidate : candidates)
+    {
+        struct stat st;
+        if (stat(candidate.c_str(), &st) < 0)
+        {
+            continue;
+        }
+
+        layers.emplace_back();
+        layers.back().path = candidate;
+        layers.back().backing_format = format;
+
+        open_layer(layers.back());
+
+        return true;
+    }
+
+    throw std::system_error(ENOENT, std::generic_category(),
+        "Cannot find backing file of " + child);
+}
+
+int QcowImage::get_l2_entries(size_t index, uint64_t l2_offset,
+    uint64_t first, uint64_t count, L2Slice &entries,
+    uint64_t &entries_first) const
+{
+    const Layer &layer = layers[index];
+    unsigned words = layer.extended_l2 ? 2 : 1;
+    std::vector<uint8_t> raw;
+
+    // Without cache, only entries of this request are read
+    if (options.l2_cache_size == 0)
+    {
+        raw.resize((size_t)(count * words * 8));
+
+        l2_misses++;
+
+        int result = read_fully(layer.fd, raw.data(), raw.size(),
+            l2_offset + first * words * 8);
+
+        if (result < 0)
+        {
+            return result;
+        }
+
+        std::shared_ptr<std::vector<uint64_t>> loaded =
+            std::make_shared<std::vector<uint64_t>>(raw.size() / 8);
+
+        for (size_t i = 0; i < loaded->size(); i++)
+        {
+            (*loaded)[i] = get_be64(raw.data() + i * 8);
+        }
+
+        entries = loaded;
+        entries_first = first;
+        return 0;
+    }
+
+    uint32_t slice_size = std::min(l2_slice_bytes, 1U << layer.cluster_bits);
+    uint64_t slice_entries = slice_size / (words * 8);
+    uint64_t slice_offset = l2_offset + first / slice_entries * slice_size;
+
+    // File offsets of slices are multiples of 512, layer index fits below
+    uint64_t key = slice_offset | index;
+
+    entries_first = first / slice_entries * slice_entries;
+
+    {
+        std::lock_guard<std::mutex> lock(l2_mutex);
+
+        auto it = l2_cache.find(key);
+
+        if (it != l2_cache.end())
+        {
+            l2_lru.splice(l2_lru.begin(), l2_lru, it->second.second);
+            entries = it->second.first;
+            l2_hits++;
+            return 0;
+        }
+    }
+
+    l2_misses++;
+
+    raw.resize(slice_size);
+
+    int result = read_fully(layer.fd, raw.data(), raw.size(), slice_offset);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    std::shared_ptr<std::vector<uint64_t>> loaded =
+        std::make_shared<std::vector<uint64_t>>(slice_size / 8);
+
+    for (size_t i = 0; i < loaded->size(); i++)
+    {
+        (*loaded)[i] = get_be64(raw.data() + i * 8);
+    }
+
+    entries = loaded;
+
+    std::lock_guard<std::mutex> lock(l2_mutex);
+
+    // Another thread may have read the same slice meanwhile
+    if (l2_cache.find(key) == l2_cache.end())
+    {
+        l2_lru.push_front(key);
+        l2_cache.emplace(key, std::make_pair(entries, l2_lru.begin()));
+        l2_cached_bytes += slice_size;
+
+        while (l2_cached_bytes > options.l2_cache_size && !l2_lru.empty())
+        {
+            auto victim = l2_cache.find(l2_lru.back());
+
+            l2_cached_bytes -= victim->second.first->size() * 8;
+            l2_cache.erase(victim);
+            l2_lru.pop_back();
+            l2_evictions++;
+        }
+    }
+
+    return 0;
+}
+
+void QcowImage::add_extent(std::vector<Extent> &extents, uint64_t offset,
+    uint64_t length, int layer, uint64_t file_offset)
+{
+    if (!extents.empty())
+    {
+        Extent &last = extents.back();
+
+        if (last.layer == layer && last.stored_size == 0 &&
+            last.offset + last.length == offset &&
+            (layer < 0 || last.file_offset + last.length == file_offset))
+        {
+            last.length += length;
+            return;
+        }
+    }
+
+    extents.push_back(Extent{ offset, length, layer, file_offset, 0, 0 });
+}
+
+int QcowImage::resolve(size_t index, uint64_t offset, uint64_t length,
+    std::vector<Extent> &extents) const
+{
+    // Below last backing file, or beyond end of a backing file that is
+    // smaller than image, is zeros
+    if (index >= layers.size() || offset >= layers[index].size)
+    {
+        add_extent(extents, offset, length, -1, 0);
+        return 0;
+    }
+
+    const Layer &layer = layers[index];
+    uint64_t end = offset + length;
+
+    if (end > layer.size)
+    {
+        int result = resolve(index, offset, layer.size - offset, extents);
+
+        if (result == 0)
+        {
+            add_extent(extents, layer.size, end - layer.size, -1, 0);
+        }
+
+        return result;
+    }
+
+    if (layer.raw)
+    {
+        add_extent(extents, offset, length, (int)index, offset);
+        return 0;
+    }
+
+    uint64_t cluster_size = 1ULL << layer.cluster_bits;
+    uint64_t subcluster_size = cluster_size / qcow_subclusters;
+    uint64_t l2_entries = 1ULL << layer.l2_bits;
+    unsigned words = layer.extended_l2 ? 2 : 1;
+
+    // Consecutive ranges not allocated in this layer are looked up in
+    // backing file together
+    uint64_t backing_start = 0;
+    uint64_t backing_length = 0;
+
+    auto flush_backing = [&]() -> int
+    {
+        if (backing_length == 0)
+        {
+            return 0;
+        }
+
+        int result = resolve(index + 1, backing_start, backing_length,
+            extents);
+
+        backing_length = 0;
+
+        return result;
+    };
+
+    auto to_backing = [&](uint64_t start, uint64_t run_length)
+    {
+        if (backing_length == 0)
+        {
+            backing_start = start;
+        }
+
+        backing_length += run_length;
+    };
+
+    // Flushes pending backing range before an extent of this layer
+    auto add = [&](uint64_t start, uint64_t run_length, int target,
+        uint64_t file_offset) -> int
+    {
+        int result = flush_backing();
+
+        if (result == 0)
+        {
+            add_extent(extents, start, run_length, target, file_offset);
+        }
+
+        return result;
+    };
+
+    while (offset < end)
+    {
+        uint64_t cluster = offset >> layer.cluster_bits;
+        uint64_t l1_index = cluster >> layer.l2_bits;
+        uint64_t table_end = std::min(end,
+            (l1_index + 1) << (layer.cluster_bits + layer.l2_bits));
+        uint64_t l2_offset = layer.l1[(size_t)l1_index];
+
+        if (l2_offset == 0)
+        {
+            to_backing(offset, table_end - offset);
+            offset = table_end;
+            continue;
+        }
+
+        // All clusters of request in this L2 table, one slice at a time
+        uint64_t first = cluster & (l2_entries - 1);
+        uint64_t last = ((table_end - 1) >> layer.cluster_bits) &
+            (l2_entries - 1);
+        L2Slice slice;
+        uint64_t slice_first;
+
+        int result = get_l2_entries(index, l2_offset, first,
+            last - first + 1, slice, slice_first);
+
+        if (result < 0)
+        {
+            return result;
+        }
+
+        uint64_t slice_end = std::min(last + 1,
+            slice_first + slice->size() / words);
+
+        for (uint64_t entry_index = first; entry_index < slice_end;
+            entry_index++)
+        {
+            uint64_t cluster_start = offset & ~(cluster_size - 1);
+            uint64_t cluster_end = std::min(table_end,
+                cluster_start + cluster_size);
+            uint64_t entry = (*slice)[(size_t)((entry_index - slice_first) *
+                words)];
+            uint64_t host = entry & qcow_offset_mask;
+
+            if ((entry & qcow_compressed) != 0)
+            {
+                // Host offset in low bits, number of additional 512 byte
+                // sectors above it
+                unsigned shift = 62 - (layer.cluster_bits - 8);
+                uint64_t stored_offset = entry & ((1ULL << shift) - 1);
+                uint64_t sectors = ((entry & (qcow_compressed - 1)) >> shift) + 1;
+
+                result = flush_backing();
+
+                if (result < 0)
+                {
+                    return result;
+                }
+
+                extents.push_back(Extent{ offset, cluster_end - offset,
+                    (int)index, stored_offset,
+                    (uint32_t)(sectors * 512 - (stored_offset & 511)),
+                    (uint32_t)(offset - cluster_start) });
+            }
+            else if (layer.extended_l2)
+            {
+                uint64_t bitmap = (*slice)[(size_t)((entry_index -
+                    slice_first) * words + 1)];
+
+                // Runs of subclusters in same state
+                for (uint64_t position = offset; position < cluster_end;)
+                {
+                    unsigned subcluster = (unsigned)((position -
+                        cluster_start) / subcluster_size);
+                    auto state = [bitmap](unsigned sc)
+                    {
+                        return ((bitmap >> sc) & 1) != 0 ? 1 :
+                            ((bitmap >> (sc + 32)) & 1) != 0 ? 2 : 0;
+                    };
+                    int run_state = state(subcluster);
+                    uint64_t run_end = cluster_start +
+                        (subcluster + 1) * subcluster_size;
+
+                    while (run_end < cluster_end &&
+                        state((unsigned)((run_end - cluster_start) /
+                        subcluster_size)) == run_state)
+                    {
+                        run_end += subcluster_size;
+                    }
+
+                    run_end = std::min(run_end, cluster_end);
+
+                    if (run_state == 1)
+                    {
+                        if (host == 0 || (host & (cluster_size - 1)) != 0)
+                        {
+                            return -EIO;
+                        }
+
+                        result = add(position, run_end - position,
+                            (int)index, host + position - cluster_start);
+                    }
+                    else if (run_state == 2)
+                    {
+                        result = add(position, run_end - position, -1, 0);
+                    }
+                    else
+                    {
+                        to_backing(position, run_end - position);
+                    }
+
+                    if (result < 0)
+                    {
+                        return result;
+                    }
+
+                    position = run_end;
+                }
+            }
+            else if ((entry & qcow_zero) != 0)
+            {
+                result = add(offset, cluster_end - offset, -1, 0);
+            }
+            else if (host != 0)
+            {
+                if ((host & (cluster_size - 1)) != 0)
+                {
+                    return -EIO;
+                }
+
+                result = add(offset, cluster_end - offset, (int)index,
+                    host + offset - cluster_start);
+            }
+            else
+            {
+                to_backing(offset, cluster_end - offset);
+            }
+
+            if (result < 0)
+            {
+                return result;
+            }
+
+            offset = cluster_end;
+        }
+    }
+
+    return flush_backing();
+}
+
+namespace
+{
+
+/// Reads and decompressions of one request, taken one at a time by
+/// requesting thread and by pool threads until all are done
+struct ReadBatch
+{
+    struct ReadOp
+    {
+        uint8_t *buffer;
+        int fd;
+        uint64_t file_offset;
+        size_t length;
+
+        /// For compressed clusters, stored size and where buffer starts in
+        /// decompressed cluster
+        uint32_t stored_size;
+        uint32_t cluster_offset;
+        uint32_t cluster_size;
+        unsigned compression_type;
+    };
+
+    std::vector<ReadOp> ops;
+    std::atomic<size_t> next{ 0 };
+
+    std::mutex mutex;
+    std::condition_variable all_done;
+    size_t completed = 0;
+    int error = 0;
+
+    static int run_op(const ReadOp &op)
+    {
+        if (op.stored_size == 0)
+        {
+            return read_fully(op.fd, op.buffer, op.length, op.file_offset);
+        }
+
+        static thread_local ThreadDecompressor decompressor;
+
+        std::vector<uint8_t> &stored = decompressor.stored;
+        stored.resize(op.stored_size);
+
+        ssize_t stored_length = read_available(op.fd, stored.data(),
+            stored.size(), op.file_offset);
+
+        if (stored_length < 0)
+        {
+            return (int)stored_length;
+        }
+
+        // Whole clusters are decompressed directly into request buffer
+        if (op.cluster_offset == 0 && op.length == op.cluster_size)
+        {
+            return decompressor.decompress(op.compression_type, stored.data(),
+                (size_t)stored_length, op.buffer, op.length);
+        }
+
+        std::vector<uint8_t> &cluster = decompressor.cluster;
+        cluster.resize(op.cluster_size);
+
+        int result = decompressor.decompress(op.compression_type,
+            stored.data(), (size_t)stored_length, cluster.data(),
+            cluster.size());
+
+        if (result == 0)
+        {
+            memcpy(op.buffer, cluster.data() + op.cluster_offset, op.length);
+        }
+
+        return result;
+    }
+
+    /// Returns number of operations done
+    size_t run()
+    {
+        size_t count = 0;
+
+        for (;;)
+        {
+            size_t index = next++;
+
+            if (index >= ops.size())
+            {
+                return count;
+            }
+
+            int result = run_op(ops[index]);
+
+            count++;
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (result < 0 && error == 0)
+            {
+                error = result;
+            }
+
+            if (++completed == ops.size())
+            {
+                all_done.notify_all();
+            }
+        }
+    }
+};
+
+}
+
+ssize_t QcowImage::read(void *buffer, size_t length, uint64_t offset) const
+{
+    if (offset >= size() || length == 0)
+    {
+        return 0;
+    }
+
+    length = (size_t)std::min<uint64_t>(length, size() - offset);
+
+    std::vector<Extent> extents;
+
+    int result = resolve(0, offset, length, extents);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    std::shared_ptr<ReadBatch> batch = std::make_shared<ReadBatch>();
+
+    for (const Extent &extent : extents)
+    {
+        uint8_t *target = (uint8_t *)buffer + (extent.offset - offset);
+
+        if (extent.layer < 0)
+        {
+            memset(target, 0, (size_t)extent.length);
+            zero_bytes += extent.length;
+            continue;
+        }
+
+        const Layer &layer = layers[extent.layer];
+
+        batch->ops.push_back(ReadBatch::ReadOp{ target, layer.fd,
+            extent.file_offset, (size_t)extent.length, extent.stored_size,
+            extent.cluster_offset, 1U << layer.cluster_bits,
+            layer.compression_type });
+
+        if (extent.stored_size != 0)
+        {
+            compressed_clusters++;
+        }
+        else
+        {
+            data_reads++;
+        }
+    }
+
+    if (batch->ops.empty())
+    {
+        return (ssize_t)length;
+    }
+
+    // Pool threads help with operations after the first one. Those that
+    // start after this thread has done all of them find nothing left to do.
+    size_t helpers = std::min(batch->ops.size() - 1, decompress_pool->size());
+
+    for (size_t i = 0; i < helpers; i++)
+    {
+        decompress_pool->submit([this, batch]
+        {
+            parallel_reads += batch->run();
+        });
+    }
+
+    batch->run();
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+
+    batch->all_done.wait(lock,
+        [&batch] { return batch->completed == batch->ops.size(); });
+
+    if (batch->error != 0)
+    {
+        return batch->error;
+    }
+
+    return (ssize_t)length;
+}
+
+ssize_t QcowImage::write(const struct iovec *, int, uint64_t) const
+{
+    return -EROFS;
+}
+
+int QcowImage::punch_hole(uint64_t, uint64_t) const
+{
+    return -EOPNOTSUPP;
+}
+
+int QcowImage::flush() const
+{
+    return 0;
+}
+
+uint64_t QcowImage::l2_table_bytes() const
+{
+    uint64_t bytes = 0;
+
+    for (const Layer &layer : layers)
+    {
+        for (uint64_t l2_offset : layer.l1)
+        {
+            if (l2_offset != 0)
+            {
+                bytes += 1ULL << layer.cluster_bits;
+            }
+        }
+    }
+
+    return bytes;
+}
+
+QcowImage::Statistics QcowImage::statistics() const
+{
+    Statistics stats;
+
+    stats.l2_hits = l2_hits;
+    stats.l2_misses = l2_misses;
+    stats.l2_evictions = l2_evictions;
+    stats.data_reads = data_reads;
+    stats.compressed_clusters = compressed_clusters;
+    stats.parallel_reads = parallel_reads;
+    stats.zero_bytes = zero_bytes;
+
+    return stats;
+}
+
+}
@@ -0,0 +1,221 @@
+/// qcowimage.h
+/// Storage backend for devio server that serves QCOW2 images natively,
+/// including images with backing file chains. L1 tables of the image and
+/// its backing files are loaded when image is opened. L2 tables are read
+/// in slices and kept in a least recently used cache limited to a number
+/// of bytes. Clusters of a request are looked up together, one slice at a
+/// time, and compressed clusters are decompressed on a worker pool while
+/// the requesting thread reads or decompresses other clusters.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_QCOWIMAGE_H_
+#define _DEVIOSERVER_QCOWIMAGE_H_
+
+#include "imagebackend.h"
+#include "workerpool.h"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace devio
+{
+
+struct QcowOptions
+{
+    /// Largest number of bytes of L2 table slices kept in memory, for image
+    /// and backing files together. Zero disables cache, L2 entries of each
+    /// request are then read from image files for every request.
+    size_t l2_cache_size = 32 << 20;
+
+    /// Number of threads that read and decompress clusters of requests
+    /// that span several clusters, zero for one per CPU
+    unsigned decompress_threads = 0;
+};
+
+class QcowImage : public ImageBackend
+{
+public:
+
+    /// Opens image and its backing files, named in header relative to
+    /// directory of image that refers to them. Throws std::system_error if
+    /// any of them cannot be opened, is not a valid QCOW2 file or uses
+    /// features not supported, such as encryption or external data files.
+    QcowImage(const std::string &path, const QcowOptions &options);
+    ~QcowImage();
+
+    QcowImage(const QcowImage &) = delete;
+    QcowImage &operator=(const QcowImage &) = delete;
+
+    /// True if file at path starts with QCOW2 signature, version 2 or 3
+    static bool is_qcow_file(const std::string &path);
+
+    uint64_t size() const override
+    {
+        return layers.front().size;
+    }
+
+    bool read_only() const override
+    {
+        return true;
+    }
+
+    bool supports_punch_hole() const override
+    {
+        return false;
+    }
+
+    ssize_t read(void *buffer, size_t length, uint64_t offset) const override;
+
+    ssize_t write(const struct iovec *iov, int iovcnt,
+        uint64_t offset) const override;
+
+    using ImageBackend::write;
+
+    int punch_hole(uint64_t offset, uint64_t length) const override;
+
+    int flush() const override;
+
+    uint32_t cluster_size() const
+    {
+        return 1U << layers.front().cluster_bits;
+    }
+
+    /// Number of files in backing chain, including image itself
+    size_t chain_length() const
+    {
+        return layers.size();
+    }
+
+    /// Bytes of all L2 tables referenced by L1 tables in chain, which is
+    /// cache size needed to keep all of them in memory
+    uint64_t l2_table_bytes() const;
+
+    struct Statistics
+    {
+        /// L2 table slices found in cache, and slices read from image files,
+        /// into cache or directly for one request if cache is disabled
+        uint64_t l2_hits;
+        uint64_t l2_misses;
+
+        /// Slices dropped from cache to stay within cache size
+        uint64_t l2_evictions;
+
+        /// Reads of uncompressed data sent to image files
+        uint64_t data_reads;
+
+        /// Compressed clusters read and decompressed, and reads and
+        /// decompressions done on worker pool while requesting thread did
+        /// another one
+        uint64_t compressed_clusters;
+        uint64_t parallel_reads;
+
+        /// Bytes of unallocated or zero clusters served without I/O
+        uint64_t zero_bytes;
+    };
+
+    Statistics statistics() const;
+
+private:
+
+    /// One file in backing chain, image itself first. Backing files
+    /// without QCOW2 signature, or with backing format "raw", are raw
+    /// images.
+    struct Layer
+    {
+        std::string path;
+        int fd = -1;
+        bool raw = false;
+        uint64_t size = 0;
+        unsigned cluster_bits = 0;
+
+        /// Entries of an L2 table are 64 bits, or 128 bits with extended
+        /// L2 entries that describe 32 subclusters each
+        bool extended_l2 = false;
+        unsigned l2_bits = 0;
+        unsigned compression_type = 0;
+
+        /// Host offsets of L2 tables, zero for unallocated ones
+        std::vector<uint64_t> l1;
+
+        std::vector<std::string> backing_paths;
+        std::string backing_format;
+    };
+
+    /// Where a range of virtual disk is found. Layer is index in layers, or
+    /// -1 for ranges that read as zeros. Compressed ranges are part of one
+    /// cluster, which is stored_size bytes at file_offset and needs to be
+    /// decompressed, cluster_offset is where range starts in cluster.
+    struct Extent
+    {
+        uint64_t offset;
+        uint64_t length;
+        int layer;
+        uint64_t file_offset;
+        uint32_t stored_size;
+        uint32_t cluster_offset;
+    };
+
+    typedef std::shared_ptr<const std::vector<uint64_t>> L2Slice;
+
+    /// Appends an extent, merged with last one if it continues it
+    static void add_extent(std::vector<Extent> &extents, uint64_t offset,
+        uint64_t length, int layer, uint64_t file_offset);
+
+    void open_layer(Layer &layer);
+
+    /// Opens backing file of last layer. Returns false if it has none.
+    bool open_backing();
+
+    /// Entries [first, first + count) of L2 table at l2_offset, in host
+    /// byte order, two per entry with extended L2 entries. From cache, or
+    /// read from file into cache. Entries are returned in entries, which
+    /// starts at entry entries_first.
+    int get_l2_entries(size_t index, uint64_t l2_offset, uint64_t first,
+        uint64_t count, L2Slice &entries, uint64_t &entries_first) const;
+
+    /// Appends extents of range [offset, offset + length) of layer and its
+    /// backing files. Returns zero or -errno.
+    int resolve(size_t index, uint64_t offset, uint64_t length,
+        std::vector<Extent> &extents) const;
+
+    std::vector<Layer> layers;
+
+    QcowOptions options;
+
+    /// Slices are keyed by layer index and file offset of slice
+    mutable std::mutex l2_mutex;
+    mutable std::unordered_map<uint64_t,
+        std::pair<L2Slice, std::list<uint64_t>::iterator>> l2_cache;
+
+    /// Cached slice keys, most recently used first
+    mutable std::list<uint64_t> l2_lru;
+    mutable size_t l2_cached_bytes = 0;
+
+    mutable std::atomic<uint64_t> l2_hits{ 0 };
+    mutable std::atomic<uint64_t> l2_misses{ 0 };
+    mutable std::atomic<uint64_t> l2_evictions{ 0 };
+    mutable std::atomic<uint64_t> data_reads{ 0 };
+    mutable std::atomic<uint64_t> compressed_clusters{ 0 };
+    mutable std::atomic<uint64_t> parallel_reads{ 0 };
+    mutable std::atomic<uint64_t> zero_bytes{ 0 };
+
+    /// Created last and stopped first, queued reads refer to layers
+    std::unique_ptr<WorkerPool> decompress_pool;
+};
+
+}
+
+#endif // _DEVIOSERVER_QCOWIMAGE_H_
@@ -0,0 +1,1450 @@
+/// server.cpp
+/// Devio TCP/IP server event loop and request execution.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "server.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <system_error>
+#include <thread>
+
+namespace devio
+{
+
+/// epoll user data values that are not connection ids
+enum : uint64_t
+{
+    LISTEN_EVENT_ID = 0,
+    COMPLETION_EVENT_ID = 1,
+    TIMER_EVENT_ID = 2,
+    URING_EVENT_ID = 3,
+    FIRST_CONNECTION_ID = 16
+};
+
+/// Size of per connection buffer for incoming request headers. Must hold
+/// the largest vectored request header.
+constexpr size_t INPUT_BUFFER_SIZE = 256 << 10;
+
+static_assert(INPUT_BUFFER_SIZE >=
+    IMDPROXY_VECTORED_REQ_SIZE(IMDPROXY_VECTORED_MAX_EXTENTS),
+    "Input buffer too small for vectored requests");
+
+/// Largest number of buffers passed to one sendmsg() call
+constexpr size_t MAX_SEND_IOVECS = 64;
+
+/// Alignment reported to clients, same as managed services
+constexpr ULONGLONG REQUIRED_ALIGNMENT = 512;
+
+struct DevioServer::Connection
+{
+    uint64_t id;
+    int fd;
+
+    /// Received bytes not yet parsed, between input_begin and input_end
+    std::unique_ptr<uint8_t[]> input{ new uint8_t[INPUT_BUFFER_SIZE] };
+    size_t input_begin = 0;
+    size_t input_end = 0;
+
+    /// Request waiting for its data to be received
+    std::shared_ptr<Request> pending;
+    size_t pending_received = 0;
+    size_t pending_size = 0;
+
+    /// Requests handed to worker threads
+    unsigned outstanding = 0;
+    bool untagged_outstanding = false;
+
+    /// Not reading more requests until some outstanding ones complete
+    bool paused = false;
+
+    /// Client sent IMDPROXY_REQ_CLOSE or shut down its end
+    bool peer_closed = false;
+
+    /// Protocol or socket error, close without sending anything more
+    bool broken = false;
+
+    std::deque<Response> output;
+
+    uint32_t events = 0;
+};
+
+static void close_fd(int &fd)
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
+template<typename T> static T load(const uint8_t *ptr)
+{
+    T value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static bool is_tagged_request(ULONGLONG request_code)
+{
+    return request_code == IMDPROXY_REQ_READ_TAGGED ||
+        request_code == IMDPROXY_REQ_WRITE_TAGGED;
+}
+
+/// Fills in response header for read and write requests, tagged or not
+template<typename Request, typename Response>
+static void set_read_write_response(const Request &request,
+    Response &response, ULONGLONG errorno, ULONGLONG length)
+{
+    if (is_tagged_request(request.request_code))
+    {
+        response.header.tagged.tag = request.tag;
+        response.header.tagged.errorno = errorno;
+        response.header.tagged.length = length;
+        response.header_length = sizeof(IMDPROXY_TAGGED_RESP);
+    }
+    else
+    {
+        response.header.read.errorno = errorno;
+        response.header.read.length = length;
+        response.header_length = sizeof(IMDPROXY_READ_RESP);
+    }
+}
+
+DevioServer::DevioServer(ImageBackend &image, const ServerOptions &options)
+    : image(image), options(options)
+{
+    try
+    {
+        struct addrinfo hints = { };
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        struct addrinfo *addresses = nullptr;
+        std::string port_string = std::to_string(options.port);
+
+        int result = getaddrinfo(
+            options.listen_address.empty() ? nullptr : options.listen_address.c_str(),
+            port_string.c_str(), &hints, &addresses);
+
+        if (result != 0)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                std::string("Cannot resolve listen address: ") + gai_strerror(result));
+        }
+
+        int last_error = EADDRNOTAVAIL;
+
+        for (struct addrinfo *address = addresses;
+            address != nullptr;
+            address = address->ai_next)
+        {
+            listen_fd = socket(address->ai_family,
+                address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                address->ai_protocol);
+
+            if (listen_fd < 0)
+            {
+                last_error = errno;
+                continue;
+            }
+
+            int on = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+            if (bind(listen_fd, address->ai_addr, address->ai_addrlen) == 0 &&
+                listen(listen_fd, SOMAXCONN) == 0)
+            {
+                break;
+            }
+
+            last_error = errno;
+            close_fd(listen_fd);
+        }
+
+        freeaddrinfo(addresses);
+
+        if (listen_fd < 0)
+        {
+            throw std::system_error(last_error, std::generic_category(),
+                "Listen failed on tcp port");
+        }
+
+        struct sockaddr_storage bound_address;
+        socklen_t bound_length = sizeof(bound_address);
+        if (getsockname(listen_fd, (struct sockaddr *)&bound_address,
+            &bound_length) == 0)
+        {
+            if (bound_address.ss_family == AF_INET6)
+            {
+                listen_port = ntohs(((struct sockaddr_in6 *)&bound_address)->sin6_port);
+            }
+            else
+            {
+                listen_port = ntohs(((struct sockaddr_in *)&bound_address)->sin_port);
+            }
+        }
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if (epoll_fd < 0 || event_fd < 0 || timer_fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot create event objects");
+        }
+
+        struct epoll_event event = { };
+
+        event.events = EPOLLIN;
+        event.data.u64 = LISTEN_EVENT_ID;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+        event.data.u64 = COMPLETION_EVENT_ID;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event);
+
+        event.data.u64 = TIMER_EVENT_ID;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+    }
+    catch (...)
+    {
+        close_fd(timer_fd);
+        close_fd(event_fd);
+        close_fd(epoll_fd);
+        close_fd(listen_fd);
+        throw;
+    }
+}
+
+DevioServer::~DevioServer()
+{
+    // Worker threads post completions and the kernel may still use buffers
+    // of io_uring requests, so they have to be stopped first
+    uring.reset();
+    workers.reset();
+
+    for (auto &entry : connections)
+    {
+        close(entry.second->fd);
+    }
+
+    connections.clear();
+
+    close_fd(timer_fd);
+    close_fd(event_fd);
+    close_fd(epoll_fd);
+    close_fd(listen_fd);
+}
+
+void DevioServer::stop()
+{
+    stopping = true;
+
+    uint64_t value = 1;
+    ssize_t result = write(event_fd, &value, sizeof(value));
+    (void)result;
+}
+
+void DevioServer::run()
+{
+    unsigned thread_count = options.worker_threads;
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    workers.reset(new WorkerPool(thread_count));
+
+    if (options.engine != IoEngineType::ThreadPool)
+    {
+        start_uring_engine();
+    }
+
+    fprintf(stderr, "Listening on port %u with %u worker threads%s.\n",
+        (unsigned)listen_port, thread_count, uring ? " and io_uring" : "");
+
+    struct epoll_event events[64];
+
+    while (!stopping)
+    {
+        // Requests prepared while handling last batch of events go to the
+        // kernel in one system call
+        if (uring)
+        {
+            uring->submit();
+        }
+
+        int count = epoll_wait(epoll_fd, events, 64, -1);
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::system_error(errno, std::generic_category(),
+                "epoll_wait failed");
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            uint64_t id = events[i].data.u64;
+
+            if (id == LISTEN_EVENT_ID)
+            {
+                accept_connections();
+                continue;
+            }
+
+            if (id == COMPLETION_EVENT_ID)
+            {
+                uint64_t value;
+                ssize_t result = read(event_fd, &value, sizeof(value));
+                (void)result;
+
+                drain_completions();
+                continue;
+            }
+
+            if (id == URING_EVENT_ID)
+            {
+                uint64_t value;
+                ssize_t result = read(uring->event_fd(), &value, sizeof(value));
+                (void)result;
+
+                uring->reap();
+                continue;
+            }
+
+            if (id == TIMER_EVENT_ID)
+            {
+                uint64_t expirations;
+                ssize_t result = read(timer_fd, &expirations, sizeof(expirations));
+                (void)result;
+
+                continue;
+            }
+
+            auto it = connections.find(id);
+            if (it == connections.end())
+            {
+                continue;
+            }
+
+            Connection &conn = *it->second;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close_connection(conn);
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT)
+            {
+                flush_output(conn);
+
+                if (close_if_done(conn))
+                {
+                    continue;
+                }
+
+                update_events(conn);
+            }
+
+            if (events[i].events & EPOLLIN)
+            {
+                process_input(conn);
+            }
+        }
+
+        deliver_delayed();
+    }
+
+    uring.reset();
+    workers.reset();
+}
+
+void DevioServer::start_uring_engine()
+{
+    try
+    {
+        if (buffers.arena_buffers().empty())
+        {
+            buffers.create_arena(options.uring_entries, options.uring_buffer_size);
+        }
+
+        const ImageFile *image_file = dynamic_cast<const ImageFile *>(&image);
+
+        if (image_file == nullptr)
+        {
+            throw std::system_error(EOPNOTSUPP, std::generic_category(),
+                "Image format cannot be served through io_uring");
+        }
+
+        uring.reset(new UringEngine(*image_file, buffers,
+            options.uring_entries));
+
+        struct epoll_event event = { };
+        event.events = EPOLLIN;
+        event.data.u64 = URING_EVENT_ID;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uring->event_fd(), &event) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot add io_uring eventfd to epoll set");
+        }
+
+        fprintf(stderr, "Using io_uring with %u entries%s%s.\n",
+            options.uring_entries,
+            uring->uses_fixed_files() ? ", fixed files" : "",
+            uring->uses_fixed_buffers() ? ", fixed buffers" : "");
+    }
+    catch (const std::system_error &ex)
+    {
+        uring.reset();
+
+        if (options.engine == IoEngineType::Uring)
+        {
+            throw;
+        }
+
+        fprintf(stderr, "io_uring not available, using worker threads: %s\n",
+            ex.what());
+    }
+}
+
+void DevioServer::accept_connections()
+{
+    for (;;)
+    {
+        struct sockaddr_storage address;
+        socklen_t address_length = sizeof(address);
+
+        int fd = accept4(listen_fd, (struct sockaddr *)&address,
+            &address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("accept");
+            }
+
+            return;
+        }
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        char host[NI_MAXHOST] = "";
+        char service[NI_MAXSERV] = "";
+        getnameinfo((struct sockaddr *)&address, address_length,
+            host, sizeof(host), service, sizeof(service),
+            NI_NUMERICHOST | NI_NUMERICSERV);
+
+        std::unique_ptr<Connection> conn(new Connection);
+        conn->id = next_connection_id++ + FIRST_CONNECTION_ID;
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+
+        struct epoll_event event = { };
+        event.events = conn->events;
+        event.data.u64 = conn->id;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            perror("epoll_ctl");
+            close(fd);
+            continue;
+        }
+
+        fprintf(stderr, "Connection %llu from %s port %s.\n",
+            (unsigned long long)(conn->id - FIRST_CONNECTION_ID), host, service);
+
+        connections.emplace(conn->id, std::move(conn));
+    }
+}
+
+void DevioServer::close_connection(Connection &conn)
+{
+    fprintf(stderr, "Connection %llu closed.\n",
+        (unsigned long long)(conn.id - FIRST_CONNECTION_ID));
+
+    // Removing fd from epoll set is implicit when it is closed. Requests
+    // still running in worker threads find no connection when they
+    // complete and their responses are dropped.
+    close(conn.fd);
+    connections.erase(conn.id);
+}
+
+bool DevioServer::close_if_done(Connection &conn)
+{
+    if (conn.broken ||
+        (conn.peer_closed && conn.outstanding == 0 && conn.output.empty() &&
+        !conn.pending))
+    {
+        close_connection(conn);
+        return true;
+    }
+
+    return false;
+}
+
+void DevioServer::process_input(Connection &conn)
+{
+    conn.paused = false;
+
+    while (!conn.peer_closed && !conn.broken)
+    {
+        if (conn.pending)
+        {
+            uint8_t *target = conn.pending->data.data() + conn.pending_received;
+            size_t needed = conn.pending_size - conn.pending_received;
+            size_t staged = conn.input_end - conn.input_begin;
+
+            if (staged > 0)
+            {
+                size_t count = std::min(needed, staged);
+                memcpy(target, conn.input.get() + conn.input_begin, count);
+                conn.input_begin += count;
+                conn.pending_received += count;
+            }
+            else
+            {
+                // Large request data is received directly into request
+                // buffer
+                ssize_t count = recv(conn.fd, target, needed, 0);
+
+                if (count == 0)
+                {
+                    conn.broken = true;
+                    break;
+                }
+
+                if (count < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    {
+                        conn.broken = true;
+                    }
+
+                    break;
+                }
+
+                conn.pending_received += (size_t)count;
+            }
+
+            if (conn.pending_received == conn.pending_size)
+            {
+                std::shared_ptr<Request> request = std::move(conn.pending);
+                conn.pending.reset();
+                dispatch(conn, std::move(request));
+            }
+
+            continue;
+        }
+
+        ParseResult result = parse_request(conn);
+
+        if (result == ParseResult::Parsed)
+        {
+            continue;
+        }
+
+        if (result == ParseResult::Paused)
+        {
+            conn.paused = true;
+            break;
+        }
+
+        if (result == ParseResult::Error)
+        {
+            conn.broken = true;
+            break;
+        }
+
+        // Need more data, move what is left of a partial header to start of
+        // buffer and receive more
+        if (conn.input_begin > 0)
+        {
+            memmove(conn.input.get(), conn.input.get() + conn.input_begin,
+                conn.input_end - conn.input_begin);
+            conn.input_end -= conn.input_begin;
+            conn.input_begin = 0;
+        }
+
+        ssize_t count = recv(conn.fd, conn.input.get() + conn.input_end,
+            INPUT_BUFFER_SIZE - conn.input_end, 0);
+
+        if (count == 0)
+        {
+            conn.peer_closed = true;
+            break;
+        }
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                conn.broken = true;
+            }
+
+            break;
+        }
+
+        conn.input_end += (size_t)count;
+    }
+
+    if (close_if_done(conn))
+    {
+        return;
+    }
+
+    update_events(conn);
+}
+
+DevioServer::ParseResult DevioServer::parse_request(Connection &conn)
+{
+    const uint8_t *header = conn.input.get() + conn.input_begin;
+    size_t available = conn.input_end - conn.input_begin;
+
+    if (available < sizeof(ULONGLONG))
+    {
+        return ParseResult::NeedData;
+    }
+
+    ULONGLONG request_code = load<ULONGLONG>(header);
+
+    // Untagged requests are answered in order, so wait for anything in
+    // progress first. Tagged requests can run in parallel up to the
+    // configured limit.
+    if (conn.untagged_outstanding ||
+        (!is_tagged_request(request_code) && conn.outstanding > 0) ||
+        conn.outstanding >= options.max_outstanding)
+    {
+        return ParseResult::Paused;
+    }
+
+    std::shared_ptr<Request> request = std::make_shared<Request>();
+    request->request_code = request_code;
+
+    size_t header_size;
+    size_t data_size = 0;
+
+    switch (request_code)
+    {
+    case IMDPROXY_REQ_INFO:
+    {
+        conn.input_begin += sizeof(ULONGLONG);
+
+        Response response;
+        response.header.info.file_size = image.size();
+        response.header.info.req_alignment = REQUIRED_ALIGNMENT;
+        response.header.info.flags =
+            IMDPROXY_FLAG_SUPPORTS_TAGGED | IMDPROXY_FLAG_SUPPORTS_VECTORED;
+
+        if (image.read_only())
+        {
+            response.header.info.flags |= IMDPROXY_FLAG_RO;
+        }
+        else
+        {
+            response.header.info.flags |= IMDPROXY_FLAG_SUPPORTS_ZERO;
+
+            if (image.supports_punch_hole())
+            {
+                response.header.info.flags |= IMDPROXY_FLAG_SUPPORTS_UNMAP;
+            }
+        }
+
+        response.header_length = sizeof(IMDPROXY_INFO_RESP);
+        queue_response(conn, std::move(response));
+        return ParseResult::Parsed;
+    }
+
+    case IMDPROXY_REQ_CLOSE:
+        conn.input_begin += sizeof(ULONGLONG);
+        conn.peer_closed = true;
+        return ParseResult::Parsed;
+
+    case IMDPROXY_REQ_READ:
+    case IMDPROXY_REQ_WRITE:
+        header_size = sizeof(IMDPROXY_READ_REQ);
+        if (available < header_size)
+        {
+            return ParseResult::NeedData;
+        }
+
+        request->offset = load<ULONGLONG>(header + 8);
+        request->length = load<ULONGLONG>(header + 16);
+        break;
+
+    case IMDPROXY_REQ_READ_TAGGED:
+    case IMDPROXY_REQ_WRITE_TAGGED:
+        header_size = sizeof(IMDPROXY_TAGGED_READ_REQ);
+        if (available < header_size)
+        {
+            return ParseResult::NeedData;
+        }
+
+        request->offset = load<ULONGLONG>(header + 8);
+        request->length = load<ULONGLONG>(header + 16);
+        request->tag = load<ULONGLONG>(header + 24);
+        break;
+
+    case IMDPROXY_REQ_UNMAP:
+    case IMDPROXY_REQ_ZERO:
+        header_size = sizeof(IMDPROXY_UNMAP_REQ);
+        if (available < header_size)
+        {
+            return ParseResult::NeedData;
+        }
+
+        request->length = load<ULONGLONG>(header + 8);
+        data_size = (size_t)request->length;
+        break;
+
+    case IMDPROXY_REQ_READV:
+    case IMDPROXY_REQ_WRITEV:
+    {
+        if (available < IMDPROXY_VECTORED_REQ_SIZE(0))
+        {
+            return ParseResult::NeedData;
+        }
+
+        ULONGLONG extent_count = load<ULONGLONG>(header + 8);
+        if (extent_count > IMDPROXY_VECTORED_MAX_EXTENTS)
+        {
+            fprintf(stderr, "Too many extents in vectored request: %llu\n",
+                (unsigned long long)extent_count);
+            return ParseResult::Error;
+        }
+
+        header_size = IMDPROXY_VECTORED_REQ_SIZE(extent_count);
+        if (available < header_size)
+        {
+            return ParseResult::NeedData;
+        }
+
+        memcpy(&request->vectored, header, header_size);
+
+        if (!ImdProxyValidateVectoredRequest(&request->vectored, header_size,
+            options.max_request_size))
+        {
+            fprintf(stderr, "Invalid vectored request.\n");
+            return ParseResult::Error;
+        }
+
+        request->length = request->vectored.length;
+        break;
+    }
+
+    default:
+        fprintf(stderr, "Unsupported request code: %#llx\n",
+            (unsigned long long)request_code);
+        return ParseResult::Error;
+    }
+
+    if (request->length > options.max_request_size)
+    {
+        fprintf(stderr, "Request too large: %llu bytes\n",
+            (unsigned long long)request->length);
+        return ParseResult::Error;
+    }
+
+    if (request_code == IMDPROXY_REQ_WRITE ||
+        request_code == IMDPROXY_REQ_WRITE_TAGGED ||
+        request_code == IMDPROXY_REQ_WRITEV)
+    {
+        data_size = (size_t)request->length;
+    }
+
+    conn.input_begin += header_size;
+
+    if (data_size > 0)
+    {
+        request->data = buffers.get(data_size);
+        conn.pending = std::move(request);
+        conn.pending_received = 0;
+        conn.pending_size = data_size;
+        return ParseResult::Parsed;
+    }
+
+    dispatch(conn, std::move(request));
+    return ParseResult::Parsed;
+}
+
+void DevioServer::dispatch(Connection &conn, std::shared_ptr<Request> request)
+{
+    conn.outstanding++;
+
+    if (!is_tagged_request(request->request_code))
+    {
+        conn.untagged_outstanding = true;
+    }
+
+    uint64_t connection_id = conn.id;
+
+    if (uring && dispatch_uring(connection_id, request))
+    {
+        return;
+    }
+
+    workers->submit([this, connection_id, request]
+    {
+        Response response;
+
+        try
+        {
+            execute(*request, response);
+        }
+        catch (const std::bad_alloc &)
+        {
+            response = Response();
+            response.header.tagged.tag = request->tag;
+            response.header.tagged.errorno = ENOMEM;
+            response.header.tagged.length = 0;
+
+            if (is_tagged_request(request->request_code))
+            {
+                response.header_length = sizeof(IMDPROXY_TAGGED_RESP);
+            }
+            else
+            {
+                // Untagged responses start with errorno, followed by
+                // length for all but unmap and zero
+                response.header.read.errorno = ENOMEM;
+                response.header.read.length = 0;
+                response.header_length =
+                    (request->request_code == IMDPROXY_REQ_UNMAP ||
+                    request->request_code == IMDPROXY_REQ_ZERO) ?
+                    sizeof(IMDPROXY_UNMAP_RESP) : sizeof(IMDPROXY_READ_RESP);
+            }
+        }
+
+        // Request data is no longer needed, give buffer back to pool
+        // before response is queued.
+        request->data.release();
+
+        post_completion(connection_id, std::move(response));
+    });
+}
+
+void DevioServer::execute(Request &request, Response &response)
+{
+    ULONGLONG errorno = 0;
+    ULONGLONG length = 0;
+
+    switch (request.request_code)
+    {
+    case IMDPROXY_REQ_READ:
+    case IMDPROXY_REQ_READ_TAGGED:
+    {
+        response.data = buffers.get((size_t)request.length);
+
+        ssize_t result = image.read(response.data.data(),
+            (size_t)request.length, request.offset);
+
+        if (result < 0)
+        {
+            errorno = (ULONGLONG)-result;
+        }
+        else
+        {
+            length = (ULONGLONG)result;
+            response.data_length = (size_t)length;
+        }
+
+        break;
+    }
+
+    case IMDPROXY_REQ_WRITE:
+    case IMDPROXY_REQ_WRITE_TAGGED:
+    {
+        ssize_t result = image.write(request.data.data(),
+            (size_t)request.length, request.offset);
+
+        if (result < 0)
+        {
+            errorno = (ULONGLONG)-result;
+        }
+        else
+        {
+            length = (ULONGLONG)result;
+        }
+
+        break;
+    }
+
+    case IMDPROXY_REQ_UNMAP:
+    case IMDPROXY_REQ_ZERO:
+        response.header.unmap.errorno = execute_range_request(image, buffers,
+            request.request_code,
+            (const DEVICE_DATA_SET_RANGE *)request.data.data(),
+            (size_t)request.length / sizeof(DEVICE_DATA_SET_RANGE));
+        response.header_length = sizeof(IMDPROXY_UNMAP_RESP);
+        return;
+
+    case IMDPROXY_REQ_READV:
+    case IMDPROXY_REQ_WRITEV:
+    {
+        bool is_read = request.request_code == IMDPROXY_REQ_READV;
+        const IMDPROXY_VECTORED_REQ &vectored = request.vectored;
+        uint8_t *buffer;
+
+        if (is_read)
+        {
+            response.data = buffers.get((size_t)vectored.length);
+            buffer = response.data.data();
+        }
+        else
+        {
+            buffer = request.data.data();
+        }
+
+        size_t position = 0;
+
+        for (ULONGLONG i = 0; i < vectored.extent_count && errorno == 0;)
+        {
+            // Merge extents that are contiguous in the image, data block is
+            // always contiguous
+            ULONGLONG offset = vectored.extents[i].offset;
+            size_t extent_length = (size_t)vectored.extents[i].length;
+
+            for (i++;
+                i < vectored.extent_count &&
+                vectored.extents[i].offset == offset + extent_length;
+                i++)
+            {
+                extent_length += (size_t)vectored.extents[i].length;
+            }
+
+            if (extent_length == 0)
+            {
+                continue;
+            }
+
+            ssize_t result = is_read ?
+                image.read(buffer + position, extent_length, offset) :
+                image.write(buffer + position, extent_length, offset);
+
+            if (result < 0)
+            {
+                errorno = (ULONGLONG)-result;
+            }
+            else if ((size_t)result < extent_length)
+            {
+                if (is_read)
+                {
+                    // Reads beyond end of image return zeros
+                    memset(buffer + position + result, 0,
+                        extent_length - (size_t)result);
+                }
+                else
+                {
+                    errorno = ENOSPC;
+                }
+            }
+
+            position += extent_length;
+        }
+
+        if (errorno == 0)
+        {
+            length = vectored.length;
+
+            if (is_read)
+            {
+                response.data_length = (size_t)length;
+            }
+        }
+
+        response.header.vectored.errorno = errorno;
+        response.header.vectored.length = length;
+        response.header_length = sizeof(IMDPROXY_VECTORED_RESP);
+        return;
+    }
+    }
+
+    set_read_write_response(request, response, errorno, length);
+}
+
+bool DevioServer::dispatch_uring(uint64_t connection_id,
+    const std::shared_ptr<Request> &request)
+{
+    switch (request->request_code)
+    {
+    case IMDPROXY_REQ_READ:
+    case IMDPROXY_REQ_READ_TAGGED:
+    {
+        std::shared_ptr<Response> response = std::make_shared<Response>();
+
+        try
+        {
+            response->data = buffers.get((size_t)request->length);
+        }
+        catch (const std::bad_alloc &)
+        {
+            // Worker thread reports the error
+            return false;
+        }
+
+        uring->read(response->data.data(), response->data.index(),
+            (size_t)request->length, request->offset,
+            [this, connection_id, request, response](ssize_t result)
+        {
+            if (result < 0)
+            {
+                set_read_write_response(*request, *response, (ULONGLONG)-result, 0);
+            }
+            else
+            {
+                set_read_write_response(*request, *response, 0, (ULONGLONG)result);
+                response->data_length = (size_t)result;
+            }
+
+            complete(connection_id, std::move(*response));
+        });
+
+        return true;
+    }
+
+    case IMDPROXY_REQ_WRITE:
+    case IMDPROXY_REQ_WRITE_TAGGED:
+        uring->write(request->data.data(), request->data.index(),
+            (size_t)request->length, request->offset,
+            [this, connection_id, request](ssize_t result)
+        {
+            request->data.release();
+
+            Response response;
+
+            if (result < 0)
+            {
+                set_read_write_response(*request, response, (ULONGLONG)-result, 0);
+            }
+            else
+            {
+                set_read_write_response(*request, response, 0, (ULONGLONG)result);
+            }
+
+            complete(connection_id, std::move(response));
+        });
+
+        return true;
+
+    case IMDPROXY_REQ_UNMAP:
+    {
+        if (!uring->supports_punch_hole())
+        {
+            return false;
+        }
+
+        size_t count = (size_t)request->length / sizeof(DEVICE_DATA_SET_RANGE);
+        std::vector<DEVICE_DATA_SET_RANGE> ranges(count);
+
+        if (count == 0)
+        {
+            return false;
+        }
+
+        memcpy(ranges.data(), request->data.data(),
+            count * sizeof(DEVICE_DATA_SET_RANGE));
+
+        for (const DEVICE_DATA_SET_RANGE &range : ranges)
+        {
+            if (range.StartingOffset < 0)
+            {
+                // Worker thread reports the error
+                return false;
+            }
+        }
+
+        request->data.release();
+
+        // Ranges are unmapped in parallel, response is sent when all are
+        // done
+        struct UnmapState
+        {
+            size_t remaining;
+            ULONGLONG errorno;
+        };
+
+        std::shared_ptr<UnmapState> state =
+            std::make_shared<UnmapState>(UnmapState{ count, 0 });
+
+        for (const DEVICE_DATA_SET_RANGE &range : ranges)
+        {
+            uring->punch_hole((uint64_t)range.StartingOffset, range.LengthInBytes,
+                [this, connection_id, state](ssize_t result)
+            {
+                // Unmap is advisory, unsupported ranges are not errors
+                if (result < 0 && result != -EOPNOTSUPP && state->errorno == 0)
+                {
+                    state->errorno = (ULONGLONG)-result;
+                }
+
+                if (--state->remaining == 0)
+                {
+                    Response response;
+                    response.header.unmap.errorno = state->errorno;
+                    response.header_length = sizeof(IMDPROXY_UNMAP_RESP);
+
+                    complete(connection_id, std::move(response));
+                }
+            });
+        }
+
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+ULONGLONG execute_range_request(const ImageBackend &image,
+    BufferPool &buffers, ULONGLONG request_code,
+    const DEVICE_DATA_SET_RANGE *ranges, size_t count)
+{
+    if (image.read_only())
+    {
+        return EROFS;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        DEVICE_DATA_SET_RANGE range;
+        memcpy(&range, &ranges[i], sizeof(range));
+
+        if (range.StartingOffset < 0)
+        {
+            return EINVAL;
+        }
+
+        // Deallocated ranges read back as zeros, so punching holes serves
+        // both request types where file system supports it
+        int result = image.punch_hole((uint64_t)range.StartingOffset,
+            range.LengthInBytes);
+
+        if (result == 0)
+        {
+            continue;
+        }
+
+        if (request_code == IMDPROXY_REQ_UNMAP)
+        {
+            // Unmap is advisory, nothing more to do where it cannot be
+            // done
+            if (result == -EOPNOTSUPP)
+            {
+                continue;
+            }
+
+            return (ULONGLONG)-result;
+        }
+
+        if (result != -EOPNOTSUPP)
+        {
+            return (ULONGLONG)-result;
+        }
+
+        // Zero ranges by writing zeros where holes are not supported
+        uint64_t offset = (uint64_t)range.StartingOffset;
+        uint64_t remaining = offset < image.size() ?
+            std::min(range.LengthInBytes, image.size() - offset) : 0;
+
+        IoBuffer zeros = buffers.get((size_t)std::min<uint64_t>(remaining, 1 << 20));
+        memset(zeros.data(), 0, zeros.capacity());
+
+        while (remaining > 0)
+        {
+            size_t chunk = (size_t)std::min<uint64_t>(remaining, zeros.capacity());
+
+            ssize_t written = image.write(zeros.data(), chunk, offset);
+            if (written < 0)
+            {
+                return (ULONGLONG)-written;
+            }
+
+            if (written == 0)
+            {
+                break;
+            }
+
+            offset += (uint64_t)written;
+            remaining -= (uint64_t)written;
+        }
+    }
+
+    return 0;
+}
+
+void DevioServer::queue_response(Connection &conn, Response response)
+{
+    conn.output.push_back(std::move(response));
+    flush_output(conn);
+}
+
+void DevioServer::flush_output(Connection &conn)
+{
+    while (!conn.output.empty() && !conn.broken)
+    {
+        // Gather as many queued responses as possible into one call
+        struct iovec iov[MAX_SEND_IOVECS];
+        size_t iovcnt = 0;
+
+        for (auto it = conn.output.begin();
+            it != conn.output.end() && iovcnt + 2 <= MAX_SEND_IOVECS;
+            ++it)
+        {
+            Response &response = *it;
+
+            if (response.sent < response.header_length)
+            {
+                iov[iovcnt].iov_base = (uint8_t *)&response.header + response.sent;
+                iov[iovcnt].iov_len = response.header_length - response.sent;
+                iovcnt++;
+            }
+
+            if (response.data_length > 0)
+            {
+                size_t data_sent = response.sent > response.header_length ?
+                    response.sent - response.header_length : 0;
+
+                iov[iovcnt].iov_base = response.data.data() + data_sent;
+                iov[iovcnt].iov_len = response.data_length - data_sent;
+                iovcnt++;
+            }
+        }
+
+        struct msghdr msg = { };
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t sent = sendmsg(conn.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                conn.broken = true;
+            }
+
+            break;
+        }
+
+        size_t remaining = (size_t)sent;
+
+        while (remaining > 0)
+        {
+            Response &response = conn.output.front();
+            size_t total = response.header_length + response.data_length;
+            size_t count = std::min(remaining, total - response.sent);
+
+            response.sent += count;
+            remaining -= count;
+
+            if (response.sent == total)
+            {
+                conn.output.pop_front();
+            }
+        }
+    }
+}
+
+void DevioServer::update_events(Connection &conn)
+{
+    uint32_t events = 0;
+
+    if (!conn.paused && !conn.peer_closed)
+    {
+        events |= EPOLLIN;
+    }
+
+    if (!conn.output.empty())
+    {
+        events |= EPOLLOUT;
+    }
+
+    if (events == conn.events)
+    {
+        return;
+    }
+
+    struct epoll_event event = { };
+    event.events = events;
+    event.data.u64 = conn.id;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &event) == 0)
+    {
+        conn.events = events;
+    }
+}
+
+void DevioServer::post_completion(uint64_t connection_id, Response response)
+{
+    std::unique_ptr<Completion> completion(new Completion{ connection_id,
+        std::move(response),
+        std::chrono::steady_clock::now() + options.response_delay });
+
+    bool was_empty;
+
+    {
+        std::lock_guard<std::mutex> lock(completion_mutex);
+        was_empty = completions.empty();
+        completions.push_back(std::move(completion));
+    }
+
+    // Event loop drains all completions each time it wakes up, so it only
+    // needs to be woken up for the first one.
+    if (was_empty)
+    {
+        uint64_t value = 1;
+        ssize_t result = write(event_fd, &value, sizeof(value));
+        (void)result;
+    }
+}
+
+void DevioServer::drain_completions()
+{
+    std::vector<std::unique_ptr<Completion>> list;
+
+    {
+        std::lock_guard<std::mutex> lock(completion_mutex);
+        list.swap(completions);
+    }
+
+    for (std::unique_ptr<Completion> &completion : list)
+    {
+        if (options.response_delay.count() > 0)
+        {
+            delayed.push(std::move(completion));
+        }
+        else
+        {
+            deliver(completion->connection_id, std::move(completion->response));
+        }
+    }
+}
+
+void DevioServer::complete(uint64_t connection_id, Response response)
+{
+    if (options.response_delay.count() > 0)
+    {
+        delayed.push(std::unique_ptr<Completion>(new Completion{ connection_id,
+            std::move(response),
+            std::chrono::steady_clock::now() + options.response_delay }));
+
+        arm_delay_timer();
+        return;
+    }
+
+    deliver(connection_id, std::move(response));
+}
+
+void DevioServer::deliver(uint64_t connection_id, Response response)
+{
+    auto it = connections.find(connection_id);
+    if (it == connections.end())
+    {
+        return;
+    }
+
+    Connection &conn = *it->second;
+
+    conn.outstanding--;
+    if (conn.outstanding == 0)
+    {
+        conn.untagged_outstanding = false;
+    }
+
+    queue_response(conn, std::move(response));
+
+    // Requests may have been held back waiting for this one
+    process_input(conn);
+}
+
+void DevioServer::deliver_delayed()
+{
+    if (delayed.empty())
+    {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+
+    while (!delayed.empty() && delayed.top()->due <= now)
+    {
+        std::unique_ptr<Completion> completion =
+            std::move(const_cast<std::unique_ptr<Completion> &>(delayed.top()));
+        delayed.pop();
+
+        deliver(completion->connection_id, std::move(completion->response));
+    }
+
+    arm_delay_timer();
+}
+
+void DevioServer::arm_delay_timer()
+{
+    if (delayed.empty())
+    {
+        return;
+    }
+
+    // steady_clock is CLOCK_MONOTONIC on Linux
+    auto due = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        delayed.top()->due.time_since_epoch()).count();
+
+    struct itimerspec spec = { };
+    spec.it_value.tv_sec = (time_t)(due / 1000000000);
+    spec.it_value.tv_nsec = (long)(due % 1000000000);
+
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+}
@@ -0,0 +1,234 @@
+/// server.h
+/// Devio TCP/IP server. Serves an image to any number of clients using
+/// the same protocol as DevioTcpService, including tagged and vectored
+/// requests, from an epoll event loop. Backend I/O runs in a worker pool.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_SERVER_H_
+#define _DEVIOSERVER_SERVER_H_
+
+#include "devioproto.h"
+#include "buffers.h"
+#include "imagebackend.h"
+#include "imagefile.h"
+#include "uringengine.h"
+#include "workerpool.h"
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace devio
+{
+
+enum class IoEngineType
+{
+    /// io_uring where available, worker threads otherwise
+    Auto,
+
+    /// Synchronous pread/pwrite calls in worker threads
+    ThreadPool,
+
+    /// io_uring, fail if not available
+    Uring
+};
+
+struct ServerOptions
+{
+    /// Address to listen on, IPv4 or IPv6. Empty for all interfaces.
+    std::string listen_address;
+
+    uint16_t port = 9000;
+
+    /// Number of backend I/O threads, zero for one per CPU
+    unsigned worker_threads = 0;
+
+    /// Maximum number of tagged requests in progress per connection. More
+    /// requests stay unread in the socket until some of them complete.
+    unsigned max_outstanding = 64;
+
+    /// Largest data block accepted in one request. Connections that send
+    /// larger requests are closed.
+    size_t max_request_size = 64 << 20;
+
+    IoEngineType engine = IoEngineType::Auto;
+
+    /// Size of io_uring submission queue, which is also the largest number
+    /// of backend requests in flight across all connections. Requests
+    /// beyond that wait in the server.
+    unsigned uring_entries = 256;
+
+    /// Size of each of the uring_entries buffers registered with io_uring.
+    /// Larger requests use buffers that are not registered.
+    size_t uring_buffer_size = 256 << 10;
+
+    /// Artificial delay before each response is sent, for measuring how
+    /// well clients hide network latency
+    std::chrono::microseconds response_delay{ 0 };
+};
+
+/// Serves an unmap or zero request for count ranges. Returns errno value
+/// for response, zero on success. Zero ranges are written with zeros where
+/// image cannot deallocate them.
+ULONGLONG execute_range_request(const ImageBackend &image,
+    BufferPool &buffers, ULONGLONG request_code,
+    const DEVICE_DATA_SET_RANGE *ranges, size_t count);
+
+class DevioServer
+{
+public:
+
+    /// Creates listening socket. Throws std::system_error on failure.
+    DevioServer(ImageBackend &image, const ServerOptions &options);
+    ~DevioServer();
+
+    DevioServer(const DevioServer &) = delete;
+    DevioServer &operator=(const DevioServer &) = delete;
+
+    /// Serves clients until stop() is called
+    void run();
+
+    /// Makes run() return. Safe to call from other threads and from
+    /// signal handlers.
+    void stop();
+
+    /// Port actually listened on, useful when options specified port zero
+    uint16_t port() const
+    {
+        return listen_port;
+    }
+
+private:
+
+    /// Request read from a connection, executed by a worker thread
+    struct Request
+    {
+        ULONGLONG request_code = IMDPROXY_REQ_NULL;
+        ULONGLONG offset = 0;
+        ULONGLONG length = 0;
+        ULONGLONG tag = 0;
+
+        /// Header and extents of READV and WRITEV requests
+        IMDPROXY_VECTORED_REQ vectored;
+
+        /// Request data of write, unmap and zero requests
+        IoBuffer data;
+    };
+
+    /// Response header and data, sent in one piece
+    struct Response
+    {
+        union
+        {
+            IMDPROXY_TAGGED_RESP tagged;
+            IMDPROXY_READ_RESP read;
+            IMDPROXY_WRITE_RESP write;
+            IMDPROXY_UNMAP_RESP unmap;
+            IMDPROXY_VECTORED_RESP vectored;
+            IMDPROXY_INFO_RESP info;
+        } header;
+        size_t header_length = 0;
+
+        IoBuffer data;
+        size_t data_length = 0;
+
+        /// Bytes already sent, header first
+        size_t sent = 0;
+    };
+
+    struct Completion
+    {
+        uint64_t connection_id;
+        Response response;
+        std::chrono::steady_clock::time_point due;
+    };
+
+    struct CompletionDueLater
+    {
+        bool operator()(const std::unique_ptr<Completion> &a,
+            const std::unique_ptr<Completion> &b) const
+        {
+            return a->due > b->due;
+        }
+    };
+
+    struct Connection;
+
+    enum class ParseResult
+    {
+        Parsed,
+        NeedData,
+        Paused,
+        Error
+    };
+
+    void accept_connections();
+    void close_connection(Connection &conn);
+
+    void process_input(Connection &conn);
+    ParseResult parse_request(Connection &conn);
+    bool close_if_done(Connection &conn);
+    void dispatch(Connection &conn, std::shared_ptr<Request> request);
+    bool dispatch_uring(uint64_t connection_id,
+        const std::shared_ptr<Request> &request);
+    void start_uring_engine();
+    void execute(Request &request, Response &response);
+
+    void queue_response(Connection &conn, Response response);
+    void flush_output(Connection &conn);
+    void update_events(Connection &conn);
+
+    void post_completion(uint64_t connection_id, Response response);
+    void drain_completions();
+    void complete(uint64_t connection_id, Response response);
+    void deliver(uint64_t connection_id, Response response);
+    void deliver_delayed();
+    void arm_delay_timer();
+
+    ImageBackend &image;
+    ServerOptions options;
+    BufferPool buffers;
+
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int event_fd = -1;
+    int timer_fd = -1;
+    uint16_t listen_port = 0;
+    volatile bool stopping = false;
+
+    uint64_t next_connection_id = 1;
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections;
+
+    /// Completed requests posted by worker threads
+    std::mutex completion_mutex;
+    std::vector<std::unique_ptr<Completion>> completions;
+
+    /// Responses held back by options.response_delay
+    std::priority_queue<std::unique_ptr<Completion>,
+        std::vector<std::unique_ptr<Completion>>,
+        CompletionDueLater> delayed;
+
+    std::unique_ptr<WorkerPool> workers;
+
+    /// Engine for reads, writes and unmap requests where io_uring is used.
+    /// Everything else still runs in worker threads. Only raw images, that
+    /// is ImageFile backends, are served through io_uring.
+    std::unique_ptr<UringEngine> uring;
+};
+
+}
+
+#endif // _DEVIOSERVER_SERVER_H_
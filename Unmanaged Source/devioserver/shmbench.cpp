@@ -0,0 +1,958 @@
+/// shmbench.cpp
+/// devio-shmbench command line application. Measures requests per second
+/// of a devio shared memory server (shmserver.h) at a number of queue
+/// depths, first through the single request mailbox, one request at a
+/// time, and then through the multi-slot ring layout in aimproxy.h, with
+/// one slot for each request in flight. Request and response data are
+/// copied in and out of the section, as the driver does.
+///
+/// Without a server name, a server is started in the same process on a
+/// temporary image file, so that the proxy protocol is measured without
+/// storage latency. Each 4 KB page of that image starts with its offset,
+/// and reads are checked against it, so that responses delivered to the
+/// wrong slot are detected. That server has one worker thread for each
+/// ring slot, and can add a fixed latency to each image read and write to
+/// model storage that is slower than the page cache.
+///
+/// With -C, mailbox transfers of 1 MB and 8 MB compare the copy paths of
+/// shared memory proxy reads and writes in the driver: through a bounce
+/// buffer allocated for each request, with two copies, as before, and
+/// directly between section and request buffer, with one copy.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imagefile.h"
+#include "shmserver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+/// Page size of loopback image pattern
+constexpr size_t PATTERN_PAGE_SIZE = 4096;
+
+struct ShmBenchOptions
+{
+    /// Server to connect to, empty for loopback server
+    std::string name;
+
+    /// Size of loopback image and shared memory section, and latency added
+    /// to each image read and write by loopback server
+    uint64_t image_size = 256 << 20;
+    size_t shm_size = devio::ShmServerOptions().buffer_size;
+    unsigned latency_us = 0;
+
+    size_t block_size = 4096;
+    std::vector<unsigned> queue_depths = { 1, 8, 32 };
+    unsigned seconds = 3;
+    bool write = false;
+    bool random = false;
+
+    /// Compare bounce buffer and direct copy paths instead of layouts
+    bool copy_test = false;
+};
+
+/// Transfer sizes of copy path comparison
+static const size_t COPY_TEST_BLOCK_SIZES[] = { 1 << 20, 8 << 20 };
+
+struct ShmBenchResult
+{
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    uint64_t copied_bytes = 0;
+    double total_latency = 0;
+    double elapsed = 0;
+};
+
+/// Image of loopback server, with latency added to reads and writes
+class DelayedImage : public devio::ImageBackend
+{
+public:
+
+    DelayedImage(const devio::ImageBackend &image, unsigned latency_us)
+        : image(image), latency(latency_us)
+    {
+    }
+
+    uint64_t size() const override
+    {
+        return image.size();
+    }
+
+    bool read_only() const override
+    {
+        return image.read_only();
+    }
+
+    bool supports_punch_hole() const override
+    {
+        return image.supports_punch_hole();
+    }
+
+    ssize_t read(void *buffer, size_t length, uint64_t offset) const override
+    {
+        std::this_thread::sleep_for(latency);
+        return image.read(buffer, length, offset);
+    }
+
+    ssize_t write(const struct iovec *iov, int iovcnt,
+        uint64_t offset) const override
+    {
+        std::this_thread::sleep_for(latency);
+        return image.write(iov, iovcnt, offset);
+    }
+
+    using ImageBackend::write;
+
+    int punch_hole(uint64_t offset, uint64_t length) const override
+    {
+        return image.punch_hole(offset, length);
+    }
+
+    int flush() const override
+    {
+        return image.flush();
+    }
+
+private:
+
+    const devio::ImageBackend &image;
+    std::chrono::microseconds latency;
+};
+
+static LONG load_state(PIMDPROXY_SHM_RING_SLOT slot)
+{
+    return __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+}
+
+static void store_state(PIMDPROXY_SHM_RING_SLOT slot, LONG state)
+{
+    __atomic_store_n(&slot->state, state, __ATOMIC_SEQ_CST);
+}
+
+/// Client end of a shared memory connection
+class ShmConnection
+{
+public:
+
+    explicit ShmConnection(const std::string &name)
+    {
+        fd = shm_open(devio::ShmServer::section_name(name).c_str(),
+            O_RDWR | O_CLOEXEC, 0);
+
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot open shared memory " + name);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "fstat");
+        }
+
+        size = (size_t)st.st_size;
+
+        void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+
+        if (address == MAP_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot map shared memory");
+        }
+
+        shm = (uint8_t *)address;
+
+        request_event = sem_open(
+            devio::ShmServer::request_event_name(name).c_str(), 0);
+        response_event = sem_open(
+            devio::ShmServer::response_event_name(name).c_str(), 0);
+
+        if (request_event == SEM_FAILED || response_event == SEM_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot open semaphores of " + name);
+        }
+    }
+
+    ~ShmConnection()
+    {
+        if (response_event != SEM_FAILED)
+        {
+            sem_close(response_event);
+        }
+
+        if (request_event != SEM_FAILED)
+        {
+            sem_close(request_event);
+        }
+
+        if (shm != nullptr)
+        {
+            munmap(shm, size);
+        }
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    ShmConnection(const ShmConnection &) = delete;
+    ShmConnection &operator=(const ShmConnection &) = delete;
+
+    /// Sends request through mailbox and waits for response, the way
+    /// ImScsiCallProxy does without a ring
+    void call(const void *request, size_t request_size,
+        const void *data, size_t data_size, void *response,
+        size_t response_size)
+    {
+        memcpy(shm, request, request_size);
+
+        if (data_size > 0)
+        {
+            memcpy(shm + IMDPROXY_HEADER_SIZE, data, data_size);
+        }
+
+        sem_post(request_event);
+        wait_response();
+
+        memcpy(response, shm, response_size);
+    }
+
+    void wait_response()
+    {
+        while (sem_wait(response_event) != 0)
+        {
+            if (errno != EINTR)
+            {
+                throw std::system_error(errno, std::generic_category(),
+                    "sem_wait");
+            }
+        }
+    }
+
+    void signal_request()
+    {
+        sem_post(request_event);
+    }
+
+    /// Switches to ring layout. Returns number of slots accepted.
+    unsigned setup_ring(unsigned slots)
+    {
+        IMDPROXY_SHM_RING_SETUP_REQ request;
+        request.request_code = IMDPROXY_REQ_SHM_RING_SETUP;
+        request.version = IMDPROXY_SHM_RING_VERSION;
+        request.slot_count = slots;
+
+        IMDPROXY_SHM_RING_SETUP_RESP response;
+        call(&request, sizeof(request), nullptr, 0, &response,
+            sizeof(response));
+
+        if (response.errorno != 0)
+        {
+            throw std::system_error((int)response.errorno,
+                std::generic_category(), "Server declined ring layout");
+        }
+
+        if (response.slot_count < 1 || response.slot_count > slots ||
+            response.slot_size != IMDPROXY_SHM_RING_SLOT_SIZE(size,
+                response.slot_count))
+        {
+            throw std::runtime_error("Invalid ring layout from server");
+        }
+
+        slot_count = (unsigned)response.slot_count;
+        slot_size = (size_t)response.slot_size;
+
+        return slot_count;
+    }
+
+    /// Leaves ring layout, or ends mailbox session
+    void close_session()
+    {
+        ULONGLONG request_code = IMDPROXY_REQ_CLOSE;
+        memcpy(shm, &request_code, sizeof(request_code));
+        sem_post(request_event);
+        slot_count = 0;
+    }
+
+    PIMDPROXY_SHM_RING_SLOT slot(unsigned index) const
+    {
+        return IMDPROXY_SHM_RING_SLOT_PTR(shm, slot_size, index);
+    }
+
+    uint8_t *mailbox_data() const
+    {
+        return shm + IMDPROXY_HEADER_SIZE;
+    }
+
+    size_t mailbox_data_size() const
+    {
+        return size - IMDPROXY_HEADER_SIZE;
+    }
+
+    size_t slot_data_size() const
+    {
+        return slot_size - IMDPROXY_HEADER_SIZE;
+    }
+
+private:
+
+    int fd = -1;
+    uint8_t *shm = nullptr;
+    size_t size = 0;
+    sem_t *request_event = SEM_FAILED;
+    sem_t *response_event = SEM_FAILED;
+    unsigned slot_count = 0;
+    size_t slot_size = 0;
+};
+
+/// Picks offsets of requests, sequential or random
+class OffsetGenerator
+{
+public:
+
+    OffsetGenerator(const ShmBenchOptions &options, uint64_t image_size)
+        : random(options.random), block_size(options.block_size),
+        block_count(image_size / options.block_size)
+    {
+        if (block_count == 0)
+        {
+            throw std::runtime_error("Image smaller than block size");
+        }
+    }
+
+    uint64_t next()
+    {
+        uint64_t block = random ? random_blocks() % block_count :
+            next_block++ % block_count;
+
+        return block * block_size;
+    }
+
+private:
+
+    bool random;
+    size_t block_size;
+    uint64_t block_count;
+    uint64_t next_block = 0;
+    std::mt19937_64 random_blocks{ 1 };
+};
+
+/// Checks that data read from loopback image is from offset
+static void check_pattern(const uint8_t *data, size_t length, uint64_t offset)
+{
+    for (size_t i = 0; i < length; i += PATTERN_PAGE_SIZE)
+    {
+        uint64_t stored;
+        memcpy(&stored, data + i, sizeof(stored));
+
+        if (stored != offset + i)
+        {
+            throw std::runtime_error("Read returned data from offset " +
+                std::to_string(stored) + " for offset " +
+                std::to_string(offset + i));
+        }
+    }
+}
+
+/// Copies request data between section and buffer, through a bounce
+/// buffer allocated for this copy if bounce is set, like the driver did
+/// before shared memory proxies used request buffers directly. Returns
+/// number of bytes copied.
+static uint64_t copy_data(uint8_t *target, const uint8_t *source,
+    size_t length, bool bounce)
+{
+    if (!bounce)
+    {
+        memcpy(target, source, length);
+        return length;
+    }
+
+    std::unique_ptr<uint8_t[]> bounce_buffer(new uint8_t[length]);
+    memcpy(bounce_buffer.get(), source, length);
+    memcpy(target, bounce_buffer.get(), length);
+    return (uint64_t)length * 2;
+}
+
+static ShmBenchResult run_mailbox(ShmConnection &connection,
+    const ShmBenchOptions &options, uint64_t image_size, bool check,
+    bool bounce = false)
+{
+    ShmBenchResult result;
+    OffsetGenerator offsets(options, image_size);
+    std::vector<uint8_t> buffer(options.block_size, 0x5A);
+
+    auto start_time = bench_clock::now();
+    auto end_time = start_time + std::chrono::seconds(options.seconds);
+
+    for (;;)
+    {
+        auto started = bench_clock::now();
+
+        if (started >= end_time)
+        {
+            break;
+        }
+
+        IMDPROXY_READ_REQ request;
+        request.request_code = options.write ?
+            IMDPROXY_REQ_WRITE : IMDPROXY_REQ_READ;
+        request.offset = offsets.next();
+        request.length = options.block_size;
+
+        if (options.write)
+        {
+            result.copied_bytes += copy_data(connection.mailbox_data(),
+                buffer.data(), buffer.size(), bounce);
+        }
+
+        IMDPROXY_READ_RESP response;
+        connection.call(&request, sizeof(request), nullptr, 0, &response,
+            sizeof(response));
+
+        if (response.errorno != 0)
+        {
+            throw std::system_error((int)response.errorno,
+                std::generic_category(), "Server returned error");
+        }
+
+        if (response.length != options.block_size)
+        {
+            throw std::runtime_error("Invalid response from server");
+        }
+
+        if (!options.write)
+        {
+            result.copied_bytes += copy_data(buffer.data(),
+                connection.mailbox_data(), (size_t)response.length, bounce);
+
+            if (check)
+            {
+                check_pattern(buffer.data(), buffer.size(), request.offset);
+            }
+        }
+
+        result.total_latency += std::chrono::duration<double>(
+            bench_clock::now() - started).count();
+        result.requests++;
+        result.bytes += response.length;
+    }
+
+    result.elapsed = std::chrono::duration<double>(
+        bench_clock::now() - start_time).count();
+
+    return result;
+}
+
+/// Keeps queue_depth slots busy from one thread. Request semaphore is
+/// posted once for all slots filled at a time, server scans all slots
+/// when woken anyway.
+static ShmBenchResult run_ring(ShmConnection &connection,
+    const ShmBenchOptions &options, uint64_t image_size,
+    unsigned queue_depth, bool check)
+{
+    ShmBenchResult result;
+    OffsetGenerator offsets(options, image_size);
+    std::vector<uint8_t> buffer(options.block_size, 0x5A);
+    std::vector<bench_clock::time_point> started(queue_depth);
+    std::vector<uint64_t> offset(queue_depth);
+    unsigned in_flight = 0;
+    bool sending = true;
+
+    auto start_time = bench_clock::now();
+    auto end_time = start_time + std::chrono::seconds(options.seconds);
+
+    while (sending || in_flight > 0)
+    {
+        bool posted = false;
+
+        for (unsigned i = 0; sending && i < queue_depth; i++)
+        {
+            if (started[i] != bench_clock::time_point())
+            {
+                continue;
+            }
+
+            auto now = bench_clock::now();
+
+            if (now >= end_time)
+            {
+                sending = false;
+                break;
+            }
+
+            PIMDPROXY_SHM_RING_SLOT slot = connection.slot(i);
+
+            IMDPROXY_READ_REQ request;
+            request.request_code = options.write ?
+                IMDPROXY_REQ_WRITE : IMDPROXY_REQ_READ;
+            request.offset = offsets.next();
+            request.length = options.block_size;
+
+            memcpy((uint8_t *)slot + IMDPROXY_SHM_RING_SLOT_HEADER_OFFSET,
+                &request, sizeof(request));
+
+            if (options.write)
+            {
+                memcpy((uint8_t *)slot + IMDPROXY_HEADER_SIZE, buffer.data(),
+                    buffer.size());
+            }
+
+            slot->tag = i;
+            offset[i] = request.offset;
+            started[i] = now;
+            in_flight++;
+
+            store_state(slot, IMDPROXY_SHM_RING_SLOT_REQUEST);
+            posted = true;
+        }
+
+        if (posted)
+        {
+            connection.signal_request();
+        }
+
+        if (in_flight == 0)
+        {
+            break;
+        }
+
+        connection.wait_response();
+
+        for (unsigned i = 0; i < queue_depth; i++)
+        {
+            PIMDPROXY_SHM_RING_SLOT slot = connection.slot(i);
+
+            if (started[i] == bench_clock::time_point() ||
+                load_state(slot) != IMDPROXY_SHM_RING_SLOT_RESPONSE)
+            {
+                continue;
+            }
+
+            IMDPROXY_READ_RESP response;
+            memcpy(&response,
+                (uint8_t *)slot + IMDPROXY_SHM_RING_SLOT_HEADER_OFFSET,
+                sizeof(response));
+
+            if (response.errorno != 0)
+            {
+                throw std::system_error((int)response.errorno,
+                    std::generic_category(), "Server returned error");
+            }
+
+            if (response.length != options.block_size || slot->tag != i)
+            {
+                throw std::runtime_error("Invalid response from server");
+            }
+
+            if (!options.write)
+            {
+                memcpy(buffer.data(), (uint8_t *)slot + IMDPROXY_HEADER_SIZE,
+                    (size_t)response.length);
+
+                if (check)
+                {
+                    check_pattern(buffer.data(), buffer.size(), offset[i]);
+                }
+            }
+
+            store_state(slot, IMDPROXY_SHM_RING_SLOT_FREE);
+
+            result.total_latency += std::chrono::duration<double>(
+                bench_clock::now() - started[i]).count();
+            result.requests++;
+            result.bytes += response.length;
+
+            started[i] = bench_clock::time_point();
+            in_flight--;
+        }
+    }
+
+    result.elapsed = std::chrono::duration<double>(
+        bench_clock::now() - start_time).count();
+
+    return result;
+}
+
+static void print_result(const char *layout, unsigned queue_depth,
+    const ShmBenchResult &result)
+{
+    printf("%-8s %11u %12.0f %12.1f %12.3f\n", layout, queue_depth,
+        result.requests / result.elapsed,
+        result.bytes / result.elapsed / 1e6,
+        result.requests > 0 ?
+        result.total_latency / result.requests * 1e3 : 0.0);
+
+    fflush(stdout);
+}
+
+/// Runs mailbox transfers of each size in COPY_TEST_BLOCK_SIZES through
+/// bounce buffers and directly
+static void run_copy_test(ShmConnection &connection,
+    const ShmBenchOptions &options, uint64_t image_size, bool loopback)
+{
+    printf("%s %s through request mailbox\n"
+        "%-8s %11s %12s %12s %12s\n",
+        options.random ? "Random" : "Sequential",
+        options.write ? "write" : "read",
+        "Copies", "Transfer MB", "Requests/s", "GB/s", "Copied MB/req");
+
+    for (size_t block_size : COPY_TEST_BLOCK_SIZES)
+    {
+        if (block_size > connection.mailbox_data_size())
+        {
+            printf("%-8s %11zu %12s\n", "", block_size >> 20,
+                "(shared memory too small)");
+            continue;
+        }
+
+        ShmBenchOptions block_options = options;
+        block_options.block_size = block_size;
+        bool check = loopback && !options.write;
+
+        for (bool bounce : { true, false })
+        {
+            ShmBenchResult result = run_mailbox(connection, block_options,
+                image_size, check, bounce);
+
+            printf("%-8s %11zu %12.0f %12.2f %12.2f\n",
+                bounce ? "bounce" : "direct", block_size >> 20,
+                result.requests / result.elapsed,
+                result.bytes / result.elapsed / 1e9,
+                result.requests > 0 ?
+                (double)result.copied_bytes / result.requests / (1 << 20) :
+                0.0);
+
+            fflush(stdout);
+        }
+    }
+}
+
+/// Writes loopback image, each page starting with its offset
+static std::string create_image(const ShmBenchOptions &options)
+{
+    char path[] = "/tmp/devio-shmbench-XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot create temporary image");
+    }
+
+    std::vector<uint8_t> chunk(1 << 20, 0);
+
+    for (uint64_t offset = 0; offset < options.image_size;
+        offset += chunk.size())
+    {
+        size_t length = (size_t)std::min<uint64_t>(chunk.size(),
+            options.image_size - offset);
+
+        for (size_t i = 0; i < length; i += PATTERN_PAGE_SIZE)
+        {
+            uint64_t page_offset = offset + i;
+            memcpy(chunk.data() + i, &page_offset, sizeof(page_offset));
+        }
+
+        if (pwrite(fd, chunk.data(), length, (off_t)offset) != (ssize_t)length)
+        {
+            int error = errno;
+            close(fd);
+            unlink(path);
+            throw std::system_error(error, std::generic_category(),
+                "Cannot write temporary image");
+        }
+    }
+
+    close(fd);
+
+    return path;
+}
+
+static void run_bench(const ShmBenchOptions &options, bool loopback)
+{
+    unsigned max_depth = 1;
+
+    for (unsigned depth : options.queue_depths)
+    {
+        max_depth = std::max(max_depth, depth);
+    }
+
+    ShmConnection connection(options.name);
+
+    IMDPROXY_INFO_RESP info;
+    ULONGLONG request_code = IMDPROXY_REQ_INFO;
+    connection.call(&request_code, sizeof(request_code), nullptr, 0, &info,
+        sizeof(info));
+
+    if (options.write && (info.flags & IMDPROXY_FLAG_RO))
+    {
+        throw std::runtime_error("Server image is read-only");
+    }
+
+    if (options.copy_test)
+    {
+        run_copy_test(connection, options, info.file_size, loopback);
+        connection.close_session();
+        return;
+    }
+
+    if (options.block_size > connection.mailbox_data_size())
+    {
+        throw std::runtime_error("Block size larger than shared memory");
+    }
+
+    // Image pattern is only known where this process wrote it
+    bool check = loopback && !options.write &&
+        options.block_size % PATTERN_PAGE_SIZE == 0;
+
+    printf("%s %s, %zu byte blocks\n"
+        "%-8s %11s %12s %12s %12s\n",
+        options.random ? "Random" : "Sequential",
+        options.write ? "write" : "read", options.block_size,
+        "Layout", "Queue depth", "Requests/s", "MB/s", "Latency ms");
+
+    print_result("mailbox", 1,
+        run_mailbox(connection, options, info.file_size, check));
+
+    if ((info.flags & IMDPROXY_FLAG_SUPPORTS_SHM_RING) == 0)
+    {
+        printf("Server does not support ring layout.\n");
+        connection.close_session();
+        return;
+    }
+
+    unsigned slots = connection.setup_ring(
+        std::min<unsigned>(max_depth, IMDPROXY_SHM_RING_MAX_SLOTS));
+
+    if (options.block_size > connection.slot_data_size())
+    {
+        connection.close_session();
+        throw std::runtime_error("Block size larger than ring slot data area");
+    }
+
+    for (unsigned depth : options.queue_depths)
+    {
+        if (depth > slots)
+        {
+            printf("%-8s %11u %12s\n", "ring", depth, "(too few slots)");
+            continue;
+        }
+
+        print_result("ring", depth,
+            run_ring(connection, options, info.file_size, depth, check));
+    }
+
+    connection.close_session();
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "devio-shmbench [options] [name]\n"
+        "\n"
+        "Measures requests per second of a devio shared memory server with\n"
+        "the request mailbox and with the ring layout, at each queue depth.\n"
+        "Without name, starts a server in this process on a temporary image\n"
+        "file and checks data read.\n"
+        "\n"
+        "-b, --block-size bytes   Request size, default 4096.\n"
+        "-q, --queue-depths list  Comma separated queue depths for ring\n"
+        "                         layout, default 1,8,32.\n"
+        "-t, --time seconds       Duration of each test, default 3.\n"
+        "-w, --write              Write test. Overwrites image contents!\n"
+        "-R, --random             Random offsets instead of sequential.\n"
+        "-s, --size MB            Size of temporary image, default 256.\n"
+        "-S, --shm-size bytes     Size of shared memory section of server\n"
+        "                         started here, default same as devio-server.\n"
+        "-l, --latency us         Latency added to each read and write by\n"
+        "                         server started here, default 0.\n"
+        "-C, --copy-test          Compare copying each request through a\n"
+        "                         bounce buffer with copying it directly, at\n"
+        "                         1 MB and 8 MB transfers through mailbox.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "block-size", required_argument, nullptr, 'b' },
+        { "queue-depths", required_argument, nullptr, 'q' },
+        { "time", required_argument, nullptr, 't' },
+        { "write", no_argument, nullptr, 'w' },
+        { "random", no_argument, nullptr, 'R' },
+        { "size", required_argument, nullptr, 's' },
+        { "shm-size", required_argument, nullptr, 'S' },
+        { "latency", required_argument, nullptr, 'l' },
+        { "copy-test", no_argument, nullptr, 'C' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    ShmBenchOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:q:t:wRs:S:l:Ch", long_options,
+        nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            options.block_size = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'q':
+        {
+            options.queue_depths.clear();
+
+            for (char *item = strtok(optarg, ","); item != nullptr;
+                item = strtok(nullptr, ","))
+            {
+                options.queue_depths.push_back(
+                    (unsigned)strtoul(item, nullptr, 0));
+            }
+
+            break;
+        }
+
+        case 't':
+            options.seconds = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'w':
+            options.write = true;
+            break;
+
+        case 'R':
+            options.random = true;
+            break;
+
+        case 's':
+            options.image_size = strtoull(optarg, nullptr, 0) << 20;
+            break;
+
+        case 'S':
+            options.shm_size = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'l':
+            options.latency_us = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'C':
+            options.copy_test = true;
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind < argc)
+    {
+        options.name = argv[optind++];
+    }
+
+    bool depths_valid = !options.queue_depths.empty();
+
+    for (unsigned depth : options.queue_depths)
+    {
+        depths_valid = depths_valid && depth > 0;
+    }
+
+    if (optind < argc || options.block_size == 0 || !depths_valid ||
+        options.image_size == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        if (!options.name.empty())
+        {
+            run_bench(options, false);
+            return 0;
+        }
+
+        std::string path = create_image(options);
+        std::unique_ptr<devio::ImageFile> image;
+
+        try
+        {
+            image.reset(new devio::ImageFile({ path }, false));
+        }
+        catch (...)
+        {
+            unlink(path.c_str());
+            throw;
+        }
+
+        unlink(path.c_str());
+
+        DelayedImage delayed_image(*image, options.latency_us);
+
+        devio::ShmServerOptions server_options;
+        server_options.name = "devio-shmbench-" + std::to_string(getpid());
+        server_options.buffer_size = options.shm_size;
+        server_options.worker_threads = IMDPROXY_SHM_RING_MAX_SLOTS;
+
+        devio::ShmServer server(delayed_image, server_options);
+        std::thread server_thread([&server] { server.run(); });
+
+        options.name = server_options.name;
+
+        try
+        {
+            run_bench(options, true);
+        }
+        catch (...)
+        {
+            server.stop();
+            server_thread.join();
+            throw;
+        }
+
+        server.stop();
+        server_thread.join();
+    }
+    catch (const std::exception &ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,495 @@
+/// shmserver.cpp
+/// Devio shared memory server, mailbox and ring layouts.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "shmserver.h"
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <system_error>
+#include <thread>
+
+namespace devio
+{
+
+/// Alignment reported to clients, same as TCP/IP server
+constexpr ULONGLONG REQUIRED_ALIGNMENT = 512;
+
+template<typename T> static T load(const uint8_t *ptr)
+{
+    T value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+template<typename T> static void store(uint8_t *ptr, const T &value)
+{
+    memcpy(ptr, &value, sizeof(value));
+}
+
+static LONG load_state(PIMDPROXY_SHM_RING_SLOT slot)
+{
+    return __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+}
+
+static void store_state(PIMDPROXY_SHM_RING_SLOT slot, LONG state)
+{
+    __atomic_store_n(&slot->state, state, __ATOMIC_SEQ_CST);
+}
+
+std::string ShmServer::section_name(const std::string &name)
+{
+    return "/" + name;
+}
+
+std::string ShmServer::request_event_name(const std::string &name)
+{
+    return "/" + name + "_Request";
+}
+
+std::string ShmServer::response_event_name(const std::string &name)
+{
+    return "/" + name + "_Response";
+}
+
+ShmServer::ShmServer(ImageBackend &image, const ShmServerOptions &options)
+    : image(image), options(options)
+{
+    if (options.name.empty() || options.name.find('/') != std::string::npos ||
+        options.buffer_size <= IMDPROXY_HEADER_SIZE)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "Invalid shared memory name or size");
+    }
+
+    // Section and semaphores are only removed by the server that created
+    // them, so that a second server cannot take over a name in use
+    shm_fd = shm_open(section_name(options.name).c_str(),
+        O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+    if (shm_fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot create shared memory " + options.name);
+    }
+
+    try
+    {
+        if (ftruncate(shm_fd, (off_t)options.buffer_size) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot set shared memory size");
+        }
+
+        void *address = mmap(nullptr, options.buffer_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+
+        if (address == MAP_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot map shared memory");
+        }
+
+        shm = (uint8_t *)address;
+
+        request_event = sem_open(request_event_name(options.name).c_str(),
+            O_CREAT | O_EXCL, 0600, 0);
+
+        if (request_event == SEM_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot create request semaphore");
+        }
+
+        response_event = sem_open(response_event_name(options.name).c_str(),
+            O_CREAT | O_EXCL, 0600, 0);
+
+        if (response_event == SEM_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot create response semaphore");
+        }
+    }
+    catch (...)
+    {
+        close_objects();
+        throw;
+    }
+}
+
+ShmServer::~ShmServer()
+{
+    workers.reset();
+
+    close_objects();
+}
+
+void ShmServer::close_objects()
+{
+    if (response_event != SEM_FAILED)
+    {
+        sem_close(response_event);
+        sem_unlink(response_event_name(options.name).c_str());
+        response_event = SEM_FAILED;
+    }
+
+    if (request_event != SEM_FAILED)
+    {
+        sem_close(request_event);
+        sem_unlink(request_event_name(options.name).c_str());
+        request_event = SEM_FAILED;
+    }
+
+    if (shm != nullptr)
+    {
+        munmap(shm, options.buffer_size);
+        shm = nullptr;
+    }
+
+    if (shm_fd >= 0)
+    {
+        close(shm_fd);
+        shm_unlink(section_name(options.name).c_str());
+        shm_fd = -1;
+    }
+}
+
+void ShmServer::stop()
+{
+    stopping = true;
+    sem_post(request_event);
+}
+
+void ShmServer::run()
+{
+    unsigned thread_count = options.worker_threads;
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    workers.reset(new WorkerPool(thread_count));
+
+    fprintf(stderr, "Serving shared memory %s, %zu bytes, with %u worker "
+        "threads.\n", options.name.c_str(), options.buffer_size, thread_count);
+
+    while (!stopping)
+    {
+        if (sem_wait(request_event) != 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::system_error(errno, std::generic_category(),
+                "Wait for request failed");
+        }
+
+        if (stopping)
+        {
+            break;
+        }
+
+        // A value other than IMDPROXY_REQ_NULL in control page ends ring
+        // layout. It is either IMDPROXY_REQ_CLOSE or first mailbox request
+        // from next client.
+        if (slot_count > 0 && scan_ring())
+        {
+            continue;
+        }
+
+        serve_mailbox();
+    }
+
+    workers.reset();
+}
+
+void ShmServer::serve_mailbox()
+{
+    ULONGLONG request_code = load<ULONGLONG>(shm);
+
+    switch (request_code)
+    {
+    case IMDPROXY_REQ_NULL:
+    case IMDPROXY_REQ_CLOSE:
+        // Client disconnected, or spurious wakeup. No response expected.
+        store<ULONGLONG>(shm, IMDPROXY_REQ_NULL);
+        return;
+
+    case IMDPROXY_REQ_SHM_RING_SETUP:
+        setup_ring();
+        break;
+
+    default:
+        execute(shm, shm + IMDPROXY_HEADER_SIZE,
+            options.buffer_size - IMDPROXY_HEADER_SIZE);
+        break;
+    }
+
+    sem_post(response_event);
+}
+
+void ShmServer::setup_ring()
+{
+    IMDPROXY_SHM_RING_SETUP_REQ request = load<IMDPROXY_SHM_RING_SETUP_REQ>(shm);
+    IMDPROXY_SHM_RING_SETUP_RESP response = { };
+
+    ULONGLONG count = std::min<ULONGLONG>(request.slot_count,
+        IMDPROXY_SHM_RING_MAX_SLOTS);
+
+    // Fewer slots than requested if section is too small for that many
+    while (count > 0 &&
+        IMDPROXY_SHM_RING_SLOT_SIZE(options.buffer_size, count) <=
+        IMDPROXY_HEADER_SIZE)
+    {
+        count--;
+    }
+
+    if (request.version != IMDPROXY_SHM_RING_VERSION)
+    {
+        response.errorno = ENOTSUP;
+    }
+    else if (count == 0)
+    {
+        response.errorno = ENOSPC;
+    }
+    else
+    {
+        slot_count = (unsigned)count;
+        slot_size = (size_t)IMDPROXY_SHM_RING_SLOT_SIZE(options.buffer_size,
+            count);
+        busy_slots = 0;
+
+        for (unsigned i = 0; i < slot_count; i++)
+        {
+            store_state(slot(i), IMDPROXY_SHM_RING_SLOT_FREE);
+        }
+
+        response.slot_count = count;
+        response.slot_size = slot_size;
+    }
+
+    // Zero errorno in first ULONGLONG is also IMDPROXY_REQ_NULL, which
+    // marks control page as in use by ring
+    store(shm, response);
+}
+
+bool ShmServer::scan_ring()
+{
+    if (load<ULONGLONG>(shm) != IMDPROXY_REQ_NULL)
+    {
+        close_ring();
+        return false;
+    }
+
+    // Last new request found is kept back, and served here if no other
+    // request is in progress, which saves a thread switch at queue depth 1
+    int pending = -1;
+
+    for (unsigned i = 0; i < slot_count; i++)
+    {
+        uint32_t slot_bit = 1U << i;
+
+        if (load_state(slot(i)) != IMDPROXY_SHM_RING_SLOT_REQUEST ||
+            (busy_slots.fetch_or(slot_bit) & slot_bit))
+        {
+            continue;
+        }
+
+        // Worker thread can have answered the request seen above and
+        // released slot since then
+        if (load_state(slot(i)) != IMDPROXY_SHM_RING_SLOT_REQUEST)
+        {
+            busy_slots.fetch_and(~slot_bit);
+            continue;
+        }
+
+        if (pending >= 0)
+        {
+            unsigned index = (unsigned)pending;
+            workers->submit([this, index] { serve_slot(index); });
+        }
+
+        pending = (int)i;
+    }
+
+    if (pending < 0)
+    {
+        return true;
+    }
+
+    unsigned index = (unsigned)pending;
+
+    if (busy_slots == 1U << index)
+    {
+        serve_slot(index);
+    }
+    else
+    {
+        workers->submit([this, index] { serve_slot(index); });
+    }
+
+    return true;
+}
+
+void ShmServer::serve_slot(unsigned index)
+{
+    PIMDPROXY_SHM_RING_SLOT ring_slot = slot(index);
+    uint32_t slot_bit = 1U << index;
+
+    execute((uint8_t *)ring_slot + IMDPROXY_SHM_RING_SLOT_HEADER_OFFSET,
+        (uint8_t *)ring_slot + IMDPROXY_HEADER_SIZE,
+        slot_size - IMDPROXY_HEADER_SIZE);
+
+    store_state(ring_slot, IMDPROXY_SHM_RING_SLOT_RESPONSE);
+
+    sem_post(response_event);
+
+    uint32_t busy = busy_slots.fetch_and(~slot_bit) & ~slot_bit;
+
+    // Client may already have reused the slot, and the scan it woke up
+    // skipped it while still marked busy here
+    if (load_state(ring_slot) == IMDPROXY_SHM_RING_SLOT_REQUEST)
+    {
+        sem_post(request_event);
+    }
+
+    if (busy == 0)
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        idle.notify_all();
+    }
+}
+
+void ShmServer::close_ring()
+{
+    {
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        idle.wait(lock, [this] { return busy_slots == 0; });
+    }
+
+    // Semaphores keep counts, unlike the auto reset events of Windows
+    // servers, and ring clients and workers post them more often than they
+    // are waited for. Counts left would answer a mailbox request of next
+    // client twice, or before it was served. Whatever is now in mailbox is
+    // served next anyway.
+    while (sem_trywait(request_event) == 0 || sem_trywait(response_event) == 0)
+    {
+    }
+
+    slot_count = 0;
+    slot_size = 0;
+}
+
+void ShmServer::execute(uint8_t *header, uint8_t *data, size_t data_size)
+{
+    ULONGLONG request_code = load<ULONGLONG>(header);
+
+    switch (request_code)
+    {
+    case IMDPROXY_REQ_INFO:
+    {
+        IMDPROXY_INFO_RESP response;
+        response.file_size = image.size();
+        response.req_alignment = REQUIRED_ALIGNMENT;
+        response.flags = IMDPROXY_FLAG_SUPPORTS_SHM_RING;
+
+        if (image.read_only())
+        {
+            response.flags |= IMDPROXY_FLAG_RO;
+        }
+        else
+        {
+            response.flags |= IMDPROXY_FLAG_SUPPORTS_ZERO;
+
+            if (image.supports_punch_hole())
+            {
+                response.flags |= IMDPROXY_FLAG_SUPPORTS_UNMAP;
+            }
+        }
+
+        store(header, response);
+        return;
+    }
+
+    case IMDPROXY_REQ_READ:
+    case IMDPROXY_REQ_WRITE:
+    {
+        IMDPROXY_READ_REQ request = load<IMDPROXY_READ_REQ>(header);
+        IMDPROXY_READ_RESP response = { };
+
+        // Data goes straight between slot data area and image
+        if (request.length > data_size)
+        {
+            response.errorno = EINVAL;
+        }
+        else
+        {
+            ssize_t result = request_code == IMDPROXY_REQ_READ ?
+                image.read(data, (size_t)request.length, request.offset) :
+                image.write(data, (size_t)request.length, request.offset);
+
+            if (result < 0)
+            {
+                response.errorno = (ULONGLONG)-result;
+            }
+            else
+            {
+                response.length = (ULONGLONG)result;
+            }
+        }
+
+        store(header, response);
+        return;
+    }
+
+    case IMDPROXY_REQ_UNMAP:
+    case IMDPROXY_REQ_ZERO:
+    {
+        IMDPROXY_UNMAP_REQ request = load<IMDPROXY_UNMAP_REQ>(header);
+        IMDPROXY_UNMAP_RESP response = { };
+
+        if (request.length > data_size)
+        {
+            response.errorno = EINVAL;
+        }
+        else
+        {
+            response.errorno = execute_range_request(image, buffers,
+                request_code, (const DEVICE_DATA_SET_RANGE *)data,
+                (size_t)request.length / sizeof(DEVICE_DATA_SET_RANGE));
+        }
+
+        store(header, response);
+        return;
+    }
+
+    default:
+    {
+        // Every response header starts with errorno
+        IMDPROXY_READ_RESP response = { };
+        response.errorno = ENOSYS;
+
+        store(header, response);
+        return;
+    }
+    }
+}
+
+}
@@ -0,0 +1,138 @@
+/// shmserver.h
+/// Devio shared memory server. Serves an image to one client at a time
+/// through a POSIX shared memory section, with the same layout as shared
+/// memory proxy connections of the driver: a single request mailbox, which
+/// clients can switch to the multi-slot ring layout in aimproxy.h with
+/// IMDPROXY_REQ_SHM_RING_SETUP. Requests in ring slots run in a worker
+/// pool, several at a time, directly on slot data areas.
+///
+/// Request and response events of Windows shared memory proxy servers are
+/// named semaphores here, with the same names, so a client posts the
+/// request semaphore where it would set the request event. Semaphores are
+/// drained when a client leaves ring layout.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_SHMSERVER_H_
+#define _DEVIOSERVER_SHMSERVER_H_
+
+#include "devioproto.h"
+#include "buffers.h"
+#include "imagebackend.h"
+#include "workerpool.h"
+
+#include <semaphore.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace devio
+{
+
+struct ShmServerOptions
+{
+    /// Name of shared memory section, without leading slash. Semaphores
+    /// are named with "_Request" and "_Response" appended.
+    std::string name;
+
+    /// Size of shared memory section, including request header page. Big
+    /// enough by default for IMDPROXY_SHM_RING_MAX_SLOTS slots with 1 MB
+    /// data area each.
+    size_t buffer_size = IMDPROXY_HEADER_SIZE +
+        IMDPROXY_SHM_RING_MAX_SLOTS * ((1 << 20) + IMDPROXY_HEADER_SIZE);
+
+    /// Number of threads that serve ring slots, zero for one per CPU
+    unsigned worker_threads = 0;
+};
+
+class ShmServer
+{
+public:
+
+    /// Creates shared memory section and semaphores. Throws
+    /// std::system_error on failure, or if objects of that name exist.
+    ShmServer(ImageBackend &image, const ShmServerOptions &options);
+
+    /// Removes section and semaphore names
+    ~ShmServer();
+
+    ShmServer(const ShmServer &) = delete;
+    ShmServer &operator=(const ShmServer &) = delete;
+
+    /// Serves clients until stop() is called
+    void run();
+
+    /// Makes run() return. Safe to call from other threads and from
+    /// signal handlers.
+    void stop();
+
+    /// Connection names of section and semaphores, with leading slash
+    static std::string section_name(const std::string &name);
+    static std::string request_event_name(const std::string &name);
+    static std::string response_event_name(const std::string &name);
+
+private:
+
+    /// Unmaps section and closes and removes section and semaphores
+    void close_objects();
+
+    /// Handles request in mailbox at start of section
+    void serve_mailbox();
+
+    /// Handles IMDPROXY_REQ_SHM_RING_SETUP in mailbox
+    void setup_ring();
+
+    /// Hands all new requests in ring slots to worker threads. Returns
+    /// false if client has left ring layout.
+    bool scan_ring();
+
+    void serve_slot(unsigned index);
+
+    /// Waits for requests in progress in ring slots and returns to
+    /// mailbox layout
+    void close_ring();
+
+    /// Executes request with header at header and data area of data_size
+    /// bytes at data, and replaces header with response header
+    void execute(uint8_t *header, uint8_t *data, size_t data_size);
+
+    PIMDPROXY_SHM_RING_SLOT slot(unsigned index) const
+    {
+        return IMDPROXY_SHM_RING_SLOT_PTR(shm, slot_size, index);
+    }
+
+    ImageBackend &image;
+    ShmServerOptions options;
+    BufferPool buffers;
+
+    int shm_fd = -1;
+    uint8_t *shm = nullptr;
+    sem_t *request_event = SEM_FAILED;
+    sem_t *response_event = SEM_FAILED;
+    volatile bool stopping = false;
+
+    /// Zero while mailbox layout is in use
+    unsigned slot_count = 0;
+    size_t slot_size = 0;
+
+    /// Slots handed to worker threads and not yet answered
+    std::atomic<uint32_t> busy_slots{ 0 };
+    std::mutex idle_mutex;
+    std::condition_variable idle;
+
+    std::unique_ptr<WorkerPool> workers;
+};
+
+}
+
+#endif // _DEVIOSERVER_SHMSERVER_H_
@@ -0,0 +1,310 @@
+/// srbpool.h
+/// User mode port of the allocators the driver uses on its SRB path, a
+/// lookaside list for fixed size work items and a size classed buffer pool
+/// with per-CPU magazines (phdskmnt/bufpool.cpp). Used by devio-poolbench
+/// to measure allocation cost per request on Linux.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_SRBPOOL_H_
+#define _DEVIOSERVER_SRBPOOL_H_
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace devio
+{
+
+/// Same limits as IMSCSI_BUFFER_POOL_xxx in phdskmnt.h
+constexpr unsigned SRB_POOL_MIN_SHIFT = 12;
+constexpr unsigned SRB_POOL_CLASSES = 12;
+constexpr unsigned SRB_POOL_MAX_MAGAZINES = 64;
+constexpr unsigned SRB_POOL_MAGAZINE_SIZE = 8;
+constexpr size_t SRB_POOL_MAGAZINE_BYTES = 512 << 10;
+constexpr unsigned SRB_POOL_MAX_DEPOT_DEPTH = 64;
+
+/// Counterpart of NPAGED_LOOKASIDE_LIST. Keeps up to depth free blocks of
+/// one size.
+class LookasideList
+{
+public:
+
+    LookasideList(size_t block_size, size_t max_depth = 256)
+        : size(block_size), depth(max_depth)
+    {
+        free_blocks.reserve(depth);
+    }
+
+    ~LookasideList()
+    {
+        for (void *block : free_blocks)
+        {
+            free(block);
+        }
+    }
+
+    LookasideList(const LookasideList &) = delete;
+    LookasideList &operator=(const LookasideList &) = delete;
+
+    /// Returns nullptr if allocation fails, like
+    /// ExAllocateFromNPagedLookasideList
+    void *allocate()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!free_blocks.empty())
+            {
+                void *block = free_blocks.back();
+                free_blocks.pop_back();
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return block;
+            }
+        }
+
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return malloc(size);
+    }
+
+    void release(void *block)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (free_blocks.size() < depth)
+            {
+                free_blocks.push_back(block);
+                return;
+            }
+        }
+
+        free(block);
+    }
+
+    std::atomic<uint64_t> hits{ 0 };
+    std::atomic<uint64_t> misses{ 0 };
+
+private:
+
+    std::mutex mutex;
+    std::vector<void *> free_blocks;
+    size_t size;
+    size_t depth;
+};
+
+/// Counterpart of IMSCSI_BUFFER_POOL. Buffers are page aligned, as
+/// non-paged pool allocations of a page or more are. Kernel version raises
+/// IRQL to stay on one CPU while a magazine is used. A thread here can move
+/// to another CPU at any time, so magazines are only mostly uncontended and
+/// each has a mutex. max_size zero disables pool, so that all buffers come
+/// directly from system allocator.
+class SrbBufferPool
+{
+public:
+
+    explicit SrbBufferPool(size_t max_size)
+    {
+        if (max_size == 0)
+        {
+            return;
+        }
+
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+        magazine_count = (unsigned)std::min<long>(std::max<long>(cpus, 1),
+            SRB_POOL_MAX_MAGAZINES);
+
+        magazines.reset(new Magazine[magazine_count]);
+
+        for (unsigned size_class = 0; size_class < SRB_POOL_CLASSES; size_class++)
+        {
+            size_t class_size = class_bytes(size_class);
+
+            magazine_depth[size_class] = (unsigned)std::min<size_t>(
+                SRB_POOL_MAGAZINE_SIZE, SRB_POOL_MAGAZINE_BYTES / class_size);
+
+            depot_depth[size_class] = (unsigned)std::max<size_t>(1,
+                std::min<size_t>(SRB_POOL_MAX_DEPOT_DEPTH, max_size / class_size));
+        }
+    }
+
+    ~SrbBufferPool()
+    {
+        for (unsigned i = 0; i < magazine_count; i++)
+        {
+            for (unsigned size_class = 0; size_class < SRB_POOL_CLASSES; size_class++)
+            {
+                while (magazines[i].count[size_class] > 0)
+                {
+                    free(magazines[i].buffers[size_class][--magazines[i].count[size_class]]);
+                }
+            }
+        }
+
+        for (unsigned size_class = 0; size_class < SRB_POOL_CLASSES; size_class++)
+        {
+            for (void *buffer : depots[size_class].buffers)
+            {
+                free(buffer);
+            }
+        }
+    }
+
+    SrbBufferPool(const SrbBufferPool &) = delete;
+    SrbBufferPool &operator=(const SrbBufferPool &) = delete;
+
+    /// Returns nullptr if allocation fails
+    void *allocate(size_t size)
+    {
+        unsigned size_class = size_class_of(size);
+        void *buffer = nullptr;
+
+        if (magazines && size_class < SRB_POOL_CLASSES)
+        {
+            Magazine &magazine = current_magazine();
+
+            {
+                std::lock_guard<std::mutex> lock(magazine.mutex);
+
+                if (magazine.count[size_class] > 0)
+                {
+                    buffer = magazine.buffers[size_class][--magazine.count[size_class]];
+                }
+            }
+
+            if (buffer == nullptr)
+            {
+                Depot &depot = depots[size_class];
+                std::lock_guard<std::mutex> lock(depot.mutex);
+
+                if (!depot.buffers.empty())
+                {
+                    buffer = depot.buffers.back();
+                    depot.buffers.pop_back();
+                }
+            }
+
+            if (buffer != nullptr)
+            {
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return buffer;
+            }
+
+            size = class_bytes(size_class);
+        }
+
+        fallbacks.fetch_add(1, std::memory_order_relaxed);
+
+        if (posix_memalign(&buffer, 4096, size) != 0)
+        {
+            return nullptr;
+        }
+
+        return buffer;
+    }
+
+    /// size can be smaller than requested at allocation, but not larger
+    void release(void *buffer, size_t size)
+    {
+        unsigned size_class = size_class_of(size);
+
+        if (!magazines || size_class >= SRB_POOL_CLASSES)
+        {
+            free(buffer);
+            return;
+        }
+
+        Magazine &magazine = current_magazine();
+
+        {
+            std::lock_guard<std::mutex> lock(magazine.mutex);
+
+            if (magazine.count[size_class] < magazine_depth[size_class])
+            {
+                magazine.buffers[size_class][magazine.count[size_class]++] = buffer;
+                return;
+            }
+        }
+
+        {
+            Depot &depot = depots[size_class];
+            std::lock_guard<std::mutex> lock(depot.mutex);
+
+            if (depot.buffers.size() < depot_depth[size_class])
+            {
+                depot.buffers.push_back(buffer);
+                return;
+            }
+        }
+
+        free(buffer);
+    }
+
+    std::atomic<uint64_t> hits{ 0 };
+    std::atomic<uint64_t> fallbacks{ 0 };
+
+private:
+
+    struct alignas(64) Magazine
+    {
+        std::mutex mutex;
+        uint8_t count[SRB_POOL_CLASSES] = { };
+        void *buffers[SRB_POOL_CLASSES][SRB_POOL_MAGAZINE_SIZE] = { };
+    };
+
+    struct Depot
+    {
+        std::mutex mutex;
+        std::vector<void *> buffers;
+    };
+
+    static size_t class_bytes(unsigned size_class)
+    {
+        return (size_t)1 << (SRB_POOL_MIN_SHIFT + size_class);
+    }
+
+    static unsigned size_class_of(size_t size)
+    {
+        unsigned size_class = 0;
+
+        while (size_class < SRB_POOL_CLASSES && class_bytes(size_class) < size)
+        {
+            size_class++;
+        }
+
+        return size_class;
+    }
+
+    Magazine &current_magazine()
+    {
+        int cpu = sched_getcpu();
+
+        return magazines[(unsigned)(cpu < 0 ? 0 : cpu) % magazine_count];
+    }
+
+    std::unique_ptr<Magazine[]> magazines;
+    unsigned magazine_count = 0;
+    unsigned magazine_depth[SRB_POOL_CLASSES] = { };
+    unsigned depot_depth[SRB_POOL_CLASSES] = { };
+    Depot depots[SRB_POOL_CLASSES];
+};
+
+}
+
+#endif // _DEVIOSERVER_SRBPOOL_H_
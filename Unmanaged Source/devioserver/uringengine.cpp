@@ -0,0 +1,558 @@
+/// uringengine.cpp
+/// Asynchronous backend I/O for devio server through Linux io_uring.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "uringengine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <system_error>
+#include <vector>
+
+namespace devio
+{
+
+/// Largest transfer in one submission, io_uring lengths are 32 bit
+constexpr uint64_t URING_MAX_CHUNK = 1U << 30;
+
+struct UringEngine::Operation
+{
+    uint8_t opcode;             // IORING_OP_READ, IORING_OP_WRITE or
+                                // IORING_OP_FALLOCATE
+    uint8_t *buffer;
+    int buffer_index;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t done = 0;
+    uint64_t chunk = 0;         // Length of request in the kernel
+    int error = 0;
+    Callback callback;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+        flags, nullptr, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg,
+    unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+UringEngine::UringEngine(const ImageFile &image, BufferPool &buffers,
+    unsigned entries)
+    : image(image)
+{
+    try
+    {
+        struct io_uring_params params = { };
+
+        ring_fd = uring_setup(entries, &params);
+        if (ring_fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "io_uring_setup");
+        }
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+
+        if (sq_ring == MAP_FAILED)
+        {
+            sq_ring = nullptr;
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot map io_uring submission queue");
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            cq_ring = sq_ring;
+        }
+        else
+        {
+            cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+
+            if (cq_ring == MAP_FAILED)
+            {
+                cq_ring = nullptr;
+                throw std::system_error(errno, std::generic_category(),
+                    "Cannot map io_uring completion queue");
+            }
+        }
+
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        void *sqe_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+        if (sqe_map == MAP_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot map io_uring submission entries");
+        }
+
+        sqes = (struct io_uring_sqe *)sqe_map;
+
+        uint8_t *sq = (uint8_t *)sq_ring;
+        sq_head = (unsigned *)(sq + params.sq_off.head);
+        sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+        sq_array = (unsigned *)(sq + params.sq_off.array);
+        sqe_tail = sqe_submitted = *sq_tail;
+
+        uint8_t *cq = (uint8_t *)cq_ring;
+        cq_head = (unsigned *)(cq + params.cq_off.head);
+        cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        // Plain read and write operations need Linux 5.6, same as probing
+        // itself, so a failing probe means io_uring is too old to be used.
+        std::vector<uint8_t> probe_buffer(sizeof(struct io_uring_probe) +
+            256 * sizeof(struct io_uring_probe_op));
+        struct io_uring_probe *probe =
+            (struct io_uring_probe *)probe_buffer.data();
+
+        if (uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "io_uring does not support probing operations");
+        }
+
+        auto supported = [probe](unsigned opcode)
+        {
+            return opcode <= probe->last_op &&
+                (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+        };
+
+        if (!supported(IORING_OP_READ) || !supported(IORING_OP_WRITE) ||
+            !supported(IORING_OP_READ_FIXED) || !supported(IORING_OP_WRITE_FIXED))
+        {
+            throw std::system_error(EOPNOTSUPP, std::generic_category(),
+                "io_uring does not support read and write operations");
+        }
+
+        can_fallocate = supported(IORING_OP_FALLOCATE);
+
+        std::vector<int> fds;
+        for (const ImageFile::Part &part : image.parts())
+        {
+            fds.push_back(part.fd);
+        }
+
+        fixed_files = uring_register(ring_fd, IORING_REGISTER_FILES,
+            fds.data(), (unsigned)fds.size()) == 0;
+
+        // Registering buffers counts against RLIMIT_MEMLOCK on older
+        // kernels. Plain reads and writes work without it.
+        const std::vector<struct iovec> &arena = buffers.arena_buffers();
+        if (!arena.empty())
+        {
+            fixed_buffers = uring_register(ring_fd, IORING_REGISTER_BUFFERS,
+                arena.data(), (unsigned)arena.size()) == 0;
+
+            if (!fixed_buffers)
+            {
+                fprintf(stderr, "Cannot register io_uring buffers: %s\n",
+                    strerror(errno));
+            }
+        }
+
+        completion_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (completion_event_fd < 0 ||
+            uring_register(ring_fd, IORING_REGISTER_EVENTFD,
+                &completion_event_fd, 1) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                "Cannot register io_uring eventfd");
+        }
+    }
+    catch (...)
+    {
+        close_ring();
+        throw;
+    }
+}
+
+UringEngine::~UringEngine()
+{
+    // Kernel may still access buffers of requests in flight, so wait for
+    // them. Their callbacks are dropped, nobody is interested any more.
+    submit();
+
+    while (in_flight > 0)
+    {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+        {
+            if (uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+                errno != EINTR)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        for (; head != tail; head++)
+        {
+            delete (Operation *)(uintptr_t)cqes[head & cq_mask].user_data;
+            in_flight--;
+        }
+
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    for (Operation *operation : backlog)
+    {
+        delete operation;
+    }
+
+    for (Operation *operation : finished)
+    {
+        delete operation;
+    }
+
+    close_ring();
+}
+
+void UringEngine::close_ring()
+{
+    if (sqes != nullptr)
+    {
+        munmap(sqes, sqes_size);
+        sqes = nullptr;
+    }
+
+    if (cq_ring != nullptr && cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+
+    cq_ring = nullptr;
+
+    if (sq_ring != nullptr)
+    {
+        munmap(sq_ring, sq_ring_size);
+        sq_ring = nullptr;
+    }
+
+    if (completion_event_fd >= 0)
+    {
+        close(completion_event_fd);
+        completion_event_fd = -1;
+    }
+
+    if (ring_fd >= 0)
+    {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+}
+
+void UringEngine::read(uint8_t *buffer, int buffer_index, size_t length,
+    uint64_t offset, Callback callback)
+{
+    start(new Operation{ IORING_OP_READ, buffer, buffer_index, offset,
+        length, 0, 0, 0, std::move(callback) });
+}
+
+void UringEngine::write(const uint8_t *buffer, int buffer_index,
+    size_t length, uint64_t offset, Callback callback)
+{
+    Operation *operation = new Operation{ IORING_OP_WRITE, (uint8_t *)buffer,
+        buffer_index, offset, length, 0, 0, 0, std::move(callback) };
+
+    if (image.read_only())
+    {
+        operation->error = -EROFS;
+    }
+
+    start(operation);
+}
+
+void UringEngine::punch_hole(uint64_t offset, uint64_t length,
+    Callback callback)
+{
+    if (offset >= image.size())
+    {
+        length = 0;
+    }
+    else
+    {
+        length = std::min(length, image.size() - offset);
+    }
+
+    start(new Operation{ IORING_OP_FALLOCATE, nullptr, -1, offset, length,
+        0, 0, 0, std::move(callback) });
+}
+
+void UringEngine::start(Operation *operation)
+{
+    // Operations are split at image part boundaries and continued after
+    // short transfers, one request in the kernel at a time.
+    if (operation->error != 0 ||
+        operation->done >= operation->length ||
+        image.find_part(operation->offset + operation->done) >=
+        image.parts().size())
+    {
+        bool was_empty = finished.empty();
+        finished.push_back(operation);
+
+        // Make sure reap() gets called even if nothing is in flight
+        if (was_empty)
+        {
+            uint64_t value = 1;
+            ssize_t result = ::write(completion_event_fd, &value, sizeof(value));
+            (void)result;
+        }
+
+        return;
+    }
+
+    if (in_flight >= sq_entries || !backlog.empty() || !prepare(operation))
+    {
+        backlog.push_back(operation);
+    }
+}
+
+io_uring_sqe *UringEngine::get_sqe()
+{
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+    if (sqe_tail - head >= sq_entries)
+    {
+        return nullptr;
+    }
+
+    unsigned index = sqe_tail & sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sqe_tail++;
+
+    return sqe;
+}
+
+bool UringEngine::prepare(Operation *operation)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr)
+    {
+        return false;
+    }
+
+    uint64_t position = operation->offset + operation->done;
+    size_t index = image.find_part(position);
+    const ImageFile::Part &part = image.parts()[index];
+    uint64_t part_offset = position - part.start;
+
+    operation->chunk = std::min(operation->length - operation->done,
+        part.size - part_offset);
+
+    if (fixed_files)
+    {
+        sqe->fd = (int)index;
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    else
+    {
+        sqe->fd = part.fd;
+    }
+
+    sqe->off = part_offset;
+    sqe->user_data = (uintptr_t)operation;
+
+    if (operation->opcode == IORING_OP_FALLOCATE)
+    {
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->addr = operation->chunk;
+        sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+    }
+    else
+    {
+        operation->chunk = std::min(operation->chunk, URING_MAX_CHUNK);
+
+        bool is_fixed = fixed_buffers && operation->buffer_index >= 0;
+
+        if (operation->opcode == IORING_OP_READ)
+        {
+            sqe->opcode = is_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        }
+        else
+        {
+            sqe->opcode = is_fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        }
+
+        sqe->addr = (uintptr_t)(operation->buffer + operation->done);
+        sqe->len = (unsigned)operation->chunk;
+
+        if (is_fixed)
+        {
+            sqe->buf_index = (uint16_t)operation->buffer_index;
+        }
+    }
+
+    in_flight++;
+    return true;
+}
+
+void UringEngine::submit()
+{
+    unsigned to_submit = sqe_tail - sqe_submitted;
+
+    if (to_submit == 0)
+    {
+        return;
+    }
+
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+    while (to_submit > 0)
+    {
+        int result = uring_enter(ring_fd, to_submit, 0, 0);
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            // Entries stay in the ring and are picked up by the next call
+            if (errno != EAGAIN && errno != EBUSY)
+            {
+                perror("io_uring_enter");
+            }
+
+            return;
+        }
+
+        sqe_submitted += (unsigned)result;
+        to_submit -= (unsigned)result;
+    }
+}
+
+void UringEngine::complete(Operation *operation, int result)
+{
+    in_flight--;
+
+    if (result == -EINTR || result == -EAGAIN)
+    {
+        // Try same chunk again
+    }
+    else if (result < 0)
+    {
+        operation->error = result;
+    }
+    else if (operation->opcode == IORING_OP_FALLOCATE)
+    {
+        operation->done += operation->chunk;
+    }
+    else if (result == 0)
+    {
+        if (operation->opcode == IORING_OP_READ)
+        {
+            // File shorter than when it was opened, treat as end of image
+            operation->length = operation->done;
+        }
+        else
+        {
+            operation->error = -EIO;
+        }
+    }
+    else
+    {
+        operation->done += (unsigned)result;
+    }
+
+    start(operation);
+}
+
+void UringEngine::finish(Operation *operation)
+{
+    ssize_t result = operation->error != 0 ?
+        operation->error : (ssize_t)operation->done;
+
+    Callback callback = std::move(operation->callback);
+    delete operation;
+
+    callback(result);
+}
+
+void UringEngine::reap()
+{
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+        Operation *operation = (Operation *)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        complete(operation, result);
+    }
+
+    // Room in the ring for operations waiting for it
+    while (!backlog.empty() && in_flight < sq_entries &&
+        prepare(backlog.front()))
+    {
+        backlog.pop_front();
+    }
+
+    // Callbacks can start new operations, which can end up here too
+    while (!finished.empty())
+    {
+        Operation *operation = finished.front();
+        finished.pop_front();
+
+        finish(operation);
+    }
+}
+
+}
@@ -0,0 +1,150 @@
+/// uringengine.h
+/// Asynchronous backend I/O for devio server through Linux io_uring. Lets
+/// the event loop thread keep hundreds of reads and writes in flight
+/// against an ImageFile without one worker thread per request. Image parts
+/// are registered as fixed files and BufferPool arena buffers as fixed
+/// buffers where the kernel allows it.
+///
+/// Uses the io_uring system calls directly, so that no liburing is needed.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_URINGENGINE_H_
+#define _DEVIOSERVER_URINGENGINE_H_
+
+#include "buffers.h"
+#include "imagefile.h"
+
+#include <deque>
+#include <functional>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace devio
+{
+
+class UringEngine
+{
+public:
+
+    /// Called with number of bytes transferred or -errno, on the thread
+    /// that calls reap()
+    typedef std::function<void(ssize_t result)> Callback;
+
+    /// Creates a ring with room for entries requests in flight. Throws
+    /// std::system_error if io_uring is not available or does not support
+    /// operations needed.
+    UringEngine(const ImageFile &image, BufferPool &buffers, unsigned entries);
+
+    /// Waits for requests still in flight, without calling their callbacks
+    ~UringEngine();
+
+    UringEngine(const UringEngine &) = delete;
+    UringEngine &operator=(const UringEngine &) = delete;
+
+    /// eventfd that is signalled when completions are available
+    int event_fd() const
+    {
+        return completion_event_fd;
+    }
+
+    /// Reads length bytes at image offset into buffer, which is assumed to
+    /// be an IoBuffer with given arena index, or -1. Result is less than
+    /// length only at end of image.
+    void read(uint8_t *buffer, int buffer_index, size_t length,
+        uint64_t offset, Callback callback);
+
+    /// Writes length bytes at image offset. Writes that extend beyond end
+    /// of image are truncated.
+    void write(const uint8_t *buffer, int buffer_index, size_t length,
+        uint64_t offset, Callback callback);
+
+    /// Deallocates a range. Only available if supports_punch_hole().
+    void punch_hole(uint64_t offset, uint64_t length, Callback callback);
+
+    /// True if this kernel can deallocate ranges through io_uring
+    bool supports_punch_hole() const
+    {
+        return can_fallocate && image.supports_punch_hole();
+    }
+
+    /// Passes prepared requests to the kernel
+    void submit();
+
+    /// Processes available completions, calling callbacks
+    void reap();
+
+    bool uses_fixed_buffers() const
+    {
+        return fixed_buffers;
+    }
+
+    bool uses_fixed_files() const
+    {
+        return fixed_files;
+    }
+
+private:
+
+    struct Operation;
+
+    void close_ring();
+    void start(Operation *operation);
+    bool prepare(Operation *operation);
+    void complete(Operation *operation, int result);
+    void finish(Operation *operation);
+    io_uring_sqe *get_sqe();
+
+    const ImageFile &image;
+
+    int ring_fd = -1;
+    int completion_event_fd = -1;
+
+    void *sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void *cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    unsigned sqe_tail = 0;
+    unsigned sqe_submitted = 0;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe *cqes;
+
+    bool fixed_buffers = false;
+    bool fixed_files = false;
+    bool can_fallocate = false;
+
+    /// Operations with a request in the kernel. Limited to sq_entries so
+    /// that completion queue can never overflow.
+    unsigned in_flight = 0;
+
+    /// Operations waiting for room in the ring
+    std::deque<Operation *> backlog;
+
+    /// Operations done without a request to the kernel, such as reads at
+    /// end of image. Callbacks are called from reap(), never directly from
+    /// read() or write().
+    std::deque<Operation *> finished;
+};
+
+}
+
+#endif // _DEVIOSERVER_URINGENGINE_H_
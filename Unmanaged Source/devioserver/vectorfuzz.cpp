@@ -0,0 +1,607 @@
+/// vectorfuzz.cpp
+/// devio-vectorfuzz command line application. Randomized tests of the
+/// vectored request encoder and validator in phdskmnt/inc/aimproxy.h,
+/// ImdProxyAddVectoredExtent and ImdProxyValidateVectoredRequest, against
+/// a reference model that uses 128 bit arithmetic and so cannot overflow.
+///
+/// Each iteration encodes a random list of extents, sorted, unsorted,
+/// overlapping, contiguous or near end of address space, with up to 65
+/// extents that do not merge. Merging, full requests and the return value
+/// of each call are checked against the model, and the encoded request
+/// must validate exactly when the model says that it is well formed. The
+/// request is then mutated, with extent counts of 0, 64, 65 and beyond,
+/// declared lengths off by one, extent lengths that wrap the sum or the
+/// address space, a lower max_length, or a header truncated anywhere, and
+/// the validator must again agree with the model. Received headers are
+/// copied to buffers of exactly the received size, so that builds with
+/// -fsanitize=address catch reads beyond a truncated header.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "devioproto.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+typedef unsigned __int128 uint128_t;
+
+/// Largest request data block the driver sends, as IMSCSI_VECTORED_MAX_LENGTH
+/// in phdskmnt.h
+constexpr ULONGLONG DRIVER_MAX_LENGTH = 4 << 20;
+
+struct FuzzOptions
+{
+    unsigned iterations = 1000000;
+    unsigned mutations = 8;
+    uint64_t seed = 1;
+};
+
+struct FuzzStats
+{
+    uint64_t encoded = 0;
+    uint64_t merged = 0;
+    uint64_t full = 0;
+    uint64_t validated = 0;
+    uint64_t accepted = 0;
+    uint64_t rejected = 0;
+    uint64_t errors = 0;
+};
+
+struct ModelExtent
+{
+    uint128_t offset;
+    uint128_t length;
+};
+
+/// Request as the encoder should build it, with lengths that cannot wrap
+struct ModelRequest
+{
+    std::vector<ModelExtent> extents;
+    uint128_t length = 0;
+
+    /// Adds an extent the way ImdProxyAddVectoredExtent is documented to.
+    /// Ends beyond address space never equal a 64 bit offset here, so an
+    /// extent that wraps is never merged with the next one.
+    bool add(uint64_t offset, uint64_t length_to_add)
+    {
+        if (!extents.empty() &&
+            extents.back().offset + extents.back().length == offset &&
+            extents.back().length + length_to_add <= UINT64_MAX)
+        {
+            extents.back().length += length_to_add;
+            length += length_to_add;
+            return true;
+        }
+
+        if (extents.size() >= IMDPROXY_VECTORED_MAX_EXTENTS)
+        {
+            return false;
+        }
+
+        extents.push_back({ offset, length_to_add });
+        length += length_to_add;
+        return true;
+    }
+
+    /// True if request can be sent as it is, each extent within address
+    /// space and sum of lengths representable and within max_length
+    bool well_formed(ULONGLONG max_length) const
+    {
+        for (const ModelExtent &extent : extents)
+        {
+            if (extent.offset + extent.length > UINT64_MAX)
+            {
+                return false;
+            }
+        }
+
+        return length <= max_length;
+    }
+};
+
+/// Validity of a received request header, from its raw fields. The data
+/// block length must match the sum of extent lengths exactly.
+static bool model_valid(const IMDPROXY_VECTORED_REQ &request,
+    ULONGLONG header_size, ULONGLONG max_length)
+{
+    if (header_size < 3 * sizeof(ULONGLONG) ||
+        request.extent_count > IMDPROXY_VECTORED_MAX_EXTENTS ||
+        header_size < 3 * sizeof(ULONGLONG) +
+        request.extent_count * sizeof(IMDPROXY_EXTENT) ||
+        request.length > max_length)
+    {
+        return false;
+    }
+
+    uint128_t total = 0;
+
+    for (ULONGLONG i = 0; i < request.extent_count; i++)
+    {
+        if ((uint128_t)request.extents[i].offset +
+            request.extents[i].length > UINT64_MAX)
+        {
+            return false;
+        }
+
+        total += request.extents[i].length;
+    }
+
+    return total == request.length;
+}
+
+class VectorFuzz
+{
+public:
+
+    VectorFuzz(const FuzzOptions &options)
+        : options(options), random(options.seed)
+    {
+    }
+
+    void run()
+    {
+        run_fixed_cases();
+
+        for (iteration = 0; iteration < options.iterations; iteration++)
+        {
+            run_iteration();
+        }
+    }
+
+    const FuzzStats &statistics() const
+    {
+        return stats;
+    }
+
+private:
+
+    uint64_t below(uint64_t limit)
+    {
+        return std::uniform_int_distribution<uint64_t>(0, limit - 1)(random);
+    }
+
+    bool percent(unsigned value)
+    {
+        return below(100) < value;
+    }
+
+    void error(const char *format, unsigned long long value)
+    {
+        if (stats.errors++ < 20)
+        {
+            fprintf(stderr, "Iteration %u: ", iteration);
+            fprintf(stderr, format, value);
+            fputc('\n', stderr);
+        }
+    }
+
+    /// Validates header_size bytes of request, received into a buffer of
+    /// exactly that size, and compares with model
+    void validate(const IMDPROXY_VECTORED_REQ &request, ULONGLONG header_size,
+        ULONGLONG max_length)
+    {
+        std::unique_ptr<uint8_t[]> received(new uint8_t[header_size]);
+        memcpy(received.get(), &request, (size_t)header_size);
+
+        bool valid = ImdProxyValidateVectoredRequest(
+            (const IMDPROXY_VECTORED_REQ *)received.get(), header_size,
+            max_length) != 0;
+
+        bool expected = model_valid(request, header_size, max_length);
+
+        stats.validated++;
+
+        if (valid)
+        {
+            stats.accepted++;
+        }
+        else
+        {
+            stats.rejected++;
+        }
+
+        if (valid != expected)
+        {
+            error(valid ?
+                "Malformed request with %llu extents accepted" :
+                "Valid request with %llu extents rejected",
+                (unsigned long long)request.extent_count);
+        }
+    }
+
+    /// Picks offset and length of next extent after previous one. Most
+    /// extents are small, as from SRBs, but some are anywhere, up to end
+    /// of address space, or long enough to overflow sums.
+    void next_extent(uint64_t &offset, uint64_t &length, unsigned pattern)
+    {
+        uint64_t previous_end = offset + length;
+
+        if (percent(5))
+        {
+            length = percent(50) ? below(4) << 62 | below(1ULL << 62) :
+                UINT64_MAX - below(16);
+        }
+        else if (percent(5))
+        {
+            length = 0;
+        }
+        else
+        {
+            length = (below(256) + 1) << 9;
+        }
+
+        switch (pattern)
+        {
+        case 0:     // Contiguous, merged by encoder
+            offset = previous_end;
+            break;
+
+        case 1:     // Sorted with gaps
+            offset = previous_end + ((below(64) + 1) << 9);
+            break;
+
+        case 2:     // Unsorted
+            offset = below(1ULL << 40) << 9;
+            break;
+
+        case 3:     // Overlapping previous extent
+            offset = previous_end - std::min(previous_end, below(1 << 20));
+            break;
+
+        default:    // Near end of address space, some wrapping
+            offset = UINT64_MAX - below(1 << 20);
+            break;
+        }
+
+        if (percent(10))
+        {
+            // Mix contiguous extents into all patterns
+            offset = previous_end;
+        }
+    }
+
+    /// Encodes a random list of extents, checking each step against model.
+    /// Returns false if encoded request differs from model.
+    bool encode(IMDPROXY_VECTORED_REQ &request, ModelRequest &model)
+    {
+        unsigned pattern = (unsigned)below(5);
+        unsigned count = percent(30) ? IMDPROXY_VECTORED_MAX_EXTENTS +
+            (unsigned)below(3) - 1 : (unsigned)below(80);
+        uint64_t offset = below(1ULL << 40) << 9;
+        uint64_t length = 0;
+
+        ImdProxyInitVectoredRequest(&request,
+            percent(50) ? IMDPROXY_REQ_READV : IMDPROXY_REQ_WRITEV);
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            next_extent(offset, length, pattern);
+
+            bool added = ImdProxyAddVectoredExtent(&request, offset,
+                length) != 0;
+
+            size_t model_count = model.extents.size();
+            bool expected = model.add(offset, length);
+
+            stats.encoded++;
+
+            if (expected && model.extents.size() == model_count)
+            {
+                stats.merged++;
+            }
+            else if (!expected)
+            {
+                stats.full++;
+            }
+
+            if (added != expected)
+            {
+                error(added ? "Extent %llu added to full request" :
+                    "Extent %llu not added", i);
+                return false;
+            }
+        }
+
+        if (request.extent_count != model.extents.size() ||
+            request.length != (ULONGLONG)model.length)
+        {
+            error("Encoded %llu extents differ from model",
+                request.extent_count);
+            return false;
+        }
+
+        for (size_t i = 0; i < model.extents.size(); i++)
+        {
+            if (request.extents[i].offset != (ULONGLONG)model.extents[i].offset ||
+                request.extents[i].length != (ULONGLONG)model.extents[i].length)
+            {
+                error("Encoded extent %llu differs from model", i);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// Changes one thing in a received request header, the way a faulty or
+    /// hostile sender could
+    void mutate(IMDPROXY_VECTORED_REQ &request, ULONGLONG &header_size,
+        ULONGLONG &max_length)
+    {
+        ULONGLONG count = std::min<ULONGLONG>(request.extent_count,
+            IMDPROXY_VECTORED_MAX_EXTENTS);
+
+        switch (below(8))
+        {
+        case 0:
+        {
+            static const ULONGLONG counts[] =
+            {
+                0, 1, IMDPROXY_VECTORED_MAX_EXTENTS - 1,
+                IMDPROXY_VECTORED_MAX_EXTENTS,
+                IMDPROXY_VECTORED_MAX_EXTENTS + 1,
+                UINT32_MAX, UINT64_MAX
+            };
+
+            request.extent_count = counts[below(7)];
+            break;
+        }
+
+        case 1:
+            request.length += below(3) - 1;
+            break;
+
+        case 2:
+            if (count > 0)
+            {
+                // Extent that wraps address space, or two lengths that
+                // make the sum wrap around to the declared length
+                ULONGLONG i = below(count);
+                ULONGLONG j = below(count);
+
+                if (i == j || percent(50))
+                {
+                    request.extents[i].length = UINT64_MAX -
+                        request.extents[i].offset + 1 + below(4096);
+                }
+                else
+                {
+                    request.extents[i].length += 1ULL << 63;
+                    request.extents[j].length += 1ULL << 63;
+                }
+            }
+            break;
+
+        case 3:
+            if (count > 0)
+            {
+                request.extents[below(count)].offset = UINT64_MAX - below(4096);
+            }
+            break;
+
+        case 4:
+            header_size = below(header_size + 1);
+            break;
+
+        case 5:
+            header_size -= std::min<ULONGLONG>(header_size,
+                below(sizeof(IMDPROXY_EXTENT)) + 1);
+            break;
+
+        case 6:
+            max_length = request.length - std::min<ULONGLONG>(
+                request.length, below(2));
+            break;
+
+        default:
+            // Extra bytes after extents are allowed
+            header_size = std::min<ULONGLONG>(sizeof(request),
+                header_size + below(64));
+            break;
+        }
+    }
+
+    void run_iteration()
+    {
+        IMDPROXY_VECTORED_REQ request;
+        ModelRequest model;
+
+        memset(&request, 0xCC, sizeof(request));
+
+        if (!encode(request, model))
+        {
+            return;
+        }
+
+        ULONGLONG max_length = percent(50) ? DRIVER_MAX_LENGTH : UINT64_MAX;
+        ULONGLONG header_size = IMDPROXY_VECTORED_REQ_SIZE(request.extent_count);
+
+        if (ImdProxyValidateVectoredRequest(&request, header_size,
+            max_length) != (int)model.well_formed(max_length))
+        {
+            error("Encoded request with %llu extents validates differently "
+                "than model", request.extent_count);
+        }
+
+        validate(request, header_size, max_length);
+
+        for (unsigned i = 0; i < options.mutations; i++)
+        {
+            mutate(request, header_size, max_length);
+            validate(request, header_size, max_length);
+        }
+    }
+
+    /// Boundary cases that must hold whatever random numbers are drawn
+    void run_fixed_cases()
+    {
+        IMDPROXY_VECTORED_REQ request;
+
+        ImdProxyInitVectoredRequest(&request, IMDPROXY_REQ_READV);
+
+        if (!ImdProxyValidateVectoredRequest(&request,
+            IMDPROXY_VECTORED_REQ_SIZE(0), 0))
+        {
+            error("Request with %llu extents rejected", 0);
+        }
+
+        if (ImdProxyValidateVectoredRequest(&request,
+            IMDPROXY_VECTORED_REQ_SIZE(0) - 1, 0))
+        {
+            error("Truncated request with %llu extents accepted", 0);
+        }
+
+        for (ULONGLONG i = 0; i < IMDPROXY_VECTORED_MAX_EXTENTS; i++)
+        {
+            if (!ImdProxyAddVectoredExtent(&request, i * 2 * 4096, 4096))
+            {
+                error("Extent %llu not added", i);
+            }
+        }
+
+        if (ImdProxyAddVectoredExtent(&request,
+            IMDPROXY_VECTORED_MAX_EXTENTS * 4 * 4096, 4096))
+        {
+            error("Extent %llu added to full request",
+                IMDPROXY_VECTORED_MAX_EXTENTS);
+        }
+
+        if (!ImdProxyAddVectoredExtent(&request,
+            (IMDPROXY_VECTORED_MAX_EXTENTS * 2 - 1) * 4096, 4096) ||
+            request.extent_count != IMDPROXY_VECTORED_MAX_EXTENTS)
+        {
+            error("Contiguous extent %llu not merged into full request",
+                IMDPROXY_VECTORED_MAX_EXTENTS);
+        }
+
+        validate(request, IMDPROXY_VECTORED_REQ_SIZE(IMDPROXY_VECTORED_MAX_EXTENTS),
+            DRIVER_MAX_LENGTH);
+
+        if (!ImdProxyValidateVectoredRequest(&request,
+            IMDPROXY_VECTORED_REQ_SIZE(IMDPROXY_VECTORED_MAX_EXTENTS),
+            DRIVER_MAX_LENGTH))
+        {
+            error("Full request with %llu extents rejected",
+                IMDPROXY_VECTORED_MAX_EXTENTS);
+        }
+
+        request.extent_count = IMDPROXY_VECTORED_MAX_EXTENTS + 1;
+
+        if (ImdProxyValidateVectoredRequest(&request, sizeof(request),
+            UINT64_MAX))
+        {
+            error("Request with %llu extents accepted",
+                IMDPROXY_VECTORED_MAX_EXTENTS + 1);
+        }
+
+        // Two lengths that wrap the sum around to the declared length
+        ImdProxyInitVectoredRequest(&request, IMDPROXY_REQ_READV);
+        request.extent_count = 2;
+        request.extents[0] = { 0, 1ULL << 63 };
+        request.extents[1] = { 1ULL << 62, (1ULL << 63) + 4096 };
+        request.length = 4096;
+
+        if (ImdProxyValidateVectoredRequest(&request,
+            IMDPROXY_VECTORED_REQ_SIZE(2), UINT64_MAX))
+        {
+            error("Request with wrapping sum of %llu extents accepted", 2);
+        }
+    }
+
+    FuzzOptions options;
+    std::mt19937_64 random;
+    FuzzStats stats;
+    unsigned iteration = 0;
+};
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "devio-vectorfuzz [options]\n"
+        "\n"
+        "Encodes random vectored proxy requests with ImdProxyAddVectoredExtent\n"
+        "and validates them and mutated copies of them with\n"
+        "ImdProxyValidateVectoredRequest, and checks both against a model that\n"
+        "cannot overflow. Exit code is 1 if any errors were found.\n"
+        "\n"
+        "-i, --iterations count      Requests encoded, default 1000000.\n"
+        "-m, --mutations count       Mutated copies validated for each\n"
+        "                            request, default 8.\n"
+        "-s, --seed value            Random seed, default 1.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "iterations", required_argument, nullptr, 'i' },
+        { "mutations", required_argument, nullptr, 'm' },
+        { "seed", required_argument, nullptr, 's' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    FuzzOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "i:m:s:h", long_options,
+        nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            options.iterations = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'm':
+            options.mutations = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 's':
+            options.seed = strtoull(optarg, nullptr, 0);
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind < argc)
+    {
+        usage();
+        return 1;
+    }
+
+    VectorFuzz fuzz(options);
+    fuzz.run();
+
+    const FuzzStats &stats = fuzz.statistics();
+
+    printf("Extents encoded:       %10llu\n", (unsigned long long)stats.encoded);
+    printf("Extents merged:        %10llu\n", (unsigned long long)stats.merged);
+    printf("Extents to full:       %10llu\n", (unsigned long long)stats.full);
+    printf("Requests validated:    %10llu\n", (unsigned long long)stats.validated);
+    printf("Requests accepted:     %10llu\n", (unsigned long long)stats.accepted);
+    printf("Requests rejected:     %10llu\n", (unsigned long long)stats.rejected);
+    printf("Errors:                %10llu\n", (unsigned long long)stats.errors);
+
+    return stats.errors > 0 ? 1 : 0;
+}
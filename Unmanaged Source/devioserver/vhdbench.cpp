@@ -0,0 +1,1261 @@
+/// vhdbench.cpp
+/// devio-vhdbench command line application. Writes a synthetic VHDX
+/// differencing chain, a dynamic base image with a number of differencing
+/// images on top of it, and measures throughput of the native VHDX/VHD
+/// backend of devio server for sequential 1 MB reads and for random 4 KB
+/// reads, with and without lookup cache and parallel block reads. All data
+/// read is verified against a model of which file each sector comes from,
+/// also for a small dynamic and differencing VHD chain.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "vhdimage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+struct BenchOptions
+{
+    std::string directory = "/tmp";
+    uint64_t image_size = 1ULL << 30;
+    uint32_t base_block_size = 32 << 20;
+    uint32_t diff_block_size = 2 << 20;
+    uint32_t sector_size = 512;
+    unsigned depth = 4;
+    unsigned allocated_percent = 75;
+    unsigned written_percent = 5;
+    size_t lookup_cache_blocks = 65536;
+    unsigned read_threads = 0;
+    unsigned reader_threads = 8;
+    unsigned seconds = 5;
+    bool keep = false;
+};
+
+// Model and synthetic data are in units of 512 bytes
+static const uint32_t model_unit = 512;
+
+// Size of writes to differencing images, before some are widened to whole
+// blocks
+static const uint32_t diff_write_size = 64 << 10;
+
+static inline void put_le16(uint8_t *ptr, uint16_t value)
+{
+    ptr[0] = (uint8_t)value;
+    ptr[1] = (uint8_t)(value >> 8);
+}
+
+static inline void put_le32(uint8_t *ptr, uint32_t value)
+{
+    ptr[0] = (uint8_t)value;
+    ptr[1] = (uint8_t)(value >> 8);
+    ptr[2] = (uint8_t)(value >> 16);
+    ptr[3] = (uint8_t)(value >> 24);
+}
+
+static inline void put_le64(uint8_t *ptr, uint64_t value)
+{
+    put_le32(ptr, (uint32_t)value);
+    put_le32(ptr + 4, (uint32_t)(value >> 32));
+}
+
+static inline void put_be32(uint8_t *ptr, uint32_t value)
+{
+    ptr[0] = (uint8_t)(value >> 24);
+    ptr[1] = (uint8_t)(value >> 16);
+    ptr[2] = (uint8_t)(value >> 8);
+    ptr[3] = (uint8_t)value;
+}
+
+static inline void put_be64(uint8_t *ptr, uint64_t value)
+{
+    put_be32(ptr, (uint32_t)(value >> 32));
+    put_be32(ptr + 4, (uint32_t)value);
+}
+
+static inline uint64_t mix64(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+/// Synthetic data written by one file of chain to one 512 byte unit
+static void fill_unit(unsigned layer, uint64_t unit, uint8_t *buffer)
+{
+    uint64_t seed = ((uint64_t)(layer + 1) << 48) ^ (unit << 6);
+
+    for (uint32_t i = 0; i < model_unit; i += 8)
+    {
+        uint64_t value = mix64(seed + i / 8);
+        memcpy(buffer + i, &value, 8);
+    }
+}
+
+static uint32_t crc32c(const uint8_t *data, size_t length)
+{
+    static uint32_t table[256];
+
+    if (table[1] == 0)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+            }
+
+            table[i] = crc;
+        }
+    }
+
+    uint32_t crc = 0xffffffff;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static void write_fully(int fd, const void *buffer, size_t length,
+    uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t result = pwrite(fd, buffer, length, (off_t)offset);
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::system_error(errno, std::generic_category(), "pwrite");
+        }
+
+        buffer = (const uint8_t *)buffer + result;
+        length -= (size_t)result;
+        offset += (uint64_t)result;
+    }
+}
+
+enum class BlockPlan : uint8_t
+{
+    Absent,
+    Zero,
+    Partial,
+    Full
+};
+
+/// What one file of chain contains: state of each block, and for
+/// partially present blocks which sectors are present
+struct LayerPlan
+{
+    uint64_t size;
+    uint32_t block_size;
+    uint32_t sector_size;
+    std::vector<BlockPlan> blocks;
+    std::map<uint64_t, std::vector<bool>> present;
+};
+
+static LayerPlan plan_base(uint64_t size, uint32_t block_size,
+    uint32_t sector_size, unsigned allocated_percent, std::mt19937_64 &random)
+{
+    LayerPlan plan{ size, block_size, sector_size, {}, {} };
+
+    plan.blocks.resize((size_t)((size + block_size - 1) / block_size));
+
+    for (BlockPlan &block : plan.blocks)
+    {
+        if (random() % 100 < allocated_percent)
+        {
+            block = BlockPlan::Full;
+        }
+        else if (random() % 8 == 0)
+        {
+            block = BlockPlan::Zero;
+        }
+    }
+
+    return plan;
+}
+
+/// Differencing file with random 64 KB writes over written_percent of
+/// disk, one in 16 of them widened to whole blocks, and one in 100 blocks
+/// explicitly zeroed
+static LayerPlan plan_diff(uint64_t size, uint32_t block_size,
+    uint32_t sector_size, unsigned written_percent, bool has_zero_blocks,
+    std::mt19937_64 &random)
+{
+    LayerPlan plan{ size, block_size, sector_size, {}, {} };
+
+    plan.blocks.resize((size_t)((size + block_size - 1) / block_size));
+
+    if (has_zero_blocks)
+    {
+        for (BlockPlan &block : plan.blocks)
+        {
+            if (random() % 100 == 0)
+            {
+                block = BlockPlan::Zero;
+            }
+        }
+    }
+
+    uint64_t writes = size * written_percent / 100 / diff_write_size;
+    uint32_t sectors_per_block = block_size / sector_size;
+
+    for (uint64_t i = 0; i < writes; i++)
+    {
+        // Sector aligned, so that runs of present sectors start and end
+        // within bitmap bytes
+        uint64_t offset = random() % (size / sector_size) * sector_size;
+        uint64_t end = std::min(size, offset + diff_write_size);
+        bool whole_block = random() % 16 == 0;
+
+        while (offset < end)
+        {
+            uint64_t block = offset / block_size;
+            uint64_t block_start = block * block_size;
+            uint64_t block_end = std::min(end, block_start + block_size);
+            BlockPlan &state = plan.blocks[(size_t)block];
+
+            if (state == BlockPlan::Absent && whole_block)
+            {
+                state = BlockPlan::Full;
+            }
+            else if (state == BlockPlan::Absent || state == BlockPlan::Partial)
+            {
+                std::vector<bool> &bits = plan.present[block];
+
+                bits.resize(sectors_per_block);
+                state = BlockPlan::Partial;
+
+                for (uint64_t sector = (offset - block_start) / sector_size;
+                    sector < (block_end - block_start + sector_size - 1) /
+                    sector_size; sector++)
+                {
+                    bits[(size_t)sector] = true;
+                }
+            }
+
+            offset = block_end;
+        }
+    }
+
+    return plan;
+}
+
+/// Which file of chain each 512 byte unit comes from, plus one, or zero
+/// for units that read as zeros
+typedef std::vector<uint8_t> Model;
+
+static void apply_plan(Model &model, const LayerPlan &plan, unsigned layer)
+{
+    uint64_t units = plan.size / model_unit;
+    uint32_t units_per_block = plan.block_size / model_unit;
+    uint32_t units_per_sector = plan.sector_size / model_unit;
+
+    for (uint64_t block = 0; block < plan.blocks.size(); block++)
+    {
+        uint64_t first = block * units_per_block;
+        uint64_t last = std::min(units, first + units_per_block);
+
+        switch (plan.blocks[(size_t)block])
+        {
+        case BlockPlan::Absent:
+            break;
+
+        case BlockPlan::Zero:
+            std::fill(model.begin() + first, model.begin() + last, 0);
+            break;
+
+        case BlockPlan::Full:
+            std::fill(model.begin() + first, model.begin() + last,
+                (uint8_t)(layer + 1));
+            break;
+
+        case BlockPlan::Partial:
+        {
+            const std::vector<bool> &bits = plan.present.at(block);
+
+            for (uint64_t unit = first; unit < last; unit++)
+            {
+                if (bits[(size_t)((unit - first) / units_per_sector)])
+                {
+                    model[(size_t)unit] = (uint8_t)(layer + 1);
+                }
+            }
+            break;
+        }
+        }
+    }
+}
+
+/// Writes data of one file of chain for units [first, last) that are
+/// present in it, at file_offset
+static void write_block_data(int fd, const LayerPlan &plan, unsigned layer,
+    uint64_t block, uint64_t file_offset)
+{
+    uint64_t first = block * plan.block_size / model_unit;
+    uint64_t last = std::min(plan.size / model_unit,
+        first + plan.block_size / model_unit);
+    uint32_t units_per_sector = plan.sector_size / model_unit;
+    const std::vector<bool> *bits = nullptr;
+    std::vector<uint8_t> buffer;
+
+    if (plan.blocks[(size_t)block] == BlockPlan::Partial)
+    {
+        bits = &plan.present.at(block);
+    }
+
+    // Runs of present units are written as one write, absent sectors are
+    // left as holes
+    for (uint64_t unit = first; unit < last;)
+    {
+        auto present = [&](uint64_t u)
+        {
+            return bits == nullptr ||
+                (*bits)[(size_t)((u - first) / units_per_sector)];
+        };
+
+        if (!present(unit))
+        {
+            unit++;
+            continue;
+        }
+
+        uint64_t run_end = unit;
+
+        while (run_end < last && present(run_end) &&
+            run_end - unit < (4 << 20) / model_unit)
+        {
+            run_end++;
+        }
+
+        buffer.resize((size_t)(run_end - unit) * model_unit);
+
+        for (uint64_t u = unit; u < run_end; u++)
+        {
+            fill_unit(layer, u, buffer.data() + (u - unit) * model_unit);
+        }
+
+        write_fully(fd, buffer.data(), buffer.size(),
+            file_offset + (unit - first) * model_unit);
+
+        unit = run_end;
+    }
+}
+
+struct Guid16
+{
+    uint8_t bytes[16];
+};
+
+static Guid16 random_guid(std::mt19937_64 &random)
+{
+    Guid16 guid;
+
+    for (int i = 0; i < 16; i += 8)
+    {
+        uint64_t value = random();
+        memcpy(guid.bytes + i, &value, 8);
+    }
+
+    return guid;
+}
+
+static std::string format_guid(const Guid16 &guid)
+{
+    const uint8_t *ptr = guid.bytes;
+    char text[40];
+
+    snprintf(text, sizeof(text),
+        "{%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+        (uint32_t)(ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24)),
+        ptr[4] | (ptr[5] << 8), ptr[6] | (ptr[7] << 8),
+        ptr[8], ptr[9], ptr[10], ptr[11], ptr[12], ptr[13], ptr[14], ptr[15]);
+
+    return text;
+}
+
+static void put_guid(uint8_t *ptr, uint32_t data1, uint16_t data2,
+    uint16_t data3, uint64_t data4)
+{
+    put_le32(ptr, data1);
+    put_le16(ptr + 4, data2);
+    put_le16(ptr + 6, data3);
+    put_be64(ptr + 8, data4);
+}
+
+static std::vector<uint8_t> utf16le(const std::string &text)
+{
+    std::vector<uint8_t> result;
+
+    for (char ch : text)
+    {
+        result.push_back((uint8_t)ch);
+        result.push_back(0);
+    }
+
+    return result;
+}
+
+/// Writes a VHDX file: headers at 64 and 128 KB, region tables at 192 and
+/// 256 KB, an empty log at 1 MB, metadata at 2 MB and BAT at 3 MB, followed
+/// by sector bitmap and payload blocks in order of first use.
+static void write_vhdx(const std::string &path, const LayerPlan &plan,
+    unsigned layer, const Guid16 &data_write_guid, const std::string &parent,
+    const Guid16 &parent_guid)
+{
+    const uint64_t mb = 1 << 20;
+    bool has_parent = !parent.empty();
+    uint32_t chunk_ratio = (uint32_t)((1ULL << 23) * plan.sector_size /
+        plan.block_size);
+    uint64_t block_count = plan.blocks.size();
+    uint64_t chunk_count = (block_count + chunk_ratio - 1) / chunk_ratio;
+    uint64_t entry_count = has_parent ? chunk_count * (chunk_ratio + 1) :
+        block_count + (block_count - 1) / chunk_ratio;
+    uint64_t bat_length = (entry_count * 8 + mb - 1) / mb * mb;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot create " + path);
+    }
+
+    try
+    {
+        uint8_t identifier[64] = { 'v', 'h', 'd', 'x', 'f', 'i', 'l', 'e' };
+        write_fully(fd, identifier, sizeof(identifier), 0);
+
+        for (int copy = 0; copy < 2; copy++)
+        {
+            std::vector<uint8_t> header(4096);
+
+            memcpy(header.data(), "head", 4);
+            put_le64(header.data() + 8, 10 + copy);
+            memcpy(header.data() + 32, data_write_guid.bytes, 16);
+            put_le16(header.data() + 66, 1);
+            put_le32(header.data() + 68, (uint32_t)mb);
+            put_le64(header.data() + 72, mb);
+            put_le32(header.data() + 4, crc32c(header.data(), header.size()));
+
+            write_fully(fd, header.data(), header.size(), (64 << 10) * (copy + 1));
+        }
+
+        std::vector<uint8_t> regions(64 << 10);
+
+        memcpy(regions.data(), "regi", 4);
+        put_le32(regions.data() + 8, 2);
+        put_guid(regions.data() + 16, 0x2dc27766, 0xf623, 0x4200, 0x9d64115e9bfd4a08ULL);
+        put_le64(regions.data() + 32, 3 * mb);
+        put_le32(regions.data() + 40, (uint32_t)bat_length);
+        put_le32(regions.data() + 44, 1);
+        put_guid(regions.data() + 48, 0x8b7ca206, 0x4790, 0x4b9a, 0xb8fe575f050f886eULL);
+        put_le64(regions.data() + 64, 2 * mb);
+        put_le32(regions.data() + 72, (uint32_t)mb);
+        put_le32(regions.data() + 76, 1);
+        put_le32(regions.data() + 4, crc32c(regions.data(), regions.size()));
+
+        write_fully(fd, regions.data(), regions.size(), 192 << 10);
+        write_fully(fd, regions.data(), regions.size(), 256 << 10);
+
+        // Metadata table, items from 64 KB
+        std::vector<uint8_t> metadata(128 << 10);
+        uint32_t item_offset = 64 << 10;
+        uint16_t item_count = 0;
+
+        auto add_item = [&](uint32_t data1, uint16_t data2, uint16_t data3,
+            uint64_t data4, bool virtual_disk, const std::vector<uint8_t> &data)
+        {
+            uint8_t *entry = metadata.data() + 32 + item_count * 32;
+
+            put_guid(entry, data1, data2, data3, data4);
+            put_le32(entry + 16, item_offset);
+            put_le32(entry + 20, (uint32_t)data.size());
+            put_le32(entry + 24, (virtual_disk ? 2 : 0) | 4);
+
+            memcpy(metadata.data() + item_offset, data.data(), data.size());
+            item_offset += ((uint32_t)data.size() + 7) & ~7U;
+            item_count++;
+        };
+
+        std::vector<uint8_t> item(8);
+        put_le32(item.data(), plan.block_size);
+        put_le32(item.data() + 4, has_parent ? 2 : 0);
+        add_item(0xcaa16737, 0xfa36, 0x4d43, 0xb3b633f0aa44e76bULL, false, item);
+
+        put_le64(item.data(), plan.size);
+        add_item(0x2fa54224, 0xcd1b, 0x4876, 0xb2115dbed83bf4b8ULL, true, item);
+
+        item.resize(4);
+        put_le32(item.data(), plan.sector_size);
+        add_item(0x8141bf1d, 0xa96f, 0x4709, 0xba47f233a8faab5fULL, true, item);
+
+        put_le32(item.data(), 4096);
+        add_item(0xcda348c7, 0x445d, 0x4471, 0x9cc9e9885251c556ULL, true, item);
+
+        std::vector<uint8_t> disk_id(data_write_guid.bytes,
+            data_write_guid.bytes + 16);
+        add_item(0xbeca12ab, 0xb2e6, 0x4523, 0x93efc309e000c746ULL, true, disk_id);
+
+        if (has_parent)
+        {
+            // Parent locator with parent_linkage, relative_path and an
+            // absolute path on the system image was created on
+            std::vector<std::pair<std::string, std::string>> pairs =
+            {
+                { "parent_linkage", format_guid(parent_guid) },
+                { "relative_path", ".\\" + parent },
+                { "absolute_win32_path", "C:\\Hyper-V\\Disks\\" + parent }
+            };
+
+            std::vector<uint8_t> locator(20 + pairs.size() * 12);
+            put_guid(locator.data(), 0xb04aefb7, 0xd19e, 0x4a81, 0xb78925b8e9445913ULL);
+            put_le16(locator.data() + 18, (uint16_t)pairs.size());
+
+            for (size_t i = 0; i < pairs.size(); i++)
+            {
+                std::vector<uint8_t> key = utf16le(pairs[i].first);
+                std::vector<uint8_t> value = utf16le(pairs[i].second);
+                uint8_t *entry = locator.data() + 20 + i * 12;
+
+                put_le32(entry, (uint32_t)locator.size());
+                put_le16(entry + 8, (uint16_t)key.size());
+                locator.insert(locator.end(), key.begin(), key.end());
+
+                entry = locator.data() + 20 + i * 12;
+                put_le32(entry + 4, (uint32_t)locator.size());
+                put_le16(entry + 10, (uint16_t)value.size());
+                locator.insert(locator.end(), value.begin(), value.end());
+            }
+
+            add_item(0xa8d35f2d, 0xb30b, 0x454d, 0xabf7d3d84834ab0cULL, false, locator);
+        }
+
+        memcpy(metadata.data(), "metadata", 8);
+        put_le16(metadata.data() + 10, item_count);
+
+        write_fully(fd, metadata.data(), metadata.size(), 2 * mb);
+
+        std::vector<uint8_t> bat((size_t)entry_count * 8);
+        uint64_t next_offset = 3 * mb + bat_length;
+        std::vector<uint64_t> bitmap_offsets((size_t)chunk_count);
+        uint32_t bitmap_bytes = plan.block_size / plan.sector_size / 8;
+
+        for (uint64_t block = 0; block < block_count; block++)
+        {
+            uint8_t *entry = bat.data() + (block + block / chunk_ratio) * 8;
+            uint64_t chunk = block / chunk_ratio;
+
+            switch (plan.blocks[(size_t)block])
+            {
+            case BlockPlan::Absent:
+                break;
+
+            case BlockPlan::Zero:
+                put_le64(entry, 2);
+                break;
+
+            case BlockPlan::Full:
+                put_le64(entry, next_offset | 6);
+                write_block_data(fd, plan, layer, block, next_offset);
+                next_offset += (plan.block_size + mb - 1) / mb * mb;
+                break;
+
+            case BlockPlan::Partial:
+            {
+                if (bitmap_offsets[(size_t)chunk] == 0)
+                {
+                    bitmap_offsets[(size_t)chunk] = next_offset;
+                    put_le64(bat.data() +
+                        (chunk * (chunk_ratio + 1) + chunk_ratio) * 8,
+                        next_offset | 6);
+                    next_offset += mb;
+                }
+
+                const std::vector<bool> &bits = plan.present.at(block);
+                std::vector<uint8_t> bitmap(bitmap_bytes);
+
+                for (size_t sector = 0; sector < bits.size(); sector++)
+                {
+                    if (bits[sector])
+                    {
+                        bitmap[sector / 8] |= (uint8_t)(1 << (sector % 8));
+                    }
+                }
+
+                write_fully(fd, bitmap.data(), bitmap.size(),
+                    bitmap_offsets[(size_t)chunk] +
+                    block % chunk_ratio * bitmap_bytes);
+
+                put_le64(entry, next_offset | 7);
+                write_block_data(fd, plan, layer, block, next_offset);
+                next_offset += (plan.block_size + mb - 1) / mb * mb;
+                break;
+            }
+            }
+        }
+
+        write_fully(fd, bat.data(), bat.size(), 3 * mb);
+
+        if (ftruncate(fd, (off_t)next_offset) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "ftruncate");
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+static void vhd_checksum(uint8_t *data, size_t length, size_t checksum_offset)
+{
+    uint32_t sum = 0;
+
+    put_be32(data + checksum_offset, 0);
+
+    for (size_t i = 0; i < length; i++)
+    {
+        sum += data[i];
+    }
+
+    put_be32(data + checksum_offset, ~sum);
+}
+
+/// Writes a dynamic or differencing VHD file: footer copy, dynamic disk
+/// header, BAT and parent locator data, followed by blocks and footer.
+static void write_vhd(const std::string &path, const LayerPlan &plan,
+    unsigned layer, const Guid16 &unique_id, const std::string &parent,
+    const Guid16 &parent_id)
+{
+    bool has_parent = !parent.empty();
+    uint32_t block_count = (uint32_t)plan.blocks.size();
+    uint64_t table_offset = 1536;
+    uint64_t table_size = ((uint64_t)block_count * 4 + 511) & ~511ULL;
+    uint64_t locator_offset = table_offset + table_size;
+    uint32_t bitmap_size = (plan.block_size / 512 / 8 + 511) & ~511U;
+    std::vector<uint8_t> locator = utf16le(".\\" + parent);
+    uint64_t next_offset = locator_offset + 512;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot create " + path);
+    }
+
+    try
+    {
+        uint8_t footer[512] = { };
+
+        memcpy(footer, "conectix", 8);
+        put_be32(footer + 8, 2);
+        put_be32(footer + 12, 0x00010000);
+        put_be64(footer + 16, 512);
+        memcpy(footer + 28, "dvio", 4);
+        memcpy(footer + 36, "Wi2k", 4);
+        put_be64(footer + 40, plan.size);
+        put_be64(footer + 48, plan.size);
+        put_be32(footer + 56, 0xffff10ff);
+        put_be32(footer + 60, has_parent ? 4 : 3);
+        memcpy(footer + 68, unique_id.bytes, 16);
+        vhd_checksum(footer, sizeof(footer), 64);
+
+        write_fully(fd, footer, sizeof(footer), 0);
+
+        uint8_t header[1024] = { };
+
+        memcpy(header, "cxsparse", 8);
+        put_be64(header + 8, ~0ULL);
+        put_be64(header + 16, table_offset);
+        put_be32(header + 24, 0x00010000);
+        put_be32(header + 28, block_count);
+        put_be32(header + 32, plan.block_size);
+
+        if (has_parent)
+        {
+            memcpy(header + 40, parent_id.bytes, 16);
+
+            for (size_t i = 0; i < parent.size() && i < 255; i++)
+            {
+                header[64 + i * 2 + 1] = (uint8_t)parent[i];
+            }
+
+            put_be32(header + 576, 0x57327275);
+            put_be32(header + 580, 1);
+            put_be32(header + 584, (uint32_t)locator.size());
+            put_be64(header + 592, locator_offset);
+
+            write_fully(fd, locator.data(), locator.size(), locator_offset);
+        }
+
+        vhd_checksum(header, sizeof(header), 36);
+
+        write_fully(fd, header, sizeof(header), 512);
+
+        std::vector<uint8_t> bat((size_t)table_size, 0xff);
+
+        for (uint32_t block = 0; block < block_count; block++)
+        {
+            BlockPlan state = plan.blocks[block];
+
+            if (state == BlockPlan::Absent || state == BlockPlan::Zero)
+            {
+                continue;
+            }
+
+            std::vector<uint8_t> bitmap(bitmap_size, 0xff);
+
+            if (state == BlockPlan::Partial)
+            {
+                const std::vector<bool> &bits = plan.present.at(block);
+
+                std::fill(bitmap.begin(), bitmap.end(), 0);
+
+                for (size_t sector = 0; sector < bits.size(); sector++)
+                {
+                    if (bits[sector])
+                    {
+                        bitmap[sector / 8] |= (uint8_t)(0x80 >> (sector % 8));
+                    }
+                }
+            }
+
+            put_be32(bat.data() + block * 4, (uint32_t)(next_offset / 512));
+            write_fully(fd, bitmap.data(), bitmap.size(), next_offset);
+            write_block_data(fd, plan, layer, block, next_offset + bitmap_size);
+            next_offset += bitmap_size + plan.block_size;
+        }
+
+        write_fully(fd, bat.data(), bat.size(), table_offset);
+        write_fully(fd, footer, sizeof(footer), next_offset);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+/// Fills buffer with expected contents of [offset, offset + length)
+static void expected_data(const Model &model, uint8_t *buffer, size_t length,
+    uint64_t offset)
+{
+    for (size_t done = 0; done < length;)
+    {
+        uint64_t unit = (offset + done) / model_unit;
+        size_t unit_offset = (size_t)((offset + done) % model_unit);
+        size_t count = std::min(length - done, model_unit - unit_offset);
+        uint8_t data[model_unit];
+
+        if (model[(size_t)unit] == 0)
+        {
+            memset(data, 0, sizeof(data));
+        }
+        else
+        {
+            fill_unit(model[(size_t)unit] - 1u, unit, data);
+        }
+
+        memcpy(buffer + done, data + unit_offset, count);
+        done += count;
+    }
+}
+
+/// Reads random ranges of random length at 512 byte aligned offsets and
+/// compares them with model. Returns number of mismatches.
+static unsigned verify_random(const devio::VhdImage &image, const Model &model,
+    unsigned count, uint64_t max_length)
+{
+    std::mt19937_64 random(7);
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> expected;
+    unsigned errors = 0;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        uint64_t offset = random() % (image.size() / 512) * 512;
+        size_t length = (size_t)std::min<uint64_t>(
+            (1 + random() % (max_length / 512)) * 512, image.size() - offset);
+
+        buffer.resize(length);
+        expected.resize(length);
+
+        expected_data(model, expected.data(), length, offset);
+
+        if (image.read(buffer.data(), length, offset) != (ssize_t)length ||
+            memcmp(buffer.data(), expected.data(), length) != 0)
+        {
+            if (errors++ < 5)
+            {
+                fprintf(stderr, "Mismatch reading %zu bytes at %llu\n",
+                    length, (unsigned long long)offset);
+            }
+        }
+    }
+
+    return errors;
+}
+
+/// Reads whole image in 1 MB requests from one thread and compares it with
+/// model. Only time spent in reads counts. Returns MB/s.
+static double run_sequential_test(const devio::VhdImage &image,
+    const Model &model, bool &mismatch)
+{
+    std::vector<uint8_t> buffer(1 << 20);
+    std::vector<uint8_t> expected(buffer.size());
+    bench_clock::duration elapsed{ 0 };
+
+    mismatch = false;
+
+    for (uint64_t offset = 0; offset < image.size(); offset += buffer.size())
+    {
+        auto start = bench_clock::now();
+
+        ssize_t result = image.read(buffer.data(), buffer.size(), offset);
+
+        elapsed += bench_clock::now() - start;
+
+        if (result <= 0)
+        {
+            throw std::system_error(result < 0 ? (int)-result : EIO,
+                std::generic_category(), "Read failed");
+        }
+
+        expected_data(model, expected.data(), (size_t)result, offset);
+
+        if (memcmp(buffer.data(), expected.data(), (size_t)result) != 0)
+        {
+            mismatch = true;
+        }
+    }
+
+    return image.size() / std::chrono::duration<double>(elapsed).count() / 1e6;
+}
+
+/// Random 4 KB reads from several threads, like worker threads of server
+/// serving random requests from clients. Returns MB/s.
+static double run_random_test(const devio::VhdImage &image,
+    const BenchOptions &options, double &iops)
+{
+    std::atomic<uint64_t> total_reads{ 0 };
+    std::atomic<bool> failed{ false };
+    std::vector<std::thread> threads;
+
+    auto start = bench_clock::now();
+    auto end = start + std::chrono::seconds(options.seconds);
+
+    for (unsigned t = 0; t < options.reader_threads; t++)
+    {
+        threads.emplace_back([&, t]
+        {
+            std::mt19937_64 random(t + 1);
+            std::uniform_int_distribution<uint64_t> block(0,
+                image.size() / 4096 - 1);
+            uint8_t buffer[4096];
+            uint64_t reads = 0;
+
+            while ((reads & 63) != 0 || bench_clock::now() < end)
+            {
+                if (image.read(buffer, sizeof(buffer),
+                    block(random) * 4096) != sizeof(buffer))
+                {
+                    failed = true;
+                    break;
+                }
+
+                reads++;
+            }
+
+            total_reads += reads;
+        });
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    if (failed)
+    {
+        throw std::runtime_error("Random read failed");
+    }
+
+    double elapsed = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+
+    iops = total_reads / elapsed;
+
+    return total_reads * 4096.0 / elapsed / 1e6;
+}
+
+/// Writes a 64 MB dynamic VHD with a differencing VHD on top of it and
+/// verifies reads through the differencing file. Returns number of
+/// mismatches.
+static unsigned verify_vhd_chain(const std::string &base,
+    std::vector<std::string> &paths)
+{
+    std::mt19937_64 random(11);
+    uint64_t size = 64 << 20;
+    uint32_t block_size = 2 << 20;
+    Model model((size_t)(size / model_unit));
+
+    std::string parent_name = base.substr(base.rfind('/') + 1) + "-base.vhd";
+    std::string parent_path = base + "-base.vhd";
+    std::string child_path = base + "-diff.vhd";
+    Guid16 parent_id = random_guid(random);
+    Guid16 child_id = random_guid(random);
+
+    LayerPlan parent = plan_base(size, block_size, 512, 60, random);
+    LayerPlan child = plan_diff(size, block_size, 512, 20, false, random);
+
+    // Dynamic VHD has no zero block state
+    for (BlockPlan &block : parent.blocks)
+    {
+        if (block == BlockPlan::Zero)
+        {
+            block = BlockPlan::Absent;
+        }
+    }
+
+    paths.push_back(parent_path);
+    write_vhd(parent_path, parent, 0, parent_id, std::string(), Guid16());
+    apply_plan(model, parent, 0);
+
+    paths.push_back(child_path);
+    write_vhd(child_path, child, 1, child_id, parent_name, parent_id);
+    apply_plan(model, child, 1);
+
+    devio::VhdImage image(child_path, devio::VhdOptions());
+
+    if (image.chain_length() != 2 || image.size() != size)
+    {
+        return 1;
+    }
+
+    return verify_random(image, model, 2000, 3 << 20);
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "devio-vhdbench [options]\n"
+        "\n"
+        "Writes a synthetic VHDX differencing chain and measures sequential\n"
+        "1 MB and random 4 KB read throughput of the native VHDX/VHD backend,\n"
+        "first with one read thread and no lookup cache, then with lookup\n"
+        "cache and parallel block reads. Also verifies a VHD chain.\n"
+        "\n"
+        "-d, --directory path     Where to write images, default /tmp.\n"
+        "-s, --size MB            Virtual disk size, default 1024.\n"
+        "-b, --base-block MB      Block size of base image, default 32.\n"
+        "-B, --diff-block MB      Block size of differencing images,\n"
+        "                         default 2.\n"
+        "-S, --sector-size bytes  Logical sector size, 512 or 4096, default\n"
+        "                         512.\n"
+        "-n, --depth n            Number of differencing images, default 4.\n"
+        "-p, --allocated n        Percent of base blocks allocated, default\n"
+        "                         75.\n"
+        "-w, --written n          Percent of disk written in each\n"
+        "                         differencing image, default 5.\n"
+        "-c, --lookup-cache n     Lookup cache size in blocks, default 65536.\n"
+        "-j, --read-threads n     Block read threads, default one per CPU.\n"
+        "-r, --readers n          Threads doing random reads, default 8.\n"
+        "-t, --time seconds       Duration of random read tests, default 5.\n"
+        "-k, --keep               Keep image files.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "directory", required_argument, nullptr, 'd' },
+        { "size", required_argument, nullptr, 's' },
+        { "base-block", required_argument, nullptr, 'b' },
+        { "diff-block", required_argument, nullptr, 'B' },
+        { "sector-size", required_argument, nullptr, 'S' },
+        { "depth", required_argument, nullptr, 'n' },
+        { "allocated", required_argument, nullptr, 'p' },
+        { "written", required_argument, nullptr, 'w' },
+        { "lookup-cache", required_argument, nullptr, 'c' },
+        { "read-threads", required_argument, nullptr, 'j' },
+        { "readers", required_argument, nullptr, 'r' },
+        { "time", required_argument, nullptr, 't' },
+        { "keep", no_argument, nullptr, 'k' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    BenchOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:s:b:B:S:n:p:w:c:j:r:t:kh",
+        long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            options.directory = optarg;
+            break;
+
+        case 's':
+            options.image_size = strtoull(optarg, nullptr, 0) << 20;
+            break;
+
+        case 'b':
+            options.base_block_size = (uint32_t)strtoul(optarg, nullptr, 0) << 20;
+            break;
+
+        case 'B':
+            options.diff_block_size = (uint32_t)strtoul(optarg, nullptr, 0) << 20;
+            break;
+
+        case 'S':
+            options.sector_size = (uint32_t)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'n':
+            options.depth = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'p':
+            options.allocated_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'w':
+            options.written_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'c':
+            options.lookup_cache_blocks = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'j':
+            options.read_threads = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'r':
+            options.reader_threads = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 't':
+            options.seconds = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'k':
+            options.keep = true;
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    auto valid_block_size = [](uint32_t size)
+    {
+        return size >= (1 << 20) && size <= (256 << 20) &&
+            (size & (size - 1)) == 0;
+    };
+
+    if (options.image_size < (64 << 20) || options.image_size % (1 << 20) != 0 ||
+        !valid_block_size(options.base_block_size) ||
+        !valid_block_size(options.diff_block_size) ||
+        (options.sector_size != 512 && options.sector_size != 4096) ||
+        options.depth > 200 || options.allocated_percent > 100 ||
+        options.written_percent > 100 || options.reader_threads == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<std::string> paths;
+
+    auto remove_files = [&]
+    {
+        if (!options.keep)
+        {
+            for (const std::string &path : paths)
+            {
+                unlink(path.c_str());
+            }
+        }
+    };
+
+    try
+    {
+        std::string base = options.directory + "/devio-vhdbench-" +
+            std::to_string(getpid());
+        std::mt19937_64 random(1);
+        Model model((size_t)(options.image_size / model_unit));
+        std::string parent_name;
+        Guid16 parent_guid = { };
+        std::string top;
+
+        for (unsigned layer = 0; layer <= options.depth; layer++)
+        {
+            std::string name = base.substr(base.rfind('/') + 1) + "-" +
+                std::to_string(layer) + ".vhdx";
+            std::string path = options.directory + "/" + name;
+            Guid16 guid = random_guid(random);
+
+            LayerPlan plan = layer == 0 ?
+                plan_base(options.image_size, options.base_block_size,
+                    options.sector_size, options.allocated_percent, random) :
+                plan_diff(options.image_size, options.diff_block_size,
+                    options.sector_size, options.written_percent, true, random);
+
+            paths.push_back(path);
+            write_vhdx(path, plan, layer, guid, parent_name, parent_guid);
+            apply_plan(model, plan, layer);
+
+            parent_name = name;
+            parent_guid = guid;
+            top = path;
+        }
+
+        uint64_t present_units = model.size() -
+            std::count(model.begin(), model.end(), 0);
+
+        printf("Synthetic VHDX chain, %llu MB virtual disk, base with %u MB "
+            "blocks and %u differencing image(s) with %u MB blocks, %u byte "
+            "sectors, %.0f%% of disk allocated\n",
+            (unsigned long long)(options.image_size >> 20),
+            options.base_block_size >> 20, options.depth,
+            options.diff_block_size >> 20, options.sector_size,
+            100.0 * present_units / model.size());
+
+        // Before: one read thread and no lookup cache, so that sector
+        // bitmaps of the chain are read for every request. After: lookup
+        // cache and parallel block reads.
+        devio::VhdOptions serial;
+        serial.read_threads = 1;
+        serial.lookup_cache_blocks = 0;
+
+        devio::VhdOptions pooled;
+        pooled.read_threads = options.read_threads;
+        pooled.lookup_cache_blocks = options.lookup_cache_blocks;
+
+        struct
+        {
+            const char *name;
+            devio::VhdOptions vhd_options;
+        } const configs[] =
+        {
+            { "No lookup cache", serial },
+            { "Cache and pool", pooled }
+        };
+
+        printf("%-18s %12s %12s %12s %14s %10s\n", "Backend", "Seq MB/s",
+            "Random MB/s", "Random IOPS", "Bitmap reads", "Hit rate");
+
+        bool mismatch = false;
+
+        for (const auto &config : configs)
+        {
+            bool sequential_mismatch;
+            double sequential_rate;
+            double random_rate;
+            double iops;
+            unsigned errors;
+            devio::VhdImage::Statistics stats;
+
+            {
+                devio::VhdImage image(top, config.vhd_options);
+                sequential_rate = run_sequential_test(image, model,
+                    sequential_mismatch);
+                errors = verify_random(image, model, 1000,
+                    3ULL * options.diff_block_size);
+            }
+
+            {
+                // Fresh image, so that random reads start with empty cache
+                devio::VhdImage image(top, config.vhd_options);
+                random_rate = run_random_test(image, options, iops);
+                stats = image.statistics();
+            }
+
+            uint64_t lookups = stats.lookup_hits + stats.lookup_misses;
+
+            printf("%-18s %12.1f %12.1f %12.0f %14llu %9.1f%%%s\n",
+                config.name, sequential_rate, random_rate, iops,
+                (unsigned long long)stats.bitmap_reads,
+                lookups > 0 ? 100.0 * stats.lookup_hits / lookups : 0.0,
+                sequential_mismatch || errors != 0 ? "  DATA MISMATCH" : "");
+
+            fflush(stdout);
+
+            if (sequential_mismatch || errors != 0)
+            {
+                mismatch = true;
+            }
+        }
+
+        unsigned vhd_errors = verify_vhd_chain(base, paths);
+
+        printf("Dynamic and differencing VHD chain: %s\n",
+            vhd_errors == 0 ? "verified" : "DATA MISMATCH");
+
+        remove_files();
+
+        if (options.keep)
+        {
+            printf("Images kept as %s\n", top.c_str());
+        }
+
+        return mismatch || vhd_errors != 0 ? 1 : 0;
+    }
+    catch (const std::exception &ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+
+        remove_files();
+
+        return 1;
+    }
+}
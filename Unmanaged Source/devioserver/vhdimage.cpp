@@ -0,0 +1,1472 @@
+/// vhdimage.cpp
+/// Storage backend for devio server that serves VHDX and VHD images.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "vhdimage.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <system_error>
+#include <thread>
+
+namespace devio
+{
+
+// VHDX layout, all values little endian. A file identifier at offset 0 is
+// followed by two copies of the header at 64 KB and 128 KB, and two copies
+// of the region table at 192 KB and 256 KB, all with CRC-32C checksums.
+// Region table locates block allocation table (BAT) and metadata region.
+
+static const size_t vhdx_header_offset[2] = { 64 << 10, 128 << 10 };
+static const size_t vhdx_header_size = 4 << 10;
+static const size_t vhdx_region_table_offset[2] = { 192 << 10, 256 << 10 };
+static const size_t vhdx_region_table_size = 64 << 10;
+static const uint32_t vhdx_max_metadata_size = 1 << 20;
+
+// BAT entries have block state in low 3 bits and offset in MB from bit 20.
+// After every chunk ratio payload block entries comes a sector bitmap
+// block entry, for differencing files only.
+static const unsigned vhdx_bat_state_mask = 7;
+static const unsigned vhdx_payload_not_present = 0;
+static const unsigned vhdx_payload_undefined = 1;
+static const unsigned vhdx_payload_zero = 2;
+static const unsigned vhdx_payload_unmapped = 3;
+static const unsigned vhdx_payload_fully_present = 6;
+static const unsigned vhdx_payload_partially_present = 7;
+static const unsigned vhdx_sb_present = 6;
+
+// In-memory BAT entries, see VhdImage::Layer
+static const uint32_t bat_zero = 0xffffffff;
+static const uint32_t bat_partial = 0x80000000;
+
+// VHD layout, all values big endian. A 512 byte footer at end of file, and
+// for dynamic and differencing files a copy of it at offset 0, followed by
+// a dynamic disk header that locates BAT. Each block starts with a sector
+// bitmap, padded to whole sectors.
+static const size_t vhd_footer_size = 512;
+static const size_t vhd_dynamic_header_size = 1024;
+static const uint32_t vhd_disk_type_fixed = 2;
+static const uint32_t vhd_disk_type_dynamic = 3;
+static const uint32_t vhd_disk_type_differencing = 4;
+static const uint32_t vhd_bat_unused = 0xffffffff;
+
+// Parent locator platform codes
+static const uint32_t vhd_platform_w2ru = 0x57327275;
+static const uint32_t vhd_platform_w2ku = 0x57326b75;
+static const uint32_t vhd_platform_macx = 0x4d616358;
+
+// Longest differencing chain followed, guards against loops
+static const size_t max_chain_length = 256;
+
+struct Guid
+{
+    uint32_t data1;
+    uint16_t data2;
+    uint16_t data3;
+    uint8_t data4[8];
+};
+
+static const Guid vhdx_bat_region =
+{ 0x2dc27766, 0xf623, 0x4200, { 0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08 } };
+
+static const Guid vhdx_metadata_region =
+{ 0x8b7ca206, 0x4790, 0x4b9a, { 0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e } };
+
+static const Guid vhdx_file_parameters =
+{ 0xcaa16737, 0xfa36, 0x4d43, { 0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b } };
+
+static const Guid vhdx_virtual_disk_size =
+{ 0x2fa54224, 0xcd1b, 0x4876, { 0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8 } };
+
+static const Guid vhdx_logical_sector_size =
+{ 0x8141bf1d, 0xa96f, 0x4709, { 0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f } };
+
+static const Guid vhdx_parent_locator =
+{ 0xa8d35f2d, 0xb30b, 0x454d, { 0xab, 0xf7, 0xd3, 0xd8, 0x48, 0x34, 0xab, 0x0c } };
+
+static inline uint16_t get_le16(const uint8_t *ptr)
+{
+    return (uint16_t)(ptr[0] | (ptr[1] << 8));
+}
+
+static inline uint32_t get_le32(const uint8_t *ptr)
+{
+    return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) |
+        ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static inline uint64_t get_le64(const uint8_t *ptr)
+{
+    return (uint64_t)get_le32(ptr) | ((uint64_t)get_le32(ptr + 4) << 32);
+}
+
+static inline uint32_t get_be32(const uint8_t *ptr)
+{
+    return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) |
+        ((uint32_t)ptr[2] << 8) | (uint32_t)ptr[3];
+}
+
+static inline uint64_t get_be64(const uint8_t *ptr)
+{
+    return ((uint64_t)get_be32(ptr) << 32) | (uint64_t)get_be32(ptr + 4);
+}
+
+static bool guid_equal(const uint8_t *ptr, const Guid &guid)
+{
+    return get_le32(ptr) == guid.data1 &&
+        get_le16(ptr + 4) == guid.data2 &&
+        get_le16(ptr + 6) == guid.data3 &&
+        memcmp(ptr + 8, guid.data4, 8) == 0;
+}
+
+static bool guid_is_zero(const uint8_t *ptr)
+{
+    static const uint8_t zero[16] = { };
+
+    return memcmp(ptr, zero, sizeof(zero)) == 0;
+}
+
+/// Formats an on-disk GUID in lower case without braces
+static std::string format_guid(const uint8_t *ptr)
+{
+    char text[37];
+
+    snprintf(text, sizeof(text),
+        "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        get_le32(ptr), get_le16(ptr + 4), get_le16(ptr + 6),
+        ptr[8], ptr[9], ptr[10], ptr[11], ptr[12], ptr[13], ptr[14], ptr[15]);
+
+    return text;
+}
+
+/// CRC-32C (Castagnoli), used by VHDX headers and region tables
+static uint32_t crc32c(const uint8_t *data, size_t length)
+{
+    static const struct Table
+    {
+        uint32_t entries[256];
+
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t crc = i;
+
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+                }
+
+                entries[i] = crc;
+            }
+        }
+    } table;
+
+    uint32_t crc = 0xffffffff;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+/// Verifies CRC-32C of a structure with checksum field at offset 4, which
+/// counts as zero in checksum
+static bool vhdx_checksum_valid(std::vector<uint8_t> &data)
+{
+    uint32_t stored = get_le32(data.data() + 4);
+
+    memset(data.data() + 4, 0, 4);
+
+    uint32_t computed = crc32c(data.data(), data.size());
+
+    memcpy(data.data() + 4, &stored, 4);
+
+    return computed == get_le32(data.data() + 4);
+}
+
+/// One's complement of byte sum, excluding checksum field, used by VHD
+/// footers and dynamic disk headers
+static bool vhd_checksum_valid(const uint8_t *data, size_t length,
+    size_t checksum_offset)
+{
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (i < checksum_offset || i >= checksum_offset + 4)
+        {
+            sum += data[i];
+        }
+    }
+
+    return ~sum == get_be32(data + checksum_offset);
+}
+
+/// Converts UTF-16 text, up to first null character, to UTF-8
+static std::string utf16_to_utf8(const uint8_t *data, size_t length,
+    bool big_endian)
+{
+    std::string text;
+
+    for (size_t i = 0; i + 1 < length; i += 2)
+    {
+        uint32_t ch = big_endian ? (data[i] << 8) | data[i + 1] :
+            data[i] | (data[i + 1] << 8);
+
+        if (ch == 0)
+        {
+            break;
+        }
+
+        if (ch >= 0xd800 && ch < 0xdc00 && i + 3 < length)
+        {
+            uint32_t low = big_endian ? (data[i + 2] << 8) | data[i + 3] :
+                data[i + 2] | (data[i + 3] << 8);
+
+            if (low >= 0xdc00 && low < 0xe000)
+            {
+                ch = 0x10000 + ((ch - 0xd800) << 10) + (low - 0xdc00);
+                i += 2;
+            }
+        }
+
+        if (ch < 0x80)
+        {
+            text += (char)ch;
+        }
+        else if (ch < 0x800)
+        {
+            text += (char)(0xc0 | (ch >> 6));
+            text += (char)(0x80 | (ch & 0x3f));
+        }
+        else if (ch < 0x10000)
+        {
+            text += (char)(0xe0 | (ch >> 12));
+            text += (char)(0x80 | ((ch >> 6) & 0x3f));
+            text += (char)(0x80 | (ch & 0x3f));
+        }
+        else
+        {
+            text += (char)(0xf0 | (ch >> 18));
+            text += (char)(0x80 | ((ch >> 12) & 0x3f));
+            text += (char)(0x80 | ((ch >> 6) & 0x3f));
+            text += (char)(0x80 | (ch & 0x3f));
+        }
+    }
+
+    return text;
+}
+
+static std::string directory_of(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+
+    if (slash == std::string::npos)
+    {
+        return ".";
+    }
+
+    return path.substr(0, slash == 0 ? 1 : slash);
+}
+
+/// Parent stored as a Windows relative path, such as .\parent.vhdx,
+/// relative to directory of child
+static std::string relative_parent_path(const std::string &child,
+    std::string relative)
+{
+    std::replace(relative.begin(), relative.end(), '\\', '/');
+
+    while (relative.compare(0, 2, "./") == 0)
+    {
+        relative.erase(0, 2);
+    }
+
+    return directory_of(child) + "/" + relative;
+}
+
+/// Parent stored as an absolute Windows path or URL, looked for by file
+/// name in directory of child, where images copied from another system are
+/// usually kept together
+static std::string absolute_parent_path(const std::string &child,
+    const std::string &absolute)
+{
+    size_t separator = absolute.find_last_of("\\/:");
+
+    return directory_of(child) + "/" + (separator == std::string::npos ?
+        absolute : absolute.substr(separator + 1));
+}
+
+static int read_fully(int fd, void *buffer, size_t length, uint64_t offset)
+{
+    size_t done = 0;
+
+    while (done < length)
+    {
+        ssize_t result = pread(fd, (char *)buffer + done, length - done,
+            (off_t)(offset + done));
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -errno;
+        }
+
+        if (result == 0)
+        {
+            return -EIO;
+        }
+
+        done += (size_t)result;
+    }
+
+    return 0;
+}
+
+VhdImage::VhdImage(const std::string &path, const VhdOptions &options)
+    : options(options)
+{
+    try
+    {
+        layers.emplace_back();
+        layers.back().path = path;
+
+        open_layer(layers.back());
+
+        while (open_parent())
+        {
+            if (layers.size() > max_chain_length)
+            {
+                throw std::system_error(ELOOP, std::generic_category(),
+                    "Differencing chain of " + path + " is too long");
+            }
+        }
+    }
+    catch (...)
+    {
+        for (const Layer &layer : layers)
+        {
+            if (layer.fd >= 0)
+            {
+                close(layer.fd);
+            }
+        }
+
+        throw;
+    }
+
+    for (const Layer &layer : layers)
+    {
+        if (layer.block_size != 0 &&
+            (lookup_unit == 0 || layer.block_size < lookup_unit))
+        {
+            lookup_unit = layer.block_size;
+        }
+    }
+
+    unsigned thread_count = this->options.read_threads;
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    read_pool.reset(new WorkerPool(thread_count));
+}
+
+VhdImage::~VhdImage()
+{
+    // Queued reads refer to layers
+    read_pool.reset();
+
+    for (const Layer &layer : layers)
+    {
+        close(layer.fd);
+    }
+}
+
+bool VhdImage::is_vhd_file(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    char signature[8];
+
+    // Dynamic and differencing VHD files start with a copy of footer
+    bool result = read_fully(fd, signature, sizeof(signature), 0) == 0 &&
+        (memcmp(signature, "vhdxfile", 8) == 0 ||
+        memcmp(signature, "conectix", 8) == 0);
+
+    close(fd);
+
+    return result;
+}
+
+void VhdImage::open_layer(Layer &layer)
+{
+    layer.fd = open(layer.path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (layer.fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot open " + layer.path);
+    }
+
+    struct stat st;
+    if (fstat(layer.fd, &st) < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+            "Cannot query size of " + layer.path);
+    }
+
+    char signature[8];
+
+    if (read_fully(layer.fd, signature, sizeof(signature), 0) == 0 &&
+        memcmp(signature, "vhdxfile", 8) == 0)
+    {
+        parse_vhdx(layer, (uint64_t)st.st_size);
+    }
+    else
+    {
+        parse_vhd(layer, (uint64_t)st.st_size);
+    }
+}
+
+void VhdImage::parse_vhdx(Layer &layer, uint64_t file_size)
+{
+    layer.format = Format::Vhdx;
+    layer.offset_shift = 20;
+
+    // Current header is the valid one with highest sequence number
+    std::vector<uint8_t> header;
+    uint64_t sequence = 0;
+
+    for (size_t offset : vhdx_header_offset)
+    {
+        std::vector<uint8_t> data(vhdx_header_size);
+
+        if (read_fully(layer.fd, data.data(), data.size(), offset) < 0 ||
+            memcmp(data.data(), "head", 4) != 0 ||
+            !vhdx_checksum_valid(data))
+        {
+            continue;
+        }
+
+        if (header.empty() || get_le64(data.data() + 8) > sequence)
+        {
+            sequence = get_le64(data.data() + 8);
+            header = std::move(data);
+        }
+    }
+
+    if (header.empty())
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "No valid VHDX header in " + layer.path);
+    }
+
+    if (get_le16(header.data() + 66) != 1)
+    {
+        throw std::system_error(ENOTSUP, std::generic_category(),
+            "Unsupported VHDX version in " + layer.path);
+    }
+
+    // Log entries are written by Hyper-V while an image is open, and
+    // replayed when it is opened next time. Image is served read-only, so
+    // log cannot be replayed here.
+    if (!guid_is_zero(header.data() + 48))
+    {
+        throw std::system_error(ENOTSUP, std::generic_category(),
+            layer.path + " has a log that needs to be replayed. Attach it "
+            "once in Windows, or with qemu-img check -r all.");
+    }
+
+    std::string data_write_guid = format_guid(header.data() + 32);
+    layer.identity.assign(data_write_guid.begin(), data_write_guid.end());
+
+    std::vector<uint8_t> region_table;
+
+    for (size_t offset : vhdx_region_table_offset)
+    {
+        std::vector<uint8_t> data(vhdx_region_table_size);
+
+        if (read_fully(layer.fd, data.data(), data.size(), offset) == 0 &&
+            memcmp(data.data(), "regi", 4) == 0 &&
+            vhdx_checksum_valid(data))
+        {
+            region_table = std::move(data);
+            break;
+        }
+    }
+
+    if (region_table.empty())
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "No valid VHDX region table in " + layer.path);
+    }
+
+    uint32_t region_count = get_le32(region_table.data() + 8);
+    uint64_t bat_offset = 0;
+    uint32_t bat_length = 0;
+    uint64_t metadata_offset = 0;
+    uint32_t metadata_length = 0;
+
+    if (region_count > (vhdx_region_table_size - 16) / 32)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "Bad VHDX region table in " + layer.path);
+    }
+
+    for (uint32_t i = 0; i < region_count; i++)
+    {
+        const uint8_t *entry = region_table.data() + 16 + i * 32;
+
+        if (guid_equal(entry, vhdx_bat_region))
+        {
+            bat_offset = get_le64(entry + 16);
+            bat_length = get_le32(entry + 24);
+        }
+        else if (guid_equal(entry, vhdx_metadata_region))
+        {
+            metadata_offset = get_le64(entry + 16);
+            metadata_length = get_le32(entry + 24);
+        }
+        else if (get_le32(entry + 28) & 1)
+        {
+            throw std::system_error(ENOTSUP, std::generic_category(),
+                "Unsupported required VHDX region in " + layer.path);
+        }
+    }
+
+    if (bat_length == 0 || metadata_length < 32 ||
+        metadata_length > vhdx_max_metadata_size)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "Bad VHDX region table in " + layer.path);
+    }
+
+    std::vector<uint8_t> metadata(metadata_length);
+
+    if (read_fully(layer.fd, metadata.data(), metadata.size(),
+        metadata_offset) < 0 ||
+        memcmp(metadata.data(), "metadata", 8) != 0)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "Bad VHDX metadata region in " + layer.path);
+    }
+
+    uint16_t item_count = get_le16(metadata.data() + 10);
+    const uint8_t *locator = nullptr;
+    uint32_t locator_length = 0;
+
+    if (item_count > (metadata_length - 32) / 32)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "Bad VHDX metadata region in " + layer.path);
+    }
+
+    for (uint16_t i = 0; i < item_count; i++)
+    {
+        const uint8_t *entry = metadata.data() + 32 + i * 32;
+        uint32_t item_offset = get_le32(entry + 16);
+        uint32_t item_length = get_le32(entry + 20);
+
+        if (item_offset > metadata_length ||
+            item_length > metadata_length - item_offset)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                "Bad VHDX metadata item in " + layer.path);
+        }
+
+        const uint8_t *item = metadata.data() + item_offset;
+
+        if (guid_equal(entry, vhdx_file_parameters) && item_length >= 8)
+        {
+            layer.block_size = get_le32(item);
+            layer.has_parent = (get_le32(item + 4) & 2) != 0;
+        }
+        else if (guid_equal(entry, vhdx_virtual_disk_size) && item_length >= 8)
+        {
+            layer.size = get_le64(item);
+        }
+        else if (guid_equal(entry, vhdx_logical_sector_size) && item_length >= 4)
+        {
+            layer.sector_size = get_le32(item);
+        }
+        else if (guid_equal(entry, vhdx_parent_locator))
+        {
+            locator = item;
+            locator_length = item_length;
+        }
+    }
+
+    if (layer.block_size < (1 << 20) || layer.block_size > (256 << 20) ||
+        (layer.block_size & (layer.block_size - 1)) != 0 ||
+        (layer.sector_size != 512 && layer.sector_size != 4096) ||
+        layer.size == 0 || layer.size % layer.sector_size != 0)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "Bad VHDX disk parameters in " + layer.path);
+    }
+
+    if (layer.has_parent)
+    {
+        if (locator == nullptr || locator_length < 20)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                "No parent locator in differencing VHDX " + layer.path);
+        }
+
+        uint16_t key_count = get_le16(locator + 18);
+        std::vector<std::string> absolute_paths;
+
+        for (uint32_t i = 0; i < key_count && 20 + (i + 1) * 12 <= locator_length;
+            i++)
+        {
+            const uint8_t *entry = locator + 20 + i * 12;
+            uint32_t key_offset = get_le32(entry);
+            uint32_t value_offset = get_le32(entry + 4);
+            uint16_t key_length = get_le16(entry + 8);
+            uint16_t value_length = get_le16(entry + 10);
+
+            if (key_offset > locator_length ||
+                key_length > locator_length - key_offset ||
+                value_offset > locator_length ||
+                value_length > locator_length - value_offset)
+            {
+                continue;
+            }
+
+            std::string key = utf16_to_utf8(locator + key_offset, key_length,
+                false);
+            std::string value = utf16_to_utf8(locator + value_offset,
+                value_length, false);
+
+            if (key == "parent_linkage" || key == "parent_linkage2")
+            {
+                std::string linkage;
+
+                for (char ch : value)
+                {
+                    if (ch != '{' && ch != '}')
+                    {
+                        linkage += (char)tolower((unsigned char)ch);
+                    }
+                }
+
+                layer.parent_identities.emplace_back(linkage.begin(),
+                    linkage.end());
+            }
+            else if (key == "relative_path")
+            {
+                layer.parent_paths.insert(layer.parent_paths.begin(),
+                    relative_parent_path(layer.path, value));
+            }
+            else if (key == "absolute_win32_path" || key == "volume_path")
+            {
+                absolute_paths.push_back(
+                    absolute_parent_path(layer.path, value));
+            }
+        }
+
+        layer.parent_paths.insert(layer.parent_paths.end(),
+            absolute_paths.begin(), absolute_paths.end());
+    }
+
+    // Each sector bitmap block covers 2^23 sectors
+    layer.chunk_ratio = (uint32_t)(((uint64_t)1 << 23) * layer.sector_size /
+        layer.block_size);
+
+    uint64_t block_count = (layer.size + layer.block_size - 1) /
+        layer.block_size;
+    uint64_t chunk_count = (block_count + layer.chunk_ratio - 1) /
+        layer.chunk_ratio;
+    uint64_t entry_count = layer.has_parent ?
+        chunk_count * (layer.chunk_ratio + 1) :
+        block_count + (block_count - 1) / layer.chunk_ratio;
+
+    if (entry_count * 8 > bat_length)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "VHDX block allocation table too small in " + layer.path);
+    }
+
+    std::vector<uint8_t> table((size_t)entry_count * 8);
+
+    if (read_fully(layer.fd, table.data(), table.size(), bat_offset) < 0)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            layer.path + " is truncated");
+    }
+
+    layer.bat.resize((size_t)block_count);
+
+    for (uint64_t block = 0; block < block_count; block++)
+    {
+        uint64_t entry = get_le64(table.data() +
+            (block + block / layer.chunk_ratio) * 8);
+        uint64_t megabyte = entry >> 20;
+
+        switch (entry & vhdx_bat_state_mask)
+        {
+        case vhdx_payload_not_present:
+        case vhdx_payload_undefined:
+            layer.bat[block] = 0;
+            continue;
+
+        case vhdx_payload_zero:
+        case vhdx_payload_unmapped:
+            layer.bat[block] = bat_zero;
+            continue;
+
+        case vhdx_payload_fully_present:
+            layer.bat[block] = (uint32_t)megabyte;
+            break;
+
+        case vhdx_payload_partially_present:
+            if (!layer.has_parent)
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    "Partially present block in VHDX without parent " +
+                    layer.path);
+            }
+
+            layer.bat[block] = bat_partial | (uint32_t)megabyte;
+            break;
+
+        default:
+            throw std::system_error(EINVAL, std::generic_category(),
+                "Bad VHDX block state for block " + std::to_string(block) +
+                " in " + layer.path);
+        }
+
+        if (megabyte == 0 || megabyte >= bat_partial ||
+            (megabyte << 20) + layer.block_size > file_size)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                "Bad VHDX block offset for block " + std::to_string(block) +
+                " in " + layer.path);
+        }
+    }
+
+    if (layer.has_parent)
+    {
+        layer.bitmap_blocks.resize((size_t)chunk_count);
+
+        for (uint64_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            uint64_t entry = get_le64(table.data() +
+                (chunk * (layer.chunk_ratio + 1) + layer.chunk_ratio) * 8);
+            uint64_t megabyte = entry >> 20;
+
+            if ((entry & vhdx_bat_state_mask) != vhdx_sb_present)
+            {
+                continue;
+            }
+
+            if (megabyte == 0 || megabyte >= bat_partial ||
+                (megabyte + 1) << 20 > file_size)
+            {
+                throw std::system_error(EINVAL, std::generic_category(),
+                    "Bad VHDX sector bitmap offset in " + layer.path);
+            }
+
+            layer.bitmap_blocks[(size_t)chunk] = (uint32_t)megabyte;
+        }
+    }
+}
+
+void VhdImage::parse_vhd(Layer &layer, uint64_t file_size)
+{
+    uint8_t footer[vhd_footer_size];
+
+    // Footer at end of file, or its copy at start of dynamic and
+    // differencing files if end of file was damaged
+    if (file_size < vhd_footer_size ||
+        read_fully(layer.fd, footer, sizeof(footer),
+            file_size - vhd_footer_size) < 0 ||
+        memcmp(footer, "conectix", 8) != 0 ||
+        !vhd_checksum_valid(footer, sizeof(footer), 64))
+    {
+        if (read_fully(layer.fd, footer, sizeof(footer), 0) < 0 ||
+            memcmp(footer, "conectix", 8) != 0 ||
+            !vhd_checksum_valid(footer, sizeof(footer), 64))
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                layer.path + " is not a VHD or VHDX file");
+        }
+    }
+
+    uint32_t disk_type = get_be32(footer + 60);
+
+    layer.size = get_be64(footer + 48);
+    layer.identity.assign(footer + 68, footer + 84);
+
+    if (disk_type == vhd_disk_type_fixed)
+    {
+        layer.format = Format::VhdFixed;
+
+        if (layer.size > file_size - vhd_footer_size)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                layer.path + " is truncated");
+        }
+
+        return;
+    }
+
+    if (disk_type != vhd_disk_type_dynamic &&
+        disk_type != vhd_disk_type_differencing)
+    {
+        throw std::system_error(ENOTSUP, std::generic_category(),
+            "Unsupported VHD disk type in " + layer.path);
+    }
+
+    layer.format = Format::VhdDynamic;
+    layer.offset_shift = 9;
+    layer.has_parent = disk_type == vhd_disk_type_differencing;
+
+    uint8_t header[vhd_dynamic_header_size];
+
+    if (read_fully(layer.fd, header, sizeof(header),
+        get_be64(footer + 16)) < 0 ||
+        memcmp(header, "cxsparse", 8) != 0 ||
+        !vhd_checksum_valid(header, sizeof(header), 36))
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "Bad VHD dynamic disk header in " + layer.path);
+    }
+
+    uint64_t table_offset = get_be64(header + 16);
+    uint32_t max_entries = get_be32(header + 28);
+
+    layer.block_size = get_be32(header + 32);
+
+    if (layer.block_size < 4096 || layer.block_size > (256 << 20) ||
+        (layer.block_size & (layer.block_size - 1)) != 0 ||
+        layer.size == 0 || layer.size % 512 != 0)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "Bad VHD disk parameters in " + layer.path);
+    }
+
+    uint64_t block_count = (layer.size + layer.block_size - 1) /
+        layer.block_size;
+
+    if (block_count > max_entries)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            "VHD block allocation table too small in " + layer.path);
+    }
+
+    // One bit per sector, padded to whole sectors
+    layer.bitmap_size = (layer.block_size / 512 / 8 + 511) & ~511U;
+
+    std::vector<uint8_t> table((size_t)block_count * 4);
+
+    if (read_fully(layer.fd, table.data(), table.size(), table_offset) < 0)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+            layer.path + " is truncated");
+    }
+
+    layer.bat.resize((size_t)block_count);
+
+    for (uint64_t block = 0; block < block_count; block++)
+    {
+        uint32_t entry = get_be32(table.data() + block * 4);
+
+        if (entry == vhd_bat_unused)
+        {
+            layer.bat[block] = 0;
+            continue;
+        }
+
+        if (entry == 0 ||
+            ((uint64_t)entry << 9) + layer.bitmap_size + layer.block_size >
+            file_size)
+        {
+            throw std::system_error(EINVAL, std::generic_category(),
+                "Bad VHD block offset for block " + std::to_string(block) +
+                " in " + layer.path);
+        }
+
+        layer.bat[block] = entry;
+    }
+
+    if (!layer.has_parent)
+    {
+        return;
+    }
+
+    layer.parent_identities.emplace_back(header + 40, header + 56);
+
+    // Relative locators first, then absolute ones and parent name, which
+    // are looked for in directory of child
+    std::vector<std::string> absolute_paths;
+
+    for (int i = 0; i < 8; i++)
+    {
+        const uint8_t *entry = header + 576 + i * 24;
+        uint32_t platform = get_be32(entry);
+        uint32_t data_length = get_be32(entry + 8);
+        uint64_t data_offset = get_be64(entry + 16);
+
+        if (platform == 0 || data_length == 0 || data_length > 65536)
+        {
+            continue;
+        }
+
+        std::vector<uint8_t> data(data_length);
+
+        if (read_fully(layer.fd, data.data(), data.size(), data_offset) < 0)
+        {
+            continue;
+        }
+
+        if (platform == vhd_platform_w2ru)
+        {
+            layer.parent_paths.push_back(relative_parent_path(layer.path,
+                utf16_to_utf8(data.data(), data.size(), false)));
+        }
+        else if (platform == vhd_platform_w2ku)
+        {
+            absolute_paths.push_back(absolute_parent_path(layer.path,
+                utf16_to_utf8(data.data(), data.size(), false)));
+        }
+        else if (platform == vhd_platform_macx)
+        {
+            absolute_paths.push_back(absolute_parent_path(layer.path,
+                std::string(data.begin(), data.end()).c_str()));
+        }
+    }
+
+    absolute_paths.push_back(absolute_parent_path(layer.path,
+        utf16_to_utf8(header + 64, 512, true)));
+
+    layer.parent_paths.insert(layer.parent_paths.end(),
+        absolute_paths.begin(), absolute_paths.end());
+}
+
+bool VhdImage::open_parent()
+{
+    if (!layers.back().has_parent)
+    {
+        return false;
+    }
+
+    // Copied, layers may be reallocated below
+    std::string child = layers.back().path;
+    std::vector<std::string> candidates = layers.back().parent_paths;
+    std::vector<std::vector<uint8_t>> identities =
+        layers.back().parent_identities;
+
+    for (const std::string &candidate : candidates)
+    {
+        struct stat st;
+        if (stat(candidate.c_str(), &st) < 0)
+        {
+            continue;
+        }
+
+        layers.emplace_back();
+        layers.back().path = candidate;
+
+        open_layer(layers.back());
+
+        if (identities.empty() ||
+            std::find(identities.begin(), identities.end(),
+                layers.back().identity) != identities.end())
+        {
+            return true;
+        }
+
+        throw std::system_error(EINVAL, std::generic_category(),
+            candidate + " is not the parent that " + child + " was "
+            "created from, or it has been modified since");
+    }
+
+    throw std::system_error(ENOENT, std::generic_category(),
+        "Cannot find parent of " + child);
+}
+
+VhdImage::BlockState VhdImage::block_state(const Layer &layer, uint64_t block,
+    uint64_t &file_offset) const
+{
+    uint32_t entry = layer.bat[(size_t)block];
+
+    if (entry == 0)
+    {
+        return BlockState::Absent;
+    }
+
+    if (layer.format == Format::Vhdx)
+    {
+        if (entry == bat_zero)
+        {
+            return BlockState::Zero;
+        }
+
+        file_offset = (uint64_t)(entry & ~bat_partial) << layer.offset_shift;
+
+        return (entry & bat_partial) != 0 ? BlockState::Partial :
+            BlockState::Present;
+    }
+
+    file_offset = ((uint64_t)entry << layer.offset_shift) + layer.bitmap_size;
+
+    return layer.has_parent ? BlockState::Partial : BlockState::Present;
+}
+
+int VhdImage::read_bitmap(const Layer &layer, uint64_t block,
+    std::vector<uint8_t> &bitmap) const
+{
+    uint64_t offset;
+
+    bitmap.resize(layer.block_size / layer.sector_size / 8);
+
+    if (layer.format == Format::Vhdx)
+    {
+        uint32_t megabyte = layer.bitmap_blocks[(size_t)(block / layer.chunk_ratio)];
+
+        if (megabyte == 0)
+        {
+            return -EIO;
+        }
+
+        offset = ((uint64_t)megabyte << 20) +
+            block % layer.chunk_ratio * bitmap.size();
+    }
+    else
+    {
+        offset = (uint64_t)layer.bat[(size_t)block] << layer.offset_shift;
+    }
+
+    bitmap_reads++;
+
+    return read_fully(layer.fd, bitmap.data(), bitmap.size(), offset);
+}
+
+void VhdImage::add_extent(std::vector<Extent> &extents, uint64_t offset,
+    uint64_t length, int layer, uint64_t file_offset)
+{
+    if (!extents.empty())
+    {
+        Extent &last = extents.back();
+
+        if (last.layer == layer && last.offset + last.length == offset &&
+            (layer < 0 || last.file_offset + last.length == file_offset))
+        {
+            last.length += length;
+            return;
+        }
+    }
+
+    extents.push_back(Extent{ offset, length, layer, file_offset });
+}
+
+int VhdImage::resolve(size_t index, uint64_t offset, uint64_t length,
+    std::vector<Extent> &extents) const
+{
+    // Below last parent, or beyond end of a parent that is smaller than
+    // its child, is zeros
+    if (index >= layers.size() || offset >= layers[index].size)
+    {
+        add_extent(extents, offset, length, -1, 0);
+        return 0;
+    }
+
+    const Layer &layer = layers[index];
+    uint64_t end = offset + length;
+
+    if (end > layer.size)
+    {
+        int result = resolve(index, offset, layer.size - offset, extents);
+
+        if (result == 0)
+        {
+            add_extent(extents, layer.size, end - layer.size, -1, 0);
+        }
+
+        return result;
+    }
+
+    if (layer.format == Format::VhdFixed)
+    {
+        add_extent(extents, offset, length, (int)index, offset);
+        return 0;
+    }
+
+    std::vector<uint8_t> bitmap;
+
+    while (offset < end)
+    {
+        uint64_t block = offset / layer.block_size;
+        uint64_t block_start = block * layer.block_size;
+        uint64_t block_end = std::min(end, block_start + layer.block_size);
+        uint64_t file_offset = 0;
+        int result = 0;
+
+        switch (block_state(layer, block, file_offset))
+        {
+        case BlockState::Absent:
+            result = resolve(index + 1, offset, block_end - offset, extents);
+            break;
+
+        case BlockState::Zero:
+            add_extent(extents, offset, block_end - offset, -1, 0);
+            break;
+
+        case BlockState::Present:
+            add_extent(extents, offset, block_end - offset, (int)index,
+                file_offset + offset - block_start);
+            break;
+
+        case BlockState::Partial:
+            result = read_bitmap(layer, block, bitmap);
+
+            if (result < 0)
+            {
+                return result;
+            }
+
+            // Runs of sectors present in this layer and of sectors that
+            // come from parent. VHD bitmaps have first sector in most
+            // significant bit, VHDX bitmaps in least significant bit.
+            for (uint64_t position = offset; position < block_end;)
+            {
+                auto sector_present = [&](uint64_t sector)
+                {
+                    unsigned bit = layer.format == Format::Vhdx ?
+                        (unsigned)(sector & 7) : 7 - (unsigned)(sector & 7);
+
+                    return ((bitmap[(size_t)(sector >> 3)] >> bit) & 1) != 0;
+                };
+
+                uint64_t sector = (position - block_start) / layer.sector_size;
+                bool present = sector_present(sector);
+                uint64_t run_end = block_start + (sector + 1) * layer.sector_size;
+
+                while (run_end < block_end &&
+                    sector_present((run_end - block_start) / layer.sector_size) ==
+                    present)
+                {
+                    run_end += layer.sector_size;
+                }
+
+                run_end = std::min(run_end, block_end);
+
+                if (present)
+                {
+                    add_extent(extents, position, run_end - position,
+                        (int)index, file_offset + position - block_start);
+                }
+                else
+                {
+                    result = resolve(index + 1, position, run_end - position,
+                        extents);
+
+                    if (result < 0)
+                    {
+                        return result;
+                    }
+                }
+
+                position = run_end;
+            }
+            break;
+        }
+
+        if (result < 0)
+        {
+            return result;
+        }
+
+        offset = block_end;
+    }
+
+    return 0;
+}
+
+int VhdImage::lookup(uint64_t unit, ExtentList &extents) const
+{
+    {
+        std::lock_guard<std::mutex> lock(lookup_mutex);
+
+        auto it = lookup_cache.find(unit);
+
+        if (it != lookup_cache.end())
+        {
+            lookup_lru.splice(lookup_lru.begin(), lookup_lru, it->second.second);
+            extents = it->second.first;
+            lookup_hits++;
+            return 0;
+        }
+    }
+
+    lookup_misses++;
+
+    uint64_t start = unit * lookup_unit;
+    std::shared_ptr<std::vector<Extent>> resolved =
+        std::make_shared<std::vector<Extent>>();
+
+    int result = resolve(0, start, std::min(lookup_unit, size() - start),
+        *resolved);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    extents = resolved;
+
+    std::lock_guard<std::mutex> lock(lookup_mutex);
+
+    // Another thread may have resolved the same unit meanwhile
+    if (lookup_cache.find(unit) == lookup_cache.end())
+    {
+        lookup_lru.push_front(unit);
+        lookup_cache.emplace(unit, std::make_pair(extents, lookup_lru.begin()));
+
+        while (lookup_cache.size() > options.lookup_cache_blocks)
+        {
+            lookup_cache.erase(lookup_lru.back());
+            lookup_lru.pop_back();
+        }
+    }
+
+    return 0;
+}
+
+int VhdImage::map_range(uint64_t offset, uint64_t length,
+    std::vector<Extent> &extents) const
+{
+    // Without parents, everything needed is in memory
+    if (layers.size() == 1 || options.lookup_cache_blocks == 0)
+    {
+        return resolve(0, offset, length, extents);
+    }
+
+    uint64_t end = offset + length;
+
+    for (uint64_t unit = offset / lookup_unit; unit * lookup_unit < end;
+        unit++)
+    {
+        ExtentList unit_extents;
+
+        int result = lookup(unit, unit_extents);
+
+        if (result < 0)
+        {
+            return result;
+        }
+
+        for (const Extent &extent : *unit_extents)
+        {
+            uint64_t first = std::max(extent.offset, offset);
+            uint64_t last = std::min(extent.offset + extent.length, end);
+
+            if (first < last)
+            {
+                add_extent(extents, first, last - first, extent.layer,
+                    extent.layer < 0 ? 0 :
+                    extent.file_offset + first - extent.offset);
+            }
+        }
+    }
+
+    return 0;
+}
+
+namespace
+{
+
+/// Reads of one request, taken one at a time by requesting thread and by
+/// pool threads until all are done
+struct ReadBatch
+{
+    struct ReadOp
+    {
+        uint8_t *buffer;
+        int fd;
+        uint64_t file_offset;
+        size_t length;
+    };
+
+    std::vector<ReadOp> ops;
+    std::atomic<size_t> next{ 0 };
+
+    std::mutex mutex;
+    std::condition_variable all_done;
+    size_t completed = 0;
+    int error = 0;
+
+    /// Returns number of reads done
+    size_t run()
+    {
+        size_t count = 0;
+
+        for (;;)
+        {
+            size_t index = next++;
+
+            if (index >= ops.size())
+            {
+                return count;
+            }
+
+            const ReadOp &op = ops[index];
+
+            int result = read_fully(op.fd, op.buffer, op.length,
+                op.file_offset);
+
+            count++;
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (result < 0 && error == 0)
+            {
+                error = result;
+            }
+
+            if (++completed == ops.size())
+            {
+                all_done.notify_all();
+            }
+        }
+    }
+};
+
+}
+
+ssize_t VhdImage::read(void *buffer, size_t length, uint64_t offset) const
+{
+    if (offset >= size() || length == 0)
+    {
+        return 0;
+    }
+
+    length = (size_t)std::min<uint64_t>(length, size() - offset);
+
+    std::vector<Extent> extents;
+
+    int result = map_range(offset, length, extents);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    std::shared_ptr<ReadBatch> batch = std::make_shared<ReadBatch>();
+
+    for (const Extent &extent : extents)
+    {
+        uint8_t *target = (uint8_t *)buffer + (extent.offset - offset);
+
+        if (extent.layer < 0)
+        {
+            memset(target, 0, (size_t)extent.length);
+            zero_bytes += extent.length;
+        }
+        else
+        {
+            batch->ops.push_back(ReadBatch::ReadOp{ target,
+                layers[extent.layer].fd, extent.file_offset,
+                (size_t)extent.length });
+        }
+    }
+
+    block_reads += batch->ops.size();
+
+    if (batch->ops.empty())
+    {
+        return (ssize_t)length;
+    }
+
+    // Pool threads help with reads after the first one. Those that start
+    // after this thread has done all reads find nothing left to do.
+    size_t helpers = std::min(batch->ops.size() - 1, read_pool->size());
+
+    for (size_t i = 0; i < helpers; i++)
+    {
+        read_pool->submit([this, batch]
+        {
+            parallel_reads += batch->run();
+        });
+    }
+
+    batch->run();
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+
+    batch->all_done.wait(lock,
+        [&batch] { return batch->completed == batch->ops.size(); });
+
+    if (batch->error != 0)
+    {
+        return batch->error;
+    }
+
+    return (ssize_t)length;
+}
+
+ssize_t VhdImage::write(const struct iovec *, int, uint64_t) const
+{
+    return -EROFS;
+}
+
+int VhdImage::punch_hole(uint64_t, uint64_t) const
+{
+    return -EOPNOTSUPP;
+}
+
+int VhdImage::flush() const
+{
+    return 0;
+}
+
+const char *VhdImage::format_name() const
+{
+    return layers.front().format == Format::Vhdx ? "VHDX" : "VHD";
+}
+
+VhdImage::Statistics VhdImage::statistics() const
+{
+    Statistics stats;
+
+    stats.lookup_hits = lookup_hits;
+    stats.lookup_misses = lookup_misses;
+    stats.bitmap_reads = bitmap_reads;
+    stats.block_reads = block_reads;
+    stats.parallel_reads = parallel_reads;
+    stats.zero_bytes = zero_bytes;
+
+    return stats;
+}
+
+}
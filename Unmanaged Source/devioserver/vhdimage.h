@@ -0,0 +1,254 @@
+/// vhdimage.h
+/// Storage backend for devio server that serves VHDX images, and dynamic
+/// and differencing VHD images, natively. Block allocation tables
+/// of the image and all its parents are loaded into compact in-memory
+/// arrays when image is opened. Unallocated blocks are served as zeros
+/// without I/O, and blocks of a request are read in parallel on a worker
+/// pool. Where each block of virtual disk is found in a differencing chain
+/// is kept in a lookup cache, so that sector bitmaps of the chain are read
+/// once rather than for every request.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_VHDIMAGE_H_
+#define _DEVIOSERVER_VHDIMAGE_H_
+
+#include "imagebackend.h"
+#include "workerpool.h"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace devio
+{
+
+struct VhdOptions
+{
+    /// Number of threads that read blocks of requests that span several
+    /// blocks or layers, zero for one per CPU
+    unsigned read_threads = 0;
+
+    /// Number of blocks of virtual disk for which location of data in a
+    /// differencing chain is kept in memory, zero to disable. Images
+    /// without parents do not need it.
+    size_t lookup_cache_blocks = 65536;
+};
+
+class VhdImage : public ImageBackend
+{
+public:
+
+    /// Opens image and all its parents, found through parent locators
+    /// relative to directory of child. Throws std::system_error if any of
+    /// them cannot be opened, is not a valid VHD or VHDX file or does not
+    /// match parent identifier stored in child.
+    VhdImage(const std::string &path, const VhdOptions &options);
+    ~VhdImage();
+
+    VhdImage(const VhdImage &) = delete;
+    VhdImage &operator=(const VhdImage &) = delete;
+
+    /// True if file at path is a VHDX file, or a dynamic or differencing
+    /// VHD file. Fixed VHD files are raw images followed by a footer and
+    /// are served as raw images, but can be parents of differencing files.
+    static bool is_vhd_file(const std::string &path);
+
+    uint64_t size() const override
+    {
+        return layers.front().size;
+    }
+
+    bool read_only() const override
+    {
+        return true;
+    }
+
+    bool supports_punch_hole() const override
+    {
+        return false;
+    }
+
+    ssize_t read(void *buffer, size_t length, uint64_t offset) const override;
+
+    ssize_t write(const struct iovec *iov, int iovcnt,
+        uint64_t offset) const override;
+
+    using ImageBackend::write;
+
+    int punch_hole(uint64_t offset, uint64_t length) const override;
+
+    int flush() const override;
+
+    /// "VHDX" or "VHD"
+    const char *format_name() const;
+
+    /// Block size of image, zero for fixed VHD
+    uint32_t block_size() const
+    {
+        return layers.front().block_size;
+    }
+
+    /// Number of files in differencing chain, including image itself
+    size_t chain_length() const
+    {
+        return layers.size();
+    }
+
+    struct Statistics
+    {
+        /// Blocks of virtual disk found in lookup cache, and blocks that
+        /// had to be looked up in block allocation tables and sector
+        /// bitmaps of the chain
+        uint64_t lookup_hits;
+        uint64_t lookup_misses;
+
+        /// Sector bitmaps read from partially present blocks
+        uint64_t bitmap_reads;
+
+        /// Reads sent to image files, and those of them that were sent on
+        /// worker pool while requesting thread read another one
+        uint64_t block_reads;
+        uint64_t parallel_reads;
+
+        /// Bytes of unallocated or zero blocks served without I/O
+        uint64_t zero_bytes;
+    };
+
+    Statistics statistics() const;
+
+private:
+
+    enum class Format
+    {
+        Vhdx,
+        VhdFixed,
+        VhdDynamic
+    };
+
+    /// One file in differencing chain, image itself first. Block
+    /// allocation table entries are 32 bits: zero if block is not present
+    /// in this file, offset of block in this file in units of
+    /// 1 << offset_shift otherwise. VHDX entries can also be bat_zero, and
+    /// have bat_partial set for blocks that have a sector bitmap. All
+    /// present blocks of differencing VHD files have sector bitmaps.
+    struct Layer
+    {
+        std::string path;
+        int fd = -1;
+        Format format = Format::VhdFixed;
+        uint64_t size = 0;
+        uint32_t block_size = 0;
+        uint32_t sector_size = 512;
+        bool has_parent = false;
+        unsigned offset_shift = 0;
+        std::vector<uint32_t> bat;
+
+        /// VHDX: blocks per sector bitmap block, and offsets of sector
+        /// bitmap blocks in MB. VHD: size of bitmap in front of each block.
+        uint32_t chunk_ratio = 0;
+        std::vector<uint32_t> bitmap_blocks;
+        uint32_t bitmap_size = 0;
+
+        /// Identity of this file that children refer to, and what this
+        /// file expects of its parent. VHDX compares DataWriteGuid with
+        /// parent_linkage values, VHD compares footer unique id.
+        std::vector<uint8_t> identity;
+        std::vector<std::vector<uint8_t>> parent_identities;
+        std::vector<std::string> parent_paths;
+    };
+
+    /// Where a range of virtual disk is found. Layer is index in layers, or
+    /// -1 for ranges that read as zeros.
+    struct Extent
+    {
+        uint64_t offset;
+        uint64_t length;
+        int layer;
+        uint64_t file_offset;
+    };
+
+    typedef std::shared_ptr<const std::vector<Extent>> ExtentList;
+
+    /// Appends an extent, merged with last one if it continues it
+    static void add_extent(std::vector<Extent> &extents, uint64_t offset,
+        uint64_t length, int layer, uint64_t file_offset);
+
+    enum class BlockState
+    {
+        Absent,
+        Zero,
+        Present,
+        Partial
+    };
+
+    void open_layer(Layer &layer);
+
+    void parse_vhdx(Layer &layer, uint64_t file_size);
+
+    void parse_vhd(Layer &layer, uint64_t file_size);
+
+    /// Finds parent of last layer among its parent paths and opens it.
+    /// Returns false if it has no parent.
+    bool open_parent();
+
+    BlockState block_state(const Layer &layer, uint64_t block,
+        uint64_t &file_offset) const;
+
+    /// Reads sector bitmap of a partially present block. Returns zero or
+    /// -errno.
+    int read_bitmap(const Layer &layer, uint64_t block,
+        std::vector<uint8_t> &bitmap) const;
+
+    /// Appends extents of range [offset, offset + length) of layer and its
+    /// parents. Returns zero or -errno.
+    int resolve(size_t index, uint64_t offset, uint64_t length,
+        std::vector<Extent> &extents) const;
+
+    /// Extents of one lookup unit of a differencing chain, from lookup
+    /// cache or resolved and added to it
+    int lookup(uint64_t unit, ExtentList &extents) const;
+
+    /// Extents of a request
+    int map_range(uint64_t offset, uint64_t length,
+        std::vector<Extent> &extents) const;
+
+    std::vector<Layer> layers;
+
+    VhdOptions options;
+
+    /// Size of ranges cached in lookup cache, smallest block size in chain
+    uint64_t lookup_unit = 0;
+
+    mutable std::mutex lookup_mutex;
+    mutable std::unordered_map<uint64_t,
+        std::pair<ExtentList, std::list<uint64_t>::iterator>> lookup_cache;
+
+    /// Cached units, most recently used first
+    mutable std::list<uint64_t> lookup_lru;
+
+    mutable std::atomic<uint64_t> lookup_hits{ 0 };
+    mutable std::atomic<uint64_t> lookup_misses{ 0 };
+    mutable std::atomic<uint64_t> bitmap_reads{ 0 };
+    mutable std::atomic<uint64_t> block_reads{ 0 };
+    mutable std::atomic<uint64_t> parallel_reads{ 0 };
+    mutable std::atomic<uint64_t> zero_bytes{ 0 };
+
+    /// Created last and stopped first, queued reads refer to layers
+    std::unique_ptr<WorkerPool> read_pool;
+};
+
+}
+
+#endif // _DEVIOSERVER_VHDIMAGE_H_
@@ -0,0 +1,114 @@
+/// workerpool.h
+/// Fixed size pool of threads that run backend I/O for devio server, so
+/// that the event loop never blocks on storage.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _DEVIOSERVER_WORKERPOOL_H_
+#define _DEVIOSERVER_WORKERPOOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace devio
+{
+
+class WorkerPool
+{
+public:
+
+    explicit WorkerPool(unsigned thread_count)
+    {
+        if (thread_count == 0)
+        {
+            thread_count = 1;
+        }
+
+        for (unsigned i = 0; i < thread_count; i++)
+        {
+            threads.emplace_back([this] { run(); });
+        }
+    }
+
+    /// Waits for queued work to finish and stops all threads
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        work_available.notify_all();
+
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    void submit(std::function<void()> work)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(work));
+        }
+
+        work_available.notify_one();
+    }
+
+    size_t size() const
+    {
+        return threads.size();
+    }
+
+private:
+
+    void run()
+    {
+        for (;;)
+        {
+            std::function<void()> work;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                work_available.wait(lock,
+                    [this] { return stopping || !queue.empty(); });
+
+                if (queue.empty())
+                {
+                    return;
+                }
+
+                work = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            work();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::deque<std::function<void()>> queue;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+}
+
+#endif // _DEVIOSERVER_WORKERPOOL_H_
@@ -0,0 +1,387 @@
+/// zerobench.cpp
+/// devio-zerobench command line application. Measures zero detection used
+/// by the driver for write requests to sparse images, with the scan
+/// routines of phdskmnt/inc/zeroscan.h compiled for user mode: the scalar
+/// loop that ImScsiIsBufferZero used before, and scalar, SSE2 and AVX2
+/// versions of ImScsiFindNonZero. Also measures finding zero block runs in
+/// partly zero writes with ImScsiFindZeroRun.
+///
+/// All versions are first checked against each other on random buffers.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "../phdskmnt/inc/zeroscan.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+struct BenchOptions
+{
+    size_t max_size = 8 << 20;
+    size_t granularity = 64 << 10;
+    unsigned data_percent = 25;
+    double seconds = 0.5;
+};
+
+/// ImScsiIsBufferZero as it was before zeroscan.h, one ULONGLONG at a time
+static size_t find_nonzero_before(const void *buffer, size_t length)
+{
+    const uint64_t *ptr;
+
+    if (length < sizeof(uint64_t))
+    {
+        return 0;
+    }
+
+    for (ptr = (const uint64_t *)buffer;
+        (ptr <= (const uint64_t *)((const uint8_t *)buffer + length - sizeof(uint64_t))) &&
+        (*ptr == 0); ptr++);
+
+    // Only tells whether all of buffer is zero
+    return ptr == (const uint64_t *)((const uint8_t *)buffer + length) ?
+        length : 0;
+}
+
+static size_t find_nonzero_scalar(const void *buffer, size_t length)
+{
+    return ImScsiFindNonZeroScalar(buffer, length);
+}
+
+#ifdef IMSCSI_ZERO_SCAN_HAS_SSE2
+static size_t find_nonzero_sse2(const void *buffer, size_t length)
+{
+    return ImScsiFindNonZeroSse2(buffer, length);
+}
+#endif
+
+#ifdef IMSCSI_ZERO_SCAN_HAS_AVX2
+static size_t find_nonzero_avx2(const void *buffer, size_t length)
+{
+    return ImScsiFindNonZeroAvx2(buffer, length);
+}
+#endif
+
+struct ScanRoutine
+{
+    const char *name;
+    PIMSCSI_FIND_NONZERO find_nonzero;
+
+    /// False for routine that only tells whether whole buffer is zero
+    bool exact;
+};
+
+static std::vector<ScanRoutine> get_routines()
+{
+    std::vector<ScanRoutine> routines;
+
+    routines.push_back({ "Before", find_nonzero_before, false });
+    routines.push_back({ "Scalar", find_nonzero_scalar, true });
+
+#ifdef IMSCSI_ZERO_SCAN_HAS_SSE2
+    routines.push_back({ "SSE2", find_nonzero_sse2, true });
+#endif
+
+#ifdef IMSCSI_ZERO_SCAN_HAS_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        routines.push_back({ "AVX2", find_nonzero_avx2, true });
+    }
+#endif
+
+    return routines;
+}
+
+/// Compares all routines on buffers with one nonzero byte at a random
+/// position, or none, at random alignments and lengths. Returns number of
+/// mismatches.
+static unsigned check_routines(const std::vector<ScanRoutine> &routines)
+{
+    std::mt19937_64 random(1);
+    std::vector<uint8_t> buffer(70000 + 64);
+    unsigned errors = 0;
+
+    for (unsigned i = 0; i < 20000; i++)
+    {
+        size_t align = random() % 64;
+        size_t length = random() % 70000;
+        size_t position = random() % (length + 1);
+        uint8_t *ptr = buffer.data() + align;
+
+        memset(buffer.data(), 0, buffer.size());
+
+        // Garbage before and after buffer must not be seen
+        buffer[align > 0 ? align - 1 : 0] = align > 0 ? 1 : 0;
+        ptr[length] = 1;
+
+        if (position < length)
+        {
+            ptr[position] = (uint8_t)(1 + random() % 255);
+        }
+
+        for (const ScanRoutine &routine : routines)
+        {
+            size_t result = routine.find_nonzero(ptr, length);
+            size_t expected = position;
+
+            if (!routine.exact)
+            {
+                if (length < 8 || length % 8 != 0)
+                {
+                    continue;
+                }
+
+                expected = position < length ? 0 : length;
+            }
+
+            if (result != expected)
+            {
+                if (errors++ < 10)
+                {
+                    fprintf(stderr, "%s: length %zu, alignment %zu, nonzero "
+                        "at %zu, returned %zu\n", routine.name, length, align,
+                        position, result);
+                }
+            }
+        }
+    }
+
+    return errors;
+}
+
+/// Repeats scan of buffer for about options.seconds. Returns GB/s.
+static double measure_scan(const ScanRoutine &routine, const uint8_t *buffer,
+    size_t length, const BenchOptions &options)
+{
+    uint64_t bytes = 0;
+    size_t sink = 0;
+    auto start = bench_clock::now();
+    auto end = start + std::chrono::duration<double>(options.seconds);
+    auto now = start;
+
+    do
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            sink += routine.find_nonzero(buffer, length);
+            bytes += length;
+        }
+
+        now = bench_clock::now();
+    } while (now < end);
+
+    if (sink == 1)
+    {
+        puts("");
+    }
+
+    return bytes / std::chrono::duration<double>(now - start).count() / 1e9;
+}
+
+/// Finds all zero runs of a buffer in one routine. Returns zero bytes
+/// found.
+static size_t find_all_runs(PIMSCSI_FIND_NONZERO find_nonzero,
+    const uint8_t *buffer, size_t length, size_t granularity)
+{
+    size_t start = 0;
+    size_t run_start;
+    size_t run_length;
+    size_t zero_bytes = 0;
+
+    while (ImScsiFindZeroRun(find_nonzero, buffer, length, start, 0,
+        granularity, &run_start, &run_length))
+    {
+        zero_bytes += run_length;
+        start = run_start + run_length;
+    }
+
+    return zero_bytes;
+}
+
+static void usage()
+{
+    fputs(
+        "Syntax:\n"
+        "devio-zerobench [options]\n"
+        "\n"
+        "Measures zero detection of driver write path in GB/s for all zero\n"
+        "buffers from 4 KB up to max size, and for finding zero block runs\n"
+        "in a partly zero buffer of max size.\n"
+        "\n"
+        "-s, --max-size bytes     Largest buffer, default 8388608.\n"
+        "-g, --granularity bytes  Zero run block size, default 65536.\n"
+        "-p, --data-percent n     Blocks with data in partly zero buffer,\n"
+        "                         default 25.\n"
+        "-t, --time seconds       Time for each measurement, default 0.5.\n",
+        stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        { "max-size", required_argument, nullptr, 's' },
+        { "granularity", required_argument, nullptr, 'g' },
+        { "data-percent", required_argument, nullptr, 'p' },
+        { "time", required_argument, nullptr, 't' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    BenchOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "s:g:p:t:h", long_options,
+        nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            options.max_size = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'g':
+            options.granularity = (size_t)strtoull(optarg, nullptr, 0);
+            break;
+
+        case 'p':
+            options.data_percent = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 't':
+            options.seconds = strtod(optarg, nullptr);
+            break;
+
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (options.max_size < 4096 || options.granularity < 512 ||
+        options.granularity > options.max_size || options.data_percent > 100)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<ScanRoutine> routines = get_routines();
+
+    unsigned errors = check_routines(routines);
+
+    if (errors != 0)
+    {
+        printf("%u mismatches between scan routines\n", errors);
+        return 1;
+    }
+
+    // Page aligned, like buffers of write requests
+    std::vector<uint8_t> storage(options.max_size + 4096);
+    uint8_t *buffer = storage.data() +
+        ((4096 - ((uintptr_t)storage.data() & 4095)) & 4095);
+
+    memset(buffer, 0, options.max_size);
+
+    printf("All zero buffers, GB/s\n%10s", "Size");
+
+    for (const ScanRoutine &routine : routines)
+    {
+        printf(" %10s", routine.name);
+    }
+
+    printf("\n");
+
+    // 4 KB, 16 KB and so on, and max size last
+    for (size_t size = 4096;; size = std::min(size << 2, options.max_size))
+    {
+        printf("%10zu", size);
+
+        for (const ScanRoutine &routine : routines)
+        {
+            printf(" %10.2f", measure_scan(routine, buffer, size, options));
+            fflush(stdout);
+        }
+
+        printf("\n");
+
+        if (size == options.max_size)
+        {
+            break;
+        }
+    }
+
+    // Partly zero buffer, one nonzero byte at a random position in data
+    // blocks
+    std::mt19937_64 random(2);
+    size_t block_count = options.max_size / options.granularity;
+    size_t data_blocks = 0;
+
+    for (size_t block = 0; block < block_count; block++)
+    {
+        if (random() % 100 < options.data_percent)
+        {
+            buffer[block * options.granularity +
+                random() % options.granularity] = 0xff;
+
+            data_blocks++;
+        }
+    }
+
+    printf("\nZero runs in %zu byte buffer, %zu of %zu blocks of %zu bytes "
+        "with data\n%10s %10s %10s\n", options.max_size, data_blocks,
+        block_count, options.granularity, "Routine", "GB/s", "Zero MB");
+
+    size_t expected_zero_bytes = (block_count - data_blocks) *
+        options.granularity;
+
+    for (const ScanRoutine &routine : routines)
+    {
+        if (!routine.exact)
+        {
+            continue;
+        }
+
+        size_t zero_bytes = 0;
+        uint64_t bytes = 0;
+        auto start = bench_clock::now();
+        auto end = start + std::chrono::duration<double>(options.seconds);
+        auto now = start;
+
+        do
+        {
+            zero_bytes = find_all_runs(routine.find_nonzero, buffer,
+                options.max_size, options.granularity);
+            bytes += options.max_size;
+            now = bench_clock::now();
+        } while (now < end);
+
+        printf("%10s %10.2f %10.1f%s\n", routine.name,
+            bytes / std::chrono::duration<double>(now - start).count() / 1e9,
+            zero_bytes / 1e6,
+            zero_bytes == expected_zero_bytes ? "" : "  MISMATCH");
+
+        if (zero_bytes != expected_zero_bytes)
+        {
+            errors++;
+        }
+    }
+
+    return errors != 0 ? 1 : 0;
+}
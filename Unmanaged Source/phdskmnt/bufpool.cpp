@@ -0,0 +1,291 @@
+/// bufpool.cpp
+/// Pool of non-paged intermediate buffers for read and write requests.
+/// Keeps released buffers in power of two size classes, so that each
+/// request does not need a new system pool allocation of transfer size.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "phdskmnt.h"
+
+///
+/// Free buffers are first kept in a small magazine for the CPU that
+/// released them, and when that is full, in a depot shared by all CPUs.
+/// Magazine locks are normally only taken by their own CPU, so they are
+/// not contended. Magazines only hold a few buffers of large classes, and
+/// none of the largest, so that memory kept for each CPU is bounded. Depot
+/// holds up to BufferPoolSize bytes of each class, but always at least one
+/// buffer.
+///
+/// Buffers are rounded up to class size when allocated. A buffer can be
+/// released with a smaller size than requested, for example after a short
+/// read, and is then kept in a class for that size. It is still at least
+/// as large as any buffer in that class.
+///
+
+#define ImScsiBufferPoolClassSize(SizeClass) \
+    (1UL << (IMSCSI_BUFFER_POOL_MIN_SHIFT + (SizeClass)))
+
+/// Smallest size class that holds Size bytes, IMSCSI_BUFFER_POOL_CLASSES if
+/// none of them does.
+static ULONG
+ImScsiBufferPoolSizeClass(
+    __in ULONG Size)
+{
+    ULONG size_class = 0;
+
+    while ((size_class < IMSCSI_BUFFER_POOL_CLASSES) &&
+        (ImScsiBufferPoolClassSize(size_class) < Size))
+    {
+        size_class++;
+    }
+
+    return size_class;
+}
+
+VOID
+ImScsiInitializeBufferPool()
+{
+    PIMSCSI_BUFFER_POOL pool = &pMPDrvInfoGlobal->BufferPool;
+    ULONG max_size = pMPDrvInfoGlobal->MPRegInfo.BufferPoolSize;
+    ULONG magazine_count;
+
+    RtlZeroMemory(pool, sizeof(*pool));
+
+    if (max_size == 0)
+    {
+        KdPrint(("PhDskMnt::ImScsiInitializeBufferPool: Buffer pool disabled.\n"));
+        return;
+    }
+
+#if (NTDDI_VERSION >= NTDDI_VISTA)
+    magazine_count = KeQueryActiveProcessorCount(NULL);
+#else
+    magazine_count = (ULONG)KeNumberProcessors;
+#endif
+
+    if (magazine_count > IMSCSI_BUFFER_POOL_MAX_MAGAZINES)
+    {
+        magazine_count = IMSCSI_BUFFER_POOL_MAX_MAGAZINES;
+    }
+    else if (magazine_count == 0)
+    {
+        magazine_count = 1;
+    }
+
+    pool->Magazines = (PIMSCSI_BUFFER_MAGAZINE)ExAllocatePoolWithTag(
+        NonPagedPool, magazine_count * sizeof(*pool->Magazines),
+        MP_TAG_GENERAL);
+
+    if (pool->Magazines == NULL)
+    {
+        DbgPrint("PhDskMnt::ImScsiInitializeBufferPool: Memory allocation failed. Buffer pool disabled.\n");
+        return;
+    }
+
+    RtlZeroMemory(pool->Magazines, magazine_count * sizeof(*pool->Magazines));
+
+    for (ULONG i = 0; i < magazine_count; i++)
+    {
+        KeInitializeSpinLock(&pool->Magazines[i].Lock);
+    }
+
+    pool->MagazineCount = magazine_count;
+
+    for (ULONG size_class = 0; size_class < IMSCSI_BUFFER_POOL_CLASSES; size_class++)
+    {
+        ULONG class_size = ImScsiBufferPoolClassSize(size_class);
+
+        pool->MagazineDepth[size_class] =
+            min(IMSCSI_BUFFER_POOL_MAGAZINE_SIZE,
+                IMSCSI_BUFFER_POOL_MAGAZINE_BYTES / class_size);
+
+        pool->DepotDepth[size_class] =
+            max(1UL, min(IMSCSI_BUFFER_POOL_MAX_DEPOT_DEPTH,
+                max_size / class_size));
+
+        KeInitializeSpinLock(&pool->DepotLock[size_class]);
+    }
+
+    KdPrint(("PhDskMnt::ImScsiInitializeBufferPool: %u magazines, %u bytes for each size class in depot.\n",
+        magazine_count, max_size));
+}
+
+VOID
+ImScsiFreeBufferPool()
+{
+    PIMSCSI_BUFFER_POOL pool = &pMPDrvInfoGlobal->BufferPool;
+
+    if (pool->Magazines == NULL)
+    {
+        return;
+    }
+
+    KdPrint(("PhDskMnt::ImScsiFreeBufferPool: %I64i hits, %I64i fallbacks.\n",
+        pool->Hits, pool->Fallbacks));
+
+    for (ULONG i = 0; i < pool->MagazineCount; i++)
+    {
+        PIMSCSI_BUFFER_MAGAZINE magazine = &pool->Magazines[i];
+
+        for (ULONG size_class = 0; size_class < IMSCSI_BUFFER_POOL_CLASSES; size_class++)
+        {
+            while (magazine->Count[size_class] > 0)
+            {
+                ExFreePoolWithTag(
+                    magazine->Buffers[size_class][--magazine->Count[size_class]],
+                    MP_TAG_GENERAL);
+            }
+        }
+    }
+
+    for (ULONG size_class = 0; size_class < IMSCSI_BUFFER_POOL_CLASSES; size_class++)
+    {
+        while (pool->DepotCount[size_class] > 0)
+        {
+            ExFreePoolWithTag(
+                pool->Depot[size_class][--pool->DepotCount[size_class]],
+                MP_TAG_GENERAL);
+        }
+    }
+
+    ExFreePoolWithTag(pool->Magazines, MP_TAG_GENERAL);
+
+    pool->Magazines = NULL;
+    pool->MagazineCount = 0;
+}
+
+PVOID
+ImScsiAllocateBuffer(
+    __in ULONG Size,
+    __inout_opt PIMSCSI_DEVICE_STATISTICS Statistics)
+{
+    PIMSCSI_BUFFER_POOL pool = &pMPDrvInfoGlobal->BufferPool;
+    PIMSCSI_BUFFER_MAGAZINE magazine;
+    ULONG size_class;
+    PVOID buffer = NULL;
+    KIRQL old_irql;
+
+    size_class = ImScsiBufferPoolSizeClass(Size);
+
+    if ((pool->Magazines != NULL) &&
+        (size_class < IMSCSI_BUFFER_POOL_CLASSES))
+    {
+        // Stay on this CPU while its magazine is used
+        KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+
+        magazine = &pool->Magazines[KeGetCurrentProcessorNumber() % pool->MagazineCount];
+
+        KeAcquireSpinLockAtDpcLevel(&magazine->Lock);
+
+        if (magazine->Count[size_class] > 0)
+        {
+            buffer = magazine->Buffers[size_class][--magazine->Count[size_class]];
+        }
+
+        KeReleaseSpinLockFromDpcLevel(&magazine->Lock);
+
+        if (buffer == NULL)
+        {
+            KeAcquireSpinLockAtDpcLevel(&pool->DepotLock[size_class]);
+
+            if (pool->DepotCount[size_class] > 0)
+            {
+                buffer = pool->Depot[size_class][--pool->DepotCount[size_class]];
+            }
+
+            KeReleaseSpinLockFromDpcLevel(&pool->DepotLock[size_class]);
+        }
+
+        KeLowerIrql(old_irql);
+
+        if (buffer != NULL)
+        {
+            InterlockedIncrement64(&pool->Hits);
+
+            if (Statistics != NULL)
+            {
+                InterlockedIncrement64(&Statistics->BufferPoolHits);
+            }
+
+            return buffer;
+        }
+
+        Size = ImScsiBufferPoolClassSize(size_class);
+    }
+
+    InterlockedIncrement64(&pool->Fallbacks);
+
+    if (Statistics != NULL)
+    {
+        InterlockedIncrement64(&Statistics->BufferPoolFallbacks);
+    }
+
+    return ExAllocatePoolWithTag(NonPagedPool, Size, MP_TAG_GENERAL);
+}
+
+VOID
+ImScsiFreeBuffer(
+    __in PVOID Buffer,
+    __in ULONG Size)
+{
+    PIMSCSI_BUFFER_POOL pool = &pMPDrvInfoGlobal->BufferPool;
+    PIMSCSI_BUFFER_MAGAZINE magazine;
+    ULONG size_class;
+    BOOLEAN kept = FALSE;
+    KIRQL old_irql;
+
+    if (pool->Magazines == NULL)
+    {
+        ExFreePoolWithTag(Buffer, MP_TAG_GENERAL);
+        return;
+    }
+
+    size_class = ImScsiBufferPoolSizeClass(Size);
+
+    if (size_class >= IMSCSI_BUFFER_POOL_CLASSES)
+    {
+        ExFreePoolWithTag(Buffer, MP_TAG_GENERAL);
+        return;
+    }
+
+    KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+
+    magazine = &pool->Magazines[KeGetCurrentProcessorNumber() % pool->MagazineCount];
+
+    KeAcquireSpinLockAtDpcLevel(&magazine->Lock);
+
+    if (magazine->Count[size_class] < pool->MagazineDepth[size_class])
+    {
+        magazine->Buffers[size_class][magazine->Count[size_class]++] = Buffer;
+        kept = TRUE;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&magazine->Lock);
+
+    if (!kept)
+    {
+        KeAcquireSpinLockAtDpcLevel(&pool->DepotLock[size_class]);
+
+        if (pool->DepotCount[size_class] < pool->DepotDepth[size_class])
+        {
+            pool->Depot[size_class][pool->DepotCount[size_class]++] = Buffer;
+            kept = TRUE;
+        }
+
+        KeReleaseSpinLockFromDpcLevel(&pool->DepotLock[size_class]);
+    }
+
+    KeLowerIrql(old_irql);
+
+    if (!kept)
+    {
+        ExFreePoolWithTag(Buffer, MP_TAG_GENERAL);
+    }
+}
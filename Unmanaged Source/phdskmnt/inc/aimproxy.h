@@ -0,0 +1,305 @@
+
+/// aimproxy.h
+/// Arsenal Image Mounter extensions to the ImDisk/devio proxy protocol
+/// defined in imdproxy.h. Extensions are only used when a proxy server
+/// advertises them in IMDPROXY_INFO_RESP flags, so that servers that only
+/// implement the original protocol continue to work unchanged.
+///
+/// This header does not depend on any Windows headers other than the basic
+/// types also used by imdproxy.h, so it can be used by portable proxy
+/// server implementations as well.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _AIMPROXY_H_
+#define _AIMPROXY_H_
+
+///
+/// Additional capability flags in IMDPROXY_INFO_RESP.flags
+///
+
+/// Server supports the multi-slot shared memory ring layout. Only valid
+/// for shared memory proxy connections.
+#define IMDPROXY_FLAG_SUPPORTS_SHM_RING     0x0100ULL
+
+/// Server accepts tagged read and write requests. Only valid for stream
+/// based proxy connections, such as TCP/IP.
+#define IMDPROXY_FLAG_SUPPORTS_TAGGED       0x0200ULL
+
+/// Server accepts vectored read and write requests.
+#define IMDPROXY_FLAG_SUPPORTS_VECTORED     0x0400ULL
+
+///
+/// Additional request codes
+///
+
+/// Switch a shared memory connection from single mailbox to multi-slot
+/// ring layout. Sent through the original mailbox, after IMDPROXY_REQ_INFO.
+#define IMDPROXY_REQ_SHM_RING_SETUP         0x0100ULL
+
+/// Tagged versions of IMDPROXY_REQ_READ and IMDPROXY_REQ_WRITE
+#define IMDPROXY_REQ_READ_TAGGED            0x0101ULL
+#define IMDPROXY_REQ_WRITE_TAGGED           0x0102ULL
+
+/// Read or write a list of extents in one request
+#define IMDPROXY_REQ_READV                  0x0103ULL
+#define IMDPROXY_REQ_WRITEV                 0x0104ULL
+
+///
+/// Shared memory ring layout
+///
+/// After a successful IMDPROXY_REQ_SHM_RING_SETUP, the shared memory section
+/// is divided as follows:
+///
+/// Offset 0, IMDPROXY_HEADER_SIZE bytes: Control page. The first ULONGLONG
+/// is IMDPROXY_REQ_NULL while the ring is in use. Client writes
+/// IMDPROXY_REQ_CLOSE here and signals request event to disconnect.
+///
+/// Offset IMDPROXY_HEADER_SIZE + n * slot_size: Slot n. Each slot starts
+/// with an IMDPROXY_SHM_RING_SLOT structure in a page of size
+/// IMDPROXY_HEADER_SIZE, followed by slot data area of
+/// slot_size - IMDPROXY_HEADER_SIZE bytes.
+///
+/// Client claims a free slot, copies request header and data into it and
+/// sets state to IMDPROXY_SHM_RING_SLOT_REQUEST before signalling request
+/// event. Server scans all slots when request event is signalled, handles
+/// requests in any order and for each of them writes response header and
+/// data into the same slot, sets state to IMDPROXY_SHM_RING_SLOT_RESPONSE
+/// and signals response event. Client then reads the response and sets the
+/// slot back to IMDPROXY_SHM_RING_SLOT_FREE.
+///
+
+#define IMDPROXY_SHM_RING_VERSION           1
+
+/// Maximum number of slots a client can request
+#define IMDPROXY_SHM_RING_MAX_SLOTS         32
+
+/// Offset of request/response header within a slot
+#define IMDPROXY_SHM_RING_SLOT_HEADER_OFFSET    64
+
+/// Largest request or response header that fits in a slot
+#define IMDPROXY_SHM_RING_SLOT_HEADER_SIZE  \
+    (IMDPROXY_HEADER_SIZE - IMDPROXY_SHM_RING_SLOT_HEADER_OFFSET)
+
+/// Slot states
+#define IMDPROXY_SHM_RING_SLOT_FREE         0
+#define IMDPROXY_SHM_RING_SLOT_REQUEST      1
+#define IMDPROXY_SHM_RING_SLOT_RESPONSE     2
+
+/// Distance in bytes between slots for a shared memory section of a given
+/// size divided into a given number of slots. Always a multiple of
+/// IMDPROXY_HEADER_SIZE so that each slot data area is page aligned.
+#define IMDPROXY_SHM_RING_SLOT_SIZE(shm_size, slot_count) \
+    ((((shm_size) - IMDPROXY_HEADER_SIZE) / (slot_count)) & \
+    ~((ULONGLONG)IMDPROXY_HEADER_SIZE - 1))
+
+/// Address of a slot within a mapped shared memory section
+#define IMDPROXY_SHM_RING_SLOT_PTR(shm, slot_size, n) \
+    ((PIMDPROXY_SHM_RING_SLOT)((PUCHAR)(shm) + IMDPROXY_HEADER_SIZE + \
+    (SIZE_T)(n) * (SIZE_T)(slot_size)))
+
+typedef struct _IMDPROXY_SHM_RING_SLOT
+{
+    volatile LONG state;        // IMDPROXY_SHM_RING_SLOT_xxx
+    ULONG reserved;
+    ULONGLONG tag;              // Set by client, not used by server
+
+    // Request/response header at IMDPROXY_SHM_RING_SLOT_HEADER_OFFSET
+
+} IMDPROXY_SHM_RING_SLOT, *PIMDPROXY_SHM_RING_SLOT;
+
+typedef struct _IMDPROXY_SHM_RING_SETUP_REQ
+{
+    ULONGLONG request_code;     // IMDPROXY_REQ_SHM_RING_SETUP
+    ULONGLONG version;          // IMDPROXY_SHM_RING_VERSION
+    ULONGLONG slot_count;       // Number of slots requested by client
+} IMDPROXY_SHM_RING_SETUP_REQ, *PIMDPROXY_SHM_RING_SETUP_REQ;
+
+typedef struct _IMDPROXY_SHM_RING_SETUP_RESP
+{
+    ULONGLONG errorno;          // 0 when ring layout is now active
+    ULONGLONG slot_count;       // Number of slots accepted by server, never
+                                // more than requested
+    ULONGLONG slot_size;        // Distance between slots, must equal
+                                // IMDPROXY_SHM_RING_SLOT_SIZE() for
+                                // accepted number of slots
+} IMDPROXY_SHM_RING_SETUP_RESP, *PIMDPROXY_SHM_RING_SETUP_RESP;
+
+///
+/// Tagged requests on stream connections
+///
+/// A client can send any number of tagged requests without waiting for
+/// responses in between. Server sends one IMDPROXY_TAGGED_RESP for each of
+/// them, in any order, with the tag copied from the request. Read responses
+/// are followed by length bytes of data, write responses have no data.
+///
+/// Untagged requests are only sent when there are no outstanding tagged
+/// requests, and are answered the same way as in the original protocol.
+///
+
+typedef struct _IMDPROXY_TAGGED_READ_REQ
+{
+    ULONGLONG request_code;     // IMDPROXY_REQ_READ_TAGGED
+    ULONGLONG offset;
+    ULONGLONG length;
+    ULONGLONG tag;              // Chosen by client, copied to response
+} IMDPROXY_TAGGED_READ_REQ, *PIMDPROXY_TAGGED_READ_REQ;
+
+typedef struct _IMDPROXY_TAGGED_WRITE_REQ
+{
+    ULONGLONG request_code;     // IMDPROXY_REQ_WRITE_TAGGED
+    ULONGLONG offset;
+    ULONGLONG length;
+    ULONGLONG tag;              // Chosen by client, copied to response
+
+    // Followed by length bytes of data to write
+
+} IMDPROXY_TAGGED_WRITE_REQ, *PIMDPROXY_TAGGED_WRITE_REQ;
+
+typedef struct _IMDPROXY_TAGGED_RESP
+{
+    ULONGLONG tag;              // Tag from request
+    ULONGLONG errorno;
+    ULONGLONG length;           // Bytes read or written
+} IMDPROXY_TAGGED_RESP, *PIMDPROXY_TAGGED_RESP;
+
+///
+/// Vectored requests
+///
+/// An IMDPROXY_VECTORED_REQ header is followed by extent_count
+/// IMDPROXY_EXTENT structures. Data for all extents is transferred as one
+/// block, in the same order as the extents, in request data for
+/// IMDPROXY_REQ_WRITEV and in response data for IMDPROXY_REQ_READV. The total
+/// size of the block is in the length field of the request.
+///
+/// For shared memory connections, header and extents are placed where a
+/// request header is normally placed, so extent_count can never be more than
+/// what fits within a request header area.
+///
+/// Server either transfers all data, where reads beyond end of image return
+/// zeros, or returns an error for the entire request. Server is free to
+/// merge extents or handle them in any order.
+///
+
+/// Largest number of extents in one request
+#define IMDPROXY_VECTORED_MAX_EXTENTS       64
+
+typedef struct _IMDPROXY_EXTENT
+{
+    ULONGLONG offset;
+    ULONGLONG length;
+} IMDPROXY_EXTENT, *PIMDPROXY_EXTENT;
+
+typedef struct _IMDPROXY_VECTORED_REQ
+{
+    ULONGLONG request_code;     // IMDPROXY_REQ_READV or IMDPROXY_REQ_WRITEV
+    ULONGLONG extent_count;
+    ULONGLONG length;           // Sum of lengths of all extents
+    IMDPROXY_EXTENT extents[IMDPROXY_VECTORED_MAX_EXTENTS];
+} IMDPROXY_VECTORED_REQ, *PIMDPROXY_VECTORED_REQ;
+
+typedef struct _IMDPROXY_VECTORED_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG length;           // Bytes read or written
+} IMDPROXY_VECTORED_RESP, *PIMDPROXY_VECTORED_RESP;
+
+/// Size in bytes of a vectored request header with a given number of
+/// extents, as sent over the connection
+#define IMDPROXY_VECTORED_REQ_SIZE(extent_count) \
+    (sizeof(IMDPROXY_VECTORED_REQ) - sizeof(IMDPROXY_EXTENT) * \
+    (IMDPROXY_VECTORED_MAX_EXTENTS - (extent_count)))
+
+/// Initializes an empty vectored request.
+static __inline void
+ImdProxyInitVectoredRequest(PIMDPROXY_VECTORED_REQ request,
+    ULONGLONG request_code)
+{
+    request->request_code = request_code;
+    request->extent_count = 0;
+    request->length = 0;
+}
+
+/// Adds an extent to a vectored request. An extent that starts where the
+/// last one ends is merged with it, unless the last one wraps around end of
+/// address space or the merged length would overflow, so that invalid
+/// extents are never merged into valid looking ones. Returns zero if
+/// request is full.
+static __inline int
+ImdProxyAddVectoredExtent(PIMDPROXY_VECTORED_REQ request,
+    ULONGLONG offset,
+    ULONGLONG length)
+{
+    if (request->extent_count > 0)
+    {
+        PIMDPROXY_EXTENT last = &request->extents[request->extent_count - 1];
+
+        if (last->offset + last->length == offset &&
+            offset >= last->offset &&
+            last->length + length >= last->length)
+        {
+            last->length += length;
+            request->length += length;
+            return 1;
+        }
+    }
+
+    if (request->extent_count >= IMDPROXY_VECTORED_MAX_EXTENTS)
+    {
+        return 0;
+    }
+
+    request->extents[request->extent_count].offset = offset;
+    request->extents[request->extent_count].length = length;
+    request->extent_count++;
+    request->length += length;
+
+    return 1;
+}
+
+/// Validates a received vectored request. header_size is the number of
+/// bytes received for header and extents, max_length the largest data block
+/// the receiver can handle. Returns zero if request is malformed, in which
+/// case it must not be used at all.
+static __inline int
+ImdProxyValidateVectoredRequest(const IMDPROXY_VECTORED_REQ *request,
+    ULONGLONG header_size,
+    ULONGLONG max_length)
+{
+    ULONGLONG total = 0;
+    ULONGLONG i;
+
+    if (header_size < IMDPROXY_VECTORED_REQ_SIZE(0) ||
+        request->extent_count > IMDPROXY_VECTORED_MAX_EXTENTS ||
+        header_size < IMDPROXY_VECTORED_REQ_SIZE(request->extent_count) ||
+        request->length > max_length)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < request->extent_count; i++)
+    {
+        const IMDPROXY_EXTENT *extent = &request->extents[i];
+
+        // Extent must neither wrap around end of address space nor make
+        // total exceed the declared length
+        if (extent->offset + extent->length < extent->offset ||
+            extent->length > request->length - total)
+        {
+            return 0;
+        }
+
+        total += extent->length;
+    }
+
+    return total == request->length;
+}
+
+#endif // _AIMPROXY_H_
@@ -209,8 +209,10 @@ typedef struct _IMSCSI_DEVICE_CONFIGURATION
     /// Bytes per sector
     ULONG           BytesPerSector;
 
-    /// Not used
-    ULONG           Reserved;
+    /// Number of worker threads serving requests for the device. Zero on
+    /// create selects driver default. Ignored for device types that do not
+    /// use worker threads.
+    ULONG           WorkerThreads;
 
     /// The byte offset in image file where the virtual disk data begins.
     LARGE_INTEGER   ImageOffset;
@@ -227,6 +229,54 @@ typedef struct _IMSCSI_DEVICE_CONFIGURATION
 } IMSCSI_DEVICE_CONFIGURATION, *PIMSCSI_DEVICE_CONFIGURATION;
 #pragma pack(pop)
 
+///
+/// Performance counters for a virtual disk, returned by
+/// SMP_IMSCSI_QUERY_STATISTICS. New counters are only added at the end, so
+/// callers with an older, shorter, version of this structure still get the
+/// counters they know about.
+///
+typedef struct _IMSCSI_DEVICE_STATISTICS
+{
+    /// Number of read and write requests served by worker threads.
+    LONGLONG        ReadRequests;
+    LONGLONG        WriteRequests;
+
+    /// Bytes transferred by read and write requests served by worker
+    /// threads.
+    LONGLONG        BytesRead;
+    LONGLONG        BytesWritten;
+
+    /// Number of intermediate buffers allocated for read and write requests.
+    LONGLONG        BounceBufferAllocations;
+
+    /// Bytes copied between request buffers and intermediate buffers.
+    LONGLONG        BounceBytesCopied;
+
+    /// Bytes copied between driver buffers and proxy communication buffers,
+    /// such as shared memory.
+    LONGLONG        ProxyBytesCopied;
+
+    /// Read requests completed from read cache without reading image, and
+    /// read requests that had to read image.
+    LONGLONG        ReadCacheHits;
+    LONGLONG        ReadCacheMisses;
+
+    /// Read cache entries dropped to make room for new ones.
+    LONGLONG        ReadCacheEvictions;
+
+    /// Intermediate buffers taken from the driver's buffer pool, and
+    /// buffers that had to be allocated from system pool instead.
+    LONGLONG        BufferPoolHits;
+    LONGLONG        BufferPoolFallbacks;
+
+    /// Bytes of write requests that were all zero, or zero runs within
+    /// them, sent to image as zero ranges instead of being written, and
+    /// number of write requests split into zero ranges and data writes.
+    LONGLONG        ZeroBytesSaved;
+    LONGLONG        ZeroRunSplitWrites;
+
+} IMSCSI_DEVICE_STATISTICS, *PIMSCSI_DEVICE_STATISTICS;
+
 #ifdef _NTDDSCSIH_
 
 ///
@@ -322,6 +372,20 @@ typedef struct {
 
 } SRB_IMSCSI_EXTEND_DEVICE, *PSRB_IMSCSI_EXTEND_DEVICE;
 
+///
+/// Structure used with SMP_IMSCSI_QUERY_STATISTICS.
+///
+typedef struct _SRB_IMSCSI_QUERY_STATISTICS
+{
+    /// SRB_IO_CONTROL header
+    SRB_IO_CONTROL              SrbIoControl;
+
+    DEVICE_NUMBER               DeviceNumber;
+
+    IMSCSI_DEVICE_STATISTICS    Statistics;
+
+} SRB_IMSCSI_QUERY_STATISTICS, *PSRB_IMSCSI_QUERY_STATISTICS;
+
 typedef struct {
     /// SRB_IO_CONTROL header
     SRB_IO_CONTROL  SrbIoControl;
@@ -375,6 +439,7 @@ ULONG Timeout)
 #define SMP_IMSCSI_SET_DEVICE_FLAGS     ((ULONG) (SMP_IMSCSI | 0x805))
 #define SMP_IMSCSI_REMOVE_DEVICE        ((ULONG) (SMP_IMSCSI | 0x806))
 #define SMP_IMSCSI_EXTEND_DEVICE        ((ULONG) (SMP_IMSCSI | 0x807))
+#define SMP_IMSCSI_QUERY_STATISTICS     ((ULONG) (SMP_IMSCSI | 0x808))
 
 #define IMSCSI_API_NO_BROADCAST_NOTIFY  0x00000001
 #define IMSCSI_API_FORCE_DISMOUNT       0x00000002
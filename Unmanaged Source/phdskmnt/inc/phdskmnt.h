@@ -80,6 +80,7 @@ extern "C" {
 
 #include "common.h"
 #include "imdproxy.h"
+#include "aimproxy.h"
 #include "phdskmntver.h"
 
 #if !defined(_MP_User_Mode_Only)                      // User-mode only.
@@ -91,6 +92,8 @@ extern "C" {
 
 #endif // !defined(_MP_H_skip_includes)
 
+#include "zeroscan.h"
+
 #define VENDOR_ID                   L"Arsenal"
 #define VENDOR_ID_ascii             "Arsenal"
 #define PRODUCT_ID                  L"Virtual"
@@ -102,6 +105,19 @@ extern "C" {
 #define MAX_TARGETS                 8
 #define MAX_LUNS                    24
 #define MP_MAX_TRANSFER_SIZE        (32 * 1024)
+#define MAX_ADDITIONAL_WORKER_THREADS   (IMDPROXY_SHM_RING_MAX_SLOTS - 1)
+#define IMSCSI_SHM_RING_MIN_SLOT_DATA_SIZE  (256 * 1024)
+#define IMSCSI_TAGGED_PROXY_MAX_OUTSTANDING 8
+#define IMSCSI_VECTORED_MAX_LENGTH          (4 * 1024 * 1024)
+#define IMSCSI_READ_CACHE_MAX_ENTRIES       512
+#define IMSCSI_READ_CACHE_MIN_ENTRIES       4       // Largest cached transfer is this part of cache size
+#define IMSCSI_MAX_ASYNC_QUEUE_DEPTH        256
+#define IMSCSI_BUFFER_POOL_MIN_SHIFT        12      // Smallest pooled buffer, 4 KB
+#define IMSCSI_BUFFER_POOL_CLASSES          12      // Power of two size classes, 4 KB to 8 MB
+#define IMSCSI_BUFFER_POOL_MAX_MAGAZINES    64
+#define IMSCSI_BUFFER_POOL_MAGAZINE_SIZE    8       // Buffers of each size class in each per-CPU magazine
+#define IMSCSI_BUFFER_POOL_MAGAZINE_BYTES   (512 * 1024)    // Limits magazine size for large classes
+#define IMSCSI_BUFFER_POOL_MAX_DEPOT_DEPTH  64
 #define TIME_INTERVAL               (1 * 1000 * 1000) //1 second.
 #define DEVLIST_BUFFER_SIZE         1024
 #define DEVICE_NOT_FOUND            0xFF
@@ -121,6 +137,11 @@ extern "C" {
 #define DEFAULT_DEBUG_LEVEL         2               
 #define DEFAULT_INITIATOR_ID        7
 #define DEFAULT_NUMBER_OF_BUSES     1
+#define DEFAULT_WORKER_THREADS      0               // Zero lets driver select number of worker threads
+#define DEFAULT_READ_CACHE_SIZE     (8 * 1024 * 1024)
+#define DEFAULT_ASYNC_QUEUE_DEPTH   16              // Zero to serve queued I/O image files synchronously
+#define DEFAULT_BUFFER_POOL_SIZE    (4 * 1024 * 1024)
+#define DEFAULT_ZERO_RUN_GRANULARITY (64 * 1024)    // Zero to only deallocate writes that are all zero
 
 #define GET_FLAG(Flags, Bit)        ((Flags) & (Bit))
 #define SET_FLAG(Flags, Bit)        ((Flags) |= (Bit))
@@ -128,6 +149,10 @@ extern "C" {
 
 #ifndef SCSIOP_UNMAP
 #define SCSIOP_UNMAP 0x42
+#endif
+
+#ifndef DECLSPEC_CACHEALIGN
+#define DECLSPEC_CACHEALIGN DECLSPEC_ALIGN(64)
 #endif
 
     typedef struct _MPDriverInfo         MPDriverInfo, *pMPDriverInfo;
@@ -147,8 +172,33 @@ extern "C" {
         UNICODE_STRING   ProductRevision;
         ULONG            NumberOfBuses;       // Number of buses (paths) supported by this adapter
         ULONG            InitiatorID;        // Adapter's target ID
+        ULONG            ReadCacheSize;      // Bytes of read cache for each LU, zero to disable
+        ULONG            WorkerThreads;      // Worker threads for each LU unless set at create time
+        ULONG            AsyncQueueDepth;    // Outstanding image file requests for each queued I/O LU
+        ULONG            BufferPoolSize;     // Bytes of free buffers kept in each size class, zero to disable
+        ULONG            ZeroRunGranularity; // Block size of zero runs deallocated within writes, zero to disable
     } MP_REG_INFO, *pMP_REG_INFO;
 
+    typedef struct DECLSPEC_CACHEALIGN _IMSCSI_BUFFER_MAGAZINE  // Free buffers kept for one CPU
+    {
+        KSPIN_LOCK Lock;
+        UCHAR Count[IMSCSI_BUFFER_POOL_CLASSES];
+        PVOID Buffers[IMSCSI_BUFFER_POOL_CLASSES][IMSCSI_BUFFER_POOL_MAGAZINE_SIZE];
+    } IMSCSI_BUFFER_MAGAZINE, *PIMSCSI_BUFFER_MAGAZINE;
+
+    typedef struct _IMSCSI_BUFFER_POOL          // Size classed intermediate buffers, see bufpool.cpp
+    {
+        PIMSCSI_BUFFER_MAGAZINE Magazines;  // NULL if pool disabled
+        ULONG MagazineCount;
+        ULONG MagazineDepth[IMSCSI_BUFFER_POOL_CLASSES];
+        ULONG DepotDepth[IMSCSI_BUFFER_POOL_CLASSES];
+        ULONG DepotCount[IMSCSI_BUFFER_POOL_CLASSES];
+        KSPIN_LOCK DepotLock[IMSCSI_BUFFER_POOL_CLASSES];
+        PVOID Depot[IMSCSI_BUFFER_POOL_CLASSES][IMSCSI_BUFFER_POOL_MAX_DEPOT_DEPTH];
+        volatile LONGLONG Hits;
+        volatile LONGLONG Fallbacks;
+    } IMSCSI_BUFFER_POOL, *PIMSCSI_BUFFER_POOL;
+
     typedef struct _MPDriverInfo {                        // The master miniport object. In effect, an extension of the driver object for the miniport.
         MP_REG_INFO                    MPRegInfo;
         KSPIN_LOCK                     DrvInfoLock;
@@ -161,6 +211,8 @@ extern "C" {
         LIST_ENTRY                     RequestList;
         KSPIN_LOCK                     RequestListLock;
         KEVENT                         RequestEvent;
+        NPAGED_LOOKASIDE_LIST          WorkItemLookaside; // MP_WorkRtnParms for all adapters
+        IMSCSI_BUFFER_POOL             BufferPool;
 #ifdef USE_SCSIPORT
         PDEVICE_OBJECT                 ControllerObject;
         LIST_ENTRY                     ResponseList;
@@ -202,6 +254,46 @@ extern "C" {
 
 #define LU_DEVICE_INITIALIZED   0x0001
 
+    typedef struct _PROXY_SHM_RING              // Client state for multi-slot shared memory layout
+    {
+        ULONG slot_count;
+        ULONG_PTR slot_size;
+        volatile LONG free_slots;                 // Bit set for each slot not owned by any caller
+        volatile LONG abandoned_slots;            // Bit set for slots left by cancelled callers
+        KSEMAPHORE slots_available;
+        KEVENT slot_completed[IMDPROXY_SHM_RING_MAX_SLOTS];
+    } PROXY_SHM_RING, *PPROXY_SHM_RING;
+
+#define PROXY_TAGGED_REQUEST_FREE       0
+#define PROXY_TAGGED_REQUEST_PENDING    1   // Sent, or being sent, waiting for response
+#define PROXY_TAGGED_REQUEST_RECEIVING  2   // Response being read by a receiving thread
+#define PROXY_TAGGED_REQUEST_COMPLETE   3   // Response, or failure status, available
+#define PROXY_TAGGED_REQUEST_ABANDONED  4   // Caller cancelled, response to be discarded
+
+    typedef struct _PROXY_TAGGED_REQUEST
+    {
+        volatile LONG state;                // PROXY_TAGGED_REQUEST_xxx
+        ULONGLONG tag;
+        PVOID response_data;                // Read buffer, NULL for writes
+        ULONG response_data_buffer_size;
+        IMDPROXY_TAGGED_RESP response;
+        NTSTATUS status;
+        KEVENT completed;
+    } PROXY_TAGGED_REQUEST, *PPROXY_TAGGED_REQUEST;
+
+    typedef struct _PROXY_TAGGED                // Client state for pipelined tagged requests on stream connections
+    {
+        ULONG max_outstanding;
+        volatile LONG free_slots;               // Bit set for each request entry not owned by any caller
+        volatile LONG failed;                   // Stream out of sync, all requests fail
+        volatile LONGLONG sequence;
+        KSEMAPHORE slots_available;
+        KEVENT send_lock;                       // Auto reset events used as locks that can be
+        KEVENT receive_lock;                    // waited for together with a cancel event
+        KEVENT untagged_lock;
+        PROXY_TAGGED_REQUEST requests[IMSCSI_TAGGED_PROXY_MAX_OUTSTANDING];
+    } PROXY_TAGGED, *PPROXY_TAGGED;
+
     typedef struct _PROXY_CONNECTION
     {
         enum PROXY_CONNECTION_TYPE
@@ -213,7 +305,11 @@ extern "C" {
         union
         {
             // Valid if connection_type is PROXY_CONNECTION_DEVICE
-            PFILE_OBJECT device;     // Pointer to proxy communication object
+            struct
+            {
+                PFILE_OBJECT device;        // Pointer to proxy communication object
+                PPROXY_TAGGED tagged;       // NULL if server does not support tagged requests
+            };
 
                                      // Valid if connection_type is PROXY_CONNECTION_SHM
             struct
@@ -224,10 +320,33 @@ extern "C" {
                 PKEVENT response_event;
                 PUCHAR shared_memory;
                 ULONG_PTR shared_memory_size;
+                PPROXY_SHM_RING shm_ring;   // NULL if single mailbox layout
             };
         };
+
+        volatile LONGLONG bytes_copied;     // Request and response data copied to or from communication buffers
     } PROXY_CONNECTION, *PPROXY_CONNECTION;
 
+    typedef struct _IMSCSI_READ_CACHE_ENTRY
+    {
+        LONGLONG StartSector;
+        ULONG Length;                       // Bytes
+        BOOLEAN Referenced;                 // Hit since clock hand passed last time
+        PUCHAR Buffer;
+    } IMSCSI_READ_CACHE_ENTRY, *PIMSCSI_READ_CACHE_ENTRY;
+
+    typedef struct _IMSCSI_READ_CACHE           // Recently transferred sector ranges, see readcache.cpp
+    {
+        KSPIN_LOCK Lock;
+        PIMSCSI_READ_CACHE_ENTRY Entries;   // Sorted by StartSector, non-overlapping. NULL if cache disabled.
+        ULONG Count;
+        ULONG Hand;                         // CLOCK eviction position in Entries
+        ULONG Size;                         // Bytes in all entries
+        ULONG MaxSize;
+        ULONG MaxEntrySize;
+        volatile LONG Sequence;             // Incremented when cached data is invalidated
+    } IMSCSI_READ_CACHE, *PIMSCSI_READ_CACHE;
+
     typedef struct _HW_LU_EXTENSION {                     // LUN extension allocated by port driver.
         LIST_ENTRY            List;                       // Pointers to next and previous HW_LU_EXTENSION objects, used in HW_HBA_EXT.
         pHW_HBA_EXT           pHBAExt;
@@ -236,6 +355,10 @@ extern "C" {
         KEVENT                RequestEvent;
         KEVENT                Initialized;
         PKTHREAD              WorkerThread;
+        HANDLE                AdditionalWorkerThreads[MAX_ADDITIONAL_WORKER_THREADS]; // Kernel handles, waited for before closed
+        ULONG                 NumberOfAdditionalWorkerThreads;
+        LIST_ENTRY            InFlightList;               // Read and write requests taken by worker threads, in dequeue order
+        BOOLEAN               TrackInFlight;              // Several worker threads, keep overlapping requests in order
         KEVENT                StopThread;
         LARGE_INTEGER         ImageOffset;
         LARGE_INTEGER         DiskSize;
@@ -246,10 +369,7 @@ extern "C" {
         BOOLEAN               ReadOnly;
         ULONG                 FakeDiskSignature;
         UCHAR                 LastReportedEvent;
-        PVOID                 LastIoBuffer;
-        LONGLONG              LastIoStartSector;
-        ULONG                 LastIoLength;
-        KSPIN_LOCK            LastIoLock;
+        IMSCSI_READ_CACHE     ReadCache;
         DEVICE_NUMBER         DeviceNumber;
         UNICODE_STRING        ObjectName;
         HANDLE                ImageFile;
@@ -266,11 +386,17 @@ extern "C" {
         BOOLEAN               Modified;
         BOOLEAN               SupportsUnmap;
         BOOLEAN               SupportsZero;
+        ULONG                 ZeroRunGranularity;         // Non-zero if zero runs in writes are sent to image as zero ranges
+        BOOLEAN               SupportsVectored;           // Proxy accepts IMDPROXY_REQ_READV/WRITEV
         BOOLEAN               NoFileLevelTrim;
         PUCHAR                ImageBuffer;
         BOOLEAN               UseProxy;
         PFILE_OBJECT          FileObject;
+        PFILE_OBJECT          WorkerFileObject;           // Queued I/O image file served by several worker threads or asynchronously
+        ULONG                 AsyncQueueDepth;            // Non-zero if read and write requests are sent to WorkerFileObject asynchronously
+        KSEMAPHORE            AsyncRequestSemaphore;      // Signalled while fewer than AsyncQueueDepth requests are outstanding
         UCHAR                 UniqueId[16];
+        IMSCSI_DEVICE_STATISTICS Statistics;
     } HW_LU_EXTENSION, *pHW_LU_EXTENSION;
 
     typedef struct _HW_SRB_EXTENSION {
@@ -290,8 +416,16 @@ extern "C" {
         KIRQL                LowestAssumedIrql;
         PVOID                MappedSystemBuffer;
         PVOID                AllocatedBuffer;
+        ULONG                AllocatedBufferSize;
         BOOLEAN              CopyBack;
+        LONG                 ReadCacheSequence;
         PKEVENT              CallerWaitEvent;
+        LIST_ENTRY           InFlightListEntry;
+        LONGLONG             FirstSector;
+        LONGLONG             EndSector;                 // First sector after request
+        BOOLEAN              IsWrite;
+        BOOLEAN              InFlight;
+        ULONG                Blockers;                  // Earlier overlapping requests still in flight
     } MP_WorkRtnParms, *pMP_WorkRtnParms;
 
     typedef enum ResultType {
@@ -767,6 +901,48 @@ extern "C" {
     KSTART_ROUTINE
         ImScsiWorkerThread;
 
+    KSTART_ROUTINE
+        ImScsiAdditionalWorkerThread;
+
+    VOID
+        ImScsiStartAdditionalWorkerThreads(
+            __inout __deref pHW_LU_EXTENSION pLUExt,
+            __in ULONG NumberOfThreads
+            );
+
+    PLIST_ENTRY
+        ImScsiRemoveNextLURequest(
+            __in pHW_LU_EXTENSION pLUExt
+            );
+
+    VOID
+        ImScsiCompleteInFlightRequest(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in pMP_WorkRtnParms pWkRtnParms
+            );
+
+    BOOLEAN
+        ImScsiDispatchCoalescedReadWrite(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in pMP_WorkRtnParms pWkRtnParms
+            );
+
+    BOOLEAN
+        ImScsiDispatchAsyncReadWrite(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in pMP_WorkRtnParms pWkRtnParms
+            );
+
+    VOID
+        ImScsiWaitForAsyncRequests(
+            __in pHW_LU_EXTENSION pLUExt
+            );
+
+    VOID
+        ImScsiStopAdditionalWorkerThreads(
+            __inout __deref pHW_LU_EXTENSION pLUExt
+            );
+
     VOID
         ImScsiCreateLU(
             __in pHW_HBA_EXT             pHBAExt,
@@ -804,6 +980,14 @@ extern "C" {
             __inout __deref PKIRQL              LowestAssumedIrql
             );
 
+    NTSTATUS
+        ImScsiQueryStatistics(
+            __in pHW_HBA_EXT                     pHBAExt,
+            __inout __deref PSRB_IMSCSI_QUERY_STATISTICS query_data,
+            __inout __deref PULONG               Length,
+            __inout __deref PKIRQL               LowestAssumedIrql
+            );
+
     NTSTATUS
         ImScsiQueryAdapter(
             __in pHW_HBA_EXT                     pDevExt,
@@ -871,6 +1055,16 @@ extern "C" {
             __out __deref PIMDPROXY_INFO_RESP ProxyInfoResponse,
             __in ULONG ProxyInfoResponseLength);
 
+    NTSTATUS
+        ImScsiSetupShmRingProxy(__inout __deref PPROXY_CONNECTION Proxy,
+            __out __deref PIO_STATUS_BLOCK IoStatusBlock,
+            __in __deref PKEVENT CancelEvent OPTIONAL,
+            __in ULONG SlotCount);
+
+    NTSTATUS
+        ImScsiSetupTaggedProxy(__inout __deref PPROXY_CONNECTION Proxy,
+            __in ULONG MaxOutstanding);
+
     NTSTATUS
         ImScsiReadProxy(__in __deref PPROXY_CONNECTION Proxy,
             __out __deref PIO_STATUS_BLOCK IoStatusBlock,
@@ -887,6 +1081,13 @@ extern "C" {
             __in ULONG Length,
             __in __deref PLARGE_INTEGER ByteOffset);
 
+    NTSTATUS
+        ImScsiVectoredProxy(__in __deref PPROXY_CONNECTION Proxy,
+            __out __deref PIO_STATUS_BLOCK IoStatusBlock,
+            __in __deref PKEVENT CancelEvent,
+            __in __deref PIMDPROXY_VECTORED_REQ Request,
+            PVOID Buffer);
+
     IMDPROXY_SHARED_RESP_CODE
         ImScsiSharedKeyProxy(__in __deref pHW_LU_EXTENSION LuExt,
             __in __deref PIMDPROXY_SHARED_REQ Request,
@@ -922,6 +1123,107 @@ extern "C" {
             __in PULONG           Length
             );
 
+    /// TRUE if ImScsiWriteDevice would send all or part of a write request
+    /// to image as zero ranges.
+    BOOLEAN
+        ImScsiIsWriteZeroRange(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in PVOID            Buffer,
+            __in PLARGE_INTEGER   ByteOffset,
+            __in ULONG            Length
+            );
+
+    /// Sends a read or write request to a file object without waiting for
+    /// it. CompletionRoutine is called for the request and frees the IRP,
+    /// unless an error is returned, in which case no request was sent.
+    NTSTATUS
+        ImScsiStartReadWriteFileObject(
+            __in PFILE_OBJECT     FileObject,
+            __in UCHAR            MajorFunction,
+            PVOID                 Buffer,
+            __in ULONG            Length,
+            __in PLARGE_INTEGER   ByteOffset,
+            __in PIO_COMPLETION_ROUTINE CompletionRoutine,
+            __in PVOID            Context
+            );
+
+    VOID
+        ImScsiInitializeBufferPool(
+            );
+
+    VOID
+        ImScsiFreeBufferPool(
+            );
+
+    /// Returns a non-paged buffer of at least Size bytes, from buffer pool
+    /// if one of suitable size is free. Counts pool hits and fallbacks to
+    /// system pool in Statistics, if not NULL.
+    PVOID
+        ImScsiAllocateBuffer(
+            __in ULONG Size,
+            __inout_opt PIMSCSI_DEVICE_STATISTICS Statistics
+            );
+
+    /// Returns a buffer from ImScsiAllocateBuffer to buffer pool. Size can
+    /// be smaller than requested at allocation, but not larger.
+    VOID
+        ImScsiFreeBuffer(
+            __in PVOID Buffer,
+            __in ULONG Size
+            );
+
+    VOID
+        ImScsiInitializeReadCache(
+            __inout __deref pHW_LU_EXTENSION pLUExt
+            );
+
+    VOID
+        ImScsiFreeReadCache(
+            __inout __deref pHW_LU_EXTENSION pLUExt
+            );
+
+    /// Copies Length bytes at StartSector to Buffer if all of them are in
+    /// read cache. Returns FALSE if some of them are not.
+    BOOLEAN
+        ImScsiReadCacheLookup(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in LONGLONG StartSector,
+            PVOID Buffer,
+            __in ULONG Length,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    /// Hands over an ImScsiAllocateBuffer buffer with data transferred at
+    /// StartSector to read cache. Sequence is the value returned by
+    /// ImScsiReadCacheSequence before the transfer started, read data is
+    /// dropped if anything has been invalidated since then. Written data
+    /// also invalidates overlapping data already in cache.
+    VOID
+        ImScsiReadCacheInsert(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in LONGLONG StartSector,
+            PVOID Buffer,
+            __in ULONG Length,
+            __in LONG Sequence,
+            __in BOOLEAN IsWrite,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    VOID
+        ImScsiReadCacheInvalidate(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in LONGLONG StartSector,
+            __in ULONGLONG NumberOfSectors,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    FORCEINLINE
+        LONG
+        ImScsiReadCacheSequence(__in pHW_LU_EXTENSION pLUExt)
+    {
+        return pLUExt->ReadCache.Sequence;
+    }
+
     VOID
         ImScsiDispatchUnmapDevice(
             __in pHW_HBA_EXT pHBAExt,
@@ -981,20 +1283,38 @@ extern "C" {
     VOID ImScsiScheduleWorkItem(pMP_WorkRtnParms pWkRtnParms,
         PKIRQL LowestAssumedIrql);
 
+    /// Selects SSE2 or AVX2 zero detection where processor supports it
+    VOID
+        ImScsiInitializeZeroScan(
+            );
+
+    /// Returns offset of first nonzero byte in Buffer, or Length if all of
+    /// it is zero. Has PIMSCSI_FIND_NONZERO signature, so that it can be
+    /// used with ImScsiFindZeroRun to find zero runs in partly zero writes.
+    size_t
+        ImScsiFindNonZero(
+            const void *Buffer,
+            size_t Length
+            );
+
     FORCEINLINE
         BOOLEAN
         ImScsiIsBufferZero(PVOID Buffer, ULONG Length)
     {
-        PULONGLONG ptr;
-
-        if (Length < sizeof(ULONGLONG))
-            return FALSE;
-
-        for (ptr = (PULONGLONG)Buffer;
-        (ptr <= (PULONGLONG)((PUCHAR)Buffer + Length - sizeof(ULONGLONG))) &&
-            (*ptr == 0); ptr++);
+        return (BOOLEAN)((Length != 0) &&
+            (ImScsiFindNonZero(Buffer, Length) == Length));
+    }
 
-            return (BOOLEAN)(ptr == (PULONGLONG)((PUCHAR)Buffer + Length));
+    /// Size of data area available for each request through a shared
+    /// memory proxy connection.
+    FORCEINLINE
+        ULONG_PTR
+        ImScsiGetShmProxyDataSize(__in __deref PPROXY_CONNECTION Proxy)
+    {
+        if (Proxy->shm_ring != NULL)
+            return Proxy->shm_ring->slot_size - IMDPROXY_HEADER_SIZE;
+        else
+            return Proxy->shared_memory_size - IMDPROXY_HEADER_SIZE;
     }
 
 #if DBG
@@ -0,0 +1,219 @@
+/// zeroscan.h
+/// Zero detection for write requests. Finds first nonzero byte of a buffer
+/// with scalar, SSE2 or AVX2 code, and runs of zero blocks within a buffer.
+/// Only depends on compiler intrinsics, so that it is shared by the driver,
+/// which selects implementation at load time in zeroscan.cpp, and the
+/// Linux microbenchmark in devioserver/zerobench.cpp.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _ZEROSCAN_H_
+#define _ZEROSCAN_H_
+
+#include <stddef.h>
+
+#define IMSCSI_ZERO_SCAN_SCALAR             0
+#define IMSCSI_ZERO_SCAN_SSE2               1
+#define IMSCSI_ZERO_SCAN_AVX2               2
+
+/// Buffers shorter than this are not worth saving AVX state for in kernel
+/// mode, they are scanned with SSE2.
+#define IMSCSI_ZERO_SCAN_AVX2_MIN_LENGTH    (64 << 10)
+
+// 32 bit x86 driver is built without SSE instructions, see
+// vs2013_sse.props, and would need to save floating point state for
+// them, so it uses scalar code only.
+#if defined(_M_AMD64) || defined(__x86_64__)
+#define IMSCSI_ZERO_SCAN_HAS_SSE2           1
+#include <emmintrin.h>
+#if (defined(_MSC_VER) && _MSC_VER >= 1700) || defined(__GNUC__)
+#define IMSCSI_ZERO_SCAN_HAS_AVX2           1
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef __GNUC__
+#define IMSCSI_ZERO_SCAN_INLINE             static inline
+#define IMSCSI_ZERO_SCAN_TARGET_AVX2        __attribute__((target("avx2")))
+typedef unsigned long long __attribute__((may_alias)) IMSCSI_ZERO_SCAN_WORD;
+#else
+#define IMSCSI_ZERO_SCAN_INLINE             static __inline
+#define IMSCSI_ZERO_SCAN_TARGET_AVX2
+typedef unsigned long long IMSCSI_ZERO_SCAN_WORD;
+#endif
+
+/// Returns offset of first nonzero byte in Buffer, or Length if all of it
+/// is zero
+typedef size_t (*PIMSCSI_FIND_NONZERO)(const void *Buffer, size_t Length);
+
+/// Scans one 64 bit word at a time, after bytes up to first 8 byte
+/// boundary
+IMSCSI_ZERO_SCAN_INLINE
+size_t
+ImScsiFindNonZeroScalar(const void *Buffer, size_t Length)
+{
+    const unsigned char *ptr = (const unsigned char *)Buffer;
+    size_t offset = 0;
+
+    while (offset < Length && ((size_t)(ptr + offset) & 7) != 0)
+    {
+        if (ptr[offset] != 0)
+        {
+            return offset;
+        }
+
+        offset++;
+    }
+
+    while (offset + 8 <= Length &&
+        *(const IMSCSI_ZERO_SCAN_WORD *)(ptr + offset) == 0)
+    {
+        offset += 8;
+    }
+
+    while (offset < Length && ptr[offset] == 0)
+    {
+        offset++;
+    }
+
+    return offset;
+}
+
+#ifdef IMSCSI_ZERO_SCAN_HAS_SSE2
+
+/// Tests 64 bytes per iteration. Exact position of first nonzero byte is
+/// then found by scalar code within those 64 bytes.
+IMSCSI_ZERO_SCAN_INLINE
+size_t
+ImScsiFindNonZeroSse2(const void *Buffer, size_t Length)
+{
+    const unsigned char *ptr = (const unsigned char *)Buffer;
+    const __m128i zero = _mm_setzero_si128();
+    size_t offset = 0;
+
+    while (offset + 64 <= Length)
+    {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(
+                _mm_loadu_si128((const __m128i *)(ptr + offset)),
+                _mm_loadu_si128((const __m128i *)(ptr + offset + 16))),
+            _mm_or_si128(
+                _mm_loadu_si128((const __m128i *)(ptr + offset + 32)),
+                _mm_loadu_si128((const __m128i *)(ptr + offset + 48))));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+        {
+            break;
+        }
+
+        offset += 64;
+    }
+
+    return offset + ImScsiFindNonZeroScalar(ptr + offset, Length - offset);
+}
+
+#endif
+
+#ifdef IMSCSI_ZERO_SCAN_HAS_AVX2
+
+/// Tests 128 bytes per iteration. Caller checks that processor and OS
+/// support AVX2, and in kernel mode saves AVX state around the call.
+IMSCSI_ZERO_SCAN_TARGET_AVX2
+IMSCSI_ZERO_SCAN_INLINE
+size_t
+ImScsiFindNonZeroAvx2(const void *Buffer, size_t Length)
+{
+    const unsigned char *ptr = (const unsigned char *)Buffer;
+    size_t offset = 0;
+
+    while (offset + 128 <= Length)
+    {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_loadu_si256((const __m256i *)(ptr + offset)),
+                _mm256_loadu_si256((const __m256i *)(ptr + offset + 32))),
+            _mm256_or_si256(
+                _mm256_loadu_si256((const __m256i *)(ptr + offset + 64)),
+                _mm256_loadu_si256((const __m256i *)(ptr + offset + 96))));
+
+        if (!_mm256_testz_si256(v, v))
+        {
+            break;
+        }
+
+        offset += 128;
+    }
+
+    // Avoids AVX to SSE transition penalty in code that follows
+    _mm256_zeroupper();
+
+    return offset + ImScsiFindNonZeroScalar(ptr + offset, Length - offset);
+}
+
+#endif
+
+/// Finds first run of whole zero blocks at or after offset Start in Buffer.
+/// Blocks are Granularity bytes, and the first block boundary in Buffer is
+/// at offset FirstBoundary, so that blocks can be aligned to device
+/// offsets rather than to start of buffer. Partial blocks at start and end
+/// of Buffer are never part of a run. Returns nonzero and sets RunStart
+/// and RunLength if a run was found.
+///
+/// Each block is scanned at most once, and blocks with data only up to
+/// their first nonzero byte.
+IMSCSI_ZERO_SCAN_INLINE
+int
+ImScsiFindZeroRun(PIMSCSI_FIND_NONZERO FindNonZero,
+    const void *Buffer,
+    size_t Length,
+    size_t Start,
+    size_t FirstBoundary,
+    size_t Granularity,
+    size_t *RunStart,
+    size_t *RunLength)
+{
+    const unsigned char *ptr = (const unsigned char *)Buffer;
+    size_t block = FirstBoundary;
+
+    if (Granularity == 0)
+    {
+        return 0;
+    }
+
+    if (block < Start)
+    {
+        block += (Start - block + Granularity - 1) / Granularity * Granularity;
+    }
+
+    while (block < Length && Length - block >= Granularity)
+    {
+        if (FindNonZero(ptr + block, Granularity) == Granularity)
+        {
+            size_t end = block + Granularity;
+
+            while (Length - end >= Granularity &&
+                FindNonZero(ptr + end, Granularity) == Granularity)
+            {
+                end += Granularity;
+            }
+
+            *RunStart = block;
+            *RunLength = end - block;
+
+            return 1;
+        }
+
+        block += Granularity;
+    }
+
+    return 0;
+}
+
+#endif // _ZEROSCAN_H_
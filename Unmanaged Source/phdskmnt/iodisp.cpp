@@ -50,8 +50,8 @@ __inout __deref PKIRQL         LowestAssumedIrql
         pLUExt->DeviceNumber.Lun,
         pLUExt));
 
-    free_worker_params = (pMP_WorkRtnParms)ExAllocatePoolWithTag(
-        NonPagedPool, sizeof(MP_WorkRtnParms), MP_TAG_GENERAL);
+    free_worker_params = (pMP_WorkRtnParms)ExAllocateFromNPagedLookasideList(
+        &pMPDrvInfoGlobal->WorkItemLookaside);
 
     if (free_worker_params == NULL)
     {
@@ -128,11 +128,7 @@ __inout __deref PKIRQL         LowestAssumedIrql
         ImScsiCloseProxy(&pLUExt->Proxy);
     }
 
-    if (pLUExt->LastIoBuffer != NULL)
-    {
-        ExFreePoolWithTag(pLUExt->LastIoBuffer, MP_TAG_GENERAL);
-        pLUExt->LastIoBuffer = NULL;
-    }
+    ImScsiFreeReadCache(pLUExt);
 
     if (pLUExt->VMDisk)
     {
@@ -154,6 +150,12 @@ __inout __deref PKIRQL         LowestAssumedIrql
             pLUExt->FileObject = NULL;
         }
 
+        if (pLUExt->WorkerFileObject != NULL)
+        {
+            ObDereferenceObject(pLUExt->WorkerFileObject);
+            pLUExt->WorkerFileObject = NULL;
+        }
+
         if (pLUExt->ImageFile != NULL)
         {
             ZwClose(pLUExt->ImageFile);
@@ -215,6 +217,7 @@ PVOID Context)
     pMP_WorkRtnParms pWkRtnParms = (pMP_WorkRtnParms)Context;
     PKTHREAD thread = NULL;
     KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    IO_STATUS_BLOCK io_status;
 
     UNREFERENCED_PARAMETER(DeviceObject);
 
@@ -301,6 +304,8 @@ PVOID Context)
         }
     }
 
+    io_status = Irp->IoStatus;
+
     if (Irp->MdlAddress != pWkRtnParms->pOriginalMdl)
     {
         ImScsiFreeIrpWithMdls(Irp);
@@ -310,11 +315,13 @@ PVOID Context)
         IoFreeIrp(Irp);
     }
 
-    if (pWkRtnParms->AllocatedBuffer != NULL)
+    if ((pWkRtnParms->AllocatedBuffer != NULL) ||
+        (pWkRtnParms->pLUExt->ReadCache.Entries != NULL))
     {
         PCDB pCdb = (PCDB)pWkRtnParms->pSrb->Cdb;
         LARGE_INTEGER startingSector;
-        KLOCK_QUEUE_HANDLE LockHandle;
+        BOOLEAN is_write = (pCdb->AsByte[0] == SCSIOP_WRITE) ||
+            (pCdb->AsByte[0] == SCSIOP_WRITE16);
 
         if ((pCdb->AsByte[0] == SCSIOP_READ16) ||
             (pCdb->AsByte[0] == SCSIOP_WRITE16))
@@ -323,6 +330,7 @@ PVOID Context)
         }
         else
         {
+            startingSector.QuadPart = 0;
             REVERSE_BYTES(&startingSector, &pCdb->CDB10.LogicalBlockByte0);
         }
 
@@ -336,21 +344,39 @@ PVOID Context)
             lowest_assumed_irql = pWkRtnParms->LowestAssumedIrql;
         }
 
-        ImScsiAcquireLock(&pWkRtnParms->pLUExt->LastIoLock, &LockHandle,
-            lowest_assumed_irql);
-
-        if (pWkRtnParms->pLUExt->LastIoBuffer != NULL)
+        if ((pWkRtnParms->AllocatedBuffer != NULL) &&
+            NT_SUCCESS(io_status.Status))
         {
-            ExFreePoolWithTag(pWkRtnParms->pLUExt->LastIoBuffer,
-                MP_TAG_GENERAL);
+            ImScsiReadCacheInsert(pWkRtnParms->pLUExt,
+                startingSector.QuadPart,
+                pWkRtnParms->AllocatedBuffer,
+                (ULONG)io_status.Information,
+                pWkRtnParms->ReadCacheSequence,
+                is_write,
+                &lowest_assumed_irql);
         }
+        else
+        {
+            if (pWkRtnParms->AllocatedBuffer != NULL)
+            {
+                ImScsiFreeBuffer(pWkRtnParms->AllocatedBuffer,
+                    pWkRtnParms->AllocatedBufferSize);
+            }
 
-        pWkRtnParms->pLUExt->LastIoStartSector = startingSector.QuadPart;
-        pWkRtnParms->pLUExt->LastIoLength =
-            pWkRtnParms->pSrb->DataTransferLength;
-        pWkRtnParms->pLUExt->LastIoBuffer = pWkRtnParms->AllocatedBuffer;
-
-        ImScsiReleaseLock(&LockHandle, &lowest_assumed_irql);
+            // Written directly from original MDL, or failed and may have
+            // changed some of the data. Length of failed requests is not
+            // known here any longer, so everything after start is dropped.
+            if (is_write)
+            {
+                ImScsiReadCacheInvalidate(pWkRtnParms->pLUExt,
+                    startingSector.QuadPart,
+                    NT_SUCCESS(io_status.Status) ?
+                    pWkRtnParms->pSrb->DataTransferLength >>
+                    pWkRtnParms->pLUExt->BlockPower :
+                    MAXLONGLONG,
+                    &lowest_assumed_irql);
+            }
+        }
     }
 
 #ifdef USE_SCSIPORT
@@ -368,7 +394,7 @@ PVOID Context)
         ScsiPortNotification(NextRequest, pWkRtnParms->pHBAExt);
         ScsiPortNotification(NextLuRequest, pWkRtnParms->pHBAExt, 0, 0, 0);
 
-        ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);
+        ExFreeToNPagedLookasideList(&pMPDrvInfoGlobal->WorkItemLookaside, pWkRtnParms);
     }
     else
     {
@@ -410,7 +436,7 @@ PVOID Context)
     KdPrint2(("PhDskMnt::ImScsiParallelReadWriteImageCompletion sending 'RequestComplete' to port StorPort.\n"));
     StorPortNotification(RequestComplete, pWkRtnParms->pHBAExt, pWkRtnParms->pSrb);
 
-    ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);
+    ExFreeToNPagedLookasideList(&pMPDrvInfoGlobal->WorkItemLookaside, pWkRtnParms);
 
 #endif
 
@@ -590,9 +616,12 @@ __inout __deref PKIRQL      LowestAssumedIrql
             return;
         }
 
+        pWkRtnParms->AllocatedBufferSize =
+            pWkRtnParms->pSrb->DataTransferLength;
+
         pWkRtnParms->AllocatedBuffer =
-            ExAllocatePoolWithTag(NonPagedPool,
-            pWkRtnParms->pSrb->DataTransferLength, MP_TAG_GENERAL);
+            ImScsiAllocateBuffer(pWkRtnParms->AllocatedBufferSize,
+            &pWkRtnParms->pLUExt->Statistics);
 
         if (pWkRtnParms->AllocatedBuffer == NULL)
         {
@@ -661,7 +690,8 @@ __inout __deref PKIRQL      LowestAssumedIrql
     {
         if (pWkRtnParms->AllocatedBuffer != NULL)
         {
-            ExFreePoolWithTag(pWkRtnParms->AllocatedBuffer, MP_TAG_GENERAL);
+            ImScsiFreeBuffer(pWkRtnParms->AllocatedBuffer,
+                pWkRtnParms->AllocatedBufferSize);
             pWkRtnParms->AllocatedBuffer = NULL;
         }
 
@@ -697,6 +727,7 @@ __inout __deref PKIRQL      LowestAssumedIrql
 
     pWkRtnParms->pReqThread = PsGetCurrentThread();
     pWkRtnParms->LowestAssumedIrql = *LowestAssumedIrql;
+    pWkRtnParms->ReadCacheSequence = ImScsiReadCacheSequence(pWkRtnParms->pLUExt);
 
     IoSetCompletionRoutine(lower_irp, ImScsiParallelReadWriteImageCompletion,
         pWkRtnParms, TRUE, TRUE, TRUE);
@@ -708,6 +739,162 @@ __inout __deref PKIRQL      LowestAssumedIrql
     return;
 }
 
+///
+/// Sends a read or write request directly to a file object and waits for
+/// it to complete. Unlike NtReadFile and NtWriteFile with a synchronous
+/// file handle, this lets several worker threads have requests in progress
+/// for the same image file at the same time.
+///
+static NTSTATUS
+ImScsiReadWriteFileObject(
+__in PFILE_OBJECT FileObject,
+__in UCHAR MajorFunction,
+__out __deref PIO_STATUS_BLOCK IoStatusBlock,
+PVOID Buffer,
+__in ULONG Length,
+__in PLARGE_INTEGER ByteOffset)
+{
+    PDEVICE_OBJECT device_object = IoGetRelatedDeviceObject(FileObject);
+    PIO_STACK_LOCATION io_stack;
+    KEVENT io_complete_event;
+    NTSTATUS status;
+    PIRP irp;
+
+    KeInitializeEvent(&io_complete_event, NotificationEvent, FALSE);
+
+#pragma warning(suppress: 6102)
+    irp = IoBuildSynchronousFsdRequest(MajorFunction,
+        device_object,
+        Buffer,
+        Length,
+        ByteOffset,
+        &io_complete_event,
+        IoStatusBlock);
+
+    if (irp == NULL)
+    {
+        KdPrint(("PhDskMnt::ImScsiReadWriteFileObject: Error building IRP.\n"));
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    io_stack = IoGetNextIrpStackLocation(irp);
+    io_stack->FileObject = FileObject;
+
+    // Same caching behaviour as requests through file handle
+    if (FileObject->Flags & FO_NO_INTERMEDIATE_BUFFERING)
+    {
+        irp->Flags |= IRP_NOCACHE;
+    }
+
+    if ((MajorFunction == IRP_MJ_WRITE) &&
+        (FileObject->Flags & FO_WRITE_THROUGH))
+    {
+        io_stack->Flags |= SL_WRITE_THROUGH;
+    }
+
+    status = IoCallDriver(device_object, irp);
+
+    if (status == STATUS_PENDING)
+    {
+        KeWaitForSingleObject(&io_complete_event,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
+
+        status = IoStatusBlock->Status;
+    }
+
+    return status;
+}
+
+NTSTATUS
+ImScsiStartReadWriteFileObject(
+__in PFILE_OBJECT FileObject,
+__in UCHAR MajorFunction,
+PVOID Buffer,
+__in ULONG Length,
+__in PLARGE_INTEGER ByteOffset,
+__in PIO_COMPLETION_ROUTINE CompletionRoutine,
+__in PVOID Context)
+{
+    PDEVICE_OBJECT device_object = IoGetRelatedDeviceObject(FileObject);
+    PIO_STACK_LOCATION io_stack;
+    PIRP irp;
+
+    if (device_object->Flags & DO_DIRECT_IO)
+    {
+        irp = IoBuildAsynchronousFsdRequest(MajorFunction,
+            device_object,
+            Buffer,
+            Length,
+            ByteOffset,
+            NULL);
+    }
+    else
+    {
+        irp = IoAllocateIrp(device_object->StackSize, FALSE);
+
+        if (irp != NULL)
+        {
+            io_stack = IoGetNextIrpStackLocation(irp);
+
+            io_stack->MajorFunction = MajorFunction;
+            io_stack->Parameters.Read.ByteOffset = *ByteOffset;
+            io_stack->Parameters.Read.Length = Length;
+
+            if (device_object->Flags & DO_BUFFERED_IO)
+            {
+                irp->AssociatedIrp.SystemBuffer = Buffer;
+            }
+            else
+            {
+                irp->UserBuffer = Buffer;
+            }
+        }
+    }
+
+    if (irp == NULL)
+    {
+        KdPrint(("PhDskMnt::ImScsiStartReadWriteFileObject: Error building IRP.\n"));
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Called from worker thread at PASSIVE_LEVEL, which lives until all
+    // requests it has sent are completed.
+    irp->Tail.Overlay.Thread = PsGetCurrentThread();
+
+    io_stack = IoGetNextIrpStackLocation(irp);
+    io_stack->FileObject = FileObject;
+
+    if (MajorFunction == IRP_MJ_READ)
+    {
+        irp->Flags |= IRP_READ_OPERATION;
+    }
+    else if (MajorFunction == IRP_MJ_WRITE)
+    {
+        irp->Flags |= IRP_WRITE_OPERATION;
+
+        if (FileObject->Flags & FO_WRITE_THROUGH)
+        {
+            io_stack->Flags |= SL_WRITE_THROUGH;
+        }
+    }
+
+    if (FileObject->Flags & FO_NO_INTERMEDIATE_BUFFERING)
+    {
+        irp->Flags |= IRP_NOCACHE;
+    }
+
+    IoSetCompletionRoutine(irp, CompletionRoutine, Context, TRUE, TRUE, TRUE);
+
+    IoCallDriver(device_object, irp);
+
+    return STATUS_PENDING;
+}
+
 NTSTATUS
 ImScsiReadDevice(
 __in pHW_LU_EXTENSION pLUExt,
@@ -750,6 +937,16 @@ __in PULONG           Length
             *Length,
             &byteoffset);
     }
+    else if (pLUExt->WorkerFileObject != NULL)
+    {
+        status = ImScsiReadWriteFileObject(
+            pLUExt->WorkerFileObject,
+            IRP_MJ_READ,
+            &io_status,
+            Buffer,
+            *Length,
+            &byteoffset);
+    }
     else if (pLUExt->ImageFile != NULL)
     {
         status = NtReadFile(
@@ -818,7 +1015,7 @@ ImScsiZeroDevice(
     else if (pLUExt->UseProxy)
     {
         DEVICE_DATA_SET_RANGE range;
-        range.StartingOffset = Offset->QuadPart;
+        range.StartingOffset = byteoffset.QuadPart;
         range.LengthInBytes = Length;
 
         status = ImScsiUnmapOrZeroProxy(
@@ -832,8 +1029,8 @@ ImScsiZeroDevice(
     else if (pLUExt->ImageFile != NULL)
     {
         FILE_ZERO_DATA_INFORMATION zerodata;
-        zerodata.FileOffset = *Offset;
-        zerodata.BeyondFinalZero.QuadPart = Offset->QuadPart + Length;
+        zerodata.FileOffset = byteoffset;
+        zerodata.BeyondFinalZero.QuadPart = byteoffset.QuadPart + Length;
 
         status = ZwFsControlFile(
             pLUExt->ImageFile,
@@ -854,8 +1051,10 @@ ImScsiZeroDevice(
     return status;
 }
 
+/// Writes Buffer to image as data, without looking for zero blocks
+static
 NTSTATUS
-ImScsiWriteDevice(
+ImScsiWriteDeviceData(
 __in pHW_LU_EXTENSION pLUExt,
 __in PVOID            Buffer,
 __in PLARGE_INTEGER   Offset,
@@ -866,28 +1065,9 @@ __in PULONG           Length
     NTSTATUS status = STATUS_NOT_IMPLEMENTED;
     LARGE_INTEGER byteoffset;
 
-    if (pLUExt->SupportsZero &&
-        ImScsiIsBufferZero(Buffer, *Length))
-    {
-        status = ImScsiZeroDevice(pLUExt, Offset, *Length);
-
-        if (NT_SUCCESS(status))
-        {
-            KdPrint2(("PhDskMnt::ImScsiWriteDevice: Zero block set at %I64i, bytes: %u.\n",
-                Offset->QuadPart, *Length));
-
-            return status;
-        }
-
-        KdPrint(("PhDskMnt::ImScsiWriteDevice: Volume does not support "
-            "FSCTL_SET_ZERO_DATA: 0x%#X\n", status));
-
-        pLUExt->SupportsZero = FALSE;
-    }
-
     byteoffset.QuadPart = Offset->QuadPart + pLUExt->ImageOffset.QuadPart;
 
-    KdPrint2(("PhDskMnt::ImScsiWriteDevice: pLUExt=%p, Buffer=%p, Offset=0x%I64X, EffectiveOffset=0x%I64X, Length=0x%X\n",
+    KdPrint2(("PhDskMnt::ImScsiWriteDeviceData: pLUExt=%p, Buffer=%p, Offset=0x%I64X, EffectiveOffset=0x%I64X, Length=0x%X\n",
         pLUExt, Buffer, *Offset, byteoffset, *Length));
 
     pLUExt->Modified = TRUE;
@@ -918,6 +1098,16 @@ __in PULONG           Length
             *Length,
             &byteoffset);
     }
+    else if (pLUExt->WorkerFileObject != NULL)
+    {
+        status = ImScsiReadWriteFileObject(
+            pLUExt->WorkerFileObject,
+            IRP_MJ_WRITE,
+            &io_status,
+            Buffer,
+            *Length,
+            &byteoffset);
+    }
     else if (pLUExt->ImageFile != NULL)
     {
         status = NtWriteFile(
@@ -941,11 +1131,191 @@ __in PULONG           Length
         *Length = 0;
     }
 
-    KdPrint2(("PhDskMnt::ImScsiWriteDevice Result: pLUExt=%p, status=0x%X, Length=0x%X\n", pLUExt, status, *Length));
+    KdPrint2(("PhDskMnt::ImScsiWriteDeviceData Result: pLUExt=%p, status=0x%X, Length=0x%X\n", pLUExt, status, *Length));
 
     return status;
 }
 
+/// Offset in a write request buffer of first block boundary for zero runs,
+/// so that zero ranges are aligned to device offsets.
+FORCEINLINE
+ULONG
+ImScsiGetZeroRunFirstBoundary(
+__in pHW_LU_EXTENSION pLUExt,
+__in PLARGE_INTEGER   Offset
+)
+{
+    ULONG granularity = pLUExt->ZeroRunGranularity;
+
+    return (granularity - (ULONG)(Offset->QuadPart % granularity)) %
+        granularity;
+}
+
+BOOLEAN
+ImScsiIsWriteZeroRange(
+__in pHW_LU_EXTENSION pLUExt,
+__in PVOID            Buffer,
+__in PLARGE_INTEGER   Offset,
+__in ULONG            Length
+)
+{
+    size_t run_start;
+    size_t run_length;
+
+    if (!pLUExt->SupportsZero)
+    {
+        return FALSE;
+    }
+
+    if (ImScsiIsBufferZero(Buffer, Length))
+    {
+        return TRUE;
+    }
+
+    if (pLUExt->ZeroRunGranularity == 0 ||
+        Length < pLUExt->ZeroRunGranularity)
+    {
+        return FALSE;
+    }
+
+    return (BOOLEAN)ImScsiFindZeroRun(ImScsiFindNonZero, Buffer, Length, 0,
+        ImScsiGetZeroRunFirstBoundary(pLUExt, Offset),
+        pLUExt->ZeroRunGranularity, &run_start, &run_length);
+}
+
+NTSTATUS
+ImScsiWriteDevice(
+__in pHW_LU_EXTENSION pLUExt,
+__in PVOID            Buffer,
+__in PLARGE_INTEGER   Offset,
+__in PULONG           Length
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG length = *Length;
+    ULONG granularity = pLUExt->ZeroRunGranularity;
+    ULONG first_boundary;
+    size_t start = 0;
+    size_t run_start;
+    size_t run_length;
+    BOOLEAN split = FALSE;
+
+    if (pLUExt->SupportsZero &&
+        ImScsiIsBufferZero(Buffer, length))
+    {
+        status = ImScsiZeroDevice(pLUExt, Offset, length);
+
+        if (NT_SUCCESS(status))
+        {
+            KdPrint2(("PhDskMnt::ImScsiWriteDevice: Zero block set at %I64i, bytes: %u.\n",
+                Offset->QuadPart, length));
+
+            InterlockedExchangeAdd64(&pLUExt->Statistics.ZeroBytesSaved,
+                length);
+
+            return status;
+        }
+
+        KdPrint(("PhDskMnt::ImScsiWriteDevice: Volume does not support "
+            "FSCTL_SET_ZERO_DATA: 0x%#X\n", status));
+
+        pLUExt->SupportsZero = FALSE;
+    }
+
+    if (!pLUExt->SupportsZero ||
+        granularity == 0 ||
+        length < granularity)
+    {
+        return ImScsiWriteDeviceData(pLUExt, Buffer, Offset, Length);
+    }
+
+    // Partly zero writes, such as when file systems are formatted or page
+    // files created, are split into data writes and zero ranges of whole
+    // aligned blocks, so that sparse images stay sparse.
+    first_boundary = ImScsiGetZeroRunFirstBoundary(pLUExt, Offset);
+
+    while (pLUExt->SupportsZero &&
+        ImScsiFindZeroRun(ImScsiFindNonZero, Buffer, length, start,
+            first_boundary, granularity, &run_start, &run_length))
+    {
+        LARGE_INTEGER offset;
+
+        if (run_start > start)
+        {
+            ULONG data_length = (ULONG)(run_start - start);
+
+            offset.QuadPart = Offset->QuadPart + start;
+
+            status = ImScsiWriteDeviceData(pLUExt, (PUCHAR)Buffer + start,
+                &offset, &data_length);
+
+            if (!NT_SUCCESS(status))
+            {
+                *Length = 0;
+                return status;
+            }
+
+            if (data_length != run_start - start)
+            {
+                *Length = (ULONG)start + data_length;
+                return status;
+            }
+        }
+
+        offset.QuadPart = Offset->QuadPart + run_start;
+
+        status = ImScsiZeroDevice(pLUExt, &offset, (ULONG)run_length);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("PhDskMnt::ImScsiWriteDevice: Volume does not support "
+                "FSCTL_SET_ZERO_DATA: 0x%#X\n", status));
+
+            // Rest of request, including this run, is written as data
+            pLUExt->SupportsZero = FALSE;
+            start = run_start;
+            break;
+        }
+
+        KdPrint2(("PhDskMnt::ImScsiWriteDevice: Zero run set at %I64i, bytes: %u.\n",
+            offset.QuadPart, (ULONG)run_length));
+
+        InterlockedExchangeAdd64(&pLUExt->Statistics.ZeroBytesSaved,
+            run_length);
+
+        split = TRUE;
+        start = run_start + run_length;
+    }
+
+    if (split)
+    {
+        InterlockedIncrement64(&pLUExt->Statistics.ZeroRunSplitWrites);
+    }
+
+    if (start < length)
+    {
+        LARGE_INTEGER offset;
+        ULONG data_length = length - (ULONG)start;
+
+        offset.QuadPart = Offset->QuadPart + start;
+
+        status = ImScsiWriteDeviceData(pLUExt, (PUCHAR)Buffer + start,
+            &offset, &data_length);
+
+        if (!NT_SUCCESS(status))
+        {
+            *Length = 0;
+            return status;
+        }
+
+        start += data_length;
+    }
+
+    *Length = (ULONG)start;
+
+    return STATUS_SUCCESS;
+}
+
 VOID
 ImScsiGenerateUniqueId(pHW_LU_EXTENSION LUExtension)
 {
@@ -1036,6 +1406,11 @@ __in __deref PETHREAD ClientThread)
     PROXY_CONNECTION proxy = { };
     ULONG alignment_requirement;
     BOOLEAN proxy_supports_unmap = FALSE;
+    BOOLEAN proxy_supports_vectored = FALSE;
+#ifdef USE_STORPORT
+    ULONG worker_threads;
+    ULONG max_worker_threads;
+#endif
     BOOLEAN proxy_supports_zero = FALSE;
 
     ASSERT(CreateData != NULL);
@@ -1931,9 +2306,80 @@ __in __deref PETHREAD ClientThread)
             if (proxy_info.flags & IMDPROXY_FLAG_SUPPORTS_ZERO)
                 proxy_supports_zero = TRUE;
 
+            if (proxy_info.flags & IMDPROXY_FLAG_SUPPORTS_VECTORED)
+                proxy_supports_vectored = TRUE;
+
             if ((proxy_info.flags & IMDPROXY_FLAG_SUPPORTS_SHARED) == 0)
                 CreateData->Fields.Flags &= ~IMSCSI_OPTION_SHARED_IMAGE;
 
+            // Shared memory servers that support it get a ring of slots so
+            // that several requests can be outstanding at the same time.
+            if ((proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM) &&
+                (proxy_info.flags & IMDPROXY_FLAG_SUPPORTS_SHM_RING))
+            {
+                ULONG slot_count = (ULONG)min(IMDPROXY_SHM_RING_MAX_SLOTS,
+                    (proxy.shared_memory_size - IMDPROXY_HEADER_SIZE) /
+                    (IMSCSI_SHM_RING_MIN_SLOT_DATA_SIZE + IMDPROXY_HEADER_SIZE));
+
+                if (slot_count >= 2)
+                {
+                    status = ImScsiSetupShmRingProxy(&proxy,
+                        &io_status,
+                        NULL,
+                        slot_count);
+
+                    if (status == STATUS_NOT_SUPPORTED)
+                    {
+                        KdPrint(("PhDskMnt: Proxy declined ring layout, using single request mailbox.\n"));
+
+                        status = STATUS_SUCCESS;
+                    }
+                    else if (!NT_SUCCESS(status))
+                    {
+                        ImScsiCloseProxy(&proxy);
+                        ZwClose(file_handle);
+
+                        if (file_name.Buffer != NULL)
+                            ExFreePoolWithTag(file_name.Buffer, MP_TAG_GENERAL);
+
+                        ImScsiLogError((pMPDrvInfoGlobal->pDriverObj,
+                            0,
+                            0,
+                            NULL,
+                            0,
+                            1000,
+                            status,
+                            102,
+                            status,
+                            0,
+                            0,
+                            NULL,
+                            L"Error setting up proxy ring."));
+
+                        KdPrint(("PhDskMnt: Error setting up proxy ring (%#x).\n", status));
+
+                        return status;
+                    }
+                }
+            }
+
+            // Stream servers that support it get several tagged requests on
+            // the wire at the same time. Otherwise, or if this fails, each
+            // request waits for the response to previous one.
+            if ((proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_DEVICE) &&
+                (proxy_info.flags & IMDPROXY_FLAG_SUPPORTS_TAGGED))
+            {
+                status = ImScsiSetupTaggedProxy(&proxy,
+                    IMSCSI_TAGGED_PROXY_MAX_OUTSTANDING);
+
+                if (!NT_SUCCESS(status))
+                {
+                    KdPrint(("PhDskMnt: Cannot use tagged proxy requests (%#x).\n", status));
+
+                    status = STATUS_SUCCESS;
+                }
+            }
+
             KdPrint(("PhDskMnt: Got from proxy: Siz=0x%08x%08x Flg=%#x Alg=%#x.\n",
                 CreateData->Fields.DiskSize.HighPart,
                 CreateData->Fields.DiskSize.LowPart,
@@ -2152,6 +2598,20 @@ __in __deref PETHREAD ClientThread)
             proxy_supports_zero))
     {
         LUExtension->SupportsZero = TRUE;
+
+        // Zero runs must be whole sectors
+        if ((pMPDrvInfoGlobal->MPRegInfo.ZeroRunGranularity &
+            ((1UL << LUExtension->BlockPower) - 1)) == 0)
+        {
+            LUExtension->ZeroRunGranularity =
+                pMPDrvInfoGlobal->MPRegInfo.ZeroRunGranularity;
+        }
+    }
+
+    if (LUExtension->UseProxy &&
+        proxy_supports_vectored)
+    {
+        LUExtension->SupportsVectored = TRUE;
     }
 
     // Image opened for shared writing
@@ -2178,11 +2638,12 @@ __in __deref PETHREAD ClientThread)
 
     KeInitializeSpinLock(&LUExtension->RequestListLock);
     InitializeListHead(&LUExtension->RequestList);
+    InitializeListHead(&LUExtension->InFlightList);
     KeInitializeEvent(&LUExtension->RequestEvent, SynchronizationEvent, FALSE);
 
     KeInitializeEvent(&LUExtension->Initialized, NotificationEvent, FALSE);
 
-    KeInitializeSpinLock(&LUExtension->LastIoLock);
+    ImScsiInitializeReadCache(LUExtension);
 
     KeSetEvent(&LUExtension->Initialized, (KPRIORITY)0, FALSE);
 
@@ -2211,6 +2672,115 @@ __in __deref PETHREAD ClientThread)
         }
     }
 
+#ifdef USE_STORPORT
+    // Several worker threads can serve the request list of an LU where more
+    // than one request can be outstanding at the same time. Additional
+    // threads are started before main worker thread, which waits for them
+    // to exit before cleaning up the LU.
+    worker_threads = CreateData->Fields.WorkerThreads;
+
+    if (worker_threads == 0)
+    {
+        worker_threads = pMPDrvInfoGlobal->MPRegInfo.WorkerThreads;
+    }
+
+    if (LUExtension->UseProxy &&
+        (LUExtension->Proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM) &&
+        (LUExtension->Proxy.shm_ring != NULL))
+    {
+        // One thread for each ring slot by default
+        max_worker_threads = LUExtension->Proxy.shm_ring->slot_count;
+    }
+    else if (LUExtension->UseProxy &&
+        (LUExtension->Proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_DEVICE) &&
+        (LUExtension->Proxy.tagged != NULL))
+    {
+        // One thread for each outstanding tagged request by default
+        max_worker_threads = LUExtension->Proxy.tagged->max_outstanding;
+    }
+    else if (LUExtension->UseProxy ||
+        (LUExtension->FileObject != NULL) ||
+        (LUExtension->VMDisk && (LUExtension->ImageFile != NULL)))
+    {
+        // Lock-step proxy connections serve one request at a time, parallel
+        // I/O and physical memory images are not served by worker threads
+        // and memory images are loaded by main worker thread before it
+        // starts serving requests.
+        max_worker_threads = 1;
+        worker_threads = 1;
+    }
+    else
+    {
+        max_worker_threads = MAX_ADDITIONAL_WORKER_THREADS + 1;
+
+        if (worker_threads == 0)
+        {
+            worker_threads = 1;
+        }
+    }
+
+    if ((worker_threads == 0) ||
+        (worker_threads > max_worker_threads))
+    {
+        worker_threads = max_worker_threads;
+    }
+
+    // Requests through a synchronous file handle are serialized by the
+    // file object lock, so several threads, or asynchronous requests, are
+    // sent as IRPs directly to the file object instead.
+    if (((worker_threads > 1) ||
+        (pMPDrvInfoGlobal->MPRegInfo.AsyncQueueDepth > 0)) &&
+        !LUExtension->UseProxy &&
+        !LUExtension->VMDisk &&
+        (LUExtension->FileObject == NULL) &&
+        (file_handle != NULL))
+    {
+        status = ObReferenceObjectByHandle(file_handle,
+            SYNCHRONIZE | FILE_READ_ATTRIBUTES | FILE_READ_DATA |
+            (LUExtension->ReadOnly ?
+            0 : FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES),
+            *IoFileObjectType,
+            KernelMode, (PVOID*)&LUExtension->WorkerFileObject, NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            LUExtension->WorkerFileObject = NULL;
+
+            DbgPrint("PhDskMnt::ImScsiCreateLU: Error referencing image file handle: %#x. Using one worker thread.\n",
+                status);
+
+            worker_threads = 1;
+        }
+    }
+
+    // Worker threads send read and write requests for queued I/O image
+    // files without waiting for them, up to queue depth, and SRBs are
+    // completed from I/O completion routine.
+    if ((LUExtension->WorkerFileObject != NULL) &&
+        (pMPDrvInfoGlobal->MPRegInfo.AsyncQueueDepth > 0))
+    {
+        LUExtension->AsyncQueueDepth = min(
+            pMPDrvInfoGlobal->MPRegInfo.AsyncQueueDepth,
+            IMSCSI_MAX_ASYNC_QUEUE_DEPTH);
+
+        KeInitializeSemaphore(&LUExtension->AsyncRequestSemaphore,
+            LUExtension->AsyncQueueDepth, LUExtension->AsyncQueueDepth);
+
+        LUExtension->TrackInFlight = TRUE;
+
+        KdPrint(("PhDskMnt::ImScsiCreateLU: Up to %u asynchronous requests for pLUExt=0x%p.\n",
+            LUExtension->AsyncQueueDepth, LUExtension));
+    }
+
+    if (worker_threads > 1)
+    {
+        ImScsiStartAdditionalWorkerThreads(LUExtension, worker_threads - 1);
+    }
+#endif
+
+    CreateData->Fields.WorkerThreads =
+        LUExtension->NumberOfAdditionalWorkerThreads + 1;
+
     status = PsCreateSystemThread(
         &thread_handle,
         (ACCESS_MASK)0L,
@@ -2224,6 +2794,9 @@ __in __deref PETHREAD ClientThread)
     {
         DbgPrint("PhDskMnt::ImScsiCreateLU: Cannot create device worker thread. (%#x)\n", status);
 
+        KeSetEvent(&LUExtension->StopThread, (KPRIORITY)0, FALSE);
+        ImScsiStopAdditionalWorkerThreads(LUExtension);
+
         return status;
     }
 
@@ -162,6 +162,13 @@ ImScsiFreeGlobalResources()
             pMPDrvInfoGlobal->WorkerThread = NULL;
         }
 
+        if (pMPDrvInfoGlobal->GlobalsInitialized)
+        {
+            ExDeleteNPagedLookasideList(&pMPDrvInfoGlobal->WorkItemLookaside);
+
+            ImScsiFreeBufferPool();
+        }
+
 #ifdef USE_SCSIPORT
         if (pMPDrvInfoGlobal->ControllerObject != NULL)
         {
@@ -491,6 +498,16 @@ __out      PBOOLEAN                        pBAgain
 
         KeInitializeEvent(&pMPDrvInfoGlobal->StopWorker, NotificationEvent, FALSE);
 
+        // Work items and intermediate buffers can be released after an
+        // adapter has completed its last request, so these are kept for
+        // all adapters together until driver unloads.
+        ExInitializeNPagedLookasideList(&pMPDrvInfoGlobal->WorkItemLookaside,
+            NULL, NULL, 0, sizeof(MP_WorkRtnParms), MP_TAG_GENERAL, 0);
+
+        ImScsiInitializeBufferPool();
+
+        ImScsiInitializeZeroScan();
+
         pMPDrvInfoGlobal->GlobalsInitialized = TRUE;
 
         InitializeObjectAttributes(&object_attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
@@ -647,7 +664,7 @@ __inout __deref PKIRQL LowestAssumedIrql
         ScsiPortNotification(RequestComplete, pWkRtnParms->pHBAExt, pWkRtnParms->pSrb);
         ScsiPortNotification(NextRequest, pWkRtnParms->pHBAExt);
 
-        ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);      // Free parm list.
+        ExFreeToNPagedLookasideList(&pMPDrvInfoGlobal->WorkItemLookaside, pWkRtnParms);      // Free parm list.
     }
 }
 
@@ -1426,7 +1443,7 @@ pMP_WorkRtnParms ImScsiCreateWorkItem(pHW_HBA_EXT pHBAExt,
     PSCSI_REQUEST_BLOCK pSrb)
 {
     pMP_WorkRtnParms pWkRtnParms =                                     // Allocate parm area for work routine.
-        (pMP_WorkRtnParms)ExAllocatePoolWithTag(NonPagedPool, sizeof(MP_WorkRtnParms), MP_TAG_GENERAL);
+        (pMP_WorkRtnParms)ExAllocateFromNPagedLookasideList(&pMPDrvInfoGlobal->WorkItemLookaside);
 
     if (pWkRtnParms == NULL)
     {
@@ -37,6 +37,13 @@ ImScsiCloseProxy(__in __deref PPROXY_CONNECTION Proxy)
             ObDereferenceObject(Proxy->device);
 
         Proxy->device = NULL;
+
+        if (Proxy->tagged != NULL)
+        {
+            ExFreePoolWithTag(Proxy->tagged, MP_TAG_GENERAL);
+            Proxy->tagged = NULL;
+        }
+
         break;
 
     case PROXY_CONNECTION::PROXY_CONNECTION_SHM:
@@ -78,12 +85,67 @@ ImScsiCloseProxy(__in __deref PPROXY_CONNECTION Proxy)
             Proxy->shared_memory = NULL;
         }
 
+        if (Proxy->shm_ring != NULL)
+        {
+            ExFreePoolWithTag(Proxy->shm_ring, MP_TAG_GENERAL);
+            Proxy->shm_ring = NULL;
+        }
+
         break;
     }
 }
 
-NTSTATUS
-ImScsiCallProxy(__in __deref PPROXY_CONNECTION Proxy,
+///
+/// Called by any caller that has been woken by the shared response event of a
+/// shared memory ring connection. Signals completion events for all slots
+/// where server has placed a response, because the response event is an auto
+/// reset event shared by all outstanding requests. Slots abandoned by
+/// cancelled callers are returned to the free pool here.
+///
+static VOID
+ImScsiSignalShmRingCompletions(__in __deref PPROXY_CONNECTION Proxy)
+{
+    PPROXY_SHM_RING ring = Proxy->shm_ring;
+
+    for (ULONG i = 0; i < ring->slot_count; i++)
+    {
+        LONG slot_bit = 1L << i;
+
+        if (ring->free_slots & slot_bit)
+        {
+            continue;
+        }
+
+        PIMDPROXY_SHM_RING_SLOT slot =
+            IMDPROXY_SHM_RING_SLOT_PTR(Proxy->shared_memory, ring->slot_size, i);
+
+        if (slot->state != IMDPROXY_SHM_RING_SLOT_RESPONSE)
+        {
+            continue;
+        }
+
+        if (InterlockedAnd(&ring->abandoned_slots, ~slot_bit) & slot_bit)
+        {
+            KdPrint(("ImScsi Proxy Client: Reclaiming abandoned slot %u.\n", i));
+
+            InterlockedExchange(&slot->state, IMDPROXY_SHM_RING_SLOT_FREE);
+            InterlockedOr(&ring->free_slots, slot_bit);
+            KeReleaseSemaphore(&ring->slots_available, (KPRIORITY)0, 1, FALSE);
+
+            continue;
+        }
+
+        KeSetEvent(&ring->slot_completed[i], (KPRIORITY)0, FALSE);
+    }
+}
+
+///
+/// Shared memory ring version of ImScsiCallProxy. Any number of threads can
+/// call this function simultaneously for the same connection, each request
+/// occupies one slot until response has been read.
+///
+static NTSTATUS
+ImScsiCallShmRingProxy(__in __deref PPROXY_CONNECTION Proxy,
 __out __deref PIO_STATUS_BLOCK IoStatusBlock,
 __in __deref PKEVENT CancelEvent OPTIONAL,
 __in __deref PVOID RequestHeader,
@@ -96,198 +158,1028 @@ __drv_when(ResponseDataBufferSize > 0 && *ResponseDataSize > 0, __out) __drv_whe
 __in ULONG ResponseDataBufferSize,
 __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
 {
+    PPROXY_SHM_RING ring = Proxy->shm_ring;
+    ULONG_PTR data_size = ring->slot_size - IMDPROXY_HEADER_SIZE;
     NTSTATUS status;
+    ULONG slot_index;
+    LONG slot_bit;
 
-    ASSERT(Proxy != NULL);
+    // Some parameter sanity checks
+    if ((RequestHeaderSize > IMDPROXY_SHM_RING_SLOT_HEADER_SIZE) ||
+        (ResponseHeaderSize > IMDPROXY_SHM_RING_SLOT_HEADER_SIZE) ||
+        (RequestDataSize > data_size))
+    {
+        KdPrint(("ImScsi Proxy Client: "
+            "Parameter values not supported.\n."));
 
-    switch (Proxy->connection_type)
+        IoStatusBlock->Status = STATUS_INVALID_BUFFER_SIZE;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    PVOID slot_wait_objects[] = {
+        &ring->slots_available,
+        CancelEvent
+    };
+
+    status = KeWaitForMultipleObjects(CancelEvent != NULL ? 2 : 1,
+        slot_wait_objects,
+        WaitAny,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL,
+        NULL);
+
+    if (status != STATUS_WAIT_0)
     {
-    case PROXY_CONNECTION::PROXY_CONNECTION_DEVICE:
+        KdPrint(("ImScsi Proxy Client: Incomplete wait for free slot %#x.\n.", status));
+
+        IoStatusBlock->Status = STATUS_CANCELLED;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    // Semaphore guarantees that at least one slot is free for us
+    for (;;)
     {
-        PUCHAR io_buffer = NULL;
-        PUCHAR temp_buffer = NULL;
-        ULONG io_size = RequestHeaderSize + RequestDataSize;
+        LONG free_slots = ring->free_slots;
 
-        if ((RequestHeaderSize > 0) &&
-            (RequestDataSize > 0))
+        if (!BitScanForward(&slot_index, (ULONG)free_slots))
         {
-            temp_buffer = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, io_size, MP_TAG_GENERAL);
+            continue;
+        }
 
-            if (temp_buffer == NULL)
-            {
-                KdPrint(("ImScsi Proxy Client: Memory allocation failed.\n."));
+        slot_bit = 1L << slot_index;
 
-                IoStatusBlock->Status = STATUS_INSUFFICIENT_RESOURCES;
-                IoStatusBlock->Information = 0;
-                return IoStatusBlock->Status;
-            }
+        if (InterlockedCompareExchange(&ring->free_slots,
+            free_slots & ~slot_bit, free_slots) == free_slots)
+        {
+            break;
+        }
+    }
 
-            if (RequestHeaderSize > 0)
-            {
-                RtlCopyMemory(temp_buffer, RequestHeader, RequestHeaderSize);
-            }
+    PIMDPROXY_SHM_RING_SLOT slot =
+        IMDPROXY_SHM_RING_SLOT_PTR(Proxy->shared_memory, ring->slot_size, slot_index);
+
+    PUCHAR slot_header = (PUCHAR)slot + IMDPROXY_SHM_RING_SLOT_HEADER_OFFSET;
+    PUCHAR slot_data = (PUCHAR)slot + IMDPROXY_HEADER_SIZE;
+
+    KeClearEvent(&ring->slot_completed[slot_index]);
+
+    IoStatusBlock->Information = 0;
+
+    slot->tag = slot_index;
 
-            if (RequestDataSize > 0)
+    if (RequestHeaderSize > 0)
+        RtlCopyMemory(slot_header,
+            RequestHeader,
+            RequestHeaderSize);
+
+    if (RequestDataSize > 0)
+    {
+        RtlCopyMemory(slot_data,
+            RequestData,
+            RequestDataSize);
+
+        InterlockedExchangeAdd64(&Proxy->bytes_copied, RequestDataSize);
+    }
+
+    // Interlocked operation also acts as a full memory barrier, so server
+    // sees complete request header and data when it sees new slot state.
+    InterlockedExchange(&slot->state, IMDPROXY_SHM_RING_SLOT_REQUEST);
+
+    KeSetEvent(Proxy->request_event, (KPRIORITY)0, FALSE);
+
+    PVOID wait_objects[] = {
+        &ring->slot_completed[slot_index],
+        Proxy->response_event,
+        CancelEvent
+    };
+
+    while (InterlockedCompareExchange(&slot->state,
+        IMDPROXY_SHM_RING_SLOT_RESPONSE,
+        IMDPROXY_SHM_RING_SLOT_RESPONSE) != IMDPROXY_SHM_RING_SLOT_RESPONSE)
+    {
+        status = KeWaitForMultipleObjects(CancelEvent != NULL ? 3 : 2,
+            wait_objects,
+            WaitAny,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL,
+            NULL);
+
+        if (status == STATUS_WAIT_1)
+        {
+            ImScsiSignalShmRingCompletions(Proxy);
+        }
+        else if (status != STATUS_WAIT_0)
+        {
+            KdPrint(("ImScsi Proxy Client: Incomplete wait %#x. Abandoning slot %u.\n.",
+                status, slot_index));
+
+            // Server still owns the slot. It will be returned to free pool
+            // when a response eventually arrives.
+            InterlockedOr(&ring->abandoned_slots, slot_bit);
+
+            IoStatusBlock->Status = STATUS_CANCELLED;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+    if (ResponseHeaderSize > 0)
+        RtlCopyMemory(ResponseHeader,
+            slot_header,
+            ResponseHeaderSize);
+
+    if (ResponseDataSize != NULL && *ResponseDataSize > 0)
+    {
+        // If server end requests to send more data than we requested, we
+        // treat that as an unrecoverable device error and exit.
+
+        if ((*ResponseDataSize > ResponseDataBufferSize) ||
+            (*ResponseDataSize > data_size))
+        {
+            DbgPrint("ImScsi Proxy Client: Invalid response size %u expected at most %u.\n.",
+                *ResponseDataSize, ResponseDataBufferSize);
+
+            KdBreakPoint();
+
+            status = STATUS_IO_DEVICE_ERROR;
+        }
+        else
+        {
+            RtlCopyMemory(ResponseData,
+                slot_data,
+                *ResponseDataSize);
+
+            InterlockedExchangeAdd64(&Proxy->bytes_copied, *ResponseDataSize);
+
+            IoStatusBlock->Information = *ResponseDataSize;
+        }
+    }
+
+    InterlockedExchange(&slot->state, IMDPROXY_SHM_RING_SLOT_FREE);
+    InterlockedOr(&ring->free_slots, slot_bit);
+    KeReleaseSemaphore(&ring->slots_available, (KPRIORITY)0, 1, FALSE);
+
+    if (!NT_SUCCESS(status))
+    {
+        IoStatusBlock->Status = status;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    if ((RequestDataSize > 0) & (IoStatusBlock->Information == 0))
+        IoStatusBlock->Information = RequestDataSize;
+    return IoStatusBlock->Status;
+}
+
+///
+/// Returns a tagged request entry to the free pool.
+///
+static VOID
+ImScsiReleaseTaggedSlot(__in __deref PPROXY_TAGGED Tagged,
+__in ULONG SlotIndex)
+{
+    InterlockedExchange(&Tagged->requests[SlotIndex].state, PROXY_TAGGED_REQUEST_FREE);
+    InterlockedOr(&Tagged->free_slots, 1L << SlotIndex);
+    KeReleaseSemaphore(&Tagged->slots_available, (KPRIORITY)0, 1, FALSE);
+}
+
+///
+/// Called when the stream can no longer be trusted to be in sync with the
+/// server, for instance after an I/O error or an unknown tag. Completes all
+/// waiting requests with an error status. Any later tagged or untagged
+/// request on the connection fails immediately.
+///
+static VOID
+ImScsiFailTaggedRequests(__in __deref PPROXY_TAGGED Tagged,
+__in NTSTATUS Status)
+{
+    InterlockedExchange(&Tagged->failed, TRUE);
+
+    for (ULONG i = 0; i < Tagged->max_outstanding; i++)
+    {
+        PPROXY_TAGGED_REQUEST request = &Tagged->requests[i];
+
+        LONG state = request->state;
+
+        if (state == PROXY_TAGGED_REQUEST_ABANDONED)
+        {
+            if (InterlockedCompareExchange(&request->state,
+                PROXY_TAGGED_REQUEST_FREE, state) == state)
             {
-                RtlCopyMemory(temp_buffer + RequestHeaderSize, RequestData, RequestDataSize);
+                InterlockedOr(&Tagged->free_slots, 1L << i);
+                KeReleaseSemaphore(&Tagged->slots_available, (KPRIORITY)0, 1, FALSE);
             }
 
-            io_buffer = temp_buffer;
+            continue;
         }
-        else if (RequestHeaderSize > 0)
+
+        if ((state != PROXY_TAGGED_REQUEST_PENDING) &&
+            (state != PROXY_TAGGED_REQUEST_RECEIVING))
         {
-            io_buffer = (PUCHAR)RequestHeader;
+            continue;
         }
-        else if (RequestDataSize > 0)
+
+        request->status = Status;
+
+        if (InterlockedCompareExchange(&request->state,
+            PROXY_TAGGED_REQUEST_COMPLETE, state) == state)
         {
-            io_buffer = (PUCHAR)RequestData;
+            KeSetEvent(&request->completed, (KPRIORITY)0, FALSE);
         }
+    }
+}
+
+///
+/// Reads and throws away response data for a request that was abandoned by
+/// its caller.
+///
+static NTSTATUS
+ImScsiDiscardTaggedData(__in __deref PPROXY_CONNECTION Proxy,
+__in __deref PKEVENT CancelEvent OPTIONAL,
+__in ULONGLONG Length)
+{
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG buffer_size = (ULONG)min(Length, 64 << 10);
+
+    if (Length == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    PVOID buffer = ExAllocatePoolWithTag(NonPagedPool, buffer_size, MP_TAG_GENERAL);
+
+    if (buffer == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-        if (io_size > 0)
+    while (Length > 0)
+    {
+        ULONG chunk = (ULONG)min(Length, buffer_size);
+
+        status = ImScsiSafeIOStream(Proxy->device,
+            IRP_MJ_READ,
+            &io_status,
+            CancelEvent,
+            buffer,
+            chunk);
+
+        if (!NT_SUCCESS(status))
         {
-            if (CancelEvent != NULL ?
-                KeReadStateEvent(CancelEvent) != 0 :
-                FALSE)
-            {
-                KdPrint(("ImScsi Proxy Client: Request cancelled.\n."));
+            break;
+        }
 
-                if (temp_buffer != NULL)
-                {
-                    ExFreePoolWithTag(temp_buffer, MP_TAG_GENERAL);
-                }
+        Length -= chunk;
+    }
 
-                IoStatusBlock->Status = STATUS_CANCELLED;
-                IoStatusBlock->Information = 0;
-                return IoStatusBlock->Status;
-            }
+    ExFreePoolWithTag(buffer, MP_TAG_GENERAL);
 
-            status = ImScsiSafeIOStream(Proxy->device,
-                IRP_MJ_WRITE,
-                IoStatusBlock,
-                CancelEvent,
-                io_buffer,
-                io_size);
+    return status;
+}
 
-            if (!NT_SUCCESS(status))
+///
+/// Called by a caller that owns the receive lock of a tagged connection.
+/// Reads responses from the stream and hands them over to the callers that
+/// sent the requests, until the response to the request of the calling
+/// thread itself has arrived.
+///
+static VOID
+ImScsiReceiveTaggedResponses(__in __deref PPROXY_CONNECTION Proxy,
+__in __deref PKEVENT CancelEvent OPTIONAL,
+__in __deref PPROXY_TAGGED_REQUEST OwnRequest)
+{
+    PPROXY_TAGGED tagged = Proxy->tagged;
+    IO_STATUS_BLOCK io_status;
+    IMDPROXY_TAGGED_RESP response;
+    NTSTATUS status;
+
+    while (OwnRequest->state != PROXY_TAGGED_REQUEST_COMPLETE)
+    {
+        if (tagged->failed)
+        {
+            ImScsiFailTaggedRequests(tagged, STATUS_IO_DEVICE_ERROR);
+            return;
+        }
+
+        status = ImScsiSafeIOStream(Proxy->device,
+            IRP_MJ_READ,
+            &io_status,
+            CancelEvent,
+            &response,
+            sizeof(response));
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImScsi Proxy Client: Tagged response header error %#x\n.",
+                status));
+
+            ImScsiFailTaggedRequests(tagged, STATUS_IO_DEVICE_ERROR);
+            return;
+        }
+
+        ULONG slot_index = (ULONG)(response.tag & 0xFF);
+
+        if ((slot_index >= tagged->max_outstanding) ||
+            (tagged->requests[slot_index].tag != response.tag))
+        {
+            DbgPrint("ImScsi Proxy Client: Response with unknown tag %#I64x.\n",
+                response.tag);
+
+            KdBreakPoint();
+
+            ImScsiFailTaggedRequests(tagged, STATUS_IO_DEVICE_ERROR);
+            return;
+        }
+
+        PPROXY_TAGGED_REQUEST request = &tagged->requests[slot_index];
+
+        LONG state = InterlockedCompareExchange(&request->state,
+            PROXY_TAGGED_REQUEST_RECEIVING, PROXY_TAGGED_REQUEST_PENDING);
+
+        if (state == PROXY_TAGGED_REQUEST_ABANDONED)
+        {
+            KdPrint(("ImScsi Proxy Client: Discarding response for abandoned request %#I64x.\n",
+                response.tag));
+
+            if (request->response_data != NULL && response.errorno == 0)
             {
-                KdPrint(("ImScsi Proxy Client: Request error %#x\n.",
-                    status));
+                status = ImScsiDiscardTaggedData(Proxy, CancelEvent, response.length);
 
-                if (temp_buffer != NULL)
+                if (!NT_SUCCESS(status))
                 {
-                    ExFreePoolWithTag(temp_buffer, MP_TAG_GENERAL);
+                    ImScsiFailTaggedRequests(tagged, STATUS_IO_DEVICE_ERROR);
+                    return;
                 }
-
-                IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
-                IoStatusBlock->Information = 0;
-                return IoStatusBlock->Status;
             }
+
+            ImScsiReleaseTaggedSlot(tagged, slot_index);
+            continue;
         }
 
-        if (temp_buffer != NULL)
+        if (state != PROXY_TAGGED_REQUEST_PENDING)
         {
-            ExFreePoolWithTag(temp_buffer, MP_TAG_GENERAL);
+            DbgPrint("ImScsi Proxy Client: Duplicate response with tag %#I64x.\n",
+                response.tag);
+
+            KdBreakPoint();
+
+            ImScsiFailTaggedRequests(tagged, STATUS_IO_DEVICE_ERROR);
+            return;
         }
 
-        if (ResponseHeaderSize > 0)
+        request->status = STATUS_SUCCESS;
+
+        // Read response data directly into buffer of caller that sent the
+        // request
+        if (request->response_data != NULL &&
+            response.errorno == 0 &&
+            response.length > 0)
         {
-            if (CancelEvent != NULL ?
-                KeReadStateEvent(CancelEvent) != 0 :
-                FALSE)
+            if (response.length > request->response_data_buffer_size)
             {
-                KdPrint(("ImScsi Proxy Client: Request cancelled.\n."));
+                DbgPrint("ImScsi Proxy Client: Invalid response size %I64u expected at most %u.\n.",
+                    response.length, request->response_data_buffer_size);
 
-                IoStatusBlock->Status = STATUS_CANCELLED;
-                IoStatusBlock->Information = 0;
-                return IoStatusBlock->Status;
+                KdBreakPoint();
+
+                ImScsiFailTaggedRequests(tagged, STATUS_IO_DEVICE_ERROR);
+                return;
             }
 
             status = ImScsiSafeIOStream(Proxy->device,
                 IRP_MJ_READ,
-                IoStatusBlock,
+                &io_status,
                 CancelEvent,
-                ResponseHeader,
-                ResponseHeaderSize);
+                request->response_data,
+                (ULONG)response.length);
 
             if (!NT_SUCCESS(status))
             {
-                KdPrint(("ImScsi Proxy Client: Response header error %#x\n.",
+                KdPrint(("ImScsi Proxy Client: Tagged response data error %#x\n.",
                     status));
 
-                IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
-                IoStatusBlock->Information = 0;
-                return IoStatusBlock->Status;
+                ImScsiFailTaggedRequests(tagged, STATUS_IO_DEVICE_ERROR);
+                return;
             }
         }
 
-        if (ResponseDataSize != NULL && *ResponseDataSize > 0)
+        request->response = response;
+
+        InterlockedExchange(&request->state, PROXY_TAGGED_REQUEST_COMPLETE);
+        KeSetEvent(&request->completed, (KPRIORITY)0, FALSE);
+    }
+}
+
+///
+/// Tagged connection version of ImScsiCallProxy for read and write requests.
+/// Any number of threads can call this function simultaneously for the same
+/// connection. Requests are sent without waiting for earlier responses and
+/// whichever waiting caller currently owns the receive lock reads responses
+/// for all of them, in the order server sends them.
+///
+static NTSTATUS
+ImScsiCallTaggedProxy(__in __deref PPROXY_CONNECTION Proxy,
+__out __deref PIO_STATUS_BLOCK IoStatusBlock,
+__in __deref PKEVENT CancelEvent OPTIONAL,
+__in ULONGLONG RequestCode,
+__in ULONGLONG Offset,
+__in ULONG Length,
+__drv_when(RequestData != NULL, __in) PVOID RequestData,
+__drv_when(ResponseData != NULL, __out) PVOID ResponseData,
+__out __deref PIMDPROXY_TAGGED_RESP Response)
+{
+    PPROXY_TAGGED tagged = Proxy->tagged;
+    IMDPROXY_TAGGED_READ_REQ tagged_req;
+    NTSTATUS status;
+    ULONG slot_index;
+    LONG slot_bit;
+
+    // Same header layout for reads and writes
+    C_ASSERT(sizeof(IMDPROXY_TAGGED_READ_REQ) == sizeof(IMDPROXY_TAGGED_WRITE_REQ));
+
+    if (tagged->failed)
+    {
+        IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    PVOID slot_wait_objects[] = {
+        &tagged->slots_available,
+        CancelEvent
+    };
+
+    status = KeWaitForMultipleObjects(CancelEvent != NULL ? 2 : 1,
+        slot_wait_objects,
+        WaitAny,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL,
+        NULL);
+
+    if (status != STATUS_WAIT_0)
+    {
+        KdPrint(("ImScsi Proxy Client: Incomplete wait for free tag %#x.\n.", status));
+
+        IoStatusBlock->Status = STATUS_CANCELLED;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    // Semaphore guarantees that at least one entry is free for us
+    for (;;)
+    {
+        LONG free_slots = tagged->free_slots;
+
+        if (!BitScanForward(&slot_index, (ULONG)free_slots))
         {
-            if (*ResponseDataSize > ResponseDataBufferSize)
-            {
-                KdPrint(("ImScsi Proxy Client: Fatal: Request %u bytes, "
-                    "receiving %u bytes.\n",
-                    ResponseDataBufferSize, *ResponseDataSize));
+            continue;
+        }
 
-                IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
-                IoStatusBlock->Information = 0;
-                return IoStatusBlock->Status;
+        slot_bit = 1L << slot_index;
+
+        if (InterlockedCompareExchange(&tagged->free_slots,
+            free_slots & ~slot_bit, free_slots) == free_slots)
+        {
+            break;
+        }
+    }
+
+    PPROXY_TAGGED_REQUEST request = &tagged->requests[slot_index];
+
+    // Low byte identifies the entry, sequence number in upper bits makes
+    // late or duplicate responses for earlier use of an entry detectable.
+    request->tag = ((ULONGLONG)InterlockedIncrement64(&tagged->sequence) << 8) |
+        slot_index;
+    request->response_data = ResponseData;
+    request->response_data_buffer_size = ResponseData != NULL ? Length : 0;
+    request->status = STATUS_PENDING;
+    KeClearEvent(&request->completed);
+
+    tagged_req.request_code = RequestCode;
+    tagged_req.offset = Offset;
+    tagged_req.length = Length;
+    tagged_req.tag = request->tag;
+
+    // Must be pending before request is sent, another thread could receive
+    // the response before we return from sending it.
+    InterlockedExchange(&request->state, PROXY_TAGGED_REQUEST_PENDING);
+
+    PVOID lock_wait_objects[] = {
+        &tagged->send_lock,
+        CancelEvent
+    };
+
+    status = KeWaitForMultipleObjects(CancelEvent != NULL ? 2 : 1,
+        lock_wait_objects,
+        WaitAny,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL,
+        NULL);
+
+    if (status != STATUS_WAIT_0)
+    {
+        KdPrint(("ImScsi Proxy Client: Incomplete wait for send lock %#x.\n.", status));
+
+        ImScsiReleaseTaggedSlot(tagged, slot_index);
+
+        IoStatusBlock->Status = STATUS_CANCELLED;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    status = ImScsiSafeIOStream(Proxy->device,
+        IRP_MJ_WRITE,
+        IoStatusBlock,
+        CancelEvent,
+        &tagged_req,
+        sizeof(tagged_req));
+
+    if (NT_SUCCESS(status) && RequestData != NULL && Length > 0)
+    {
+        status = ImScsiSafeIOStream(Proxy->device,
+            IRP_MJ_WRITE,
+            IoStatusBlock,
+            CancelEvent,
+            RequestData,
+            Length);
+    }
+
+    KeSetEvent(&tagged->send_lock, (KPRIORITY)0, FALSE);
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ImScsi Proxy Client: Tagged request error %#x\n.",
+            status));
+
+        // A partially sent request leaves the stream unusable. Other
+        // waiting callers are failed by the thread that owns or next
+        // acquires the receive lock.
+        InterlockedExchange(&tagged->failed, TRUE);
+
+        request->status = STATUS_IO_DEVICE_ERROR;
+
+        if (InterlockedCompareExchange(&request->state,
+            PROXY_TAGGED_REQUEST_COMPLETE,
+            PROXY_TAGGED_REQUEST_PENDING) == PROXY_TAGGED_REQUEST_PENDING)
+        {
+            KeSetEvent(&request->completed, (KPRIORITY)0, FALSE);
+        }
+    }
+
+    PVOID wait_objects[] = {
+        &request->completed,
+        &tagged->receive_lock,
+        CancelEvent
+    };
+
+    while (request->state != PROXY_TAGGED_REQUEST_COMPLETE)
+    {
+        status = KeWaitForMultipleObjects(CancelEvent != NULL ? 3 : 2,
+            wait_objects,
+            WaitAny,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL,
+            NULL);
+
+        if (status == STATUS_WAIT_0)
+        {
+            break;
+        }
+
+        if (status == STATUS_WAIT_1)
+        {
+            ImScsiReceiveTaggedResponses(Proxy, CancelEvent, request);
+
+            KeSetEvent(&tagged->receive_lock, (KPRIORITY)0, FALSE);
+
+            continue;
+        }
+
+        KdPrint(("ImScsi Proxy Client: Incomplete wait for tagged response %#x.\n.", status));
+
+        // Leave entry to receiving thread if response has not arrived yet.
+        // Otherwise, response is being read into our buffer right now and
+        // we need to wait for that to finish before returning.
+        if (InterlockedCompareExchange(&request->state,
+            PROXY_TAGGED_REQUEST_ABANDONED,
+            PROXY_TAGGED_REQUEST_PENDING) == PROXY_TAGGED_REQUEST_PENDING)
+        {
+            IoStatusBlock->Status = STATUS_CANCELLED;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        KeWaitForSingleObject(&request->completed,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
+
+        break;
+    }
+
+    status = request->status;
+    *Response = request->response;
+
+    ImScsiReleaseTaggedSlot(tagged, slot_index);
+
+    if (!NT_SUCCESS(status))
+    {
+        IoStatusBlock->Status = status;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    IoStatusBlock->Information = (ULONG_PTR)Response->length;
+    return IoStatusBlock->Status;
+}
+
+///
+/// Waits for all outstanding tagged requests to complete and blocks new ones
+/// from being sent, so that an untagged request can be sent in lock-step.
+///
+static NTSTATUS
+ImScsiEnterUntaggedProxy(__in __deref PPROXY_CONNECTION Proxy,
+__in __deref PKEVENT CancelEvent OPTIONAL)
+{
+    PPROXY_TAGGED tagged = Proxy->tagged;
+    NTSTATUS status;
+    ULONG acquired;
+
+    if (tagged->failed)
+    {
+        return STATUS_IO_DEVICE_ERROR;
+    }
+
+    PVOID lock_wait_objects[] = {
+        &tagged->untagged_lock,
+        CancelEvent
+    };
+
+    status = KeWaitForMultipleObjects(CancelEvent != NULL ? 2 : 1,
+        lock_wait_objects,
+        WaitAny,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL,
+        NULL);
+
+    if (status != STATUS_WAIT_0)
+    {
+        return STATUS_CANCELLED;
+    }
+
+    PVOID slot_wait_objects[] = {
+        &tagged->slots_available,
+        CancelEvent
+    };
+
+    for (acquired = 0; acquired < tagged->max_outstanding; acquired++)
+    {
+        status = KeWaitForMultipleObjects(CancelEvent != NULL ? 2 : 1,
+            slot_wait_objects,
+            WaitAny,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL,
+            NULL);
+
+        if (status != STATUS_WAIT_0)
+        {
+            if (acquired > 0)
+            {
+                KeReleaseSemaphore(&tagged->slots_available, (KPRIORITY)0,
+                    (LONG)acquired, FALSE);
             }
 
-            if (CancelEvent != NULL ?
-                KeReadStateEvent(CancelEvent) != 0 :
-                FALSE)
+            KeSetEvent(&tagged->untagged_lock, (KPRIORITY)0, FALSE);
+
+            return STATUS_CANCELLED;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+ImScsiLeaveUntaggedProxy(__in __deref PPROXY_CONNECTION Proxy)
+{
+    PPROXY_TAGGED tagged = Proxy->tagged;
+
+    KeReleaseSemaphore(&tagged->slots_available, (KPRIORITY)0,
+        (LONG)tagged->max_outstanding, FALSE);
+
+    KeSetEvent(&tagged->untagged_lock, (KPRIORITY)0, FALSE);
+}
+
+///
+/// Stream connection version of ImScsiCallProxy. Sends request and waits for
+/// response in lock-step.
+///
+static NTSTATUS
+ImScsiCallStreamProxy(__in __deref PPROXY_CONNECTION Proxy,
+__out __deref PIO_STATUS_BLOCK IoStatusBlock,
+__in __deref PKEVENT CancelEvent OPTIONAL,
+__in __deref PVOID RequestHeader,
+__in ULONG RequestHeaderSize,
+__drv_when(RequestDataSize > 0, __in __deref) PVOID RequestData,
+__in ULONG RequestDataSize,
+__drv_when(ResponseHeaderSize > 0, __out __deref) PVOID ResponseHeader,
+__in ULONG ResponseHeaderSize,
+__drv_when(ResponseDataBufferSize > 0 && *ResponseDataSize > 0, __out) __drv_when(ResponseDataBufferSize > 0, __deref) PVOID ResponseData,
+__in ULONG ResponseDataBufferSize,
+__drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
+{
+    NTSTATUS status;
+
+    PUCHAR io_buffer = NULL;
+    PUCHAR temp_buffer = NULL;
+    ULONG io_size = RequestHeaderSize + RequestDataSize;
+
+    if ((RequestHeaderSize > 0) &&
+        (RequestDataSize > 0))
+    {
+        temp_buffer = (PUCHAR)ImScsiAllocateBuffer(io_size, NULL);
+
+        if (temp_buffer == NULL)
+        {
+            KdPrint(("ImScsi Proxy Client: Memory allocation failed.\n."));
+
+            IoStatusBlock->Status = STATUS_INSUFFICIENT_RESOURCES;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        if (RequestHeaderSize > 0)
+        {
+            RtlCopyMemory(temp_buffer, RequestHeader, RequestHeaderSize);
+        }
+
+        if (RequestDataSize > 0)
+        {
+            RtlCopyMemory(temp_buffer + RequestHeaderSize, RequestData, RequestDataSize);
+
+            InterlockedExchangeAdd64(&Proxy->bytes_copied, RequestDataSize);
+        }
+
+        io_buffer = temp_buffer;
+    }
+    else if (RequestHeaderSize > 0)
+    {
+        io_buffer = (PUCHAR)RequestHeader;
+    }
+    else if (RequestDataSize > 0)
+    {
+        io_buffer = (PUCHAR)RequestData;
+    }
+
+    if (io_size > 0)
+    {
+        if (CancelEvent != NULL ?
+            KeReadStateEvent(CancelEvent) != 0 :
+            FALSE)
+        {
+            KdPrint(("ImScsi Proxy Client: Request cancelled.\n."));
+
+            if (temp_buffer != NULL)
             {
-                KdPrint(("ImScsi Proxy Client: Request cancelled.\n."));
+                ImScsiFreeBuffer(temp_buffer, io_size);
+            }
 
-                IoStatusBlock->Status = STATUS_CANCELLED;
-                IoStatusBlock->Information = 0;
-                return IoStatusBlock->Status;
+            IoStatusBlock->Status = STATUS_CANCELLED;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        status = ImScsiSafeIOStream(Proxy->device,
+            IRP_MJ_WRITE,
+            IoStatusBlock,
+            CancelEvent,
+            io_buffer,
+            io_size);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImScsi Proxy Client: Request error %#x\n.",
+                status));
+
+            if (temp_buffer != NULL)
+            {
+                ImScsiFreeBuffer(temp_buffer, io_size);
             }
 
-            KdPrint2
-                (("ImScsi Proxy Client: Got ok resp. Waiting for data.\n"));
+            IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+    }
+
+    if (temp_buffer != NULL)
+    {
+        ImScsiFreeBuffer(temp_buffer, io_size);
+    }
+
+    if (ResponseHeaderSize > 0)
+    {
+        if (CancelEvent != NULL ?
+            KeReadStateEvent(CancelEvent) != 0 :
+            FALSE)
+        {
+            KdPrint(("ImScsi Proxy Client: Request cancelled.\n."));
+
+            IoStatusBlock->Status = STATUS_CANCELLED;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        status = ImScsiSafeIOStream(Proxy->device,
+            IRP_MJ_READ,
+            IoStatusBlock,
+            CancelEvent,
+            ResponseHeader,
+            ResponseHeaderSize);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImScsi Proxy Client: Response header error %#x\n.",
+                status));
+
+            IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+    }
+
+    if (ResponseDataSize != NULL && *ResponseDataSize > 0)
+    {
+        if (*ResponseDataSize > ResponseDataBufferSize)
+        {
+            KdPrint(("ImScsi Proxy Client: Fatal: Request %u bytes, "
+                "receiving %u bytes.\n",
+                ResponseDataBufferSize, *ResponseDataSize));
+
+            IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        if (CancelEvent != NULL ?
+            KeReadStateEvent(CancelEvent) != 0 :
+            FALSE)
+        {
+            KdPrint(("ImScsi Proxy Client: Request cancelled.\n."));
+
+            IoStatusBlock->Status = STATUS_CANCELLED;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        KdPrint2
+            (("ImScsi Proxy Client: Got ok resp. Waiting for data.\n"));
+
+        status = ImScsiSafeIOStream(Proxy->device,
+            IRP_MJ_READ,
+            IoStatusBlock,
+            CancelEvent,
+            ResponseData,
+            *ResponseDataSize);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImScsi Proxy Client: Response data error %#x\n.",
+                status));
+
+            KdPrint(("ImScsi Proxy Client: Response data %u bytes, "
+                "got %u bytes.\n",
+                *ResponseDataSize,
+                (ULONG)IoStatusBlock->Information));
+
+            IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        KdPrint2
+            (("ImScsi Proxy Client: Received %u byte data stream.\n",
+                IoStatusBlock->Information));
+    }
+
+    IoStatusBlock->Status = STATUS_SUCCESS;
+
+    IoStatusBlock->Information = RequestDataSize;
+
+    if (ResponseDataSize != NULL)
+    {
+        IoStatusBlock->Information += *ResponseDataSize;
+    }
+
+    return IoStatusBlock->Status;
+}
+
+NTSTATUS
+ImScsiCallProxy(__in __deref PPROXY_CONNECTION Proxy,
+__out __deref PIO_STATUS_BLOCK IoStatusBlock,
+__in __deref PKEVENT CancelEvent OPTIONAL,
+__in __deref PVOID RequestHeader,
+__in ULONG RequestHeaderSize,
+__drv_when(RequestDataSize > 0, __in __deref) PVOID RequestData,
+__in ULONG RequestDataSize,
+__drv_when(ResponseHeaderSize > 0, __out __deref) PVOID ResponseHeader,
+__in ULONG ResponseHeaderSize,
+__drv_when(ResponseDataBufferSize > 0 && *ResponseDataSize > 0, __out) __drv_when(ResponseDataBufferSize > 0, __deref) PVOID ResponseData,
+__in ULONG ResponseDataBufferSize,
+__drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
+{
+    NTSTATUS status;
+
+    ASSERT(Proxy != NULL);
 
-            status = ImScsiSafeIOStream(Proxy->device,
-                IRP_MJ_READ,
+    switch (Proxy->connection_type)
+    {
+    case PROXY_CONNECTION::PROXY_CONNECTION_DEVICE:
+    {
+        if (Proxy->tagged == NULL)
+        {
+            return ImScsiCallStreamProxy(Proxy,
                 IoStatusBlock,
                 CancelEvent,
+                RequestHeader,
+                RequestHeaderSize,
+                RequestData,
+                RequestDataSize,
+                ResponseHeader,
+                ResponseHeaderSize,
                 ResponseData,
-                *ResponseDataSize);
-
-            if (!NT_SUCCESS(status))
-            {
-                KdPrint(("ImScsi Proxy Client: Response data error %#x\n.",
-                    status));
-
-                KdPrint(("ImScsi Proxy Client: Response data %u bytes, "
-                    "got %u bytes.\n",
-                    *ResponseDataSize,
-                    (ULONG)IoStatusBlock->Information));
-
-                IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
-                IoStatusBlock->Information = 0;
-                return IoStatusBlock->Status;
-            }
-
-            KdPrint2
-                (("ImScsi Proxy Client: Received %u byte data stream.\n",
-                    IoStatusBlock->Information));
+                ResponseDataBufferSize,
+                ResponseDataSize);
         }
 
-        IoStatusBlock->Status = STATUS_SUCCESS;
-
-        IoStatusBlock->Information = RequestDataSize;
+        // Untagged responses cannot be told apart from tagged ones, so
+        // wait for outstanding tagged requests to complete first.
+        status = ImScsiEnterUntaggedProxy(Proxy, CancelEvent);
 
-        if (ResponseDataSize != NULL)
+        if (!NT_SUCCESS(status))
         {
-            IoStatusBlock->Information += *ResponseDataSize;
+            IoStatusBlock->Status = status;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
         }
 
-        return IoStatusBlock->Status;
+        status = ImScsiCallStreamProxy(Proxy,
+                IoStatusBlock,
+                CancelEvent,
+                RequestHeader,
+                RequestHeaderSize,
+                RequestData,
+                RequestDataSize,
+                ResponseHeader,
+                ResponseHeaderSize,
+                ResponseData,
+                ResponseDataBufferSize,
+                ResponseDataSize);
+
+        ImScsiLeaveUntaggedProxy(Proxy);
+
+        return status;
     }
 
     case PROXY_CONNECTION::PROXY_CONNECTION_SHM:
     {
+        if (Proxy->shm_ring != NULL)
+        {
+            return ImScsiCallShmRingProxy(Proxy,
+                IoStatusBlock,
+                CancelEvent,
+                RequestHeader,
+                RequestHeaderSize,
+                RequestData,
+                RequestDataSize,
+                ResponseHeader,
+                ResponseHeaderSize,
+                ResponseData,
+                ResponseDataBufferSize,
+                ResponseDataSize);
+        }
+
         PKEVENT wait_objects[] = {
             Proxy->response_event,
             CancelEvent
@@ -317,10 +1209,14 @@ __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
                 RequestHeaderSize);
 
         if (RequestDataSize > 0)
+        {
             RtlCopyMemory(Proxy->shared_memory + IMDPROXY_HEADER_SIZE,
                 RequestData,
                 RequestDataSize);
 
+            InterlockedExchangeAdd64(&Proxy->bytes_copied, RequestDataSize);
+        }
+
 #pragma warning(suppress: 28160)
         KeSetEvent(Proxy->request_event, (KPRIORITY)0, TRUE);
 
@@ -371,6 +1267,8 @@ __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
                     Proxy->shared_memory + IMDPROXY_HEADER_SIZE,
                     *ResponseDataSize);
 
+                InterlockedExchangeAdd64(&Proxy->bytes_copied, *ResponseDataSize);
+
                 IoStatusBlock->Information = *ResponseDataSize;
             }
         }
@@ -685,6 +1583,176 @@ __in ULONG ProxyInfoResponseLength)
     return IoStatusBlock->Status;
 }
 
+///
+/// Asks a shared memory proxy server to switch to the multi-slot ring layout.
+/// Returns STATUS_NOT_SUPPORTED if server declines, in which case connection
+/// continues to use the single mailbox layout. Any other error means that
+/// the connection is no longer usable.
+///
+NTSTATUS
+ImScsiSetupShmRingProxy(__inout __deref PPROXY_CONNECTION Proxy,
+__out __deref PIO_STATUS_BLOCK IoStatusBlock,
+__in __deref PKEVENT CancelEvent OPTIONAL,
+__in ULONG SlotCount)
+{
+    IMDPROXY_SHM_RING_SETUP_REQ setup_req;
+    IMDPROXY_SHM_RING_SETUP_RESP setup_resp;
+    PPROXY_SHM_RING ring;
+    NTSTATUS status;
+
+    ASSERT(Proxy != NULL);
+    ASSERT(IoStatusBlock != NULL);
+
+    if ((Proxy->connection_type != PROXY_CONNECTION::PROXY_CONNECTION_SHM) ||
+        (Proxy->shm_ring != NULL) ||
+        (SlotCount < 2) ||
+        (SlotCount > IMDPROXY_SHM_RING_MAX_SLOTS))
+    {
+        IoStatusBlock->Status = STATUS_INVALID_PARAMETER;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    setup_req.request_code = IMDPROXY_REQ_SHM_RING_SETUP;
+    setup_req.version = IMDPROXY_SHM_RING_VERSION;
+    setup_req.slot_count = SlotCount;
+
+    KdPrint(("ImScsi Proxy Client: Sending IMDPROXY_REQ_SHM_RING_SETUP for %u slots.\n",
+        SlotCount));
+
+    status = ImScsiCallProxy(Proxy,
+        IoStatusBlock,
+        CancelEvent,
+        &setup_req,
+        sizeof(setup_req),
+        NULL,
+        0,
+        &setup_resp,
+        sizeof(setup_resp),
+        NULL,
+        0,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        IoStatusBlock->Status = status;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    if (setup_resp.errorno != 0)
+    {
+        KdPrint(("ImScsi Proxy Client: Server declined ring layout: %#I64x.\n",
+            setup_resp.errorno));
+
+        IoStatusBlock->Status = STATUS_NOT_SUPPORTED;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    if ((setup_resp.slot_count < 1) ||
+        (setup_resp.slot_count > SlotCount) ||
+        (setup_resp.slot_size != IMDPROXY_SHM_RING_SLOT_SIZE(
+            Proxy->shared_memory_size, setup_resp.slot_count)) ||
+        (setup_resp.slot_size <= IMDPROXY_HEADER_SIZE))
+    {
+        DbgPrint("ImScsi Proxy Client: Invalid ring layout from server, "
+            "%I64u slots of %#I64x bytes.\n",
+            setup_resp.slot_count, setup_resp.slot_size);
+
+        IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    ring = (PPROXY_SHM_RING)ExAllocatePoolWithTag(NonPagedPool,
+        sizeof(PROXY_SHM_RING), MP_TAG_GENERAL);
+
+    if (ring == NULL)
+    {
+        IoStatusBlock->Status = STATUS_INSUFFICIENT_RESOURCES;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    RtlZeroMemory(ring, sizeof(PROXY_SHM_RING));
+
+    ring->slot_count = (ULONG)setup_resp.slot_count;
+    ring->slot_size = (ULONG_PTR)setup_resp.slot_size;
+    ring->free_slots = (LONG)((1ULL << ring->slot_count) - 1);
+
+    KeInitializeSemaphore(&ring->slots_available,
+        (LONG)ring->slot_count, (LONG)ring->slot_count);
+
+    for (ULONG i = 0; i < ring->slot_count; i++)
+    {
+        KeInitializeEvent(&ring->slot_completed[i], NotificationEvent, FALSE);
+    }
+
+    Proxy->shm_ring = ring;
+
+    KdPrint(("ImScsi Proxy Client: Ring layout active, %u slots with %#Ix bytes data.\n",
+        ring->slot_count, ring->slot_size - IMDPROXY_HEADER_SIZE));
+
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    IoStatusBlock->Information = 0;
+    return IoStatusBlock->Status;
+}
+
+///
+/// Starts using tagged read and write requests on a stream connection to a
+/// server that has advertised IMDPROXY_FLAG_SUPPORTS_TAGGED. No request is
+/// sent to server, it accepts tagged requests at any time.
+///
+NTSTATUS
+ImScsiSetupTaggedProxy(__inout __deref PPROXY_CONNECTION Proxy,
+__in ULONG MaxOutstanding)
+{
+    PPROXY_TAGGED tagged;
+
+    ASSERT(Proxy != NULL);
+
+    if ((Proxy->connection_type != PROXY_CONNECTION::PROXY_CONNECTION_DEVICE) ||
+        (Proxy->tagged != NULL) ||
+        (MaxOutstanding < 2) ||
+        (MaxOutstanding > IMSCSI_TAGGED_PROXY_MAX_OUTSTANDING))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    tagged = (PPROXY_TAGGED)ExAllocatePoolWithTag(NonPagedPool,
+        sizeof(PROXY_TAGGED), MP_TAG_GENERAL);
+
+    if (tagged == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(tagged, sizeof(PROXY_TAGGED));
+
+    tagged->max_outstanding = MaxOutstanding;
+    tagged->free_slots = (LONG)((1UL << MaxOutstanding) - 1);
+
+    KeInitializeSemaphore(&tagged->slots_available,
+        (LONG)MaxOutstanding, (LONG)MaxOutstanding);
+
+    KeInitializeEvent(&tagged->send_lock, SynchronizationEvent, TRUE);
+    KeInitializeEvent(&tagged->receive_lock, SynchronizationEvent, TRUE);
+    KeInitializeEvent(&tagged->untagged_lock, SynchronizationEvent, TRUE);
+
+    for (ULONG i = 0; i < MaxOutstanding; i++)
+    {
+        KeInitializeEvent(&tagged->requests[i].completed, NotificationEvent, FALSE);
+    }
+
+    Proxy->tagged = tagged;
+
+    KdPrint(("ImScsi Proxy Client: Tagged requests active, up to %u outstanding.\n",
+        MaxOutstanding));
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS
 ImScsiReadProxy(__in __deref PPROXY_CONNECTION Proxy,
 __out __deref PIO_STATUS_BLOCK IoStatusBlock,
@@ -706,8 +1774,44 @@ __in __deref PLARGE_INTEGER ByteOffset)
     ASSERT(Buffer != NULL);
     ASSERT(ByteOffset != NULL);
 
+    if ((Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_DEVICE) &&
+        (Proxy->tagged != NULL))
+    {
+        IMDPROXY_TAGGED_RESP tagged_resp;
+
+        status = ImScsiCallTaggedProxy(Proxy,
+            IoStatusBlock,
+            CancelEvent,
+            IMDPROXY_REQ_READ_TAGGED,
+            ByteOffset->QuadPart,
+            Length,
+            NULL,
+            Buffer,
+            &tagged_resp);
+
+        if (!NT_SUCCESS(status))
+        {
+            IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        if (tagged_resp.errorno != 0)
+        {
+            KdPrint(("ImScsi Proxy Client: Server returned error %#I64x.\n",
+                tagged_resp.errorno));
+            IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        IoStatusBlock->Status = STATUS_SUCCESS;
+        IoStatusBlock->Information = (ULONG_PTR)tagged_resp.length;
+        return IoStatusBlock->Status;
+    }
+
     if (Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
-        max_transfer_size = Proxy->shared_memory_size - IMDPROXY_HEADER_SIZE;
+        max_transfer_size = ImScsiGetShmProxyDataSize(Proxy);
     else
         max_transfer_size = Length;
 
@@ -799,8 +1903,55 @@ __in __deref PLARGE_INTEGER ByteOffset)
     ASSERT(Buffer != NULL);
     ASSERT(ByteOffset != NULL);
 
+    if ((Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_DEVICE) &&
+        (Proxy->tagged != NULL))
+    {
+        IMDPROXY_TAGGED_RESP tagged_resp;
+
+        status = ImScsiCallTaggedProxy(Proxy,
+            IoStatusBlock,
+            CancelEvent,
+            IMDPROXY_REQ_WRITE_TAGGED,
+            ByteOffset->QuadPart,
+            Length,
+            Buffer,
+            NULL,
+            &tagged_resp);
+
+        if (!NT_SUCCESS(status))
+        {
+            IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        if (tagged_resp.errorno != 0)
+        {
+            KdPrint(("ImScsi Proxy Client: Server returned error 0x%I64x.\n",
+                tagged_resp.errorno));
+            IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        if (tagged_resp.length != Length)
+        {
+            KdPrint(("ImScsi Proxy Client: IMDPROXY_REQ_WRITE_TAGGED %u bytes, "
+                "response %u bytes.\n",
+                Length,
+                (ULONG)tagged_resp.length));
+            IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+
+        IoStatusBlock->Status = STATUS_SUCCESS;
+        IoStatusBlock->Information = Length;
+        return IoStatusBlock->Status;
+    }
+
     if (Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
-        max_transfer_size = Proxy->shared_memory_size - IMDPROXY_HEADER_SIZE;
+        max_transfer_size = ImScsiGetShmProxyDataSize(Proxy);
     else
         max_transfer_size = Length;
 
@@ -894,6 +2045,86 @@ __in __deref PLARGE_INTEGER ByteOffset)
     //return IoStatusBlock->Status;
 }
 
+///
+/// Sends an IMDPROXY_REQ_READV or IMDPROXY_REQ_WRITEV request built with
+/// ImdProxyInitVectoredRequest and ImdProxyAddVectoredExtent. Buffer holds
+/// data for all extents, in extent order, Request->length bytes in total.
+///
+NTSTATUS
+ImScsiVectoredProxy(__in __deref PPROXY_CONNECTION Proxy,
+__out __deref PIO_STATUS_BLOCK IoStatusBlock,
+__in __deref PKEVENT CancelEvent,
+__in __deref PIMDPROXY_VECTORED_REQ Request,
+PVOID Buffer)
+{
+    IMDPROXY_VECTORED_RESP vectored_resp;
+    ULONG header_size = (ULONG)IMDPROXY_VECTORED_REQ_SIZE(Request->extent_count);
+    BOOLEAN is_read = Request->request_code == IMDPROXY_REQ_READV;
+    NTSTATUS status;
+
+    ASSERT(Proxy != NULL);
+    ASSERT(IoStatusBlock != NULL);
+    ASSERT(Buffer != NULL);
+
+    if ((Request->extent_count == 0) ||
+        (Request->length > MAXULONG) ||
+        ((Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM) &&
+        (Request->length > ImScsiGetShmProxyDataSize(Proxy))))
+    {
+        IoStatusBlock->Status = STATUS_INVALID_PARAMETER;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    KdPrint2(("ImScsi Proxy Client: Vectored request %#I64x with %I64u extents, 0x%I64x bytes.\n",
+        Request->request_code, Request->extent_count, Request->length));
+
+    vectored_resp.length = Request->length;
+
+    status = ImScsiCallProxy(Proxy,
+        IoStatusBlock,
+        CancelEvent,
+        Request,
+        header_size,
+        is_read ? NULL : Buffer,
+        is_read ? 0 : (ULONG)Request->length,
+        &vectored_resp,
+        sizeof(vectored_resp),
+        is_read ? Buffer : NULL,
+        is_read ? (ULONG)Request->length : 0,
+        is_read ? (PULONG)&vectored_resp.length : NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    if (vectored_resp.errorno != 0)
+    {
+        KdPrint(("ImScsi Proxy Client: Server returned error %#I64x.\n",
+            vectored_resp.errorno));
+        IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    if (vectored_resp.length != Request->length)
+    {
+        KdPrint(("ImScsi Proxy Client: Vectored request 0x%I64x bytes, "
+            "response 0x%I64x bytes.\n",
+            Request->length, vectored_resp.length));
+        IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    IoStatusBlock->Information = (ULONG_PTR)Request->length;
+    return IoStatusBlock->Status;
+}
+
 NTSTATUS
 ImScsiUnmapOrZeroProxy(
     __in __deref PPROXY_CONNECTION Proxy,
@@ -913,7 +2144,7 @@ ImScsiUnmapOrZeroProxy(
     ASSERT(Ranges != NULL);
 
     if ((Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM) &&
-        (byte_size >= (Proxy->shared_memory_size - IMDPROXY_HEADER_SIZE)))
+        (byte_size >= ImScsiGetShmProxyDataSize(Proxy)))
     {
         status = STATUS_BUFFER_OVERFLOW;
         IoStatusBlock->Information = 0;
@@ -0,0 +1,372 @@
+/// readcache.cpp
+/// Per-LU cache of recently transferred sector ranges. Keeps data of
+/// completed reads and writes in non-paged buffers, so that repeated reads
+/// of the same sectors, such as file system metadata, can be completed
+/// directly in the StartIo routine without a trip to the image file or
+/// proxy service.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "phdskmnt.h"
+
+///
+/// Entries are kept sorted by starting sector and never overlap, so that a
+/// lookup is a binary search. Eviction uses the CLOCK algorithm. New entries
+/// start without reference bit, so that data read once, for example by a
+/// large sequential copy, is evicted before data that has been read again.
+///
+
+#define ImScsiReadCacheEntryEnd(pLUExt, Entry) \
+    ((Entry)->StartSector + ((LONGLONG)(Entry)->Length >> (pLUExt)->BlockPower))
+
+/// Index of first entry starting after Sector
+static ULONG
+ImScsiReadCacheUpperBound(
+    __in PIMSCSI_READ_CACHE Cache,
+    __in LONGLONG Sector)
+{
+    ULONG low = 0;
+    ULONG high = Cache->Count;
+
+    while (low < high)
+    {
+        ULONG middle = low + ((high - low) >> 1);
+
+        if (Cache->Entries[middle].StartSector <= Sector)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/// Removes entry at Index. Caller holds cache lock.
+static VOID
+ImScsiReadCacheRemoveEntry(
+    __in PIMSCSI_READ_CACHE Cache,
+    __in ULONG Index)
+{
+    ImScsiFreeBuffer(Cache->Entries[Index].Buffer, Cache->Entries[Index].Length);
+
+    Cache->Size -= Cache->Entries[Index].Length;
+
+    Cache->Count--;
+
+    RtlMoveMemory(&Cache->Entries[Index], &Cache->Entries[Index + 1],
+        (Cache->Count - Index) * sizeof(*Cache->Entries));
+
+    if (Cache->Hand > Index)
+    {
+        Cache->Hand--;
+    }
+}
+
+/// Removes all entries with data for any sector in range from StartSector
+/// up to, but not including, EndSector. Caller holds cache lock.
+static VOID
+ImScsiReadCacheRemoveRange(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in LONGLONG StartSector,
+    __in LONGLONG EndSector)
+{
+    PIMSCSI_READ_CACHE cache = &pLUExt->ReadCache;
+    ULONG index = ImScsiReadCacheUpperBound(cache, StartSector);
+
+    if ((index > 0) &&
+        (ImScsiReadCacheEntryEnd(pLUExt, &cache->Entries[index - 1]) > StartSector))
+    {
+        index--;
+    }
+
+    while ((index < cache->Count) &&
+        (cache->Entries[index].StartSector < EndSector))
+    {
+        ImScsiReadCacheRemoveEntry(cache, index);
+    }
+}
+
+/// Evicts one entry, first one found by the clock hand that has not been
+/// referenced since hand passed it last time. Caller holds cache lock.
+static VOID
+ImScsiReadCacheEvict(
+    __in pHW_LU_EXTENSION pLUExt)
+{
+    PIMSCSI_READ_CACHE cache = &pLUExt->ReadCache;
+
+    for (;;)
+    {
+        if (cache->Hand >= cache->Count)
+        {
+            cache->Hand = 0;
+        }
+
+        if (!cache->Entries[cache->Hand].Referenced)
+        {
+            break;
+        }
+
+        cache->Entries[cache->Hand].Referenced = FALSE;
+        cache->Hand++;
+    }
+
+    ImScsiReadCacheRemoveEntry(cache, cache->Hand);
+
+    InterlockedIncrement64(&pLUExt->Statistics.ReadCacheEvictions);
+}
+
+VOID
+ImScsiInitializeReadCache(
+    __inout __deref pHW_LU_EXTENSION pLUExt)
+{
+    PIMSCSI_READ_CACHE cache = &pLUExt->ReadCache;
+    ULONG max_size = pMPDrvInfoGlobal->MPRegInfo.ReadCacheSize;
+
+    KeInitializeSpinLock(&cache->Lock);
+
+    // Shared images can be modified by other hosts, memory backed images
+    // would only get a second copy of data that is already in memory.
+    if ((max_size == 0) ||
+        pLUExt->SharedImage ||
+        pLUExt->VMDisk ||
+        pLUExt->AWEAllocDisk)
+    {
+        return;
+    }
+
+    cache->Entries = (PIMSCSI_READ_CACHE_ENTRY)
+        ExAllocatePoolWithTag(NonPagedPool,
+            IMSCSI_READ_CACHE_MAX_ENTRIES * sizeof(*cache->Entries),
+            MP_TAG_GENERAL);
+
+    if (cache->Entries == NULL)
+    {
+        DbgPrint("PhDskMnt::ImScsiInitializeReadCache: Memory allocation failed. Read cache disabled.\n");
+        return;
+    }
+
+    cache->MaxSize = max_size;
+    cache->MaxEntrySize = max_size / IMSCSI_READ_CACHE_MIN_ENTRIES;
+
+    KdPrint(("PhDskMnt::ImScsiInitializeReadCache: Read cache of %u bytes for pLUExt=0x%p.\n",
+        max_size, pLUExt));
+}
+
+VOID
+ImScsiFreeReadCache(
+    __inout __deref pHW_LU_EXTENSION pLUExt)
+{
+    PIMSCSI_READ_CACHE cache = &pLUExt->ReadCache;
+
+    if (cache->Entries == NULL)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < cache->Count; i++)
+    {
+        ImScsiFreeBuffer(cache->Entries[i].Buffer, cache->Entries[i].Length);
+    }
+
+    ExFreePoolWithTag(cache->Entries, MP_TAG_GENERAL);
+
+    cache->Entries = NULL;
+    cache->Count = 0;
+    cache->Size = 0;
+}
+
+BOOLEAN
+ImScsiReadCacheLookup(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in LONGLONG StartSector,
+    PVOID Buffer,
+    __in ULONG Length,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    PIMSCSI_READ_CACHE cache = &pLUExt->ReadCache;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    LONGLONG sector = StartSector;
+    PUCHAR ptr = (PUCHAR)Buffer;
+    ULONG remaining = Length;
+    ULONG first;
+    ULONG index;
+
+    if ((cache->Entries == NULL) || (Length == 0))
+    {
+        return FALSE;
+    }
+
+    ImScsiAcquireLock(&cache->Lock, &lock_handle, *LowestAssumedIrql);
+
+    first = index = ImScsiReadCacheUpperBound(cache, StartSector);
+
+    if (index > 0)
+    {
+        first = --index;
+
+        // Request can be served from several adjacent entries
+        while ((remaining > 0) &&
+            (index < cache->Count) &&
+            (cache->Entries[index].StartSector <= sector))
+        {
+            PIMSCSI_READ_CACHE_ENTRY entry = &cache->Entries[index];
+            ULONG offset = (ULONG)((sector - entry->StartSector) << pLUExt->BlockPower);
+            ULONG chunk;
+
+            if (offset >= entry->Length)
+            {
+                break;
+            }
+
+            chunk = min(remaining, entry->Length - offset);
+
+            RtlCopyMemory(ptr, entry->Buffer + offset, chunk);
+
+            ptr += chunk;
+            remaining -= chunk;
+            sector += chunk >> pLUExt->BlockPower;
+            index++;
+        }
+
+        if (remaining == 0)
+        {
+            for (ULONG i = first; i < index; i++)
+            {
+                cache->Entries[i].Referenced = TRUE;
+            }
+        }
+    }
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    if (remaining != 0)
+    {
+        InterlockedIncrement64(&pLUExt->Statistics.ReadCacheMisses);
+        return FALSE;
+    }
+
+    InterlockedIncrement64(&pLUExt->Statistics.ReadCacheHits);
+    return TRUE;
+}
+
+VOID
+ImScsiReadCacheInsert(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in LONGLONG StartSector,
+    PVOID Buffer,
+    __in ULONG Length,
+    __in LONG Sequence,
+    __in BOOLEAN IsWrite,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    PIMSCSI_READ_CACHE cache = &pLUExt->ReadCache;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    LONGLONG end_sector = StartSector + ((LONGLONG)Length >> pLUExt->BlockPower);
+    BOOLEAN valid;
+    ULONG index;
+
+    if (cache->Entries == NULL)
+    {
+        ImScsiFreeBuffer(Buffer, Length);
+        return;
+    }
+
+    ImScsiAcquireLock(&cache->Lock, &lock_handle, *LowestAssumedIrql);
+
+    // Data is only known to be current if nothing has been written since
+    // the request was sent. Written data replaces whatever was cached for
+    // the range in any case.
+    valid = (Sequence == cache->Sequence) &&
+        (Length > 0) &&
+        (Length <= cache->MaxEntrySize);
+
+    if (valid || IsWrite)
+    {
+        ImScsiReadCacheRemoveRange(pLUExt, StartSector, end_sector);
+    }
+
+    if (IsWrite)
+    {
+        InterlockedIncrement(&cache->Sequence);
+    }
+
+    if (!valid)
+    {
+        ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+        ImScsiFreeBuffer(Buffer, Length);
+        return;
+    }
+
+    while ((cache->Count > 0) &&
+        ((cache->Count >= IMSCSI_READ_CACHE_MAX_ENTRIES) ||
+        ((ULONGLONG)cache->Size + Length > cache->MaxSize)))
+    {
+        ImScsiReadCacheEvict(pLUExt);
+    }
+
+    index = ImScsiReadCacheUpperBound(cache, StartSector);
+
+    RtlMoveMemory(&cache->Entries[index + 1], &cache->Entries[index],
+        (cache->Count - index) * sizeof(*cache->Entries));
+
+    cache->Entries[index].StartSector = StartSector;
+    cache->Entries[index].Length = Length;
+    cache->Entries[index].Referenced = FALSE;
+    cache->Entries[index].Buffer = (PUCHAR)Buffer;
+
+    cache->Count++;
+    cache->Size += Length;
+
+    if ((cache->Hand >= index) && (cache->Count > 1))
+    {
+        cache->Hand++;
+    }
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+}
+
+VOID
+ImScsiReadCacheInvalidate(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in LONGLONG StartSector,
+    __in ULONGLONG NumberOfSectors,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    PIMSCSI_READ_CACHE cache = &pLUExt->ReadCache;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    LONGLONG end_sector;
+
+    if (cache->Entries == NULL)
+    {
+        return;
+    }
+
+    if (NumberOfSectors > (ULONGLONG)(MAXLONGLONG - StartSector))
+    {
+        end_sector = MAXLONGLONG;
+    }
+    else
+    {
+        end_sector = StartSector + (LONGLONG)NumberOfSectors;
+    }
+
+    ImScsiAcquireLock(&cache->Lock, &lock_handle, *LowestAssumedIrql);
+
+    ImScsiReadCacheRemoveRange(pLUExt, StartSector, end_sector);
+
+    InterlockedIncrement(&cache->Sequence);
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+}
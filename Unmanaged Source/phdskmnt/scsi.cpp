@@ -1240,7 +1240,7 @@ ScsiOpVPDDiskUnit(
                     pLUExt->Proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
                 {
                     ULONG_PTR max_dsrs =
-                        (pLUExt->Proxy.shared_memory_size - sizeof(IMDPROXY_HEADER_SIZE)) /
+                        ImScsiGetShmProxyDataSize(&pLUExt->Proxy) /
                         sizeof(DEVICE_DATA_SET_RANGE);
 
                     maxLbaCountPerCmd =
@@ -1592,10 +1592,8 @@ __in PKIRQL               LowestAssumedIrql
 {
     PCDB                         pCdb = (PCDB)pSrb->Cdb;
     LONGLONG                     startingSector;
-    LONGLONG                     startingOffset;
     ULONG                        numBlocks;
     pMP_WorkRtnParms             pWkRtnParms;
-    KLOCK_QUEUE_HANDLE           lock_handle;
 
     KdPrint2(("PhDskMnt::ScsiOpReadWrite:  pHBAExt = 0x%p, pLUExt=0x%p, pSrb=0x%p\n", pHBAExt, pLUExt, pSrb));
 
@@ -1621,8 +1619,6 @@ __in PKIRQL               LowestAssumedIrql
         return;
     }
 
-    startingOffset = startingSector << pLUExt->BlockPower;
-
     numBlocks = pSrb->DataTransferLength >> pLUExt->BlockPower;
 
     KdPrint2(("PhDskMnt::ScsiOpReadWrite action: 0x%X, starting sector: 0x%I64X, number of blocks: 0x%X\n", (int)pSrb->Cdb[0], startingSector, numBlocks));
@@ -1675,17 +1671,10 @@ __in PKIRQL               LowestAssumedIrql
     }
 
     // Intermediate non-paged cache
-    if ((pLUExt->FileObject == NULL) &&
-        (pLUExt->LastIoLength > 0) &&
-        !pLUExt->SharedImage)
+    if (pLUExt->ReadCache.Entries != NULL)
     {
-        ImScsiAcquireLock(&pLUExt->LastIoLock, &lock_handle, *LowestAssumedIrql);
-
-        if (((pSrb->Cdb[0] == SCSIOP_READ) ||
-            (pSrb->Cdb[0] == SCSIOP_READ16)) &&
-            (pLUExt->LastIoBuffer != NULL) &&
-            (pLUExt->LastIoStartSector <= startingSector) &&
-            ((startingOffset - (pLUExt->LastIoStartSector << pLUExt->BlockPower) + pSrb->DataTransferLength) <= pLUExt->LastIoLength))
+        if ((pSrb->Cdb[0] == SCSIOP_READ) ||
+            (pSrb->Cdb[0] == SCSIOP_READ16))
         {
             PVOID sysaddress = NULL;
             ULONG storage_status;
@@ -1693,34 +1682,33 @@ __in PKIRQL               LowestAssumedIrql
             storage_status = StoragePortGetSystemAddress(pHBAExt, pSrb, &sysaddress);
             if ((storage_status != STORAGE_STATUS_SUCCESS) || (sysaddress == NULL))
             {
-                ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
-
                 DbgPrint("PhDskMnt::ScsiOpReadWrite: StorPortGetSystemAddress failed: status=0x%X address=0x%p translated=0x%p\n",
                     storage_status,
                     pSrb->DataBuffer,
                     sysaddress);
 
                 ScsiSetCheckCondition(pSrb, SRB_STATUS_ERROR, SCSI_SENSE_HARDWARE_ERROR, SCSI_ADSENSE_NO_SENSE, 0);
-            }
-            else
-            {
-                KdPrint(("PhDskMnt::ScsiOpReadWrite: Intermediate cache hit.\n"));
 
-                RtlMoveMemory(
-                    sysaddress,
-                    (PUCHAR)pLUExt->LastIoBuffer + startingOffset - (pLUExt->LastIoStartSector << pLUExt->BlockPower),
-                    pSrb->DataTransferLength
-                    );
+                return;
+            }
 
-                ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+            if (ImScsiReadCacheLookup(pLUExt, startingSector, sysaddress,
+                pSrb->DataTransferLength, LowestAssumedIrql))
+            {
+                KdPrint2(("PhDskMnt::ScsiOpReadWrite: Intermediate cache hit.\n"));
 
                 ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
-            }
 
-            return;
+                return;
+            }
+        }
+        else
+        {
+            // Reads that arrive while this write is in progress must not
+            // be served data it is about to overwrite.
+            ImScsiReadCacheInvalidate(pLUExt, startingSector, numBlocks,
+                LowestAssumedIrql);
         }
-
-        ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
     }
 
     pWkRtnParms = ImScsiCreateWorkItem(pHBAExt, pLUExt, pSrb);
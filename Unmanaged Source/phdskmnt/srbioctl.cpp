@@ -156,6 +156,32 @@ __inout __deref PKIRQL      LowestAssumedIrql
         break;
     }
 
+    case SMP_IMSCSI_QUERY_STATISTICS:
+    {
+        PSRB_IMSCSI_QUERY_STATISTICS srb_buffer = (PSRB_IMSCSI_QUERY_STATISTICS)pSrb->DataBuffer;
+
+        KdPrint2(("PhDskMnt::ScsiIoControl: Request SMP_IMSCSI_QUERY_STATISTICS.\n"));
+
+        // Callers built with an older, shorter, version of statistics
+        // structure are accepted.
+        if ((pSrb->DataTransferLength < FIELD_OFFSET(SRB_IMSCSI_QUERY_STATISTICS, Statistics)) ||
+            (srb_buffer->SrbIoControl.Length <
+                FIELD_OFFSET(SRB_IMSCSI_QUERY_STATISTICS, Statistics) - sizeof(SRB_IO_CONTROL)))
+        {
+            KdPrint(("PhDskMnt::ScsiIoControl: Bad SMP_IMSCSI_QUERY_STATISTICS request.\n"));
+
+            pSrb->DataTransferLength = 0;
+            ScsiSetError(pSrb, SRB_STATUS_DATA_OVERRUN);
+            goto Done;
+        }
+
+        srb_io_control->ReturnCode = ImScsiQueryStatistics(pHBAExt, srb_buffer, &pSrb->DataTransferLength, LowestAssumedIrql);
+
+        ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+
+        break;
+    }
+
     case SMP_IMSCSI_QUERY_ADAPTER:
     {
         PSRB_IMSCSI_QUERY_ADAPTER srb_buffer = (PSRB_IMSCSI_QUERY_ADAPTER)pSrb->DataBuffer;
@@ -416,6 +442,8 @@ __inout __deref PKIRQL              LowestAssumedIrql
     create_data->Fields.DeviceNumber = device_extension->DeviceNumber;
     create_data->Fields.DiskSize = device_extension->DiskSize;
     create_data->Fields.BytesPerSector = 1UL << device_extension->BlockPower;
+    create_data->Fields.WorkerThreads =
+        device_extension->NumberOfAdditionalWorkerThreads + 1;
 
     create_data->Fields.Flags = 0;
     if (device_extension->ReadOnly)
@@ -470,6 +498,93 @@ __inout __deref PKIRQL              LowestAssumedIrql
     return STATUS_SUCCESS;
 }
 
+NTSTATUS
+ImScsiQueryStatistics(
+__in            pHW_HBA_EXT                     pHBAExt,
+__inout __deref PSRB_IMSCSI_QUERY_STATISTICS    query_data,
+__inout __deref PULONG                          Length,
+__inout __deref PKIRQL                          LowestAssumedIrql
+)
+{
+    pHW_LU_EXTENSION        device_extension = NULL;
+    UCHAR                   srb_status;
+    IMSCSI_DEVICE_STATISTICS statistics;
+    ULONG                   length;
+
+    KdPrint2(("PhDskMnt::ImScsiQueryStatistics: Device %i:%i:%i.\n",
+        (int)query_data->DeviceNumber.PathId,
+        (int)query_data->DeviceNumber.TargetId,
+        (int)query_data->DeviceNumber.Lun));
+
+    srb_status = ScsiGetLUExtension(
+        pHBAExt,
+        &device_extension,
+        query_data->DeviceNumber.PathId,
+        query_data->DeviceNumber.TargetId,
+        query_data->DeviceNumber.Lun,
+        LowestAssumedIrql
+        );
+
+    if (srb_status != SRB_STATUS_SUCCESS)
+    {
+        KdPrint(("PhDskMnt::ImScsiQueryStatistics: Device not found.\n"));
+        *Length = sizeof(SRB_IO_CONTROL);
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    // Counters are updated without locks by worker threads, so each of
+    // them is read individually to avoid torn 64 bit values on x86.
+    statistics.ReadRequests = InterlockedCompareExchange64(
+        &device_extension->Statistics.ReadRequests, 0, 0);
+    statistics.WriteRequests = InterlockedCompareExchange64(
+        &device_extension->Statistics.WriteRequests, 0, 0);
+    statistics.BytesRead = InterlockedCompareExchange64(
+        &device_extension->Statistics.BytesRead, 0, 0);
+    statistics.BytesWritten = InterlockedCompareExchange64(
+        &device_extension->Statistics.BytesWritten, 0, 0);
+    statistics.BounceBufferAllocations = InterlockedCompareExchange64(
+        &device_extension->Statistics.BounceBufferAllocations, 0, 0);
+    statistics.BounceBytesCopied = InterlockedCompareExchange64(
+        &device_extension->Statistics.BounceBytesCopied, 0, 0);
+
+    if (device_extension->UseProxy)
+        statistics.ProxyBytesCopied = InterlockedCompareExchange64(
+            &device_extension->Proxy.bytes_copied, 0, 0);
+    else
+        statistics.ProxyBytesCopied = 0;
+
+    statistics.ReadCacheHits = InterlockedCompareExchange64(
+        &device_extension->Statistics.ReadCacheHits, 0, 0);
+    statistics.ReadCacheMisses = InterlockedCompareExchange64(
+        &device_extension->Statistics.ReadCacheMisses, 0, 0);
+    statistics.ReadCacheEvictions = InterlockedCompareExchange64(
+        &device_extension->Statistics.ReadCacheEvictions, 0, 0);
+
+    statistics.BufferPoolHits = InterlockedCompareExchange64(
+        &device_extension->Statistics.BufferPoolHits, 0, 0);
+    statistics.BufferPoolFallbacks = InterlockedCompareExchange64(
+        &device_extension->Statistics.BufferPoolFallbacks, 0, 0);
+
+    statistics.ZeroBytesSaved = InterlockedCompareExchange64(
+        &device_extension->Statistics.ZeroBytesSaved, 0, 0);
+    statistics.ZeroRunSplitWrites = InterlockedCompareExchange64(
+        &device_extension->Statistics.ZeroRunSplitWrites, 0, 0);
+
+    // Older callers may know about fewer counters than this driver version,
+    // newer callers may know about more. Return as many as fit.
+    length = *Length - FIELD_OFFSET(SRB_IMSCSI_QUERY_STATISTICS, Statistics);
+
+    if (length > sizeof(statistics))
+        length = sizeof(statistics);
+
+    RtlCopyMemory(&query_data->Statistics, &statistics, length);
+
+    *Length = FIELD_OFFSET(SRB_IMSCSI_QUERY_STATISTICS, Statistics) + length;
+
+    KdPrint2(("PhDskMnt::ImScsiQueryStatistics: End.\n"));
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS
 ImScsiQueryAdapter(
 __in            pHW_HBA_EXT                 pHBAExt,
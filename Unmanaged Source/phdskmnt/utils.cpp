@@ -39,6 +39,11 @@ None
 
     defRegInfo.NumberOfBuses = DEFAULT_NUMBER_OF_BUSES;
     defRegInfo.InitiatorID = DEFAULT_INITIATOR_ID;
+    defRegInfo.ReadCacheSize = DEFAULT_READ_CACHE_SIZE;
+    defRegInfo.WorkerThreads = DEFAULT_WORKER_THREADS;
+    defRegInfo.AsyncQueueDepth = DEFAULT_ASYNC_QUEUE_DEPTH;
+    defRegInfo.BufferPoolSize = DEFAULT_BUFFER_POOL_SIZE;
+    defRegInfo.ZeroRunGranularity = DEFAULT_ZERO_RUN_GRANULARITY;
 
     RtlInitUnicodeString(&defRegInfo.VendorId, VENDOR_ID);
     RtlInitUnicodeString(&defRegInfo.ProductId, PRODUCT_ID);
@@ -60,6 +65,11 @@ None
 
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"NumberOfBuses", &pRegInfo->NumberOfBuses, REG_DWORD, &defRegInfo.NumberOfBuses, sizeof(ULONG) },
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"InitiatorID", &pRegInfo->InitiatorID, REG_DWORD, &defRegInfo.InitiatorID, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"ReadCacheSize", &pRegInfo->ReadCacheSize, REG_DWORD, &defRegInfo.ReadCacheSize, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"WorkerThreads", &pRegInfo->WorkerThreads, REG_DWORD, &defRegInfo.WorkerThreads, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"AsyncQueueDepth", &pRegInfo->AsyncQueueDepth, REG_DWORD, &defRegInfo.AsyncQueueDepth, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"BufferPoolSize", &pRegInfo->BufferPoolSize, REG_DWORD, &defRegInfo.BufferPoolSize, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"ZeroRunGranularity", &pRegInfo->ZeroRunGranularity, REG_DWORD, &defRegInfo.ZeroRunGranularity, sizeof(ULONG) },
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"VendorId", &pRegInfo->VendorId, REG_SZ, defRegInfo.VendorId.Buffer, 0 },
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"ProductId", &pRegInfo->ProductId, REG_SZ, defRegInfo.ProductId.Buffer, 0 },
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"ProductRevision", &pRegInfo->ProductRevision, REG_SZ, defRegInfo.ProductRevision.Buffer, 0 },
@@ -81,6 +91,11 @@ None
         if (!NT_SUCCESS(status)) {                    // A problem?
             pRegInfo->NumberOfBuses = defRegInfo.NumberOfBuses;
             pRegInfo->InitiatorID = defRegInfo.InitiatorID;
+            pRegInfo->ReadCacheSize = defRegInfo.ReadCacheSize;
+            pRegInfo->WorkerThreads = defRegInfo.WorkerThreads;
+            pRegInfo->AsyncQueueDepth = defRegInfo.AsyncQueueDepth;
+            pRegInfo->BufferPoolSize = defRegInfo.BufferPoolSize;
+            pRegInfo->ZeroRunGranularity = defRegInfo.ZeroRunGranularity;
             RtlCopyUnicodeString(&pRegInfo->VendorId, &defRegInfo.VendorId);
             RtlCopyUnicodeString(&pRegInfo->ProductId, &defRegInfo.ProductId);
             RtlCopyUnicodeString(&pRegInfo->ProductRevision, &defRegInfo.ProductRevision);
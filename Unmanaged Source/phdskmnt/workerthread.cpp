@@ -25,6 +25,11 @@
 /*                                                                                                */
 /**************************************************************************************************/
 
+static VOID
+ImScsiServeRequests(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in BOOLEAN AdditionalThread);
+
 /**************************************************************************************************/
 /*                                                                                                */
 /* This is the worker thread routine, which always runs in System process.                        */
@@ -34,10 +39,6 @@ VOID
 ImScsiWorkerThread(__in PVOID Context)
 {
     pHW_LU_EXTENSION            pLUExt = (pHW_LU_EXTENSION)Context;
-    pMP_WorkRtnParms            pWkRtnParms = NULL;
-    PLIST_ENTRY                 request_list = NULL;
-    PKSPIN_LOCK                 request_list_lock = NULL;
-    PKEVENT                     wait_objects[2] = { NULL };
 
     KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
 
@@ -46,10 +47,6 @@ ImScsiWorkerThread(__in PVOID Context)
         KdPrint(("PhDskMnt::ImScsiWorkerThread: Device worker thread start. pLUExt = 0x%p\n",
             pLUExt));
 
-        request_list = &pLUExt->RequestList;
-        request_list_lock = &pLUExt->RequestListLock;
-        wait_objects[0] = &pLUExt->RequestEvent;
-
         // If this is a VM backed disk that should be pre-loaded with an image file
         // we have to load the contents of that file now before entering the service
         // loop.
@@ -61,7 +58,66 @@ ImScsiWorkerThread(__in PVOID Context)
     {
         KdPrint(("PhDskMnt::ImScsiWorkerThread: Global worker thread start. pLUExt=%p\n",
             pLUExt));
+    }
+
+    ImScsiServeRequests(pLUExt, FALSE);
+}
+
+#ifdef USE_STORPORT
+
+/**************************************************************************************************/
+/*                                                                                                */
+/* Additional worker threads that serve the same LU request list as the main worker thread, for  */
+/* LUs where several requests can be outstanding at the same time. They never clean up the LU,   */
+/* that is left to the main worker thread after these threads have exited.                       */
+/*                                                                                                */
+/**************************************************************************************************/
+VOID
+ImScsiAdditionalWorkerThread(__in PVOID Context)
+{
+    pHW_LU_EXTENSION            pLUExt = (pHW_LU_EXTENSION)Context;
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    KdPrint(("PhDskMnt::ImScsiAdditionalWorkerThread: Start. pLUExt = 0x%p\n",
+        pLUExt));
+
+    ImScsiServeRequests(pLUExt, TRUE);
+}
+
+#endif
+
+/**************************************************************************************************/
+/*                                                                                                */
+/* Service loop of all worker threads. Takes requests from LU request list, or global request    */
+/* list if pLUExt is NULL, until driver or LU is stopped. Main worker thread of an LU waits for  */
+/* additional worker threads to exit and then cleans up the LU.                                   */
+/*                                                                                                */
+/**************************************************************************************************/
+static VOID
+ImScsiServeRequests(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in BOOLEAN AdditionalThread)
+{
+    pMP_WorkRtnParms            pWkRtnParms = NULL;
+    PLIST_ENTRY                 request_list = NULL;
+    PKSPIN_LOCK                 request_list_lock = NULL;
+    PKEVENT                     wait_objects[3] = { NULL };
+    ULONG                       wait_count = 2;
+
+    if (pLUExt != NULL)
+    {
+        request_list = &pLUExt->RequestList;
+        request_list_lock = &pLUExt->RequestListLock;
+        wait_objects[0] = &pLUExt->RequestEvent;
 
+        // Request event only wakes one thread, so all threads of an LU wait
+        // for stop event as well
+        wait_objects[2] = &pLUExt->StopThread;
+        wait_count = 3;
+    }
+    else
+    {
         request_list = &pMPDrvInfoGlobal->RequestList;
         request_list_lock = &pMPDrvInfoGlobal->RequestListLock;
         wait_objects[0] = &pMPDrvInfoGlobal->RequestEvent;
@@ -73,6 +129,7 @@ ImScsiWorkerThread(__in PVOID Context)
         PLIST_ENTRY                 request;
         KLOCK_QUEUE_HANDLE          lock_handle;
         KIRQL                       lowest_assumed_irql = PASSIVE_LEVEL;
+        BOOLEAN                     more_requests;
 
 #ifdef USE_SCSIPORT
 
@@ -93,22 +150,63 @@ ImScsiWorkerThread(__in PVOID Context)
         {
             ImScsiAcquireLock(request_list_lock, &lock_handle, lowest_assumed_irql);
 
-            request = RemoveHeadList(request_list);
+#ifdef USE_STORPORT
+            if (pLUExt != NULL)
+            {
+                request = ImScsiRemoveNextLURequest(pLUExt);
+            }
+            else
+#endif
+            {
+                request = RemoveHeadList(request_list);
+            }
+
+            more_requests = !IsListEmpty(request_list);
 
             ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
 
             if (request != request_list)
             {
+                // Request event is a synchronization event, so pass it on
+                // to another worker thread if there is more work.
+                if (more_requests &&
+                    (pLUExt != NULL) &&
+                    (AdditionalThread ||
+                    (pLUExt->NumberOfAdditionalWorkerThreads > 0)))
+                {
+                    KeSetEvent(&pLUExt->RequestEvent, (KPRIORITY)0, FALSE);
+                }
+
                 break;
             }
 
             if (KeReadStateEvent(&pMPDrvInfoGlobal->StopWorker) ||
                 ((pLUExt != NULL) && (KeReadStateEvent(&pLUExt->StopThread))))
             {
+                if (AdditionalThread)
+                {
+                    KdPrint(("PhDskMnt::ImScsiAdditionalWorkerThread shutting down.\n"));
+
+                    PsTerminateSystemThread(STATUS_SUCCESS);
+                    return;
+                }
+
                 KdPrint(("PhDskMnt::ImScsiWorkerThread shutting down.\n"));
 
                 if (pLUExt != NULL)
                 {
+                    ImScsiStopAdditionalWorkerThreads(pLUExt);
+
+                    ImScsiWaitForAsyncRequests(pLUExt);
+
+                    // Requests waiting for overlapping requests served by
+                    // additional threads or asynchronously are queued again
+                    // when those are done.
+                    if (!IsListEmpty(request_list))
+                    {
+                        continue;
+                    }
+
                     ImScsiCleanupLU(pLUExt, &lowest_assumed_irql);
                 }
 
@@ -126,7 +224,7 @@ ImScsiWorkerThread(__in PVOID Context)
 
             KdPrint2(("PhDskMnt::ImScsiWorkerThread idle, waiting for request.\n"));
 
-            KeWaitForMultipleObjects(2, (PVOID*)wait_objects, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+            KeWaitForMultipleObjects(wait_count, (PVOID*)wait_objects, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
         }
 
         pWkRtnParms = CONTAINING_RECORD(request, MP_WorkRtnParms, RequestListEntry);
@@ -161,13 +259,29 @@ ImScsiWorkerThread(__in PVOID Context)
             
             ExFreePoolWithTag(pWkRtnParms->pLUExt, MP_TAG_GENERAL);
 
-            ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);
+            ExFreeToNPagedLookasideList(&pMPDrvInfoGlobal->WorkItemLookaside, pWkRtnParms);
 
             continue;
         }
 
+#ifdef USE_STORPORT
+        if ((pLUExt != NULL) &&
+            (ImScsiDispatchCoalescedReadWrite(pLUExt, pWkRtnParms) ||
+            ImScsiDispatchAsyncReadWrite(pLUExt, pWkRtnParms)))
+        {
+            continue;
+        }
+#endif
+
         ImScsiDispatchWork(pWkRtnParms);
 
+#ifdef USE_STORPORT
+        if (pLUExt != NULL)
+        {
+            ImScsiCompleteInFlightRequest(pLUExt, pWkRtnParms);
+        }
+#endif
+
         if (pWkRtnParms->pReqThread != NULL)
         {
             ObDereferenceObject(pWkRtnParms->pReqThread);
@@ -197,7 +311,7 @@ ImScsiWorkerThread(__in PVOID Context)
 
         StorPortNotification(RequestComplete, pWkRtnParms->pHBAExt, pWkRtnParms->pSrb);
 
-        ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);
+        ExFreeToNPagedLookasideList(&pMPDrvInfoGlobal->WorkItemLookaside, pWkRtnParms);
 
         KdPrint2(("PhDskMnt::ImScsiWorkerThread: Finished work: 0x%p.\n", pWkRtnParms));
 
@@ -206,32 +320,82 @@ ImScsiWorkerThread(__in PVOID Context)
     }
 }
 
-VOID
-ImScsiDispatchReadWrite(
-    __in pHW_HBA_EXT pHBAExt,
+#ifdef USE_STORPORT
+
+/**************************************************************************************************/
+/*                                                                                                */
+/* When several worker threads serve an LU, read and write requests are kept in an in-flight      */
+/* list in the order they were taken from the request list. A request that overlaps an earlier    */
+/* request in the list, where either one is a write, is held back until the earlier ones are      */
+/* done and then queued first in the request list again.                                          */
+/*                                                                                                */
+/**************************************************************************************************/
+
+static BOOLEAN
+ImScsiIsLUReadWrite(
     __in pHW_LU_EXTENSION pLUExt,
-    __in PSCSI_REQUEST_BLOCK pSrb)
+    __in pMP_WorkRtnParms pWkRtnParms,
+    __out PBOOLEAN IsRead)
 {
-    PCDB pCdb = (PCDB)pSrb->Cdb;
-    PVOID sysaddress;
-    PVOID buffer;
-    LARGE_INTEGER startingSector;
-    LARGE_INTEGER startingOffset;
-    KLOCK_QUEUE_HANDLE LockHandle;
-    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    PSCSI_REQUEST_BLOCK pSrb = pWkRtnParms->pSrb;
 
-    if (((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16)) &&
-        (((pLUExt->RegistrationKey == 0) && (pLUExt->ReservationKey != 0)) ||
-        (pLUExt->RegistrationKey != 0) && (pLUExt->ReservationKey == 0)))
+    if ((pSrb == NULL) ||
+        (pWkRtnParms->pLUExt != pLUExt) ||
+        (pSrb->Function != SRB_FUNCTION_EXECUTE_SCSI))
     {
-        KdPrint(("PhDskMnt::ImScsiDispatchWork Write operation on unreserved LUN.\n"));
+        return FALSE;
+    }
 
-        pSrb->SrbStatus = SRB_STATUS_ERROR;
-        pSrb->ScsiStatus = SCSISTAT_RESERVATION_CONFLICT;
+    switch (pSrb->Cdb[0])
+    {
+    case SCSIOP_READ:
+    case SCSIOP_READ16:
+        *IsRead = TRUE;
+        return TRUE;
 
-        return;
+    case SCSIOP_WRITE:
+    case SCSIOP_WRITE16:
+        *IsRead = FALSE;
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
+
+static BOOLEAN
+ImScsiInFlightRequestsConflict(
+    __in pMP_WorkRtnParms First,
+    __in pMP_WorkRtnParms Second)
+{
+    return (First->IsWrite || Second->IsWrite) &&
+        (First->FirstSector < Second->EndSector) &&
+        (Second->FirstSector < First->EndSector);
+}
+
+/// Adds a request just taken from LU request list to in-flight list.
+/// Returns FALSE if it has to wait for earlier requests. Caller holds
+/// RequestListLock.
+static BOOLEAN
+ImScsiStartInFlightRequest(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in pMP_WorkRtnParms pWkRtnParms)
+{
+    PSCSI_REQUEST_BLOCK pSrb = pWkRtnParms->pSrb;
+    PCDB pCdb;
+    LARGE_INTEGER startingSector;
+    BOOLEAN is_read;
+
+    // Already in flight if queued again after waiting
+    if (pWkRtnParms->InFlight ||
+        !pLUExt->TrackInFlight ||
+        !ImScsiIsLUReadWrite(pLUExt, pWkRtnParms, &is_read))
+    {
+        return TRUE;
     }
 
+    pCdb = (PCDB)pSrb->Cdb;
+
     if ((pCdb->AsByte[0] == SCSIOP_READ16) ||
         (pCdb->AsByte[0] == SCSIOP_WRITE16))
     {
@@ -239,64 +403,556 @@ ImScsiDispatchReadWrite(
     }
     else
     {
-        startingSector.QuadPart = 0;
-        REVERSE_BYTES(&startingSector, &pCdb->CDB10.LogicalBlockByte0);
+        startingSector.QuadPart = 0;
+        REVERSE_BYTES(&startingSector, &pCdb->CDB10.LogicalBlockByte0);
+    }
+
+    pWkRtnParms->FirstSector = startingSector.QuadPart;
+    pWkRtnParms->EndSector = startingSector.QuadPart +
+        (pSrb->DataTransferLength >> pLUExt->BlockPower);
+    pWkRtnParms->IsWrite = !is_read;
+    pWkRtnParms->Blockers = 0;
+
+    for (PLIST_ENTRY entry = pLUExt->InFlightList.Flink;
+        entry != &pLUExt->InFlightList;
+        entry = entry->Flink)
+    {
+        pMP_WorkRtnParms earlier =
+            CONTAINING_RECORD(entry, MP_WorkRtnParms, InFlightListEntry);
+
+        if (ImScsiInFlightRequestsConflict(earlier, pWkRtnParms))
+        {
+            pWkRtnParms->Blockers++;
+        }
+    }
+
+    InsertTailList(&pLUExt->InFlightList, &pWkRtnParms->InFlightListEntry);
+    pWkRtnParms->InFlight = TRUE;
+
+    if (pWkRtnParms->Blockers > 0)
+    {
+        KdPrint2(("PhDskMnt::ImScsiStartInFlightRequest: Request 0x%p waits for %u overlapping requests.\n",
+            pWkRtnParms, pWkRtnParms->Blockers));
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+///
+/// Removes next request that can be dispatched from LU request list.
+/// Returns pointer to list head if there is none. Caller holds
+/// RequestListLock.
+///
+PLIST_ENTRY
+ImScsiRemoveNextLURequest(
+    __in pHW_LU_EXTENSION pLUExt)
+{
+    for (;;)
+    {
+        PLIST_ENTRY request = RemoveHeadList(&pLUExt->RequestList);
+
+        if ((request == &pLUExt->RequestList) ||
+            ImScsiStartInFlightRequest(pLUExt,
+                CONTAINING_RECORD(request, MP_WorkRtnParms, RequestListEntry)))
+        {
+            return request;
+        }
+    }
+}
+
+///
+/// Removes a dispatched request from in-flight list and queues requests
+/// that no longer have to wait for it.
+///
+VOID
+ImScsiCompleteInFlightRequest(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in pMP_WorkRtnParms pWkRtnParms)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    PLIST_ENTRY insert_after = &pLUExt->RequestList;
+    PLIST_ENTRY entry;
+
+    if (!pWkRtnParms->InFlight)
+    {
+        return;
+    }
+
+    ImScsiAcquireLock(&pLUExt->RequestListLock, &lock_handle, lowest_assumed_irql);
+
+    entry = pWkRtnParms->InFlightListEntry.Flink;
+
+    RemoveEntryList(&pWkRtnParms->InFlightListEntry);
+    pWkRtnParms->InFlight = FALSE;
+
+    for (; entry != &pLUExt->InFlightList; entry = entry->Flink)
+    {
+        pMP_WorkRtnParms later =
+            CONTAINING_RECORD(entry, MP_WorkRtnParms, InFlightListEntry);
+
+        // Requests that can go are queued first, in their original order
+        if (ImScsiInFlightRequestsConflict(pWkRtnParms, later) &&
+            (--later->Blockers == 0))
+        {
+            InsertHeadList(insert_after, &later->RequestListEntry);
+            insert_after = &later->RequestListEntry;
+        }
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    if (insert_after != &pLUExt->RequestList)
+    {
+        KeSetEvent(&pLUExt->RequestEvent, (KPRIORITY)0, FALSE);
+    }
+}
+
+/**************************************************************************************************/
+/*                                                                                                */
+/* Read and write requests that are queued next to each other for an LU with a proxy that        */
+/* supports vectored requests are sent to the proxy as one IMDPROXY_REQ_READV or                  */
+/* IMDPROXY_REQ_WRITEV request.                                                                   */
+/*                                                                                                */
+/**************************************************************************************************/
+
+static VOID
+ImScsiCompleteLUWork(
+    __in pMP_WorkRtnParms pWkRtnParms)
+{
+    ImScsiCompleteInFlightRequest(pWkRtnParms->pLUExt, pWkRtnParms);
+
+    if (pWkRtnParms->pReqThread != NULL)
+    {
+        ObDereferenceObject(pWkRtnParms->pReqThread);
+    }
+
+    if (pWkRtnParms->CallerWaitEvent != NULL)
+    {
+        KeSetEvent(pWkRtnParms->CallerWaitEvent, (KPRIORITY)0, FALSE);
+    }
+
+    StorPortNotification(RequestComplete, pWkRtnParms->pHBAExt, pWkRtnParms->pSrb);
+
+    ExFreeToNPagedLookasideList(&pMPDrvInfoGlobal->WorkItemLookaside, pWkRtnParms);
+}
+
+///
+/// Takes read or write requests in the same direction as pWkRtnParms from
+/// head of LU request list, sends them all to proxy in one vectored request
+/// and completes them. Returns FALSE without doing anything if pWkRtnParms
+/// cannot be combined with other requests, in which case caller dispatches
+/// it as usual.
+///
+BOOLEAN
+ImScsiDispatchCoalescedReadWrite(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in pMP_WorkRtnParms pWkRtnParms)
+{
+    pMP_WorkRtnParms batch[IMDPROXY_VECTORED_MAX_EXTENTS];
+    PVOID sysaddress[IMDPROXY_VECTORED_MAX_EXTENTS];
+    IMDPROXY_VECTORED_REQ request;
+    IO_STATUS_BLOCK io_status;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    ULONG_PTR max_length = IMSCSI_VECTORED_MAX_LENGTH;
+    ULONG_PTR total_length;
+    ULONG count = 0;
+    BOOLEAN is_read;
+    BOOLEAN next_is_read;
+    PUCHAR buffer = NULL;
+    LONG cache_sequence = 0;
+    NTSTATUS status;
+
+    // Lock-step vectored requests would hold up pipelined tagged ones,
+    // and requests that need special treatment of sector zero or
+    // reservations are left to ImScsiDispatchReadWrite.
+    if (!pLUExt->SupportsVectored ||
+        pLUExt->SharedImage ||
+        (pLUExt->FakeDiskSignature != 0) ||
+        ((pLUExt->Proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_DEVICE) &&
+        (pLUExt->Proxy.tagged != NULL)) ||
+        !ImScsiIsLUReadWrite(pLUExt, pWkRtnParms, &is_read))
+    {
+        return FALSE;
+    }
+
+    if (pLUExt->Proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
+    {
+        max_length = min(max_length, ImScsiGetShmProxyDataSize(&pLUExt->Proxy));
+    }
+
+    total_length = pWkRtnParms->pSrb->DataTransferLength;
+
+    if (total_length > max_length)
+    {
+        return FALSE;
+    }
+
+    batch[count++] = pWkRtnParms;
+
+    ImScsiAcquireLock(&pLUExt->RequestListLock, &lock_handle, lowest_assumed_irql);
+
+    while ((count < IMDPROXY_VECTORED_MAX_EXTENTS) &&
+        !IsListEmpty(&pLUExt->RequestList))
+    {
+        pMP_WorkRtnParms next = CONTAINING_RECORD(pLUExt->RequestList.Flink,
+            MP_WorkRtnParms, RequestListEntry);
+
+        if (!ImScsiIsLUReadWrite(pLUExt, next, &next_is_read) ||
+            (next_is_read != is_read) ||
+            (total_length + next->pSrb->DataTransferLength > max_length))
+        {
+            break;
+        }
+
+        RemoveEntryList(&next->RequestListEntry);
+
+        // Overlaps a request in flight, dispatched when that one is done
+        if (!ImScsiStartInFlightRequest(pLUExt, next))
+        {
+            break;
+        }
+
+        total_length += next->pSrb->DataTransferLength;
+        batch[count++] = next;
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    if (count == 1)
+    {
+        return FALSE;
+    }
+
+    KdPrint2(("PhDskMnt::ImScsiDispatchCoalescedReadWrite: %u %s requests, %Iu bytes.\n",
+        count, is_read ? "read" : "write", total_length));
+
+    ImdProxyInitVectoredRequest(&request,
+        is_read ? IMDPROXY_REQ_READV : IMDPROXY_REQ_WRITEV);
+
+    status = STATUS_SUCCESS;
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        PSCSI_REQUEST_BLOCK pSrb = batch[i]->pSrb;
+        PCDB pCdb = (PCDB)pSrb->Cdb;
+        LARGE_INTEGER startingSector;
+
+        if ((pCdb->AsByte[0] == SCSIOP_READ16) ||
+            (pCdb->AsByte[0] == SCSIOP_WRITE16))
+        {
+            REVERSE_BYTES_QUAD(&startingSector, pCdb->CDB16.LogicalBlock);
+        }
+        else
+        {
+            startingSector.QuadPart = 0;
+            REVERSE_BYTES(&startingSector, &pCdb->CDB10.LogicalBlockByte0);
+        }
+
+        ULONG s_status = StoragePortGetSystemAddress(batch[i]->pHBAExt, pSrb, &sysaddress[i]);
+
+        if ((s_status != STORAGE_STATUS_SUCCESS) || (sysaddress[i] == NULL))
+        {
+            status = STATUS_INVALID_USER_BUFFER;
+            break;
+        }
+
+        ImdProxyAddVectoredExtent(&request,
+            (startingSector.QuadPart << pLUExt->BlockPower) +
+            pLUExt->ImageOffset.QuadPart,
+            pSrb->DataTransferLength);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        buffer = (PUCHAR)ImScsiAllocateBuffer((ULONG)total_length,
+            &pLUExt->Statistics);
+
+        if (buffer == NULL)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+        else
+        {
+            InterlockedIncrement64(&pLUExt->Statistics.BounceBufferAllocations);
+        }
+    }
+
+    if (NT_SUCCESS(status) && !is_read)
+    {
+        PUCHAR ptr = buffer;
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            RtlCopyMemory(ptr, sysaddress[i], batch[i]->pSrb->DataTransferLength);
+            ptr += batch[i]->pSrb->DataTransferLength;
+        }
+
+        InterlockedExchangeAdd64(&pLUExt->Statistics.BounceBytesCopied, total_length);
+
+        pLUExt->Modified = TRUE;
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        cache_sequence = ImScsiReadCacheSequence(pLUExt);
+
+        status = ImScsiVectoredProxy(&pLUExt->Proxy,
+            &io_status,
+            &pLUExt->StopThread,
+            &request,
+            buffer);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        // Let the usual path retry each request on its own and report
+        // errors with proper sense data.
+        KdPrint(("PhDskMnt::ImScsiDispatchCoalescedReadWrite: Vectored request failed (%#x), dispatching %u requests separately.\n",
+            status, count));
+
+        if (buffer != NULL)
+        {
+            ImScsiFreeBuffer(buffer, (ULONG)total_length);
+        }
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            ImScsiDispatchWork(batch[i]);
+            ImScsiCompleteLUWork(batch[i]);
+        }
+
+        return TRUE;
+    }
+
+    if (is_read)
+    {
+        PUCHAR ptr = buffer;
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            RtlCopyMemory(sysaddress[i], ptr, batch[i]->pSrb->DataTransferLength);
+            ptr += batch[i]->pSrb->DataTransferLength;
+        }
+
+        InterlockedExchangeAdd64(&pLUExt->Statistics.BounceBytesCopied, total_length);
+
+        InterlockedExchangeAdd64(&pLUExt->Statistics.ReadRequests, count);
+        InterlockedExchangeAdd64(&pLUExt->Statistics.BytesRead, total_length);
+    }
+    else
+    {
+        InterlockedExchangeAdd64(&pLUExt->Statistics.WriteRequests, count);
+        InterlockedExchangeAdd64(&pLUExt->Statistics.BytesWritten, total_length);
+    }
+
+    /// Adjacent requests have been merged into extents. A single extent
+    /// hands the whole buffer over to read cache, otherwise each extent is
+    /// handled separately.
+    if (request.extent_count == 1)
+    {
+        ImScsiReadCacheInsert(pLUExt,
+            (LONGLONG)(request.extents[0].offset - pLUExt->ImageOffset.QuadPart) >> pLUExt->BlockPower,
+            buffer, (ULONG)total_length, cache_sequence, !is_read,
+            &lowest_assumed_irql);
+
+        buffer = NULL;
+    }
+    else
+    {
+        PUCHAR extent_data = buffer;
+
+        for (ULONG i = 0; i < request.extent_count; i++)
+        {
+            LONGLONG extent_sector =
+                (LONGLONG)(request.extents[i].offset - pLUExt->ImageOffset.QuadPart) >> pLUExt->BlockPower;
+            ULONG extent_length = (ULONG)request.extents[i].length;
+
+            if (!is_read)
+            {
+                ImScsiReadCacheInvalidate(pLUExt, extent_sector,
+                    extent_length >> pLUExt->BlockPower, &lowest_assumed_irql);
+            }
+            else if ((pLUExt->ReadCache.Entries != NULL) &&
+                (extent_length <= pLUExt->ReadCache.MaxEntrySize))
+            {
+                PVOID cache_buffer = ImScsiAllocateBuffer(extent_length,
+                    &pLUExt->Statistics);
+
+                if (cache_buffer != NULL)
+                {
+                    RtlCopyMemory(cache_buffer, extent_data, extent_length);
+
+                    ImScsiReadCacheInsert(pLUExt, extent_sector, cache_buffer,
+                        extent_length, cache_sequence, FALSE, &lowest_assumed_irql);
+                }
+            }
+
+            extent_data += extent_length;
+        }
+    }
+
+    if (buffer != NULL)
+    {
+        ImScsiFreeBuffer(buffer, (ULONG)total_length);
+    }
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        ScsiSetSuccess(batch[i]->pSrb, batch[i]->pSrb->DataTransferLength);
+
+        ImScsiCompleteLUWork(batch[i]);
+    }
+
+    return TRUE;
+}
+
+VOID
+ImScsiStartAdditionalWorkerThreads(
+    __inout __deref pHW_LU_EXTENSION pLUExt,
+    __in ULONG NumberOfThreads)
+{
+    NTSTATUS status;
+
+    if (NumberOfThreads > MAX_ADDITIONAL_WORKER_THREADS)
+    {
+        NumberOfThreads = MAX_ADDITIONAL_WORKER_THREADS;
     }
 
-    startingOffset.QuadPart = startingSector.QuadPart << pLUExt->BlockPower;
+    if (NumberOfThreads > 0)
+    {
+        pLUExt->TrackInFlight = TRUE;
+    }
 
-    KdPrint2(("PhDskMnt::ImScsiDispatchWork starting sector: 0x%I64X\n", startingSector));
+    // Threads are kept track of by kernel handles, which are valid in any
+    // process and need no further step after thread creation that could
+    // fail while the thread is already running. If a thread cannot be
+    // created, LU is served by the threads started before it.
+    OBJECT_ATTRIBUTES object_attributes;
 
-    ULONG s_status = StoragePortGetSystemAddress(pHBAExt, pSrb, &sysaddress);
+    InitializeObjectAttributes(&object_attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
 
-    if ((s_status != STORAGE_STATUS_SUCCESS) || (sysaddress == NULL))
+    while (pLUExt->NumberOfAdditionalWorkerThreads < NumberOfThreads)
     {
-        DbgPrint("PhDskMnt::ImScsiDispatchWork: StorPortGetSystemAddress failed: status=0x%X address=0x%p translated=0x%p\n",
-            s_status,
-            pSrb->DataBuffer,
-            sysaddress);
+        status = PsCreateSystemThread(
+            &pLUExt->AdditionalWorkerThreads[pLUExt->NumberOfAdditionalWorkerThreads],
+            SYNCHRONIZE,
+            &object_attributes,
+            NULL,
+            NULL,
+            ImScsiAdditionalWorkerThread,
+            pLUExt);
 
-        pSrb->SrbStatus = SRB_STATUS_ERROR;
-        pSrb->ScsiStatus = SCSISTAT_GOOD;
+        if (!NT_SUCCESS(status))
+        {
+            DbgPrint("PhDskMnt::ImScsiStartAdditionalWorkerThreads: Cannot create worker thread. (%#x)\n", status);
 
-        return;
+            pLUExt->AdditionalWorkerThreads[pLUExt->NumberOfAdditionalWorkerThreads] = NULL;
+
+            break;
+        }
+
+        pLUExt->NumberOfAdditionalWorkerThreads++;
     }
 
-    buffer = ExAllocatePoolWithTag(NonPagedPool, pSrb->DataTransferLength, MP_TAG_GENERAL);
+    KdPrint(("PhDskMnt::ImScsiStartAdditionalWorkerThreads: %u additional worker threads for pLUExt=0x%p.\n",
+        pLUExt->NumberOfAdditionalWorkerThreads, pLUExt));
+}
 
-    if (buffer == NULL)
-    {
-        DbgPrint("PhDskMnt::ImScsiDispatchWork: Memory allocation failed.\n");
+#endif
 
-        pSrb->SrbStatus = SRB_STATUS_ERROR;
-        pSrb->ScsiStatus = SCSISTAT_GOOD;
+VOID
+ImScsiStopAdditionalWorkerThreads(
+    __inout __deref pHW_LU_EXTENSION pLUExt)
+{
+    while (pLUExt->NumberOfAdditionalWorkerThreads > 0)
+    {
+        HANDLE thread_handle =
+            pLUExt->AdditionalWorkerThreads[--pLUExt->NumberOfAdditionalWorkerThreads];
 
-        return;
-    }
+        ZwWaitForSingleObject(thread_handle, FALSE, NULL);
 
-    NTSTATUS status = STATUS_NOT_IMPLEMENTED;
+        ZwClose(thread_handle);
 
-    /// For write operations, prepare temporary buffer
-    if ((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16))
-    {
-        RtlMoveMemory(buffer, sysaddress, pSrb->DataTransferLength);
+        pLUExt->AdditionalWorkerThreads[pLUExt->NumberOfAdditionalWorkerThreads] = NULL;
     }
+}
 
-    if ((pSrb->Cdb[0] == SCSIOP_READ) || (pSrb->Cdb[0] == SCSIOP_READ16))
+///
+/// Waits for all asynchronous image file requests of an LU to complete.
+///
+VOID
+ImScsiWaitForAsyncRequests(
+    __in pHW_LU_EXTENSION pLUExt)
+{
+    if (pLUExt->AsyncQueueDepth == 0)
     {
-        status = ImScsiReadDevice(pLUExt, buffer, &startingOffset, &pSrb->DataTransferLength);
+        return;
     }
-    else if ((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16))
+
+    for (ULONG i = 0; i < pLUExt->AsyncQueueDepth; i++)
     {
-        status = ImScsiWriteDevice(pLUExt, buffer, &startingOffset, &pSrb->DataTransferLength);
+        KeWaitForSingleObject(
+            &pLUExt->AsyncRequestSemaphore,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
     }
 
-    if (!NT_SUCCESS(status))
+    KeReleaseSemaphore(&pLUExt->AsyncRequestSemaphore, (KPRIORITY)0,
+        (LONG)pLUExt->AsyncQueueDepth, FALSE);
+}
+
+/// Writes are not accepted from an initiator that is registered while
+/// no reservation is held, or the other way around.
+static BOOLEAN
+ImScsiIsWriteReservationConflict(
+    __in pHW_LU_EXTENSION pLUExt)
+{
+    return ((pLUExt->RegistrationKey == 0) && (pLUExt->ReservationKey != 0)) ||
+        ((pLUExt->RegistrationKey != 0) && (pLUExt->ReservationKey == 0));
+}
+
+///
+/// Completes a read or write request after image I/O. Buffer is either an
+/// intermediate buffer, which is handed over to read cache or freed, or
+/// system buffer itself if ZeroCopy is set. NumberOfBlocks is length of
+/// request before image I/O, which sets transfer length to what was
+/// actually transferred.
+///
+static VOID
+ImScsiFinishReadWrite(
+    __in pHW_HBA_EXT pHBAExt,
+    __in pHW_LU_EXTENSION pLUExt,
+    __in PSCSI_REQUEST_BLOCK pSrb,
+    __in NTSTATUS Status,
+    PVOID Buffer,
+    PVOID SystemAddress,
+    __in BOOLEAN ZeroCopy,
+    __in LONGLONG StartingSector,
+    __in ULONG NumberOfBlocks,
+    __in LONG CacheSequence,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    BOOLEAN is_read =
+        (pSrb->Cdb[0] == SCSIOP_READ) || (pSrb->Cdb[0] == SCSIOP_READ16);
+
+    if (!NT_SUCCESS(Status))
     {
-        ExFreePoolWithTag(buffer, MP_TAG_GENERAL);
+        if (!ZeroCopy)
+            ImScsiFreeBuffer(Buffer, NumberOfBlocks << pLUExt->BlockPower);
 
-        DbgPrint("PhDskMnt::ImScsiDispatchWork: I/O error status=0x%X\n", status);
-        switch (status)
+        /// Failed writes may still have changed some of the data
+        if (!is_read)
+            ImScsiReadCacheInvalidate(pLUExt, StartingSector,
+                NumberOfBlocks, LowestAssumedIrql);
+
+        DbgPrint("PhDskMnt::ImScsiDispatchWork: I/O error status=0x%X\n", Status);
+        switch (Status)
         {
         case STATUS_INVALID_BUFFER_SIZE:
         {
@@ -337,7 +993,7 @@ ImScsiDispatchReadWrite(
         {
             DbgPrint("PhDskMnt::ImScsiDispatchWork: Underlying image disconnected. Reporting SRB_STATUS_ERROR/SCSI_SENSE_NOT_READY/SCSI_ADSENSE_LUN_NOT_READY/SCSI_SENSEQ_NOT_REACHABLE.\n");
             
-            ImScsiRemoveDevice(pHBAExt, &pLUExt->DeviceNumber, &lowest_assumed_irql);
+            ImScsiRemoveDevice(pHBAExt, &pLUExt->DeviceNumber, LowestAssumedIrql);
             
             ScsiSetCheckCondition(
                 pSrb,
@@ -365,10 +1021,10 @@ ImScsiDispatchReadWrite(
     if ((pLUExt->FakeDiskSignature != 0) &&
         ((pSrb->Cdb[0] == SCSIOP_READ) ||
         (pSrb->Cdb[0] == SCSIOP_READ16)) &&
-            (startingSector.QuadPart == 0) &&
+            (StartingSector == 0) &&
         (pSrb->DataTransferLength >= 512))
     {
-        PUCHAR mbr = (PUCHAR)buffer;
+        PUCHAR mbr = (PUCHAR)Buffer;
 
         if ((*(PUSHORT)(mbr + 0x01FE) == 0xAA55) &&
             (*(PUSHORT)(mbr + 0x01BC) == 0x0000) &&
@@ -386,40 +1042,367 @@ ImScsiDispatchReadWrite(
     else if ((pLUExt->FakeDiskSignature != 0) &&
         ((pSrb->Cdb[0] == SCSIOP_WRITE) ||
         (pSrb->Cdb[0] == SCSIOP_WRITE16)) &&
-            (startingSector.QuadPart == 0) &&
+            (StartingSector == 0) &&
         (pSrb->DataTransferLength >= 512))
     {
         pLUExt->FakeDiskSignature = 0;
     }
 
+    if (is_read)
+    {
+        InterlockedIncrement64(&pLUExt->Statistics.ReadRequests);
+        InterlockedExchangeAdd64(&pLUExt->Statistics.BytesRead,
+            pSrb->DataTransferLength);
+    }
+    else
+    {
+        InterlockedIncrement64(&pLUExt->Statistics.WriteRequests);
+        InterlockedExchangeAdd64(&pLUExt->Statistics.BytesWritten,
+            pSrb->DataTransferLength);
+    }
+
     /// For write operations, temporary buffer holds read data.
     /// Copy that to system buffer.
+    if (!ZeroCopy && is_read)
+    {
+        RtlMoveMemory(SystemAddress, Buffer, pSrb->DataTransferLength);
+
+        InterlockedExchangeAdd64(&pLUExt->Statistics.BounceBytesCopied,
+            pSrb->DataTransferLength);
+    }
+
+    if (ZeroCopy)
+    {
+        /// System buffer cannot be kept in read cache. Reads small enough
+        /// to be cached are copied to a new buffer. Writes only invalidate
+        /// overlapping data in cache.
+        if (!is_read)
+        {
+            ImScsiReadCacheInvalidate(pLUExt, StartingSector,
+                NumberOfBlocks, LowestAssumedIrql);
+        }
+        else if ((pLUExt->ReadCache.Entries != NULL) &&
+            (pSrb->DataTransferLength <= pLUExt->ReadCache.MaxEntrySize))
+        {
+            Buffer = ImScsiAllocateBuffer(pSrb->DataTransferLength,
+                &pLUExt->Statistics);
+
+            if (Buffer != NULL)
+            {
+                RtlCopyMemory(Buffer, SystemAddress, pSrb->DataTransferLength);
+
+                ImScsiReadCacheInsert(pLUExt, StartingSector,
+                    Buffer, pSrb->DataTransferLength, CacheSequence, FALSE,
+                    LowestAssumedIrql);
+            }
+        }
+    }
+    else
+    {
+        /// Read cache takes over temporary buffer, or frees it if cache is
+        /// not used for this LU.
+        ImScsiReadCacheInsert(pLUExt, StartingSector, Buffer,
+            pSrb->DataTransferLength, CacheSequence, !is_read,
+            LowestAssumedIrql);
+    }
+
+    ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+}
+
+VOID
+ImScsiDispatchReadWrite(
+    __in pHW_HBA_EXT pHBAExt,
+    __in pHW_LU_EXTENSION pLUExt,
+    __in PSCSI_REQUEST_BLOCK pSrb)
+{
+    PCDB pCdb = (PCDB)pSrb->Cdb;
+    PVOID sysaddress;
+    PVOID buffer;
+    LARGE_INTEGER startingSector;
+    LARGE_INTEGER startingOffset;
+    ULONG numBlocks = pSrb->DataTransferLength >> pLUExt->BlockPower;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    BOOLEAN zero_copy;
+    LONG cache_sequence = ImScsiReadCacheSequence(pLUExt);
+
+    if (((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16)) &&
+        ImScsiIsWriteReservationConflict(pLUExt))
+    {
+        KdPrint(("PhDskMnt::ImScsiDispatchWork Write operation on unreserved LUN.\n"));
+
+        pSrb->SrbStatus = SRB_STATUS_ERROR;
+        pSrb->ScsiStatus = SCSISTAT_RESERVATION_CONFLICT;
+
+        return;
+    }
+
+    if ((pCdb->AsByte[0] == SCSIOP_READ16) ||
+        (pCdb->AsByte[0] == SCSIOP_WRITE16))
+    {
+        REVERSE_BYTES_QUAD(&startingSector, pCdb->CDB16.LogicalBlock);
+    }
+    else
+    {
+        startingSector.QuadPart = 0;
+        REVERSE_BYTES(&startingSector, &pCdb->CDB10.LogicalBlockByte0);
+    }
+
+    startingOffset.QuadPart = startingSector.QuadPart << pLUExt->BlockPower;
+
+    KdPrint2(("PhDskMnt::ImScsiDispatchWork starting sector: 0x%I64X\n", startingSector));
+
+    ULONG s_status = StoragePortGetSystemAddress(pHBAExt, pSrb, &sysaddress);
+
+    if ((s_status != STORAGE_STATUS_SUCCESS) || (sysaddress == NULL))
+    {
+        DbgPrint("PhDskMnt::ImScsiDispatchWork: StorPortGetSystemAddress failed: status=0x%X address=0x%p translated=0x%p\n",
+            s_status,
+            pSrb->DataBuffer,
+            sysaddress);
+
+        pSrb->SrbStatus = SRB_STATUS_ERROR;
+        pSrb->ScsiStatus = SCSISTAT_GOOD;
+
+        return;
+    }
+
+    /// Shared memory proxy always copies data between shared memory and
+    /// caller buffer itself, so an intermediate buffer would only add
+    /// another copy. Let proxy read and write system buffer directly.
+    zero_copy = pLUExt->UseProxy &&
+        (pLUExt->Proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM);
+
+    if (zero_copy)
+    {
+        buffer = sysaddress;
+    }
+    else
+    {
+        buffer = ImScsiAllocateBuffer(pSrb->DataTransferLength,
+            &pLUExt->Statistics);
+
+        if (buffer == NULL)
+        {
+            DbgPrint("PhDskMnt::ImScsiDispatchWork: Memory allocation failed.\n");
+
+            pSrb->SrbStatus = SRB_STATUS_ERROR;
+            pSrb->ScsiStatus = SCSISTAT_GOOD;
+
+            return;
+        }
+
+        InterlockedIncrement64(&pLUExt->Statistics.BounceBufferAllocations);
+    }
+
+    NTSTATUS status = STATUS_NOT_IMPLEMENTED;
+
+    /// For write operations, prepare temporary buffer
+    if (!zero_copy &&
+        ((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16)))
+    {
+        RtlMoveMemory(buffer, sysaddress, pSrb->DataTransferLength);
+
+        InterlockedExchangeAdd64(&pLUExt->Statistics.BounceBytesCopied,
+            pSrb->DataTransferLength);
+    }
+
     if ((pSrb->Cdb[0] == SCSIOP_READ) || (pSrb->Cdb[0] == SCSIOP_READ16))
     {
-        RtlMoveMemory(sysaddress, buffer, pSrb->DataTransferLength);
+        status = ImScsiReadDevice(pLUExt, buffer, &startingOffset, &pSrb->DataTransferLength);
+    }
+    else if ((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16))
+    {
+        status = ImScsiWriteDevice(pLUExt, buffer, &startingOffset, &pSrb->DataTransferLength);
+    }
+
+    ImScsiFinishReadWrite(pHBAExt, pLUExt, pSrb, status, buffer, sysaddress,
+        zero_copy, startingSector.QuadPart, numBlocks, cache_sequence,
+        &lowest_assumed_irql);
+}
+
+#ifdef USE_STORPORT
+
+/**************************************************************************************************/
+/*                                                                                                */
+/* Read and write requests for queued I/O image files are sent to the image file object without   */
+/* waiting for them, so that a worker thread keeps up to AsyncQueueDepth requests outstanding.    */
+/* Requests are sent at PASSIVE_LEVEL from worker thread, as file systems expect, and SRBs are    */
+/* completed from I/O completion routine.                                                         */
+/*                                                                                                */
+/**************************************************************************************************/
+
+static NTSTATUS
+ImScsiAsyncReadWriteCompletion(
+    PDEVICE_OBJECT DeviceObject,
+    PIRP Irp,
+    PVOID Context)
+{
+    __analysis_assume(Context != NULL);
+
+    pMP_WorkRtnParms pWkRtnParms = (pMP_WorkRtnParms)Context;
+    pHW_LU_EXTENSION pLUExt = pWkRtnParms->pLUExt;
+    PSCSI_REQUEST_BLOCK pSrb = pWkRtnParms->pSrb;
+    ULONG numBlocks = pSrb->DataTransferLength >> pLUExt->BlockPower;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    NTSTATUS status = Irp->IoStatus.Status;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    // Same as ImScsiReadDevice and ImScsiWriteDevice
+    if ((status == STATUS_END_OF_FILE) && !pWkRtnParms->IsWrite)
+    {
+        RtlZeroMemory(pWkRtnParms->AllocatedBuffer, pSrb->DataTransferLength);
+        status = STATUS_SUCCESS;
+    }
+    else if (NT_SUCCESS(status))
+    {
+        pSrb->DataTransferLength = (ULONG)Irp->IoStatus.Information;
+    }
+    else
+    {
+        pSrb->DataTransferLength = 0;
+    }
+
+    ImScsiFreeIrpWithMdls(Irp);
+
+    KdPrint2(("PhDskMnt::ImScsiAsyncReadWriteCompletion: pWkRtnParms=0x%p, status=0x%X, Length=0x%X\n",
+        pWkRtnParms, status, pSrb->DataTransferLength));
+
+    ImScsiFinishReadWrite(pWkRtnParms->pHBAExt, pLUExt, pSrb, status,
+        pWkRtnParms->AllocatedBuffer, pWkRtnParms->MappedSystemBuffer, FALSE,
+        pWkRtnParms->FirstSector, numBlocks, pWkRtnParms->ReadCacheSequence,
+        &lowest_assumed_irql);
+
+    ImScsiCompleteLUWork(pWkRtnParms);
+
+    // Last thing, LU can be cleaned up as soon as all requests are done
+    KeReleaseSemaphore(&pLUExt->AsyncRequestSemaphore, (KPRIORITY)0, 1, FALSE);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+///
+/// Sends a read or write request for an LU with asynchronous image file
+/// I/O to image file object, waiting only if AsyncQueueDepth requests are
+/// already outstanding. Returns FALSE without doing anything if request is
+/// to be dispatched as usual, in which case caller does that.
+///
+BOOLEAN
+ImScsiDispatchAsyncReadWrite(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in pMP_WorkRtnParms pWkRtnParms)
+{
+    PSCSI_REQUEST_BLOCK pSrb = pWkRtnParms->pSrb;
+    PCDB pCdb;
+    LARGE_INTEGER startingSector;
+    LARGE_INTEGER byteOffset;
+    BOOLEAN is_read;
+    PVOID buffer;
+    NTSTATUS status;
+
+    if ((pLUExt->AsyncQueueDepth == 0) ||
+        !ImScsiIsLUReadWrite(pLUExt, pWkRtnParms, &is_read) ||
+        (!is_read && ImScsiIsWriteReservationConflict(pLUExt)))
+    {
+        return FALSE;
+    }
+
+    if ((StoragePortGetSystemAddress(pWkRtnParms->pHBAExt, pSrb,
+        &pWkRtnParms->MappedSystemBuffer) != STORAGE_STATUS_SUCCESS) ||
+        (pWkRtnParms->MappedSystemBuffer == NULL))
+    {
+        return FALSE;
     }
 
-    if (pLUExt->SharedImage)
+    pCdb = (PCDB)pSrb->Cdb;
+
+    if ((pCdb->AsByte[0] == SCSIOP_READ16) ||
+        (pCdb->AsByte[0] == SCSIOP_WRITE16))
     {
-        ExFreePoolWithTag(buffer, MP_TAG_GENERAL);
+        REVERSE_BYTES_QUAD(&startingSector, pCdb->CDB16.LogicalBlock);
     }
     else
     {
-        ImScsiAcquireLock(&pLUExt->LastIoLock, &LockHandle, lowest_assumed_irql);
+        startingSector.QuadPart = 0;
+        REVERSE_BYTES(&startingSector, &pCdb->CDB10.LogicalBlockByte0);
+    }
+
+    byteOffset.QuadPart = startingSector.QuadPart << pLUExt->BlockPower;
+
+    // Zero blocks, and zero runs within partly zero writes, are deallocated
+    // with FSCTL_SET_ZERO_DATA by ImScsiWriteDevice
+    if (!is_read &&
+        ImScsiIsWriteZeroRange(pLUExt, pWkRtnParms->MappedSystemBuffer,
+            &byteOffset, pSrb->DataTransferLength))
+    {
+        return FALSE;
+    }
+
+    KeWaitForSingleObject(
+        &pLUExt->AsyncRequestSemaphore,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL);
+
+    buffer = ImScsiAllocateBuffer(pSrb->DataTransferLength,
+        &pLUExt->Statistics);
+
+    if (buffer == NULL)
+    {
+        KeReleaseSemaphore(&pLUExt->AsyncRequestSemaphore, (KPRIORITY)0, 1, FALSE);
 
-        if (pLUExt->LastIoBuffer != NULL)
-            ExFreePoolWithTag(pLUExt->LastIoBuffer, MP_TAG_GENERAL);
+        return FALSE;
+    }
+
+    InterlockedIncrement64(&pLUExt->Statistics.BounceBufferAllocations);
+
+    if (!is_read)
+    {
+        RtlMoveMemory(buffer, pWkRtnParms->MappedSystemBuffer,
+            pSrb->DataTransferLength);
 
-        pLUExt->LastIoStartSector = startingSector.QuadPart;
-        pLUExt->LastIoLength = pSrb->DataTransferLength;
-        pLUExt->LastIoBuffer = buffer;
+        InterlockedExchangeAdd64(&pLUExt->Statistics.BounceBytesCopied,
+            pSrb->DataTransferLength);
 
-        ImScsiReleaseLock(&LockHandle, &lowest_assumed_irql);
+        pLUExt->Modified = TRUE;
     }
 
-    ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+    byteOffset.QuadPart += pLUExt->ImageOffset.QuadPart;
+
+    pWkRtnParms->AllocatedBuffer = buffer;
+    pWkRtnParms->FirstSector = startingSector.QuadPart;
+    pWkRtnParms->IsWrite = !is_read;
+    pWkRtnParms->ReadCacheSequence = ImScsiReadCacheSequence(pLUExt);
+
+    KdPrint2(("PhDskMnt::ImScsiDispatchAsyncReadWrite: pWkRtnParms=0x%p, %s, Offset=0x%I64X, Length=0x%X\n",
+        pWkRtnParms, is_read ? "read" : "write", byteOffset.QuadPart,
+        pSrb->DataTransferLength));
+
+    status = ImScsiStartReadWriteFileObject(
+        pLUExt->WorkerFileObject,
+        is_read ? IRP_MJ_READ : IRP_MJ_WRITE,
+        buffer,
+        pSrb->DataTransferLength,
+        &byteOffset,
+        ImScsiAsyncReadWriteCompletion,
+        pWkRtnParms);
+
+    if (!NT_SUCCESS(status))
+    {
+        ImScsiFreeBuffer(buffer, pSrb->DataTransferLength);
+        pWkRtnParms->AllocatedBuffer = NULL;
+
+        KeReleaseSemaphore(&pLUExt->AsyncRequestSemaphore, (KPRIORITY)0, 1, FALSE);
+
+        return FALSE;
+    }
+
+    return TRUE;
 }
 
+#endif
+
 VOID
 ImScsiDispatchWork(
 __in pMP_WorkRtnParms        pWkRtnParms
@@ -501,6 +1484,26 @@ __in pMP_WorkRtnParms        pWkRtnParms
 
 }                                                     // End ImScsiDispatchWork().
 
+/// Data in unmapped ranges may read back as zeros or anything else, so it
+/// is dropped from read cache.
+static VOID
+ImScsiInvalidateUnmapRanges(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in PUNMAP_LIST_HEADER list,
+    __in USHORT items)
+{
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+
+    for (USHORT i = 0; i < items; i++)
+    {
+        LONGLONG startingSector = RtlUlonglongByteSwap(*(PULONGLONG)list->Descriptors[i].StartingLba);
+        ULONG numBlocks = RtlUlongByteSwap(*(PULONG)list->Descriptors[i].LbaCount);
+
+        ImScsiReadCacheInvalidate(pLUExt, startingSector, numBlocks,
+            &lowest_assumed_irql);
+    }
+}
+
 VOID
 ImScsiDispatchUnmapDevice(
     __in pHW_HBA_EXT pHBAExt,
@@ -525,6 +1528,8 @@ ImScsiDispatchUnmapDevice(
 
     NTSTATUS status = STATUS_SUCCESS;
 
+    ImScsiInvalidateUnmapRanges(pLUExt, list, items);
+
     IO_STATUS_BLOCK io_status;
 
     if (pLUExt->UseProxy)
@@ -667,6 +1672,9 @@ ImScsiDispatchUnmapDevice(
 
 done:
 
+    /// Reads sent while unmap was in progress could have cached old data
+    ImScsiInvalidateUnmapRanges(pLUExt, list, items);
+
     KdPrint(("PhDskMnt::ImScsiDispatchUnmap: Result: %#x\n", status));
 
     ScsiSetSuccess(pSrb, 0);
@@ -0,0 +1,122 @@
+/// zeroscan.cpp
+/// Selects zero detection code for write requests when driver starts.
+/// Scan routines are in inc/zeroscan.h.
+///
+/// Copyright (c) 2012-2019, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "phdskmnt.h"
+
+#ifndef PF_AVX2_INSTRUCTIONS_AVAILABLE
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#endif
+
+///
+/// SSE2 is always available on x64 and XMM registers can be used in kernel
+/// mode without saving state. AVX2 needs AVX state saved around each use,
+/// so it is only used for large buffers, and only after first page turns
+/// out to be zero, because buffers with data usually have it early on.
+///
+/// ExIsProcessorFeaturePresent reports AVX2 on Windows 10 and later only,
+/// older versions use SSE2. KeSaveExtendedProcessorState is looked up at
+/// run time, because it does not exist before Windows 7 SP1.
+///
+
+#if defined(IMSCSI_ZERO_SCAN_HAS_AVX2) && defined(XSTATE_MASK_AVX)
+#define IMSCSI_ZERO_SCAN_KERNEL_AVX2 1
+
+typedef NTSTATUS(NTAPI *PKE_SAVE_EXTENDED_PROCESSOR_STATE)(
+    __in ULONG64 Mask,
+    __out PXSTATE_SAVE XStateSave);
+
+typedef VOID(NTAPI *PKE_RESTORE_EXTENDED_PROCESSOR_STATE)(
+    __in PXSTATE_SAVE XStateSave);
+
+static PKE_SAVE_EXTENDED_PROCESSOR_STATE ImScsiSaveExtendedProcessorState;
+static PKE_RESTORE_EXTENDED_PROCESSOR_STATE ImScsiRestoreExtendedProcessorState;
+#endif
+
+static ULONG ImScsiZeroScanLevel = IMSCSI_ZERO_SCAN_SCALAR;
+
+VOID
+ImScsiInitializeZeroScan()
+{
+#ifdef IMSCSI_ZERO_SCAN_HAS_SSE2
+    ImScsiZeroScanLevel = IMSCSI_ZERO_SCAN_SSE2;
+#endif
+
+#ifdef IMSCSI_ZERO_SCAN_KERNEL_AVX2
+    if (ExIsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE))
+    {
+        UNICODE_STRING save_name;
+        UNICODE_STRING restore_name;
+
+        RtlInitUnicodeString(&save_name, L"KeSaveExtendedProcessorState");
+        RtlInitUnicodeString(&restore_name, L"KeRestoreExtendedProcessorState");
+
+        ImScsiSaveExtendedProcessorState = (PKE_SAVE_EXTENDED_PROCESSOR_STATE)
+            MmGetSystemRoutineAddress(&save_name);
+        ImScsiRestoreExtendedProcessorState = (PKE_RESTORE_EXTENDED_PROCESSOR_STATE)
+            MmGetSystemRoutineAddress(&restore_name);
+
+        if ((ImScsiSaveExtendedProcessorState != NULL) &&
+            (ImScsiRestoreExtendedProcessorState != NULL))
+        {
+            ImScsiZeroScanLevel = IMSCSI_ZERO_SCAN_AVX2;
+        }
+    }
+#endif
+
+    KdPrint(("PhDskMnt::ImScsiInitializeZeroScan: Zero scan level %u.\n",
+        ImScsiZeroScanLevel));
+}
+
+size_t
+ImScsiFindNonZero(
+    const void *Buffer,
+    size_t Length)
+{
+#ifdef IMSCSI_ZERO_SCAN_KERNEL_AVX2
+    if ((ImScsiZeroScanLevel == IMSCSI_ZERO_SCAN_AVX2) &&
+        (Length >= IMSCSI_ZERO_SCAN_AVX2_MIN_LENGTH))
+    {
+        XSTATE_SAVE state;
+        size_t offset = ImScsiFindNonZeroSse2(Buffer, PAGE_SIZE);
+
+        if (offset < PAGE_SIZE)
+        {
+            return offset;
+        }
+
+        if ((KeGetCurrentIrql() <= DISPATCH_LEVEL) &&
+            NT_SUCCESS(ImScsiSaveExtendedProcessorState(XSTATE_MASK_AVX,
+                &state)))
+        {
+            offset += ImScsiFindNonZeroAvx2((const UCHAR*)Buffer + offset,
+                Length - offset);
+
+            ImScsiRestoreExtendedProcessorState(&state);
+
+            return offset;
+        }
+
+        return offset + ImScsiFindNonZeroSse2((const UCHAR*)Buffer + offset,
+            Length - offset);
+    }
+#endif
+
+#ifdef IMSCSI_ZERO_SCAN_HAS_SSE2
+    if (ImScsiZeroScanLevel != IMSCSI_ZERO_SCAN_SCALAR)
+    {
+        return ImScsiFindNonZeroSse2(Buffer, Length);
+    }
+#endif
+
+    return ImScsiFindNonZeroScalar(Buffer, Length);
+}